@@ -0,0 +1,127 @@
+#!/bin/sh
+
+# Usage: bench.sh [-v] [-t <percent>] <baseline> <results...>
+#
+# Compare the "BENCH <suite> <test> key=value..." lines that the
+# bench-* targets collect against those in <baseline>.  A line's name
+# is everything but its measurements; a line in the results is matched
+# to the baseline line with the same name.  A cycle count that grew by
+# more than <percent> (default 10), or a fairness that fell by more
+# than that, is a regression, and bench.sh exits 1 if there are any.
+# -v prints the lines that are within the tolerance too.
+
+verbose=0
+tolerance=10
+
+while :
+do
+	case "x$1" in
+	x-v)
+		verbose=1
+		shift
+		;;
+	x-t)
+		tolerance=$2
+		shift
+		shift
+		;;
+	*)
+		break
+		;;
+	esac
+done
+
+if [ $# -lt 2 ]
+then
+	echo "usage: $0 [-v] [-t percent] baseline results..." >&2
+	exit 2
+fi
+
+baseline=$1
+shift
+if [ ! -f "$baseline" ]
+then
+	echo "$0: no baseline $baseline" >&2
+	exit 2
+fi
+
+awk -v tol="$tolerance" -v verbose=$verbose '
+# Measurements, and which way is better: 1 if lower, -1 if higher.
+# Any other key=value is part of the name.
+BEGIN {
+	split("cycles per_op median mean cycles_per_req latency min p50 p90 p99 max", lower, " ");
+	for (i in lower)
+		better[lower[i]] = 1;
+	better["fairness"] = -1;
+}
+
+FNR == 1 {
+	nfile++;
+}
+
+$1 != "BENCH" {
+	next;
+}
+
+{
+	name = "";
+	nm = 0;
+	for (i = 2; i <= NF; i++) {
+		key = $i;
+		sub(/=.*/, "", key);
+		if (key in better) {
+			val = $i;
+			sub(/^[^=]*=/, "", val);
+			mkey[++nm] = key;
+			mval[nm] = val;
+		} else
+			name = name (name == "" ? "" : " ") $i;
+	}
+}
+
+nfile == 1 {
+	for (i = 1; i <= nm; i++)
+		base[name, mkey[i]] = mval[i];
+	known[name] = 1;
+	next;
+}
+
+{
+	if (!(name in known)) {
+		printf("%s: not in the baseline\n", name);
+		nnew++;
+		next;
+	}
+	worst = "";
+	for (i = 1; i <= nm; i++) {
+		if (!((name, mkey[i]) in base))
+			continue;
+		old = base[name, mkey[i]];
+		new = mval[i];
+		# "fairness=-" and the like mean nothing was measured
+		if (old !~ /^[0-9.]+$/ || new !~ /^[0-9.]+$/ || old + 0 == 0)
+			continue;
+		change = (new - old) * 100 / old;
+		if (change * better[mkey[i]] > tol)
+			worst = worst sprintf(" %s %s -> %s (%+.1f%%)", mkey[i], old, new, change);
+	}
+	if (worst != "") {
+		printf("%s: REGRESSED%s\n", name, worst);
+		nbad++;
+	} else {
+		if (verbose)
+			printf("%s: OK\n", name);
+		nok++;
+	}
+	seen[name] = 1;
+}
+
+END {
+	for (name in known)
+		if (!(name in seen))
+			printf("%s: missing from the results\n", name);
+	printf("bench: %d ok, %d regressed, %d new (tolerance %s%%)\n",
+		nok, nbad, nnew, tol);
+	exit(nbad > 0);
+}
+' "$baseline" "$@"
@@ -30,15 +30,17 @@
  **********************************************************************/
 
 #define SECTSIZE	512
+#define MAXSECTS	256			// per read command
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
 
-static void readsect(void*, uint32_t);
+static void readsects(void*, uint32_t, uint32_t);
 static void readseg(uint32_t, uint32_t, uint32_t);
 
 void
 bootmain(void)
 {
 	struct Proghdr *ph, *eph;
+	uint32_t va, offset;
 
 	// read 1st page off disk
 	readseg((uint32_t) ELFHDR, SECTSIZE*8, 0);
@@ -47,11 +49,18 @@ bootmain(void)
 	if (ELFHDR->e_magic != ELF_MAGIC)
 		goto bad;
 
-	// load each program segment (ignores ph flags)
+	// load each program segment (ignores ph flags).  Segments that lie
+	// in memory as they do in the file go in one read, since the
+	// headers come in increasing address order.
 	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
 	eph = ph + ELFHDR->e_phnum;
-	for (; ph < eph; ph++)
-		readseg(ph->p_va, ph->p_memsz, ph->p_offset);
+	for (; ph < eph; ph++) {
+		va = ph->p_va;
+		offset = ph->p_offset;
+		while (ph + 1 < eph && ph[1].p_va - va == ph[1].p_offset - offset)
+			ph++;
+		readseg(va, ph->p_va + ph->p_memsz - va, offset);
+	}
 
 	// call the entry point from the ELF header
 	// note: does not return!
@@ -69,7 +78,7 @@ bad:
 void
 readseg(uint32_t va, uint32_t count, uint32_t offset)
 {
-	uint32_t end_va;
+	uint32_t end_va, n, k;
 
 	va &= 0xFFFFFF;
 	end_va = va + count;
@@ -80,13 +89,14 @@ readseg(uint32_t va, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
-	while (va < end_va) {
-		readsect((uint8_t*) va, offset);
-		va += SECTSIZE;
-		offset++;
+	// Read as many sectors at a time as the disk will.  We write more
+	// to memory than asked, but it doesn't matter -- we load in
+	// increasing order.
+	for (n = (end_va - va + SECTSIZE - 1) / SECTSIZE; n > 0; n -= k) {
+		k = n < MAXSECTS ? n : MAXSECTS;
+		readsects((uint8_t*) va, offset, k);
+		va += k * SECTSIZE;
+		offset += k;
 	}
 }
 
@@ -98,23 +108,25 @@ waitdisk(void)
 		/* do nothing */;
 }
 
+// Read 'n' sectors, at most MAXSECTS, starting at 'offset', with one command
 void
-readsect(void *dst, uint32_t offset)
+readsects(void *dst, uint32_t offset, uint32_t n)
 {
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);		// count = 1
+	outb(0x1F2, n);		// count = n, where 0 means 256
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
-
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+	// the disk has each sector ready in turn
+	for (; n > 0; n--) {
+		waitdisk();
+		insl(0x1F0, dst, SECTSIZE/4);
+		dst += SECTSIZE;
+	}
 }
 
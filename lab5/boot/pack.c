@@ -0,0 +1,164 @@
+/*
+ * Compress the kernel ELF for boot/unpack.c (see boot/pack.h):
+ *	pack kernel kernel.pack
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Prevent inc/types.h, included from inc/elf.h,
+// from attempting to redefine types defined in the host's inttypes.h.
+#define JOS_INC_TYPES_H
+
+#include <inc/elf.h>
+#include <boot/pack.h>
+
+#define HASHBITS	16
+#define MAXOFF		65535		// farthest back a match can start
+#define MFLIMIT		12		// no match starts closer to the end
+#define LASTLITERALS	5		// and none ends closer
+
+static void
+die(const char *msg)
+{
+	fprintf(stderr, "pack: %s\n", msg);
+	exit(1);
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint8_t *
+put_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+// One sequence: 'nlit' literals from 'lit', then, if 'mlen' isn't 0, a
+// match of 'mlen' bytes 'off' back.
+static uint8_t *
+put_seq(uint8_t *op, const uint8_t *lit, size_t nlit, size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - 4 : 0;
+
+	*op++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+	*op++ = off;
+	*op++ = off >> 8;
+	if (ml >= 15)
+		op = put_len(op, ml - 15);
+	return op;
+}
+
+// Compress 'n' bytes at 'in' to an LZ4 block at 'out', which has room
+// for n + n / 255 + 16 bytes, greedily: each position takes the last
+// one before it that started with the same four bytes, if that's near
+// enough.  Returns the compressed size.
+static size_t
+lz4_encode(const uint8_t *in, size_t n, uint8_t *out)
+{
+	static int32_t table[1 << HASHBITS];
+	size_t i = 0, anchor = 0, len;
+	uint8_t *op = out;
+	uint32_t h;
+	int32_t ref;
+
+	memset(table, 0xFF, sizeof(table));
+	while (i + MFLIMIT <= n) {
+		h = (read32(in + i) * 2654435761U) >> (32 - HASHBITS);
+		ref = table[h];
+		table[h] = i;
+		if (ref < 0 || i - ref > MAXOFF || read32(in + ref) != read32(in + i)) {
+			i++;
+			continue;
+		}
+		for (len = 4; i + len < n - LASTLITERALS && in[ref + len] == in[i + len]; len++)
+			/* extend the match */;
+		op = put_seq(op, in + anchor, i - anchor, i - ref, len);
+		i += len;
+		anchor = i;
+	}
+	op = put_seq(op, in + anchor, n - anchor, 0, 0);
+	return op - out;
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *f;
+	uint8_t *elf, **cdata;
+	long size;
+	struct Elf *eh;
+	struct Proghdr *ph;
+	struct Packhdr hdr;
+	struct Packseg *segs;
+	size_t insize = 0, outsize = 0;
+	int i;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: pack kernel packed\n");
+		exit(2);
+	}
+
+	if ((f = fopen(argv[1], "rb")) == NULL)
+		die("cannot open kernel");
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if ((elf = malloc(size)) == NULL || fread(elf, 1, size, f) != (size_t) size)
+		die("cannot read kernel");
+	fclose(f);
+
+	eh = (struct Elf *) elf;
+	if (size < (long) sizeof(*eh) || eh->e_magic != ELF_MAGIC
+	    || eh->e_phoff + eh->e_phnum * sizeof(*ph) > (size_t) size)
+		die("kernel is not an ELF image");
+	ph = (struct Proghdr *) (elf + eh->e_phoff);
+
+	hdr.ph_magic = PACK_MAGIC;
+	hdr.ph_entry = eh->e_entry;
+	hdr.ph_nseg = 0;
+	segs = calloc(eh->e_phnum, sizeof(*segs));
+	cdata = calloc(eh->e_phnum, sizeof(*cdata));
+	for (i = 0; i < eh->e_phnum; i++, ph++) {
+		if (ph->p_type != ELF_PROG_LOAD || ph->p_filesz == 0)
+			continue;
+		if (ph->p_offset + ph->p_filesz > (size_t) size)
+			die("segment runs past the end of the kernel");
+		cdata[hdr.ph_nseg] = malloc(ph->p_filesz + ph->p_filesz / 255 + 16);
+		segs[hdr.ph_nseg].ps_va = ph->p_va;
+		segs[hdr.ph_nseg].ps_size = ph->p_filesz;
+		segs[hdr.ph_nseg].ps_csize = lz4_encode(elf + ph->p_offset,
+			ph->p_filesz, cdata[hdr.ph_nseg]);
+		insize += ph->p_filesz;
+		outsize += segs[hdr.ph_nseg].ps_csize;
+		hdr.ph_nseg++;
+	}
+
+	if ((f = fopen(argv[2], "wb")) == NULL)
+		die("cannot create packed kernel");
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(segs, sizeof(*segs), hdr.ph_nseg, f);
+	for (i = 0; i < (int) hdr.ph_nseg; i++)
+		fwrite(cdata[i], 1, segs[i].ps_csize, f);
+	if (fclose(f) != 0)
+		die("cannot write packed kernel");
+	printf("pack: %zu bytes of kernel in %zu\n", insize, outsize);
+	return 0;
+}
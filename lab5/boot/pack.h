@@ -0,0 +1,24 @@
+#ifndef JOS_BOOT_PACK_H
+#define JOS_BOOT_PACK_H
+
+// A packed kernel, as boot/pack makes it from the kernel ELF and
+// boot/unpack.c puts it back: a Packhdr, ph_nseg Packsegs, and then
+// each segment's file contents, LZ4-compressed (the block format,
+// without frames), one after the other.  The bss isn't there; the
+// kernel clears its own.
+
+#define PACK_MAGIC	0x4b434150	// "PACK" in little endian
+
+struct Packhdr {
+	uint32_t ph_magic;
+	uint32_t ph_entry;		// the kernel's e_entry
+	uint32_t ph_nseg;
+};
+
+struct Packseg {
+	uint32_t ps_va;			// where the loader would put it
+	uint32_t ps_size;		// bytes it unpacks to
+	uint32_t ps_csize;		// bytes of compressed data
+};
+
+#endif	// !JOS_BOOT_PACK_H
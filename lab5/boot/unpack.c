@@ -0,0 +1,87 @@
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#include <boot/pack.h>
+
+/**********************************************************************
+ * The second boot stage for a packed kernel (see boot/pack.h).
+ *
+ * boot/main.c loads this program, with the packed kernel linked in
+ * behind it, as it would load the kernel itself, and calls unpack().
+ * That uncompresses each of the kernel's segments to the address the
+ * loader would have read it to, and jumps to the kernel.  We are
+ * linked at UNPACK_ADDR (see boot/Makefrag), above where the kernel
+ * goes, so unpacking it can't overwrite us.
+ **********************************************************************/
+
+extern uint8_t _binary_obj_kern_kernel_pack_start[];
+
+static void lz4_decode(uint8_t *dst, const uint8_t *src, uint32_t size);
+
+void
+unpack(void)
+{
+	struct Packhdr *ph = (struct Packhdr *) _binary_obj_kern_kernel_pack_start;
+	struct Packseg *ps = (struct Packseg *) (ph + 1);
+	uint8_t *data = (uint8_t *) (ps + ph->ph_nseg);
+	uint8_t *dst;
+	uint32_t i;
+
+	if (ph->ph_magic != PACK_MAGIC)
+		goto bad;
+
+	for (i = 0; i < ph->ph_nseg; i++, ps++) {
+		dst = (uint8_t *) (ps->ps_va & 0xFFFFFF);
+		if (dst + ps->ps_size > (uint8_t *) UNPACK_ADDR)
+			goto bad;
+		lz4_decode(dst, data, ps->ps_csize);
+		data += ps->ps_csize;
+	}
+
+	// call the entry point from the ELF header
+	// note: does not return!
+	((void (*)(void)) (ph->ph_entry & 0xFFFFFF))();
+
+bad:
+	outw(0x8A00, 0x8A00);
+	outw(0x8A00, 0x8E00);
+	while (1)
+		/* do nothing */;
+}
+
+// Uncompress the 'size' bytes of LZ4 block at 'src' to 'dst'.  Each
+// sequence is a token, whose high nibble counts the literals that
+// follow and whose low nibble plus 4 is the length of the match after
+// them, copied from a two-byte little-endian offset back.  A nibble of
+// 15 continues in the bytes after it, until one isn't 255.  The last
+// sequence is literals only.
+static uint32_t
+lz4_len(uint32_t len, const uint8_t **src)
+{
+	if (len == 15)
+		do
+			len += **src;
+		while (*(*src)++ == 255);
+	return len;
+}
+
+static void
+lz4_decode(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+	const uint8_t *end = src + size, *m;
+	uint32_t token, len;
+
+	while (src < end) {
+		token = *src++;
+		for (len = lz4_len(token >> 4, &src); len > 0; len--)
+			*dst++ = *src++;
+		if (src >= end)
+			break;
+		// the copy may overlap what it writes, so it goes a byte at
+		// a time, forwards
+		m = dst - (src[0] | (src[1] << 8));
+		src += 2;
+		for (len = lz4_len(token & 15, &src) + 4; len > 0; len--)
+			*dst++ = *m++;
+	}
+}
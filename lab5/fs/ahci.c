@@ -0,0 +1,429 @@
+/*
+ * A SATA disk on an AHCI controller.
+ *
+ * The controller takes up to 32 commands per port at once, one in each
+ * slot of the port's command list; a slot's command table holds the
+ * FIS to send the disk and a PRD for each physically contiguous piece of
+ * the buffer, so a run of block cache pages goes in one command.  Each
+ * fiber's request takes a free slot and sleeps until the port's
+ * interrupt says its command is done.  If the controller and disk can do
+ * native command queueing, commands are READ/WRITE FPDMA QUEUED, which
+ * the disk may work on together and finish in whatever order suits it;
+ * otherwise they're READ/WRITE DMA EXT, which the controller sends one
+ * after another.
+ *
+ * The registers are device memory, which we can't map, so every access
+ * is a system call (sys_ahci_read and sys_ahci_write); the command list,
+ * FISes and command tables are in our memory, for the controller to
+ * reach by DMA.  The interrupt is a PCI one, masked by the kernel until
+ * we have cleared it at the port and listen again (see irq_signal_pci).
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+// HBA registers
+#define HBA_CAP		0x00
+#define HBA_GHC		0x04
+#define HBA_IS		0x08
+#define HBA_PI		0x0C	// ports implemented
+
+#define CAP_SNCQ	(1 << 30)
+#define CAP_NCS(cap)	((((cap) >> 8) & 0x1F) + 1)	// slots per port
+#define GHC_AE		(1U << 31)	// AHCI enable
+#define GHC_IE		(1 << 1)
+
+// Registers of port 'ahci_port'
+#define PORT(reg)	(0x100 + ahci_port * 0x80 + (reg))
+#define PxCLB		0x00
+#define PxCLBU		0x04
+#define PxFB		0x08
+#define PxFBU		0x0C
+#define PxIS		0x10
+#define PxIE		0x14
+#define PxCMD		0x18
+#define PxTFD		0x20
+#define PxSIG		0x24
+#define PxSSTS		0x28
+#define PxSERR		0x30
+#define PxSACT		0x34
+#define PxCI		0x38
+
+#define PxCMD_ST	(1 << 0)
+#define PxCMD_FRE	(1 << 4)
+#define PxCMD_FR	(1 << 14)
+#define PxCMD_CR	(1 << 15)
+
+#define PxIS_DHRS	(1 << 0)	// D2H register FIS
+#define PxIS_SDBS	(1 << 3)	// set device bits FIS, for NCQ
+#define PxIS_DPS	(1 << 5)	// a PRD with its I bit done
+#define PxIS_ERRORS	((1 << 30) | (1 << 29) | (1 << 28) | (1 << 27))
+
+#define SSTS_DET_PRESENT	3
+#define SIG_ATA		0x00000101
+
+// ATA commands
+#define ATA_IDENTIFY		0xEC
+#define ATA_READ_DMA_EXT	0x25
+#define ATA_WRITE_DMA_EXT	0x35
+#define ATA_READ_FPDMA		0x60
+#define ATA_WRITE_FPDMA		0x61
+
+#define AHCI_NSLOT	32
+
+// A command list entry
+struct AhciCmdHdr {
+	uint16_t ch_flags;	// FIS length in dwords, and AHCI_CH_WRITE
+	uint16_t ch_prdtl;	// PRDs in the table
+	volatile uint32_t ch_prdbc;	// bytes moved
+	uint32_t ch_ctba;	// the command table, 128-byte aligned
+	uint32_t ch_ctbau;
+	uint32_t ch_rsv[4];
+};
+
+#define AHCI_CH_WRITE	(1 << 6)
+
+struct AhciPrd {
+	uint32_t prd_dba;	// physical address
+	uint32_t prd_dbau;
+	uint32_t prd_rsv;
+	uint32_t prd_dbc;	// bytes - 1, up to 4MB
+};
+
+// A command table, with as many PRDs as fit in 1KB: enough for 256
+// sectors in pages that aren't adjacent
+#define AHCI_NPRD	56
+
+struct AhciCmdTable {
+	uint8_t ct_cfis[64];	// the FIS for the disk
+	uint8_t ct_acmd[16];
+	uint8_t ct_rsv[48];
+	struct AhciPrd ct_prdt[AHCI_NPRD];
+};
+
+// The port's command list and received FISes, then its command tables
+static struct {
+	struct AhciCmdHdr pm_cl[AHCI_NSLOT];
+	uint8_t pm_rfis[256];
+} ahci_mem __attribute__((aligned(PGSIZE)));
+static struct AhciCmdTable ahci_ctab[AHCI_NSLOT] __attribute__((aligned(PGSIZE)));
+static uint16_t ahci_ident[256] __attribute__((aligned(PGSIZE)));
+
+static int ahci_port = -1;	// the port our disk is on
+static int ahci_irq;		// the controller's PCI interrupt line
+static bool use_irq;		// sleep on the interrupt instead of polling
+static bool use_ncq;		// queue commands with READ/WRITE FPDMA
+static int ahci_nslot;		// slots we use
+static uint32_t slot_busy;	// slots a request has
+static uint32_t slot_issued;	// slots the controller has a command in
+static uint32_t slot_done;	// slots whose command finished
+static uint32_t slot_failed;	// ... with an error
+static struct FiberQ ahci_slotq;	// fibers waiting for a slot
+static struct FiberQ ahci_doneq;	// fibers waiting for their commands
+
+static uint32_t
+hba_read(uint32_t off)
+{
+	uint32_t v;
+	int r;
+
+	if ((r = sys_ahci_read(off, &v)) < 0)
+		panic("ahci: sys_ahci_read(0x%x): %e", off, r);
+	return v;
+}
+
+static void
+hba_write(uint32_t off, uint32_t v)
+{
+	int r;
+
+	if ((r = sys_ahci_write(off, v)) < 0)
+		panic("ahci: sys_ahci_write(0x%x): %e", off, r);
+}
+
+// Is there an AHCI controller whose registers the kernel mapped for us?
+bool
+ahci_probe(void)
+{
+	int dev, func;
+	uint32_t v;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(0, dev, func, 0x00) & 0xFFFF) == 0xFFFF)
+				continue;
+			// class 1 (storage), subclass 6 (SATA), prog-if 1 (AHCI)
+			if ((pci_conf_read(0, dev, func, 0x08) >> 8) != 0x010601)
+				continue;
+			ahci_irq = pci_conf_read(0, dev, func, 0x3C) & 0xFF;
+			return sys_ahci_read(HBA_CAP, &v) == 0;
+		}
+	return 0;
+}
+
+static void
+ahci_port_stop(void)
+{
+	hba_write(PORT(PxCMD), hba_read(PORT(PxCMD)) & ~(PxCMD_ST | PxCMD_FRE));
+	while (hba_read(PORT(PxCMD)) & (PxCMD_CR | PxCMD_FR))
+		sys_yield();
+}
+
+static void
+ahci_port_start(void)
+{
+	hba_write(PORT(PxCMD), hba_read(PORT(PxCMD)) | PxCMD_FRE);
+	hba_write(PORT(PxCMD), hba_read(PORT(PxCMD)) | PxCMD_ST);
+}
+
+// The port reported an error.  Restarting it is the simplest recovery,
+// but throws away every command it had, so they all fail; since we
+// can't tell which queued command the disk failed, that's what the
+// callers get anyway.
+static void
+ahci_recover(void)
+{
+	cprintf("ahci: port %d error, task file %08x, SERR %08x\n", ahci_port,
+		hba_read(PORT(PxTFD)), hba_read(PORT(PxSERR)));
+	ahci_port_stop();
+	hba_write(PORT(PxSERR), 0xFFFFFFFF);
+	hba_write(PORT(PxIS), 0xFFFFFFFF);
+	ahci_port_start();
+	slot_failed |= slot_issued;
+	slot_done |= slot_issued;
+	slot_issued = 0;
+}
+
+// Note which commands the controller has finished.
+static void
+ahci_collect(void)
+{
+	uint32_t is, active;
+
+	// Clear the interrupt before looking, so that a command finishing
+	// after we look raises another
+	is = hba_read(PORT(PxIS));
+	hba_write(PORT(PxIS), is);
+	hba_write(HBA_IS, 1 << ahci_port);
+	if (is & PxIS_ERRORS) {
+		ahci_recover();
+		return;
+	}
+	active = hba_read(PORT(PxCI));
+	if (use_ncq)
+		active |= hba_read(PORT(PxSACT));
+	slot_done |= slot_issued & ~active;
+	slot_issued &= active;
+}
+
+// The server's main loop got our IRQ.
+static void
+ahci_intr(void)
+{
+	ahci_collect();
+	fiber_wakeup(&ahci_doneq);
+	if (sys_irq_listen(ahci_irq) < 0)
+		use_irq = 0;
+}
+
+// Run ATA command 'cmd' on nsecs sectors from secno, moving them to or
+// from buf.
+static int
+ahci_cmd(uint8_t cmd, uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	struct AhciCmdHdr *h;
+	struct AhciCmdTable *t;
+	uintptr_t va = (uintptr_t) buf;
+	size_t len = nsecs * SECTSIZE;
+	physaddr_t pa;
+	uint32_t m, bit;
+	bool fpdma = cmd == ATA_READ_FPDMA || cmd == ATA_WRITE_FPDMA;
+	int slot, n, e;
+
+	assert(nsecs <= 256);
+	for (;;) {
+		for (slot = 0; slot < ahci_nslot && (slot_busy & (1 << slot)); slot++)
+			;
+		if (slot < ahci_nslot)
+			break;
+		if (fiber_self() < 0)
+			panic("ahci_cmd: out of slots");
+		fiber_sleep(&ahci_slotq);
+	}
+	bit = 1 << slot;
+	h = &ahci_mem.pm_cl[slot];
+	t = &ahci_ctab[slot];
+
+	// PRDs, merging pages that happen to be physically adjacent
+	for (n = 0; len > 0; va += m, len -= m) {
+		if (!(vpd[PDX(va)] & PTE_P) || !(vpt[VPN(va)] & PTE_P))
+			return -E_INVAL;
+		pa = va2pa((void *) va);
+		m = MIN(len, PGSIZE - PGOFF(va));
+		if (n > 0 && t->ct_prdt[n-1].prd_dba + t->ct_prdt[n-1].prd_dbc + 1 == pa)
+			t->ct_prdt[n-1].prd_dbc += m;
+		else {
+			if (n == AHCI_NPRD)
+				return -E_INVAL;
+			t->ct_prdt[n].prd_dba = pa;
+			t->ct_prdt[n].prd_dbau = 0;
+			t->ct_prdt[n].prd_dbc = m - 1;
+			n++;
+		}
+	}
+
+	// A register FIS, host to device
+	memset(t->ct_cfis, 0, sizeof(t->ct_cfis));
+	t->ct_cfis[0] = 0x27;
+	t->ct_cfis[1] = 0x80;		// a command
+	t->ct_cfis[2] = cmd;
+	t->ct_cfis[4] = secno & 0xFF;
+	t->ct_cfis[5] = (secno >> 8) & 0xFF;
+	t->ct_cfis[6] = (secno >> 16) & 0xFF;
+	t->ct_cfis[7] = cmd == ATA_IDENTIFY ? 0 : 0x40;	// LBA
+	t->ct_cfis[8] = (secno >> 24) & 0xFF;
+	if (fpdma) {
+		// the count is in the features; the tag is the slot
+		t->ct_cfis[3] = nsecs & 0xFF;
+		t->ct_cfis[11] = (nsecs >> 8) & 0xFF;
+		t->ct_cfis[12] = slot << 3;
+	} else if (cmd != ATA_IDENTIFY) {
+		t->ct_cfis[12] = nsecs & 0xFF;
+		t->ct_cfis[13] = (nsecs >> 8) & 0xFF;
+	}
+
+	h->ch_flags = 5 | (write ? AHCI_CH_WRITE : 0);	// 5 dwords of FIS
+	h->ch_prdtl = n;
+	h->ch_prdbc = 0;
+	h->ch_ctba = va2pa(t);
+	h->ch_ctbau = 0;
+
+	slot_busy |= bit;
+	slot_issued |= bit;
+	mb();
+	if (fpdma)
+		hba_write(PORT(PxSACT), bit);
+	hba_write(PORT(PxCI), bit);
+
+	while (!(slot_done & bit)) {
+		if (use_irq && fiber_self() >= 0) {
+			fiber_sleep(&ahci_doneq);
+			continue;
+		}
+		ahci_collect();
+		if (slot_done & bit)
+			break;
+		if (!use_irq)
+			sys_yield();
+		else if ((e = sys_irq_wait(ahci_irq)) < 0) {
+			cprintf("ahci: sys_irq_wait: %e; polling instead\n", e);
+			use_irq = 0;
+		}
+	}
+
+	e = (slot_failed & bit) ? -E_UNSPECIFIED : 0;
+	slot_done &= ~bit;
+	slot_failed &= ~bit;
+	slot_busy &= ~bit;
+	fiber_wakeup(&ahci_slotq);
+	return e;
+}
+
+static int
+ahci_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	if (nsecs == 0)
+		return 0;
+	return ahci_cmd(use_ncq ? ATA_READ_FPDMA : ATA_READ_DMA_EXT,
+			secno, dst, nsecs, 0);
+}
+
+static int
+ahci_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	if (nsecs == 0)
+		return 0;
+	return ahci_cmd(use_ncq ? ATA_WRITE_FPDMA : ATA_WRITE_DMA_EXT,
+			secno, (void *) src, nsecs, 1);
+}
+
+// Find the disk -- the second one, if there are two, as ide_init
+// does -- and set up its port.
+static int
+ahci_init(void)
+{
+	uint32_t cap, pi, p;
+	uintptr_t va;
+	int r;
+
+	if (!ahci_probe())
+		return -E_NOT_FOUND;
+	hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_AE);
+	cap = hba_read(HBA_CAP);
+	pi = hba_read(HBA_PI);
+	for (p = 0; p < 32; p++) {
+		if (!(pi & (1 << p)))
+			continue;
+		if ((hba_read(0x100 + p * 0x80 + PxSSTS) & 0xF) != SSTS_DET_PRESENT
+		    || hba_read(0x100 + p * 0x80 + PxSIG) != SIG_ATA)
+			continue;
+		if (ahci_port >= 0) {
+			ahci_port = p;
+			break;
+		}
+		ahci_port = p;
+	}
+	if (ahci_port < 0)
+		return -E_NOT_FOUND;
+
+	// Pages of our own for the controller to DMA to, not the
+	// zero page a fresh bss page starts as
+	for (va = (uintptr_t) &ahci_mem; va < (uintptr_t) (&ahci_mem + 1); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	for (va = (uintptr_t) ahci_ctab; va < (uintptr_t) (ahci_ctab + AHCI_NSLOT); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	if ((r = sys_page_alloc(0, ahci_ident, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+
+	ahci_port_stop();
+	hba_write(PORT(PxCLB), va2pa(ahci_mem.pm_cl));
+	hba_write(PORT(PxCLBU), 0);
+	hba_write(PORT(PxFB), va2pa(ahci_mem.pm_rfis));
+	hba_write(PORT(PxFBU), 0);
+	hba_write(PORT(PxSERR), 0xFFFFFFFF);
+	hba_write(PORT(PxIS), 0xFFFFFFFF);
+	ahci_port_start();
+
+	ahci_nslot = CAP_NCS(cap);
+	if ((r = ahci_cmd(ATA_IDENTIFY, 0, ahci_ident, 1, 0)) < 0)
+		return r;
+	// Word 76 bit 8: NCQ; word 75: the queue depth, less one
+	use_ncq = (cap & CAP_SNCQ) && (ahci_ident[76] & (1 << 8));
+	if (use_ncq)
+		ahci_nslot = MIN(ahci_nslot, (ahci_ident[75] & 0x1F) + 1);
+
+	if (IDE_IRQ && ahci_irq > 0 && ahci_irq < 16) {
+		if ((r = sys_irq_listen(ahci_irq)) < 0)
+			cprintf("ahci: sys_irq_listen(%d): %e; polling\n", ahci_irq, r);
+		else {
+			hba_write(PORT(PxIE), PxIS_DHRS | PxIS_SDBS | PxIS_DPS | PxIS_ERRORS);
+			hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_IE);
+			use_irq = 1;
+			bdev_ahci.bd_irq = ahci_irq;
+		}
+	}
+	cprintf("AHCI disk on port %d: %d slots%s\n", ahci_port, ahci_nslot,
+		use_ncq ? ", NCQ" : "");
+	return 0;
+}
+
+struct Bdev bdev_ahci = {
+	.bd_name =	"ahci",
+	.bd_init =	ahci_init,
+	.bd_read =	ahci_read,
+	.bd_write =	ahci_write,
+	.bd_irq =	-1,
+	.bd_intr =	ahci_intr
+};
@@ -1,19 +1,42 @@
+#include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/lz.h>
 
 #include "fs.h"
 
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+static bool fs_extents;		// version 2 layout: files have extents
+static bool fs_journal;		// metadata goes through the journal
 
 void file_flush(struct File *f);
+static int alloc_block_near(struct File *f, uint32_t near);
 bool block_is_free(uint32_t blockno);
-
-// Return the virtual address of this disk block.
+void write_block(uint32_t blockno);
+static bool bc_reading(uint32_t blockno);
+static int read_block_packed(uint32_t blockno, char **blk, uint32_t packed);
+static int block_inflate(uint32_t blockno, char *addr, uint32_t size);
+static void bitmap_flush(void);
+static void dcache_drop_page(void *va);
+
+// Pages of the DISKMAP window no block from past it shares: those of the
+// superblock, bitmap and journal, rounded up to a multiple of BC_NHASH
+static uint32_t diskmap_fixed;
+
+// Return the virtual address of this disk block.  Block n has page n of
+// the DISKMAP window; on a disk bigger than the window, the blocks past
+// it wrap round the pages from diskmap_fixed on, which they share with
+// the blocks there and each other.  A page is in the same bc_hash chain
+// as every block that may have it, and holds one of them at a time (see
+// bc_touch).
 char*
 diskaddr(uint32_t blockno)
 {
 	if (super && blockno >= super->s_nblocks)
 		panic("bad block number %08x in diskaddr", blockno);
+	if (blockno >= DISKMAP_NBLOCKS)
+		blockno = diskmap_fixed + (blockno - DISKMAP_NBLOCKS)
+			% (DISKMAP_NBLOCKS - diskmap_fixed);
 	return (char*) (DISKMAP + blockno * BLKSIZE);
 }
 
@@ -29,7 +52,7 @@ bool
 block_is_mapped(uint32_t blockno)
 {
 	char *va = diskaddr(blockno);
-	return va_is_mapped(va) && va != 0;
+	return va_is_mapped(va) && va != 0 && diskblock(va) == blockno;
 }
 
 // Is this virtual address dirty?
@@ -39,21 +62,496 @@ va_is_dirty(void *va)
 	return (vpt[VPN(va)] & PTE_D) != 0;
 }
 
-// Is this block dirty?
+// Is this block dirty?  A block still being read in isn't, even though
+// PIO reads set PTE_D.
 bool
 block_is_dirty(uint32_t blockno)
 {
 	char *va = diskaddr(blockno);
-	return va_is_mapped(va) && va_is_dirty(va);
+	return block_is_mapped(blockno) && va_is_dirty(va) && !bc_reading(blockno);
+}
+
+// Is this one of the bitmap blocks?
+static bool
+block_is_bitmap(uint32_t blockno)
+{
+	return super && blockno >= 2
+		&& blockno < 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+}
+
+// Block cache.
+//
+// At most BCACHE_NBLOCKS disk blocks are mapped at once.  Mapping one
+// more evicts a victim chosen by CLOCK: the hand sweeps the slots, giving
+// blocks whose PTE_A bit is set (which the hardware sets on any access
+// through our mapping) a second chance and clearing the bit as it goes.
+// A dirty victim is written back with write_block first.
+//
+// Some blocks must stay put because we hold pointers into them: the
+// superblock and the bitmap, the blocks holding open files' struct
+// File (and their directory's), pinned with bc_pin, and every block
+// used by a request still being served, since callers such as
+// file_block_walk keep pointers across further block reads.  serve()
+// starts each request with bc_new_epoch() and tells us with
+// bc_set_oldest() the epoch of the oldest request still around; blocks
+// used since then stay.  Blocks a client still has mapped (pageref > 1)
+// are left alone, too.
+//
+// Requests run in fibers that sleep while the disk works, so a block
+// can be in the cache without its contents being there yet: b_io says
+// it is being read in, and anyone else who wants it sleeps on bc_ioq
+// until it is.  Blocks being read or written are not evicted, since the
+// disk is moving data to or from their pages.
+//
+// Slots whose blocks may be dirty are kept on the dirty list, so that
+// fs_flush only has to look at those.  serve_dirty puts clients' blocks
+// there through file_dirty; our own stores into block pages only show
+// in PTE_D, which bc_harvest gathers from the cache's slots.  A slot
+// stays listed when its block goes, so the list is only ever a superset
+// of the dirty blocks, and never longer than the cache.
+//
+// Metadata blocks in the open transaction are pinned, and are written
+// only through the journal.
+//
+// Worker threads (see serv.c) look blocks up at the same time as the
+// main thread's fibers use the cache.  The hash chains, and each slot's
+// b_epoch and b_pins, change only under bc_lock, and a worker reads them
+// only under it; the main thread, the only one to change the chains,
+// reads them without.  A worker takes only blocks that are cached and
+// read in already (bc_peek): it never evicts, reads from the disk or
+// sleeps.  Evicting rechecks under the lock that nobody has just used
+// the block before unmapping it.
+
+struct BufSlot {
+	uint32_t b_blockno;	// block held, or BC_EMPTY
+	uint32_t b_epoch;	// bc_epoch when last used
+	int b_pins;		// bc_pin count
+	int b_io;		// BC_IO_READ or BC_IO_WRITE while the disk works
+	int b_next;		// next slot in hash chain, or -1
+	bool b_listed;		// on the dirty list
+	int b_dnext;		// next slot on the dirty list, or -1
+	bool b_txn;		// in the open transaction (see journal_commit)
+};
+
+#define BC_IO_READ	1
+#define BC_IO_WRITE	2
+
+#define BC_EMPTY	0xFFFFFFFF
+#define BC_NHASH	128
+#define BC_HASH(blockno)	((blockno) % BC_NHASH)
+
+static struct BufSlot bcache[BCACHE_NBLOCKS];
+static int bc_hash[BC_NHASH];
+static int bc_hand;
+static uint32_t bc_epoch;
+static uint32_t bc_oldest;
+static struct FiberQ bc_ioq;	// fibers waiting for blocks being read in
+static int bc_dirty = -1;	// first slot on the dirty list
+static struct Mutex bc_lock;
+
+void
+bc_init(void)
+{
+	int i;
+
+	for (i = 0; i < BCACHE_NBLOCKS; i++) {
+		bcache[i].b_blockno = BC_EMPTY;
+		bcache[i].b_next = -1;
+		bcache[i].b_dnext = -1;
+	}
+	for (i = 0; i < BC_NHASH; i++)
+		bc_hash[i] = -1;
+}
+
+// Start a new request, returning its epoch.
+uint32_t
+bc_new_epoch(void)
+{
+	return ++bc_epoch;
+}
+
+// Every request from before 'epoch' is done: blocks last used before
+// then may be evicted again.
+void
+bc_set_oldest(uint32_t epoch)
+{
+	bc_oldest = epoch;
+}
+
+// Find the slot holding blockno, or -1.
+static int
+bc_lookup(uint32_t blockno)
+{
+	int i;
+
+	for (i = bc_hash[BC_HASH(blockno)]; i != -1; i = bcache[i].b_next)
+		if (bcache[i].b_blockno == blockno)
+			return i;
+	return -1;
+}
+
+// Find the slot of a block other than blockno that may have its page,
+// or -1.  There is none unless the disk is bigger than DISKMAP.
+static int
+bc_alias(uint32_t blockno)
+{
+	char *va = diskaddr(blockno);
+	int i;
+
+	if (super == 0 || super->s_nblocks <= DISKMAP_NBLOCKS)
+		return -1;
+	for (i = bc_hash[BC_HASH(blockno)]; i != -1; i = bcache[i].b_next)
+		if (bcache[i].b_blockno != blockno && diskaddr(bcache[i].b_blockno) == va)
+			return i;
+	return -1;
+}
+
+// Return the number of the block whose page holds va, in DISKMAP.
+uint32_t
+diskblock(void *va)
+{
+	uint32_t page = ((uintptr_t) va - DISKMAP) / BLKSIZE;
+	int i;
+
+	if (super && super->s_nblocks > DISKMAP_NBLOCKS && page >= diskmap_fixed)
+		for (i = bc_hash[BC_HASH(page)]; i != -1; i = bcache[i].b_next)
+			if (diskaddr(bcache[i].b_blockno) == ROUNDDOWN((char *) va, BLKSIZE))
+				return bcache[i].b_blockno;
+	return page;
+}
+
+// Empty slot i.  Called with bc_lock held.
+static void
+bc_remove(int i)
+{
+	int *pp;
+
+	// Another block may take the page now: pointers into it go stale
+	if (bcache[i].b_blockno >= DISKMAP_NBLOCKS)
+		dcache_drop_page(diskaddr(bcache[i].b_blockno));
+	for (pp = &bc_hash[BC_HASH(bcache[i].b_blockno)]; *pp != i; pp = &bcache[*pp].b_next)
+		;
+	*pp = bcache[i].b_next;
+	bcache[i].b_blockno = BC_EMPTY;
+	bcache[i].b_next = -1;
+	bcache[i].b_pins = 0;
+	bcache[i].b_io = 0;
+	bcache[i].b_txn = 0;
+}
+
+// Is the block being read in?
+static bool
+bc_reading(uint32_t blockno)
+{
+	int i;
+
+	return (i = bc_lookup(blockno)) >= 0 && bcache[i].b_io == BC_IO_READ;
+}
+
+// Is the block in the open transaction?
+static bool
+bc_in_txn(uint32_t blockno)
+{
+	int i;
+
+	return (i = bc_lookup(blockno)) >= 0 && bcache[i].b_txn;
+}
+
+// Note that the disk is moving the block in slot i (io != 0), or is done
+// with it (io == 0).
+static void
+bc_set_io(uint32_t blockno, int io)
+{
+	int i;
+
+	if ((i = bc_lookup(blockno)) < 0)
+		return;
+	if (bcache[i].b_io == BC_IO_READ && io == 0)
+		fiber_wakeup(&bc_ioq);
+	bcache[i].b_io = io;
+}
+
+// May the block in slot i be evicted?
+static bool
+bc_evictable(int i)
+{
+	struct BufSlot *b = &bcache[i];
+
+	if (super == 0 || b->b_pins > 0 || b->b_io != 0 || b->b_epoch >= bc_oldest)
+		return 0;
+	// superblock and bitmap
+	if (b->b_blockno < 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE)
+		return 0;
+	return pageref(diskaddr(b->b_blockno)) <= 1;
+}
+
+// Evict the block in slot i, which bc_evictable lets go, writing it
+// back first if it's dirty.  Returns i, or -E_NO_MEM if the block was
+// used while it was written and so stays.
+static int
+bc_evict_slot(int i)
+{
+	uint32_t blockno = bcache[i].b_blockno;
+	char *va = diskaddr(blockno);
+	int r;
+
+	if (block_is_dirty(blockno) && !block_is_free(blockno)) {
+		// Others run while we write it: if they used the block
+		// meanwhile, it stays
+		write_block(blockno);
+		if (bcache[i].b_blockno != blockno || !bc_evictable(i)
+		    || (vpt[VPN(va)] & (PTE_A|PTE_D)))
+			return -E_NO_MEM;
+	}
+	// A worker may have taken it since we looked
+	mutex_lock(&bc_lock);
+	if (!bc_evictable(i)) {
+		mutex_unlock(&bc_lock);
+		return -E_NO_MEM;
+	}
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("bc_evict: sys_page_unmap: %e", r);
+	bc_remove(i);
+	mutex_unlock(&bc_lock);
+	return i;
+}
+
+// Free up a slot by evicting a block, returning the slot or -E_NO_MEM
+// if everything is in use.
+static int
+bc_evict(void)
+{
+	int i, n, r;
+	uint32_t blockno;
+	char *va;
+
+	// Two full sweeps: the first may only clear accessed bits
+	for (n = 0; n < 2 * BCACHE_NBLOCKS + 1; n++) {
+		i = bc_hand;
+		bc_hand = (bc_hand + 1) % BCACHE_NBLOCKS;
+		blockno = bcache[i].b_blockno;
+		if (blockno == BC_EMPTY)
+			return i;
+		va = diskaddr(blockno);
+		if (!va_is_mapped(va)) {
+			mutex_lock(&bc_lock);
+			bc_remove(i);
+			mutex_unlock(&bc_lock);
+			return i;
+		}
+		if (!bc_evictable(i))
+			continue;
+		if (vpt[VPN(va)] & PTE_A) {
+			// Second chance.  Remapping clears PTE_D as well as
+			// PTE_A, so write dirty blocks back now.
+			if (block_is_dirty(blockno) && !block_is_free(blockno))
+				write_block(blockno);
+			else if ((r = sys_page_map(0, va, 0, va, vpt[VPN(va)] & PTE_USER)) < 0)
+				panic("bc_evict: sys_page_map: %e", r);
+			continue;
+		}
+		if ((r = bc_evict_slot(i)) >= 0)
+			return r;
+	}
+	// Clients' file caches may be what holds the blocks (serv.c)
+	lease_revoke();
+	return -E_NO_MEM;
+}
+
+// Write everything back, then empty every slot whose block may be
+// evicted, so that the blocks are read from the disk again when next
+// used: for measuring cold-cache performance.  Returns how many blocks
+// went.
+int
+bc_drop_all(void)
+{
+	int i, r, n = 0;
+	uint32_t blockno;
+	char *va;
+	struct SyscallBatch b = BATCH_INIT;
+
+	fs_sync();
+	for (i = 0; i < BCACHE_NBLOCKS; i++) {
+		blockno = bcache[i].b_blockno;
+		if (blockno == BC_EMPTY || !bc_evictable(i))
+			continue;
+		va = diskaddr(blockno);
+		if (va_is_mapped(va)) {
+			// Dirtied since the sync, by a request that ran
+			// while it wrote
+			if (block_is_dirty(blockno) && !block_is_free(blockno))
+				continue;
+			// Nothing runs before the flush that could map it again
+			if ((r = batch_page_unmap(&b, 0, va)) < 0)
+				panic("bc_drop_all: sys_page_unmap: %e", r);
+		}
+		mutex_lock(&bc_lock);
+		bc_remove(i);
+		mutex_unlock(&bc_lock);
+		n++;
+	}
+	if ((r = batch_flush(&b)) < 0)
+		panic("bc_drop_all: sys_page_unmap: %e", r);
+	return n;
+}
+
+// Note that blockno is about to be mapped or was just used, finding it
+// a slot if it hasn't got one.  Returns 0 or -E_NO_MEM.
+static int
+bc_touch(uint32_t blockno)
+{
+	int i, r;
+
+	while ((i = bc_lookup(blockno)) < 0) {
+		// A block sharing blockno's page has to give it up
+		if ((r = bc_alias(blockno)) >= 0) {
+			if (!bc_evictable(r) || (i = bc_evict_slot(r)) < 0)
+				return -E_NO_MEM;
+		} else if ((i = bc_evict()) < 0)
+			return i;
+		// Evicting may sleep, and someone else may have brought
+		// blockno, or a block sharing its page, in meanwhile; then
+		// leave slot i empty and look again
+		if (bc_lookup(blockno) < 0 && bc_alias(blockno) < 0) {
+			mutex_lock(&bc_lock);
+			bcache[i].b_blockno = blockno;
+			bcache[i].b_pins = 0;
+			bcache[i].b_io = 0;
+			bcache[i].b_next = bc_hash[BC_HASH(blockno)];
+			bc_hash[BC_HASH(blockno)] = i;
+			mutex_unlock(&bc_lock);
+			break;
+		}
+	}
+	mutex_lock(&bc_lock);
+	bcache[i].b_epoch = bc_epoch;
+	mutex_unlock(&bc_lock);
+	return 0;
+}
+
+// read_block for a worker thread, which can't wait for the disk: if the
+// block is cached and read in, note its use and set *blk to it.
+// Returns 0, or -E_FS_RETRY if the request has to go to a fiber.
+static int
+bc_peek(uint32_t blockno, char **blk)
+{
+	int i, r = -E_FS_RETRY;
+
+	mutex_lock(&bc_lock);
+	if ((i = bc_lookup(blockno)) >= 0 && bcache[i].b_io != BC_IO_READ
+	    && block_is_mapped(blockno)) {
+		bcache[i].b_epoch = bc_epoch;
+		if (blk != NULL)
+			*blk = diskaddr(blockno);
+		r = 0;
+	}
+	mutex_unlock(&bc_lock);
+	return r;
+}
+
+// Keep the block holding address va (in DISKMAP) in memory until the
+// matching bc_unpin.
+void
+bc_pin(void *va)
+{
+	int i;
+
+	mutex_lock(&bc_lock);
+	if ((i = bc_lookup(diskblock(va))) >= 0)
+		bcache[i].b_pins++;
+	mutex_unlock(&bc_lock);
+}
+
+void
+bc_unpin(void *va)
+{
+	int i;
+
+	mutex_lock(&bc_lock);
+	if ((i = bc_lookup(diskblock(va))) >= 0
+	    && bcache[i].b_pins > 0)
+		bcache[i].b_pins--;
+	mutex_unlock(&bc_lock);
+}
+
+// Note that the block held in slot i may be dirty.
+static void
+bc_list_dirty(int i)
+{
+	if (bcache[i].b_listed)
+		return;
+	bcache[i].b_listed = 1;
+	bcache[i].b_dnext = bc_dirty;
+	bc_dirty = i;
+}
+
+// Note that the cached block blockno has been written to.
+void
+bc_mark_dirty(uint32_t blockno)
+{
+	int i;
+
+	if ((i = bc_lookup(blockno)) >= 0)
+		bc_list_dirty(i);
+}
+
+// Put the cached blocks whose PTE_D is set on the dirty list.
+static void
+bc_harvest(void)
+{
+	int i;
+
+	for (i = 0; i < BCACHE_NBLOCKS; i++)
+		if (!bcache[i].b_listed && bcache[i].b_blockno != BC_EMPTY
+		    && block_is_dirty(bcache[i].b_blockno))
+			bc_list_dirty(i);
+}
+
+// Give the disk block a slot and a fresh page, for the disk to do 'io'
+// (BC_IO_READ, or 0 if nothing) with.  Returns 0 if we mapped it, 1 if
+// it was (or, since finding a slot may sleep, has meanwhile been)
+// mapped already, or < 0 on error.
+static int
+bc_map_new(uint32_t blockno, int io)
+{
+	int r;
+
+	if ((r = bc_touch(blockno)) < 0)
+		return r;
+	if (block_is_mapped(blockno))
+		return 1;
+	// A worker takes a mapped block that isn't being read as ready
+	bc_set_io(blockno, io);
+	if ((r = sys_page_alloc(0, diskaddr(blockno), PTE_U|PTE_P|PTE_W)) < 0) {
+		bc_set_io(blockno, 0);
+		return r;
+	}
+	return 0;
+}
+
+// Forget a block whose read failed.  Whoever waits for it looks again.
+static void
+bc_drop(uint32_t blockno)
+{
+	int i;
+
+	mutex_lock(&bc_lock);
+	(void) sys_page_unmap(0, diskaddr(blockno));
+	if ((i = bc_lookup(blockno)) >= 0)
+		bc_remove(i);
+	mutex_unlock(&bc_lock);
+	fiber_wakeup(&bc_ioq);
 }
 
 // Allocate a page to hold the disk block
 int
 map_block(uint32_t blockno)
 {
-	if (block_is_mapped(blockno))
-		return 0;
-	return sys_page_alloc(0, diskaddr(blockno), PTE_U|PTE_P|PTE_W);
+	int r;
+
+	if ((r = bc_map_new(blockno, 0)) < 0)
+		return r;
+	return 0;
 }
 
 // Make sure a particular disk block is loaded into memory.
@@ -64,6 +562,14 @@ map_block(uint32_t blockno)
 // Hint: Use diskaddr, map_block, and ide_read.
 static int
 read_block(uint32_t blockno, char **blk)
+{
+	return read_block_packed(blockno, blk, 0);
+}
+
+// read_block for a block that may be compressed: if packed is nonzero
+// it is, and decodes to that many bytes (block_inflate).
+static int
+read_block_packed(uint32_t blockno, char **blk, uint32_t packed)
 {
 	int r;
 	char *addr;
@@ -76,12 +582,32 @@ read_block(uint32_t blockno, char **blk)
 
 	// LAB 5: Your code here.
     addr = diskaddr(blockno);
-    r = map_block(blockno);
+    if (fs_in_worker())
+        return bc_peek(blockno, blk);
+    // Cached: the copy in memory is the newest one, once it is there
+    while ((r = bc_map_new(blockno, BC_IO_READ)) == 1) {
+        if ((r = bc_lookup(blockno)) < 0 || bcache[r].b_io != BC_IO_READ) {
+            if (blk != NULL)
+                *blk = addr;
+            return 0;
+        }
+        fiber_sleep(&bc_ioq);
+    }
     if (r < 0)
         return r;
-    r = ide_read(blockno * BLKSECTS, (void*)addr, BLKSECTS);
-    if (r < 0)
+    if (packed)
+        r = block_inflate(blockno, addr, packed);
+    else
+        r = disk_read(blockno * BLKSECTS, (void*)addr, BLKSECTS);
+    if (r < 0) {
+        bc_drop(blockno);
         return r;
+    }
+    bc_set_io(blockno, 0);
+    // What we just read matches the disk, however we read it
+    if (va_is_dirty(addr)
+        && sys_page_map(0, addr, 0, addr, PTE_U|PTE_P|PTE_AVAIL|PTE_W) < 0)
+        panic("read_block: Syscall page map failed.");
     if (blk != NULL)
         *blk = addr;
     return 0;
@@ -104,10 +630,18 @@ write_block(uint32_t blockno)
     addr = diskaddr(blockno);
     if (!block_is_dirty(blockno))
         return;
-    if (ide_write(blockno * BLKSECTS, (void *)addr, BLKSECTS) < 0)
-        panic("write_block: IDE write failed.");
+    // Blocks this one points to must be marked in use on disk first
+    if (!block_is_bitmap(blockno))
+        bitmap_flush();
+    // Clear PTE_D first: others may run while the disk works, and a
+    // store they make meanwhile must leave the block dirty
     if (sys_page_map(0, (void *)addr, 0, (void *)addr, PTE_U|PTE_P|PTE_AVAIL|PTE_W) < 0)
         panic("write_block: Syscall page map failed.");
+    bc_set_io(blockno, BC_IO_WRITE);
+    snap_save(blockno, 1);
+    if (disk_write(blockno * BLKSECTS, (void *)addr, BLKSECTS) < 0)
+        panic("write_block: IDE write failed.");
+    bc_set_io(blockno, 0);
     return;
 }
 
@@ -122,9 +656,13 @@ unmap_block(uint32_t blockno)
 
 	assert(block_is_free(blockno) || !block_is_dirty(blockno));
 
+	mutex_lock(&bc_lock);
 	if ((r = sys_page_unmap(0, diskaddr(blockno))) < 0)
 		panic("unmap_block: sys_mem_unmap: %e", r);
 	assert(!block_is_mapped(blockno));
+	if ((r = bc_lookup(blockno)) >= 0)
+		bc_remove(r);
+	mutex_unlock(&bc_lock);
 }
 
 // Check to see if the block bitmap indicates that block 'blockno' is free.
@@ -139,53 +677,575 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
-// Mark a block free in the bitmap
+// Bitmap writeback.
+//
+// Allocating a block only clears its bit in memory; the store sets the
+// bitmap block's PTE_D, and the block goes out with everything else at
+// file_flush or fs_sync time, or when it's evicted.  To keep the disk
+// consistent should we crash in between, bits reach the disk in the
+// right order with the blocks that point at them:
+//
+//  - a block is marked in use on disk before any block pointing to it
+//    is written: write_block and write_block_run flush the dirty bitmap
+//    blocks before writing anything else.
+//  - a block is marked free on disk only after the blocks that pointed
+//    to it have been written: free_block just remembers the block, and
+//    fs_sync frees it in the bitmap once it has written every dirty
+//    block.  Until then the block can't be allocated again, either.
+//    Freed blocks are remembered as runs, so that a big file goes back
+//    to the bitmap a word of bits at a time.
+// Either way a crash can only leak blocks, never make two files share
+// one.
+//
+// On a disk with a journal the bitmap blocks are metadata like any
+// other, and reach the disk in the same transaction as the blocks that
+// point at what they mark; only the deferred frees still apply.
+
+// Runs of blocks freed since the last fs_sync
+#define FREE_PENDING_MAX	256
+struct FreeRun {
+	uint32_t fr_start;
+	uint32_t fr_n;
+};
+static struct FreeRun free_pending[FREE_PENDING_MAX];
+static int nfree_pending;
+
+// Write out the bitmap blocks we've changed.
+static void
+bitmap_flush(void)
+{
+	uint32_t i;
+
+	if (bitmap == 0 || fs_journal)
+		return;
+	for (i = 0; i < ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE; i++)
+		if (block_is_dirty(2 + i))
+			write_block(2 + i);
+}
+
+// Mark a block free in the bitmap right away.  Only for blocks that
+// nothing on disk can point to yet.
+static void
+bitmap_free(uint32_t blockno)
+{
+	bitmap[blockno/32] |= 1<<(blockno%32);
+	txn_add(&bitmap[blockno/32]);
+}
+
+// Mark the n blocks from 'start' free in the bitmap right away, setting
+// the bits of each word at once.
+static void
+bitmap_free_run(uint32_t start, uint32_t n)
+{
+	uint32_t w, k, first;
+
+	for (first = start; n > 0; start += k, n -= k) {
+		w = start / 32;
+		k = MIN(32 - start % 32, n);
+		bitmap[w] |= (k == 32 ? ~0U : (1U << k) - 1) << (start % 32);
+		// Once for each bitmap block the run touches
+		if (start == first || w % (BLKSIZE / 4) == 0)
+			txn_add(&bitmap[w]);
+	}
+}
+
+// Mark the n blocks from 'start' free in the bitmap, once the blocks
+// that pointed to them are on disk.  A run that carries on from the
+// last one freed joins it.
 void
-free_block(uint32_t blockno)
+free_blocks(uint32_t start, uint32_t n)
 {
+	struct FreeRun *fr;
+
 	// Blockno zero is the null pointer of block numbers.
-	if (blockno == 0)
+	if (start == 0)
 		panic("attempt to free zero block");
-	bitmap[blockno/32] |= 1<<(blockno%32);
+	if (n == 0)
+		return;
+	if (nfree_pending > 0) {
+		fr = &free_pending[nfree_pending - 1];
+		if (fr->fr_start + fr->fr_n == start) {
+			fr->fr_n += n;
+			return;
+		}
+	}
+	if (nfree_pending == FREE_PENDING_MAX)
+		fs_sync();
+	free_pending[nfree_pending].fr_start = start;
+	free_pending[nfree_pending].fr_n = n;
+	nfree_pending++;
+}
+
+void
+free_block(uint32_t blockno)
+{
+	free_blocks(blockno, 1);
+}
+
+// Take the freed blocks waiting for fs_sync out of the cache: whatever
+// they hold is garbage, and writing it back would be wasted work.  All
+// the pages go in one batch of unmaps, flushed before anything can run
+// and allocate one of the blocks again.
+static void
+free_pending_drop(void)
+{
+	struct SyscallBatch b = BATCH_INIT;
+	uint32_t blockno;
+	int i, j, r;
+
+	for (i = 0; i < nfree_pending; i++)
+		for (blockno = free_pending[i].fr_start;
+		     blockno < free_pending[i].fr_start + free_pending[i].fr_n; blockno++) {
+			if ((j = bc_lookup(blockno)) < 0 || !bc_evictable(j))
+				continue;
+			if (block_is_mapped(blockno)
+			    && (r = batch_page_unmap(&b, 0, diskaddr(blockno))) < 0)
+				panic("free_pending_drop: sys_page_unmap: %e", r);
+			mutex_lock(&bc_lock);
+			bc_remove(j);
+			mutex_unlock(&bc_lock);
+		}
+	if ((r = batch_flush(&b)) < 0)
+		panic("free_pending_drop: sys_page_unmap: %e", r);
+}
+
+// Where the next search for a free block starts when the caller has no
+// better idea: just past the block allocated last (next fit), so
+// allocations don't rescan the full part of the disk every time.
+static uint32_t alloc_next;
+
+// Allocation windows.
+//
+// Blocks are chosen as a file's pages are first touched, so files grown
+// at the same time would take turns at the free blocks and end up
+// interleaved on disk.  Instead, each file that allocates a block gets a
+// window: the ALLOCWIN_BLOCKS blocks after it are kept for the file, and
+// other files' searches skip them, so the file goes on growing into one
+// run.  file_fallocate gives a file a window the size of the range it
+// fills.  Windows are only a hint, kept in memory: the bitmap doesn't
+// know of them, an allocation that would otherwise fail ignores them,
+// and the oldest is reused when a file needs a new one.
+#define NALLOCWIN	16
+#define ALLOCWIN_BLOCKS	64
+
+struct AllocWin {
+	struct File *w_file;	// whose window, or 0 if unused
+	uint32_t w_next;	// next block to give it
+	uint32_t w_end;		// first block past the window
+};
+
+static struct AllocWin allocwin[NALLOCWIN];
+static int allocwin_hand;
+
+// f's window, or 0.
+static struct AllocWin *
+allocwin_find(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < NALLOCWIN; i++)
+		if (allocwin[i].w_file == f)
+			return &allocwin[i];
+	return 0;
+}
+
+// Keep the n blocks from 'start' on for f.
+static void
+allocwin_set(struct File *f, uint32_t start, uint32_t n)
+{
+	struct AllocWin *w;
+
+	if ((w = allocwin_find(f)) == 0) {
+		w = &allocwin[allocwin_hand];
+		allocwin_hand = (allocwin_hand + 1) % NALLOCWIN;
+		w->w_file = f;
+	}
+	w->w_next = start;
+	w->w_end = start + n;
+}
+
+// f is done growing, or gone.
+static void
+allocwin_drop(struct File *f)
+{
+	struct AllocWin *w;
+
+	if ((w = allocwin_find(f)) != 0)
+		w->w_file = 0;
 }
 
-// Search the bitmap for a free block and allocate it.
+// Is blockno in the window of a file other than f?  Then return the
+// first block past the window, else 0.
+static uint32_t
+allocwin_other(struct File *f, uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < NALLOCWIN; i++)
+		if (allocwin[i].w_file && allocwin[i].w_file != f
+		    && blockno >= allocwin[i].w_next && blockno < allocwin[i].w_end)
+			return allocwin[i].w_end;
+	return 0;
+}
+
+// Find the first free block at or after 'start', wrapping round at the
+// end of the disk, 32 blocks at a time: words with no bit set are all in
+// use, and bsf finds the first free block in the others.  With 'windows'
+// set, blocks in the windows of files other than f don't count.
+static int
+bitmap_find_free(uint32_t start, struct File *f, bool windows)
+{
+	uint32_t first, nwords, w, word, k, bno;
+
+	first = 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+	nwords = ROUNDUP(super->s_nblocks, 32) / 32;
+	if (start < first || start >= super->s_nblocks)
+		start = first;
+	w = start / 32;
+	word = bitmap[w] & (~0U << (start % 32));
+	// One word more than the bitmap has, for the bits below start
+	for (k = 0; k <= nwords; k++) {
+		while (word != 0) {
+			bno = w * 32 + bsf(word);
+			if (bno >= super->s_nblocks)
+				break;		// padding past the last block
+			if (bno >= first && !(windows && allocwin_other(f, bno)))
+				return bno;
+			word &= word - 1;
+		}
+		w = (w + 1) % nwords;
+		word = bitmap[w];
+	}
+	return -E_NO_DISK;
+}
+
+// Find the first run of n free blocks outside any file's window, 32
+// blocks at a time where the words are all in use.  Returns its first
+// block, or -E_NO_DISK if there's no run that long.
+static int
+bitmap_find_run(uint32_t n)
+{
+	uint32_t first, bno, run, end;
+
+	first = 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+	for (bno = first, run = 0; bno < super->s_nblocks && run < n; ) {
+		if (bno % 32 == 0 && bitmap[bno / 32] == 0) {
+			run = 0;
+			bno += 32;
+		} else if ((end = allocwin_other(0, bno)) != 0) {
+			run = 0;
+			bno = end;
+		} else {
+			run = block_is_free(bno) ? run + 1 : 0;
+			bno++;
+		}
+	}
+	return run == n ? (int) (bno - n) : -E_NO_DISK;
+}
+
+// Search the bitmap for a free block for file f (0 for none in
+// particular) and allocate it, preferring the next block of f's window,
+// or else the first free one at or after 'near' (0 for wherever the last
+// search left off).
 // 
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
 int
-alloc_block_num(void)
+alloc_block_num(struct File *f, uint32_t near)
 {
 	// LAB 5: Your code here.
     int i;
-    for (i = 2 + ROUNDUP(super->s_nblocks, BLKSECTS)/BLKSECTS; i < super->s_nblocks; i++) {
-        if (block_is_free(i)) {
-            bitmap[i / 32] &= ~(1 << (i % 32));
-            write_block(2 + i / BLKBITSIZE);
-            return i;
-        }
+    struct AllocWin *w;
+    if (f && (w = allocwin_find(f)) && w->w_next < w->w_end)
+        near = w->w_next;
+    // Blocks waiting in free_block count too, once we sync; and
+    // windows give way before the disk is full
+    if ((i = bitmap_find_free(near ? near : alloc_next, f, 1)) == -E_NO_DISK
+        && nfree_pending > 0) {
+        fs_sync();
+        i = bitmap_find_free(near ? near : alloc_next, f, 1);
     }
-	return -E_NO_DISK;
+    if (i == -E_NO_DISK)
+        i = bitmap_find_free(near ? near : alloc_next, f, 0);
+    if (i < 0)
+        return i;
+    bitmap[i / 32] &= ~(1 << (i % 32));
+    txn_add(&bitmap[i / 32]);
+    alloc_next = i + 1;
+    // fs_sync may have slept, and the windows moved meanwhile
+    if (f && (w = allocwin_find(f)) && i >= w->w_next && i < w->w_end)
+        w->w_next = i + 1;
+    else if (f)
+        allocwin_set(f, i + 1, ALLOCWIN_BLOCKS);
+    return i;
 }
 
 // Allocate a block -- first find a free block in the bitmap,
 // then map it into memory.
 int
 alloc_block(void)
+{
+	return alloc_block_near(0, 0);
+}
+
+// Like alloc_block, but put the block at or soon after block 'near' if
+// there's room, so that a file's blocks end up next to each other on
+// disk and can be moved in multi-block runs.  Blocks of f's data go in
+// its window, if it has one (see alloc_block_num).
+static int
+alloc_block_near(struct File *f, uint32_t near)
 {
 	int r, bno;
 
-	if ((r = alloc_block_num()) < 0)
+	if ((r = alloc_block_num(f, near)) < 0)
 		return r;
 	bno = r;
 
 	if ((r = map_block(bno)) < 0) {
-		free_block(bno);
+		bitmap_free(bno);
 		return r;
 	}
 	return bno;
 }
 
+// Journal.
+//
+// On a disk with a journal (s_njournal != 0), changes to metadata -- the
+// superblock, the bitmap, directory blocks and blocks of pointers or
+// extents -- aren't written in place as they're made.  txn_add puts the
+// block a change went into in the open transaction, pinning it in the
+// cache, and from then on the block reaches the disk only through
+// journal_commit.  That copies the transaction's blocks into the
+// journal after a header, writes the lot with one IDE command, and only
+// then writes the copies home.  A crash before the journal write is
+// done loses the whole transaction; after it, journal_recover writes
+// the transaction home again at the next boot.  Either way the disk
+// never shows half of one, so nothing needs to be written synchronously
+// to keep the order right.
+//
+// Data blocks aren't journaled.  fs_flush writes them before it
+// commits, so a committed file has its data on disk too.  Blocks freed
+// go back in the bitmap after the commit, when nothing on disk points
+// to them -- unless the journal still holds a copy of one, which a
+// replay would write over its next use.
+//
+// Everything that changes metadata is an exclusive request (see
+// serv.c), so a commit never sees another request's change half made.
+// A transaction too big for the journal goes out in pieces, bitmap
+// blocks first.  That is only as good as the ordered writes used
+// without a journal, where a crash may leak blocks but never gives one
+// to two files; serve() runs the flusher once the transaction fills the
+// journal, so it's rare.
+
+static uint32_t txn_blocks[BCACHE_NBLOCKS];	// the open transaction
+static uint32_t txn_n;
+static uint32_t txn_seq;			// last transaction committed
+
+// Note that the metadata at va, in a cached block, was just changed.
+// Don't sleep in between, or a commit may go without it.
+void
+txn_add(void *va)
+{
+	int i;
+
+	if (!fs_journal)
+		return;
+	if ((i = bc_lookup(diskblock(va))) < 0)
+		panic("txn_add: block at %08x isn't cached", va);
+	if (bcache[i].b_txn)
+		return;
+	bcache[i].b_txn = 1;
+	mutex_lock(&bc_lock);
+	bcache[i].b_pins++;
+	mutex_unlock(&bc_lock);
+	txn_blocks[txn_n++] = bcache[i].b_blockno;
+}
+
+// Has the open transaction filled the journal?
+bool
+journal_full(void)
+{
+	return fs_journal && txn_n >= super->s_njournal - 1;
+}
+
+// Map pages for the journal at its place in DISKMAP.  They stay there,
+// outside the block cache.
+static struct JournalHeader *
+journal_map(void)
+{
+	uint32_t i;
+	char *va;
+	int r;
+
+	for (i = 0; i < super->s_njournal; i++) {
+		va = diskaddr(super->s_journal + i);
+		if (!va_is_mapped(va) && (r = sys_page_alloc(0, va, PTE_U|PTE_P|PTE_W)) < 0)
+			panic("journal_map: %e", r);
+	}
+	return (struct JournalHeader *) diskaddr(super->s_journal);
+}
+
+// Write the blocks logged after jh where they belong, each run of
+// adjacent ones with one IDE command.
+static int
+journal_write_home(struct JournalHeader *jh)
+{
+	char *log = (char *) jh + BLKSIZE;
+	uint32_t i, j;
+	int r;
+
+	for (i = 0; i < jh->j_nblocks; i = j) {
+		for (j = i + 1; j < jh->j_nblocks && jh->j_blocks[j] == jh->j_blocks[j - 1] + 1; j++)
+			;
+		snap_save(jh->j_blocks[i], j - i);
+		if ((r = disk_write(jh->j_blocks[i] * BLKSECTS, log + i * BLKSIZE,
+				   (j - i) * BLKSECTS)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+// How far into the n blocks from 'start' is the first the journal holds
+// a copy of?  n if it holds none of them.
+static uint32_t
+journal_first(struct JournalHeader *jh, uint32_t start, uint32_t n)
+{
+	uint32_t i, k = n;
+
+	for (i = 0; i < jh->j_nblocks; i++)
+		if (jh->j_blocks[i] - start < k)
+			k = jh->j_blocks[i] - start;
+	return k;
+}
+
+// Should block a be committed before block b?  Bitmap blocks first,
+// then in order, so that adjacent blocks go home together.
+static bool
+txn_before(uint32_t a, uint32_t b)
+{
+	if (block_is_bitmap(a) != block_is_bitmap(b))
+		return block_is_bitmap(a);
+	return a < b;
+}
+
+// Commit the open transaction and write it home, then free the blocks
+// free_block put off freeing.  With nothing to commit but blocks to
+// free, an empty transaction takes the last one out of the journal.
+static void
+journal_commit(void)
+{
+	static uint32_t blocks[BCACHE_NBLOCKS];
+	static struct FreeRun kept[FREE_PENDING_MAX];
+	struct JournalHeader *jh;
+	uint32_t i, j, k, n, b, max;
+	char *log;
+	int r;
+
+	if (!fs_journal || (txn_n == 0 && nfree_pending == 0))
+		return;
+	jh = journal_map();
+	log = (char *) jh + BLKSIZE;
+	max = super->s_njournal - 1;
+
+	for (i = n = 0; i < txn_n; i++) {
+		if (!bc_in_txn(b = txn_blocks[i]))
+			continue;	// dropped from the cache unused
+		for (j = n++; j > 0 && txn_before(b, blocks[j - 1]); j--)
+			blocks[j] = blocks[j - 1];
+		blocks[j] = b;
+	}
+	txn_n = 0;
+
+	i = 0;
+	do {
+		k = MIN(n - i, max);
+		for (j = 0; j < k; j++) {
+			b = blocks[i + j];
+			memmove(log + j * BLKSIZE, diskaddr(b), BLKSIZE);
+			jh->j_blocks[j] = b;
+			// The copy is what goes home; as in write_block
+			if (sys_page_map(0, diskaddr(b), 0, diskaddr(b), PTE_U|PTE_P|PTE_AVAIL|PTE_W) < 0)
+				panic("journal_commit: Syscall page map failed.");
+		}
+		jh->j_magic = JOURNAL_MAGIC;
+		jh->j_seq = ++txn_seq;
+		jh->j_nblocks = k;
+		jh->j_sum = journal_sum(jh);
+		// A replay mustn't write over what a snapshot still needs
+		for (j = 0; j < k; j++)
+			snap_save(jh->j_blocks[j], 1);
+		snap_save(super->s_journal, k + 1);
+		if ((r = disk_write(super->s_journal * BLKSECTS, jh, (k + 1) * BLKSECTS)) < 0
+		    || (r = journal_write_home(jh)) < 0)
+			panic("journal_commit: %e", r);
+		i += k;
+	} while (i < n);
+
+	for (i = 0; i < n; i++)
+		if ((r = bc_lookup(blocks[i])) >= 0 && bcache[r].b_txn) {
+			bcache[r].b_txn = 0;
+			mutex_lock(&bc_lock);
+			bcache[r].b_pins--;
+			mutex_unlock(&bc_lock);
+		}
+
+	// Blocks the journal holds copies of wait for the next commit; the
+	// rest of their runs go now, unless splitting them would leave more
+	// runs than free_pending has room for
+	for (i = j = 0; i < (uint32_t) nfree_pending; i++) {
+		b = free_pending[i].fr_start;
+		n = free_pending[i].fr_n;
+		while ((k = journal_first(jh, b, n)) < n) {
+			bitmap_free_run(b, k);
+			kept[j].fr_start = b + k;
+			if (j + nfree_pending - i + 1 > FREE_PENDING_MAX) {
+				kept[j++].fr_n = n - k;
+				n = 0;
+				break;
+			}
+			kept[j++].fr_n = 1;
+			b += k + 1;
+			n -= k + 1;
+		}
+		bitmap_free_run(b, n);
+	}
+	memmove(free_pending, kept, j * sizeof(kept[0]));
+	nfree_pending = j;
+}
+
+// Write home the transaction in the journal, unless it was torn on the
+// way there.  It may have gone home already; writing it again does no
+// harm.  Returns 1 if there was one.
+static bool
+journal_recover(void)
+{
+	struct JournalHeader *jh;
+	uint32_t i, b;
+	int r;
+
+	if (!fs_journal)
+		return 0;
+	jh = journal_map();
+	if ((r = disk_read(super->s_journal * BLKSECTS, jh, super->s_njournal * BLKSECTS)) < 0)
+		panic("journal_recover: %e", r);
+	if (jh->j_magic != JOURNAL_MAGIC)
+		return 0;
+	txn_seq = jh->j_seq;
+	if (jh->j_nblocks == 0 || jh->j_nblocks >= super->s_njournal
+	    || journal_sum(jh) != jh->j_sum)
+		return 0;
+	for (i = 0; i < jh->j_nblocks; i++) {
+		b = jh->j_blocks[i];
+		if (b < 1 || b >= super->s_nblocks
+		    || (b >= super->s_journal && b < super->s_journal + super->s_njournal))
+			panic("journal_recover: bad block %08x in transaction %d", b, jh->j_seq);
+	}
+	if ((r = journal_write_home(jh)) < 0)
+		panic("journal_recover: %e", r);
+	cprintf("journal: transaction %d, %d blocks, written home\n", jh->j_seq, jh->j_nblocks);
+	return 1;
+}
+
 // Read and validate the file system super-block.
 void
 read_super(void)
@@ -200,7 +1260,23 @@ read_super(void)
 	if (super->s_magic != FS_MAGIC)
 		panic("bad file system magic number");
 
-	if (super->s_nblocks > DISKSIZE/BLKSIZE)
+	// Sector numbers are 32 bits
+	if (super->s_nblocks > 0xFFFFFFFF / BLKSECTS)
+		panic("file system is too large");
+
+	if (super->s_version > FS_VERSION)
+		panic("file system version %d is too new", super->s_version);
+	fs_extents = super->s_version == FS_VERSION_EXTENT;
+
+	fs_journal = super->s_njournal != 0;
+	if (fs_journal && (super->s_njournal < 2 || super->s_njournal > JOURNAL_MAXBLOCKS
+			   || super->s_journal < 2
+			   || super->s_journal + super->s_njournal > super->s_nblocks))
+		panic("bad journal at block %d, %d blocks", super->s_journal, super->s_njournal);
+
+	diskmap_fixed = ROUNDUP(MAX(2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE,
+				    super->s_journal + super->s_njournal), BC_NHASH);
+	if (super->s_nblocks > DISKMAP_NBLOCKS && diskmap_fixed >= DISKMAP_NBLOCKS)
 		panic("file system is too large");
 
 	cprintf("superblock is good\n");
@@ -264,7 +1340,7 @@ check_write_block(void)
 
 	// back up super block
 	read_block(0, 0);
-	memmove(diskaddr(0), diskaddr(1), PGSIZE);
+	page_copy(diskaddr(0), diskaddr(1));
 
 	// smash it 
 	strcpy(diskaddr(1), "OOPS!\n");
@@ -276,79 +1352,445 @@ check_write_block(void)
 	sys_page_unmap(0, diskaddr(1));
 	assert(!block_is_mapped(1));
 
-	// read it back in
-	read_block(1, 0);
-	assert(strcmp(diskaddr(1), "OOPS!\n") == 0);
+	// read it back in
+	read_block(1, 0);
+	assert(strcmp(diskaddr(1), "OOPS!\n") == 0);
+
+	// fix it
+	page_copy(diskaddr(1), diskaddr(0));
+	write_block(1);
+	super = (struct Super*)diskaddr(1);
+
+	cprintf("write_block is good\n");
+}
+
+// The device we're on; umain may pick another before fs_init
+struct Bdev *bdev = &bdev_ide;
+
+// Initialize the file system
+void
+fs_init(void)
+{
+	static_assert(sizeof(struct File) == 256);
+
+	int r;
+
+	bc_init();
+
+	if ((r = bdev->bd_init()) < 0)
+		panic("fs_init: %s: %e", bdev->bd_name, r);
+	read_super();
+	// Replaying may have written a new superblock
+	if (journal_recover()) {
+		bc_drop(1);
+		read_super();
+	}
+	// So may rolling back to a snapshot
+	if (snap_mount()) {
+		bc_drop(1);
+		read_super();
+	}
+	if (SELFTEST)
+		check_write_block();
+	read_bitmap();
+	tmpfs_init();
+}
+
+// Set *pblk to the block of pointers whose number is in *slot, first
+// allocating a cleared one near 'near' if *slot is 0 and 'alloc' is set.
+static int
+file_ptr_block(uint32_t *slot, uint32_t near, uint32_t **pblk, bool alloc)
+{
+	int r;
+	char *blk;
+
+	if (*slot == 0) {
+		if (alloc == 0)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block_near(0, near)) < 0)
+			return r;
+		// alloc_block may sleep; someone may have beaten us
+		if (*slot != 0) {
+			bitmap_free(r);
+			unmap_block(r);
+			alloc = 0;
+		} else {
+			*slot = r;
+			txn_add(slot);
+		}
+	} else
+		alloc = 0;	// we did not allocate a block
+	if ((r = read_block(*slot, &blk)) < 0)
+		return r;
+	assert(blk != 0);
+	if (alloc) {		// must clear any block we allocated
+		page_zero(blk);
+		txn_add(blk);
+	}
+	*pblk = (uint32_t*) blk;
+	return 0;
+}
+
+// Find the disk block number slot for the 'filebno'th block in file 'f'.
+// Set '*ppdiskbno' to point to that slot.
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the indirect blocks of the
+// double-indirect block.
+// When 'alloc' is set, this function will allocate indirect blocks
+// if necessary.
+//
+// Returns:
+//	0 on success (but note that *ppdiskbno might equal 0).
+//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
+//		alloc was 0.
+//	-E_NO_DISK if there's no space on the disk for an indirect block.
+//	-E_NO_MEM if there's no space in memory for an indirect block.
+//	-E_INVAL if filebno is out of range (it's >= NINDIRECT + NDINDIRECT).
+//
+// Analogy: This is like pgdir_walk for files.  
+int
+file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
+{
+	int r;
+	uint32_t *ptr, *blk;
+
+	if (filebno < NDIRECT)
+		ptr = &f->f_direct[filebno];
+	else if (filebno < NINDIRECT) {
+		// right after the last direct block, if there is one
+		if ((r = file_ptr_block(&f->f_indirect, f->f_direct[NDIRECT-1]
+					? f->f_direct[NDIRECT-1] + 1 : 0, &blk, alloc)) < 0)
+			return r;
+		ptr = blk + filebno;
+	} else if (filebno < NINDIRECT + NDINDIRECT) {
+		filebno -= NINDIRECT;
+		if ((r = file_ptr_block(&f->f_dindirect, f->f_indirect
+					? f->f_indirect + 1 : 0, &blk, alloc)) < 0
+		    || (r = file_ptr_block(&blk[filebno / NINDIRECT], f->f_dindirect + 1,
+					   &blk, alloc)) < 0)
+			return r;
+		ptr = blk + filebno % NINDIRECT;
+	} else
+		return -E_INVAL;
+
+	*ppdiskbno = ptr;
+	return 0;
+}
+
+// file_map_block for version 1 file systems.
+static int
+file_map_block_ptr(struct File *f, uint32_t filebno, uint32_t *diskbno, bool alloc)
+{
+	int r;
+	uint32_t *ptr, *prev, near;
+
+	if ((r = file_block_walk(f, filebno, &ptr, alloc)) < 0)
+		return r;
+	if (*ptr == 0) {
+		if (alloc == 0)
+			return -E_NOT_FOUND;
+		// Follow on from the file's previous block
+		near = 0;
+		if (filebno > 0 && file_block_walk(f, filebno - 1, &prev, 0) == 0 && *prev)
+			near = *prev + 1;
+		if ((r = alloc_block_near(f, near)) < 0)
+			return r;
+		// as in file_block_walk
+		if (*ptr != 0) {
+			bitmap_free(r);
+			unmap_block(r);
+		} else {
+			*ptr = r;
+			txn_add(ptr);
+		}
+	}
+	*diskbno = *ptr;
+	return 0;
+}
+
+// Extents.
+//
+// On version 2 file systems a file's blocks are described by runs of
+// blocks contiguous both in the file and on disk: one lookup is a binary
+// search over a handful of extents, with no indirect block to read for
+// most files, and a file written in order stays a single extent that
+// file_readahead and file_flush can move with few IDE commands.
+
+// Set *pe to f's extent number i.  With 'alloc', i may be f_nextent, the
+// next free one, and we allocate the extent block if it's needed.
+static int
+file_extent(struct File *f, uint32_t i, struct Extent **pe, bool alloc)
+{
+	int r;
+	char *blk;
+
+	if (i < NEXTENT_INLINE) {
+		*pe = &f->f_extent[i];
+		return 0;
+	}
+	if (i - NEXTENT_INLINE >= NEXTENT_BLOCK)
+		return -E_NO_DISK;	// too fragmented
+	if (f->f_extblk == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block_near(0, f->f_extent[NEXTENT_INLINE-1].e_start
+					  + f->f_extent[NEXTENT_INLINE-1].e_len)) < 0)
+			return r;
+		// alloc_block may sleep; someone may have beaten us
+		if (f->f_extblk != 0) {
+			bitmap_free(r);
+			unmap_block(r);
+		} else {
+			page_zero(diskaddr(r));
+			txn_add(diskaddr(r));
+			f->f_extblk = r;
+			txn_add(f);
+		}
+	}
+	if ((r = read_block(f->f_extblk, &blk)) < 0)
+		return r;
+	*pe = (struct Extent *) blk + (i - NEXTENT_INLINE);
+	return 0;
+}
+
+// Find the last extent of f that starts at or before file block filebno,
+// setting *pi to its number (-1 if there's none) and *pe to it.
+static int
+file_extent_find(struct File *f, uint32_t filebno, int *pi, struct Extent **pe)
+{
+	int lo = 0, hi = (int) f->f_nextent - 1, mid, r;
+	struct Extent *e;
+
+	*pi = -1;
+	*pe = 0;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if ((r = file_extent(f, mid, &e, 0)) < 0)
+			return r;
+		if (e->e_fileblk <= filebno) {
+			*pi = mid;
+			*pe = e;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return 0;
+}
+
+// Put a new extent in at number i, moving the ones from there on up.
+static int
+file_extent_insert(struct File *f, uint32_t i, uint32_t filebno, uint32_t diskbno)
+{
+	struct Extent *e, *prev;
+	uint32_t j;
+	int r;
+
+	if ((r = file_extent(f, f->f_nextent, &e, 1)) < 0)
+		return r;
+	for (j = f->f_nextent; j > i; j--) {
+		if ((r = file_extent(f, j - 1, &prev, 0)) < 0)
+			return r;
+		*e = *prev;
+		txn_add(e);
+		e = prev;
+	}
+	e->e_fileblk = filebno;
+	e->e_start = diskbno;
+	e->e_len = 1;
+	txn_add(e);
+	f->f_nextent++;
+	txn_add(f);
+	return 0;
+}
+
+// Take extent i out, moving the ones after it down.
+static int
+file_extent_delete(struct File *f, uint32_t i)
+{
+	struct Extent *e, *next;
+	uint32_t j;
+	int r;
+
+	if ((r = file_extent(f, i, &e, 0)) < 0)
+		return r;
+	for (j = i + 1; j < f->f_nextent; j++) {
+		if ((r = file_extent(f, j, &next, 0)) < 0)
+			return r;
+		*e = *next;
+		txn_add(e);
+		e = next;
+	}
+	memset(e, 0, sizeof(*e));
+	txn_add(e);
+	f->f_nextent--;
+	txn_add(f);
+	return 0;
+}
+
+// file_map_block for version 2 file systems.
+static int
+file_map_block_extent(struct File *f, uint32_t filebno, uint32_t *diskbno, bool alloc)
+{
+	int r, i;
+	uint32_t near, bno;
+	struct Extent *e, *next;
+
+	if ((r = file_extent_find(f, filebno, &i, &e)) < 0)
+		return r;
+	if (e && filebno < e->e_fileblk + e->e_len) {
+		*diskbno = e->e_start + (filebno - e->e_fileblk);
+		return 0;
+	}
+	if (!alloc)
+		return -E_NOT_FOUND;
 
-	// fix it
-	memmove(diskaddr(1), diskaddr(0), PGSIZE);
-	write_block(1);
-	super = (struct Super*)diskaddr(1);
+	// Where the extent before, if it went on this far, would have it
+	near = e ? e->e_start + (filebno - e->e_fileblk) : 0;
+	if ((r = alloc_block_near(f, near)) < 0)
+		return r;
+	bno = r;
+	// alloc_block may sleep and someone may have mapped filebno
+	// meanwhile; in any case the extents may have moved
+	if (file_map_block_extent(f, filebno, diskbno, 0) == 0) {
+		bitmap_free(bno);
+		unmap_block(bno);
+		return 0;
+	}
+	if ((r = file_extent_find(f, filebno, &i, &e)) < 0)
+		goto fail;
+	next = 0;
+	if (i + 1 < (int) f->f_nextent && (r = file_extent(f, i + 1, &next, 0)) < 0)
+		goto fail;
+
+	if (e && e->e_fileblk + e->e_len == filebno && e->e_start + e->e_len == bno) {
+		// Grow the extent before, joining it to the one after if
+		// the gap between them is gone
+		e->e_len++;
+		txn_add(e);
+		if (next && next->e_fileblk == filebno + 1 && next->e_start == bno + 1) {
+			e->e_len += next->e_len;
+			if ((r = file_extent_delete(f, i + 1)) < 0)
+				goto fail;
+		}
+	} else if (next && next->e_fileblk == filebno + 1 && next->e_start == bno + 1) {
+		// Grow the extent after downwards
+		next->e_fileblk--;
+		next->e_start--;
+		next->e_len++;
+		txn_add(next);
+	} else if ((r = file_extent_insert(f, i + 1, filebno, bno)) < 0)
+		goto fail;
+	*diskbno = bno;
+	return 0;
 
-	cprintf("write_block is good\n");
+    fail:
+	bitmap_free(bno);
+	unmap_block(bno);
+	return r;
 }
 
-// Initialize the file system
-void
-fs_init(void)
+// Free f's blocks from file block nblocks on.
+static void
+file_truncate_extents(struct File *f, uint32_t nblocks)
 {
-	static_assert(sizeof(struct File) == 256);
-
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
-	
-	read_super();
-	check_write_block();
-	read_bitmap();
+	struct Extent *e;
+	uint32_t keep, start, len;
+
+	while (f->f_nextent > 0) {
+		if (file_extent(f, f->f_nextent - 1, &e, 0) < 0)
+			panic("file_truncate_extents: extent block unreadable");
+		if (e->e_fileblk + e->e_len <= nblocks)
+			break;
+		keep = e->e_fileblk < nblocks ? nblocks - e->e_fileblk : 0;
+		start = e->e_start + keep;
+		len = e->e_len - keep;
+		if (keep > 0) {
+			e->e_len = keep;
+			txn_add(e);
+		} else {
+			memset(e, 0, sizeof(*e));
+			txn_add(e);
+			f->f_nextent--;
+			txn_add(f);
+		}
+		free_blocks(start, len);
+		if (keep > 0)
+			break;
+	}
+	if (f->f_nextent <= NEXTENT_INLINE && f->f_extblk != 0) {
+		free_block(f->f_extblk);
+		f->f_extblk = 0;
+		txn_add(f);
+	}
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// Per-File locks.
 //
-// Returns:
-//	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
-//		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_NO_MEM if there's no space in memory for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NINDIRECT).
+// Most changes to a struct File are made by requests that run alone (see
+// serve_lock in serv.c), but moving an inline file's data out happens in
+// shared ones too, while a worker thread may be copying the File into an
+// open's Fd.  A File lives on disk, with no room for a lock, so the
+// locks are hashed by its address.
+
+#define NFILELOCK	64
+
+static struct Mutex file_locks[NFILELOCK];
+
+struct Mutex *
+file_lock(struct File *f)
+{
+	return &file_locks[((uintptr_t) f / sizeof(struct File)) % NFILELOCK];
+}
+
+// Inline files.
 //
-// Analogy: This is like pgdir_walk for files.  
-int
-file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
+// A regular file of up to FILE_INLINE_MAX bytes may keep its data in its
+// struct File, where its block pointers or extents would go (FILE_INLINE);
+// fsformat writes small files that way.  Such a file takes no block,
+// reading it takes no block read, and a client has its data in the Fd
+// page from the open on.  Whatever needs a block of it -- to write the
+// data, or to map it -- moves the data out to a block first, and from
+// then on it's an ordinary file.
+
+// Move inline file f's data out to a block of its own.
+static int
+file_uninline(struct File *f)
 {
 	int r;
-	uint32_t *ptr;
+	uint32_t bno;
 	char *blk;
 
-	if (filebno < NDIRECT)
-		ptr = &f->f_direct[filebno];
-	else if (filebno < NINDIRECT) {
-		if (f->f_indirect == 0) {
-			if (alloc == 0)
-				return -E_NOT_FOUND;
-			if ((r = alloc_block()) < 0)
-				return r;
-			f->f_indirect = r;
-		} else
-			alloc = 0;	// we did not allocate a block
-		if ((r = read_block(f->f_indirect, &blk)) < 0)
-			return r;
-		assert(blk != 0);
-		if (alloc)		// must clear any block we allocated
-			memset(blk, 0, BLKSIZE);
-		ptr = (uint32_t*)blk + filebno;
+	if (f->f_size == 0) {
+		mutex_lock(file_lock(f));
+		memset(f->f_data, 0, sizeof(f->f_data));
+		f->f_flags &= ~FILE_INLINE;
+		txn_add(f);
+		mutex_unlock(file_lock(f));
+		return 0;
+	}
+	// Allocating may sleep, and someone else may move it meanwhile
+	if ((r = alloc_block_near(f, 0)) < 0)
+		return r;
+	bno = r;
+	if (!(f->f_flags & FILE_INLINE)) {
+		bitmap_free(bno);
+		unmap_block(bno);
+		return 0;
+	}
+	mutex_lock(file_lock(f));
+	blk = diskaddr(bno);
+	memset(blk, 0, BLKSIZE);
+	memmove(blk, f->f_data, MIN(f->f_size, FILE_INLINE_MAX));
+	memset(f->f_data, 0, sizeof(f->f_data));
+	if (fs_extents) {
+		f->f_extent[0].e_start = bno;
+		f->f_extent[0].e_len = 1;
+		f->f_nextent = 1;
 	} else
-		return -E_INVAL;
-
-	*ppdiskbno = ptr;
+		f->f_direct[0] = bno;
+	f->f_flags &= ~FILE_INLINE;
+	txn_add(f);
+	mutex_unlock(file_lock(f));
 	return 0;
 }
 
@@ -358,26 +1800,24 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if alloc was 0 but the block did not exist.
-//	-E_NO_DISK if a block needed to be allocated but the disk is full.
+//	-E_NO_DISK if a block needed to be allocated but the disk is full
+//		(or, with extents, the file has run out of them).
 //	-E_NO_MEM if we're out of memory.
 //	-E_INVAL if filebno is out of range.
 int
 file_map_block(struct File *f, uint32_t filebno, uint32_t *diskbno, bool alloc)
 {
 	int r;
-	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, alloc)) < 0)
-		return r;
-	if (*ptr == 0) {
-		if (alloc == 0)
+	if (f->f_flags & FILE_INLINE) {
+		if (!alloc)
 			return -E_NOT_FOUND;
-		if ((r = alloc_block()) < 0)
+		if ((r = file_uninline(f)) < 0)
 			return r;
-		*ptr = r;
 	}
-	*diskbno = *ptr;
-	return 0;
+	if (fs_extents)
+		return file_map_block_extent(f, filebno, diskbno, alloc);
+	return file_map_block_ptr(f, filebno, diskbno, alloc);
 }
 
 // Remove a block from file f.  If it's not there, just silently succeed.
@@ -393,7 +1833,172 @@ file_clear_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		txn_add(ptr);
+	}
+	return 0;
+}
+
+// Free the blocks that entries 'from' up to 'to' of the array of block
+// pointers 'a' point to.  Each entry is cleared before its block is
+// freed, since freeing may sync, and then nothing on disk may point at a
+// block the bitmap says is free.
+static void
+file_free_ptrs(uint32_t *a, uint32_t from, uint32_t to)
+{
+	uint32_t i, bno;
+
+	if (from >= to)
+		return;
+	txn_add(a);
+	for (i = from; i < to; i++)
+		if ((bno = a[i]) != 0) {
+			a[i] = 0;
+			free_block(bno);
+		}
+}
+
+// Free file blocks nblocks up to oldnblocks of a version 1 file, walking
+// each block of pointers once.
+static void
+file_truncate_ptrs(struct File *f, uint32_t nblocks, uint32_t oldnblocks)
+{
+	uint32_t *dblk, i, j, end;
+	char *blk;
+
+	file_free_ptrs(f->f_direct, nblocks, MIN(oldnblocks, NDIRECT));
+	if (oldnblocks > NDIRECT && f->f_indirect != 0) {
+		if (read_block(f->f_indirect, &blk) < 0)
+			panic("file_truncate_ptrs: indirect block unreadable");
+		file_free_ptrs((uint32_t*) blk, MAX(nblocks, NDIRECT),
+			       MIN(oldnblocks, NINDIRECT));
+	}
+	if (oldnblocks <= NINDIRECT || f->f_dindirect == 0)
+		return;
+	if (read_block(f->f_dindirect, &blk) < 0)
+		panic("file_truncate_ptrs: double-indirect block unreadable");
+	dblk = (uint32_t*) blk;
+	i = MAX(nblocks, NINDIRECT) - NINDIRECT;
+	end = MIN(oldnblocks, NINDIRECT + NDINDIRECT) - NINDIRECT;
+	for (; i < end; i = j) {
+		j = MIN(ROUNDDOWN(i, NINDIRECT) + NINDIRECT, end);
+		if (dblk[i / NINDIRECT] == 0)
+			continue;
+		if (read_block(dblk[i / NINDIRECT], &blk) < 0)
+			panic("file_truncate_ptrs: indirect block unreadable");
+		file_free_ptrs((uint32_t*) blk, i % NINDIRECT,
+			       (j - 1) % NINDIRECT + 1);
+	}
+}
+
+// Free the double-indirect block's indirect blocks that lie wholly at or
+// past file block nblocks, and the double-indirect block itself if the
+// file no longer reaches it.  Their data blocks are already gone.
+static void
+file_truncate_dindirect(struct File *f, uint32_t nblocks)
+{
+	uint32_t *dblk, i;
+	char *blk;
+
+	if (read_block(f->f_dindirect, &blk) < 0)
+		panic("file_truncate_dindirect: double-indirect block unreadable");
+	dblk = (uint32_t*) blk;
+	i = nblocks > NINDIRECT ? ROUNDUP(nblocks - NINDIRECT, NINDIRECT) / NINDIRECT : 0;
+	for (; i < NINDIRECT; i++)
+		if (dblk[i]) {
+			free_block(dblk[i]);
+			dblk[i] = 0;
+			txn_add(&dblk[i]);
+		}
+	if (nblocks <= NINDIRECT) {
+		free_block(f->f_dindirect);
+		f->f_dindirect = 0;
+		txn_add(f);
+	}
+}
+
+// Compressed files.
+//
+// fsformat -z compresses each block of a file on its own (inc/lz.h),
+// where that saves sectors in every block, and sets FILE_COMPRESSED.
+// The block map is as it would be, but a block keeps its stream at its
+// start (inc/fs.h), so reading it moves only the sectors the stream
+// takes: one to find the length, then the rest of them.  The stream is
+// decoded into the block's cache page, which from then on is the
+// file's block like any other, for reading and mapping.  Nothing writes
+// a compressed file: the first writer -- a write open, a truncation --
+// has it written back out decoded first (file_uncompress).
+
+static uint8_t packed_buf[FS_NFIBER + 1][BLKSIZE] __attribute__((aligned(PGSIZE)));
+static char unpacked_block[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Read compressed block blockno, and decode it into addr, where it must
+// come to size bytes.  Fibers sleep in the disk reads, so each has a
+// buffer for the stream, as has the mount, before there are any.
+static int
+block_inflate(uint32_t blockno, char *addr, uint32_t size)
+{
+	uint8_t *buf = packed_buf[fiber_self() + 1];
+	uint32_t len, nsect;
+	int r;
+
+	if ((r = disk_read(blockno * BLKSECTS, buf, 1)) < 0)
+		return r;
+	len = buf[0] | (buf[1] << 8);
+	if (len > PACKED_MAXLEN)
+		return -E_INVAL;
+	nsect = ROUNDUP(PACKED_HDRSIZE + len, SECTSIZE) / SECTSIZE;
+	if (nsect > 1
+	    && (r = disk_read(blockno * BLKSECTS + 1, buf + SECTSIZE, nsect - 1)) < 0)
+		return r;
+	if (lz_decode(buf + PACKED_HDRSIZE, len, (uint8_t *) addr, BLKSIZE) != (int) size) {
+		cprintf("fs: compressed block %08x is corrupt\n", blockno);
+		return -E_INVAL;
+	}
+	return 0;
+}
+
+// What block filebno of f decodes to, if f is compressed; 0 if it isn't.
+static uint32_t
+file_packed_size(struct File *f, uint32_t filebno)
+{
+	if (!(f->f_flags & FILE_COMPRESSED) || filebno * BLKSIZE >= f->f_size)
+		return 0;
+	return MIN(BLKSIZE, f->f_size - filebno * BLKSIZE);
+}
+
+// Write the blocks holding compressed file f's first 'size' bytes back
+// out decoded, where they are, and clear FILE_COMPRESSED.  A block in
+// the cache is decoded already; the rest go through a scratch page, so
+// that a file bigger than the cache needs none of it.  The caller has
+// the file system to itself (serve_is_shared), so no one reads a block
+// in while it changes under them.
+int
+file_uncompress(struct File *f, off_t size)
+{
+	uint32_t bno, diskbno;
+	char *src;
+	int r;
+
+	if (!(f->f_flags & FILE_COMPRESSED))
+		return 0;
+	for (bno = 0; bno < ROUNDUP(size, BLKSIZE) / BLKSIZE; bno++) {
+		if ((r = file_map_block(f, bno, &diskbno, 0)) == -E_NOT_FOUND)
+			continue;
+		if (r < 0)
+			return r;
+		src = diskaddr(diskbno);
+		if (!block_is_mapped(diskbno)) {
+			memset(unpacked_block, 0, BLKSIZE);
+			if ((r = block_inflate(diskbno, unpacked_block, file_packed_size(f, bno))) < 0)
+				return r;
+			src = unpacked_block;
+		}
+		snap_save(diskbno, 1);
+		if (disk_write(diskbno * BLKSECTS, src, BLKSECTS) < 0)
+			panic("file_uncompress: IDE write failed.");
 	}
+	f->f_flags &= ~FILE_COMPRESSED;
+	txn_add(f);
 	return 0;
 }
 
@@ -410,16 +2015,184 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 	// Hint: Use file_map_block and read_block.
 	// LAB 5: Your code here.
 
-    r = file_map_block(f, filebno, &diskbno, 1);
+    if (tmpfs_owns(f))
+        return tmpfs_get_block(f, filebno, blk);
+    // A worker can't allocate; a fiber will
+    r = file_map_block(f, filebno, &diskbno, !fs_in_worker());
+    if (r == -E_NOT_FOUND && fs_in_worker())
+        return -E_FS_RETRY;
     if (r < 0)
         return r;
-    r = read_block(diskbno, blk);
+    r = read_block_packed(diskbno, blk, file_packed_size(f, filebno));
     if (r < 0)
         return r;
     else
         return 0;
 }
 
+// A hole in a file reads as this block.  It sits in the bss and is never
+// written, so it's the kernel's zero page, read-only: whoever it's mapped
+// into can't write it either.
+static char zero_block[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Like file_get_block, for a caller that will only read the block: a
+// hole gets the zero block instead of a disk block of its own, so sparse
+// files stay sparse and reading them dirties no bitmap.
+int
+file_peek_block(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t diskbno;
+	int r;
+
+	if (tmpfs_owns(f))
+		return tmpfs_get_block(f, filebno, blk);
+	// Its block is lent out, so an inline file needs one
+	if ((f->f_flags & FILE_INLINE) && (r = file_uninline(f)) < 0)
+		return r;
+	if ((r = file_map_block(f, filebno, &diskbno, 0)) == -E_NOT_FOUND) {
+		*blk = zero_block;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+	return read_block_packed(diskbno, blk, file_packed_size(f, filebno));
+}
+
+// Multi-block I/O.
+//
+// Adjacent disk blocks are mostly adjacent in DISKMAP too, so a run of
+// them can move between disk and cache with a single IDE command of up
+// to 256 sectors.  Callers gather the blocks they want read or written into a
+// BlockRun with blockrun_add, in any order; each time the next block
+// doesn't extend the current run, the run is issued and a new one begun.
+// blockrun_flush issues whatever is left.
+
+#define BLOCKRUN_MAX	(256 / BLKSECTS)
+
+struct BlockRun {
+	uint32_t br_start;	// first block of the run
+	uint32_t br_len;	// blocks in the run, 0 if none
+	bool br_write;		// write back (else read in)
+};
+
+// Read the run of n disk blocks starting at blockno, none of them
+// mapped yet, into the cache with one IDE command.  If we can't map
+// them all, or someone else brings one in first, read as many as we
+// could map.
+static int
+read_block_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t i, j;
+	int r;
+
+	assert(n <= BLOCKRUN_MAX);
+	for (i = 0; i < n; i++)
+		if (bc_map_new(blockno + i, BC_IO_READ) != 0)
+			break;
+	if (i == 0)
+		return -E_NO_MEM;
+	r = disk_read(blockno * BLKSECTS, diskaddr(blockno), i * BLKSECTS);
+	if (r < 0) {
+		for (j = 0; j < i; j++)
+			bc_drop(blockno + j);
+		return r;
+	}
+	for (j = 0; j < i; j++)
+		bc_set_io(blockno + j, 0);
+	// as in read_block
+	if (sys_page_map_range(0, diskaddr(blockno), 0, diskaddr(blockno), i,
+			       PTE_U|PTE_P|PTE_AVAIL|PTE_W) < 0)
+		panic("read_block_run: Syscall page map failed.");
+	return 0;
+}
+
+// Like write_block for the run of n mapped blocks starting at blockno:
+// one IDE command writes them all, and one system call clears their
+// PTE_D bits.
+static void
+write_block_run(uint32_t blockno, uint32_t n)
+{
+	char *addr = diskaddr(blockno);
+	uint32_t i;
+
+	assert(n <= BLOCKRUN_MAX);
+	// As in write_block, the bitmap and PTE_D go before the data does
+	bitmap_flush();
+	if (sys_page_map_range(0, addr, 0, addr, n, PTE_U|PTE_P|PTE_AVAIL|PTE_W) < 0)
+		panic("write_block_run: Syscall page map failed.");
+	for (i = 0; i < n; i++)
+		bc_set_io(blockno + i, BC_IO_WRITE);
+	snap_save(blockno, n);
+	if (disk_write(blockno * BLKSECTS, addr, n * BLKSECTS) < 0)
+		panic("write_block_run: IDE write failed.");
+	for (i = 0; i < n; i++)
+		bc_set_io(blockno + i, 0);
+}
+
+static void
+blockrun_flush(struct BlockRun *run)
+{
+	if (run->br_len == 0)
+		return;
+	if (run->br_write)
+		write_block_run(run->br_start, run->br_len);
+	else
+		read_block_run(run->br_start, run->br_len);
+	run->br_len = 0;
+}
+
+static void
+blockrun_add(struct BlockRun *run, uint32_t blockno)
+{
+	// Metadata in the open transaction goes out through the journal
+	if (run->br_write && bc_in_txn(blockno)) {
+		blockrun_flush(run);
+		return;
+	}
+	// Keep blocks waiting to be written from being evicted meanwhile
+	if (run->br_write)
+		bc_touch(blockno);
+	// Past the DISKMAP window, a run stops where the pages wrap round
+	if (run->br_len > 0 && blockno == run->br_start + run->br_len
+	    && diskaddr(blockno) == diskaddr(run->br_start) + run->br_len * BLKSIZE
+	    && run->br_len < BLOCKRUN_MAX) {
+		run->br_len++;
+		return;
+	}
+	blockrun_flush(run);
+	run->br_start = blockno;
+	run->br_len = 1;
+}
+
+// Bring file blocks [filebno, filebno + n) of f into the cache before
+// anyone asks for them.  Blocks that are adjacent on disk (as files
+// written in one go mostly are) are read together, but for a compressed
+// file's, which are each read as far as their streams go.  Holes and
+// blocks already in the cache are skipped.  This is only a hint, so
+// errors are ignored.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	struct BlockRun run = { 0, 0, 0 };
+	uint32_t bno, end, diskbno;
+
+	if (tmpfs_owns(f))
+		return;
+	end = MIN(filebno + n, (uint32_t) ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (bno = filebno; bno < end; bno++) {
+		if (file_map_block(f, bno, &diskbno, 0) < 0 || block_is_mapped(diskbno)) {
+			// a gap ends the run
+			blockrun_flush(&run);
+			continue;
+		}
+		if (f->f_flags & FILE_COMPRESSED)
+			(void) read_block_packed(diskbno, NULL, file_packed_size(f, bno));
+		else
+			blockrun_add(&run, diskbno);
+	}
+	blockrun_flush(&run);
+}
+
 // Mark the offset/BLKSIZE'th block dirty in file f
 // by writing its first word to itself.  
 int
@@ -428,9 +2201,13 @@ file_dirty(struct File *f, off_t offset)
 	int r;
 	char *blk;
 
+	// Memory is as up to date as /tmp gets
+	if (tmpfs_owns(f))
+		return 0;
 	if ((r = file_get_block(f, offset/BLKSIZE, &blk)) < 0)
 		return r;
 	*(volatile char*)blk = *(volatile char*)blk;
+	bc_mark_dirty(diskblock(blk));
 	return 0;
 }
 
@@ -439,7 +2216,7 @@ int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, h, len;
 	char *blk;
 	struct File *f;
 
@@ -448,12 +2225,14 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
+	h = fs_namehash(name);
+	len = strlen(name);
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
-			if (strcmp(f[j].f_name, name) == 0) {
+			if (dir_name_is(&f[j], name, h, len)) {
 				*file = &f[j];
 				f[j].f_dir = dir;
 				return 0;
@@ -462,6 +2241,134 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
+// Path lookup cache.
+//
+// walk_path looks each path component up here before scanning the
+// directory.  An entry maps (directory, name) to the File, or to 0 for a
+// name the directory doesn't have.  Files live in directory blocks at a
+// fixed address, so the pointer stays good while the entry is cached even
+// if the block cache evicts the block; a hit reads the block back.
+// file_create and file_remove drop the entries they make wrong, and
+// truncating a directory drops all of its entries.  The exception is a
+// block past the DISKMAP window, whose page another block may take: its
+// entries go when it leaves the cache.
+//
+// Worker threads look names up here too, so the entries change and are
+// read under dcache_lock, which is never held across a block read: a
+// fiber may sleep in one, and bc_remove takes dcache_lock under bc_lock.
+
+#define NDCACHE		128
+
+struct Dentry {
+	struct File *d_dir;	// 0 if the entry is unused
+	struct File *d_file;	// 0 if d_dir has no such name
+	uint32_t d_hash;	// fs_namehash(d_name)
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDCACHE];
+static struct Mutex dcache_lock;
+
+static struct Dentry *
+dcache_slot(struct File *dir, uint32_t h)
+{
+	return &dcache[(((uintptr_t) dir / sizeof(struct File)) ^ h) % NDCACHE];
+}
+
+// dir_lookup through the cache.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	int r;
+	uint32_t h;
+	char *blk;
+	struct Dentry *d;
+	struct File *f;
+
+	h = fs_namehash(name);
+	d = dcache_slot(dir, h);
+	mutex_lock(&dcache_lock);
+	if (d->d_dir == dir && d->d_hash == h && strcmp(d->d_name, name) == 0) {
+		f = d->d_file;
+		mutex_unlock(&dcache_lock);
+		if (f == 0)
+			return -E_NOT_FOUND;
+		if ((r = read_block(diskblock(f), &blk)) == 0) {
+			f->f_dir = dir;
+			*file = f;
+			return 0;
+		}
+		if (r == -E_FS_RETRY)
+			return r;
+		mutex_lock(&dcache_lock);
+		if (d->d_dir == dir && d->d_file == f)
+			d->d_dir = 0;
+	}
+	mutex_unlock(&dcache_lock);
+
+	// dir_lookup may sleep; whoever has the slot by then loses it
+	if ((r = dir_lookup(dir, name, file)) < 0 && r != -E_NOT_FOUND)
+		return r;
+	mutex_lock(&dcache_lock);
+	d->d_dir = dir;
+	d->d_file = r == 0 ? *file : 0;
+	d->d_hash = h;
+	strcpy(d->d_name, name);
+	mutex_unlock(&dcache_lock);
+	return r;
+}
+
+// Forget what the cache says about name in dir.
+static void
+dcache_drop(struct File *dir, const char *name)
+{
+	struct Dentry *d;
+
+	d = dcache_slot(dir, fs_namehash(name));
+	mutex_lock(&dcache_lock);
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0)
+		d->d_dir = 0;
+	mutex_unlock(&dcache_lock);
+}
+
+// Forget every entry in dir, and dir itself.
+static void
+dcache_drop_dir(struct File *dir)
+{
+	int i;
+
+	mutex_lock(&dcache_lock);
+	for (i = 0; i < NDCACHE; i++)
+		if (dcache[i].d_dir == dir || dcache[i].d_file == dir)
+			dcache[i].d_dir = 0;
+	mutex_unlock(&dcache_lock);
+}
+
+// Drop the entries for Files in the block page at va, or in the
+// directory there.
+static void
+dcache_drop_page(void *va)
+{
+	int i;
+
+	mutex_lock(&dcache_lock);
+	for (i = 0; i < NDCACHE; i++)
+		if (ROUNDDOWN((char *) dcache[i].d_dir, BLKSIZE) == va
+		    || (dcache[i].d_file && ROUNDDOWN((char *) dcache[i].d_file, BLKSIZE) == va))
+			dcache[i].d_dir = 0;
+	mutex_unlock(&dcache_lock);
+}
+
+// Name the free File structure f, which dir_alloc_file found.
+static void
+dir_set_name(struct File *f, const char *name)
+{
+	strcpy(f->f_name, name);
+	f->f_namehash = fs_namehash(name);
+	f->f_namelen = strlen(name);
+	txn_add(f);
+}
+
 // Set *file to point at a free File structure in dir.
 int
 dir_alloc_file(struct File *dir, struct File **file)
@@ -485,6 +2392,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 			}
 	}
 	dir->f_size += BLKSIZE;
+	txn_add(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
@@ -540,7 +2448,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dcache_lookup(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -564,16 +2472,20 @@ int
 file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
+	const char *tmpname;
 	int r;
 	struct File *dir, *f;
 
+	if ((tmpname = tmpfs_path(path)))
+		return tmpfs_create(tmpname, pf);
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
 	if (dir_alloc_file(dir, &f) < 0)
 		return r;
-	strcpy(f->f_name, name);
+	dir_set_name(f, name);
+	dcache_drop(dir, name);
 	*pf = f;
 	return 0;
 }
@@ -586,6 +2498,9 @@ file_open(const char *path, struct File **pf)
 	// Hint: Use walk_path.
 	// LAB 5: Your code here.
     int r;
+    const char *tmpname;
+    if ((tmpname = tmpfs_path(path)))
+        return fs_in_worker() ? -E_FS_RETRY : tmpfs_open(tmpname, pf);
     r = walk_path(path, NULL, pf, NULL);
     if (r < 0)
         return r;
@@ -605,32 +2520,98 @@ file_open(const char *path, struct File **pf)
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t old_nblocks, new_nblocks;
 
 	// Hint: Use file_clear_block and/or free_block.
 	// LAB 5: Your code here.
     old_nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
     new_nblocks = ROUNDUP(newsize, BLKSIZE) / BLKSIZE;
-    for (bno = new_nblocks; bno < old_nblocks; bno++) 
-        file_clear_block(f, bno);
+    // The entries cached for a directory may be in the blocks going away
+    if (f->f_type == FTYPE_DIR)
+        dcache_drop_dir(f);
+    // Bytes past the end of an inline file are zero
+    if (f->f_flags & FILE_INLINE) {
+        if (newsize < FILE_INLINE_MAX)
+            memset(f->f_data + newsize, 0, FILE_INLINE_MAX - newsize);
+        txn_add(f);
+        return;
+    }
+    if (fs_extents) {
+        file_truncate_extents(f, new_nblocks);
+        free_pending_drop();
+        return;
+    }
+    file_truncate_ptrs(f, new_nblocks, old_nblocks);
     if (new_nblocks <= NDIRECT && f->f_indirect != 0) {
         free_block(f->f_indirect);
         f->f_indirect = 0;
+        txn_add(f);
     }
+    if (old_nblocks > NINDIRECT && f->f_dindirect != 0)
+        file_truncate_dindirect(f, new_nblocks);
+    // All the freed blocks' cache pages at once
+    free_pending_drop();
 }
 
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	int r;
+
+	if (tmpfs_owns(f))
+		return tmpfs_set_size(f, newsize);
+	// What's left of a compressed file is written decoded
+	if ((f->f_flags & FILE_COMPRESSED)
+	    && (r = file_uncompress(f, MIN(f->f_size, newsize))) < 0)
+		return r;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
+	else if ((f->f_flags & FILE_INLINE) && newsize > FILE_INLINE_MAX
+		 && (r = file_uninline(f)) < 0)
+		return r;
 	f->f_size = newsize;
-	if (f->f_dir)
+	txn_add(f);
+	// With a journal, the change goes at the next commit instead
+	if (f->f_dir && !fs_journal)
 		file_flush(f->f_dir);
 	return 0;
 }
 
+// Allocate the blocks of f from 'offset' up to 'offset + len' that it
+// hasn't got yet, all in one run if the disk has one that long, and make
+// f at least that long: for a writer that knows how much it will write.
+// The blocks read as zeros.
+int
+file_fallocate(struct File *f, off_t offset, off_t len)
+{
+	uint32_t bno, end, n, diskbno;
+	char *blk;
+	int r;
+
+	if (offset < 0 || len <= 0 || len > MAXFILESIZE - offset)
+		return -E_INVAL;
+	if (tmpfs_owns(f))
+		return offset + len > f->f_size ? tmpfs_set_size(f, offset + len) : 0;
+	end = ROUNDUP(offset + len, BLKSIZE) / BLKSIZE;
+	for (bno = offset / BLKSIZE, n = 0; bno < end; bno++)
+		if (file_map_block(f, bno, &diskbno, 0) == -E_NOT_FOUND)
+			n++;
+	if (n > 0 && (r = bitmap_find_run(n)) >= 0)
+		allocwin_set(f, r, n);
+	for (bno = offset / BLKSIZE; bno < end; bno++) {
+		if (file_map_block(f, bno, &diskbno, 0) == 0)
+			continue;
+		if ((r = file_get_block(f, bno, &blk)) < 0)
+			return r;
+		// A fresh block's page is zero, but the disk under it isn't
+		*(volatile char *) blk = 0;
+		bc_mark_dirty(diskblock(blk));
+	}
+	if (offset + len > f->f_size)
+		return file_set_size(f, offset + len);
+	return 0;
+}
+
 // Flush the contents of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
@@ -644,32 +2625,94 @@ file_flush(struct File *f)
 
     int r;
     uint32_t nblock, bno, diskbno;
+    struct BlockRun run = { 0, 0, 1 };
+    if (tmpfs_owns(f))
+        return;
     nblock = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
     for (bno = 0; bno < nblock; bno++) {
         r = file_map_block(f, bno, &diskbno, 0);
+        // A hole has nothing to write
+        if (r == -E_NOT_FOUND) {
+            blockrun_flush(&run);
+            continue;
+        }
         if (r < 0)
             panic("file_flush: File map block failed.");
+        // Dirty blocks that are adjacent on disk go out together
         if (block_is_dirty(diskbno))
-            write_block(diskbno);
+            blockrun_add(&run, diskbno);
+        else
+            blockrun_flush(&run);
     }
+    blockrun_flush(&run);
+}
+
+// Write back every dirty block, in disk order, so that blocks adjacent
+// on disk go out together, and then commit the open transaction.  Only
+// the dirty list and the cache's slots are looked at, never the whole
+// disk.  The caller runs alone (it's an exclusive request), since we
+// keep the list we took in a static array.
+void
+fs_flush(void)
+{
+	static uint32_t blocks[BCACHE_NBLOCKS];
+	struct BlockRun run = { 0, 0, 1 };
+	uint32_t b;
+	int i, j, n = 0;
+
+	bitmap_flush();
+	bc_harvest();
+	// Take the list; what gets dirty while we write goes on a new one
+	for (i = bc_dirty; i != -1; i = bcache[i].b_dnext) {
+		bcache[i].b_listed = 0;
+		b = bcache[i].b_blockno;
+		if (b == BC_EMPTY || !block_is_dirty(b))
+			continue;
+		// insertion sort: the list is short, and mostly runs
+		// backwards through blocks dirtied in order
+		for (j = n++; j > 0 && blocks[j - 1] > b; j--)
+			blocks[j] = blocks[j - 1];
+		blocks[j] = b;
+	}
+	bc_dirty = -1;
+	for (i = 0; i < n; i++)
+		if (block_is_dirty(blocks[i]))
+			blockrun_add(&run, blocks[i]);
+	blockrun_flush(&run);
+	journal_commit();
 }
 
 // Sync the entire file system.  A big hammer.
+// Blocks freed since last time are free on disk too when we're done,
+// but for any the journal held copies of, which are at the next commit.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 0; i < super->s_nblocks; i++)
-		if (block_is_dirty(i))
-			write_block(i);
+	int i, n;
+
+	free_pending_drop();
+	fs_flush();
+	if (fs_journal) {
+		// The commit freed blocks in the next transaction
+		journal_commit();
+		return;
+	}
+
+	// Nothing on disk points to the freed blocks now
+	n = nfree_pending;
+	nfree_pending = 0;
+	for (i = 0; i < n; i++)
+		bitmap_free_run(free_pending[i].fr_start, free_pending[i].fr_n);
+	bitmap_flush();
 }
 
 // Close a file.
 void
 file_close(struct File *f)
 {
+	allocwin_drop(f);
 	file_flush(f);
-	if (f->f_dir)
+	if (f->f_dir && !fs_journal)
 		file_flush(f->f_dir);
 }
 
@@ -678,15 +2721,24 @@ int
 file_remove(const char *path)
 {
 	int r;
-	struct File *f;
+	const char *tmpname;
+	struct File *dir, *f;
 
-	if ((r = walk_path(path, 0, &f, 0)) < 0)
+	if ((tmpname = tmpfs_path(path)))
+		return tmpfs_remove(tmpname);
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
 		return r;
 
+	dcache_drop(dir, f->f_name);
+	allocwin_drop(f);
 	file_truncate_blocks(f, 0);
 	f->f_name[0] = '\0';
+	f->f_namehash = 0;
+	f->f_namelen = 0;
+	f->f_flags = 0;
 	f->f_size = 0;
-	if (f->f_dir)
+	txn_add(f);
+	if (f->f_dir && !fs_journal)
 		file_flush(f->f_dir);
 
 	return 0;
@@ -1,38 +1,261 @@
 #include <inc/fs.h>
 #include <inc/lib.h>
+#include <inc/fiber.h>
+#include <inc/x86.h>
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
 
 /* Disk block n, when in memory, is mapped into the file system
- * server's address space at DISKMAP + (n*BLKSIZE). */
+ * server's address space at DISKMAP + (n*BLKSIZE), if the disk fits in
+ * the window; blocks past it share pages further up (see diskaddr). */
 #define DISKMAP		0x10000000
 
-/* Maximum disk size we can handle (3GB) */
+/* Size of the DISKMAP window (3GB) */
 #define DISKSIZE	0xC0000000
+#define DISKMAP_NBLOCKS	(DISKSIZE / BLKSIZE)
+
+/* The RAM file system's blocks are mapped from TMPMAP (see tmpfs.c), and
+ * the RAM disk's from RAMDISKMAP, up to RAMDISKSIZE of it (ramdisk.c) */
+#define TMPMAP		0xE0000000
+#define RAMDISKMAP	0xE2000000
+#define RAMDISKSIZE	0x0A000000
+
+/* Clients' request pages, which serv.c keeps, are mapped from CLIENTMAP */
+#define CLIENTMAP	0xEC000000
+
+/* Most disk blocks the server keeps in memory at once (see fs.c) */
+#ifndef BCACHE_NBLOCKS
+#define BCACHE_NBLOCKS	512
+#endif
+
+/* Use bus-master DMA for disk transfers when the controller can */
+#ifndef IDE_DMA
+#define IDE_DMA		1
+#endif
+
+/* Requests the server works on at once, each in its own fiber
+ * (lib/fiber.c) */
+#ifndef FS_NFIBER
+#define FS_NFIBER	8
+#endif
+
+/* Requests between runs of the write-back flusher (see serv.c), and
+ * the clock ticks without one after which it runs anyway */
+#ifndef FS_FLUSH_PERIOD
+#define FS_FLUSH_PERIOD	64
+#endif
+#ifndef FS_FLUSH_IDLE
+#define FS_FLUSH_IDLE	10
+#endif
+
+/* Blocks, of memory, the RAM file system at /tmp may hold (see tmpfs.c) */
+#ifndef TMPFS_NBLOCKS
+#define TMPFS_NBLOCKS	4096
+#endif
+
+/* Serve the file system from a copy of the disk in memory, loaded at
+ * startup, rather than from the disk itself */
+#ifndef FS_RAMDISK
+#define FS_RAMDISK	0
+#endif
+
+/* Hold the RAM disk in 4MB pages where the CPU has them (see ramdisk.c) */
+#ifndef RAMDISK_SUPER
+#define RAMDISK_SUPER	1
+#endif
+
+/* Run check_write_block and fs_test (test.c) at startup; 'make
+ * SELFTEST=1' sets it, as for the kernel's (kern/selftest.h) */
+#ifndef SELFTEST
+#define SELFTEST	0
+#endif
+
+/* Worker threads that serve opens and stats found in the cache, on
+ * other CPUs than the main loop's (see serv.c); 0 for none */
+#ifndef FS_NWORKER
+#define FS_NWORKER	3
+#endif
+
+/* Requests one client may have the server working on at once; more
+ * wait their turn (see serv.c) */
+#ifndef FS_CLIENT_NREQ
+#define FS_CLIENT_NREQ	2
+#endif
+
+/* Clients whose request pages the server keeps at once */
+#ifndef FS_NCLIENT
+#define FS_NCLIENT	256
+#endif
+
+/* Roll back to the disk's snapshot, if it has one, every time it's
+ * mounted (see snap.c) */
+#ifndef FS_SNAP_RESET
+#define FS_SNAP_RESET	0
+#endif
+
+/* Sleep on the disk interrupt instead of polling for it */
+#ifndef IDE_IRQ
+#define IDE_IRQ		1
+#endif
+
+/* Use a virtio block device (QEMU's -drive if=virtio) rather than the
+ * IDE disk, if there is one */
+#ifndef FS_VIRTIO
+#define FS_VIRTIO	1
+#endif
+
+/* Use the first AHCI controller's SATA disk rather than the IDE disk, if
+ * there is one (and no virtio disk) */
+#ifndef FS_AHCI
+#define FS_AHCI		1
+#endif
+
+/* The device the file system is on.  bd_init gets it ready, or returns
+ * < 0; bd_read and bd_write move sectors, at most 256 at a time.  A
+ * request that sleeps waits for IRQ bd_irq, which serve() passes on to
+ * bd_intr. */
+struct Bdev {
+	const char *bd_name;
+	int (*bd_init)(void);
+	int (*bd_read)(uint32_t secno, void *dst, size_t nsecs);
+	int (*bd_write)(uint32_t secno, const void *src, size_t nsecs);
+	int bd_irq;
+	void (*bd_intr)(void);
+};
+
+extern struct Bdev *bdev;	// set before fs_init; the IDE disk by default
+extern struct Bdev bdev_ide;
+extern struct Bdev bdev_ram;
+extern struct Bdev bdev_virtio;
+extern struct Bdev bdev_ahci;
+
+/* The physical address of mapped va, for a device to DMA to.  The file
+ * server has I/O privilege, so it isn't swapped and this stays good.
+ * The RAM disk may be in 4MB pages, which have no page table to look in
+ * (see ramdisk.c). */
+static inline physaddr_t
+va2pa(const void *va)
+{
+	if (vpd[VPD(va)] & PTE_PS)
+		return PTE_PS_ADDR(vpd[VPD(va)]) | ((uintptr_t) va & (PTSIZE - 1));
+	return PTE_ADDR(vpt[VPN(va)]) | PGOFF(va);
+}
+
+/* Are we one of serv.c's worker threads, rather than the main loop or
+ * one of its fibers?  Threads run on stacks of their own (inc/lib.h). */
+static inline bool
+fs_in_worker(void)
+{
+	uintptr_t esp = read_esp();
+
+	return esp >= UTHREADS && esp < UTHREADSTOP;
+}
+
+/* What the cache tells a worker that would have to wait for the disk,
+ * or change the file system: a fiber must serve the request instead.
+ * It never reaches a client. */
+#define E_FS_RETRY	(MAXERROR + 1)
+
+static inline int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return bdev->bd_read(secno, dst, nsecs);
+}
+
+static inline int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return bdev->bd_write(secno, src, nsecs);
+}
+
+/* Is f, a directory entry, named 'name', whose fs_namehash is h and
+ * whose length is len?  The hash, then the length, rule out nearly every
+ * other entry without a look at its name; the one that's left has its
+ * name compared a word at a time (memcmp), NUL and all.  An entry from
+ * before either was kept has 0 there, and only the name tells. */
+static inline bool
+dir_name_is(const struct File *f, const char *name, uint32_t h, uint32_t len)
+{
+	return (f->f_namehash == h || f->f_namehash == 0)
+		&& (f->f_namelen == len || f->f_namelen == 0)
+		&& memcmp(f->f_name, name, len + 1) == 0;
+}
 
 /* ide.c */
 bool	ide_probe_disk1(void);
+bool	ide_dma_init(void);
+bool	ide_irq_init(void);
+void	ide_intr(void);
 void	ide_set_disk(int diskno);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+uint32_t pci_conf_read(int bus, int dev, int func, int off);
+void	pci_conf_write(int bus, int dev, int func, int off, uint32_t v);
+
+/* virtio.c */
+bool	virtio_probe(void);
+
+/* ahci.c */
+bool	ahci_probe(void);
 
 /* fs.c */
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_peek_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_set_size(struct File *f, off_t newsize);
+int	file_fallocate(struct File *f, off_t offset, off_t len);
+int	file_uncompress(struct File *f, off_t size);
 void	file_flush(struct File *f);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 void	file_close(struct File *f);
 int	file_remove(const char *path);
 void	fs_init(void);
 int	file_dirty(struct File *f, off_t offset);
 void	fs_sync(void);
+void	fs_flush(void);
+bool	journal_full(void);
+struct Mutex *file_lock(struct File *f);
 
+extern struct Super *super;
 extern uint32_t *bitmap;
+uint32_t diskblock(void *va);
+uint32_t bc_new_epoch(void);
+void	bc_set_oldest(uint32_t epoch);
+void	bc_pin(void *va);
+void	bc_unpin(void *va);
+void	bc_mark_dirty(uint32_t blockno);
+int	bc_drop_all(void);
 int	map_block(uint32_t);
 int	alloc_block(void);
+int	alloc_block_num(struct File *f, uint32_t near);
+bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
+void	free_blocks(uint32_t start, uint32_t n);
+void	txn_add(void *va);
+
+/* snap.c */
+void	snap_save(uint32_t blockno, uint32_t n);
+bool	snap_mount(void);
+int	snap_take(uint32_t nstore);
+int	snap_rollback(void);
+int	snap_drop(void);
+int	snap_stat(void);
+
+/* tmpfs.c */
+extern uint32_t tmpfs_nused;
+void	tmpfs_init(void);
+bool	tmpfs_owns(struct File *f);
+const char *tmpfs_path(const char *path);
+int	tmpfs_open(const char *name, struct File **pf);
+int	tmpfs_create(const char *name, struct File **pf);
+int	tmpfs_remove(const char *name);
+int	tmpfs_get_block(struct File *f, uint32_t filebno, char **blk);
+int	tmpfs_set_size(struct File *f, off_t newsize);
 
 /* test.c */
 void	fs_test(void);
 
+/* serv.c */
+void	lease_revoke(void);
@@ -0,0 +1,480 @@
+/*
+ * JOS file system check
+ *
+ * Checks a disk image, as fsformat made it or the file server left it,
+ * in one pass over the mapped image: the superblock and the journal,
+ * then every file from the root down, claiming each block it uses for
+ * data, pointers or extents, and last the bitmap against the claims.
+ * The image is only read.  If the journal holds a transaction, which
+ * the file server writes home when it next mounts the disk, its blocks
+ * are checked as they will be then.
+ *
+ * Blocks marked in use that no file claims are only reported: crashes
+ * may leak blocks, and the file server allows for it.  Anything else
+ * amiss is an error, and the exit status is 1.
+ *
+ * Like the file server, fsck takes the image to be little-endian, as
+ * fsformat writes it.
+ */
+
+#include "fshost.h"
+
+#define OWNER_FS	1	// the superblock, bitmap and journal
+
+const char *imgname;
+bool verbose;
+
+uint8_t *disk;
+uint32_t nblocks;
+struct Super *super;
+uint32_t *bitmap;
+uint32_t nbitblock;
+struct JournalHeader *journal;	// the transaction to replay, or NULL
+
+// For each block, the number of the file that claimed it, or 0 if none
+// has; files are numbered from 2 in the order we meet them, and
+// names[n] is file n's path.
+uint32_t *owner;
+char **names;
+uint32_t nnames, maxnames;
+
+uint32_t nerrors;
+uint32_t nfiles, ndirs, nused;
+
+void
+bad(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", imgname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	nerrors++;
+}
+
+// The contents of block b, as the file server will find them.
+void *
+block(uint32_t b)
+{
+	uint32_t i;
+
+	if (journal)
+		for (i = 0; i < journal->j_nblocks; i++)
+			if (journal->j_blocks[i] == b)
+				return (uint8_t *) journal + (i + 1) * BLKSIZE;
+	return disk + b * BLKSIZE;
+}
+
+bool
+block_is_free(uint32_t b)
+{
+	return (bitmap[b / 32] & (1 << (b % 32))) != 0;
+}
+
+// Note that file number 'who' uses block b, for 'what'.  Returns 0 if
+// it can't have it.
+bool
+claim(uint32_t b, uint32_t who, const char *what)
+{
+	if (b >= nblocks) {
+		bad("%s: %s block %u is past the end of the disk", names[who], what, b);
+		return 0;
+	}
+	if (owner[b]) {
+		bad("%s: %s block %u is %s's too", names[who], what, b, names[owner[b]]);
+		return 0;
+	}
+	if (block_is_free(b))
+		bad("%s: %s block %u is marked free", names[who], what, b);
+	owner[b] = who;
+	nused++;
+	return 1;
+}
+
+// Check the disk's geometry, as super gives it.
+void
+check_super(uint32_t imgblocks)
+{
+	if (super->s_magic != FS_MAGIC) {
+		bad("bad file system magic number %08x", super->s_magic);
+		exit(1);
+	}
+	if (super->s_nblocks < 2 || super->s_nblocks > imgblocks) {
+		bad("superblock says %u blocks, the image has %u", super->s_nblocks, imgblocks);
+		exit(1);
+	}
+	nblocks = super->s_nblocks;
+	if (super->s_version > FS_VERSION)
+		bad("file system version %u is too new", super->s_version);
+	nbitblock = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	if (2 + nbitblock > nblocks) {
+		bad("no room for the bitmap");
+		exit(1);
+	}
+	if (super->s_njournal != 0
+	    && (super->s_njournal < 2 || super->s_njournal > JOURNAL_MAXBLOCKS
+		|| super->s_journal < 2 + nbitblock
+		|| super->s_journal + super->s_njournal > nblocks)) {
+		bad("bad journal at block %u, %u blocks", super->s_journal, super->s_njournal);
+		exit(1);
+	}
+}
+
+// Claim the snapshot's header and area, if the disk has a snapshot.
+// It only tells how to roll back, which fsck doesn't check.
+void
+claim_snapshot(void)
+{
+	struct SnapHeader *sh;
+	uint32_t i, j;
+
+	if (super->s_snap == 0)
+		return;
+	if (!claim(super->s_snap, OWNER_FS, "snapshot header"))
+		return;
+	sh = (struct SnapHeader *) (disk + super->s_snap * BLKSIZE);
+	if (sh->sh_magic != SNAP_MAGIC || sh->sh_nrun > SNAP_MAXRUN) {
+		bad("bad snapshot header at block %u", super->s_snap);
+		return;
+	}
+	for (i = 0; i < sh->sh_nrun; i++)
+		for (j = 0; j < sh->sh_run[i].e_len; j++)
+			if (!claim(sh->sh_run[i].e_start + j, OWNER_FS, "snapshot"))
+				break;
+}
+
+// Claim the blocks nobody but the file system itself may use.
+void
+claim_reserved(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < 2 + nbitblock; i++)
+		claim(i, OWNER_FS, i < 2 ? "reserved" : "bitmap");
+	for (i = 0; i < super->s_njournal; i++)
+		claim(super->s_journal + i, OWNER_FS, "journal");
+	claim_snapshot();
+}
+
+// Find the transaction the file server would replay, if any.
+void
+check_journal(void)
+{
+	struct JournalHeader *jh;
+	uint32_t i, j, b;
+
+	if (super->s_njournal == 0)
+		return;
+	jh = (struct JournalHeader *) (disk + super->s_journal * BLKSIZE);
+	if (jh->j_magic != JOURNAL_MAGIC || jh->j_nblocks == 0)
+		return;
+	if (jh->j_nblocks >= super->s_njournal || journal_sum(jh) != jh->j_sum) {
+		if (verbose)
+			printf("%s: transaction %u in the journal is torn, ignored\n",
+			       imgname, jh->j_seq);
+		return;
+	}
+	for (i = 0; i < jh->j_nblocks; i++) {
+		b = jh->j_blocks[i];
+		if (b < 1 || b >= nblocks
+		    || (b >= super->s_journal && b < super->s_journal + super->s_njournal)) {
+			// The file server would panic rather than replay it
+			bad("journal: transaction %u has bad block %u", jh->j_seq, b);
+			return;
+		}
+		for (j = 0; j < i; j++)
+			if (jh->j_blocks[j] == b)
+				bad("journal: transaction %u has block %u twice", jh->j_seq, b);
+	}
+	if (verbose)
+		printf("%s: transaction %u, %u blocks, is to be replayed\n",
+		       imgname, jh->j_seq, jh->j_nblocks);
+	journal = jh;
+}
+
+// Claim a file's data block b, its block number filebno.  'nblk' is how
+// many blocks its size gives it; 'blocks', if not NULL, gets the disk
+// block numbers, so that directories can be read.
+void
+claim_data(uint32_t b, uint32_t filebno, uint32_t nblk, uint32_t who, uint32_t *blocks)
+{
+	if (filebno >= nblk) {
+		bad("%s: block %u is past the end of the file", names[who], filebno);
+		return;
+	}
+	if (claim(b, who, "data") && blocks)
+		blocks[filebno] = b;
+}
+
+// The blocks of a version 1 file: direct, indirect and double-indirect.
+void
+check_blockptrs(struct File *f, uint32_t nblk, uint32_t who, uint32_t *blocks)
+{
+	uint32_t i, j, *ind, *dind;
+
+	for (i = 0; i < NDIRECT; i++)
+		if (f->f_direct[i])
+			claim_data(f->f_direct[i], i, nblk, who, blocks);
+	// Entries below NDIRECT of the indirect block go unused
+	if (f->f_indirect && claim(f->f_indirect, who, "indirect")) {
+		ind = block(f->f_indirect);
+		for (i = NDIRECT; i < NINDIRECT; i++)
+			if (ind[i])
+				claim_data(ind[i], i, nblk, who, blocks);
+	}
+	if (f->f_dindirect && claim(f->f_dindirect, who, "double-indirect")) {
+		dind = block(f->f_dindirect);
+		for (j = 0; j < NINDIRECT; j++) {
+			if (dind[j] == 0 || !claim(dind[j], who, "indirect"))
+				continue;
+			ind = block(dind[j]);
+			for (i = 0; i < NINDIRECT; i++)
+				if (ind[i])
+					claim_data(ind[i], NINDIRECT + j * NINDIRECT + i,
+						   nblk, who, blocks);
+		}
+	}
+}
+
+// The blocks of a version 2 file: its extents, in order and apart.
+void
+check_extents(struct File *f, uint32_t nblk, uint32_t who, uint32_t *blocks)
+{
+	struct Extent *e, *ext = NULL;
+	uint32_t i, j, end = 0;
+
+	if (f->f_nextent > NEXTENT_INLINE + NEXTENT_BLOCK) {
+		bad("%s: %u extents", names[who], f->f_nextent);
+		return;
+	}
+	if (f->f_extblk && claim(f->f_extblk, who, "extent"))
+		ext = block(f->f_extblk);
+	if (f->f_nextent > NEXTENT_INLINE && ext == NULL) {
+		bad("%s: %u extents, but no extent block", names[who], f->f_nextent);
+		return;
+	}
+	for (i = 0; i < f->f_nextent; i++) {
+		e = i < NEXTENT_INLINE ? &f->f_extent[i] : &ext[i - NEXTENT_INLINE];
+		if (e->e_len == 0 || e->e_fileblk < end
+		    || e->e_fileblk + e->e_len < e->e_fileblk
+		    || e->e_start + e->e_len < e->e_start) {
+			bad("%s: bad extent %u: blocks %u+%u at %u", names[who],
+			    i, e->e_fileblk, e->e_len, e->e_start);
+			return;
+		}
+		for (j = 0; j < e->e_len; j++)
+			claim_data(e->e_start + j, e->e_fileblk + j, nblk, who, blocks);
+		end = e->e_fileblk + e->e_len;
+	}
+}
+
+void check_file(struct File *f, const char *path);
+
+// Check the entries of directory 'who', whose blocks are 'blocks'.
+void
+check_dir(uint32_t who, uint32_t *blocks, uint32_t nblk)
+{
+	struct File *f, *g;
+	uint32_t i, j, k, l;
+	char *path;
+	size_t len;
+
+	for (i = 0; i < nblk; i++) {
+		// A hole reads as a block of empty entries
+		if (blocks[i] == 0)
+			continue;
+		f = block(blocks[i]);
+		for (j = 0; j < BLKFILES; j++) {
+			if (f[j].f_name[0] == '\0')
+				continue;
+			len = strnlen(f[j].f_name, MAXNAMELEN);
+			if (len == MAXNAMELEN || strchr(f[j].f_name, '/')) {
+				bad("%s: bad name in entry %u of block %u", names[who], j, blocks[i]);
+				continue;
+			}
+			// Names seen already, in this block and the ones before
+			for (k = 0; k <= i; k++) {
+				if (blocks[k] == 0)
+					continue;
+				g = block(blocks[k]);
+				for (l = 0; l < (k < i ? BLKFILES : j); l++)
+					if (strcmp(g[l].f_name, f[j].f_name) == 0)
+						bad("%s: %s is there twice", names[who], f[j].f_name);
+			}
+			path = malloc(strlen(names[who]) + len + 2);
+			sprintf(path, "%s%s%s", names[who],
+				strcmp(names[who], "/") == 0 ? "" : "/", f[j].f_name);
+			check_file(&f[j], path);
+		}
+	}
+}
+
+// Each block of a compressed file must decode to its part of the file.
+void
+check_packed(uint32_t *blocks, uint32_t nblk, struct File *f, const char *path)
+{
+	static uint8_t buf[BLKSIZE];
+	uint32_t i, len, size;
+	uint8_t *p;
+
+	for (i = 0; i < nblk; i++) {
+		if (blocks[i] == 0)
+			continue;
+		p = block(blocks[i]);
+		len = p[0] | (p[1] << 8);
+		size = i + 1 < nblk ? BLKSIZE : f->f_size - i * BLKSIZE;
+		if (len > PACKED_MAXLEN
+		    || lz_decode(p + PACKED_HDRSIZE, len, buf, BLKSIZE) != (int) size)
+			bad("%s: compressed block %u doesn't decode", path, i);
+	}
+}
+
+void
+check_file(struct File *f, const char *path)
+{
+	uint32_t who, nblk, *blocks = NULL;
+
+	if (nnames == maxnames) {
+		maxnames *= 2;
+		if ((names = realloc(names, maxnames * sizeof(char *))) == NULL) {
+			perror("fsck");
+			exit(2);
+		}
+	}
+	who = nnames++;
+	names[who] = (char *) path;
+	if (f->f_namehash != 0 && f->f_namehash != fs_namehash(f->f_name))
+		bad("%s: name hash %08x is wrong", path, f->f_namehash);
+	if (f->f_namelen != 0 && f->f_namelen != strnlen(f->f_name, MAXNAMELEN))
+		bad("%s: name length %u is wrong", path, f->f_namelen);
+	if ((int32_t) f->f_size < 0 || f->f_size > MAXFILESIZE) {
+		bad("%s: size %d", path, f->f_size);
+		return;
+	}
+	// An inline file has its data here, and no blocks
+	if (f->f_flags & FILE_INLINE) {
+		if (f->f_type != FTYPE_REG)
+			bad("%s: inline, but file type %u", path, f->f_type);
+		else if (f->f_size > FILE_INLINE_MAX)
+			bad("%s: inline, but size %u", path, f->f_size);
+		else if (f->f_flags & FILE_COMPRESSED)
+			bad("%s: inline and compressed", path);
+		else
+			nfiles++;
+		return;
+	}
+	nblk = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	if ((f->f_flags & FILE_COMPRESSED) && f->f_type != FTYPE_REG)
+		bad("%s: compressed, but file type %u", path, f->f_type);
+	else if (f->f_flags & FILE_COMPRESSED)
+		blocks = calloc(nblk, sizeof(uint32_t));
+	if (f->f_type == FTYPE_DIR) {
+		ndirs++;
+		if (f->f_size % BLKSIZE != 0)
+			bad("%s: directory size %u isn't whole blocks", path, f->f_size);
+		blocks = calloc(nblk, sizeof(uint32_t));
+	} else if (f->f_type == FTYPE_REG)
+		nfiles++;
+	else {
+		bad("%s: file type %u", path, f->f_type);
+		return;
+	}
+
+	if (super->s_version == FS_VERSION_EXTENT)
+		check_extents(f, nblk, who, blocks);
+	else
+		check_blockptrs(f, nblk, who, blocks);
+
+	// Only blocks claimed here are read, so a directory can't turn
+	// up inside itself
+	if (blocks && f->f_type == FTYPE_DIR)
+		check_dir(who, blocks, nblk);
+	else if (blocks)
+		check_packed(blocks, nblk, f, path);
+	free(blocks);
+}
+
+void
+check_bitmap(void)
+{
+	uint32_t b, nleaked = 0;
+
+	for (b = 0; b < nblocks; b++)
+		if (!owner[b] && !block_is_free(b))
+			nleaked++;
+	if (nleaked)
+		printf("%s: %u blocks marked in use belong to no file\n", imgname, nleaked);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: fsck [-v] fs.img\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size;
+	uint32_t one = 1, imgblocks;
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 2)
+		usage();
+	imgname = argv[1];
+	if (*(uint8_t *) &one != 1) {
+		fprintf(stderr, "fsck: needs a little-endian host\n");
+		exit(2);
+	}
+
+	if ((disk = image_map(imgname, &size, 0)) == NULL) {
+		fprintf(stderr, "%s: %s\n", imgname, strerror(errno));
+		exit(2);
+	}
+	imgblocks = size / BLKSIZE;
+	if (imgblocks < 2) {
+		bad("too small for a file system");
+		exit(1);
+	}
+
+	// Where the journal is comes from the superblock on disk; the rest
+	// from the one the file server will find, if the journal has it
+	super = (struct Super *) (disk + BLKSIZE);
+	check_super(imgblocks);
+	check_journal();
+	if (journal) {
+		super = (struct Super *) block(1);
+		check_super(imgblocks);
+	}
+	bitmap = (uint32_t *) block(2);
+
+	owner = calloc(nblocks, sizeof(uint32_t));
+	maxnames = 64;
+	names = calloc(maxnames, sizeof(char *));
+	if (owner == NULL || names == NULL) {
+		perror("fsck");
+		exit(2);
+	}
+	names[OWNER_FS] = "the file system";
+	nnames = OWNER_FS + 1;
+	claim_reserved();
+
+	check_file(&super->s_root, "/");
+	if (strcmp(super->s_root.f_name, "/") != 0)
+		bad("/: root directory is named %.*s", MAXNAMELEN, super->s_root.f_name);
+	if (super->s_root.f_type != FTYPE_DIR)
+		bad("/: root isn't a directory");
+	check_bitmap();
+
+	if (verbose)
+		printf("%s: %u files, %u directories, %u of %u blocks in use\n",
+		       imgname, nfiles, ndirs, nused, nblocks);
+	return nerrors ? 1 : 0;
+}
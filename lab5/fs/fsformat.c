@@ -1,76 +1,59 @@
 /*
  * JOS file system format
+ *
+ * The image is built in place, mapped from the image file, in one pass
+ * over the files that go on it.  A file's size is known from stat
+ * before it's read, so it gets one run of blocks, read straight into
+ * the image, with any pointer blocks after the run; a directory's
+ * entries are counted before the first goes in, so its blocks are a
+ * run too.  In the version 2 layout every file is then a single
+ * extent, which the file server reads ahead sequentially; files small
+ * enough to fit in their struct File go there instead.  With -z, a
+ * file's blocks are compressed where they are, if each of them then
+ * takes fewer sectors, so that reading it moves fewer.  Blocks are
+ * handed out in order, so the bitmap is left till last: everything
+ * below nextb is in use, the rest is free.
  */
 
-#define _BSD_EXTENSION
-
-// We don't actually want to define off_t!
-#define off_t xxx_off_t
-#define bool xxx_bool
-#include <stdio.h>
-#include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <inttypes.h>
-#include <sys/stat.h>
-#include <string.h>
-#include <assert.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <dirent.h>
-#include <limits.h>
-#undef off_t
-#undef bool
-
-// Prevent inc/types.h, included from inc/fs.h,
-// from attempting to redefine types defined in the host's inttypes.h.
-#define JOS_INC_TYPES_H
-// Typedef the types that inc/mmu.h needs.
-typedef uint32_t physaddr_t;
-typedef uint32_t off_t;
-typedef int bool;
-
-#include <inc/mmu.h>
-#include <inc/fs.h>
-
-#define nelem(x)	(sizeof(x) / sizeof((x)[0]))
+#include "fshost.h"
+
 typedef struct Super Super;
 typedef struct File File;
 
-struct Super super;
-int diskfd;
+uint8_t *disk;			// the image
+uint8_t *btype;			// BLOCK_* of each block, for swizzling
+struct Super *super;
 uint32_t nblocks;
 uint32_t nbitblock;
 uint32_t nextb;
+uint32_t version = FS_VERSION;
+uint32_t njournal = JOURNAL_NBLOCKS;
+int compress;			// -z
 
 enum {
+	BLOCK_FILE,		// data, left alone
 	BLOCK_SUPER,
 	BLOCK_DIR,
-	BLOCK_FILE,
-	BLOCK_BITS
+	BLOCK_BITS		// words: bitmap, pointer and extent blocks
 };
 
-struct Block
-{
-	uint32_t busy;
-	uint32_t bno;
-	uint32_t used;
-	uint8_t buf[BLKSIZE];
-	uint32_t type;
+// A directory being filled in
+struct Dir {
+	struct File *d_file;
+	uint32_t d_nent;	// entries so far
 };
 
-struct Block cache[16];
-
 ssize_t
 readn(int f, void *av, size_t n)
 {
 	uint8_t *a;
 	size_t t;
+	ssize_t m;
 
 	a = av;
 	t = 0;
 	while (t < n) {
-		size_t m = read(f, a + t, n - t);
+		m = read(f, a + t, n - t);
 		if (m <= 0) {
 			if (t == 0)
 				return m;
@@ -105,267 +88,403 @@ swizzlefile(struct File *f)
 		return;
 	swizzle((uint32_t*) &f->f_size);
 	swizzle(&f->f_type);
-	for (i = 0; i < NDIRECT; i++)
-		swizzle(&f->f_direct[i]);
-	swizzle(&f->f_indirect);
+	swizzle(&f->f_namehash);
+	swizzle(&f->f_namelen);
+	// Its data is bytes, and the flag must be read before it's swizzled
+	if (f->f_flags & FILE_INLINE) {
+		swizzle(&f->f_flags);
+		return;
+	}
+	swizzle(&f->f_flags);
+	if (version == FS_VERSION_EXTENT) {
+		for (i = 0; i < NEXTENT_INLINE; i++) {
+			swizzle(&f->f_extent[i].e_fileblk);
+			swizzle(&f->f_extent[i].e_start);
+			swizzle(&f->f_extent[i].e_len);
+		}
+		swizzle(&f->f_extblk);
+		swizzle(&f->f_nextent);
+	} else {
+		for (i = 0; i < NDIRECT; i++)
+			swizzle(&f->f_direct[i]);
+		swizzle(&f->f_indirect);
+		swizzle(&f->f_dindirect);
+	}
+}
+
+// Block bno of the image.
+void *
+diskblk(uint32_t bno)
+{
+	return disk + (size_t) bno * BLKSIZE;
 }
 
 void
-swizzleblock(struct Block *b)
+swizzleblock(uint32_t bno)
 {
 	int i;
 	struct Super *s;
 	struct File *f;
 	uint32_t *u;
 
-	switch (b->type) {
+	switch (btype[bno]) {
 	case BLOCK_SUPER:
-		s = (struct Super*) b->buf;
+		s = (struct Super*) diskblk(bno);
 		swizzle(&s->s_magic);
 		swizzle(&s->s_nblocks);
 		swizzlefile(&s->s_root);
+		swizzle(&s->s_version);
+		swizzle(&s->s_journal);
+		swizzle(&s->s_njournal);
+		swizzle(&s->s_snap);
 		break;
 	case BLOCK_DIR:
-		f = (struct File*) b->buf;
+		f = (struct File*) diskblk(bno);
 		for (i = 0; i < BLKFILES; i++)
 			swizzlefile(f + i);
 		break;
 	case BLOCK_BITS:
-		u = (uint32_t*) b->buf;
+		u = (uint32_t*) diskblk(bno);
 		for (i = 0; i < BLKSIZE / 4; i++)
 			swizzle(u + i);
 		break;
 	}
 }
 
-void
-flushb(struct Block *b)
+// Allocate n blocks in a row for 'type', returning the first.  The
+// image starts out zeroed, so they are clear.
+uint32_t
+allocblks(uint32_t n, uint32_t type)
 {
-	swizzleblock(b);
-	if (lseek(diskfd, b->bno * BLKSIZE, 0) < 0
-	    || write(diskfd, b->buf, BLKSIZE) != BLKSIZE) {
-		perror("flushb");
-		fprintf(stderr, "\n");
+	uint32_t bno = nextb;
+
+	if (n > nblocks - nextb) {
+		fprintf(stderr, "disk full: %u blocks, %u more wanted\n", nblocks, n);
 		abort();
 	}
-	swizzleblock(b);
+	memset(btype + bno, type, n);
+	nextb += n;
+	return bno;
 }
 
-struct Block*
-getblk(uint32_t bno, int clr, uint32_t type)
+void
+opendisk(const char *name)
 {
-	int i, least;
-	static int t = 1;
-	struct Block *b;
+	size_t size = (size_t) nblocks * BLKSIZE;
 
-	if (bno >= nblocks) {
-		fprintf(stderr, "attempt to access past end of disk bno=%d\n", bno);
+	if ((disk = image_map(name, &size, 1)) == NULL) {
+		fprintf(stderr, "open %s: ", name);
+		perror("");
+		fprintf(stderr, "\n");
 		abort();
 	}
-
-	least = -1;
-	for (i = 0; i < nelem(cache); i++) {
-		if (cache[i].bno == bno) {
-			b = &cache[i];
-			goto out;
-		}
-		if (!cache[i].busy
-		    && (least == -1 || cache[i].used < cache[least].used))
-			least = i;
-	}
-
-	if (least == -1) {
-		fprintf(stderr, "panic: block cache full\n");
+	if ((btype = calloc(nblocks, 1)) == NULL) {
+		perror("fsformat");
 		abort();
 	}
 
-	b = &cache[least];
-	if (b->used)
-		flushb(b);
+	nextb = 2;
+	btype[1] = BLOCK_SUPER;
+	nbitblock = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	allocblks(nbitblock, BLOCK_BITS);
 
-	if (lseek(diskfd, bno*BLKSIZE, 0) < 0
-	    || readn(diskfd, b->buf, BLKSIZE) != BLKSIZE) {
-		fprintf(stderr, "read block %d: ", bno);
-		perror("");
-		fprintf(stderr, "\n");
-		abort();
-	}
-	b->bno = bno;
-	if (!clr)
-		swizzleblock(b);
-
-out:
-	if (clr)
-		memset(b->buf, 0, sizeof(b->buf));
-	b->used = ++t;
-	if (b->busy) {
-		fprintf(stderr, "panic: block #%d is busy\n", b->bno);
+	// The journal follows the bitmap.  Zeroed, it holds no transaction.
+	if (nextb + njournal >= nblocks) {
+		fprintf(stderr, "no room for a %d-block journal\n", njournal);
 		abort();
 	}
-	/* it is important to reset b->type in case we reuse a block for a
-	 * different purpose while it is still in the cache - this can happen
-	 * for example if a file ends exactly on a block boundary */
-	b->type = type;
-	b->busy = 1;
-	return b;
+	super = (struct Super*) diskblk(1);
+	if (njournal > 0)
+		super->s_journal = allocblks(njournal, BLOCK_FILE);
+	super->s_njournal = njournal;
+
+	super->s_magic = FS_MAGIC;
+	super->s_nblocks = nblocks;
+	super->s_version = version;
+	super->s_root.f_type = FTYPE_DIR;
+	strcpy(super->s_root.f_name, "/");
 }
 
+// Give f the nblk blocks from 'start' on, adding the pointer blocks the
+// version 1 layout needs after them.
 void
-putblk(struct Block *b)
+setblocks(struct File *f, uint32_t start, uint32_t nblk)
 {
-	b->busy = 0;
-}
+	uint32_t i, j, *ind, *dind;
 
-void
-opendisk(const char *name)
-{
-	int i, r;
-	struct Block *b;
-
-	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0) {
-		fprintf(stderr, "open %s: ", name);
-		perror("");
-		fprintf(stderr, "\n");
-		abort();
+	if (nblk == 0)
+		return;
+	if (version == FS_VERSION_EXTENT) {
+		f->f_extent[0].e_fileblk = 0;
+		f->f_extent[0].e_start = start;
+		f->f_extent[0].e_len = nblk;
+		f->f_nextent = 1;
+		return;
 	}
-
-	if ((r = ftruncate(diskfd, 0)) < 0
-	    || (r = ftruncate(diskfd, nblocks * BLKSIZE)) < 0) {
-		fprintf(stderr, "truncate %s: ", name);
-		perror("");
-		abort();
+	for (i = 0; i < nblk && i < NDIRECT; i++)
+		f->f_direct[i] = start + i;
+	if (nblk > NDIRECT) {
+		f->f_indirect = allocblks(1, BLOCK_BITS);
+		ind = diskblk(f->f_indirect);
+		for (i = NDIRECT; i < nblk && i < NINDIRECT; i++)
+			ind[i] = start + i;
 	}
-
-	nbitblock = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
-	for (i = 0; i < nbitblock; i++){
-		b = getblk(2 + i, 0, BLOCK_BITS);
-		memset(b->buf, 0xFF, BLKSIZE);
-		putblk(b);
+	if (nblk > NINDIRECT) {
+		f->f_dindirect = allocblks(1, BLOCK_BITS);
+		dind = diskblk(f->f_dindirect);
+		for (i = NINDIRECT; i < nblk; i++) {
+			j = (i - NINDIRECT) / NINDIRECT;
+			if (dind[j] == 0)
+				dind[j] = allocblks(1, BLOCK_BITS);
+			ind = diskblk(dind[j]);
+			ind[(i - NINDIRECT) % NINDIRECT] = start + i;
+		}
 	}
+}
 
-	nextb = 2 + nbitblock;
+// The disk block holding block nblk of a file setblocks laid out.
+uint32_t
+fileblk(struct File *f, uint32_t nblk)
+{
+	uint32_t *ind;
 
-	super.s_magic = FS_MAGIC;
-	super.s_nblocks = nblocks;
-	super.s_root.f_type = FTYPE_DIR;
-	strcpy(super.s_root.f_name, "/");
+	if (version == FS_VERSION_EXTENT)
+		return f->f_extent[0].e_start + nblk;
+	if (nblk < NDIRECT)
+		return f->f_direct[nblk];
+	if (nblk < NINDIRECT)
+		return ((uint32_t*) diskblk(f->f_indirect))[nblk];
+	nblk -= NINDIRECT;
+	ind = diskblk(((uint32_t*) diskblk(f->f_dindirect))[nblk / NINDIRECT]);
+	return ind[nblk % NINDIRECT];
 }
 
+// Make f a directory with room for nent entries, all in one run.
 void
-storeblk(struct File *f, struct Block *b, int nblk)
+makedir(struct File *f, uint32_t nent, struct Dir *d)
 {
-	if (nblk < NDIRECT)
-		f->f_direct[nblk] = b->bno;
-	else if (nblk < NINDIRECT) {
-		struct Block *bindir;
-		if (f->f_indirect == 0) {
-			bindir = getblk(nextb++, 1, BLOCK_BITS);
-			f->f_indirect = bindir->bno;
-		} else
-			bindir = getblk(f->f_indirect, 0, BLOCK_BITS);
-		((uint32_t*)bindir->buf)[nblk] = b->bno;
-		putblk(bindir);
-	} else {
-		fprintf(stderr, "file too large\n");
-		abort();
-	}
+	uint32_t nblk = (nent + BLKFILES - 1) / BLKFILES;
+
+	f->f_type = FTYPE_DIR;
+	setblocks(f, allocblks(nblk, BLOCK_DIR), nblk);
+	f->f_size = nblk * BLKSIZE;
+	d->d_file = f;
+	d->d_nent = 0;
 }
 
 struct File *
-allocfile(struct File *dirf, const char *name, struct Block **dirb)
+allocfile(struct Dir *d, const char *name)
 {
 	struct File *ino;
-	int nblk, i;
-
-	nblk = (int)((dirf->f_size + BLKSIZE - 1) / BLKSIZE) - 1;
-	if (nblk >= NDIRECT) {
-		struct Block *idirb = getblk(dirf->f_indirect, 0, BLOCK_BITS);
-		*dirb = getblk(((uint32_t*)idirb->buf) [nblk], 0, BLOCK_DIR);
-		putblk(idirb);
-	} else if (nblk >= 0)
-		*dirb = getblk(dirf->f_direct[nblk], 0, BLOCK_DIR);
-	else
-		goto new_dirb;
-
-	ino = (struct File *) (*dirb)->buf;
-	for (i = 0; i < BLKFILES; i++)
-		if (ino[i].f_name[0] == '\0') {
-			ino = &ino[i];
-			goto gotit;
-		}
+	uint32_t i = d->d_nent++;
 
-	putblk(*dirb);
-
-new_dirb:
-	*dirb = getblk(nextb++, 1, BLOCK_DIR);
-	storeblk(dirf, *dirb, ++nblk);
-	dirf->f_size += BLKSIZE;
-	assert((nblk + 1) * BLKSIZE == dirf->f_size);
-	
-	ino = (struct File *) (*dirb)->buf;
-	
-gotit:
+	assert(i < d->d_file->f_size / BLKSIZE * BLKFILES);
+	ino = (struct File*) diskblk(fileblk(d->d_file, i / BLKFILES)) + i % BLKFILES;
 	strcpy(ino->f_name, name);
+	ino->f_namehash = fs_namehash(name);
+	ino->f_namelen = strlen(name);
 	return ino;
 }
 
+const char *
+lastelem(const char *name)
+{
+	const char *last = strrchr(name, '/');
+
+	return last ? last + 1 : name;
+}
+
 void
-writefile(struct File *dirf, const char *name)
+writefile(struct Dir *d, const char *name)
 {
 	int fd;
-	const char *last;
 	File *f;
-	int n, nblk;
-	struct Block *dirb, *b;
+	struct stat s;
+	uint32_t nblk, start;
 
-	if ((fd = open(name, O_RDONLY)) < 0) {
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &s) < 0) {
 		fprintf(stderr, "open %s:", name);
 		perror("");
 		abort();
 	}
+	if (s.st_size > MAXFILESIZE) {
+		fprintf(stderr, "%s: file too large\n", name);
+		abort();
+	}
 
-	last = strrchr(name, '/');
-	if (last)
-		last++;
-	else
-		last = name;
-
-	f = allocfile(dirf, last, &dirb);
+	f = allocfile(d, lastelem(name));
 	f->f_type = FTYPE_REG;
+	f->f_size = s.st_size;
 
-	n = 0;
-	for (nblk = 0; ; nblk++) {
-		b = getblk(nextb, 1, BLOCK_FILE);
-		n = readn(fd, b->buf, BLKSIZE);
-		if (n < 0) {
+	// A small file goes in its struct File
+	if (s.st_size > 0 && s.st_size <= FILE_INLINE_MAX) {
+		if (readn(fd, f->f_data, s.st_size) != s.st_size) {
 			fprintf(stderr, "reading %s: ", name);
 			perror("");
 			abort();
 		}
-		if (n == 0) {
-			putblk(b);
-			break;
+		close(fd);
+		f->f_flags = FILE_INLINE;
+		return;
+	}
+
+	// Read the file straight into its blocks
+	nblk = (s.st_size + BLKSIZE - 1) / BLKSIZE;
+	start = allocblks(nblk, BLOCK_FILE);
+	if (readn(fd, diskblk(start), s.st_size) != s.st_size) {
+		fprintf(stderr, "reading %s: ", name);
+		perror("");
+		abort();
+	}
+	close(fd);
+	setblocks(f, start, nblk);
+	if (compress && nblk > 0)
+		packfile(f, start, nblk);
+}
+
+// Compression (inc/lz.h): greedy, finding matches through a hash of
+// the next LZ_MINMATCH bytes.  The hash table remembers the last place
+// each hash was seen.
+#define LZ_HASHBITS	12
+
+uint32_t
+lz_hash(const uint8_t *p)
+{
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return (x * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+// Append the bytes continuing a length whose nibble said 15, n past it.
+uint8_t *
+lz_putlen(uint8_t *o, uint8_t *end, uint32_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (o == end)
+			return NULL;
+		*o++ = 255;
+	}
+	if (o == end)
+		return NULL;
+	*o++ = n;
+	return o;
+}
+
+// Append a sequence: nlit literals, then, if mlen isn't 0, a match of
+// mlen bytes 'off' back.  Returns where it ends, or NULL if the sequence
+// won't fit before 'end'.
+uint8_t *
+lz_putseq(uint8_t *o, uint8_t *end, const uint8_t *lit, uint32_t nlit,
+	  uint32_t off, uint32_t mlen)
+{
+	uint32_t m = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (o == end)
+		return NULL;
+	*o++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15 && (o = lz_putlen(o, end, nlit - 15)) == NULL)
+		return NULL;
+	if (nlit > (uint32_t) (end - o))
+		return NULL;
+	memcpy(o, lit, nlit);
+	o += nlit;
+	if (mlen == 0)
+		return o;
+	if (end - o < 2)
+		return NULL;
+	*o++ = off & 0xFF;
+	*o++ = off >> 8;
+	if (m >= 15 && (o = lz_putlen(o, end, m - 15)) == NULL)
+		return NULL;
+	return o;
+}
+
+// Compress the n bytes at src into dst, which has room for max.
+// Returns the length, or -1 if it won't fit.
+int
+lz_encode(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t max)
+{
+	static int32_t last[1 << LZ_HASHBITS];
+	uint32_t i = 0, j, anchor = 0, len;
+	uint8_t *o = dst, *end = dst + max;
+	int32_t c;
+
+	memset(last, 0xFF, sizeof(last));
+	while (i + LZ_MINMATCH <= n) {
+		j = lz_hash(src + i);
+		c = last[j];
+		last[j] = i;
+		if (c < 0 || memcmp(src + c, src + i, LZ_MINMATCH) != 0) {
+			i++;
+			continue;
 		}
-		nextb++;
-		storeblk(f, b, nblk);
-		putblk(b);
-		if (n < BLKSIZE)
-			break;
+		for (len = LZ_MINMATCH; i + len < n && src[c + len] == src[i + len]; len++)
+			;
+		if ((o = lz_putseq(o, end, src + anchor, i - anchor, i - c, len)) == NULL)
+			return -1;
+		for (j = i + 1; j < i + len && j + LZ_MINMATCH <= n; j++)
+			last[lz_hash(src + j)] = j;
+		i += len;
+		anchor = i;
 	}
-	f->f_size = nblk*BLKSIZE + n;
-	putblk(dirb);
+	if ((o = lz_putseq(o, end, src + anchor, n - anchor, 0, 0)) == NULL)
+		return -1;
+	return o - dst;
 }
 
+// Compress the nblk blocks of f, from 'start' on, each in place, and
+// mark f FILE_COMPRESSED -- unless some block wouldn't come to a sector
+// less than it takes now, when they're all left as they are.
 void
-writedirectory(struct File *parentdirf, char *name, int root)
+packfile(struct File *f, uint32_t start, uint32_t nblk)
 {
-	struct File *dirf;
+	uint8_t *out, *p;
+	uint32_t i, size;
+	int *lens;
+
+	out = malloc((size_t) nblk * BLKSIZE);
+	lens = malloc(nblk * sizeof(int));
+	if (out == NULL || lens == NULL) {
+		perror("fsformat");
+		abort();
+	}
+	for (i = 0; i < nblk; i++) {
+		size = i + 1 < nblk ? BLKSIZE : f->f_size - i * BLKSIZE;
+		lens[i] = lz_encode(diskblk(start + i), size, out + (size_t) i * BLKSIZE,
+				    BLKSIZE - 512 - PACKED_HDRSIZE);
+		if (lens[i] < 0)
+			goto done;
+	}
+	for (i = 0; i < nblk; i++) {
+		p = diskblk(start + i);
+		memset(p, 0, BLKSIZE);
+		p[0] = lens[i] & 0xFF;
+		p[1] = lens[i] >> 8;
+		memcpy(p + PACKED_HDRSIZE, out + (size_t) i * BLKSIZE, lens[i]);
+	}
+	f->f_flags = FILE_COMPRESSED;
+done:
+	free(out);
+	free(lens);
+}
+
+// What goes in a directory: its regular files and subdirectories.
+struct Entry {
+	char *e_path;
+	int e_dir;
+};
+
+void
+writedirectory(struct Dir *parent, char *name, int root)
+{
+	struct Dir d;
 	DIR *dir;
 	struct dirent *ent;
 	struct stat s;
 	char pathbuf[PATH_MAX];
-	int namelen;
-	struct Block *dirb = NULL;
+	int namelen, i, n = 0, max = 16;
+	struct Entry *ents;
 
 	if ((dir = opendir(name)) == NULL) {
 		fprintf(stderr, "open %s:", name);
@@ -373,19 +492,6 @@ writedirectory(struct File *parentdirf, char *name, int root)
 		abort();
 	}
 
-	if (!root) {
-		const char *last = strrchr(name, '/');
-		if (last)
-			last++;
-		else
-			last = name;
-
-		dirf = allocfile(parentdirf, last, &dirb);
-		dirf->f_type = FTYPE_DIR;
-		dirf->f_size = 0;
-	} else
-		dirf = parentdirf;
-
 	strcpy(pathbuf, name);
 	namelen = strlen(pathbuf);
 	if (pathbuf[namelen - 1] != '/') {
@@ -393,6 +499,8 @@ writedirectory(struct File *parentdirf, char *name, int root)
 		pathbuf[namelen] = 0;
 	}
 
+	// Count the entries before making the directory
+	ents = malloc(max * sizeof(*ents));
 	while ((ent = readdir(dir)) != NULL) {
 		int ent_namlen = strlen(ent->d_name);
 		strcpy(pathbuf + namelen, ent->d_name);
@@ -400,61 +508,65 @@ writedirectory(struct File *parentdirf, char *name, int root)
 		// don't depend on unreliable parts of the dirent structure
 		if (stat(pathbuf, &s) < 0)
 			continue;
-		
-		if (S_ISREG(s.st_mode))
-			writefile(dirf, pathbuf);
-		else if (S_ISDIR(s.st_mode)
+
+		if (!S_ISREG(s.st_mode)
+		    && !(S_ISDIR(s.st_mode)
 			 && (ent_namlen > 1 || ent->d_name[0] != '.')
 			 && (ent_namlen > 2 || ent->d_name[0] != '.' || ent->d_name[1] != '.')
-			 && (ent_namlen > 3 || ent->d_name[0] != 'C' || ent->d_name[1] != 'V' || ent->d_name[2] != 'S'))
-			writedirectory(dirf, pathbuf, 0);
+			 && (ent_namlen > 3 || ent->d_name[0] != 'C' || ent->d_name[1] != 'V' || ent->d_name[2] != 'S')))
+			continue;
+		if (n == max)
+			ents = realloc(ents, (max *= 2) * sizeof(*ents));
+		if (ents == NULL || (ents[n].e_path = strdup(pathbuf)) == NULL) {
+			perror("fsformat");
+			abort();
+		}
+		ents[n++].e_dir = S_ISDIR(s.st_mode);
 	}
-
 	closedir(dir);
-	if (dirb)
-		putblk(dirb);
-}
-
-void
-finishfs(void)
-{
-	int i;
-	struct Block *b;
 
-	for (i = 0; i < nextb; i++) {
-		b = getblk(2 + i/BLKBITSIZE, 0, BLOCK_BITS);
-		((uint32_t*)b->buf)[(i%BLKBITSIZE)/32] &= ~(1<<(i%32));
-		putblk(b);
-	}
-
-	// this is slow but not too slow.  i do not care
-	if (nblocks != nbitblock*BLKBITSIZE) {
-		b = getblk(2+nbitblock-1, 0, BLOCK_BITS);
-		for (i = nblocks % BLKBITSIZE; i < BLKBITSIZE; i++)
-			((uint32_t*)b->buf)[i/32] &= ~(1<<(i%32));
-		putblk(b);
+	makedir(root ? &super->s_root : allocfile(parent, lastelem(name)), n, &d);
+	for (i = 0; i < n; i++) {
+		if (ents[i].e_dir)
+			writedirectory(&d, ents[i].e_path, 0);
+		else
+			writefile(&d, ents[i].e_path);
+		free(ents[i].e_path);
 	}
-
-	b = getblk(1, 1, BLOCK_SUPER);
-	memmove(b->buf, &super, sizeof(Super));
-	putblk(b);
+	free(ents);
 }
 
 void
-flushdisk(void)
+finishfs(void)
 {
-	int i;
-
-	for (i = 0; i < nelem(cache); i++)
-		if (cache[i].used)
-			flushb(&cache[i]);
+	uint32_t i, *bits = diskblk(2);
+
+	// Free from nextb to the end of the disk, a word at a time where
+	// we can; the bits past the end stay clear
+	for (i = nextb; i < nblocks && i % 32 != 0; i++)
+		bits[i / 32] |= 1 << (i % 32);
+	for (; i + 32 <= nblocks; i += 32)
+		bits[i / 32] = ~0U;
+	for (; i < nblocks; i++)
+		bits[i / 32] |= 1 << (i % 32);
+
+	for (i = 0; i < nextb; i++)
+		swizzleblock(i);
+	if (munmap(disk, (size_t) nblocks * BLKSIZE) < 0) {
+		perror("munmap");
+		abort();
+	}
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat kern/fs.img NBLOCKS files...\n\
-       fsformat kern/fs.img NBLOCKS -r DIR\n");
+	fprintf(stderr, "Usage: fsformat [-1] [-j N] [-z] kern/fs.img NBLOCKS files...\n\
+       fsformat [-1] [-j N] [-z] kern/fs.img NBLOCKS -r DIR\n\
+  -1    write the version 1 layout, with direct and indirect blocks\n\
+  -j N  give the journal N blocks, 2 to %d, or 0 for none (default %d)\n\
+  -z    compress the files whose every block comes to fewer sectors\n",
+		JOURNAL_MAXBLOCKS, JOURNAL_NBLOCKS);
 	abort();
 }
 
@@ -463,30 +575,45 @@ main(int argc, char **argv)
 {
 	int i;
 	char *s;
+	struct Dir root;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
-	if (argc < 3)
+	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+		if (strcmp(argv[1], "-1") == 0)
+			version = FS_VERSION_BLOCKPTR;
+		else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			njournal = strtol(argv[2], &s, 0);
+			if (*s || s == argv[2] || njournal == 1 || njournal > JOURNAL_MAXBLOCKS)
+				usage();
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-z") == 0)
+			compress = 1;
+		else
+			usage();
+	}
+	if (argc < 4)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	// the file server's sector numbers are 32 bits: at most 2TB of disk
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > 0xFFFFFFFF / (BLKSIZE / 512))
 		usage();
-	
+
 	opendisk(argv[1]);
 
 	if (strcmp(argv[3], "-r") == 0) {
 		if (argc != 5)
 			usage();
-		writedirectory(&super.s_root, argv[4], 1);
+		writedirectory(NULL, argv[4], 1);
 	} else {
+		makedir(&super->s_root, argc - 3, &root);
 		for (i = 3; i < argc; i++)
-			writefile(&super.s_root, argv[i]);
+			writefile(&root, argv[i]);
 	}
-	
+
 	finishfs();
-	flushdisk();
 	exit(0);
 	return 0;
 }
-
@@ -0,0 +1,82 @@
+/*
+ * What the host-side file system tools, fsformat and fsck, have in
+ * common: the host's headers and JOS's inc/fs.h, included so their
+ * types don't collide, and a way to get at an image file.
+ */
+
+#ifndef JOS_FS_FSHOST_H
+#define JOS_FS_FSHOST_H
+
+#define _BSD_EXTENSION
+
+// We don't actually want to define off_t!
+#define off_t xxx_off_t
+#define bool xxx_bool
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <limits.h>
+#undef off_t
+#undef bool
+
+// Prevent inc/types.h, included from inc/fs.h,
+// from attempting to redefine types defined in the host's inttypes.h.
+#define JOS_INC_TYPES_H
+// Typedef the types that inc/mmu.h needs.
+typedef uint32_t physaddr_t;
+typedef uint32_t off_t;
+typedef int bool;
+
+#include <inc/mmu.h>
+#include <inc/fs.h>
+#include <inc/lz.h>
+
+#define nelem(x)	(sizeof(x) / sizeof((x)[0]))
+
+// Map the image file 'name' into memory, shared, and return where, or
+// NULL with errno set.  Without 'create', map it read-only and set
+// *size to its length; with it, make the file *size bytes of zeroes
+// first and map it writable, so that stores go to the file.
+static inline void *
+image_map(const char *name, size_t *size, bool create)
+{
+	struct stat st;
+	void *p;
+	int fd, e;
+
+	if ((fd = open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0666)) < 0)
+		return NULL;
+	if (create ? ftruncate(fd, 0) < 0 || ftruncate(fd, *size) < 0
+	    : fstat(fd, &st) < 0)
+		goto fail;
+	if (!create)
+		*size = st.st_size;
+	if (*size == 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	p = mmap(NULL, *size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+		 MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+	return p;
+
+fail:
+	e = errno;
+	close(fd);
+	errno = e;
+	return NULL;
+}
+
+#endif /* !JOS_FS_FSHOST_H */
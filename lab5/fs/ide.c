@@ -1,7 +1,21 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal PIO-based IDE driver code.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
+ *
+ * If ide_dma_init() finds a bus-master capable PCI IDE controller
+ * (the PIIX that QEMU and Bochs emulate), transfers use DMA instead:
+ * the controller moves the data while we yield the CPU.
+ *
+ * After ide_irq_init(), waits for the disk sleep until the drive raises
+ * IRQ 14 rather than spinning on the status register: a request's fiber
+ * sleeps until the server's main loop receives the interrupt and calls
+ * ide_intr, and the main loop itself blocks in sys_irq_wait.  Only one
+ * fiber at a time has a command outstanding; the rest queue for the
+ * drive.
+ *
+ * Sectors past the first 2^28 (128GB) are reached with the 48-bit LBA
+ * commands.
  */
 
 #include "fs.h"
@@ -14,6 +28,47 @@
 
 static int diskno = 1;
 
+// PCI configuration space, through mechanism #1
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+// Bus-master IDE registers, relative to BAR4 (primary channel)
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// device to memory
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_IRQ	0x04
+#define BM_STATUS_DMA0	0x20	// drive 0 is DMA capable
+#define BM_STATUS_DMA1	0x40	// drive 1 is DMA capable
+
+// Physical region descriptor: one physically contiguous piece of the
+// buffer, not crossing a 64KB boundary.  A count of 0 means 64KB.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_count;
+	uint16_t prd_flags;
+};
+
+#define PRD_EOT		0x8000	// last entry in the table
+#define NPRD		(PGSIZE / sizeof(struct Prd))
+
+// The table must be physically contiguous and not cross 64KB, so it
+// gets a page to itself
+static struct Prd prdt[NPRD] __attribute__((aligned(PGSIZE)));
+
+// Sectors the 28-bit LBA commands reach
+#define IDE_LBA28_NSECS	(1 << 28)
+
+static int bmiba;		// bus-master I/O base, 0 if PIO only
+static bool use_irq;		// sleep on IRQ_IDE instead of polling
+static bool ide_busy;		// a fiber has a command outstanding
+static struct FiberQ ide_irqq;	// fibers waiting for IRQ_IDE
+static struct FiberQ ide_lockq;	// fibers waiting for the drive
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -27,6 +82,56 @@ ide_wait_ready(bool check_error)
 	return 0;
 }
 
+// Sleep until the drive may have interrupted.
+static void
+ide_sleep(void)
+{
+	int r;
+
+	if (fiber_self() >= 0)
+		fiber_sleep(&ide_irqq);
+	else if ((r = sys_irq_wait(IRQ_IDE)) < 0) {
+		cprintf("ide: sys_irq_wait: %e; polling instead\n", r);
+		use_irq = 0;
+	}
+}
+
+// The server's main loop got IRQ_IDE: let whoever waits for it look.
+void
+ide_intr(void)
+{
+	fiber_wakeup(&ide_irqq);
+}
+
+// Wait like ide_wait_ready, but sleep while the drive is busy.  Only for
+// busy periods the drive ends by raising its interrupt: a data transfer,
+// or the command before.  An IRQ can be stale or arrive before we sleep,
+// so we look at the status again after every wakeup; reading it also
+// acknowledges the drive's interrupt.
+static int
+ide_wait_irq(bool check_error)
+{
+	while (use_irq && (inb(0x1F7) & IDE_BSY) != 0)
+		ide_sleep();
+	return ide_wait_ready(check_error);
+}
+
+// Take the drive for one command, queueing behind other fibers.
+static void
+ide_lock(void)
+{
+	while (ide_busy)
+		fiber_sleep(&ide_lockq);
+	ide_busy = 1;
+}
+
+static void
+ide_unlock(void)
+{
+	ide_busy = 0;
+	fiber_wakeup(&ide_lockq);
+}
+
 bool
 ide_probe_disk1(void)
 {
@@ -57,24 +162,188 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+uint32_t
+pci_conf_read(int bus, int dev, int func, int off)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (off & 0xFC));
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(int bus, int dev, int func, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (off & 0xFC));
+	outl(PCI_CONF_DATA, v);
+}
+
+// Have the drive interrupt us when it finishes (nIEN clear in the device
+// control register) and sleep until it does.  Returns 1 on success, 0
+// to keep polling.
+bool
+ide_irq_init(void)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	if ((r = sys_irq_listen(IRQ_IDE)) < 0) {
+		cprintf("ide: sys_irq_listen: %e\n", r);
+		return 0;
+	}
+	outb(0x3F6, 0);
+	use_irq = 1;
+	return 1;
+}
 
-	ide_wait_ready(0);
+// Look for a bus-master IDE controller on PCI bus 0 and switch ide_read
+// and ide_write to DMA through it.  Returns 1 if found, 0 to stay with
+// PIO.
+bool
+ide_dma_init(void)
+{
+	int dev, func;
+	uint32_t id, class, bar4;
+
+	for (dev = 0; dev < 32; dev++) {
+		for (func = 0; func < 8; func++) {
+			id = pci_conf_read(0, dev, func, 0x00);
+			if ((id & 0xFFFF) == 0xFFFF)
+				continue;
+			// class 1 (storage), subclass 1 (IDE), and prog-if
+			// bit 7: bus master capable
+			class = pci_conf_read(0, dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+				continue;
+			bar4 = pci_conf_read(0, dev, func, 0x20);
+			if ((bar4 & 1) == 0 || (bar4 & 0xFFFC) == 0)
+				continue;
+			bmiba = bar4 & 0xFFFC;
+
+			// enable I/O space and bus mastering
+			pci_conf_write(0, dev, func, 0x04,
+				       pci_conf_read(0, dev, func, 0x04) | 0x05);
+			outb(bmiba + BM_STATUS, BM_STATUS_DMA0 | BM_STATUS_DMA1
+			     | BM_STATUS_ERR | BM_STATUS_IRQ);
+			cprintf("IDE bus-master DMA at port 0x%x (pci %d.%d, id %08x)\n",
+				bmiba, dev, func, id);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Describe the buffer [buf, buf + len) to the controller, merging pages
+// that happen to be physically adjacent.  Every page must be mapped.
+static int
+ide_dma_prepare(const void *buf, size_t len)
+{
+	uintptr_t va = (uintptr_t) buf;
+	physaddr_t pa;
+	uint32_t m, count = 0;
+	int n = 0;
+
+	while (len > 0) {
+		if (!(vpd[PDX(va)] & PTE_P)
+		    || (!(vpd[PDX(va)] & PTE_PS) && !(vpt[VPN(va)] & PTE_P)))
+			return -E_INVAL;
+		pa = va2pa((void *) va);
+		m = MIN(len, PGSIZE - PGOFF(va));
+		if (n > 0 && prdt[n-1].prd_addr + count == pa
+		    && (pa + m - 1) / 0x10000 == prdt[n-1].prd_addr / 0x10000)
+			count += m;
+		else {
+			if (n == NPRD)
+				return -E_INVAL;
+			prdt[n].prd_addr = pa;
+			prdt[n].prd_flags = 0;
+			count = m;
+			n++;
+		}
+		prdt[n-1].prd_count = count;	// 64KB becomes 0, as it should
+		va += m;
+		len -= m;
+	}
+	prdt[n-1].prd_flags = PRD_EOT;
+	return 0;
+}
 
+// Set up a transfer of nsecs sectors, at most 256, from secno and issue
+// the command: cmd, or cmd48, its 48-bit LBA version, if the transfer
+// goes past what 28 bits reach.
+static void
+ide_start(uint32_t secno, size_t nsecs, uint8_t cmd, uint8_t cmd48)
+{
+	if (secno + nsecs > IDE_LBA28_NSECS) {
+		// Each register takes its high byte first, then its low one
+		outb(0x1F2, (nsecs >> 8) & 0xFF);
+		outb(0x1F3, (secno >> 24) & 0xFF);
+		outb(0x1F4, 0);		// sector numbers are 32 bits here
+		outb(0x1F5, 0);
+		outb(0x1F2, nsecs & 0xFF);
+		outb(0x1F3, secno & 0xFF);
+		outb(0x1F4, (secno >> 8) & 0xFF);
+		outb(0x1F5, (secno >> 16) & 0xFF);
+		outb(0x1F6, 0x40 | ((diskno&1)<<4));
+		outb(0x1F7, cmd48);
+		return;
+	}
 	outb(0x1F2, nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Transfer nsecs sectors between disk and buf by DMA.
+static int
+ide_dma(uint32_t secno, const void *buf, size_t nsecs, bool write)
+{
+	int r, st;
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+
+	if ((r = ide_dma_prepare(buf, nsecs * SECTSIZE)) < 0)
+		return r;
+
+	ide_wait_irq(0);
+
+	outl(bmiba + BM_PRDT, PTE_ADDR(vpt[VPN(prdt)]));
+	outb(bmiba + BM_CMD, dir);
+	outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	// CMD 0xC8/0xCA: read/write DMA; 0x25/0x35 for 48-bit LBA
+	if (write)
+		ide_start(secno, nsecs, 0xCA, 0x35);
+	else
+		ide_start(secno, nsecs, 0xC8, 0x25);
+	outb(bmiba + BM_CMD, dir | BM_CMD_START);
+
+	// Let everyone else run while the controller moves the data: sleep
+	// until the drive interrupts, or yield if we can't
+	while (((st = inb(bmiba + BM_STATUS)) & BM_STATUS_ACTIVE)
+	       && !(st & (BM_STATUS_ERR | BM_STATUS_IRQ))) {
+		if (use_irq)
+			ide_sleep();
+		else
+			sys_yield();
+	}
+
+	outb(bmiba + BM_CMD, dir);
+	outb(bmiba + BM_STATUS, st | BM_STATUS_ERR | BM_STATUS_IRQ);
+	if ((r = ide_wait_ready(1)) < 0 || (st & BM_STATUS_ERR))
+		return -1;
+	return 0;
+}
+
+static int
+ide_pio_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	ide_wait_irq(0);
+
+	ide_start(secno, nsecs, 0x20, 0x24);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
+		if ((r = ide_wait_irq(1)) < 0)
 			return r;
 		insl(0x1F0, dst, SECTSIZE/4);
 	}
@@ -82,24 +351,20 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+static int
+ide_pio_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
-	
-	assert(nsecs <= 256);
+	bool first;
 
-	ide_wait_ready(0);
+	ide_wait_irq(0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_start(secno, nsecs, 0x30, 0x34);	// CMD 0x30 means write sector
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
+	// The drive asks for the first sector without an interrupt; after
+	// that it interrupts once it has taken each one
+	for (first = 1; nsecs > 0; nsecs--, src += SECTSIZE, first = 0) {
+		if ((r = first ? ide_wait_ready(1) : ide_wait_irq(1)) < 0)
 			return r;
 		outsl(0x1F0, src, SECTSIZE/4);
 	}
@@ -107,3 +372,59 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	return 0;
 }
 
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	ide_lock();
+	if (bmiba)
+		r = ide_dma(secno, dst, nsecs, 0);
+	else
+		r = ide_pio_read(secno, dst, nsecs);
+	ide_unlock();
+	return r;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	ide_lock();
+	if (bmiba)
+		r = ide_dma(secno, src, nsecs, 1);
+	else
+		r = ide_pio_write(secno, src, nsecs);
+	ide_unlock();
+	return r;
+}
+
+// Find a JOS disk, using the second IDE disk (number 1) if available,
+// and set up DMA and the interrupt if we can.
+static int
+ide_init(void)
+{
+	if (ide_probe_disk1())
+		ide_set_disk(1);
+	else
+		ide_set_disk(0);
+	if (IDE_DMA && ide_dma_init())
+		cprintf("FS is using DMA\n");
+	if (IDE_IRQ && ide_irq_init())
+		cprintf("FS is using the disk interrupt\n");
+	return 0;
+}
+
+struct Bdev bdev_ide = {
+	.bd_name =	"ide",
+	.bd_init =	ide_init,
+	.bd_read =	ide_read,
+	.bd_write =	ide_write,
+	.bd_irq =	IRQ_IDE,
+	.bd_intr =	ide_intr
+};
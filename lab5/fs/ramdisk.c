@@ -0,0 +1,122 @@
+// A RAM disk.
+//
+// bdev_ram serves the file system from a copy of the disk held in our
+// memory: at startup ramdisk_init reads the whole image off the IDE
+// disk, a run of 256 sectors at a time, and from then on reads and
+// writes are memmoves that never sleep.  Nothing goes back to the IDE
+// disk, so what's written is lost when the server goes; this is for
+// benchmarks and test runs that want no disk in the way.
+//
+// Sector s is at RAMDISKMAP + s*SECTSIZE.  The superblock says how big
+// the image is; it must fit in RAMDISKSIZE.  The image is all there, and
+// stays, so each whole 4MB of it is one 4MB page where the kernel has
+// one to give (RAMDISK_SUPER): one PDE and one TLB entry instead of a
+// page table's worth, and a run that DMA fills in one piece.
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+static uint32_t ram_nsecs;	// sectors in the image
+
+static void *
+ram_addr(uint32_t secno)
+{
+	return (void *) (RAMDISKMAP + secno * SECTSIZE);
+}
+
+// Map memory for sectors [secno, secno + n) of the image: 4MB pages
+// for the 4MB stretches it covers, and the rest page by page.
+static int
+ram_alloc(uint32_t secno, size_t n)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) ram_addr(secno), PGSIZE);
+	uintptr_t end = (uintptr_t) ram_addr(secno + n);
+	int r;
+
+	while (va < end)
+		if (RAMDISK_SUPER && va % PTSIZE == 0 && end - va >= PTSIZE) {
+			// The kernel falls back to 4KB pages if it must
+			if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+				return r;
+			va += PTSIZE;
+		} else {
+			if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+				return r;
+			va += PGSIZE;
+		}
+	return 0;
+}
+
+// Map memory for sectors [secno, secno + n) of the image and read them in.
+static int
+ram_load(uint32_t secno, size_t n)
+{
+	int r;
+
+	if ((r = ram_alloc(secno, n)) < 0)
+		return r;
+	return ide_read(secno, ram_addr(secno), n);
+}
+
+static int
+ramdisk_init(void)
+{
+	struct Super *s;
+	uint32_t secno, n;
+	int r;
+
+	static_assert(RAMDISKMAP + RAMDISKSIZE <= CLIENTMAP);
+	static_assert(RAMDISKMAP % PTSIZE == 0);
+
+	if ((r = bdev_ide.bd_init()) < 0)
+		return r;
+	// Blocks 0 and 1 tell us how much more there is
+	if ((r = ram_load(0, 2 * BLKSECTS)) < 0)
+		return r;
+	s = (struct Super *) ram_addr(BLKSECTS);
+	if (s->s_magic != FS_MAGIC)
+		return -E_INVAL;
+	if (s->s_nblocks > RAMDISKSIZE / BLKSIZE)
+		return -E_NO_MEM;
+	ram_nsecs = s->s_nblocks * BLKSECTS;
+
+	// All of the memory first, so that the 4MB pages can be had; they
+	// replace blocks 0 and 1, which are read again
+	if ((r = ram_alloc(0, ram_nsecs)) < 0)
+		return r;
+	for (secno = 0; secno < ram_nsecs; secno += n) {
+		n = MIN(ram_nsecs - secno, 256);
+		if ((r = ide_read(secno, ram_addr(secno), n)) < 0)
+			return r;
+	}
+	cprintf("FS loaded %d blocks into the RAM disk\n", ram_nsecs / BLKSECTS);
+	return 0;
+}
+
+static int
+ramdisk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	if (secno > ram_nsecs || nsecs > ram_nsecs - secno)
+		return -E_INVAL;
+	memmove(dst, ram_addr(secno), nsecs * SECTSIZE);
+	return 0;
+}
+
+static int
+ramdisk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	if (secno > ram_nsecs || nsecs > ram_nsecs - secno)
+		return -E_INVAL;
+	memmove(ram_addr(secno), src, nsecs * SECTSIZE);
+	return 0;
+}
+
+struct Bdev bdev_ram = {
+	.bd_name =	"ramdisk",
+	.bd_init =	ramdisk_init,
+	.bd_read =	ramdisk_read,
+	.bd_write =	ramdisk_write,
+	.bd_irq =	IRQ_IDE,	// only loading the image sleeps
+	.bd_intr =	ide_intr
+};
@@ -5,6 +5,7 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/elf.h>
 
 #include "fs.h"
 
@@ -16,53 +17,252 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	bool o_pinned;		// o_file's blocks are pinned in the cache
+	bool o_opening;		// taken by an open still in progress
+	bool o_onfree;		// on openfile_freelist
+	struct OpenFile *o_free_link;	// next on openfile_freelist
+
+	// Sequential read-ahead state (see serve_map)
+	uint32_t o_ra_next;	// file block we expect to be asked for next
+	uint32_t o_ra_end;	// first file block not yet read ahead
+	uint32_t o_ra_window;	// blocks to read ahead, 0 if not sequential
 };
 
-// Max number of open files in the file system at once
+// Read-ahead window bounds, in blocks.  RA_MAX is what one IDE command
+// can transfer.
+#define RA_MIN		4
+#define RA_MAX		(256 / BLKSECTS)
+
+// Max number of open files in the file system at once, and where their
+// Fd pages go: above the worker threads' stacks
 #define MAXOPEN		1024
-#define FILEVA		0xD0000000
+#define FILEVA		UTHREADSTOP
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-#define REQVA		0x0ffff000
+// Entries that are probably free: never used, or closed.  A closed file
+// may still be open in another environment that shares the fd, and a
+// client may exit without closing at all, so openfile_alloc checks
+// pageref as ever, and when the list runs dry openfile_reclaim sweeps
+// the table for entries whose last user has gone.  Worker threads open
+// files too, so the list, and o_onfree and o_opening, change under
+// opentab_lock.
+static struct OpenFile *openfile_freelist;
+static struct Mutex opentab_lock;
+
+static void openfile_free(struct OpenFile *o);
+static void exec_forget(struct File *f);
+
+// The lease page (struct FsLease), above the Fd pages.  A file's slot
+// in it is got from where its struct File lies in DISKMAP, which is
+// where it stays; files sharing a slot just break each other's leases.
+#define LEASEVA		(FILEVA + MAXOPEN * PGSIZE)
+#define fslease		((struct FsLease *) LEASEVA)
+#define lease_slot(f)	(((uintptr_t) (f) / sizeof(struct File)) % FSLEASE_NGEN)
+
+static void
+lease_break(struct File *f)
+{
+	fslease->l_gen[lease_slot(f)]++;
+}
+
+// Break every lease: clients let go of all they keep.
+void
+lease_revoke(void)
+{
+	fslease->l_epoch++;
+}
+
+// Virtual address at which to receive page mappings containing client
+// requests: request slot i gets the page REQVA(i).
+#define REQVA(i)	(0x0ffff000 - (i) * PGSIZE)
+
+// rq_type of the write-back flusher's requests, which aren't a client's
+#define SERVE_FLUSH	0
+
+// Clients' request pages (see FSREQ_SETUP in inc/fs.h).  Client c's
+// slot s is mapped at CLIENTVA(c, s) for as long as we keep it; we
+// find c from the envid through client_ix.  A client that has gone
+// leaves its pages with us until its entry is wanted again.
+#define CLIENTVA(c, s)	(CLIENTMAP + ((c) * FSREQ_NSLOT + (s)) * PGSIZE)
+
+struct Client {
+	envid_t c_envid;	// 0 if free
+};
+
+static struct Client clients[FS_NCLIENT];
+static uint16_t client_ix[NENV];	// ENVX(envid) -> client number + 1
+
+// Requests being served.  Request i runs in fiber i.  The slot stays
+// busy until the fiber is done and its reply has gone out, because the
+// reply may be a block in the cache, which mustn't be evicted before
+// then (see bc_set_oldest).
+struct Request {
+	bool rq_busy;		// slot in use
+	volatile bool rq_done;	// fiber or worker has finished
+	bool rq_excl;		// must run alone (see serve_lock)
+	bool rq_worker;		// a worker thread has it, not fiber i
+	volatile bool rq_retry;	// the worker gave it back for fiber i
+	bool rq_deferred;	// waiting for its client's others (serve_admit)
+	uint32_t rq_type;	// FSREQ_*
+	envid_t rq_whom;	// client
+	uint32_t rq_epoch;	// block cache epoch it started in
+	void *rq_pg;		// the request, at REQVA, in a client's page,
+				// or in rq_words
+	int rq_slot;		// the page's FSREQ_SLOT, if it's the client's
+	uint32_t rq_words[IPC_NWORDS];	// an FSREQ_INREGS request
+
+	// The reply, once serve_reply has been called, until it's sent
+	bool rq_replied;
+	envid_t rq_reply_envid;
+	uint32_t rq_reply_value;
+	void *rq_reply_pg;
+	int rq_reply_perm;
+};
+
+static struct Request reqtab[FS_NFIBER];
 
 void
 serve_init(void)
 {
-	int i;
+	int i, r;
 	uintptr_t va = FILEVA;
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = MAXOPEN - 1; i >= 0; i--)
+		openfile_free(&opentab[i]);
+	if ((r = sys_page_alloc(0, fslease, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("serve_init: lease page: %e", r);
+	fslease->l_epoch = 1;
+	if ((r = fiber_init(FS_NFIBER)) < 0)
+		panic("serve_init: fiber_init: %e", r);
+}
+
+// Put o on the free list, if it isn't there already.  Called with
+// opentab_lock held.
+static void
+openfile_push(struct OpenFile *o)
+{
+	if (o->o_onfree)
+		return;
+	o->o_onfree = 1;
+	o->o_free_link = openfile_freelist;
+	openfile_freelist = o;
+}
+
+static void
+openfile_free(struct OpenFile *o)
+{
+	mutex_lock(&opentab_lock);
+	openfile_push(o);
+	mutex_unlock(&opentab_lock);
+}
+
+// Put every entry nobody has open any more on the free list.  Called
+// with opentab_lock held.
+static void
+openfile_reclaim(void)
+{
+	int i;
+
+	for (i = MAXOPEN - 1; i >= 0; i--)
+		if (!opentab[i].o_opening && !opentab[i].o_onfree
+		    && pageref(opentab[i].o_fd) <= 1)
+			openfile_push(&opentab[i]);
+}
+
+// An open file's struct File lives in its directory's block, and points
+// at the directory's own struct File; keep both in the block cache.
+static void
+openfile_pin(struct OpenFile *o)
+{
+	bc_pin(o->o_file);
+	if (o->o_file->f_dir)
+		bc_pin(o->o_file->f_dir);
+	o->o_pinned = 1;
+}
+
+static void
+openfile_unpin(struct OpenFile *o)
+{
+	if (!o->o_pinned)
+		return;
+	bc_unpin(o->o_file);
+	if (o->o_file->f_dir)
+		bc_unpin(o->o_file->f_dir);
+	o->o_pinned = 0;
+}
+
+// Once an inline file's data has moved out to a block (see fs.c), clear
+// FILE_INLINE in the Fd copies of its opens, so that their readers map
+// the block instead of reading the copy they got at the open.  Called
+// after a request on o that may have moved it; the copies are all
+// cleared at once, so only o's needs looking at first.
+static void
+openfile_uninlined(struct OpenFile *o)
+{
+	int i;
+
+	if ((o->o_file->f_flags & FILE_INLINE)
+	    || !(o->o_fd->fd_file.file.f_flags & FILE_INLINE))
+		return;
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == o->o_file && pageref(opentab[i].o_fd) > 1)
+			opentab[i].o_fd->fd_file.file.f_flags &= ~FILE_INLINE;
 }
 
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
+	int r;
+	struct OpenFile *of;
 
 	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
+	mutex_lock(&opentab_lock);
+	while (1) {
+		if (!openfile_freelist) {
+			openfile_reclaim();
+			if (!openfile_freelist) {
+				mutex_unlock(&opentab_lock);
+				return -E_MAX_OPEN;
+			}
+		}
+		of = openfile_freelist;
+		openfile_freelist = of->o_free_link;
+		of->o_onfree = 0;
+		if (of->o_opening)
+			continue;
+		switch (pageref(of->o_fd)) {
 		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+			if ((r = sys_page_alloc(0, of->o_fd, PTE_P|PTE_U|PTE_W)) < 0) {
+				openfile_push(of);
+				mutex_unlock(&opentab_lock);
 				return r;
+			}
 			/* fall through */
 		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+			of->o_opening = 1;
+			mutex_unlock(&opentab_lock);
+			// The last user may have gone without closing
+			openfile_unpin(of);
+			of->o_fileid += MAXOPEN;
+			of->o_ra_next = 0;
+			of->o_ra_end = 0;
+			of->o_ra_window = 0;
+			*o = of;
+			page_zero(of->o_fd);
+			return of->o_fileid;
 		}
+		// Still open somewhere; its last close, or a reclaim, will
+		// bring it back
 	}
-	return -E_MAX_OPEN;
 }
 
 // Look up an open file for envid.
@@ -78,9 +278,156 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Worker threads (see serve_worker)
+struct Worker {
+	envid_t w_id;
+	struct Request *w_rq;	// the request it's serving, or 0
+};
+
+static struct Worker workers[FS_NWORKER];
+static int serve_nworker;	// workers running
+
+// The request the running fiber or worker is serving.
+static struct Request *
+serve_current(void)
+{
+	int i;
+
+	if (!fs_in_worker())
+		return &reqtab[fiber_self()];
+	for (i = 0; i < serve_nworker; i++)
+		if (workers[i].w_id == env->env_id)
+			return workers[i].w_rq;
+	panic("serve_current: thread %08x isn't a worker", env->env_id);
+}
+
+// Answer the running request.  serve() sends the reply next time it
+// gets control, with ipc_reply_wait on its way to waiting for the next
+// request if it can, even if the request has more to do; a worker
+// sends its own.
+static void
+serve_reply(envid_t envid, uint32_t value, void *pg, int perm)
+{
+	struct Request *rq = serve_current();
+
+	rq->rq_replied = 1;
+	rq->rq_reply_envid = envid;
+	rq->rq_reply_value = value;
+	rq->rq_reply_pg = pg;
+	rq->rq_reply_perm = perm;
+}
+
+// Keep the read-ahead for o going if the client asked for file block
+// filebno right after the one before it, doubling the window each time
+// we reach the previous batch, and stop when it seeks.
+static void
+openfile_readahead(struct OpenFile *o, uint32_t filebno)
+{
+	uint32_t start, end;
+
+	if (filebno != o->o_ra_next) {
+		o->o_ra_window = 0;
+		o->o_ra_end = 0;
+	} else if (o->o_ra_window == 0)
+		o->o_ra_window = RA_MIN;
+	o->o_ra_next = filebno + 1;
+	if (o->o_ra_window == 0)
+		return;
+
+	// Start the next batch once the client is halfway into this one,
+	// so it seldom has to wait for the disk.  Reading sleeps, so move
+	// o's window on first, for other requests on o to see.
+	if (filebno + o->o_ra_window / 2 >= o->o_ra_end) {
+		start = MAX(o->o_ra_end, filebno + 1);
+		end = filebno + 1 + o->o_ra_window;
+		o->o_ra_end = end;
+		o->o_ra_window = MIN(2 * o->o_ra_window, RA_MAX);
+		file_readahead(o->o_file, start, end - start);
+	}
+}
+
+// Is the env that was client c gone?
+static bool
+client_gone(int c)
+{
+	envid_t id = clients[c].c_envid;
+
+	return id == 0 || envs[ENVX(id)].env_id != id
+		|| envs[ENVX(id)].env_status == ENV_FREE;
+}
+
+static void
+client_free(int c)
+{
+	int s;
+
+	for (s = 0; s < FSREQ_NSLOT; s++)
+		sys_page_unmap(0, (void *) CLIENTVA(c, s));
+	if (clients[c].c_envid && client_ix[ENVX(clients[c].c_envid)] == c + 1)
+		client_ix[ENVX(clients[c].c_envid)] = 0;
+	clients[c].c_envid = 0;
+}
+
+// Find envid's client number, giving it one if 'create' is set.
+// Returns -E_INVAL if it has none, -E_MAX_OPEN if they're all taken.
+static int
+client_lookup(envid_t envid, bool create)
+{
+	int c = client_ix[ENVX(envid)] - 1;
+
+	if (c >= 0 && clients[c].c_envid == envid)
+		return c;
+	if (!create)
+		return -E_INVAL;
+	// An env that had envid's slot in envs[] has gone, so its entry is
+	// the first to take
+	if (c < 0 || !client_gone(c))
+		for (c = 0; c < FS_NCLIENT && !client_gone(c); c++)
+			;
+	if (c == FS_NCLIENT)
+		return -E_MAX_OPEN;
+	client_free(c);
+	clients[c].c_envid = envid;
+	client_ix[ENVX(envid)] = c + 1;
+	return c;
+}
+
+// The request page envid keeps in 'slot', or 0.
+static void *
+client_page(envid_t envid, int slot)
+{
+	int c;
+
+	if (slot < 0 || slot >= FSREQ_NSLOT || (c = client_lookup(envid, 0)) < 0
+	    || !(vpt[VPN(CLIENTVA(c, slot))] & PTE_P))
+		return 0;
+	return (void *) CLIENTVA(c, slot);
+}
+
+// Keep the page that came with this request as envid's request page
+// in 'slot', and give envid the lease page.
+void
+serve_setup(envid_t envid, int slot, void *pg)
+{
+	int c, r;
+
+	if (slot < 0 || slot >= FSREQ_NSLOT) {
+		r = -E_INVAL;
+		goto out;
+	}
+	if ((r = c = client_lookup(envid, 1)) < 0)
+		goto out;
+	if ((r = sys_page_map(0, pg, 0, (void *) CLIENTVA(c, slot), PTE_P|PTE_U|PTE_W)) >= 0) {
+		serve_reply(envid, r, fslease, PTE_P|PTE_U|PTE_SHARE);
+		return;
+	}
+out:
+	serve_reply(envid, r, 0, 0);
+}
+
 // Serve requests, sending responses back to envid.
-// To send a result back, ipc_send(envid, r, 0, 0).
-// To include a page, ipc_send(envid, r, srcva, perm).
+// To send a result back, serve_reply(envid, r, 0, 0).
+// To include a page, serve_reply(envid, r, srcva, perm).
 void
 serve_open(envid_t envid, struct Fsreq_open *rq)
 {
@@ -88,7 +435,7 @@ serve_open(envid_t envid, struct Fsreq_open *rq)
 	struct File *f;
 	int fileid;
 	int r;
-	struct OpenFile *o;
+	struct OpenFile *o = 0;
 
 	if (debug)
 		cprintf("serve_open %08x %s 0x%x\n", envid, rq->req_path, rq->req_omode);
@@ -105,29 +452,60 @@ serve_open(envid_t envid, struct Fsreq_open *rq)
 	}
 	fileid = r;
 
-	// Open the file
-	if ((r = file_open(path, &f)) < 0) {
+	// Open the file, creating it if need be (a scratch file under
+	// /tmp, say)
+	if ((r = file_open(path, &f)) < 0 && r == -E_NOT_FOUND
+	    && (rq->req_omode & O_CREAT)) {
+		lease_revoke();
+		r = file_create(path, &f);
+	} else if (r == 0 && (rq->req_omode & (O_CREAT|O_EXCL)) == (O_CREAT|O_EXCL))
+		r = -E_FILE_EXISTS;
+	if (r < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
 		goto out;
 	}
+	if ((rq->req_omode & O_TRUNC) && f->f_type != FTYPE_DIR) {
+		exec_forget(f);
+		if ((r = file_set_size(f, 0)) < 0)
+			goto out;
+	}
+	// A compressed file is written to decoded (see fs.c)
+	if ((rq->req_omode & O_ACCMODE) != O_RDONLY
+	    && (r = file_uncompress(f, f->f_size)) < 0)
+		goto out;
+	// A writer may change any of it
+	if ((rq->req_omode & O_ACCMODE) != O_RDONLY)
+		lease_break(f);
 
 	// Save the file pointer
 	o->o_file = f;
+	o->o_opening = 0;
+	openfile_pin(o);
 
-	// Fill out the Fd structure
+	// Fill out the Fd structure.  Another request may be moving an
+	// inline file's data out meanwhile (see file_lock).
+	mutex_lock(file_lock(f));
 	o->o_fd->fd_file.file = *f;
+	mutex_unlock(file_lock(f));
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.lease_slot = lease_slot(f);
+	o->o_fd->fd_file.lease_gen = fslease->l_gen[lease_slot(f)];
+	o->o_fd->fd_file.lease_epoch = fslease->l_epoch;
 	o->o_fd->fd_omode = rq->req_omode;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = rq->req_omode;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
-	ipc_send(envid, 0, o->o_fd, PTE_P|PTE_U|PTE_W|PTE_SHARE);
+	serve_reply(envid, 0, o->o_fd, PTE_P|PTE_U|PTE_W|PTE_SHARE);
 	return;
 out:
-	ipc_send(envid, r, 0, 0);
+	if (o) {
+		o->o_opening = 0;
+		openfile_free(o);
+	}
+	serve_reply(envid, r, 0, 0);
 }
 
 void
@@ -170,23 +548,50 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 	// Here's how it goes.
 
 	// First, use openfile_lookup to find the relevant open file.
-	// On failure, return the error code to the client with ipc_send.
+	// On failure, return the error code to the client with serve_reply.
 	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
 		goto out;
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
+	exec_forget(o->o_file);
 	if ((r = file_set_size(o->o_file, rq->req_size)) < 0)
 		goto out;
 
 	// Third, update the 'struct Fd' copy of the 'struct File'
 	// as appropriate.
 	o->o_fd->fd_file.file.f_size = rq->req_size;
+	openfile_uninlined(o);
 
 	// Finally, return to the client!
 	// (We just return r since we know it's 0 at this point.)
 out:
-	ipc_send(envid, r, 0, 0);
+	serve_reply(envid, r, 0, 0);
+}
+
+void
+serve_fallocate(envid_t envid, struct Fsreq_fallocate *rq)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_fallocate %08x %08x %08x %08x\n", envid, rq->req_fileid,
+			rq->req_offset, rq->req_len);
+
+	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
+		goto out;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY) {
+		r = -E_INVAL;
+		goto out;
+	}
+	exec_forget(o->o_file);
+	if ((r = file_fallocate(o->o_file, rq->req_offset, rq->req_len)) < 0)
+		goto out;
+	o->o_fd->fd_file.file.f_size = o->o_file->f_size;
+	openfile_uninlined(o);
+out:
+	serve_reply(envid, r, 0, 0);
 }
 
 void
@@ -201,26 +606,35 @@ serve_map(envid_t envid, struct Fsreq_map *rq)
 		cprintf("serve_map %08x %08x %08x\n", envid, rq->req_fileid, rq->req_offset);
 
 	// Map the requested block in the client's address space
-	// by using ipc_send.
+	// by using serve_reply.
 	// Map read-only unless the file's open mode (o->o_mode) allows writes
 	// (see the O_ flags in inc/lib.h).
 	
 	// LAB 5: Your code here.
     r = openfile_lookup(envid, rq->req_fileid, &o);
     if (r < 0) {
-        ipc_send(envid, r, 0, 0);
+        serve_reply(envid, r, 0, 0);
         return;
     }
-    r = file_get_block(o->o_file, ROUNDUP(rq->req_offset, BLKSIZE)/BLKSIZE, &blk);
+    // A reader gets holes as the zero block; a writer may write the
+    // page, so it needs a block there
+    if ((o->o_mode & O_ACCMODE) == O_RDONLY) {
+        perm = PTE_P | PTE_U;
+        r = file_peek_block(o->o_file, ROUNDUP(rq->req_offset, BLKSIZE)/BLKSIZE, &blk);
+    } else {
+        // It may fill a hole that readers were given the zero block for
+        perm = PTE_P | PTE_U | PTE_W;
+        lease_break(o->o_file);
+        r = file_get_block(o->o_file, ROUNDUP(rq->req_offset, BLKSIZE)/BLKSIZE, &blk);
+    }
+    openfile_uninlined(o);
     if (r < 0) {
-        ipc_send(envid, r, 0, 0);
+        serve_reply(envid, r, 0, 0);
         return;
     }
-    if ((o->o_mode & O_ACCMODE) == O_RDONLY)
-        perm = PTE_P | PTE_U;
-    else
-        perm = PTE_P | PTE_U | PTE_W;
-    ipc_send(envid, 0, blk, perm);
+    serve_reply(envid, 0, blk, perm);
+    // The client can go on while we read ahead for it
+    openfile_readahead(o, ROUNDUP(rq->req_offset, BLKSIZE)/BLKSIZE);
     return;
 }
 
@@ -238,14 +652,67 @@ serve_close(envid_t envid, struct Fsreq_close *rq)
 	// LAB 5: Your code here.
     r = openfile_lookup(envid, rq->req_fileid, &o);
     if (r < 0) {
-        ipc_send(envid, r, 0, 0);
+        serve_reply(envid, r, 0, 0);
         return;
     }
     file_close(o->o_file);
-    ipc_send(envid, 0, 0, 0);
+    openfile_unpin(o);
+    openfile_free(o);
+    serve_reply(envid, 0, 0, 0);
     return;
 }
 
+void
+serve_close_batch(envid_t envid, struct Fsreq_close_batch *rq)
+{
+	struct Fsclose_ent *ce;
+	struct OpenFile *o;
+	uint32_t i, j;
+	int r, ret = 0;
+
+	if (debug)
+		cprintf("serve_close_batch %08x %d\n", envid, rq->req_n);
+
+	if (rq->req_n > FSCLOSE_MAXENT) {
+		serve_reply(envid, -E_INVAL, 0, 0);
+		return;
+	}
+	// The dirt first: it may be from an fd dup'd from one closed here
+	for (i = 0; i < rq->req_n; i++) {
+		ce = &rq->req_ent[i];
+		if (ce->ce_npages == 0)
+			continue;
+		if ((r = openfile_lookup(envid, ce->ce_fileid, &o)) < 0) {
+			ret = ret ? ret : r;
+			continue;
+		}
+		exec_forget(o->o_file);
+		for (j = 0; j < ce->ce_npages; j++)
+			if ((r = file_dirty(o->o_file, ce->ce_offset + j * PGSIZE)) < 0)
+				ret = ret ? ret : r;
+	}
+	for (i = 0; i < rq->req_n; i++) {
+		ce = &rq->req_ent[i];
+		if (ce->ce_npages != 0)
+			continue;
+		if ((r = openfile_lookup(envid, ce->ce_fileid, &o)) < 0) {
+			ret = ret ? ret : r;
+			continue;
+		}
+		if (ce->ce_offset != o->o_file->f_size) {
+			exec_forget(o->o_file);
+			if ((r = file_set_size(o->o_file, ce->ce_offset)) < 0)
+				ret = ret ? ret : r;
+			else
+				o->o_fd->fd_file.file.f_size = ce->ce_offset;
+		}
+		file_close(o->o_file);
+		openfile_unpin(o);
+		openfile_free(o);
+	}
+	serve_reply(envid, ret, 0, 0);
+}
+
 void
 serve_remove(envid_t envid, struct Fsreq_remove *rq)
 {
@@ -262,8 +729,9 @@ serve_remove(envid_t envid, struct Fsreq_remove *rq)
 	// LAB 5: Your code here.
 	memmove(path, rq->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
+    exec_forget(0);
     r = file_remove(path);
-    ipc_send(envid, r, 0, 0);
+    serve_reply(envid, r, 0, 0);
     return;
 }
 
@@ -282,11 +750,12 @@ serve_dirty(envid_t envid, struct Fsreq_dirty *rq)
 	// LAB 5: Your code here.
     r = openfile_lookup(envid, rq->req_fileid, &o);
     if (r < 0) {
-        ipc_send(envid, r, 0, 0);
+        serve_reply(envid, r, 0, 0);
         return;
     }
+    exec_forget(o->o_file);
     r = file_dirty(o->o_file, rq->req_offset);
-    ipc_send(envid, r, 0, 0);
+    serve_reply(envid, r, 0, 0);
     return;
 }
 
@@ -294,57 +763,919 @@ void
 serve_sync(envid_t envid)
 {
 	fs_sync();
-	ipc_send(envid, 0, 0, 0);
+	serve_reply(envid, 0, 0, 0);
+}
+
+// Write back and drop the block cache, replying with the number of
+// blocks dropped.  Clients' caches hold blocks too; they go next time.
+void
+serve_drop_cache(envid_t envid)
+{
+	lease_revoke();
+	serve_reply(envid, bc_drop_all(), 0, 0);
+}
+
+// Take, roll back to, drop or look at the disk's snapshot (snap.c).
+void
+serve_snapshot(envid_t envid, struct Fsreq_snapshot *rq)
+{
+	int r;
+
+	if (debug)
+		cprintf("serve_snapshot %08x %d %d\n", envid, rq->req_op, rq->req_nblocks);
+
+	switch (rq->req_op) {
+	case SNAPREQ_TAKE:
+		r = snap_take(rq->req_nblocks);
+		break;
+	case SNAPREQ_ROLLBACK:
+		r = snap_rollback();
+		break;
+	case SNAPREQ_DROP:
+		r = snap_drop();
+		break;
+	case SNAPREQ_STAT:
+		r = snap_stat();
+		break;
+	default:
+		r = -E_INVAL;
+		break;
+	}
+	serve_reply(envid, r, 0, 0);
+}
+
+// Requests that only read the file system -- opens, and maps of files
+// open read-only -- run side by side, each sleeping while the disk
+// works for it; anything else waits for them and then runs alone, as
+// every request used to.  Waiting exclusive requests hold up new
+// shared ones, so they don't starve.  Requests given to worker threads
+// are shared ones, counted in serve_nworking; a worker that finishes
+// while an exclusive request waits tells the main loop to wake it.
+static int serve_nshared;
+static bool serve_excl;
+static volatile int serve_nexcl_waiting;
+static volatile uint32_t serve_nworking;
+static struct FiberQ serve_lockq;
+
+static void
+serve_lock(struct Request *rq)
+{
+	if (rq->rq_excl) {
+		serve_nexcl_waiting++;
+		mb();		// before we look at serve_nworking
+		while (serve_excl || serve_nshared > 0 || serve_nworking > 0)
+			fiber_sleep(&serve_lockq);
+		serve_nexcl_waiting--;
+		serve_excl = 1;
+	} else {
+		while (serve_excl || serve_nexcl_waiting > 0)
+			fiber_sleep(&serve_lockq);
+		serve_nshared++;
+	}
+}
+
+static void
+serve_unlock(struct Request *rq)
+{
+	if (rq->rq_excl)
+		serve_excl = 0;
+	else
+		serve_nshared--;
+	fiber_wakeup(&serve_lockq);
+}
+
+// Map the n blocks of f from filebno on at va in envid, with perm,
+// setting *nmapped to how many we mapped before any error.
+// Blocks adjacent on disk are mostly adjacent in DISKMAP, so each run of
+// them goes over in one sys_page_map_range.  Blocks got while we collect stay
+// cached, since the running request's epoch pins them; runs are cut at
+// FSMAP_MAXPAGES so that not too many are pinned at once.
+static int
+file_map_blocks(struct File *f, uint32_t filebno, uint32_t n, envid_t envid,
+		uintptr_t va, int perm, uint32_t *nmapped)
+{
+	int r = 0;
+	char *blk, *run;
+	uint32_t i, len;
+
+	run = 0;
+	len = 0;
+	for (i = 0; i < n; i++) {
+		// Holes come over as the zero block, unless writable
+		if ((r = (perm & PTE_W) ? file_get_block(f, filebno + i, &blk)
+		     : file_peek_block(f, filebno + i, &blk)) < 0)
+			break;
+		if (run && (blk != run + len * BLKSIZE || len == FSMAP_MAXPAGES)) {
+			if ((r = sys_page_map_range(0, run, envid,
+					(void *) (va + (i - len) * PGSIZE), len, perm)) < 0) {
+				i -= len;
+				run = 0;
+				break;
+			}
+			run = 0;
+		}
+		if (!run) {
+			run = blk;
+			len = 0;
+		}
+		len++;
+	}
+	if (run && (r = sys_page_map_range(0, run, envid,
+			(void *) (va + (i - len) * PGSIZE), len, perm)) < 0)
+		i -= len;
+	*nmapped = i;
+	return r < 0 ? r : 0;
+}
+
+// Map blocks of an open file straight into the client, which has
+// granted us the pages.  We stop early at the first block that fails, and
+// reply with how many we mapped.
+void
+serve_map_range(envid_t envid, struct Fsreq_map_range *rq)
+{
+	int r, perm;
+	uint32_t filebno, i, n;
+	struct OpenFile *o;
+
+	if (debug)
+		cprintf("serve_map_range %08x %08x %08x %d\n", envid, rq->req_fileid,
+			rq->req_offset, rq->req_npages);
+
+	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0) {
+		serve_reply(envid, r, 0, 0);
+		return;
+	}
+	if (rq->req_npages == 0 || rq->req_npages > FSMAP_MAXPAGES
+	    || PGOFF(rq->req_va) != 0) {
+		serve_reply(envid, -E_INVAL, 0, 0);
+		return;
+	}
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		perm = PTE_P | PTE_U;
+	else {
+		perm = PTE_P | PTE_U | PTE_W;
+		lease_break(o->o_file);
+	}
+
+	filebno = ROUNDUP(rq->req_offset, BLKSIZE) / BLKSIZE;
+	r = file_map_blocks(o->o_file, filebno, rq->req_npages, envid, rq->req_va, perm, &i);
+	openfile_uninlined(o);
+	serve_reply(envid, i > 0 ? i : r, 0, 0);
+
+	// The client can go on while we read ahead for it
+	for (n = 0; n < i; n++)
+		openfile_readahead(o, filebno + n);
+}
+
+// Program images.
+//
+// serve_exec keeps what it learned from the ELF headers of the last few
+// programs it loaded, so spawning the same program again reads no
+// headers: the program's text and data are already in the block cache
+// (the children running it have them mapped), and go to the new child
+// with a few sys_page_map_ranges.  Anything that may change a file's
+// contents or reuse its struct File forgets the file (exec_forget),
+// which breaks its lease as well.
+// A program linked against the shared library names it in a PT_INTERP
+// header, and spawn loads that file into the child too; its text is one
+// file's blocks, so every program using it shares the one copy.
+
+#define NEXECCACHE	8
+
+struct ExecImage {
+	struct File *x_file;	// 0 if the slot is unused
+	uint32_t x_entry;
+	uint32_t x_nseg;
+	struct Fsexec_seg x_seg[FSEXEC_MAXSEG];
+	char x_interp[FSEXEC_MAXINTERP];
+};
+
+static struct ExecImage execcache[NEXECCACHE];
+static int exec_next;		// slot to fill next
+
+// Forget what we know about f, or about all files if f is 0.
+static void
+exec_forget(struct File *f)
+{
+	int i;
+
+	if (f == 0)
+		lease_revoke();
+	else
+		lease_break(f);
+	for (i = 0; i < NEXECCACHE; i++)
+		if (f == 0 || execcache[i].x_file == f)
+			execcache[i].x_file = 0;
+}
+
+// Copy the path of the library f's PT_INTERP header 'ph' names into x;
+// the path must lie in one block.
+static int
+exec_interp(struct File *f, struct Proghdr *ph, struct ExecImage *x)
+{
+	char *blk;
+	int r;
+
+	if (ph->p_filesz == 0 || ph->p_filesz > FSEXEC_MAXINTERP
+	    || ph->p_offset + ph->p_filesz > f->f_size
+	    || ph->p_offset / BLKSIZE != (ph->p_offset + ph->p_filesz - 1) / BLKSIZE)
+		return -E_INVAL;
+	if ((r = file_peek_block(f, ph->p_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	memmove(x->x_interp, blk + ph->p_offset % BLKSIZE, ph->p_filesz);
+	x->x_interp[ph->p_filesz - 1] = 0;
+	return 0;
+}
+
+// Find, or read and check, f's program image.
+static int
+exec_lookup(struct File *f, struct ExecImage *x)
+{
+	int i, r;
+	char *blk;
+	struct Elf *elf;
+	struct Proghdr *ph, interp;
+
+	for (i = 0; i < NEXECCACHE; i++)
+		if (execcache[i].x_file == f) {
+			*x = execcache[i];
+			return 0;
+		}
+
+	// The ELF and program headers must be in the first block, and an
+	// inline file is too small to hold a program to map
+	if (f->f_flags & FILE_INLINE)
+		return -E_INVAL;
+	if ((r = file_peek_block(f, 0, &blk)) < 0)
+		return r;
+	elf = (struct Elf *) blk;
+	if (f->f_size < sizeof(struct Elf) || elf->e_magic != ELF_MAGIC
+	    || elf->e_phoff > BLKSIZE
+	    || elf->e_phnum > (BLKSIZE - elf->e_phoff) / sizeof(struct Proghdr))
+		return -E_INVAL;
+	x->x_file = f;
+	x->x_entry = elf->e_entry;
+	x->x_nseg = 0;
+	x->x_interp[0] = 0;
+	interp.p_type = 0;
+	ph = (struct Proghdr *) (blk + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type == ELF_PROG_INTERP)
+			interp = *ph;
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (x->x_nseg == FSEXEC_MAXSEG
+		    || ph->p_filesz > ph->p_memsz
+		    || ph->p_offset + ph->p_filesz > f->f_size
+		    || PGOFF(ph->p_offset) != PGOFF(ph->p_va)
+		    || ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va)
+			return -E_INVAL;
+		x->x_seg[x->x_nseg].s_va = ph->p_va;
+		x->x_seg[x->x_nseg].s_offset = ph->p_offset;
+		x->x_seg[x->x_nseg].s_filesz = ph->p_filesz;
+		x->x_seg[x->x_nseg].s_memsz = ph->p_memsz;
+		x->x_seg[x->x_nseg].s_flags = ph->p_flags;
+		x->x_nseg++;
+	}
+	// Reading the path may take block 0 out of the cache: it comes last
+	if (interp.p_type == ELF_PROG_INTERP && (r = exec_interp(f, &interp, x)) < 0)
+		return r;
+
+	// Another fiber reading the same headers may have filled a slot
+	// for f while we waited for the block; a second copy does no harm
+	execcache[exec_next] = *x;
+	exec_next = (exec_next + 1) % NEXECCACHE;
+	return 0;
+}
+
+void
+serve_exec(envid_t envid, struct Fsreq_exec *rq)
+{
+	int r;
+	uint32_t i, start, end, n;
+	envid_t child = rq->req_child;
+	struct Fsret_exec *ret = (struct Fsret_exec *) rq;
+	struct Fsexec_seg *seg;
+	struct ExecImage x;
+	struct OpenFile *o;
+
+	if (debug)
+		cprintf("serve_exec %08x %08x %08x\n", envid, rq->req_fileid, child);
+
+	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0
+	    || (r = exec_lookup(o->o_file, &x)) < 0)
+		goto out;
+
+	// Text whole; of data, only the pages the data fills
+	for (i = 0; i < x.x_nseg; i++) {
+		seg = &x.x_seg[i];
+		start = ROUNDDOWN(seg->s_offset, PGSIZE);
+		if (seg->s_flags & ELF_PROG_FLAG_WRITE)
+			end = ROUNDDOWN(seg->s_offset + seg->s_filesz, PGSIZE);
+		else
+			end = ROUNDUP(seg->s_offset + seg->s_filesz, PGSIZE);
+		if (end <= start)
+			continue;
+		if ((r = file_map_blocks(o->o_file, start / BLKSIZE, (end - start) / PGSIZE,
+					 child, ROUNDDOWN(seg->s_va, PGSIZE),
+					 (seg->s_flags & ELF_PROG_FLAG_WRITE)
+					 ? PTE_P | PTE_U | PTE_COW : PTE_P | PTE_U, &n)) < 0)
+			goto out;
+	}
+
+	ret->ret_entry = x.x_entry;
+	ret->ret_nseg = x.x_nseg;
+	memmove(ret->ret_seg, x.x_seg, sizeof(x.x_seg));
+	memmove(ret->ret_interp, x.x_interp, sizeof(x.x_interp));
+out:
+	serve_reply(envid, r, 0, 0);
+}
+
+// Look a path up and send back what stat() wants, without opening it.
+void
+serve_stat(envid_t envid, struct Fsreq_stat *rq)
+{
+	char path[MAXPATHLEN];
+	struct Fsret_stat *ret = (struct Fsret_stat *) rq;
+	struct File *f;
+	int r;
+
+	if (debug)
+		cprintf("serve_stat %08x %s\n", envid, rq->req_path);
+
+	memmove(path, rq->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	if ((r = file_open(path, &f)) == 0) {
+		memmove(ret->ret_name, f->f_name, MAXNAMELEN);
+		ret->ret_name[MAXNAMELEN-1] = 0;
+		ret->ret_size = f->f_size;
+		ret->ret_isdir = (f->f_type == FTYPE_DIR);
+	}
+	serve_reply(envid, r, 0, 0);
 }
 
+// Pack the entries in use of the directory open as rq->req_fileid, from
+// rq->req_offset on, into the request page, as many as fit.  Only the
+// name, size and type go: a client listing a directory wants no more.
+void
+serve_readdir(envid_t envid, struct Fsreq_readdir *rq)
+{
+	struct Fsret_readdir *ret = (struct Fsret_readdir *) rq;
+	struct OpenFile *o;
+	struct Fsdirent *d;
+	struct File *f;
+	uint32_t pos, len = 0, namelen;
+	char *blk;
+	int r, n = 0;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %08x\n", envid, rq->req_fileid, rq->req_offset);
+
+	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
+		goto out;
+	if (o->o_file->f_type != FTYPE_DIR || rq->req_offset < 0) {
+		r = -E_INVAL;
+		goto out;
+	}
+	pos = ROUNDUP(rq->req_offset, sizeof(struct File));
+	for (; pos < o->o_file->f_size; pos += sizeof(struct File)) {
+		// What we have so far, if the rest won't come
+		if ((r = file_peek_block(o->o_file, pos / BLKSIZE, &blk)) < 0) {
+			if (n == 0)
+				goto out;
+			break;
+		}
+		f = (struct File *) (blk + pos % BLKSIZE);
+		if (f->f_name[0] == '\0')
+			continue;
+		namelen = strnlen(f->f_name, MAXNAMELEN - 1);
+		if (len + FSDIRENT_SIZE(namelen) > sizeof(ret->ret_buf))
+			break;
+		d = (struct Fsdirent *) (ret->ret_buf + len);
+		d->d_size = f->f_size;
+		d->d_type = f->f_type;
+		d->d_namelen = namelen;
+		memmove(d->d_name, f->f_name, namelen);
+		d->d_name[namelen] = '\0';
+		len += FSDIRENT_SIZE(namelen);
+		n++;
+	}
+	ret->ret_offset = pos;
+	ret->ret_len = len;
+	r = n;
+out:
+	serve_reply(envid, r, 0, 0);
+}
+
+// May this request run alongside others?
+static bool
+serve_is_shared(envid_t whom, uint32_t req, void *pg)
+{
+	struct OpenFile *o;
+
+	// Creating or truncating changes the file system, as does opening
+	// a compressed file to write (file_uncompress)
+	if (req == FSREQ_OPEN)
+		return !(((struct Fsreq_open *) pg)->req_omode & (O_CREAT|O_TRUNC))
+			&& (((struct Fsreq_open *) pg)->req_omode & O_ACCMODE) == O_RDONLY;
+	if (req == FSREQ_STAT || req == FSREQ_SETUP)
+		return 1;
+	// Readers leave holes alone (see file_peek_block)
+	return (req == FSREQ_MAP || req == FSREQ_MAP_RANGE || req == FSREQ_EXEC
+		|| req == FSREQ_READDIR)
+		&& openfile_lookup(whom, ((struct Fsreq_map *) pg)->req_fileid, &o) == 0
+		&& (o->o_mode & O_ACCMODE) == O_RDONLY;
+}
+
+// The body of request fiber i.
+static void
+serve_request(void *arg)
+{
+	struct Request *rq = arg;
+	envid_t whom = rq->rq_whom;
+	void *pg = rq->rq_pg;
+
+	serve_lock(rq);
+	switch (rq->rq_type) {
+	case FSREQ_SETUP:
+		serve_setup(whom, rq->rq_slot, pg);
+		break;
+	case FSREQ_OPEN:
+		serve_open(whom, (struct Fsreq_open*)pg);
+		break;
+	case FSREQ_MAP:
+		serve_map(whom, (struct Fsreq_map*)pg);
+		break;
+	case FSREQ_SET_SIZE:
+		serve_set_size(whom, (struct Fsreq_set_size*)pg);
+		break;
+	case FSREQ_FALLOCATE:
+		serve_fallocate(whom, (struct Fsreq_fallocate*)pg);
+		break;
+	case FSREQ_CLOSE:
+		serve_close(whom, (struct Fsreq_close*)pg);
+		break;
+	case FSREQ_DIRTY:
+		serve_dirty(whom, (struct Fsreq_dirty*)pg);
+		break;
+	case FSREQ_CLOSE_BATCH:
+		serve_close_batch(whom, (struct Fsreq_close_batch*)pg);
+		break;
+	case FSREQ_REMOVE:
+		serve_remove(whom, (struct Fsreq_remove*)pg);
+		break;
+	case FSREQ_SYNC:
+		serve_sync(whom);
+		break;
+	case FSREQ_DROP_CACHE:
+		serve_drop_cache(whom);
+		break;
+	case FSREQ_SNAPSHOT:
+		serve_snapshot(whom, (struct Fsreq_snapshot*)pg);
+		break;
+	case FSREQ_MAP_RANGE:
+		serve_map_range(whom, (struct Fsreq_map_range*)pg);
+		break;
+	case FSREQ_EXEC:
+		serve_exec(whom, (struct Fsreq_exec*)pg);
+		break;
+	case FSREQ_STAT:
+		serve_stat(whom, (struct Fsreq_stat*)pg);
+		break;
+	case FSREQ_READDIR:
+		serve_readdir(whom, (struct Fsreq_readdir*)pg);
+		break;
+	case SERVE_FLUSH:
+		fs_flush();
+		break;
+	default:
+		cprintf("Invalid request code %d from %08x\n", whom, rq->rq_type);
+		break;
+	}
+	serve_unlock(rq);
+	rq->rq_done = 1;
+}
+
+// Fairness between clients.  Replies often go out before the request
+// is done -- a map's fiber goes on reading ahead -- so a client that
+// streams requests, say FSREQ_MAPs through a big file, could fill every
+// slot and keep the rest waiting in our send queue.  Instead each env
+// may have FS_CLIENT_NREQ requests started and not yet retired.  One
+// past that waits in its slot, and as the client's others finish the
+// waiting requests start in turn, round-robin from the slot after the
+// last one started.  Clients wait for each reply, so one holds at most
+// FS_CLIENT_NREQ + 1 slots and the others always find some free.
+static uint8_t client_nreq[NENV];	// ENVX(envid) -> requests started
+static int serve_rr;			// slot last started from waiting
+
+static bool serve_to_worker(int i);
+
+static void
+serve_start(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	rq->rq_deferred = 0;
+	if (rq->rq_whom)
+		client_nreq[ENVX(rq->rq_whom)]++;
+	if (!serve_to_worker(i))
+		fiber_start(i, serve_request, rq);
+}
+
+// Start request i, just received, unless its client has enough going.
+static void
+serve_admit(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	if (rq->rq_whom && client_nreq[ENVX(rq->rq_whom)] >= FS_CLIENT_NREQ) {
+		rq->rq_deferred = 1;
+		return;
+	}
+	serve_start(i);
+}
+
+// Start the waiting requests whose clients have room now.
+static void
+serve_start_deferred(void)
+{
+	int i, k, rr = serve_rr;
+	struct Request *rq;
+
+	for (k = 1; k <= FS_NFIBER; k++) {
+		i = (rr + k) % FS_NFIBER;
+		rq = &reqtab[i];
+		if (rq->rq_busy && rq->rq_deferred
+		    && client_nreq[ENVX(rq->rq_whom)] < FS_CLIENT_NREQ) {
+			serve_start(i);
+			serve_rr = i;
+		}
+	}
+}
+
+// Let the block cache evict what only finished requests used.
+static void
+serve_set_oldest(void)
+{
+	int i;
+	uint32_t oldest = bc_new_epoch();	// newer than any block's
+
+	for (i = 0; i < FS_NFIBER; i++)
+		if (reqtab[i].rq_busy && reqtab[i].rq_epoch < oldest)
+			oldest = reqtab[i].rq_epoch;
+	bc_set_oldest(oldest);
+}
+
+// Free request slot i if it is done and answered.
+static void
+serve_retire(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	if (!rq->rq_busy || !rq->rq_done || rq->rq_replied)
+		return;
+	if (rq->rq_pg == (void *) REQVA(i))
+		sys_page_unmap(0, (void*) REQVA(i));
+	if (rq->rq_whom)
+		client_nreq[ENVX(rq->rq_whom)]--;
+	rq->rq_busy = 0;
+	serve_set_oldest();
+}
+
+// Send request i's reply on its own.  Clients wait in ipc_call, so they
+// are receiving; if one has gone, the reply is dropped.
+static void
+serve_send(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	(void) sys_ipc_try_send(rq->rq_reply_envid, rq->rq_reply_value,
+				rq->rq_reply_pg ? rq->rq_reply_pg : (void *) UTOP,
+				rq->rq_reply_perm);
+	rq->rq_replied = 0;
+	serve_retire(i);
+}
+
+// The write-back flusher.  It runs every FS_FLUSH_PERIOD requests,
+// and whenever we've served any since it last ran and then had nothing
+// to do for FS_FLUSH_IDLE clock ticks: dirty blocks don't sit in memory
+// for long after a burst of work, and a later fs_sync has little left
+// to write, but a client pausing between requests doesn't get a flush
+// in its way.  It runs next, too, once the metadata waiting to be
+// committed fills the journal.  It runs as a request of our own,
+// exclusive so that nothing dirties blocks under fs_flush, with no
+// client and no reply.
+static uint32_t serve_nreqs;	// requests since it last started
+
+static bool
+serve_flush_due(void)
+{
+	int i;
+
+	for (i = 0; i < FS_NFIBER; i++)
+		if (reqtab[i].rq_busy && reqtab[i].rq_type == SERVE_FLUSH)
+			return 0;
+	return serve_nreqs >= FS_FLUSH_PERIOD || journal_full();
+}
+
+// Should the flusher run if no request comes for FS_FLUSH_IDLE ticks?
+// Only if there's been work, and none is left but the reply we hold.
+static bool
+serve_flush_idle(int held)
+{
+	int i;
+
+	if (serve_nreqs == 0)
+		return 0;
+	for (i = 0; i < FS_NFIBER; i++)
+		if (reqtab[i].rq_busy && i != held)
+			return 0;
+	return 1;
+}
+
+static void
+serve_start_flush(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	memset(rq, 0, sizeof(*rq));
+	rq->rq_busy = 1;
+	rq->rq_type = SERVE_FLUSH;
+	rq->rq_excl = 1;
+	rq->rq_epoch = bc_new_epoch();
+	serve_nreqs = 0;
+	fiber_start(i, serve_request, rq);
+}
+
+// Worker threads.
+//
+// Opens and stats are mostly path lookups through directory blocks the
+// cache has already, so threads of ours on other CPUs serve them, while
+// the main loop goes on receiving and running fibers.  They share the
+// block cache, the path cache and the open-file table, under the locks
+// in fs.c and opentab_lock.  A worker can't wait for the disk, though:
+// if the request needs a block that isn't in, or would change the file
+// system, it fails with -E_FS_RETRY and goes back to the main loop,
+// which runs it again in fiber i.  Everything else -- the bitmap, the
+// journal, writes to Files -- belongs to exclusive requests, which wait
+// for the workers to finish, or to the main thread.
+//
+// A worker sends the reply itself, and the main loop frees the slot the
+// next time round, unless it's waiting for one (serve_slot_wait), or
+// has a request to run again or an exclusive one to wake: then the
+// worker tells it with sys_addr_wake or a message.
+static envid_t serve_envid;		// the main loop's
+static struct Mutex work_lock;
+static struct Cond work_cond;
+static int work_queue[FS_NFIBER];	// request slots waiting for a worker
+static uint32_t work_head, work_tail;
+static volatile bool serve_slot_wait;	// main loop sleeps on serve_nworking
+
+static void
+serve_worker(void *arg)
+{
+	struct Worker *w = arg;
+	struct Request *rq;
+	bool retry;
+
+	while (1) {
+		mutex_lock(&work_lock);
+		while (work_head == work_tail)
+			cond_wait(&work_cond, &work_lock);
+		rq = &reqtab[work_queue[work_head++ % FS_NFIBER]];
+		mutex_unlock(&work_lock);
+
+		w->w_rq = rq;
+		if (rq->rq_type == FSREQ_OPEN)
+			serve_open(rq->rq_whom, (struct Fsreq_open *) rq->rq_pg);
+		else
+			serve_stat(rq->rq_whom, (struct Fsreq_stat *) rq->rq_pg);
+		w->w_rq = 0;
+
+		retry = rq->rq_reply_value == (uint32_t) -E_FS_RETRY;
+		if (!retry)
+			// Clients wait in ipc_call, so they are receiving
+			(void) sys_ipc_try_send(rq->rq_reply_envid, rq->rq_reply_value,
+						rq->rq_reply_pg ? rq->rq_reply_pg : (void *) UTOP,
+						rq->rq_reply_perm);
+		rq->rq_replied = 0;
+		if (retry)
+			rq->rq_retry = 1;
+		else
+			rq->rq_done = 1;
+		atomic_dec(&serve_nworking);
+		if (serve_slot_wait)
+			sys_addr_wake(&serve_nworking, ADDR_WAKE_ALL);
+		if (retry || serve_nexcl_waiting > 0)
+			ipc_send(serve_envid, 0, 0, 0);
+	}
+}
+
+// Start the worker threads, one for each CPU but the main loop's, up to
+// FS_NWORKER.
+static void
+serve_start_workers(void)
+{
+	int n = MIN(FS_NWORKER, (int) kinfo.ki_ncpu - 1);
+	envid_t tid;
+
+	serve_envid = sys_getenvid();
+	for (; serve_nworker < n; serve_nworker++) {
+		workers[serve_nworker].w_rq = 0;
+		if ((tid = thread_create(serve_worker, &workers[serve_nworker])) < 0) {
+			cprintf("fs: thread_create: %e\n", tid);
+			break;
+		}
+		workers[serve_nworker].w_id = tid;
+		(void) sys_env_set_priority(tid, ENV_PRIO_HIGH);
+	}
+	if (serve_nworker > 0)
+		cprintf("FS has %d worker threads\n", serve_nworker);
+}
+
+// Is envid one of our workers?
+static bool
+serve_is_worker(envid_t envid)
+{
+	int i;
+
+	for (i = 0; i < serve_nworker; i++)
+		if (workers[i].w_id == envid)
+			return 1;
+	return 0;
+}
+
+// Give request i to a worker, if it's one they serve and it may start
+// now.  On a disk bigger than DISKMAP, blocks share pages and the
+// cache's reverse map changes under a worker, so they sit it out.
+static bool
+serve_to_worker(int i)
+{
+	struct Request *rq = &reqtab[i];
+
+	if (serve_nworker == 0 || rq->rq_excl || serve_excl || serve_nexcl_waiting > 0
+	    || (rq->rq_type != FSREQ_OPEN && rq->rq_type != FSREQ_STAT)
+	    || super->s_nblocks > DISKMAP_NBLOCKS)
+		return 0;
+	rq->rq_worker = 1;
+	atomic_inc(&serve_nworking);
+	mutex_lock(&work_lock);
+	work_queue[work_tail++ % FS_NFIBER] = i;
+	cond_signal(&work_cond);
+	mutex_unlock(&work_lock);
+	return 1;
+}
+
+// Run the requests workers gave back in their fibers, and wake the
+// exclusive requests that were waiting for workers.
+static void
+serve_take_back(void)
+{
+	int i;
+
+	for (i = 0; i < FS_NFIBER; i++)
+		if (reqtab[i].rq_busy && reqtab[i].rq_retry) {
+			reqtab[i].rq_retry = 0;
+			reqtab[i].rq_worker = 0;
+			fiber_start(i, serve_request, &reqtab[i]);
+		}
+	if (serve_nexcl_waiting > 0 && serve_nworking == 0)
+		fiber_wakeup(&serve_lockq);
+}
+
+// The main loop.  Each request runs in a fiber of its own until it has
+// to wait for the disk; meanwhile we answer other requests, so a cached
+// block doesn't wait behind someone else's cold read.  We learn about
+// the disk finishing the same way we learn about requests: sys_irq_listen
+// has the kernel send the disk's interrupt as a message from envid 0.
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm;
-	
+	uint32_t req, whom, n;
+	int perm, held, i, r;
+	struct Request *rq;
+	void *pg;
+
+	serve_start_workers();
+	serve_set_oldest();
 	while (1) {
+		// Run requests until every one is done or asleep
+		serve_start_deferred();
+		serve_take_back();
+		fiber_run();
+
+		// Send all waiting replies but one, which goes with the next
+		// ipc_reply_wait
+		held = -1;
+		for (i = 0; i < FS_NFIBER; i++) {
+			serve_retire(i);
+			if (!reqtab[i].rq_replied || reqtab[i].rq_worker)
+				continue;
+			if (held < 0)
+				held = i;
+			else
+				serve_send(i);
+		}
+
+		// A free slot for the next request
+		for (i = 0; i < FS_NFIBER && reqtab[i].rq_busy; i++)
+			;
+		if (i == FS_NFIBER) {
+			if (held >= 0) {
+				serve_send(held);
+				continue;
+			}
+			// Workers have some: wait for one to finish
+			if ((n = serve_nworking) > 0) {
+				serve_slot_wait = 1;
+				mb();
+				sys_addr_wait(&serve_nworking, n);
+				serve_slot_wait = 0;
+				continue;
+			}
+			// Every request is waiting on the disk
+			if ((r = sys_irq_wait(bdev->bd_irq)) < 0)
+				panic("serve: all requests asleep, but sys_irq_wait: %e", r);
+			bdev->bd_intr();
+			continue;
+		}
+
+		if (serve_flush_due()) {
+			serve_start_flush(i);
+			continue;
+		}
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, (void *) REQVA, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, vpt[VPN(REQVA)], REQVA);
+		if (serve_flush_idle(held)) {
+			// Wait with a timeout, which ipc_reply_wait can't
+			if (held >= 0)
+				serve_send(held);
+			req = ipc_recv_timeout((int32_t *) &whom, (void *) REQVA(i),
+					       &perm, FS_FLUSH_IDLE);
+			if ((int32_t) req == -E_TIMEOUT) {
+				serve_start_flush(i);
+				continue;
+			}
+		} else if (held >= 0) {
+			rq = &reqtab[held];
+			req = ipc_reply_wait(rq->rq_reply_envid, rq->rq_reply_value,
+					     rq->rq_reply_pg, rq->rq_reply_perm,
+					     (void *) REQVA(i), (int32_t *) &whom, &perm);
+			rq->rq_replied = 0;
+			serve_retire(held);
+		} else
+			req = ipc_reply_wait(0, 0, 0, 0, (void *) REQVA(i),
+					     (int32_t *) &whom, &perm);
+		if ((int32_t) req < 0) {
+			cprintf("fs: receive failed: %e\n", req);
+			continue;
+		}
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// From the kernel: the disk is done
+		if (whom == 0) {
+			if ((int) req == bdev->bd_irq)
+				bdev->bd_intr();
+			continue;
+		}
+		// From a worker, which has given a request back or finished
+		// what an exclusive one waits for: serve_take_back sees to it
+		if (serve_is_worker(whom))
+			continue;
+		// All requests must contain an argument page, be in a page
+		// the client gave us to keep, or fit in a short message
+		rq = &reqtab[i];
+		if (perm & PTE_P)
+			pg = (void *) REQVA(i);
+		else if (FSREQ_ISREGS(req)) {
+			if (!FSREQ_FITS_REGS(FSREQ_TYPE(req))) {
+				cprintf("Invalid request from %08x: %d in registers\n",
+					whom, FSREQ_TYPE(req));
+				(void) sys_ipc_try_send(whom, -E_INVAL, (void *) UTOP, 0);
+				continue;
+			}
+			pg = rq->rq_words;
+		} else if (!(pg = client_page(whom, FSREQ_SLOT(req)))) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-            /*cprintf("0x%x\n", perm);*/
-			continue; // just leave it hanging...
+			(void) sys_ipc_try_send(whom, -E_INVAL, (void *) UTOP, 0);
+			continue;
 		}
+		if (debug)
+			cprintf("fs req %d from %08x [page %08x: %s]\n",
+				req, whom, vpt[VPN(pg)], pg);
 
-		switch (req) {
-		case FSREQ_OPEN:
-			serve_open(whom, (struct Fsreq_open*)REQVA);
-			break;
-		case FSREQ_MAP:
-			serve_map(whom, (struct Fsreq_map*)REQVA);
-			break;
-		case FSREQ_SET_SIZE:
-			serve_set_size(whom, (struct Fsreq_set_size*)REQVA);
-			break;
-		case FSREQ_CLOSE:
-			serve_close(whom, (struct Fsreq_close*)REQVA);
-			break;
-		case FSREQ_DIRTY:
-			serve_dirty(whom, (struct Fsreq_dirty*)REQVA);
-			break;
-		case FSREQ_REMOVE:
-			serve_remove(whom, (struct Fsreq_remove*)REQVA);
-			break;
-		case FSREQ_SYNC:
-			serve_sync(whom);
-			break;
-		default:
-			cprintf("Invalid request code %d from %08x\n", whom, req);
-			break;
-		}
-		sys_page_unmap(0, (void*) REQVA);
+		memset(rq, 0, sizeof(*rq));
+		if (pg == rq->rq_words)
+			memmove(rq->rq_words, (void *) env->env_ipc_words, sizeof(rq->rq_words));
+		rq->rq_busy = 1;
+		rq->rq_type = FSREQ_TYPE(req);
+		rq->rq_slot = FSREQ_SLOT(req);
+		rq->rq_whom = whom;
+		rq->rq_pg = pg;
+		rq->rq_excl = !serve_is_shared(whom, rq->rq_type, pg);
+		rq->rq_epoch = bc_new_epoch();
+		serve_nreqs++;
+		serve_admit(i);
 	}
 }
 
@@ -352,6 +1683,10 @@ void
 umain(void)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert(FS_NFIBER <= FIBER_MAX);
+	static_assert(sizeof(struct Fsreq_set_size) <= sizeof(reqtab[0].rq_words));
+	static_assert(sizeof(struct Fsreq_dirty) <= sizeof(reqtab[0].rq_words));
+	static_assert(CLIENTVA(FS_NCLIENT, 0) <= USTACKTOP - PTSIZE);
         binaryname = "fs";
 	cprintf("FS is running\n");
 
@@ -359,9 +1694,28 @@ umain(void)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
+	// We mostly sleep in ipc_recv; when a request arrives, serve it
+	// ahead of whatever compute-bound env is running
+	if (sys_env_set_priority(0, ENV_PRIO_HIGH) < 0)
+		cprintf("FS could not raise its priority\n");
+	// The disk interrupts come to CPU 0, so waiting for one there
+	// wakes us without a second CPU's help
+	if (sys_env_set_affinity(0, 0) < 0)
+		cprintf("FS could not pin itself to CPU 0\n");
+
+	// The disk, or a copy of it in memory
+	if (FS_VIRTIO && virtio_probe())
+		bdev = &bdev_virtio;
+	else if (FS_AHCI && ahci_probe())
+		bdev = &bdev_ahci;
+	if (FS_RAMDISK)
+		bdev = &bdev_ram;
+	cprintf("FS is on %s\n", bdev->bd_name);
+
 	serve_init();
 	fs_init();
-	fs_test();
+	if (SELFTEST)
+		fs_test();
 
 	serve();
 }
@@ -0,0 +1,392 @@
+// Block-level snapshots.
+//
+// A snapshot keeps the disk as it was when it was taken, without
+// copying it: the blocks in use then stay shared between the snapshot
+// and the live file system until the live one writes over one.  Just
+// before that write goes to the disk, snap_save copies the block's old
+// contents, which are still on the disk, into the snapshot's store, and
+// notes in the table where it went.  Blocks that were free then belong
+// to the live file system alone, and are written over freely.  So
+// rolling back only has to copy home the blocks the store holds: the
+// superblock, the bitmap and the journal come back with the rest.
+//
+// The snapshot's header, at super->s_snap, names its area (inc/fs.h):
+// the bitmap as it was when the snapshot was taken, which tells which
+// blocks are shared, the table, and the store.  The area is allocated
+// before the bitmap is copied, so it is in use both in the live file
+// system and after a rollback, and the copy marks it free, so that none
+// of it is ever saved.  In memory, snap_shared has a bit set for each
+// block a write would still have to save.
+//
+// Every write goes through here: write_block and write_block_run, and,
+// on a disk with a journal, journal_commit, which saves the blocks of a
+// transaction before it writes it to the journal, so that a replay at
+// the next mount writes over nothing unsaved.  Each save is on the disk,
+// copy and table entry, before the write it is for goes out, so a crash
+// can't lose one.
+//
+// The file server is running when a client asks for a rollback, with
+// the file system cached and its files open, so a rollback happens at
+// the next mount instead, before anything is read (snap_mount); with
+// FS_SNAP_RESET, every mount rolls back.  If the store fills up, the
+// snapshot can no longer be rolled back to, and is only good for
+// dropping.
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+// Most blocks a store may have
+#define SNAP_MAXSTORE	16384
+
+static char snap_hdrblk[BLKSIZE] __attribute__((aligned(PGSIZE)));
+static struct SnapHeader *const snap_hdr = (struct SnapHeader *) snap_hdrblk;
+static uint32_t snap_shared[DISKMAP_NBLOCKS / 32] __attribute__((aligned(PGSIZE)));
+static uint32_t snap_table[SNAP_MAXSTORE] __attribute__((aligned(PGSIZE)));
+static char snap_buf[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+static uint32_t snap_blockno;	// the header's block, if snap_hdr holds it
+static bool snap_active;	// snap_shared is good, and writes save
+static uint32_t snap_nused;	// store blocks holding a saved block
+
+// Saves sleep while the disk works; one runs at a time
+static bool snap_busy;
+static struct FiberQ snap_q;
+
+static uint32_t
+snap_nbitmap(void)
+{
+	return ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+}
+
+// The disk block of block i of the area
+static uint32_t
+snap_area(uint32_t i)
+{
+	struct Extent *e;
+
+	for (e = snap_hdr->sh_run; e < snap_hdr->sh_run + snap_hdr->sh_nrun; e++)
+		if (i - e->e_fileblk < e->e_len)
+			return e->e_start + i - e->e_fileblk;
+	panic("snap_area: block %d isn't in the area", i);
+}
+
+// Read or write the n blocks of the area from i on at buf
+static void
+snap_area_io(uint32_t i, void *buf, uint32_t n, bool write)
+{
+	uint32_t secno;
+	int r;
+
+	for (; n > 0; i++, n--, buf += BLKSIZE) {
+		secno = snap_area(i) * BLKSECTS;
+		if ((r = write ? disk_write(secno, buf, BLKSECTS)
+		     : disk_read(secno, buf, BLKSECTS)) < 0)
+			panic("snapshot: disk %s: %e", write ? "write" : "read", r);
+	}
+}
+
+static void
+snap_write_header(void)
+{
+	int r;
+
+	if ((r = disk_write(snap_blockno * BLKSECTS, snap_hdr, BLKSECTS)) < 0)
+		panic("snapshot: header write: %e", r);
+}
+
+// Write table entries [from, to) to the disk
+static void
+snap_write_table(uint32_t from, uint32_t to)
+{
+	from /= SNAP_PER_TABLE;
+	to = ROUNDUP(to, SNAP_PER_TABLE) / SNAP_PER_TABLE;
+	snap_area_io(snap_hdr->sh_nbitmap + from,
+		     snap_table + from * SNAP_PER_TABLE, to - from, 1);
+}
+
+static bool
+snap_is_shared(uint32_t blockno)
+{
+	return (snap_shared[blockno / 32] >> (blockno % 32)) & 1;
+}
+
+static void
+snap_lock(void)
+{
+	while (snap_busy)
+		fiber_sleep(&snap_q);
+	snap_busy = 1;
+}
+
+static void
+snap_unlock(void)
+{
+	snap_busy = 0;
+	fiber_wakeup(&snap_q);
+}
+
+// Is the header in snap_hdr one we can use for a disk of this size?
+static bool
+snap_header_ok(void)
+{
+	struct SnapHeader *h = snap_hdr;
+	uint32_t i, n = 0;
+
+	if (h->sh_magic != SNAP_MAGIC || h->sh_nbitmap != snap_nbitmap()
+	    || h->sh_nstore > SNAP_MAXSTORE || h->sh_nstore == 0
+	    || h->sh_ntable > SNAP_MAXSTORE / SNAP_PER_TABLE
+	    || h->sh_nstore > h->sh_ntable * SNAP_PER_TABLE
+	    || h->sh_nrun > SNAP_MAXRUN)
+		return 0;
+	for (i = 0; i < h->sh_nrun; i++) {
+		if (h->sh_run[i].e_fileblk != n || h->sh_run[i].e_start < 2
+		    || h->sh_run[i].e_len > super->s_nblocks - h->sh_run[i].e_start)
+			return 0;
+		n += h->sh_run[i].e_len;
+	}
+	return n == h->sh_nbitmap + h->sh_ntable + h->sh_nstore;
+}
+
+// Turn the copy of the bitmap in snap_shared, a bit set for each block
+// free then, into the blocks still to save, and start saving.
+static void
+snap_start(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < snap_nbitmap() * BLKSIZE / 4; i++)
+		snap_shared[i] = ~snap_shared[i];
+	for (i = 0; i < snap_nused; i++)
+		snap_shared[snap_table[i] / 32] &= ~(1 << (snap_table[i] % 32));
+	snap_active = 1;
+}
+
+void
+snap_save(uint32_t blockno, uint32_t n)
+{
+	uint32_t i, b, first;
+	int r;
+
+	if (!snap_active)
+		return;
+	// Most writes are of blocks saved long ago; those need no lock
+	for (i = 0; i < n && !snap_is_shared(blockno + i); i++)
+		;
+	if (i == n)
+		return;
+
+	snap_lock();
+	first = snap_nused;
+	for (; i < n && snap_active; i++) {
+		b = blockno + i;
+		if (!snap_is_shared(b))
+			continue;
+		if (snap_nused == snap_hdr->sh_nstore) {
+			cprintf("snapshot: the store is full, so there's no rolling back now\n");
+			snap_hdr->sh_flags |= SNAP_OVERFLOW;
+			snap_write_header();
+			snap_active = 0;
+			break;
+		}
+		if ((r = disk_read(b * BLKSECTS, snap_buf, BLKSECTS)) < 0)
+			panic("snapshot: disk read: %e", r);
+		snap_area_io(snap_hdr->sh_nbitmap + snap_hdr->sh_ntable + snap_nused,
+			     snap_buf, 1, 1);
+		snap_table[snap_nused++] = b;
+	}
+	// Only once the table says where the copies are may homes change
+	if (snap_active && snap_nused > first) {
+		snap_write_table(first, snap_nused);
+		for (i = first; i < snap_nused; i++)
+			snap_shared[snap_table[i] / 32] &= ~(1 << (snap_table[i] % 32));
+	}
+	snap_unlock();
+}
+
+bool
+snap_mount(void)
+{
+	uint32_t i, n;
+	int r;
+
+	if (super->s_snap == 0)
+		return 0;
+	if (super->s_nblocks > DISKMAP_NBLOCKS || super->s_snap >= super->s_nblocks
+	    || (r = disk_read(super->s_snap * BLKSECTS, snap_hdr, BLKSECTS)) < 0
+	    || !snap_header_ok()) {
+		cprintf("snapshot: bad header at block %d, ignored\n", super->s_snap);
+		return 0;
+	}
+	snap_blockno = super->s_snap;
+	if (snap_hdr->sh_flags & SNAP_OVERFLOW) {
+		cprintf("snapshot: the store overflowed; drop the snapshot\n");
+		return 0;
+	}
+	snap_area_io(0, snap_shared, snap_hdr->sh_nbitmap, 0);
+	snap_area_io(snap_hdr->sh_nbitmap, snap_table, snap_hdr->sh_ntable, 0);
+	for (n = 0; n < snap_hdr->sh_nstore && snap_table[n] != 0; n++)
+		if (snap_table[n] >= super->s_nblocks)
+			panic("snapshot: table entry %d is block %08x", n, snap_table[n]);
+	snap_nused = n;
+
+	if (!FS_SNAP_RESET && !(snap_hdr->sh_flags & SNAP_ROLLBACK)) {
+		snap_start();
+		return 0;
+	}
+	// Copying home again after a crash partway through does no harm;
+	// the table goes only once every block is home
+	for (i = 0; i < n; i++) {
+		snap_area_io(snap_hdr->sh_nbitmap + snap_hdr->sh_ntable + i, snap_buf, 1, 0);
+		if ((r = disk_write(snap_table[i] * BLKSECTS, snap_buf, BLKSECTS)) < 0)
+			panic("snapshot: disk write: %e", r);
+	}
+	memset(snap_table, 0, n * sizeof(snap_table[0]));
+	if (n > 0)
+		snap_write_table(0, n);
+	snap_nused = 0;
+	if (snap_hdr->sh_flags & SNAP_ROLLBACK) {
+		snap_hdr->sh_flags &= ~SNAP_ROLLBACK;
+		snap_write_header();
+	}
+	cprintf("snapshot: rolled back %d blocks\n", n);
+	snap_start();
+	return n > 0;
+}
+
+// Allocate the area for a store of about nstore blocks, in as few runs
+// as we can, filling in the header.  Returns 0, or -E_NO_DISK if there
+// isn't room for the copy of the bitmap, the table and a store block.
+static int
+snap_alloc_area(uint32_t nstore)
+{
+	struct SnapHeader *h = snap_hdr;
+	struct Extent *e = NULL;
+	uint32_t i, need;
+	int b = snap_blockno;
+
+	h->sh_nbitmap = snap_nbitmap();
+	h->sh_ntable = ROUNDUP(nstore, SNAP_PER_TABLE) / SNAP_PER_TABLE;
+	need = h->sh_nbitmap + h->sh_ntable + nstore;
+	for (i = 0; i < need; i++) {
+		if ((b = alloc_block_num(0, b + 1)) < 0)
+			break;
+		if (e != NULL && e->e_start + e->e_len == (uint32_t) b)
+			e->e_len++;
+		else if (h->sh_nrun < SNAP_MAXRUN) {
+			e = &h->sh_run[h->sh_nrun++];
+			e->e_fileblk = i;
+			e->e_start = b;
+			e->e_len = 1;
+		} else {
+			free_block(b);
+			break;
+		}
+	}
+	if (i <= h->sh_nbitmap + h->sh_ntable)
+		return -E_NO_DISK;
+	// A store smaller than asked for may leave table blocks unused
+	h->sh_nstore = i - h->sh_nbitmap - h->sh_ntable;
+	return 0;
+}
+
+static void
+snap_free_area(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < snap_hdr->sh_nrun; i++)
+		free_blocks(snap_hdr->sh_run[i].e_start, snap_hdr->sh_run[i].e_len);
+	snap_hdr->sh_nrun = 0;
+}
+
+int
+snap_take(uint32_t nstore)
+{
+	uint32_t i, j, nfree = 0;
+	struct Extent *e;
+	int r;
+
+	if (super->s_nblocks > DISKMAP_NBLOCKS)
+		return -E_INVAL;
+	if (super->s_snap != 0 && (r = snap_drop()) < 0)
+		return r;
+	fs_sync();
+	if (nstore == 0) {
+		for (i = 0; i < super->s_nblocks; i++)
+			nfree += block_is_free(i);
+		nstore = nfree / 2;
+	}
+	nstore = MIN(MAX(nstore, 1), SNAP_MAXSTORE);
+
+	memset(snap_hdr, 0, BLKSIZE);
+	if ((r = alloc_block_num(0, 0)) < 0)
+		return r;
+	snap_blockno = r;
+	if ((r = snap_alloc_area(nstore)) < 0) {
+		snap_free_area();
+		free_block(snap_blockno);
+		snap_blockno = 0;
+		return r;
+	}
+	super->s_snap = snap_blockno;
+	txn_add(&super->s_snap);
+	fs_sync();
+
+	// The disk is now what the snapshot keeps.  The bitmap as it is,
+	// but with the area free, tells what to save.
+	memmove(snap_shared, bitmap, snap_hdr->sh_nbitmap * BLKSIZE);
+	snap_shared[snap_blockno / 32] |= 1 << (snap_blockno % 32);
+	for (i = 0; i < snap_hdr->sh_nrun; i++) {
+		e = &snap_hdr->sh_run[i];
+		for (j = e->e_start; j < e->e_start + e->e_len; j++)
+			snap_shared[j / 32] |= 1 << (j % 32);
+	}
+	snap_area_io(0, snap_shared, snap_hdr->sh_nbitmap, 1);
+	memset(snap_table, 0, snap_hdr->sh_ntable * BLKSIZE);
+	snap_area_io(snap_hdr->sh_nbitmap, snap_table, snap_hdr->sh_ntable, 1);
+	snap_hdr->sh_magic = SNAP_MAGIC;
+	snap_write_header();
+	snap_nused = 0;
+	snap_start();
+	return snap_hdr->sh_nstore;
+}
+
+int
+snap_rollback(void)
+{
+	if (super->s_snap == 0)
+		return -E_NOT_FOUND;
+	if (!snap_active)
+		return -E_INVAL;
+	snap_hdr->sh_flags |= SNAP_ROLLBACK;
+	snap_write_header();
+	return snap_nused;
+}
+
+int
+snap_drop(void)
+{
+	if (super->s_snap == 0)
+		return -E_NOT_FOUND;
+	snap_active = 0;
+	super->s_snap = 0;
+	txn_add(&super->s_snap);
+	// Once nothing on the disk points to the area, it can go; an area we
+	// couldn't make sense of leaks instead
+	fs_sync();
+	if (snap_blockno != 0) {
+		snap_free_area();
+		free_block(snap_blockno);
+		snap_blockno = 0;
+	}
+	return 0;
+}
+
+int
+snap_stat(void)
+{
+	if (super->s_snap == 0)
+		return -E_NOT_FOUND;
+	return snap_active ? (int) snap_nused : -E_INVAL;
+}
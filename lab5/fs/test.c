@@ -16,13 +16,89 @@ strecmp(char *a, char *b)
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// Check that the metadata at va has gone to disk.  Without a journal
+// file_set_size and file_close write it themselves; with one, it waits
+// in the open transaction for a commit.
+static void
+check_meta_written(void *va)
+{
+	if (super->s_njournal) {
+		assert(vpt[VPN(va)] & PTE_D);
+		fs_sync();
+	}
+	assert(!(vpt[VPN(va)] & PTE_D));
+}
+
+// Check that a change to f goes to disk through the journal: once
+// fs_flush commits it, the transaction in the journal on disk has f's
+// block, which is clean again in memory.
+static void
+check_journal(struct File *f)
+{
+	struct JournalHeader *jh = (struct JournalHeader *) (2 * PGSIZE);
+	uint32_t blockno = diskblock(f), i;
+	int r;
+
+	if ((r = file_set_size(f, f->f_size)) < 0)
+		panic("file_set_size: %e", r);
+	fs_flush();
+	if ((r = sys_page_alloc(0, jh, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = disk_read(super->s_journal * BLKSECTS, jh, BLKSECTS)) < 0)
+		panic("disk_read: %e", r);
+	assert(jh->j_magic == JOURNAL_MAGIC);
+	for (i = 0; i < jh->j_nblocks && jh->j_blocks[i] != blockno; i++)
+		;
+	assert(i < jh->j_nblocks);
+	assert(!(vpt[VPN(f)] & PTE_D));
+	sys_page_unmap(0, jh);
+	cprintf("journal is good\n");
+}
+
+// Check that files under /tmp live in memory: creating and growing one
+// dirties no disk block, and removing it gives its pages back.
+static void
+check_tmpfs(void)
+{
+	struct File *f, *g;
+	uint32_t nused = tmpfs_nused;
+	char *blk;
+	int r;
+
+	if ((r = file_create("/tmp/scratch", &f)) < 0)
+		panic("file_create /tmp/scratch: %e", r);
+	assert(tmpfs_owns(f));
+	if ((r = file_create("/tmp/scratch", &g)) != -E_FILE_EXISTS)
+		panic("file_create /tmp/scratch twice: %e", r);
+	if ((r = file_set_size(f, (NINDIRECT + 1) * BLKSIZE)) < 0)
+		panic("file_set_size /tmp/scratch: %e", r);
+	if ((r = file_get_block(f, NINDIRECT, &blk)) < 0)
+		panic("file_get_block /tmp/scratch: %e", r);
+	strcpy(blk, msg);
+	file_close(f);
+	if ((r = file_open("//tmp//scratch", &g)) < 0 || g != f)
+		panic("file_open /tmp/scratch: %e", r);
+	if ((r = file_get_block(g, NINDIRECT, &blk)) < 0 || strcmp(blk, msg) != 0)
+		panic("file_get_block /tmp/scratch 2: %e", r);
+	if ((r = file_remove("/tmp/scratch")) < 0)
+		panic("file_remove /tmp/scratch: %e", r);
+	if ((r = file_open("/tmp/scratch", &g)) != -E_NOT_FOUND)
+		panic("file_open /tmp/scratch after remove: %e", r);
+	// The directory keeps its one block
+	assert(tmpfs_nused == nused + (nused == 0));
+	if ((r = file_open("/tmp", &g)) < 0 || g->f_type != FTYPE_DIR)
+		panic("file_open /tmp: %e", r);
+	cprintf("tmpfs is good\n");
+}
+
 void
 fs_test(void)
 {
-	struct File *f;
+	struct File *f, *g, *h;
 	int r;
 	char *blk;
-	uint32_t *bits;
+	uint32_t *bits, bnos[42];
+	int i;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
@@ -46,10 +122,30 @@ fs_test(void)
 		panic("file_open /newmotd: %e", r);
 	cprintf("file_open is good\n");
 
+	// The path cache remembers misses; create and remove must undo
+	// what it remembers
+	if ((r = file_open("/dcache-test", &g)) != -E_NOT_FOUND)
+		panic("file_open /dcache-test: %e", r);
+	if ((r = file_create("/dcache-test", &g)) < 0)
+		panic("file_create /dcache-test: %e", r);
+	if ((r = file_open("/dcache-test", &h)) < 0 || h != g)
+		panic("file_open /dcache-test after create: %e", r);
+	if ((r = file_remove("/dcache-test")) < 0)
+		panic("file_remove /dcache-test: %e", r);
+	if ((r = file_open("/dcache-test", &h)) != -E_NOT_FOUND)
+		panic("file_open /dcache-test after remove: %e", r);
+	cprintf("path cache is good\n");
+
+	// fsformat put /newmotd in its struct File; getting its block
+	// moves the data out to one
+	assert(f->f_flags & FILE_INLINE);
+	if (strecmp((char *) f->f_data, msg) != 0)
+		panic("inline file has wrong data");
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block: %e", r);
 	if (strecmp(blk, msg) != 0)
 		panic("file_get_block returned wrong data");
+	assert(!(f->f_flags & FILE_INLINE) && f->f_size == strlen(msg));
 	cprintf("file_get_block is good\n");
 
 	*(volatile char*)blk = *(volatile char*)blk;
@@ -60,20 +156,97 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
-	assert(!(vpt[VPN(f)] & PTE_D));
+	if (super->s_version == FS_VERSION_EXTENT)
+		assert(f->f_nextent == 0 && f->f_extent[0].e_start == 0);
+	else
+		assert(f->f_direct[0] == 0);
+	check_meta_written(f);
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(vpt[VPN(f)] & PTE_D));
+	check_meta_written(f);
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);	
 	assert((vpt[VPN(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(vpt[VPN(blk)] & PTE_D));
+
+	// A block past what the indirect block reaches, then gone again
+	if ((r = file_set_size(f, (NINDIRECT + 1) * BLKSIZE)) < 0)
+		panic("file_set_size 3: %e", r);
+	// Reading the holes that leaves allocates nothing
+	if ((r = file_peek_block(f, 1, &blk)) < 0)
+		panic("file_peek_block: %e", r);
+	for (r = 0; r < BLKSIZE; r++)
+		assert(blk[r] == 0);
+	if (super->s_version == FS_VERSION_EXTENT)
+		assert(f->f_nextent == 1 && f->f_extent[0].e_len == 1);
+	else
+		assert(f->f_direct[1] == 0);
+	file_flush(f);
+	cprintf("file holes are good\n");
+	if ((r = file_get_block(f, NINDIRECT, &blk)) < 0)
+		panic("file_get_block %d: %e", NINDIRECT, r);
+	strcpy(blk, msg);
+	if (super->s_version != FS_VERSION_EXTENT)
+		assert(f->f_dindirect != 0);
+	if ((r = file_set_size(f, strlen(msg))) < 0)
+		panic("file_set_size 4: %e", r);
+	if (super->s_version != FS_VERSION_EXTENT)
+		assert(f->f_dindirect == 0);
+	cprintf("large file block is good\n");
+
+	// A run of blocks across the direct and indirect ones goes back to
+	// the bitmap whole
+	for (r = NDIRECT - 2; r < NDIRECT + 40; r++) {
+		if ((i = file_get_block(f, r, &blk)) < 0)
+			panic("file_get_block %d: %e", r, i);
+		bnos[r - (NDIRECT - 2)] = diskblock(blk);
+	}
+	if ((r = file_set_size(f, strlen(msg))) < 0)
+		panic("file_set_size 5: %e", r);
+	fs_sync();
+	for (r = 0; r < 42; r++)
+		assert(bitmap[bnos[r] / 32] & (1 << (bnos[r] % 32)));
+	cprintf("range truncate is good\n");
+
+	// Files grown side by side get a run each, and fallocate gives a
+	// file the run it asks for, all zeros
+	if ((r = file_create("/alloc-a", &g)) < 0 || (r = file_create("/alloc-b", &h)) < 0)
+		panic("file_create /alloc-*: %e", r);
+	if ((r = file_set_size(g, 8 * BLKSIZE)) < 0 || (r = file_set_size(h, 8 * BLKSIZE)) < 0)
+		panic("file_set_size /alloc-*: %e", r);
+	for (r = 0; r < 8; r++) {
+		if ((i = file_get_block(g, r, &blk)) < 0)
+			panic("file_get_block /alloc-a: %e", i);
+		bnos[r] = diskblock(blk);
+		if ((i = file_get_block(h, r, &blk)) < 0)
+			panic("file_get_block /alloc-b: %e", i);
+		bnos[8 + r] = diskblock(blk);
+	}
+	for (r = 1; r < 8; r++)
+		assert(bnos[r] == bnos[0] + r && bnos[8 + r] == bnos[8] + r);
+	if ((r = file_fallocate(g, 8 * BLKSIZE, 20 * BLKSIZE)) < 0)
+		panic("file_fallocate: %e", r);
+	assert(g->f_size == 28 * BLKSIZE);
+	for (r = 8; r < 28; r++) {
+		if ((i = file_get_block(g, r, &blk)) < 0)
+			panic("file_get_block /alloc-a: %e", i);
+		bnos[r - 8] = diskblock(blk);
+		assert(bnos[r - 8] == bnos[0] + r - 8);
+		for (i = 0; i < BLKSIZE; i++)
+			assert(blk[i] == 0);
+	}
+	if ((r = file_remove("/alloc-a")) < 0 || (r = file_remove("/alloc-b")) < 0)
+		panic("file_remove /alloc-*: %e", r);
+	cprintf("allocation windows are good\n");
 	file_close(f);
-	assert(!(vpt[VPN(f)] & PTE_D));	
+	check_meta_written(f);
 	cprintf("file rewrite is good\n");
+
+	if (super->s_njournal)
+		check_journal(f);
+	check_tmpfs();
 }
@@ -0,0 +1,287 @@
+// The RAM file system at /tmp.
+//
+// Files under /tmp never touch the disk: their blocks are pages of our
+// own, allocated as the file grows and unmapped as it shrinks, so there
+// is no IDE I/O, no bitmap on disk, and flushing one is a no-op.  What
+// is in /tmp goes when the server does.
+//
+// Block b of the RAM disk is mapped at TMPMAP + b*BLKSIZE, and files
+// find their blocks with the version 1 pointers -- f_direct, f_indirect
+// and f_dindirect -- holding these block numbers; 0 is never allocated,
+// so it still means none.  The /tmp directory is a file of this kind
+// too, whose blocks hold struct Files as a disk directory's do, so
+// clients list it the same way; each file's struct File stays put in
+// one of them while it exists.  /tmp has no subdirectories.
+//
+// fs.c sends a path under /tmp here (tmpfs_path), and a struct File of
+// ours (tmpfs_owns), before its own code sees it, so serv.c needn't
+// know the difference.
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+static struct File tmp_root;
+static uint32_t tmp_used[TMPFS_NBLOCKS / 32];	// bit set: block in use
+static uint32_t tmp_next;			// where to look for a free block
+uint32_t tmpfs_nused;				// blocks in use
+
+static void *
+tmp_addr(uint32_t blockno)
+{
+	return (void *) (TMPMAP + blockno * BLKSIZE);
+}
+
+void
+tmpfs_init(void)
+{
+	static_assert(TMPMAP + TMPFS_NBLOCKS * BLKSIZE <= RAMDISKMAP);
+	static_assert(TMPFS_NBLOCKS % 32 == 0);
+
+	tmp_used[0] = 1;	// block 0 means no block
+	tmp_next = 1;
+	strcpy(tmp_root.f_name, "tmp");
+	tmp_root.f_type = FTYPE_DIR;
+	tmp_root.f_namehash = fs_namehash(tmp_root.f_name);
+	tmp_root.f_namelen = strlen(tmp_root.f_name);
+}
+
+// Does f live in the RAM file system?
+bool
+tmpfs_owns(struct File *f)
+{
+	return f == &tmp_root
+		|| ((uintptr_t) f >= TMPMAP && (uintptr_t) f < TMPMAP + TMPFS_NBLOCKS * BLKSIZE);
+}
+
+// If path is /tmp or names something in it, return what's after the
+// "/tmp/" ("" for /tmp itself); otherwise, 0.
+const char *
+tmpfs_path(const char *path)
+{
+	while (*path == '/')
+		path++;
+	if (strncmp(path, "tmp", 3) != 0 || (path[3] != '/' && path[3] != '\0'))
+		return 0;
+	path += 3;
+	while (*path == '/')
+		path++;
+	return path;
+}
+
+// Allocate a zeroed block, returning its number, or -E_NO_DISK.
+static int
+tmp_alloc(void)
+{
+	uint32_t i, b;
+
+	for (i = 0; i < TMPFS_NBLOCKS; i++) {
+		b = (tmp_next + i) % TMPFS_NBLOCKS;
+		if (tmp_used[b / 32] & (1 << (b % 32)))
+			continue;
+		if (sys_page_alloc(0, tmp_addr(b), PTE_P|PTE_U|PTE_W) < 0)
+			return -E_NO_DISK;
+		tmp_used[b / 32] |= 1 << (b % 32);
+		tmp_next = b + 1;
+		tmpfs_nused++;
+		return b;
+	}
+	return -E_NO_DISK;
+}
+
+// Free *slot's block, if it has one, and clear the slot.  A client that
+// still has the page mapped keeps its copy; nobody else will see it.
+static void
+tmp_free(uint32_t *slot)
+{
+	uint32_t b = *slot;
+
+	if (b == 0)
+		return;
+	assert(tmp_used[b / 32] & (1 << (b % 32)));
+	sys_page_unmap(0, tmp_addr(b));
+	tmp_used[b / 32] &= ~(1 << (b % 32));
+	tmpfs_nused--;
+	*slot = 0;
+}
+
+// Set *pblk to the block of pointers whose number is in *slot, first
+// allocating one if *slot is 0 and 'alloc' is set.
+static int
+tmp_ptr_block(uint32_t *slot, bool alloc, uint32_t **pblk)
+{
+	int r;
+
+	if (*slot == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = tmp_alloc()) < 0)
+			return r;
+		*slot = r;
+	}
+	*pblk = tmp_addr(*slot);
+	return 0;
+}
+
+// Set *ppslot to the slot for f's block filebno, allocating the blocks
+// of pointers on the way if 'alloc' is set, as file_block_walk does.
+static int
+tmp_walk(struct File *f, uint32_t filebno, uint32_t **ppslot, bool alloc)
+{
+	uint32_t *ind;
+	int r;
+
+	if (filebno < NDIRECT) {
+		*ppslot = &f->f_direct[filebno];
+		return 0;
+	}
+	if (filebno < NINDIRECT) {
+		if ((r = tmp_ptr_block(&f->f_indirect, alloc, &ind)) < 0)
+			return r;
+		*ppslot = &ind[filebno];
+		return 0;
+	}
+	filebno -= NINDIRECT;
+	if (filebno >= NDINDIRECT)
+		return -E_INVAL;
+	if ((r = tmp_ptr_block(&f->f_dindirect, alloc, &ind)) < 0
+	    || (r = tmp_ptr_block(&ind[filebno / NINDIRECT], alloc, &ind)) < 0)
+		return r;
+	*ppslot = &ind[filebno % NINDIRECT];
+	return 0;
+}
+
+// Set *blk to block filebno of f, allocating it if need be.
+int
+tmpfs_get_block(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t *slot;
+	int r;
+
+	if ((r = tmp_walk(f, filebno, &slot, 1)) < 0)
+		return r;
+	if (*slot == 0) {
+		if ((r = tmp_alloc()) < 0)
+			return r;
+		*slot = r;
+	}
+	*blk = tmp_addr(*slot);
+	return 0;
+}
+
+int
+tmpfs_set_size(struct File *f, off_t newsize)
+{
+	uint32_t bno, old_nblocks, new_nblocks, *slot, *dind, j;
+
+	if (newsize > MAXFILESIZE)
+		return -E_NO_DISK;
+	old_nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	new_nblocks = ROUNDUP(newsize, BLKSIZE) / BLKSIZE;
+	for (bno = new_nblocks; bno < old_nblocks; bno++)
+		if (tmp_walk(f, bno, &slot, 0) == 0)
+			tmp_free(slot);
+	if (new_nblocks <= NDIRECT)
+		tmp_free(&f->f_indirect);
+	if (f->f_dindirect) {
+		dind = tmp_addr(f->f_dindirect);
+		for (j = 0; j < NINDIRECT; j++)
+			if (new_nblocks <= NINDIRECT + j * NINDIRECT)
+				tmp_free(&dind[j]);
+		if (new_nblocks <= NINDIRECT)
+			tmp_free(&f->f_dindirect);
+	}
+	f->f_size = newsize;
+	return 0;
+}
+
+// Find name in /tmp.
+static int
+tmp_lookup(const char *name, struct File **pf)
+{
+	uint32_t h = fs_namehash(name), len = strlen(name), i, j, nblock;
+	struct File *f;
+	char *blk;
+	int r;
+
+	nblock = tmp_root.f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if ((r = tmpfs_get_block(&tmp_root, i, &blk)) < 0)
+			return r;
+		f = (struct File *) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (dir_name_is(&f[j], name, h, len)) {
+				f[j].f_dir = &tmp_root;
+				*pf = &f[j];
+				return 0;
+			}
+	}
+	return -E_NOT_FOUND;
+}
+
+// Open name, which tmpfs_path found in a path: /tmp itself if it's "".
+int
+tmpfs_open(const char *name, struct File **pf)
+{
+	if (*name == '\0') {
+		*pf = &tmp_root;
+		return 0;
+	}
+	if (strchr(name, '/'))
+		return -E_NOT_FOUND;
+	return tmp_lookup(name, pf);
+}
+
+int
+tmpfs_create(const char *name, struct File **pf)
+{
+	uint32_t i, j, nblock;
+	struct File *f;
+	char *blk;
+	int r;
+
+	if (*name == '\0' || tmp_lookup(name, &f) == 0)
+		return -E_FILE_EXISTS;
+	if (strchr(name, '/') || strlen(name) >= MAXNAMELEN)
+		return -E_BAD_PATH;
+	nblock = tmp_root.f_size / BLKSIZE;
+	for (i = 0; i <= nblock; i++) {
+		if ((r = tmpfs_get_block(&tmp_root, i, &blk)) < 0)
+			return r;
+		if (i == nblock)
+			tmp_root.f_size += BLKSIZE;
+		f = (struct File *) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] == '\0')
+				goto found;
+	}
+	panic("tmpfs_create: new directory block is full");
+
+found:
+	f += j;
+	memset(f, 0, sizeof(*f));
+	strcpy(f->f_name, name);
+	f->f_namehash = fs_namehash(name);
+	f->f_namelen = strlen(name);
+	f->f_type = FTYPE_REG;
+	f->f_dir = &tmp_root;
+	*pf = f;
+	return 0;
+}
+
+int
+tmpfs_remove(const char *name)
+{
+	struct File *f;
+	int r;
+
+	if (*name == '\0')
+		return -E_BAD_PATH;
+	if ((r = tmpfs_open(name, &f)) < 0)
+		return r;
+	tmpfs_set_size(f, 0);
+	f->f_name[0] = '\0';
+	f->f_namehash = 0;
+	f->f_namelen = 0;
+	return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * A virtio block device, through the legacy virtio PCI interface, for
+ * running under QEMU with the disk on -drive if=virtio.  An emulated
+ * IDE disk costs a VM exit for every register access and, with PIO,
+ * for every word of data; here a request is a few descriptors in shared
+ * memory and one port write to say they're there.
+ *
+ * Requests go to the device through one virtqueue: a table of
+ * descriptors, each naming a physically contiguous buffer, an avail
+ * ring in which we hand the device chains of them, and a used ring in
+ * which it hands them back.  A request is a chain of its header (read or
+ * write, and the first sector), the data, one descriptor per page since
+ * the pages of a block run are contiguous only in our address space, and
+ * a status byte the device fills in.  Each fiber's request goes in as
+ * soon as there are descriptors free for it, so the device has every
+ * request the server is working on at once; the fiber sleeps until the
+ * device's interrupt says the request is done.
+ *
+ * The device raises a level-triggered PCI interrupt, which the kernel
+ * masks when it comes in (see irq_signal_pci): reading the ISR register
+ * drops the line, and only then do we listen for it again.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+// Legacy virtio PCI registers, relative to BAR0 (I/O space)
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN	0x08
+#define VIRTIO_QUEUE_SIZE	0x0C
+#define VIRTIO_QUEUE_SEL	0x0E
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define VIRTIO_ISR		0x13
+#define VIRTIO_BLK_CAPACITY	0x14	// 64 bits, in sectors
+
+#define VIRTIO_STATUS_ACK	0x01
+#define VIRTIO_STATUS_DRIVER	0x02
+#define VIRTIO_STATUS_DRIVER_OK	0x04
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_DEV_BLK		0x1001	// legacy (transitional) block device
+
+struct VringDesc {
+	uint64_t addr;		// physical address
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;		// with VRING_DESC_F_NEXT
+};
+
+#define VRING_DESC_F_NEXT	1	// the chain goes on at 'next'
+#define VRING_DESC_F_WRITE	2	// the device writes the buffer
+
+struct VringAvail {
+	uint16_t flags;
+	volatile uint16_t idx;
+	uint16_t ring[];
+};
+
+struct VringUsed {
+	uint16_t flags;
+	volatile uint16_t idx;
+	struct {
+		uint32_t id;	// head of the chain
+		uint32_t len;
+	} ring[];
+};
+
+struct VirtioBlkHdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+// A request the device has, found by the descriptor at the head of its
+// chain.  32 bytes, so that none straddles a page.
+struct VirtioReq {
+	struct VirtioBlkHdr vr_hdr;
+	volatile uint8_t vr_status;
+	volatile bool vr_done;	// back on the used ring
+	uint8_t vr_pad[14];
+};
+
+// Biggest queue we take: its descriptor table fills a page
+#define VQ_MAX		256
+#define VQ_MAXPAGES	4
+
+// The queue's rings, legacy layout: descriptors, then the avail ring,
+// then, from the next page boundary, the used ring.  The device wants
+// them physically contiguous, so their pages come from
+// sys_page_alloc_contig.
+static char vq_mem[VQ_MAXPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+static struct VirtioReq vreqs[VQ_MAX] __attribute__((aligned(PGSIZE)));
+
+static int iobase;		// BAR0, 0 if there's no device
+static int irq;		// its PCI interrupt line
+static bool use_irq;		// sleep on the interrupt instead of polling
+static uint16_t vq_size;	// descriptors in the queue
+static struct VringDesc *vq_desc;
+static struct VringAvail *vq_avail;
+static struct VringUsed *vq_used;
+static uint16_t vq_used_seen;	// used ring entries we've taken
+static uint16_t vq_free;	// first free descriptor, chained by 'next'
+static uint16_t vq_nfree;
+static struct FiberQ vq_descq;	// fibers waiting for descriptors
+static struct FiberQ vq_doneq;	// fibers waiting for their requests
+
+// Look for a virtio block device on PCI bus 0.  Returns 1 if found.
+bool
+virtio_probe(void)
+{
+	int dev, func;
+	uint32_t id, bar0;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			id = pci_conf_read(0, dev, func, 0x00);
+			if (id != (VIRTIO_DEV_BLK << 16 | VIRTIO_VENDOR))
+				continue;
+			bar0 = pci_conf_read(0, dev, func, 0x10);
+			if ((bar0 & 1) == 0 || (bar0 & 0xFFFC) == 0)
+				continue;
+			iobase = bar0 & 0xFFFC;
+			irq = pci_conf_read(0, dev, func, 0x3C) & 0xFF;
+			// enable I/O space and bus mastering
+			pci_conf_write(0, dev, func, 0x04,
+				       pci_conf_read(0, dev, func, 0x04) | 0x05);
+			cprintf("virtio-blk at port 0x%x, irq %d (pci %d.%d)\n",
+				iobase, irq, dev, func);
+			return 1;
+		}
+	return 0;
+}
+
+// Take the requests the device is done with off the used ring.
+static void
+virtio_harvest(void)
+{
+	while (vq_used_seen != vq_used->idx) {
+		mb();
+		vreqs[vq_used->ring[vq_used_seen % vq_size].id].vr_done = 1;
+		vq_used_seen++;
+	}
+}
+
+// The server's main loop got our IRQ: let the fibers whose requests
+// are done go on, then listen for the next one.
+static void
+virtio_intr(void)
+{
+	// Reading the ISR acknowledges the interrupt
+	(void) inb(iobase + VIRTIO_ISR);
+	virtio_harvest();
+	fiber_wakeup(&vq_doneq);
+	if (sys_irq_listen(irq) < 0)
+		use_irq = 0;
+}
+
+// Wait until the device is done with r.
+static void
+virtio_wait(struct VirtioReq *r)
+{
+	int e;
+
+	while (!r->vr_done) {
+		if (use_irq && fiber_self() >= 0) {
+			fiber_sleep(&vq_doneq);
+			continue;
+		}
+		(void) inb(iobase + VIRTIO_ISR);
+		virtio_harvest();
+		if (r->vr_done)
+			break;
+		if (!use_irq)
+			sys_yield();
+		else if ((e = sys_irq_wait(irq)) < 0) {
+			cprintf("virtio: sys_irq_wait: %e; polling instead\n", e);
+			use_irq = 0;
+		}
+	}
+}
+
+// Move nsecs sectors between the disk, from secno, and buf.
+static int
+virtio_rw(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	uintptr_t va = (uintptr_t) buf;
+	size_t len = nsecs * SECTSIZE;
+	uint16_t head, d, n;
+	uint32_t m;
+	struct VirtioReq *r;
+
+	assert(nsecs <= 256);
+	if (nsecs == 0)
+		return 0;
+	for (m = ROUNDDOWN(va, PGSIZE); m < va + len; m += PGSIZE)
+		if (!(vpd[PDX(m)] & PTE_P) || !(vpt[VPN(m)] & PTE_P))
+			return -E_INVAL;
+	// the header, the pages, and the status
+	n = 2 + (ROUNDUP(va + len, PGSIZE) - ROUNDDOWN(va, PGSIZE)) / PGSIZE;
+	while (vq_nfree < n) {
+		if (fiber_self() >= 0)
+			fiber_sleep(&vq_descq);
+		else
+			panic("virtio_rw: out of descriptors");
+	}
+
+	head = vq_free;
+	r = &vreqs[head];
+	r->vr_hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	r->vr_hdr.reserved = 0;
+	r->vr_hdr.sector = secno;
+	r->vr_status = 0xFF;
+	r->vr_done = 0;
+
+	d = head;
+	vq_desc[d].addr = va2pa(&r->vr_hdr);
+	vq_desc[d].len = sizeof(r->vr_hdr);
+	vq_desc[d].flags = VRING_DESC_F_NEXT;
+	for (; len > 0; va += m, len -= m) {
+		m = MIN(len, PGSIZE - PGOFF(va));
+		d = vq_desc[d].next;
+		vq_desc[d].addr = va2pa((void *) va);
+		vq_desc[d].len = m;
+		vq_desc[d].flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+	}
+	d = vq_desc[d].next;
+	vq_desc[d].addr = va2pa((void *) &r->vr_status);
+	vq_desc[d].len = 1;
+	vq_desc[d].flags = VRING_DESC_F_WRITE;
+	vq_free = vq_desc[d].next;
+	vq_nfree -= n;
+
+	vq_avail->ring[vq_avail->idx % vq_size] = head;
+	mb();
+	vq_avail->idx++;
+	mb();
+	outw(iobase + VIRTIO_QUEUE_NOTIFY, 0);
+
+	virtio_wait(r);
+
+	// Give the chain back
+	vq_desc[d].next = vq_free;
+	vq_free = head;
+	vq_nfree += n;
+	fiber_wakeup(&vq_descq);
+	return r->vr_status == VIRTIO_BLK_S_OK ? 0 : -E_UNSPECIFIED;
+}
+
+static int
+virtio_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return virtio_rw(secno, dst, nsecs, 0);
+}
+
+static int
+virtio_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return virtio_rw(secno, (void *) src, nsecs, 1);
+}
+
+// Reset the device virtio_probe found and set up its queue.
+static int
+virtio_init(void)
+{
+	uint32_t used_off, npages, i;
+	int r;
+
+	if (iobase == 0 && !virtio_probe())
+		return -E_NOT_FOUND;
+
+	outb(iobase + VIRTIO_STATUS, 0);
+	outb(iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	// We need none of the optional features
+	outl(iobase + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(iobase + VIRTIO_QUEUE_SEL, 0);
+	vq_size = inw(iobase + VIRTIO_QUEUE_SIZE);
+	if (vq_size == 0 || vq_size > VQ_MAX)
+		return -E_INVAL;
+	used_off = ROUNDUP(vq_size * sizeof(struct VringDesc)
+			   + sizeof(struct VringAvail) + (vq_size + 1) * sizeof(uint16_t), PGSIZE);
+	npages = ROUNDUP(used_off + sizeof(struct VringUsed)
+			 + vq_size * sizeof(vq_used->ring[0]) + sizeof(uint16_t), PGSIZE) / PGSIZE;
+	assert(npages <= VQ_MAXPAGES);
+	if ((r = sys_page_alloc_contig(vq_mem, npages, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	vq_desc = (struct VringDesc *) vq_mem;
+	vq_avail = (struct VringAvail *) (vq_mem + vq_size * sizeof(struct VringDesc));
+	vq_used = (struct VringUsed *) (vq_mem + used_off);
+	for (i = 0; i < vq_size; i++)
+		vq_desc[i].next = (i + 1) % vq_size;
+	vq_free = 0;
+	vq_nfree = vq_size;
+	outl(iobase + VIRTIO_QUEUE_PFN, va2pa(vq_mem) >> PGSHIFT);
+
+	if (IDE_IRQ && irq > 0 && irq < 16) {
+		if ((r = sys_irq_listen(irq)) < 0)
+			cprintf("virtio: sys_irq_listen(%d): %e; polling\n", irq, r);
+		else {
+			use_irq = 1;
+			bdev_virtio.bd_irq = irq;
+		}
+	}
+	outb(iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+	     | VIRTIO_STATUS_DRIVER_OK);
+	cprintf("virtio-blk: %d descriptors, %d sectors\n", vq_size,
+		inl(iobase + VIRTIO_BLK_CAPACITY));
+	return 0;
+}
+
+struct Bdev bdev_virtio = {
+	.bd_name =	"virtio",
+	.bd_init =	virtio_init,
+	.bd_read =	virtio_read,
+	.bd_write =	virtio_write,
+	.bd_irq =	-1,
+	.bd_intr =	virtio_intr
+};
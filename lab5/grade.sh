@@ -59,12 +59,12 @@ runtest () {
 	[ "$preservefs" = y ] || rm -f obj/fs/fs.img
 	if $verbose
 	then
-		echo "gmake $2... "
+		echo "gmake SELFTEST=1 $2... "
 	fi
-	gmake $2 >$out
+	gmake SELFTEST=1 $2 >$out
 	if [ $? -ne 0 ]
 	then
-		echo gmake $2 failed 
+		echo gmake SELFTEST=1 $2 failed 
 		exit 1
 	fi
 	runbochs
@@ -162,7 +162,7 @@ score=0
 # Reset the file system to its original, pristine state
 resetfs() {
 	rm -f obj/fs/fs.img
-	gmake obj/fs/fs.img >$out
+	gmake SELFTEST=1 obj/fs/fs.img >$out
 }
 
 
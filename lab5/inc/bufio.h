@@ -0,0 +1,44 @@
+#ifndef JOS_INC_BUFIO_H
+#define JOS_INC_BUFIO_H 1
+
+#include <inc/types.h>
+#include <inc/stdarg.h>
+
+// Buffered I/O on top of file descriptors, or on the console.
+// A FILE gathers small writes into one write() of up to its buffer
+// size, and fills its buffer a read() at a time.
+
+typedef struct Bufio FILE;
+
+#define BUFSIZ		4096	// default buffer size
+
+// Buffering modes, for setvbuf
+#define _IOFBF		0	// write when the buffer fills
+#define _IOLBF		1	// and at each newline
+#define _IONBF		2	// don't buffer
+
+// The console, through sys_cputs: stdout line-buffered, stderr not
+extern FILE *stdout;
+extern FILE *stderr;
+
+// mode is "r", "w", "a", "r+", "w+" or "a+".  NULL on error.
+FILE *	fopen(const char *path, const char *mode);
+FILE *	fdopen(int fd, const char *mode);
+// Before the first read or write: buffer 'size' bytes at 'buf', or in
+// a buffer of our own if buf is NULL.
+int	setvbuf(FILE *f, char *buf, int mode, size_t size);
+size_t	fread(void *ptr, size_t size, size_t nmemb, FILE *f);
+size_t	fwrite(const void *ptr, size_t size, size_t nmemb, FILE *f);
+int	fgetc(FILE *f);		// -1 at end of file or error
+int	fputc(int c, FILE *f);
+int	fputs(const char *s, FILE *f);
+int	bprintf(FILE *f, const char *fmt, ...);
+int	vbprintf(FILE *f, const char *fmt, va_list ap);
+// Write out what's buffered; every FILE if f is NULL.
+int	fflush(FILE *f);
+int	fclose(FILE *f);
+int	feof(FILE *f);
+int	ferror(FILE *f);
+int	fileno(FILE *f);
+
+#endif	// !JOS_INC_BUFIO_H
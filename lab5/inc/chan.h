@@ -0,0 +1,38 @@
+#ifndef JOS_INC_CHAN_H
+#define JOS_INC_CHAN_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// The header page of a channel's ring (lib/chan.c).  Servers that keep
+// one end of a ring themselves, like the network server, see it too.
+struct Chan {
+	volatile uint32_t ch_rpos;	// bytes read so far
+	volatile uint32_t ch_wpos;	// bytes written so far
+	volatile uint32_t ch_rwait;	// reader sleeps on ch_wpos
+	volatile uint32_t ch_wwait;	// writer sleeps on ch_rpos
+	uint32_t ch_size;		// bytes in the ring, a power of two
+
+	// If set, the other end of the ring is this server's event loop,
+	// which doesn't sleep in sys_addr_wait: instead of waking it with
+	// sys_addr_wake, send it ch_server_value by IPC.
+	envid_t ch_server;
+	uint32_t ch_server_value;
+};
+
+#define CHAN_BUF(ch)	((uint8_t *) (ch) + PGSIZE)
+
+// Bytes waiting to be read, and room for more
+static __inline uint32_t
+chan_avail(struct Chan *ch)
+{
+	return ch->ch_wpos - ch->ch_rpos;
+}
+
+static __inline uint32_t
+chan_room(struct Chan *ch)
+{
+	return ch->ch_size - (ch->ch_wpos - ch->ch_rpos);
+}
+
+#endif	// !JOS_INC_CHAN_H
@@ -7,26 +7,32 @@
 #include <inc/queue.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/syscall.h>
+#include <inc/pmc.h>
+
+struct Event_wait;
 
 typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+--------------19----------------+----------12----------+
+// |0|          Uniqueifier           |     Environment      |
+// | |                                |        Index         |
+// +----------------------------------+----------------------+
+//                                     \----- ENVX(eid) ----/
 //
 // The environment index ENVX(eid) equals the environment's offset in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
+// NENV is the most envs[] can hold; the kernel backs it with memory
+// only as environments are created.
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+#define LOG2NENV		12
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
@@ -34,28 +40,180 @@ typedef int32_t envid_t;
 #define ENV_FREE		0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
+#define ENV_DYING		3	// destroyed while running on another CPU
+
+// Scheduling classes, highest first.  A runnable env is never chosen
+// while an env of a higher class is runnable, and one waking up preempts
+// a lower-class env at once.  ENV_PRIO_HIGH is meant for I/O servers
+// (the file server) that mostly sleep in IPC.
+#define ENV_PRIO_HIGH		0
+#define ENV_PRIO_NORMAL		1
+#define ENV_PRIO_LOW		2
+#define ENV_NPRIO		3
+
+// Time slice, in timer ticks, for each class.  Compute-bound envs in the
+// low class run less often but for longer.
+#define ENV_QUANTUM(prio)	(1 << (prio))
+
+// sys_page_autogrow: at most this many regions per env, whose missing
+// pages the kernel fills with zeroed ones when they're touched
+#define ENV_NREGION		4
+
+// sys_env_set_fault_flags: the write faults on copy-on-write pages that
+// the kernel deals with itself, rather than pushing a UTrapframe and
+// running the upcall.  Missing pages in auto-grow regions, and swapped
+// out ones, are always dealt with in the kernel.
+#define ENV_FAULT_REUSE		0x1	// make an unshared page writable in place
+#define ENV_FAULT_COW		0x2	// copy the page, if it's still shared
+
+// sys_ipc_recv_range flags
+#define IPC_NONBLOCK		0x1	// take only what's waiting; don't block
+
+// sys_addr_wake: wake every waiter
+#define ADDR_WAKE_ALL		0xFFFFFFFF
+
+// Words a short message (sys_ipc_send_short) carries besides its value
+#define IPC_NWORDS		3
+
+struct Env_region {
+	uintptr_t r_start;		// page-aligned; r_start == r_end if unused
+	uintptr_t r_end;
+};
+
+// sys_env_set_ras: at most this many restartable atomic sequences per
+// address space
+#define ENV_NRAS		4
+
+// A restartable atomic sequence: the code in [ras_start, ras_end).  If
+// the env is interrupted with its eip strictly inside, the kernel sets
+// eip back to ras_start, so the sequence runs again from the top.  Its
+// last instruction should be its only store others may see.
+struct Env_ras {
+	uintptr_t ras_start;
+	uintptr_t ras_end;
+};
+
+// Each Env starts on a cache line of its own, and that line holds what
+// the scheduler and envs[ENVX(envid)] lookups look at -- the identity,
+// status and scheduling fields, and whether it's receiving -- so a scan
+// of envs[], the kernel's or a user program's at UENVS, reads one line
+// per env and never the saved registers or the statistics.
+#define ENV_HOT_SIZE		64
 
 struct Env {
-	struct Trapframe env_tf;	// Saved registers
-	LIST_ENTRY(Env) env_link;	// Free list link pointers
+	// Hot: the first ENV_HOT_SIZE bytes
 	envid_t env_id;			// Unique environment identifier
-	envid_t env_parent_id;		// env_id of this env's parent
 	unsigned env_status;		// Status of the environment
+	envid_t env_parent_id;		// env_id of this env's parent
+	int env_priority;		// ENV_PRIO_*: env_base_priority, or a
+					// caller's if higher (env_donate)
+	int env_ticks;			// Ticks left in the current slice
+	int env_quantum;		// Ticks per time slice
+	int env_cpunum;			// CPU running this env, or -1
+	int env_rq_cpu;			// CPU whose run queue it's on, or was last
+	int env_affinity;		// CPU it must run on, or -1 for any
+	TAILQ_ENTRY(Env) env_run_link;	// Run queue link (while ENV_RUNNABLE)
+	uint8_t env_ipc_recving;	// env is blocked receiving
+	uint8_t env_doomed;		// destroyed, or being freed: envid2env
+					// doesn't find it
+	envid_t env_ipc_from;		// envid of the sender
+
+	struct Trapframe env_tf;	// Saved registers
+	LIST_ENTRY(Env) env_link;	// Free list link pointers
 	uint32_t env_runs;		// Number of times environment has run
+	uint64_t env_utime;		// cycles run in user mode
+	uint64_t env_stime;		// cycles the kernel ran for it
+
+	// Scheduling: priority donation (kern/env.c)
+	int env_base_priority;		// what sys_env_set_priority gave it
+	uint16_t env_donors[ENV_NPRIO];	// callers waiting on us, by class
+	uint16_t env_donated;		// the class we lend env_callee
+	envid_t env_callee;		// server we called, until it answers
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
+	uint32_t env_npages;		// user pages mapped, not counting swapped out
+	uint32_t env_nshared;		// of those, mapped PTE_SHARE
+	uint32_t env_nptpages;		// page tables below UTOP
+	uint32_t env_page_quota;	// most env_npages sys_page_alloc allows, or 0
+	uint32_t env_lockx;		// env_locks[] entry guarding it, shared
+					// by threads (sys_thread_create)
+	uintptr_t env_umc_va;		// user_mem_check's last range passed,
+	uintptr_t env_umc_end;		// [env_umc_va, env_umc_end) with
+	int env_umc_perm;		// env_umc_perm, as of pmap_revokes
+	uint32_t env_umc_revokes;	// == env_umc_revokes
 
 	// Exception handling
 	void *env_pgfault_upcall;	// page fault upcall entry point
+	uintptr_t env_xstacktop;	// top of the user exception stack
+	uint32_t env_fault_flags;	// ENV_FAULT_*: faults the kernel resolves
+	uint32_t env_kfaults;		// page faults resolved without an upcall
+	uint32_t env_ufaults;		// page faults sent to the upcall
+	struct Env_region env_regions[ENV_NREGION]; // see sys_page_autogrow
 
-	// Lab 4 IPC
-	bool env_ipc_recving;		// env is blocked receiving
+	// Lab 4 IPC (and env_ipc_recving and env_ipc_from, above)
 	void *env_ipc_dstva;		// va at which to map received page
 	uint32_t env_ipc_value;		// data value sent to us 
-	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
-};
+	size_t env_ipc_dstnpages;	// pages we'll take from env_ipc_dstva
+	size_t env_ipc_npages;		// pages received
+	uint32_t env_ipc_words[IPC_NWORDS]; // a short message's words
+	envid_t env_ipc_handoff;	// env we last woke with a send
+
+	// Blocking sends (sys_ipc_send, sys_ipc_call)
+	TAILQ_HEAD(Env_sendq, Env) env_ipc_senders; // envs waiting to send to us
+	TAILQ_ENTRY(Env) env_ipc_send_link; // link in target's env_ipc_senders
+	envid_t env_ipc_send_to;	// env we wait to send to, 0 if none
+	uint32_t env_ipc_send_value;	// the message we wait to send
+	void *env_ipc_send_srcva;
+	size_t env_ipc_send_npages;
+	uint32_t env_ipc_send_words[IPC_NWORDS];
+	int env_ipc_send_perm;
+	uint8_t env_ipc_send_short;	// with env_ipc_send_words
+	uint8_t env_ipc_send_call;	// receive a reply after sending
+
+	// sys_page_grant: env_grant_envid may map pages into this env's
+	// [env_grant_va, env_grant_va + env_grant_npages pages)
+	envid_t env_grant_envid;
+	uintptr_t env_grant_va;
+	size_t env_grant_npages;
+
+	// sys_addr_wait
+	TAILQ_ENTRY(Env) env_wait_link;	// link in the kernel's wait hash
+	physaddr_t env_wait_pa;		// word we sleep on, 0 if none
+
+	// sys_sleep, and receiving with a timeout (kern/ktimer.c)
+	LIST_ENTRY(Env) env_timer_link;	// link in the timer wheel
+	uint32_t env_timer_expires;	// tick the timer goes off at
+	uint8_t env_timer_armed;	// in the wheel
+
+	// sys_cgetc_wait
+	uint8_t env_cons_waiting;	// on env_cons_link's list
+	TAILQ_ENTRY(Env) env_cons_link;	// link in the console's waiters
+
+	// sys_event_wait
+	TAILQ_ENTRY(Env) env_event_link; // link in the kernel's event waiters
+	struct Event_wait *env_event;	// what it sleeps for, on its kernel
+					// stack; NULL if it isn't
+
+	// System calls this env made, and cycles in the ones that returned
+	uint32_t env_sc_count[NSYSCALLS];
+	uint64_t env_sc_cycles[NSYSCALLS];
+
+	// FPU and SSE registers, saved while the env isn't using them;
+	// NULL until it first does (see kern/fpu.c)
+	struct Fpu_state *env_fpu;
+	int env_fpu_cpu;		// CPU whose registers it last loaded
+
+	// Kernel stack, for kernel code that blocks partway (kern/kstack.c);
+	// NULL until the env first needs one
+	void *env_kstack;
+	uintptr_t env_kesp;		// where it blocked on it, or 0
+
+	// Performance counter counts, by PMC_*, up to its last switch in
+	// (see inc/pmc.h)
+	uint64_t env_pmc[PMC_N];
+} __attribute__((aligned(ENV_HOT_SIZE)));
 
 #endif // !JOS_INC_ENV_H
@@ -0,0 +1,22 @@
+#ifndef JOS_INC_ENVSTAT_H
+#define JOS_INC_ENVSTAT_H
+
+#include <inc/types.h>
+
+// Counts the kernel keeps for each env, by ENVX, readable by everyone at
+// UENVSTAT: a profiler reads them with loads, and no system call of its
+// own gets counted.  They start at zero when the env is made.  The
+// env's system calls, page faults and run time are in its struct Env,
+// which users read at UENVS; these are the rest.
+struct EnvStat {
+	uint32_t es_sends;		// messages it sent that arrived
+	uint32_t es_recvs;		// messages it received
+	uint32_t es_pages_sent;		// pages those carried
+	uint32_t es_pages_recvd;
+	uint32_t es_retries;		// sends that found the receiver not receiving
+	uint32_t es_cow_faults;		// copy-on-write faults the kernel resolved
+	uint64_t es_recv_wait;		// cycles blocked receiving until a message came
+	uint64_t es_send_wait;		// cycles blocked in receivers' send queues
+};
+
+#endif	// !JOS_INC_ENVSTAT_H
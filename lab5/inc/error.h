@@ -24,6 +24,14 @@
 #define E_FILE_EXISTS	13	// File already exists
 #define E_NOT_EXEC	14	// File not a valid executable
 
-#define MAXERROR	14
+// Network error codes -- only seen in user-level
+#define E_NO_NET	15	// No network card
+#define E_CONN_REFUSED	16	// Connection refused
+#define E_CONN_TIMEOUT	17	// Connection timed out
+#define E_ADDR_IN_USE	18	// Address already in use
+
+#define E_TIMEOUT	19	// A wait's timeout ran out
+
+#define MAXERROR	19
 
 #endif	// !JOS_INC_ERROR_H */
@@ -12,6 +12,34 @@
 struct Fd;
 struct Stat;
 struct Dev;
+struct EventWatch;
+
+// One buffer of a readv or writev
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+// Most buffers one readv or writev takes
+#define IOV_MAX		16
+
+// One fd of a poll(): what we wait for it to be ready for, and what it is
+struct pollfd {
+	int fd;			// or POLLFD_CONS, POLLFD_IPC; others < 0 are skipped
+	short events;		// POLLIN, POLLOUT
+	short revents;		// those of events that are ready, and POLLHUP, POLLNVAL
+};
+
+#define POLLIN		0x1	// a read won't block
+#define POLLOUT		0x4	// a write won't block
+#define POLLHUP		0x10	// the other end is closed
+#define POLLNVAL	0x20	// fd isn't open
+
+#define POLLFD_CONS	-2	// console input (sys_cgetc), for POLLIN
+#define POLLFD_IPC	-3	// a message to receive, for POLLIN
+
+// Most words a dev_poll asks poll() to watch
+#define POLL_DEV_NWATCH	2
 
 struct Dev {
 	int dev_id;
@@ -22,11 +50,41 @@ struct Dev {
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_seek)(struct Fd *fd, off_t pos);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Optional: all of an iovec in one operation.  Without them,
+	// readv and writev call dev_read and dev_write per buffer.
+	ssize_t (*dev_readv)(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+	ssize_t (*dev_writev)(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+	// Optional: which of 'events' fd is ready for, with POLLHUP; or if
+	// none, add up to POLL_DEV_NWATCH words at ew[*nwatch] for poll()
+	// to sleep on until that may change.  Without it, poll() finds the
+	// fd always ready, as a file is.
+	int (*dev_poll)(struct Fd *fd, int events, struct EventWatch *ew, int *nwatch);
+	// Optional: make up to 'len' bytes from 'offset' on readable where
+	// they lie, at *blk, and return how many; 0 at end of file.  splice()
+	// hands them straight to the other fd's dev_write.
+	ssize_t (*dev_map)(struct Fd *fd, size_t len, off_t offset, const void **blk);
 };
 
+// Maximum number of file descriptors a program may hold open concurrently
+#define MAXFD		64
+
 struct FdFile {
 	int id;
 	struct File file;
+	// The size as far as our writes go.  file.f_size, the server's,
+	// may be more: file_write reserves room to grow into, and the two
+	// agree again at close, sync or ftruncate.
+	off_t size;
+	// The lease the open came with (struct FsLease): the file's slot,
+	// and its l_gen and l_epoch then
+	uint32_t lease_slot;
+	uint32_t lease_gen;
+	uint32_t lease_epoch;
+};
+
+// Network server sockets
+struct FdSock {
+	int sockid;
 };
 
 struct Fd {
@@ -36,6 +94,7 @@ struct Fd {
 	union {
 		// File server files
 		struct FdFile fd_file;
+		struct FdSock fd_sock;
 	};
 };
 
@@ -46,15 +105,25 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// What readdir gives for each directory entry
+struct Dirent {
+	char d_name[MAXNAMELEN];
+	off_t d_size;
+	int d_isdir;
+};
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
 int	fd_close(struct Fd *fd, bool must_exist);
 int	fd_lookup(int fdnum, struct Fd **fd_store);
+int	fd_data_lookup(void *va, struct Fd **fd_store);
 int	dev_lookup(int devid, struct Dev **dev_store);
 
 extern struct Dev devcons;
 extern struct Dev devfile;
 extern struct Dev devpipe;
+extern struct Dev devchan;
+extern struct Dev devsock;
 
 #endif	// not JOS_INC_FD_H
@@ -0,0 +1,32 @@
+#ifndef JOS_INC_FIBER_H
+#define JOS_INC_FIBER_H 1
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Fibers: cooperative threads within one env (lib/fiber.c).
+
+// Most fibers an env can have, and each one's stack
+#define FIBER_MAX	32
+#define FIBER_STKSIZE	(2 * PGSIZE)
+
+struct Fiber;
+struct FiberQ {
+	struct Fiber *fq_head;
+	struct Fiber *fq_tail;
+};
+
+int	fiber_init(int nfiber);
+void	fiber_start(int id, void (*fn)(void *), void *arg);
+void	fiber_run(void);
+int	fiber_self(void);
+void	fiber_yield(void);
+void	fiber_sleep(struct FiberQ *q);
+void	fiber_wakeup(struct FiberQ *q);
+
+// A request server on fibers: see fiber_serve
+typedef int32_t (*fiber_handler)(envid_t whom, uint32_t value, void *pg, int perm);
+void	fiber_serve(fiber_handler fn, uintptr_t pgbase, int nfiber) __attribute__((noreturn));
+
+#endif
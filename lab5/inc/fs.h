@@ -4,6 +4,7 @@
 #define JOS_INC_FS_H
 
 #include <inc/types.h>
+#include <inc/mmu.h>
 
 // File nodes (both in-memory and on-disk)
 
@@ -22,18 +23,67 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reached through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	(NINDIRECT * BLKSIZE)
+// A client maps a whole open file at its fd (lib/fd.c), so this is what
+// bounds a file; the block pointers reach NINDIRECT + NDINDIRECT blocks.
+#define MAXFILESIZE	(4 * NINDIRECT * BLKSIZE)
+
+// A run of a file's blocks that is contiguous on disk too: file blocks
+// [e_fileblk, e_fileblk + e_len) are disk blocks [e_start, e_start + e_len).
+struct Extent {
+	uint32_t e_fileblk;	// first file block in the run
+	uint32_t e_start;	// its disk block
+	uint32_t e_len;		// number of blocks
+};
+
+// Number of extents in a File descriptor
+#define NEXTENT_INLINE	3
+// Number of extents in an extent block
+#define NEXTENT_BLOCK	(BLKSIZE / sizeof(struct Extent))
+
+// A regular file no bigger than this may keep its data in its struct File
+// instead of a block of its own (FILE_INLINE)
+#define FILE_INLINE_MAX	96
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	// Where the blocks are; which half of the union is in use depends
+	// on the file system's version (see struct Super).  An inline file
+	// has no blocks, and its data in f_data instead.
+	union {
+		// Version 1: block pointers.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+			uint32_t f_dindirect;		// double-indirect block
+		};
+		// Version 2: up to NEXTENT_INLINE + NEXTENT_BLOCK extents,
+		// sorted by e_fileblk, the first few here and the rest in
+		// f_extblk.  A block is allocated iff an extent covers it.
+		struct {
+			struct Extent f_extent[NEXTENT_INLINE];
+			uint32_t f_extblk;		// block of more extents
+			uint32_t f_nextent;		// extents in use
+		};
+		// FILE_INLINE: the first f_size bytes; the rest are zero.
+		uint8_t f_data[FILE_INLINE_MAX];
+	};
+
+	// fs_namehash(f_name), so directory lookups can skip most strcmps;
+	// 0 if it was never set, and then only the name tells.
+	uint32_t f_namehash;
+
+	uint32_t f_flags;		// FILE_*
+
+	// strlen(f_name), so lookups rule out names of another length
+	// without reading them; 0 if it was never set.
+	uint32_t f_namelen;
 
 	// Points to the directory in which this file lives.
 	// Meaningful only in memory; the value on disk can be garbage.
@@ -42,9 +92,31 @@ struct File {
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - sizeof(struct File*)];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - FILE_INLINE_MAX - 12 - sizeof(struct File*)];
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// File flags
+#define FILE_INLINE	0x1	// data in f_data, not in blocks
+#define FILE_COMPRESSED	0x2	// each block compressed on its own
+
+// A block of a FILE_COMPRESSED file holds, not the file's block, but its
+// compressed stream (inc/lz.h): a little-endian 16-bit length, then that
+// many bytes of stream, then nothing that's read.  The block decodes to
+// BLKSIZE bytes, or to the rest of the file in the last block.
+#define PACKED_HDRSIZE	2
+#define PACKED_MAXLEN	(BLKSIZE - PACKED_HDRSIZE)
+
+// FNV-1a hash of a file name, never 0.
+static inline uint32_t
+fs_namehash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h ? h : 1;
+}
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
@@ -57,10 +129,97 @@ struct File {
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
 
+// On-disk layout versions.  Disks made before the version was recorded
+// have s_version 0 and are version 1.
+#define FS_VERSION_BLOCKPTR	1	// files have direct and indirect blocks
+#define FS_VERSION_EXTENT	2	// files have extents
+#define FS_VERSION		FS_VERSION_EXTENT	// newest
+
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_version;		// FS_VERSION_*, or 0 for version 1
+	uint32_t s_journal;		// first block of the journal
+	uint32_t s_njournal;		// blocks in the journal, 0 if there's none
+	uint32_t s_snap;		// snapshot header block, 0 if there's none
+};
+
+// The journal holds the last metadata transaction committed: a header
+// block, then copies of the blocks the transaction changed, in the
+// order of j_blocks.  It is written with one IDE command, so it is at
+// most 256 sectors long.
+#define JOURNAL_MAGIC		0x4A4E4C21	// 'JNL!'
+#define JOURNAL_MAXBLOCKS	32
+#define JOURNAL_NBLOCKS		JOURNAL_MAXBLOCKS	// what fsformat gives it
+
+struct JournalHeader {
+	uint32_t j_magic;		// JOURNAL_MAGIC
+	uint32_t j_sum;			// journal_sum of the rest
+	uint32_t j_seq;			// transaction number
+	uint32_t j_nblocks;		// blocks logged after the header
+	uint32_t j_blocks[0];		// where each one belongs
+};
+
+// FNV-1a over the header after j_sum and the j_nblocks blocks that
+// follow the header block in memory.  A transaction only torn partway
+// through being written won't match its j_sum.  j_nblocks must be less
+// than the journal's size.
+static inline uint32_t
+journal_sum(const struct JournalHeader *jh)
+{
+	const uint32_t *w = (const uint32_t *) jh;
+	uint32_t h = 2166136261U, i;
+
+	for (i = 2; i < 4 + jh->j_nblocks; i++)
+		h = (h ^ w[i]) * 16777619U;
+	w += BLKSIZE / 4;
+	for (i = 0; i < jh->j_nblocks * (BLKSIZE / 4); i++)
+		h = (h ^ w[i]) * 16777619U;
+	return h;
+}
+
+// A snapshot (fs/snap.c) keeps what the disk held when it was taken, so
+// that the disk can be rolled back to it.  Its header names an area of
+// blocks, in runs: first a copy of the bitmap as it was, with the area
+// itself marked free, then the table, then the store.  The first write
+// to a block in use then copies the block's old contents into the next
+// block of the store, and table entry k is the block that store block k
+// holds, or 0 if it holds none yet; those in use come first.
+#define SNAP_MAGIC		0x534E4150	// 'SNAP'
+#define SNAP_MAXRUN		64
+#define SNAP_PER_TABLE		(BLKSIZE / 4)	// table entries in a block
+
+// Snapshot flags
+#define SNAP_ROLLBACK		0x1	// roll back at the next mount
+#define SNAP_OVERFLOW		0x2	// the store filled up: no going back
+
+struct SnapHeader {
+	uint32_t sh_magic;		// SNAP_MAGIC
+	uint32_t sh_flags;		// SNAP_*
+	uint32_t sh_nbitmap;		// blocks of the copy of the bitmap
+	uint32_t sh_ntable;		// blocks of the table
+	uint32_t sh_nstore;		// blocks of the store
+	uint32_t sh_nrun;		// runs in use
+	// Block i of the area is e_start + (i - e_fileblk) of the run
+	// with i in [e_fileblk, e_fileblk + e_len)
+	struct Extent sh_run[SNAP_MAXRUN];
+};
+
+// Leases.  The file server shares this page, read-only, with every
+// client that gives it a request page (FSREQ_SETUP).  l_gen[slot]
+// changes whenever what a file in that slot holds may have: a write
+// open, a size change, a writer mapping blocks.  l_epoch changes
+// whenever a path may name another file than it did -- a create, a
+// remove -- and when the server wants the blocks clients hold back.  An
+// open's Fd says the file's slot and what the two said at the time
+// (struct FdFile); while they still say it, the pages the open got are
+// still the file's, and a client may keep reusing them (lib/fcache.c).
+#define FSLEASE_NGEN	(PGSIZE / 4 - 1)
+
+struct FsLease {
+	volatile uint32_t l_epoch;
+	volatile uint32_t l_gen[FSLEASE_NGEN];
 };
 
 // Definitions for requests from clients to file system
@@ -72,6 +231,38 @@ struct Super {
 #define FSREQ_DIRTY	5
 #define FSREQ_REMOVE	6
 #define FSREQ_SYNC	7
+#define FSREQ_MAP_RANGE	8
+#define FSREQ_EXEC	9
+#define FSREQ_READDIR	10
+#define FSREQ_STAT	11
+#define FSREQ_SETUP	12
+#define FSREQ_CLOSE_BATCH	13
+#define FSREQ_DROP_CACHE	14
+#define FSREQ_FALLOCATE	15
+#define FSREQ_SNAPSHOT	16
+
+// Request pages.  A client may give the server its request pages to
+// keep, sending each once as FSREQ_SETUP_SLOT(slot), and from then on
+// send requests with no page at all, as FSREQ_INSLOT(type, slot): the
+// server reads the request from, and writes any results into, the page
+// it kept, and nothing is mapped or unmapped per request.  The pages go
+// by envid, so a forked child gives the server its own.
+#define FSREQ_NSLOT		2
+#define FSREQ_INSLOT(type, slot)	((type) | ((slot) + 1) << 8)
+#define FSREQ_SETUP_SLOT(slot)	FSREQ_INSLOT(FSREQ_SETUP, slot)
+#define FSREQ_TYPE(value)	((value) & 0xFF)
+#define FSREQ_SLOT(value)	((int) (((value) >> 8) & 0xFF) - 1)	// -1 if none
+
+// Requests small enough to fit in the IPC_NWORDS words of a short
+// message (ipc_call_short) need no page at all: they are sent as
+// FSREQ_INREGS(type) with the request struct in the words.  Only
+// FSREQ_FITS_REGS types may be.
+#define FSREQ_INREGS(type)	((type) | 0x10000)
+#define FSREQ_ISREGS(value)	(((value) & 0x10000) != 0)
+#define FSREQ_FITS_REGS(type)	((type) == FSREQ_SET_SIZE || (type) == FSREQ_CLOSE \
+				 || (type) == FSREQ_DIRTY || (type) == FSREQ_SYNC \
+				 || (type) == FSREQ_DROP_CACHE || (type) == FSREQ_FALLOCATE \
+				 || (type) == FSREQ_SNAPSHOT)
 
 struct Fsreq_open {
 	char req_path[MAXPATHLEN];
@@ -83,6 +274,47 @@ struct Fsreq_map {
 	off_t req_offset;
 };
 
+// Map up to req_npages (at most FSMAP_MAXPAGES) blocks from req_offset on
+// at req_va in the client, which has granted the server that range with
+// sys_page_grant.  The reply is the number of blocks mapped.
+#define FSMAP_MAXPAGES	32
+
+struct Fsreq_map_range {
+	int req_fileid;		// first, as in Fsreq_map
+	off_t req_offset;
+	uint32_t req_npages;
+	uintptr_t req_va;
+};
+
+// Map the program open as req_fileid into req_child, a new environment
+// of the client's that has granted the server its address space below
+// the stack with sys_page_grant.  Text goes in read-only and data pages
+// copy-on-write; the page each data segment ends in, bss and the stack
+// are left to the client, which the server tells where things go by
+// overwriting the request with a struct Fsret_exec.
+#define FSEXEC_MAXSEG	8
+#define FSEXEC_MAXINTERP 64	// longest PT_INTERP path, with its NUL
+
+struct Fsreq_exec {
+	int req_fileid;		// first, as in Fsreq_map
+	int32_t req_child;	// an envid_t
+};
+
+struct Fsexec_seg {
+	uint32_t s_va;
+	uint32_t s_offset;
+	uint32_t s_filesz;
+	uint32_t s_memsz;
+	uint32_t s_flags;	// ELF_PROG_FLAG_*
+};
+
+struct Fsret_exec {
+	uint32_t ret_entry;
+	uint32_t ret_nseg;
+	struct Fsexec_seg ret_seg[FSEXEC_MAXSEG];
+	char ret_interp[FSEXEC_MAXINTERP]; // library to load too, or ""
+};
+
 struct Fsreq_set_size {
 	int req_fileid;
 	off_t req_size;
@@ -92,13 +324,95 @@ struct Fsreq_close {
 	int req_fileid;
 };
 
+// Give the file its blocks from req_offset up to req_offset + req_len
+// now, in one run on disk if there's room, growing it to that size if
+// it's shorter.
+struct Fsreq_fallocate {
+	int req_fileid;
+	off_t req_offset;
+	off_t req_len;
+};
+
+// Take a snapshot with a store of req_nblocks blocks (0 for half the
+// free ones), replacing any there is, and reply with the store's size;
+// have the next mount roll back to it, replying with how many blocks
+// that will restore; drop it; or reply with how many blocks have been
+// saved since it was taken.  The last three fail with -E_NOT_FOUND if
+// there is no snapshot, and all but drop with -E_INVAL if its store
+// overflowed.
+#define SNAPREQ_TAKE		1
+#define SNAPREQ_ROLLBACK	2
+#define SNAPREQ_DROP		3
+#define SNAPREQ_STAT		4
+
+struct Fsreq_snapshot {
+	int req_op;		// SNAPREQ_*
+	uint32_t req_nblocks;
+};
+
 struct Fsreq_dirty {
 	int req_fileid;
 	off_t req_offset;
 };
 
+// Close several files at once, as exit does.  An entry with ce_npages
+// > 0 marks the ce_npages pages from ce_offset on dirty; one with
+// ce_npages == 0 closes the file, first setting its size to ce_offset
+// if that's not what it is.  All the dirt is marked before anything is
+// closed, and the reply is the first error, if any.
+struct Fsclose_ent {
+	int ce_fileid;
+	off_t ce_offset;
+	uint32_t ce_npages;
+};
+
+#define FSCLOSE_MAXENT	((PGSIZE - 4) / sizeof(struct Fsclose_ent))
+
+struct Fsreq_close_batch {
+	uint32_t req_n;
+	struct Fsclose_ent req_ent[FSCLOSE_MAXENT];
+};
+
 struct Fsreq_remove {
 	char req_path[MAXPATHLEN];
 };
 
+// Look up req_path without opening it.  The server overwrites the
+// request with a struct Fsret_stat.
+struct Fsreq_stat {
+	char req_path[MAXPATHLEN];
+};
+
+struct Fsret_stat {
+	char ret_name[MAXNAMELEN];
+	off_t ret_size;
+	int ret_isdir;
+};
+
+// List the directory open as req_fileid from byte req_offset of it on.
+// The server overwrites the request with a struct Fsret_readdir holding
+// as many of the entries in use as fit, packed, and replies with how
+// many that is; 0 means the end.  ret_offset is where to go on from.
+struct Fsreq_readdir {
+	int req_fileid;		// first, as in Fsreq_map
+	off_t req_offset;
+};
+
+// An entry, taking FSDIRENT_SIZE(d_namelen) bytes of ret_buf
+struct Fsdirent {
+	off_t d_size;
+	uint16_t d_type;	// FTYPE_*
+	uint16_t d_namelen;	// not counting the null that follows
+	char d_name[0];
+};
+
+#define FSDIRENT_SIZE(namelen) \
+	((sizeof(struct Fsdirent) + (namelen) + 1 + 3) & ~3)
+
+struct Fsret_readdir {
+	off_t ret_offset;
+	uint32_t ret_len;	// bytes of ret_buf in use
+	char ret_buf[PGSIZE - 8];
+};
+
 #endif /* !JOS_INC_FS_H */
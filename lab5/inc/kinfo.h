@@ -0,0 +1,16 @@
+#ifndef JOS_INC_KINFO_H
+#define JOS_INC_KINFO_H
+
+#include <inc/types.h>
+
+// What the kernel knows about time and the machine, readable by everyone
+// at UKINFO, so that asking costs a load rather than a system call.  The
+// kernel writes it; nobody else can.
+struct KernInfo {
+	uint32_t ki_ticks;		// BSP timer ticks since boot
+	uint32_t ki_hz;			// ticks a second
+	uint64_t ki_tsc_hz;		// rdtsc counts a second
+	uint32_t ki_ncpu;		// CPUs running
+};
+
+#endif	// !JOS_INC_KINFO_H
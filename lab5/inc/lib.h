@@ -16,22 +16,87 @@
 #include <inc/env.h>
 #include <inc/memlayout.h>
 #include <inc/syscall.h>
+#include <inc/trace.h>
+#include <inc/kinfo.h>
+#include <inc/envstat.h>
 #include <inc/trap.h>
 #include <inc/fs.h>
 #include <inc/fd.h>
 #include <inc/args.h>
+#include <inc/malloc.h>
+#include <inc/sync.h>
+#include <inc/ras.h>
+#include <inc/bufio.h>
+#include <inc/net.h>
+#include <inc/ns.h>
 
 #define USED(x)		(void)(x)
 
 // libos.c or entry.S
 extern char *binaryname;
-extern volatile struct Env *env;
+// Threads (lib/thread.c) run on stacks in [UTHREADS, UTHREADSTOP),
+// each in a THREAD_STKSIZE slot: its exception stack is the top page,
+// its normal stack the pages below, down to an unmapped guard page.
+#define UTHREADS	0xD0000000
+#define NTHREAD		64
+#define THREAD_STKSIZE	(16 * PGSIZE)
+#define UTHREADSTOP	(UTHREADS + NTHREAD * THREAD_STKSIZE)
+
+// Where user/lib.ld links the shared library image, libjos.so, just
+// above the malloc heap
+#define ULIB		0x0C000000
+
+// The file cache (lib/fcache.c), below the fd table: the file server's
+// lease page, the cache's table, and from FCACHE + PTSIZE on a window
+// for each file it keeps
+#define FCACHE		0x8E000000
+
+// The running environment's Env.  It lives in the top word of the normal
+// user stack rather than in .data, so that environments made by sfork(),
+// which share .data but not the stack, each see their own.
+// lib/entry.S and spawn's init_stack keep that word free.  A thread's
+// lives in the top word of its stack slot.
+#define ENVSLOT		(USTACKTOP - 4)
+#define env		(*(volatile struct Env **) env_slot())
+
+static __inline uintptr_t
+env_slot(void)
+{
+	uintptr_t esp;
+
+	__asm __volatile("movl %%esp,%0" : "=r" (esp));
+	if (esp >= UTHREADS && esp < UTHREADSTOP)
+		return ROUNDDOWN(esp, THREAD_STKSIZE) + THREAD_STKSIZE - 4;
+	return ENVSLOT;
+}
 extern volatile struct Env envs[NENV];
 extern volatile struct Page pages[];
+extern volatile struct SyscallStat sysstat[NSYSCALLS];
+extern volatile struct EnvStat envstat[NENV];
+extern volatile struct TraceRing tracebuf[TRACE_NRING];
+extern volatile struct KernInfo kinfo;
+
+// Our own Env, found without a system call: the page directory maps
+// itself at UVPT, and its struct Page names the env it was made for.
+// A thread shares its creator's page directory, so it gets 'env' from
+// thread_create instead.
+static __inline volatile struct Env *
+env_lookup(void)
+{
+	uintptr_t e = (uintptr_t) pages[PPN(vpd[PDX(UVPT)])].pp_env;
+
+	return &envs[(e - KENVS) / sizeof(struct Env)];
+}
 void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+void	add_pgfault_handler(int (*handler)(struct UTrapframe *utf));
+
+// console.c
+void	cflush(void);
+int	opencons(void);
+extern bool cons_unbuffered;
 
 // readline.c
 char*	readline(const char *buf);
@@ -39,19 +104,54 @@ char*	readline(const char *buf);
 // syscall.c
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
+int	sys_cgetc_wait(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+int	sys_sleep(uint32_t ticks);
 static envid_t sys_exofork(void);
-int	sys_env_set_status(envid_t env, int status);
-int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
-int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
-int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_env_set_status(envid_t envid, int status);
+int	sys_env_set_trapframe(envid_t envid, struct Trapframe *tf);
+int	sys_env_set_pgfault_upcall(envid_t envid, void *upcall);
+int	sys_env_set_fault_flags(envid_t envid, uint32_t flags);
+int	sys_env_set_page_quota(envid_t envid, uint32_t npages);
+int	sys_env_set_priority(envid_t envid, int priority);
+int	sys_env_set_affinity(envid_t envid, int cpu);
+int	sys_page_alloc(envid_t envid, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
-int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_map_range(envid_t src_env, void *src_pg,
+		     envid_t dst_env, void *dst_pg, size_t npages, int perm);
+int	sys_page_unmap(envid_t envid, void *pg);
+int	sys_page_autogrow(void *va, size_t len);
+int	sys_page_cow_reuse(void *va);
+envid_t	sys_cow_fork(void);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_range(void *rcv_pg, size_t npages, uint32_t ticks, int flags);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send_range(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_send_short(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int	sys_ipc_call_short(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_addr_wait(const volatile uint32_t *addr, uint32_t val);
+int	sys_addr_wake(const volatile uint32_t *addr, uint32_t max);
+int	sys_irq_listen(int irq);
+int	sys_irq_wait(int irq);
+int	sys_page_grant(envid_t envid, envid_t toenvid, void *va, size_t npages);
+int	sys_net_try_send(void *va, int npkts);
+int	sys_net_recv(void *va, int npkts);
+int	sys_net_hwaddr(uint8_t *mac);
+envid_t	sys_exec(const void *binary, size_t size, void *stack, uintptr_t esp);
+envid_t	sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop);
+int	sys_batch(struct SyscallReq *reqs, uint32_t n);
+int	sys_page_alloc_contig(void *va, size_t npages, int perm);
+int	sys_ahci_read(uint32_t off, uint32_t *val);
+int	sys_ahci_write(uint32_t off, uint32_t val);
+int	sys_event_wait(uint32_t events, const struct EventWatch *watch, int nwatch, uint32_t ticks);
+int	sys_klog_read(char *buf, size_t len);
+int	sys_env_set_ras(envid_t envid, const struct Env_ras *ras, size_t n);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t sys_exofork(void) __attribute__((always_inline));
@@ -70,11 +170,42 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 uint32_t ticks);
+int32_t ipc_poll(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_range(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int32_t ipc_recv_range(envid_t *from_env_store, void *pg, size_t npages,
+		       size_t *npages_store, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+void	ipc_send_short(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int32_t ipc_call_short(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       void *rcv_pg, envid_t *from_env_store, int *perm_store);
+
+// batch.c
+struct SyscallBatch {
+	uint32_t sb_n;			// calls queued
+	struct SyscallReq sb_req[SYSBATCH_MAX];
+};
+#define BATCH_INIT	{ 0 }
+int	batch_add(struct SyscallBatch *b, uint32_t num, uint32_t a1, uint32_t a2,
+		  uint32_t a3, uint32_t a4, uint32_t a5);
+int	batch_flush(struct SyscallBatch *b);
+int	batch_page_alloc(struct SyscallBatch *b, envid_t envid, void *va, int perm);
+int	batch_page_map(struct SyscallBatch *b, envid_t srcenv, void *srcva,
+		       envid_t dstenv, void *dstva, int perm);
+int	batch_page_unmap(struct SyscallBatch *b, envid_t envid, void *va);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+int	dup_shared(envid_t envid);
+
+// thread.c
+envid_t	thread_create(void (*fn)(void *), void *arg);
+int	thread_join(envid_t tid);
+void	thread_exit(void) __attribute__((noreturn));
 
 // fd.c
 int	close(int fd);
@@ -82,33 +213,107 @@ ssize_t	read(int fd, void *buf, size_t nbytes);
 ssize_t	write(int fd, const void *buf, size_t nbytes);
 int	seek(int fd, off_t offset);
 void	close_all(void);
+void	close_all_exit(void);
+ssize_t	readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t	writev(int fd, const struct iovec *iov, int iovcnt);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	poll(struct pollfd *fds, int nfds, int timeout);
+ssize_t	splice(int fdin, int fdout, size_t n);
 
 // file.c
 int	open(const char *path, int mode);
 int	read_map(int fd, off_t offset, void **blk);
+int	read_map_range(int fd, off_t offset, size_t len, void **blk);
+ssize_t	read_zc(int fd, void *buf, size_t n);
 int	ftruncate(int fd, off_t size);
+int	fallocate(int fd, off_t offset, off_t len);
 int	remove(const char *path);
 int	sync(void);
+int	readdir(int fd, struct Dirent *ent);
+int	file_close_all(void);
+int	mmap(void *va, size_t len, int prot, int flags, int fd, off_t offset);
+int	munmap(void *va, size_t len);
+
+// fcache.c
+// fd_file.id of an fd fcache_open made, which the server knows nothing of
+#define FCACHE_FILEID	(-1)
+int	fcache_open(const char *path, struct Fd *fd);
+void	fcache_note(const char *path, struct Fd *fd);
+void	fcache_donate(struct Fd *fd);
+void	fcache_fill(int fdnum);
+int	fcache_give(envid_t child);
 
 // fsipc.c
 int	fsipc_open(const char *path, int omode, struct Fd *fd);
 int	fsipc_map(int fileid, off_t offset, void *dst_va);
+int	fsipc_map_range(int fileid, off_t offset, void *dst_va, size_t npages);
+int	fsipc_exec(int fileid, envid_t child, struct Fsret_exec *ret);
 int	fsipc_set_size(int fileid, off_t size);
+int	fsipc_fallocate(int fileid, off_t offset, off_t len);
 int	fsipc_close(int fileid);
 int	fsipc_dirty(int fileid, off_t offset);
+int	fsipc_close_batch(const struct Fsclose_ent *ent, uint32_t n);
 int	fsipc_remove(const char *path);
 int	fsipc_sync(void);
+int	fsipc_drop_cache(void);
+int	fsipc_snapshot(int op, uint32_t nblocks);
+int	fsipc_readdir(int fileid, off_t offset, struct Fsret_readdir *ret);
+int	fsipc_stat(const char *path, struct Stat *st);
+
+// chan.c
+struct Chan;
+#define CHAN_MAXPAGES	512	// ring pages, plus the header, fit in an fd's data
+int	chan(int fd[2]);
+int	chan_isclosed(int fd);
+int	chan_alloc(int fd[2], struct Dev *dev, int npages);
+ssize_t	chan_fdread(struct Fd *fd, void *buf, size_t n, off_t offset);
+ssize_t	chan_fdwrite(struct Fd *fd, const void *buf, size_t n, off_t offset);
+ssize_t	chan_fdreadv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t	chan_fdwritev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t	chan_readv(struct Fd *fd, struct Chan *ch, const struct iovec *iov, int iovcnt);
+ssize_t	chan_writev(struct Fd *fd, struct Chan *ch, const struct iovec *iov, int iovcnt);
+size_t	chan_put(struct Chan *ch, const void *buf, size_t n);
+void	chan_peek(struct Chan *ch, uint32_t off, void *buf, size_t n);
+void	chan_consume(struct Chan *ch, size_t n);
+int	chan_fdclose(struct Fd *fd);
+int	chan_fdstat(struct Fd *fd, struct Stat *stat);
+int	chan_fdpoll(struct Fd *fd, int events, struct EventWatch *ew, int *nwatch);
+int	chan_poll(struct Fd *fd, struct Chan *ch, bool rd, struct EventWatch *ew, int *nwatch);
+
+// pipe.c
+int	pipe(int pipefds[2]);
+int	pipeisclosed(int pipefd);
+
+// nsipc.c
+int	nsipc_socket(void *va);
+int	nsipc_bind(int sockid, const struct sockaddr_in *addr);
+int	nsipc_listen(int sockid, int backlog);
+int	nsipc_accept(int sockid, void *va, struct sockaddr_in *addr);
+int	nsipc_connect(int sockid, const struct sockaddr_in *addr);
+int	nsipc_close(int sockid);
+
+// sockets.c
+int	socket(int domain, int type, int protocol);
+int	bind(int s, const struct sockaddr_in *addr);
+int	listen(int s, int backlog);
+int	accept(int s, struct sockaddr_in *addr);
+int	connect(int s, const struct sockaddr_in *addr);
+
+// pmc.c
+uint64_t pmc_read(int i);
 
 // pageref.c
 int	pageref(void *addr);
+pte_t	upte(uintptr_t va);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
+envid_t	spawn_exec(const char *program, const char **argv);
+int	spawn_prewarm(const char *program, int n);
 
 
 /* File open modes */
@@ -122,4 +327,11 @@ envid_t	spawnl(const char *program, const char *arg0, ...);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+
+#define	MAP_SHARED	0x1		/* writes reach the file */
+#define	MAP_PRIVATE	0x2		/* writes are copied */
+
 #endif	// !JOS_INC_LIB_H
@@ -0,0 +1,62 @@
+#ifndef JOS_INC_LZ_H
+#define JOS_INC_LZ_H
+
+#include <inc/types.h>
+
+// The compression of FILE_COMPRESSED files' blocks (inc/fs.h): LZ77,
+// laid out for a decoder that's a few lines long.  fsformat compresses,
+// and the file server and fsck decompress with lz_decode.
+//
+// A stream is a run of sequences.  Each begins with a token byte, whose
+// high nibble counts the literal bytes that follow it and whose low
+// nibble is the length, less LZ_MINMATCH, of a match after them: two
+// bytes of little-endian offset back into what's been decoded so far.
+// A nibble of 15 is continued by bytes added to it, up to one that
+// isn't 255, the literal count's straight after the token and the match
+// length's after the offset.  The last sequence ends after its literals,
+// with the stream, and has no match.
+#define LZ_MINMATCH	4
+
+// Decode the n bytes at src into dst, which has room for max.  Returns
+// the length decoded, or -1 if the stream is corrupt or won't fit.
+static inline int
+lz_decode(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t max)
+{
+	const uint8_t *end = src + n;
+	uint32_t o = 0, len, off;
+	uint8_t t;
+
+	while (src < end) {
+		t = *src++;
+		if ((len = t >> 4) == 15)
+			do {
+				if (src == end)
+					return -1;
+				len += *src;
+			} while (*src++ == 255);
+		if (len > (uint32_t) (end - src) || len > max - o)
+			return -1;
+		for (; len > 0; len--)
+			dst[o++] = *src++;
+		if (src == end)
+			break;
+		if (end - src < 2)
+			return -1;
+		off = src[0] | (src[1] << 8);
+		src += 2;
+		if ((len = t & 15) == 15)
+			do {
+				if (src == end)
+					return -1;
+				len += *src;
+			} while (*src++ == 255);
+		len += LZ_MINMATCH;
+		if (off == 0 || off > o || len > max - o)
+			return -1;
+		for (; len > 0; len--, o++)
+			dst[o] = dst[o - off];
+	}
+	return o;
+}
+
+#endif	// !JOS_INC_LZ_H
@@ -17,7 +17,7 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS    0x28     // Task segment selector
+#define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -36,22 +36,35 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     :              .               :                   |
+ *    MMIOLIM ------>  +------------------------------+ 0xefa00000        |
+ *                     |       Memory-mapped I/O      | RW/--  PTSIZE/2   |
+ *    MMIOBASE ---->   +------------------------------+ 0xef800000      --+
+ *                     |     Env Table (Kern. RW)     | RW/--  PTSIZE
+ *    ULIM, KENVS -->  +------------------------------+ 0xef400000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
- *    UVPT      ---->  +------------------------------+ 0xef400000
+ *    UVPT      ---->  +------------------------------+ 0xef000000
  *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *    UPAGES    ---->  +------------------------------+ 0xeec00000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *    UENVS  ------->  +------------------------------+ 0xee800000
+ *                     |    RO SYSCALL, ENV STATS     | R-/R-  PTSIZE
+ * UTOP,USYSSTAT --->  +------------------------------+ 0xee400000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee3ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee3fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee3fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -94,7 +107,16 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
-#define ULIM		(KSTACKTOP - PTSIZE) 
+#define KSTKGAP		(8*PGSIZE)   		// size of a kernel stack guard
+
+// Memory-mapped I/O: the local APIC's registers go here
+#define MMIOBASE	(KSTACKTOP - PTSIZE)
+#define MMIOLIM		(MMIOBASE + PTSIZE / 2)
+
+// The kernel's view of the env table, mapped a page at a time as the
+// table grows; UENVS maps the same pages read-only for users
+#define KENVS		(MMIOBASE - PTSIZE)
+#define ULIM		KENVS
 
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
@@ -107,13 +129,23 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copy of the kernel's per-syscall statistics
+#define USYSSTAT	(UENVS - PTSIZE)
+// Read-only copy of the kernel's per-env counts (inc/envstat.h), a
+// quarter of the way up the same 4MB
+#define UENVSTAT	(USYSSTAT + PTSIZE / 4)
+// Read-only copy of the kernel's event trace rings (inc/trace.h), in
+// the top half of it
+#define UTRACE		(USYSSTAT + PTSIZE / 2)
+// Read-only kernel info page (inc/kinfo.h), just below the trace rings
+#define UKINFO		(UTRACE - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
  */
 
 // Top of user-accessible VM
-#define UTOP		UENVS
+#define UTOP		USYSSTAT
 // Top of one-page user exception stack
 #define UXSTACKTOP	UTOP
 // Next page left invalid to guard against exception stack overflow; then:
@@ -131,6 +163,18 @@
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)	
 
+// Physical address the application processors start at, in real mode:
+// kern/mpentry.S is copied there.  Page-aligned, and below 1MB.
+#define MPENTRY_PADDR	0x7000
+
+// Where boot.S leaves the BIOS's E820 memory map: the 16-bit word at
+// E820_MAP is the address just past the last entry, and the entries, of
+// struct E820_entry, follow from E820_MAP + 4.  Nothing is there if it
+// points below that.
+#define E820_MAP	0x8000
+#define E820_MAXENT	128
+#define E820_RAM	1	// e8_type of usable memory
+
 
 #ifndef __ASSEMBLER__
 
@@ -175,7 +219,47 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, only meaningful for the first page of a
+	// free block: pp_order is log2 of the block's size in pages, and
+	// pp_free is set while the block sits on a free list.
+	uint8_t pp_order;
+	uint8_t pp_free : 1;
+
+	// Set in a user page that kern/merge.c shares among envs with the
+	// same contents, for as long as it stays read-only
+	uint8_t pp_merged : 1;
+
+	// Number of envs in sys_addr_wait on a word in this page
+	uint16_t pp_waiters;
+
+	// The aging sweep that last saw the page touched in user space,
+	// or 0 if none has seen it mapped yet (kern/age.c)
+	uint16_t pp_atime;
+
+	// What the page is used for says which of these it needs; they
+	// are all NULL in a page just allocated, and page directories and
+	// page tables are never mapped in user space
+	union {
+		// Where the page is mapped in user space (kern/pmap.c)
+		struct Rmap *pp_rmap;
+
+		// For an env's page directory, the env, whose memory use
+		// kern/pmap.c counts as it maps and unmaps pages
+		struct Env *pp_env;
+
+		// For a page table shared since fork, the page directory
+		// its pages' rmap entries are for, or NULL (kern/pmap.c)
+		pde_t *pp_ptdir;
+	};
 };
 
+// An entry of the BIOS memory map at E820_MAP
+struct E820_entry {
+	uint64_t e8_addr;
+	uint64_t e8_len;
+	uint32_t e8_type;	// E820_RAM, or something we mustn't use
+} __attribute__((packed));
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
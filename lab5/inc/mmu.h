@@ -65,18 +65,34 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global
 #define PTE_MBZ		0x180	// Bits must be zero
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Software bits with a fixed meaning shared by the library and the kernel.
+// PTE_SHARE pages are shared writable across fork and spawn;
+// PTE_COW marks copy-on-write pages (see lib/fork.c and sys_cow_fork).
+#define PTE_SHARE	0x400
+#define PTE_COW		0x800
+
+// In a PTE without PTE_P, PTE_SWAP marks a page the kernel has paged out
+// to the swap disk (see kern/swap.c): PTE_ADDR holds its slot there, and
+// the low bits the permissions it comes back with.  Such a page is still
+// mapped; touching it, or sys_page_map'ing it, brings it back.
+#define PTE_SWAP	0x200
+
 // Only flags in PTE_USER may be used in system calls.
 #define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // address in page table entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// address in a 4MB (PTE_PS) page directory entry
+#define PTE_PS_ADDR(pde)	((physaddr_t) (pde) & ~0x3FFFFF)
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -90,7 +106,10 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// SIMD exceptions raise #XM
+#define CR4_OSFXSR	0x00000200	// fxsave/fxrstor and SSE
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -98,6 +117,18 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID function 1 feature flags (returned in %edx)
+#define CPUID_FEAT_PSE	0x00000008	// Page Size Extensions
+#define CPUID_FEAT_SEP	0x00000800	// SYSENTER and SYSEXIT
+#define CPUID_FEAT_PGE	0x00002000	// Page Global Enable
+#define CPUID_FEAT_FXSR	0x01000000	// fxsave and fxrstor
+#define CPUID_FEAT_SSE2	0x04000000	// SSE2 (movnti, sfence)
+
+// Model-specific registers for sysenter
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -0,0 +1,22 @@
+#ifndef JOS_INC_NET_H
+#define JOS_INC_NET_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Packets go to and from the e1000 a page each, with no copying: the
+// page holds a struct NetPkt, and the card reads or writes np_data in
+// place.  sys_net_try_send takes pages away from the sender and hands
+// them to the card; sys_net_recv maps the pages the card filled into
+// the receiver, and gives the card fresh ones in their place.
+
+#define NET_MAXPKT	1518	// the largest Ethernet frame, with no FCS
+#define NET_BATCH	32	// most packets sys_net_* take per call
+
+struct NetPkt {
+	int np_len;		// bytes in np_data
+	uint8_t np_pad[12];	// np_data starts on a 16-byte boundary
+	uint8_t np_data[PGSIZE - 16];
+};
+
+#endif	// !JOS_INC_NET_H
@@ -0,0 +1,117 @@
+// Definitions for the network server (net/) and its clients
+// (lib/nsipc.c, lib/sockets.c).
+
+#ifndef JOS_INC_NS_H
+#define JOS_INC_NS_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// The kernel starts the network server right after the file server,
+// so it's always envs[NS_ENVX]
+#define NS_ENVX		2
+
+// Byte order: the network's is big-endian
+static __inline uint16_t
+htons(uint16_t x)
+{
+	return (x << 8) | (x >> 8);
+}
+
+static __inline uint32_t
+htonl(uint32_t x)
+{
+	return (x << 24) | ((x & 0xFF00) << 8) | ((x >> 8) & 0xFF00) | (x >> 24);
+}
+
+#define ntohs(x)	htons(x)
+#define ntohl(x)	htonl(x)
+
+// An IPv4 address a.b.c.d, in host order
+#define IP4(a, b, c, d)	(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define AF_INET		2
+#define SOCK_STREAM	1
+
+// Port and address are in network order, as with BSD sockets
+struct sockaddr_in {
+	uint16_t sin_family;	// AF_INET
+	uint16_t sin_port;
+	uint32_t sin_addr;
+};
+
+#define INADDR_ANY	0
+
+// A socket's data goes through two rings (inc/chan.h) that the server
+// and the client both map, in the client from the fd's data page: what
+// arrived from the network, and what is to go out.  The server copies
+// between the rings and the packets, and is only told of anything by
+// IPC when a ring it had found empty or full moves (NSREQ_KICK).  The
+// transmit ring is TCP's retransmission buffer too: the server moves
+// its read position only when the peer acknowledges the data.
+#define SOCK_RINGPAGES	4	// pages of ring each way, a power of two
+#define SOCK_RX(va)	((struct Chan *) (va))
+#define SOCK_TX(va)	((struct Chan *) ((uint8_t *) (va) + (1 + SOCK_RINGPAGES) * PGSIZE))
+#define SOCK_NPAGES	(2 * (1 + SOCK_RINGPAGES))
+
+// Requests.  As with the file server (see FSREQ_SETUP in inc/fs.h), a
+// client gives the server its request page to keep and from then on
+// sends requests in it with no page; any request that brings a page
+// makes that the one the server keeps, NSREQ_SETUP doing nothing else.
+#define NSREQ_SOCKET	1
+#define NSREQ_BIND	2
+#define NSREQ_LISTEN	3
+#define NSREQ_ACCEPT	4
+#define NSREQ_CONNECT	5
+#define NSREQ_CLOSE	6
+#define NSREQ_SETUP	7
+// No page and no reply: socket NSREQ_ARG has moved one of its ring
+// positions with the server waiting on it.  Sent by chan_readv and
+// chan_writev, as the rings' ch_server_value.
+#define NSREQ_KICK	8
+// From the server's own helpers: NSREQ_ARG packets have come in, and a
+// clock tick
+#define NSREQ_INPUT	9
+#define NSREQ_TIMER	10
+
+#define NSREQ_TYPE(value)	((value) & 0xFFFF)
+#define NSREQ_ARG(value)	((value) >> 16)
+#define NSREQ_WITHARG(type, arg) ((type) | ((arg) << 16))
+
+// NSREQ_SOCKET and NSREQ_ACCEPT map the new socket's rings into the
+// client at req_va (SOCK_NPAGES pages, which the client has granted the
+// server with sys_page_grant) and return its socket id.
+struct Nsreq_socket {
+	uintptr_t req_va;
+};
+
+struct Nsreq_bind {
+	int req_sockid;
+	struct sockaddr_in req_addr;
+};
+
+struct Nsreq_listen {
+	int req_sockid;
+	int req_backlog;
+};
+
+// Blocks until a connection comes in.  Returns the peer in ret_addr.
+struct Nsreq_accept {
+	int req_sockid;
+	uintptr_t req_va;
+	struct sockaddr_in ret_addr;
+};
+
+// Blocks until the connection is made or has failed.
+struct Nsreq_connect {
+	int req_sockid;
+	struct sockaddr_in req_addr;
+};
+
+// The client has unmapped its rings.  The connection closes once every
+// env sharing the socket has done the same.
+struct Nsreq_close {
+	int req_sockid;
+};
+
+#endif	// !JOS_INC_NS_H
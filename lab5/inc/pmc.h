@@ -0,0 +1,44 @@
+#ifndef JOS_INC_PMC_H
+#define JOS_INC_PMC_H
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+// Hardware performance counters.  Where the CPU has Intel's
+// architectural performance monitoring, the kernel programs the first
+// PMC_N general-purpose counters with the events below, counting user
+// mode only, and lets user mode read them with rdpmc.  The counters
+// are virtualized per env: each switch to an env zeroes them, and each
+// switch away adds what they counted to the env's env_pmc[], so an
+// env's count is env_pmc[i] plus rdpmc(i) while it runs (see
+// pmc_read in lib/pmc.c).
+enum {
+	PMC_CYCLES = 0,		// unhalted core cycles
+	PMC_INSTRS,		// instructions retired
+	PMC_LLC_MISS,		// last-level cache misses
+	PMC_N
+};
+
+// How many of the PMC_N counters this CPU has, 0 if none: the kernel
+// and user mode both ask here, so they agree.
+static __inline int
+pmc_ncounters(void)
+{
+	// CPUID 0xA EBX bits that say an event is missing, by PMC_*
+	static const uint32_t missing[PMC_N] = { 0x01, 0x02, 0x10 };
+	uint32_t eax, ebx;
+	int n;
+
+	cpuid(0, &eax, NULL, NULL, NULL);
+	if (eax < 0xA)
+		return 0;
+	cpuid(0xA, &eax, &ebx, NULL, NULL);
+	if ((eax & 0xFF) == 0)
+		return 0;
+	for (n = 0; n < PMC_N && n < ((eax >> 8) & 0xFF); n++)
+		if (ebx & missing[n])
+			break;
+	return n;
+}
+
+#endif	// !JOS_INC_PMC_H
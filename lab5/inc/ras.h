@@ -0,0 +1,26 @@
+#ifndef JOS_INC_RAS_H
+#define JOS_INC_RAS_H 1
+
+#include <inc/types.h>
+
+// A counter and a queue, lock-free, on restartable atomic sequences
+// (lib/ras.c): no locked instruction and no trap, as long as everyone
+// using one runs on the same CPU -- with sys_env_set_affinity, or on a
+// machine with one.  Both start zeroed.
+
+#define RASQ_SIZE	64		// items a RasQueue holds, a power of two
+
+struct RasQueue {
+	volatile uint32_t q_head;	// items taken, ever
+	volatile uint32_t q_tail;	// items put, ever
+	void *volatile q_slot[RASQ_SIZE];
+};
+
+#define RASQ_INIT	{ 0, 0, { 0 } }
+
+uint32_t ras_add(volatile uint32_t *c, uint32_t n);
+int	rasq_put(struct RasQueue *q, void *item);
+void	*rasq_get(struct RasQueue *q);
+int	ras_forget(envid_t envid);
+
+#endif
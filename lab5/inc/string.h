@@ -18,6 +18,9 @@ void *	memset(void *dst, int c, size_t len);
 void *	memmove(void *dst, const void *src, size_t len);
 int	memcmp(const void *s1, const void *s2, size_t len);
 void *	memfind(const void *s, int c, size_t len);
+// Whole pages; dst and src must be page-aligned
+void	page_copy(void *dst, const void *src);
+void	page_zero(void *dst);
 
 long	strtol(const char *s, char **endptr, int base);
 
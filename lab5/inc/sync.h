@@ -0,0 +1,30 @@
+#ifndef JOS_INC_SYNC_H
+#define JOS_INC_SYNC_H 1
+
+#include <inc/types.h>
+
+// Locks for threads, and for envs sharing memory after sfork or
+// sys_page_map (lib/sync.c).  Both start zeroed, unlocked and with no
+// waiters.
+
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held with waiters
+};
+
+struct Cond {
+	volatile uint32_t c_seq;	// bumped by each signal
+	uint32_t c_nwait;		// waiters, counted under the mutex
+};
+
+#define MUTEX_INIT	{ 0 }
+#define COND_INIT	{ 0, 0 }
+
+void	mutex_lock(struct Mutex *m);
+int	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+
+void	cond_wait(struct Cond *c, struct Mutex *m);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum
 {
@@ -18,7 +20,89 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_page_map_range,
+	SYS_cow_fork,
+	SYS_env_set_priority,
+	SYS_ipc_send,
+	SYS_addr_wait,
+	SYS_addr_wake,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_irq_listen,
+	SYS_irq_wait,
+	SYS_page_grant,
+	SYS_exec,
+	SYS_env_set_affinity,
+	SYS_cgetc_wait,
+	SYS_page_autogrow,
+	SYS_page_cow_reuse,
+	SYS_env_set_fault_flags,
+	SYS_env_set_page_quota,
+	SYS_net_try_send,
+	SYS_net_recv,
+	SYS_net_hwaddr,
+	SYS_sleep,
+	SYS_ipc_recv_range,
+	SYS_ipc_send_range,
+	SYS_ipc_send_short,
+	SYS_ipc_call_short,
+	SYS_thread_create,
+	SYS_batch,
+	SYS_page_alloc_contig,
+	SYS_ahci_read,
+	SYS_ahci_write,
+	SYS_event_wait,
+	SYS_klog_read,
+	SYS_env_set_ras,
 	NSYSCALLS
 };
 
+// How much of the kernel log the kernel keeps, for sys_klog_read
+#define KLOG_SIZE	16384
+
+// One call of a sys_batch: the number and arguments syscall() would get
+// from the registers, and the call's result, filled in by the kernel.
+// Only calls that return without blocking or switching envs may be
+// batched; the rest get -E_INVAL.
+#define SYSBATCH_MAX	32	// most calls a sys_batch runs
+
+struct SyscallReq {
+	uint32_t sr_num;
+	uint32_t sr_args[5];
+	int32_t sr_ret;
+};
+
+// sys_event_wait: what to wait for, any of which wakes us, and which
+// of them did.  Besides these, the call watches up to EVENT_NWATCH
+// words, as sys_addr_wait watches one.
+#define EVENT_IPC	0x1	// a sender waits for us to receive
+#define EVENT_CONS	0x2	// there's console input
+#define EVENT_ADDR	0x4	// a watched word moved, or was woken
+#define EVENT_TIMEOUT	0x8	// the timeout ran out
+#define EVENT_NONBLOCK	0x100	// say what's ready, but don't sleep
+
+#define EVENT_NWATCH	16	// most words one call watches
+
+struct EventWatch {
+	const volatile uint32_t *ew_addr;	// sleep while *ew_addr == ew_val
+	uint32_t ew_val;
+};
+
+// How often each system call is made and how long it takes, counted by
+// the kernel in syscall() and readable by everyone at USYSSTAT.  Calls
+// that never return, such as sys_yield or a blocking receive, count in
+// ss_count but not in the cycles.
+#define SYSSTAT_NHIST	16	// buckets in ss_hist
+#define SYSSTAT_SHIFT	7	// bucket 0 counts calls of under 2^7 cycles
+
+struct SyscallStat {
+	uint32_t ss_count;		// calls made
+	uint32_t ss_returns;		// calls that returned
+	uint64_t ss_cycles;		// cycles spent in the calls that returned
+	// Returned calls by cycles: bucket i > 0 counts calls of
+	// [2^(SYSSTAT_SHIFT+i-1), 2^(SYSSTAT_SHIFT+i)) cycles, and the
+	// last bucket everything longer
+	uint32_t ss_hist[SYSSTAT_NHIST];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
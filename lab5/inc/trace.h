@@ -0,0 +1,41 @@
+#ifndef JOS_INC_TRACE_H
+#define JOS_INC_TRACE_H
+
+#include <inc/types.h>
+
+// The kernel's event trace: a ring per CPU of the last TRACE_NEVENT
+// events of the kinds turned on in the monitor, readable by everyone at
+// UTRACE.  Each CPU writes only its own ring.  The layout is fixed --
+// little-endian, no padding -- so that a dump of the rings can be
+// decoded off the machine.
+#define TRACE_NRING	8		// rings at UTRACE, one per CPU
+#define TRACE_NEVENT	2048		// events per ring, a power of two
+
+enum {
+	TRACE_SWITCH = 0,	// a switch to another env: a0 the one run
+	TRACE_IPC_SEND,		// a message delivered: a0 from, a1 to
+	TRACE_IPC_RECV,		// an env waits to receive: a0 dstva
+	TRACE_PGFAULT,		// a user page fault: a0 va, a1 eip
+	TRACE_SYSCALL,		// a system call made: a0 its number
+	TRACE_SYSRET,		// and returning: a0 its number, a1 the result
+	TRACE_IRQ,		// a device or timer interrupt: a0 the IRQ
+	TRACE_IPC_TRY,		// sys_ipc_try_send: a0 to, a1 the result
+	TRACE_YIELD,		// sched_yield: a0 the env giving up the CPU
+	NTRACE
+};
+
+struct TraceEvent {
+	uint64_t te_tsc;		// rdtsc when it happened
+	uint32_t te_type;		// TRACE_*
+	uint32_t te_env;		// env running then, or 0
+	uint32_t te_a0;
+	uint32_t te_a1;
+};
+
+struct TraceRing {
+	uint32_t tr_head;		// events written, ever; the last is
+	uint32_t tr_pad[3];		// tr_ev[(tr_head - 1) % TRACE_NEVENT]
+	struct TraceEvent tr_ev[TRACE_NEVENT];
+};
+
+#endif /* !JOS_INC_TRACE_H */
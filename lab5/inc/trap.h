@@ -27,13 +27,17 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48		// system call
+#define T_BENCH     0xF0	// borrowed by the monitor's bench (pmap_bench)
 #define T_DEFAULT   500		// catchall
 
 // Hardware IRQ numbers. We receive these as (IRQ_OFFSET+IRQ_WHATEVER)
 #define IRQ_TIMER        0
 #define IRQ_KBD          1
+#define IRQ_SERIAL       4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20	// IPI: there's an env queued for a halted CPU
+#define IRQ_TLB         21	// IPI: flush the TLB entries in the mailbox
 #define IRQ_SPURIOUS    31
 
 #ifndef __ASSEMBLER__
@@ -2,6 +2,7 @@
 #define JOS_INC_X86_H
 
 #include <inc/types.h>
+#include <inc/mmu.h>
 
 static __inline void breakpoint(void) __attribute__((always_inline));
 static __inline uint8_t inb(int port) __attribute__((always_inline));
@@ -34,6 +35,18 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline uint64_t rdpmc(uint32_t ctr) __attribute__((always_inline));
+static __inline int cpu_has_sysenter(void);
+static __inline uint32_t bsf(uint32_t v) __attribute__((always_inline));
+static __inline uint32_t bsr(uint32_t v) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
+static __inline uint32_t cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval) __attribute__((always_inline));
+static __inline void atomic_inc(volatile uint32_t *addr) __attribute__((always_inline));
+static __inline void atomic_dec(volatile uint32_t *addr) __attribute__((always_inline));
+static __inline void mb(void) __attribute__((always_inline));
+static __inline void pause(void) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +287,115 @@ read_tsc(void)
         return tsc;
 }
 
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+// User mode too, once the kernel sets CR4_PCE
+static __inline uint64_t
+rdpmc(uint32_t ctr)
+{
+	uint64_t val;
+	__asm __volatile("rdpmc" : "=A" (val) : "c" (ctr));
+	return val;
+}
+
+// Can we use sysenter and sysexit?  The first Pentium Pros report
+// CPUID_FEAT_SEP but don't have the instructions.
+static __inline int
+cpu_has_sysenter(void)
+{
+	uint32_t eax, edx;
+	cpuid(1, &eax, NULL, NULL, &edx);
+	if (!(edx & CPUID_FEAT_SEP))
+		return 0;
+	return !(((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3 && (eax & 0xF) < 3);
+}
+
+// Index of the lowest set bit in v, which must not be 0.
+static __inline uint32_t
+bsf(uint32_t v)
+{
+	uint32_t i;
+	__asm("bsfl %1,%0" : "=r" (i) : "rm" (v) : "cc");
+	return i;
+}
+
+// Index of the highest set bit in v, which must not be 0.
+static __inline uint32_t
+bsr(uint32_t v)
+{
+	uint32_t i;
+	__asm("bsrl %1,%0" : "=r" (i) : "rm" (v) : "cc");
+	return i;
+}
+
+// Atomically exchange *addr and newval, returning the old *addr.
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	__asm __volatile("lock; xchgl %0, %1" :
+			 "+m" (*addr), "=a" (result) :
+			 "1" (newval) :
+			 "cc");
+	return result;
+}
+
+// Atomically set *addr to newval if it holds oldval, returning the old
+// *addr either way.
+static __inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	__asm __volatile("lock; cmpxchgl %2, %1" :
+			 "=a" (result), "+m" (*addr) :
+			 "r" (newval), "0" (oldval) :
+			 "cc", "memory");
+	return result;
+}
+
+// Atomically add one to *addr.
+static __inline void
+atomic_inc(volatile uint32_t *addr)
+{
+	__asm __volatile("lock; incl %0" : "+m" (*addr) : : "cc", "memory");
+}
+
+// Atomically take one from *addr.
+static __inline void
+atomic_dec(volatile uint32_t *addr)
+{
+	__asm __volatile("lock; decl %0" : "+m" (*addr) : : "cc", "memory");
+}
+
+// Full memory barrier: no load after it is done before a store ahead of
+// it is visible.  A locked instruction is one, and unlike mfence works
+// on every CPU we run on.
+static __inline void
+mb(void)
+{
+	__asm __volatile("lock; addl $0,0(%%esp)" : : : "memory", "cc");
+}
+
+// Spin-wait hint.
+static __inline void
+pause(void)
+{
+	__asm __volatile("pause" : : : "memory");
+}
+
 #endif /* !JOS_INC_X86_H */
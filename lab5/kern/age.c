@@ -0,0 +1,187 @@
+// Page aging.
+//
+// Every physical page that's mapped in user space has an age: how many
+// sweeps of the aging scan have gone by since anyone was seen to touch
+// it.  The scan walks the user PTEs of every env, the file system
+// server's included, a batch at a time from the scheduler's idle path.
+// It harvests PTE_A: a PTE with it set has been used since the last
+// sweep, so the scan clears it and notes the sweep in the page's
+// pp_atime.  A page seen for the first time counts as touched then.
+// Sweeps start at most AGE_PERIOD cycles apart, so that ages measure
+// time, roughly, rather than how often we're idle.
+//
+// An env that a CPU is running may have PTEs in that CPU's TLB, and
+// clearing PTE_A under it would need a shootdown.  We don't clear it
+// there: a set PTE_A just counts as a touch, though it stays set all
+// the while the env runs.  A clear one still means untouched, since
+// the CPU sets PTE_A as soon as it loads the PTE into its TLB.
+//
+// Aging only reads the page tables and clears PTE_A, so it can look
+// at every user page, shared and IOPL envs' ones too; kern/swap.c pages
+// out a subset of them, and harvests PTE_A the same way as it goes.
+// age_lock and the env locks are only ever tried: another idle CPU
+// that's scanning, or an env that's busy, is simply passed over.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+
+#include <kern/age.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define AGE_PERIOD	(1ULL << 30)	// cycles from one sweep to the next
+
+uint16_t age_sweep = 1;
+uint32_t age_nsweeps;
+
+static struct spinlock age_lock = SPINLOCK_INIT(age_lock);
+static uint64_t age_start;		// when this sweep started
+static bool age_done = 1;		// it has finished
+// Where the sweep has got to: the next PTE it looks at
+static uint32_t age_env;
+static uintptr_t age_va;
+
+// Note that pp was touched in this sweep.
+static void
+age_touch(struct Page *pp)
+{
+	pp->pp_atime = age_sweep;
+}
+
+bool
+age_harvest(pte_t *pte)
+{
+	struct Page *pp = pa2page(PTE_ADDR(*pte));
+
+	if (*pte & PTE_A) {
+		*pte &= ~PTE_A;
+		age_touch(pp);
+		return 1;
+	}
+	if (pp->pp_atime == 0)
+		age_touch(pp);
+	return 0;
+}
+
+uint32_t
+page_age(struct Page *pp)
+{
+	if (pp->pp_ref == 0 || pp->pp_atime == 0)
+		return 0;
+	return (uint16_t) (age_sweep - pp->pp_atime);
+}
+
+// Is e, or a thread sharing its address space, some CPU's current env?
+static bool
+env_on_cpu(struct Env *e)
+{
+	struct Env *c;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if ((c = cpus[i].cpu_env) != NULL && c->env_pgdir == e->env_pgdir)
+			return 1;
+	return 0;
+}
+
+// Age e's user pages from age_va on, looking at up to 'n' of them.
+// e is locked.  Returns how many are left of n.
+static int
+age_scan(struct Env *e, int n)
+{
+	pde_t pde;
+	pte_t *pte;
+	bool running = env_on_cpu(e);
+
+	for (; age_va < UTOP && n > 0; age_va += PGSIZE) {
+		pde = e->env_pgdir[PDX(age_va)];
+		// Another env may be writing the PTEs of a table it
+		// shares with e
+		if (!(pde & PTE_P) || (pde & PTE_PS) || PDE_SHARED(pde)) {
+			age_va = ROUNDDOWN(age_va, PTSIZE) + PTSIZE - PGSIZE;
+			n--;
+			continue;
+		}
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(age_va);
+		if ((*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+			continue;
+		n--;
+		if (!running)
+			age_harvest(pte);
+		else if ((*pte & PTE_A) || pa2page(PTE_ADDR(*pte))->pp_atime == 0)
+			age_touch(pa2page(PTE_ADDR(*pte)));
+	}
+	return n;
+}
+
+void
+age_idle(int n)
+{
+	struct Env *e;
+
+	if (!spin_trylock(&age_lock))
+		return;
+	if (age_done) {
+		if (read_tsc() - age_start < AGE_PERIOD)
+			goto out;
+		// A new sweep; pp_atime 0 means never seen, so skip it
+		if (++age_sweep == 0)
+			age_sweep = 1;
+		age_start = read_tsc();
+		age_done = 0;
+		age_env = 0;
+		age_va = 0;
+	}
+	while (n > 0) {
+		if (age_env >= env_ntable) {
+			age_done = 1;
+			age_nsweeps++;
+			break;
+		}
+		e = &envs[age_env];
+		if (e->env_status != ENV_FREE && env_trylock(e)) {
+			if (e->env_status != ENV_FREE && e->env_pgdir != NULL)
+				n = age_scan(e, n);
+			env_unlock(e);
+			if (age_va < UTOP)
+				continue;
+		}
+		n--;
+		age_env++;
+		age_va = 0;
+	}
+out:
+	spin_unlock(&age_lock);
+}
+
+//
+// Fill pps[] with up to 'n' of the pages the aging scan has seen mapped
+// in user space, picking those that have gone the most sweeps without
+// being touched, oldest first.  A page that's no longer mapped anywhere
+// is freed, and so has no age.  This looks at every page, so it's for
+// the occasional caller: the monitor, or code choosing what to evict.
+//
+int
+age_coldest(struct Page **pps, int n)
+{
+	struct Page *pp;
+	uint32_t age;
+	int found = 0, i;
+
+	for (pp = pages; pp < pages + npage && n > 0; pp++) {
+		if (pp->pp_ref == 0 || pp->pp_atime == 0)
+			continue;
+		age = page_age(pp);
+		if (found == n && age <= page_age(pps[n - 1]))
+			continue;
+		// insert, keeping pps[] oldest first
+		i = (found < n) ? found++ : n - 1;
+		for (; i > 0 && page_age(pps[i - 1]) < age; i--)
+			pps[i] = pps[i - 1];
+		pps[i] = pp;
+	}
+	return found;
+}
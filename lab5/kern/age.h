@@ -0,0 +1,25 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_AGE_H
+#define JOS_KERN_AGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+extern uint16_t age_sweep;	// the aging sweep in progress, from 1
+extern uint32_t age_nsweeps;	// sweeps finished
+
+// Scan up to 'n' more user PTEs.  Called from the scheduler's idle path.
+void	age_idle(int n);
+// Harvest PTE_A from the user PTE *pte, of an env no CPU is running.
+bool	age_harvest(pte_t *pte);
+// Sweeps gone by since pp was last seen touched.
+uint32_t page_age(struct Page *pp);
+// Find up to 'n' of the user pages that have gone longest untouched,
+// oldest first.  Returns how many it found.
+int	age_coldest(struct Page **pps, int n);
+
+#endif	// !JOS_KERN_AGE_H
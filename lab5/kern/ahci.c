@@ -0,0 +1,27 @@
+// An AHCI SATA controller.  All the kernel does is map its registers;
+// the file server drives it (fs/ahci.c) through sys_ahci_read and
+// sys_ahci_write, and gets its interrupt by sys_irq_listen.
+
+#include <inc/error.h>
+
+#include <kern/ahci.h>
+#include <kern/pci.h>
+#include <kern/pmap.h>
+
+volatile uint32_t *ahci_regs;
+uint32_t ahci_regs_size;
+
+int
+ahci_attach(struct pci_func *f)
+{
+	// Only the first controller
+	if (ahci_regs)
+		return 0;
+	pci_func_enable(f);
+	// The registers are in BAR5, the ABAR
+	if (f->reg_base[5] == 0 || f->reg_size[5] == 0)
+		return -E_INVAL;
+	ahci_regs = mmio_map_region(f->reg_base[5], f->reg_size[5]);
+	ahci_regs_size = f->reg_size[5];
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_AHCI_H
+#define JOS_KERN_AHCI_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct pci_func;
+
+// An AHCI SATA controller, whatever its vendor
+#define PCI_CLASS_STORAGE	0x01
+#define PCI_SUBCLASS_SATA	0x06
+
+// The controller's registers (its ABAR), 0 if there's no controller.
+// The driver is the file server's (fs/ahci.c), which reaches them with
+// sys_ahci_read and sys_ahci_write, since user space can't map device
+// memory.
+extern volatile uint32_t *ahci_regs;
+extern uint32_t ahci_regs_size;
+
+int ahci_attach(struct pci_func *f);
+
+#endif	// !JOS_KERN_AHCI_H
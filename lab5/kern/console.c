@@ -8,8 +8,12 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/klog.h>
 
-extern int ch_color;
+// The color of what the console writes: the last %C the kernel log
+// came to (kern/klog.c)
+int cons_color = 7;
 
 void cons_intr(int (*proc)(void));
 
@@ -19,10 +23,12 @@ void cons_intr(int (*proc)(void));
 #define COM1		0x3F8
 
 #define COM_RX		0	// In:	Receive buffer (DLAB=0)
+#define COM_TX		0	// Out: Transmit buffer (DLAB=0)
 #define COM_DLL		0	// Out: Divisor Latch Low (DLAB=1)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
 #define COM_FCR		2	// Out: FIFO Control Register
 #define COM_LCR		3	// Out: Line Control Register
@@ -34,9 +40,28 @@ void cons_intr(int (*proc)(void));
 #define	  COM_MCR_OUT2	0x08	// Out2 complement
 #define COM_LSR		5	// In:	Line Status Register
 #define   COM_LSR_DATA	0x01	//   Data available
+#define   COM_LSR_TXRDY	0x20	//   Transmit buffer empty
 
 static bool serial_exists;
 
+// Output waits here for the transmitter, which takes a byte at a time
+// (the FIFO is off) and interrupts when it's ready for the next, so
+// printing costs the printer no more than the copy.  rpos and wpos run
+// free; their difference is how much is queued.  The ring is guarded by
+// cons_lock.  Once serial_sync is set, by cons_sync, output waits for
+// the transmitter instead, so that a panic's message gets out.
+#define SERIAL_TXBUF	1024
+
+static struct {
+	uint8_t buf[SERIAL_TXBUF];
+	uint32_t rpos;
+	uint32_t wpos;
+} serial_tx;
+static bool serial_txi;		// COM_IER_TXI is set
+static bool serial_sync;
+
+static void delay(void);
+
 int
 serial_proc_data(void)
 {
@@ -45,11 +70,83 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Wait, but not forever, for the transmitter to take another byte
+static void
+serial_wait(void)
+{
+	int i;
+
+	for (i = 0; !(inb(COM1+COM_LSR) & COM_LSR_TXRDY) && i < 12800; i++)
+		delay();
+}
+
+// Hand the transmitter what it will take now, and ask it to interrupt
+// when it wants more only while there is more.
+static void
+serial_tx_drain(void)
+{
+	bool more;
+
+	while (serial_tx.rpos != serial_tx.wpos
+	       && (inb(COM1+COM_LSR) & COM_LSR_TXRDY))
+		outb(COM1+COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUF]);
+	more = serial_tx.rpos != serial_tx.wpos;
+	if (more != serial_txi) {
+		outb(COM1+COM_IER, COM_IER_RDI | (more ? COM_IER_TXI : 0));
+		serial_txi = more;
+	}
+}
+
+static void
+serial_putc(int c)
+{
+	if (!serial_exists)
+		return;
+	if (serial_sync) {
+		serial_wait();
+		outb(COM1+COM_TX, c);
+		return;
+	}
+	// A full ring means printing faster than the line runs: wait for
+	// room, or drop the oldest byte if the transmitter is stuck.
+	if (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUF) {
+		serial_wait();
+		serial_tx_drain();
+		if (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUF)
+			serial_tx.rpos++;
+	}
+	serial_tx.buf[serial_tx.wpos++ % SERIAL_TXBUF] = c;
+	serial_tx_drain();
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	if (!serial_exists)
+		return;
+	cons_intr(serial_proc_data);
+	cons_begin();
+	serial_tx_drain();
+	cons_end();
+}
+
+// Send whatever is queued, waiting for it, and make all later output
+// synchronous.  For panics: nothing may be left in the ring when the
+// kernel stops taking interrupts for good.
+void
+cons_sync(void)
+{
+	cons_begin();
+	serial_sync = 1;
+	if (serial_exists) {
+		while (serial_tx.rpos != serial_tx.wpos) {
+			serial_wait();
+			outb(COM1+COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUF]);
+		}
+		outb(COM1+COM_IER, COM_IER_RDI);
+		serial_txi = 0;
+	}
+	cons_end();
 }
 
 void
@@ -149,10 +246,19 @@ cga_init(void)
 
 
 
+static void
+cga_cursor(void)
+{
+	outb(addr_6845, 14);
+	outb(addr_6845 + 1, crt_pos >> 8);
+	outb(addr_6845, 15);
+	outb(addr_6845 + 1, crt_pos);
+}
+
 void
 cga_putc(int c)
 {
-    c = c + (ch_color << 8);
+    c = c + (cons_color << 8);
 	// if no attribute given, then use black on white
 	if (!(c & ~0xFF))
         c |= 0x0700;
@@ -194,10 +300,99 @@ cga_putc(int c)
 	}
 
 	/* move that little blinky thing */
-	outb(addr_6845, 14);
-	outb(addr_6845 + 1, crt_pos >> 8);
-	outb(addr_6845, 15);
-	outb(addr_6845 + 1, crt_pos);
+	cga_cursor();
+}
+
+// Scroll the screen up 'rows' rows, blanking those that come in
+static void
+cga_scroll(int rows)
+{
+	int i;
+
+	if (rows > CRT_ROWS)
+		rows = CRT_ROWS;
+	memmove(crt_buf, crt_buf + rows * CRT_COLS, (CRT_SIZE - rows * CRT_COLS) * sizeof(uint16_t));
+	for (i = CRT_SIZE - rows * CRT_COLS; i < CRT_SIZE; i++)
+		crt_buf[i] = 0x0700 | ' ';
+}
+
+// cga_putc for a whole string, with the same results.  A first pass
+// works out where the string takes the cursor, as if the screen went
+// on downwards, so that all the scrolling can be done at once, before
+// anything is written; the second writes the characters, dropping
+// those that would have scrolled off.  The cursor moves once, at the
+// end.
+static void
+cga_write(const char *s, size_t n)
+{
+	int attr = cons_color << 8, pos, max, base, i;
+	size_t k;
+
+	if (!(attr & ~0xFF))
+		attr |= 0x0700;
+
+	pos = max = crt_pos;
+	for (k = 0; k < n; k++) {
+		switch (s[k]) {
+		case '\b':
+			if (pos > 0)
+				pos--;
+			break;
+		case '\n':
+			pos += CRT_COLS;
+			/* fallthru */
+		case '\r':
+			pos -= pos % CRT_COLS;
+			break;
+		case '\t':
+			pos += 5;
+			break;
+		default:
+			pos++;
+			break;
+		}
+		if (pos > max)
+			max = pos;
+	}
+	base = 0;
+	if (max >= CRT_SIZE) {
+		base = ((max - CRT_SIZE) / CRT_COLS + 1) * CRT_COLS;
+		cga_scroll(base / CRT_COLS);
+	}
+
+	pos = crt_pos;
+	for (k = 0; k < n; k++) {
+		switch (s[k]) {
+		case '\b':
+			if (pos > 0) {
+				pos--;
+				if (pos >= base)
+					crt_buf[pos - base] = attr | ' ';
+			}
+			break;
+		case '\n':
+			pos += CRT_COLS;
+			/* fallthru */
+		case '\r':
+			pos -= pos % CRT_COLS;
+			break;
+		case '\t':
+			for (i = 0; i < 5; i++, pos++)
+				if (pos >= base)
+					crt_buf[pos - base] = attr | ' ';
+			break;
+		default:
+			// A run of plain characters at once
+			for (; k < n && s[k] != '\b' && s[k] != '\n'
+				     && s[k] != '\r' && s[k] != '\t'; k++, pos++)
+				if (pos >= base)
+					crt_buf[pos - base] = attr | (uint8_t) s[k];
+			k--;
+			break;
+		}
+	}
+	crt_pos = pos - base;
+	cga_cursor();
 }
 
 
@@ -403,6 +598,9 @@ cons_getc(void)
 {
 	int c;
 
+	// Whoever wants input sees what the kernel printed first
+	klog_flush();
+
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
@@ -419,14 +617,35 @@ cons_getc(void)
 	return 0;
 }
 
+// is there input in the buffer that nobody has read yet?
+int
+cons_pending(void)
+{
+	return cons.rpos != cons.wpos;
+}
+
 // output a character to the console
 void
 cons_putc(int c)
 {
+	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
 }
 
+// output n characters to the console, as cons_putc would each of them
+void
+cons_write(const char *s, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		serial_putc(s[i]);
+		lpt_putc(s[i]);
+	}
+	cga_write(s, n);
+}
+
 // initialize the console devices
 void
 cons_init(void)
@@ -442,10 +661,35 @@ cons_init(void)
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// CPUs printing at once would garble the devices' state, like the CGA
+// cursor, so output goes one CPU at a time.  cprintf holds the lock for
+// a whole message, so that messages don't interleave.  The holder may
+// take it again, as a panic in the middle of a message does.
+struct spinlock cons_lock = SPINLOCK_INIT(cons_lock);
+static int cons_lock_depth;
+
+void
+cons_begin(void)
+{
+	if (!spin_holding(&cons_lock))
+		spin_lock(&cons_lock);
+	cons_lock_depth++;
+}
+
+void
+cons_end(void)
+{
+	if (--cons_lock_depth == 0)
+		spin_unlock(&cons_lock);
+}
+
 void
 cputchar(int c)
 {
+	klog_flush();
+	cons_begin();
 	cons_putc(c);
+	cons_end();
 }
 
 int
@@ -19,7 +19,15 @@
 
 void cons_init(void);
 void cons_putc(int c);
+void cons_write(const char *s, size_t n);
 int cons_getc(void);
+int cons_pending(void);
+void cons_begin(void);
+void cons_end(void);
+void cons_sync(void);
+
+extern struct spinlock cons_lock;
+extern int cons_color;
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
@@ -0,0 +1,88 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/x86.h>
+
+// Maximum number of CPUs
+#define NCPU		8
+
+// Values of cpu_status
+#define CPU_UNUSED	0
+#define CPU_STARTED	1	// running, and holding the kernel lock or in user mode
+#define CPU_HALTED	2	// in sched_halt, without the kernel lock
+
+// Per-CPU state
+struct Cpu {
+	uint8_t cpu_id;			// Local APIC ID; index into cpus[]
+	volatile unsigned cpu_status;	// CPU_*
+	struct Env *cpu_env;		// The currently-running environment
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+	struct Env *cpu_fpu_env;	// Whose state is in our FPU registers
+	uint64_t cpu_tsc;		// rdtsc when env time was last charged
+	uint64_t cpu_ioff_tsc;		// rdtsc when interrupts last went off
+	uint64_t cpu_ioff_max;		// longest they've stayed off, in cycles
+	bool cpu_preempting;		// letting them in at a preemption point
+	unsigned cpu_timer_hz;		// Rate its clock ticks at; 0 if stopped
+};
+
+// Top of CPU i's kernel stack.  The stacks sit below KSTACKTOP with an
+// unmapped guard between each, so an overflow faults rather than
+// running into the next CPU's stack.
+#define CPU_KSTACKTOP(i)	(KSTACKTOP - (i) * (KSTKSIZE + KSTKGAP))
+
+extern struct Cpu cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct Cpu *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+extern volatile uint32_t *lapic;	// Its virtual address, once mapped
+
+// Per-CPU kernel stacks, mapped at CPU_KSTACKTOP(i).  The BSP boots
+// on bootstack, and is on its own from the first trap.
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
+
+// Interrupt latency.  The kernel runs with interrupts off, so the
+// longest it stays in without letting them in -- from a trap to the
+// iret, sysexit or hlt that leaves, or to a preemption point
+// (kstack_preempt) -- bounds how long an interrupt may wait.  The
+// monitor's latency command shows each CPU's longest.
+static inline void
+cpu_ioff_start(void)
+{
+	thiscpu->cpu_ioff_tsc = read_tsc();
+}
+
+static inline void
+cpu_ioff_end(void)
+{
+	struct Cpu *c = thiscpu;
+	uint64_t d = read_tsc() - c->cpu_ioff_tsc;
+
+	if (c->cpu_ioff_tsc != 0 && d > c->cpu_ioff_max)
+		c->cpu_ioff_max = d;
+}
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_periodic(unsigned hz);
+void lapic_timer_oneshot(uint64_t tsc);
+void lapic_timer_stop(void);
+
+extern uint32_t lapic_timer_freq;	// LAPIC timer counts a second, or 0
+
+#endif	// !JOS_KERN_CPU_H
@@ -0,0 +1,278 @@
+// The Intel 82540EM gigabit Ethernet controller (the "e1000").
+// See the PCI/PCI-X Family of Gigabit Ethernet Controllers Software
+// Developer's Manual.
+//
+// Every packet buffer is a page holding a struct NetPkt (inc/net.h),
+// and the descriptors point the card straight at np_data, so packets
+// move between the card and the network server by page mapping alone.
+// e1000_tx and e1000_rx move a batch at a time and tell the card about
+// it with one register write.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/net.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kern/e1000.h>
+#include <kern/pci.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+#include <kern/syscall.h>
+
+// Registers, divided by 4 for use as uint32_t[] indices
+#define CTRL	(0x00000/4)	// Device Control
+	#define CTRL_ASDE	0x00000020	// Auto-speed detection
+	#define CTRL_SLU	0x00000040	// Set link up
+	#define CTRL_RST	0x04000000	// Reset
+#define STATUS	(0x00008/4)	// Device Status
+#define EERD	(0x00014/4)	// EEPROM Read
+	#define EERD_START	0x00000001
+	#define EERD_DONE	0x00000010
+	#define EERD_ADDR(a)	((a) << 8)
+	#define EERD_DATA(v)	((v) >> 16)
+#define ICR	(0x000C0/4)	// Interrupt Cause Read, cleared by reading
+#define ITR	(0x000C4/4)	// Interrupt Throttling, in 256ns units
+#define IMS	(0x000D0/4)	// Interrupt Mask Set
+#define IMC	(0x000D8/4)	// Interrupt Mask Clear
+	#define INT_RXDMT0	0x00000010	// Receive ring running low
+	#define INT_RXO		0x00000040	// Receive overrun
+	#define INT_RXT0	0x00000080	// Receive timer
+#define RCTL	(0x00100/4)	// Receive Control
+	#define RCTL_EN		0x00000002
+	#define RCTL_BAM	0x00008000	// Accept broadcasts
+	#define RCTL_SECRC	0x04000000	// Strip the CRC
+	// BSIZE 0, without BSEX: 2048-byte buffers
+#define TCTL	(0x00400/4)	// Transmit Control
+	#define TCTL_EN		0x00000002
+	#define TCTL_PSP	0x00000008	// Pad short packets
+	#define TCTL_CT		0x00000100	// Collision threshold 0x10
+	#define TCTL_COLD	0x00040000	// Collision distance 0x40
+#define TIPG	(0x00410/4)	// Transmit Inter-packet Gap
+	#define TIPG_DEFAULT	(10 | (4 << 10) | (6 << 20))
+#define RDBAL	(0x02800/4)	// Receive ring base, low
+#define RDBAH	(0x02804/4)
+#define RDLEN	(0x02808/4)	// in bytes, a multiple of 128
+#define RDH	(0x02810/4)	// Receive ring head, the card's
+#define RDT	(0x02818/4)	// Receive ring tail, ours
+#define RDTR	(0x02820/4)	// Receive interrupt delay
+#define TDBAL	(0x03800/4)
+#define TDBAH	(0x03804/4)
+#define TDLEN	(0x03808/4)
+#define TDH	(0x03810/4)
+#define TDT	(0x03818/4)
+#define MTA	(0x05200/4)	// Multicast table, 128 entries
+#define RAL0	(0x05400/4)	// Receive address 0, low
+#define RAH0	(0x05404/4)
+	#define RAH_AV		0x80000000	// Address valid
+
+struct tx_desc {
+	uint64_t addr;
+	uint16_t length;
+	uint8_t cso;
+	uint8_t cmd;
+	uint8_t status;
+	uint8_t css;
+	uint16_t special;
+};
+#define TXD_CMD_EOP	0x01	// End of packet
+#define TXD_CMD_IFCS	0x02	// Insert the FCS
+#define TXD_CMD_RS	0x08	// Report status
+#define TXD_STAT_DD	0x01	// Descriptor done
+
+struct rx_desc {
+	uint64_t addr;
+	uint16_t length;
+	uint16_t csum;
+	uint8_t status;
+	uint8_t errors;
+	uint16_t special;
+};
+#define RXD_STAT_DD	0x01
+#define RXD_STAT_EOP	0x02
+
+// Ring sizes, so the rings are multiples of 128 bytes
+#define NTXDESC		64
+#define NRXDESC		128
+
+// At most this many interrupts a second, so a burst of packets comes
+// to sys_net_recv as a batch
+#define E1000_INTR_RATE	8000
+
+static volatile uint32_t *e1000;
+int e1000_irq;
+uint8_t e1000_mac[6];
+
+// The card owns tx_ring[tx_clean .. tx_tail); tx_pages[i] is the page
+// tx_ring[i] sends, which we hold a reference to until it's sent.
+static struct tx_desc tx_ring[NTXDESC] __attribute__((aligned(16)));
+static struct Page *tx_pages[NTXDESC];
+static uint32_t tx_tail, tx_clean;
+
+// The card fills rx_ring[rx_next ..] in order up to RDT; rx_pages[i]
+// is the page rx_ring[i] receives into.
+static struct rx_desc rx_ring[NRXDESC] __attribute__((aligned(16)));
+static struct Page *rx_pages[NRXDESC];
+static uint32_t rx_next;
+
+static uint16_t
+e1000_eeprom_read(int addr)
+{
+	uint32_t v;
+
+	e1000[EERD] = EERD_START | EERD_ADDR(addr);
+	while (!((v = e1000[EERD]) & EERD_DONE))
+		;
+	return EERD_DATA(v);
+}
+
+// Point rx_ring[i] at a new page; its np_data takes the packet.
+static int
+e1000_rx_fill(int i)
+{
+	struct Page *pp;
+	int r;
+
+	// Zeroed, since it goes to user space
+	if ((r = page_alloc_zeroed(&pp)) < 0)
+		return r;
+	pp->pp_ref = 1;
+	rx_pages[i] = pp;
+	rx_ring[i].addr = page2pa(pp) + offsetof(struct NetPkt, np_data);
+	rx_ring[i].status = 0;
+	return 0;
+}
+
+int
+e1000_attach(struct pci_func *f)
+{
+	uint16_t w;
+	int i, r;
+
+	pci_func_enable(f);
+	if (f->irq_line == 0 || f->irq_line >= MAX_IRQS)
+		return -E_INVAL;
+	e1000 = mmio_map_region(f->reg_base[0], f->reg_size[0]);
+
+	e1000[IMC] = 0xFFFFFFFF;
+	e1000[CTRL] |= CTRL_RST;
+	while (e1000[CTRL] & CTRL_RST)
+		;
+	e1000[IMC] = 0xFFFFFFFF;
+	(void) e1000[ICR];
+	e1000[CTRL] |= CTRL_SLU | CTRL_ASDE;
+
+	for (i = 0; i < 3; i++) {
+		w = e1000_eeprom_read(i);
+		e1000_mac[2 * i] = w & 0xFF;
+		e1000_mac[2 * i + 1] = w >> 8;
+	}
+	e1000[RAL0] = e1000_mac[0] | (e1000_mac[1] << 8)
+		| (e1000_mac[2] << 16) | (e1000_mac[3] << 24);
+	e1000[RAH0] = e1000_mac[4] | (e1000_mac[5] << 8) | RAH_AV;
+	for (i = 0; i < 128; i++)
+		e1000[MTA + i] = 0;
+
+	memset(tx_ring, 0, sizeof(tx_ring));
+	e1000[TDBAL] = PADDR(tx_ring);
+	e1000[TDBAH] = 0;
+	e1000[TDLEN] = sizeof(tx_ring);
+	e1000[TDH] = e1000[TDT] = 0;
+	e1000[TCTL] = TCTL_EN | TCTL_PSP | TCTL_CT | TCTL_COLD;
+	e1000[TIPG] = TIPG_DEFAULT;
+
+	memset(rx_ring, 0, sizeof(rx_ring));
+	for (i = 0; i < NRXDESC; i++)
+		if ((r = e1000_rx_fill(i)) < 0)
+			return r;
+	e1000[RDBAL] = PADDR(rx_ring);
+	e1000[RDBAH] = 0;
+	e1000[RDLEN] = sizeof(rx_ring);
+	// The card may fill all but the last, so RDH == RDT means empty
+	e1000[RDH] = 0;
+	e1000[RDT] = NRXDESC - 1;
+	e1000[RDTR] = 0;
+	e1000[RCTL] = RCTL_EN | RCTL_BAM | RCTL_SECRC;
+
+	// Don't interrupt for sends: e1000_tx reclaims the finished ones
+	e1000[ITR] = 1000000000 / (E1000_INTR_RATE * 256);
+	e1000[IMS] = INT_RXT0 | INT_RXO | INT_RXDMT0;
+	e1000_irq = f->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+
+	cprintf("e1000: MAC %02x:%02x:%02x:%02x:%02x:%02x, irq %d\n",
+		e1000_mac[0], e1000_mac[1], e1000_mac[2],
+		e1000_mac[3], e1000_mac[4], e1000_mac[5], e1000_irq);
+	return 0;
+}
+
+// Drop our references to the pages the card has finished sending.
+static void
+e1000_tx_reclaim(void)
+{
+	while (tx_clean != tx_tail && (tx_ring[tx_clean].status & TXD_STAT_DD)) {
+		page_decref(tx_pages[tx_clean]);
+		tx_pages[tx_clean] = NULL;
+		tx_clean = (tx_clean + 1) % NTXDESC;
+	}
+}
+
+int
+e1000_tx(struct Page **pps, int n)
+{
+	struct tx_desc *d;
+	int i;
+
+	e1000_tx_reclaim();
+	for (i = 0; i < n && (tx_tail + 1) % NTXDESC != tx_clean; i++) {
+		d = &tx_ring[tx_tail];
+		d->addr = page2pa(pps[i]) + offsetof(struct NetPkt, np_data);
+		d->length = ((struct NetPkt *) page2kva(pps[i]))->np_len;
+		d->cmd = TXD_CMD_EOP | TXD_CMD_IFCS | TXD_CMD_RS;
+		d->status = 0;
+		page_incref(pps[i]);
+		tx_pages[tx_tail] = pps[i];
+		tx_tail = (tx_tail + 1) % NTXDESC;
+	}
+	if (i > 0)
+		e1000[TDT] = tx_tail;
+	return i;
+}
+
+int
+e1000_rx(struct Page **pps, int n)
+{
+	struct rx_desc *d;
+	struct NetPkt *pkt;
+	int i = 0, taken = 0;
+
+	while (i < n && ((d = &rx_ring[rx_next])->status & RXD_STAT_DD)) {
+		// Our buffers hold the largest frame, so a packet that
+		// doesn't end in one descriptor is an error; drop it
+		if ((d->status & RXD_STAT_EOP) && d->errors == 0) {
+			pkt = page2kva(rx_pages[rx_next]);
+			pkt->np_len = d->length;
+			pps[i] = rx_pages[rx_next];
+			// Without a new page, leave the packet for later
+			if (e1000_rx_fill(rx_next) < 0)
+				break;
+			i++;
+		} else
+			d->status = 0;
+		rx_next = (rx_next + 1) % NRXDESC;
+		taken++;
+	}
+	// Hand the descriptors back together
+	if (taken > 0)
+		e1000[RDT] = (rx_next + NRXDESC - 1) % NRXDESC;
+	return i;
+}
+
+void
+e1000_intr(void)
+{
+	uint32_t icr = e1000[ICR];
+
+	irq_eoi(e1000_irq);
+	if (icr & (INT_RXT0 | INT_RXO | INT_RXDMT0))
+		net_signal();
+}
@@ -0,0 +1,33 @@
+#ifndef JOS_KERN_E1000_H
+#define JOS_KERN_E1000_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct pci_func;
+struct Page;
+
+// The 82540EM, which Bochs and QEMU both emulate
+#define E1000_VENDOR	0x8086
+#define E1000_PRODUCT	0x100E
+
+// The card's IRQ, 0 if there's no card
+extern int e1000_irq;
+extern uint8_t e1000_mac[6];
+
+int e1000_attach(struct pci_func *f);
+// The card's IRQ came in.
+void e1000_intr(void);
+
+// Queue up to n of the packet pages pps (struct NetPkt) for sending,
+// taking a reference to each until the card is done with it.  Returns
+// how many were queued, fewer than n if the ring filled.
+int e1000_tx(struct Page **pps, int n);
+// Take up to n received packets out of the ring, into pps, giving the
+// card new pages in their place; the caller gets the ring's reference
+// to each page.  Returns how many there were.
+int e1000_rx(struct Page **pps, int n);
+
+#endif	// !JOS_KERN_E1000_H
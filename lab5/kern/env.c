@@ -12,12 +12,65 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/swap.h>
+#include <kern/trace.h>
+#include <kern/kstack.h>
+#include <kern/cpu.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;	        // The current env
+struct EnvStat *envstat;		// Their counts, mapped at UENVSTAT
+uint32_t env_ntable;			// envs[] entries backed by memory
+uint32_t env_nlive;			// envs[] entries not ENV_FREE
 static struct Env_list env_free_list;	// Free list
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+// env_table_lock guards env_free_list and the env_status of free envs,
+// and holds off env_free while an envid is looked up and its env locked.
+// env_locks[i] guards envs[i]'s address space, and so that of the
+// threads it makes (see env_alloc_thread).
+struct spinlock env_table_lock = SPINLOCK_INIT(env_table_lock);
+struct spinlock env_locks[NENV];
+struct Env_rasset env_ras[NENV];
+
+#define ENVGENSHIFT	12		// >= LOG2NENV
+
+// Envs added to the table at a time, when the free list runs out
+#define ENV_GROW	64
+
+// The page directories of freed envs, for env_setup_vm to give the next
+// ones: the kernel half is the same in every env's, and env_free leaves
+// the user half clear, so reusing one costs nothing.  Guarded by
+// env_table_lock.  Each holds its one reference, as in the env.
+static struct Page *env_pgdir_pool[ENV_POOL];
+static uint32_t env_npool;
+
+// On SMP, env_free leaves a big address space -- ENV_RECLAIM_MIN pages
+// or more -- for idle CPUs to take down, env_reclaim_idle's few page
+// tables at a time, rather than making the CPU that killed it wait.
+// The dead page directories wait in env_reclaim[], guarded by
+// env_reclaim_lock.  A CPU claims one for a batch (er_busy) and puts it
+// back, so any CPU can go on with a half-done one, and several go at
+// once.  page_alloc, out of memory, finishes them all first thing
+// (env_reclaim_all).  Each stays allocated until it's clear, and
+// (pgdir, va) in the pages' rmaps keeps meaning the dead env's mapping.
+// With all ENV_RECLAIM_MAX entries taken, env_free does the work
+// itself again.
+#define ENV_RECLAIM_MIN		256
+#define ENV_RECLAIM_MAX		(2 * NCPU)
+
+static struct Env_reclaim {
+	struct Page *er_pgdir;		// NULL if the entry is free
+	uint32_t er_pdeno;		// the next PDE to look at
+	bool er_busy;			// a CPU has it, or env_free is filling it
+} env_reclaim[ENV_RECLAIM_MAX];
+static uint32_t env_nreclaim;		// entries not free
+static struct spinlock env_reclaim_lock = SPINLOCK_INIT(env_reclaim_lock);
+
+static int envid2env_locked(envid_t envid, struct Env **env_store, bool checkperm);
+static struct Env_reclaim *env_reclaim_reserve(void);
 
 //
 // Converts an envid to an env pointer.
@@ -29,6 +82,53 @@ static struct Env_list env_free_list;	// Free list
 //
 int
 envid2env(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	spin_lock(&env_table_lock);
+	r = envid2env_locked(envid, env_store, checkperm);
+	spin_unlock(&env_table_lock);
+	return r;
+}
+
+//
+// envid2env, and lock the env found, for the callers that change its
+// address space.  The env can't be freed between looking it up and
+// locking it.  Release it with env_unlock.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	spin_lock(&env_table_lock);
+	if ((r = envid2env_locked(envid, env_store, checkperm)) == 0)
+		env_lock(*env_store);
+	spin_unlock(&env_table_lock);
+	return r;
+}
+
+//
+// The same for two envs, which may be the same env, as sys_page_map
+// wants.  Release them with env_unlock2.
+//
+int
+envid2env_lock2(envid_t envid1, struct Env **env_store1,
+		envid_t envid2, struct Env **env_store2, bool checkperm)
+{
+	int r;
+
+	spin_lock(&env_table_lock);
+	if ((r = envid2env_locked(envid1, env_store1, checkperm)) == 0
+	    && (r = envid2env_locked(envid2, env_store2, checkperm)) == 0)
+		env_lock2(*env_store1, *env_store2);
+	spin_unlock(&env_table_lock);
+	return r;
+}
+
+// envid2env, with env_table_lock held.
+static int
+envid2env_locked(envid_t envid, struct Env **env_store, bool checkperm)
 {
 	struct Env *e;
 
@@ -43,8 +143,15 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	// A dying env is as good as gone.  Past env_ntable there's
+	// no memory behind the slot, and no env.
+	if (ENVX(envid) >= env_ntable) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_doomed || e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -63,23 +170,47 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Back ENV_GROW more entries of envs[] with memory and put them on the
+// free list, lowest index first.  Called with env_table_lock held.
+// Returns -E_NO_FREE_ENV if the table already holds NENV, or -E_NO_MEM.
+//
+static int
+env_grow(void)
+{
+    uint32_t n = MIN(env_ntable + ENV_GROW, NENV), i;
+    int r;
+    if (env_ntable == NENV)
+        return -E_NO_FREE_ENV;
+    if ((r = envs_grow(n)) < 0)
+        return r;
+    for (i = n; i-- > env_ntable; ) {
+        envs[i].env_id = 0;
+        envs[i].env_status = ENV_FREE;
+        LIST_INSERT_HEAD(&env_free_list, envs + i, env_link);
+    }
+    env_ntable = n;
+    return 0;
+}
+
 //
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Insert in reverse order, so that the first call to env_alloc()
 // returns envs[0].
+// Only the first ENV_GROW get memory now; env_alloc adds more.
 //
 void
 env_init(void)
 {
 	// LAB 3: Your code here.
     int i;
+    static_assert(offsetof(struct Env, env_tf) <= ENV_HOT_SIZE);
     LIST_INIT(&env_free_list);
-    for (i = NENV - 1; i >= 0; i--) {
-        envs[i].env_id = 0;
-        envs[i].env_status = ENV_FREE;
-        LIST_INSERT_HEAD(&env_free_list, envs + i, env_link);
-    }
+    for (i = 0; i < NENV; i++)
+        env_locks[i].name = "env_lock";
+    if (env_grow() < 0)
+        panic("env_init: no memory for envs");
 }
 
 //
@@ -98,8 +229,17 @@ env_setup_vm(struct Env *e)
 	int i, r;
 	struct Page *p = NULL;
 
+	// A freed env's page directory is ready as it is
+	if (env_npool > 0) {
+		p = env_pgdir_pool[--env_npool];
+		e->env_pgdir = page2kva(p);
+		e->env_cr3 = page2pa(p);
+		p->pp_env = e;
+		return 0;
+	}
+
 	// Allocate a page for the page directory
-	if ((r = page_alloc(&p)) < 0)
+	if ((r = page_alloc_zeroed(&p)) < 0)
 		return r;
 
 	// Now, set e->env_pgdir and e->env_cr3,
@@ -121,9 +261,13 @@ env_setup_vm(struct Env *e)
 
     e->env_pgdir = page2kva(p);
     e->env_cr3 = page2pa(p);
-    memmove(e->env_pgdir, boot_pgdir, PGSIZE);
-    memset(e->env_pgdir, 0, PDX(UTOP) * sizeof(pde_t));
-    p->pp_ref += 1;
+    // The page is already zero below UTOP; copy only the kernel part,
+    // whose page tables i386_vm_init made once for every pgdir to share
+    memmove(e->env_pgdir + PDX(UTOP), boot_pgdir + PDX(UTOP),
+        (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+    page_incref(p);
+    // What gets mapped below UTOP from now on counts against e
+    p->pp_env = e;
 
 	// VPT and UVPT map the env's own page table, with
 	// different permissions.
@@ -133,27 +277,56 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+//
+// Keep envs[0] for the idle environment in a kernel built without one,
+// so that the file server still comes out as envs[1].  Call before the
+// first env_create.
+//
+void
+env_reserve_idle(void)
+{
+    assert(LIST_FIRST(&env_free_list) == &envs[0]);
+    LIST_REMOVE(&envs[0], env_link);
+}
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// If 'share' isn't null, the new env is a thread that shares its
+// address space instead of getting a fresh one.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
-//	-E_NO_FREE_ENV if all NENVS environments are allocated
+//	-E_NO_FREE_ENV if all NENV environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
-int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+static int
+env_alloc_share(struct Env **newenv_store, envid_t parent_id, struct Env *share)
 {
 	int32_t generation;
 	int r;
 	struct Env *e;
 
-	if (!(e = LIST_FIRST(&env_free_list)))
-		return -E_NO_FREE_ENV;
+	spin_lock(&env_table_lock);
+	if (!(e = LIST_FIRST(&env_free_list))) {
+		if ((r = env_grow()) < 0) {
+			spin_unlock(&env_table_lock);
+			return r;
+		}
+		e = LIST_FIRST(&env_free_list);
+	}
 
-	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	// Allocate and set up the page directory for this environment,
+	// or take another reference to the one we share.
+	if (share != NULL) {
+		e->env_pgdir = share->env_pgdir;
+		e->env_cr3 = share->env_cr3;
+		page_incref(pa2page(e->env_cr3));
+		e->env_lockx = share->env_lockx;
+	} else if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_table_lock);
 		return r;
+	} else
+		e->env_lockx = e - envs;
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -163,8 +336,20 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
+	e->env_priority = ENV_PRIO_NORMAL;
+	e->env_base_priority = ENV_PRIO_NORMAL;
+	memset(e->env_donors, 0, sizeof(e->env_donors));
+	e->env_callee = 0;
+	e->env_quantum = ENV_QUANTUM(ENV_PRIO_NORMAL);
+	e->env_ticks = 0;
+	e->env_fpu_cpu = -1;
+	e->env_cpunum = -1;
+	e->env_rq_cpu = -1;
+	e->env_affinity = -1;
+	env_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
+	e->env_utime = 0;
+	e->env_stime = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -191,24 +376,118 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
+	e->env_fault_flags = 0;
+	e->env_kfaults = 0;
+	e->env_ufaults = 0;
+	e->env_page_quota = 0;
+	e->env_umc_end = e->env_umc_va = 0;
+	memset(e->env_regions, 0, sizeof(e->env_regions));
+	env_ras[e - envs].rs_n = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_handoff = 0;
+	TAILQ_INIT(&e->env_ipc_senders);
+	e->env_ipc_send_to = 0;
+	e->env_wait_pa = 0;
+	e->env_timer_armed = 0;
+	e->env_cons_waiting = 0;
+	e->env_event = NULL;
+	e->env_grant_npages = 0;
+	memset(e->env_sc_count, 0, sizeof(e->env_sc_count));
+	memset(e->env_sc_cycles, 0, sizeof(e->env_sc_cycles));
+	memset(e->env_pmc, 0, sizeof(e->env_pmc));
+	memset(&envstat[ENVX(e->env_id)], 0, sizeof(struct EnvStat));
 
 	// If this is the file server (e == &envs[1]) give it I/O privileges.
 	// LAB 5: Your code here.
+	// The network server, the env after it, drives the network card.
 
-    if (e == envs + 1)
+    if (e == envs + 1 || e == envs + 2)
         e->env_tf.tf_eflags |= FL_IOPL_3;
 
 	// commit the allocation
 	LIST_REMOVE(e, env_link);
+	spin_unlock(&env_table_lock);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
 
+int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	return env_alloc_share(newenv_store, parent_id, NULL);
+}
+
+//
+// Allocate a thread of 'parent': a child env that runs in parent's
+// address space -- the same page directory, counted in its pp_ref, and
+// the same env lock.  What either maps or unmaps, the other sees.  The
+// address space stays until the last env in it is freed.
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *parent)
+{
+	return env_alloc_share(newenv_store, parent->env_id, parent);
+}
+
+//
+// Is some CPU other than this one running an env in address space
+// 'pgdir'?  It may be reading the space's pages in the kernel.
+//
+bool
+env_pgdir_elsewhere(pde_t *pgdir)
+{
+	struct Env *c;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (i != cpunum() && (c = cpus[i].cpu_env) != NULL && c->env_pgdir == pgdir)
+			return 1;
+	return 0;
+}
+
+//
+// The env that e's address space is accounted to (see pgdir_account):
+// e itself, unless e is a thread, or the env that made it has gone.
+//
+struct Env *
+env_vm_owner(struct Env *e)
+{
+	return pa2page(e->env_cr3)->pp_env;
+}
+
+//
+// e is being freed, but threads still run in its address space: if the
+// space is accounted to e, pass its accounts on to one of them.  Called
+// with env_table_lock and e's lock held.
+//
+static void
+env_vm_handoff(struct Env *e)
+{
+	struct Page *pp = pa2page(e->env_cr3);
+	uint32_t i;
+	struct Env *t;
+
+	if (pp->pp_env != e)
+		return;
+	for (i = 0; i < env_ntable; i++) {
+		t = &envs[i];
+		if (t == e || t->env_status == ENV_FREE || t->env_cr3 != e->env_cr3)
+			continue;
+		t->env_npages = e->env_npages;
+		t->env_nshared = e->env_nshared;
+		t->env_nptpages = e->env_nptpages;
+		t->env_page_quota = e->env_page_quota;
+		pp->pp_env = t;
+		return;
+	}
+	panic("env_vm_handoff: address space shared with nobody");
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -230,7 +509,7 @@ segment_alloc(struct Env *e, void *va, size_t len)
     va = ROUNDDOWN(va, PGSIZE);
     len = ROUNDUP(len, PGSIZE);
     for (i = 0; i < len; i += PGSIZE) {
-        err = page_alloc(&page);
+        err = page_alloc_zeroed(&page);
         if (err) 
             panic("segment_alloc: Allocate physical page failed. \n", err);
         err = page_insert(e->env_pgdir, page, va + i, PTE_U | PTE_W);
@@ -239,6 +518,138 @@ segment_alloc(struct Env *e, void *va, size_t len)
     }
 }
 
+// If 'va' is in one of e's auto-grow regions (see sys_page_autogrow),
+// map a fresh zeroed page there, or the zero page copy-on-write if the
+// fault wasn't a 'write'.  For page_fault_handler, when nothing is mapped
+// at va.
+//
+// Returns 0 on success, < 0 if va isn't in a region or we run out of
+// memory.
+int
+env_autogrow(struct Env *e, uintptr_t va, bool write)
+{
+    struct Env_region *r;
+    struct Page *page;
+    int err;
+    for (r = e->env_regions; r < e->env_regions + ENV_NREGION; r++)
+        if (va >= r->r_start && va < r->r_end)
+            break;
+    if (r == e->env_regions + ENV_NREGION)
+        return -E_INVAL;
+    // A read needs no page of its own yet
+    if (!write) {
+        env_lock(e);
+        err = page_map_zero(e->env_pgdir, (void *)ROUNDDOWN(va, PGSIZE), PTE_U | PTE_W | PTE_P);
+        env_unlock(e);
+        return err;
+    }
+    if ((err = page_alloc_zeroed_at(&page, (void *)va)) < 0)
+        return err;
+    env_lock(e);
+    err = page_insert(e->env_pgdir, page, (void *)ROUNDDOWN(va, PGSIZE), PTE_U | PTE_W | PTE_P);
+    env_unlock(e);
+    if (err < 0)
+        page_free(page);
+    return err;
+}
+
+//
+// Load the loadable segments of the ELF image 'binary', 'size' bytes
+// long, into e's address space, and point e's eip at its entry.  The
+// image must be readable where it is under the current page directory:
+// in the kernel, or in curenv's memory.  Each page is filled through
+// its kernel address, so we never switch to e's page directory.
+//
+// If 'share' is set, the image is one the kernel embeds, starting on a
+// page (see kern/kernel.ld), and will never change.  Then the pages of
+// a read-only segment that come entirely from the file are mapped
+// straight from the image, read-only, rather than copied.
+//
+// Returns 0 on success, < 0 on error; pages already mapped stay mapped
+// for env_free.  Errors are:
+//	-E_NOT_EXEC if the image is not an ELF we can load, or needs the
+//	shared library (a PT_INTERP header).
+//	-E_NO_MEM if we run out of memory.
+//
+int
+env_load_elf(struct Env *e, const uint8_t *binary, size_t size, bool share)
+{
+    const struct Elf *ELFHDR = (const struct Elf *)binary;
+    const struct Proghdr *ph, *eph;
+    struct Page *page, *copy;
+    pte_t *pte;
+    uintptr_t va, end, fileva, fileend;
+    bool shareseg;
+    int err;
+
+    // is this a valid ELF, all inside the image
+    if (size < sizeof(struct Elf) || ELFHDR->e_magic != ELF_MAGIC
+        || ELFHDR->e_phoff > size
+        || ELFHDR->e_phnum > (size - ELFHDR->e_phoff) / sizeof(struct Proghdr))
+        return -E_NOT_EXEC;
+
+    ph = (const struct Proghdr *)(binary + ELFHDR->e_phoff);
+    eph = ph + ELFHDR->e_phnum;
+    for (; ph < eph; ph++) {
+        // Only spawn() loads the shared library a program needs
+        if (ph->p_type == ELF_PROG_INTERP)
+            return -E_NOT_EXEC;
+        if (ph->p_type != ELF_PROG_LOAD)
+            continue;
+        if (ph->p_filesz > ph->p_memsz
+            || ph->p_offset > size || ph->p_filesz > size - ph->p_offset
+            || ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va)
+            return -E_NOT_EXEC;
+        // The file part is copied into fresh zeroed pages, which
+        // leaves the bss cleared, and pages of bss alone get the zero
+        // page, copy-on-write.  A page two segments share is
+        // filled twice; if the first mapped it from the image, the
+        // second gets a private copy of it first.
+        fileva = ph->p_va;
+        fileend = ph->p_va + ph->p_filesz;
+        end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+        shareseg = share && !(ph->p_flags & ELF_PROG_FLAG_WRITE)
+            && PGOFF(binary + ph->p_offset) == PGOFF(ph->p_va);
+        for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < end; va += PGSIZE) {
+            page = page_lookup(e->env_pgdir, (void *)va, &pte);
+            if (page == NULL && shareseg && MIN(va + PGSIZE, ph->p_va + ph->p_memsz) <= fileend) {
+                page = pa2page(PADDR((void *)(binary + ph->p_offset - (ph->p_va - va))));
+                if ((err = page_insert(e->env_pgdir, page, (void *)va, PTE_U)) < 0)
+                    return err;
+                continue;
+            }
+            if (page != NULL && !(*pte & PTE_W)) {
+                if ((err = page_alloc(&copy)) < 0)
+                    return err;
+                page_copy(page2kva(copy), page2kva(page));
+                if ((err = page_insert(e->env_pgdir, copy, (void *)va, PTE_U | PTE_W)) < 0) {
+                    page_free(copy);
+                    return err;
+                }
+                page = copy;
+            } else if (page == NULL && (va >= fileend || va + PGSIZE <= fileva)) {
+                // All bss: zeros until it's written
+                if ((err = page_map_zero(e->env_pgdir, (void *)va, PTE_U | PTE_W)) < 0)
+                    return err;
+                continue;
+            } else if (page == NULL) {
+                if ((err = page_alloc_zeroed(&page)) < 0)
+                    return err;
+                if ((err = page_insert(e->env_pgdir, page, (void *)va, PTE_U | PTE_W)) < 0) {
+                    page_free(page);
+                    return err;
+                }
+            }
+            if (va + PGSIZE > fileva && va < fileend)
+                memmove(page2kva(page) + PGOFF(MAX(va, fileva)),
+                        binary + ph->p_offset + (MAX(va, fileva) - ph->p_va),
+                        MIN(va + PGSIZE, fileend) - MAX(va, fileva));
+        }
+    }
+    e->env_tf.tf_eip = ELFHDR->e_entry;
+    return 0;
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -295,28 +706,9 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 
 	// LAB 3: Your code here.
 
-    struct Elf *ELFHDR = (struct Elf *)binary;
-    struct Proghdr *ph, *eph;
-
-    // is this a valid ELF
-    if (ELFHDR->e_magic != ELF_MAGIC)
-        panic("load_icode: Give binary is not a valid ELF.\n");
-
-	// load each program segment (ignores ph flags)
-    ph = (struct Proghdr *)((uint8_t *) ELFHDR + ELFHDR->e_phoff);
-    eph = ph + ELFHDR->e_phnum;
-    // switch to user address space
-    lcr3(e->env_cr3);
-    for (; ph < eph; ph++) {
-        if (ph->p_type == ELF_PROG_LOAD) {
-            segment_alloc(e, (void *)ph->p_va, ph->p_memsz);
-            memset((void *)ph->p_va, 0, ph->p_memsz);
-            memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-        }
-    }
-    // switch to kern address space
-    lcr3(boot_cr3);
-    e->env_tf.tf_eip = ELFHDR->e_entry;
+    int err;
+    if ((err = env_load_elf(e, binary, size, 1)) < 0)
+        panic("load_icode: %e", err);
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
 
@@ -347,57 +739,409 @@ env_create(uint8_t *binary, size_t size)
     load_icode(env, binary, size);
 }
 
+//
+// Take down user page table 'pdeno' of a dead address space, dropping
+// the pages straight from the table rather than page_remove'ing them
+// one at a time: no CPU is running in the space, so no TLB entry needs
+// flushing.
+//
+static void
+env_free_pt(pde_t *pgdir, uint32_t pdeno)
+{
+	pte_t *pt;
+	uint32_t pteno;
+	physaddr_t pa;
+
+	if (PDE_SUPER(pgdir[pdeno])) {
+		page_super_put(pgdir, PGADDR(pdeno, 0, 0));
+		return;
+	}
+	if (PDE_SHARED(pgdir[pdeno])) {
+		pgdir_pt_leave(pgdir, PGADDR(pdeno, 0, 0));
+		return;
+	}
+
+	// find the pa and va of the page table
+	pa = PTE_ADDR(pgdir[pdeno]);
+	pt = (pte_t*) KADDR(pa);
+
+	// unmap all PTEs in this page table, clearing them as we go
+	for (pteno = 0; pteno <= PTX(~0); pteno++) {
+		if (pt[pteno] == 0)
+			continue;
+		if (pt[pteno] & PTE_P) {
+			page_rmap_remove(pa2page(PTE_ADDR(pt[pteno])),
+					 pgdir, PGADDR(pdeno, pteno, 0));
+			page_decref(pa2page(PTE_ADDR(pt[pteno])));
+		}
+		else if (PTE_SWAPPED(pt[pteno]))
+			swap_free(pt[pteno]);
+		pt[pteno] = 0;
+	}
+
+	// free the page table itself, which, empty, can go to
+	// pgdir_walk as it is
+	pgdir[pdeno] = 0;
+	page_table_decref(pa2page(pa));
+}
+
 //
 // Frees env e and all memory it uses.
 // 
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	uint32_t pdeno;
+	bool shared, pooled = 0;
+	struct Env_reclaim *er = NULL;
+	struct Page *pp;
 	
-	// If freeing the current environment, switch to boot_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
-		lcr3(boot_cr3);
+	// Nobody may be left waiting to send to us, nor we to anyone
+	ipc_cancel(e);
+
+	// Keep envid lookups from finding us half freed, then wait out
+	// anyone changing our address space without the kernel lock.  We
+	// may stop for other envs partway through (kstack_preempt); so that
+	// the scheduler doesn't run e meanwhile, unless it's us, it's dying.
+	spin_lock(&env_table_lock);
+	e->env_doomed = 1;
+	if (e != curenv)
+		env_set_status(e, ENV_DYING);
+	env_lock(e);
+	spin_unlock(&env_table_lock);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// If threads still run in the address space, it stays as it is,
+	// and only our reference to the page directory goes.
+	shared = pa2page(e->env_cr3)->pp_ref > 1;
+	if (shared)
+		env_vm_handoff(e);
+
+	// Otherwise flush all mapped pages in the user portion of the
+	// address space: no CPU is running in it (a running env is left
+	// ENV_DYING until it stops, and we left it above if it's ours).
+	// A big one, on SMP, is left to idle CPUs (env_reclaim_idle).
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	if (!shared && ncpu > 1 && e->env_npages >= ENV_RECLAIM_MIN)
+		er = env_reclaim_reserve();
+	for (pdeno = 0; !shared && !er && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
+		env_free_pt(e->env_pgdir, pdeno);
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+		// Between page tables, let in the interrupts and envs that
+		// a big address space would keep waiting
+		if (kstack_preempt_due()) {
+			env_unlock(e);
+			kstack_preempt();
+			env_lock(e);
 		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
 	}
 
-	// free the page directory
-	pa = e->env_cr3;
+	e->env_npages = e->env_nshared = e->env_nptpages = 0;
+	fpu_free(e);
+	kstack_free(e);
+
+	// If freeing the current environment, switch to boot_pgdir
+	// before freeing the page directory, just in case the page
+	// gets reused.
+	if (e == curenv)
+		lcr3(boot_cr3);
+
+	pp = pa2page(e->env_cr3);
 	e->env_pgdir = 0;
 	e->env_cr3 = 0;
-	page_decref(pa2page(pa));
+	env_unlock(e);
 
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	// Return the environment to the free list.  Free the page
+	// directory, or, if we had it to ourselves, keep it for the next
+	// env: every user PDE is clear again.  Or queue it, a
+	// page directory of nobody's, for an idle CPU to clear.
+	spin_lock(&env_table_lock);
+	if (er != NULL) {
+		pp->pp_env = NULL;
+		spin_lock(&env_reclaim_lock);
+		er->er_pgdir = pp;
+		er->er_pdeno = 0;
+		er->er_busy = 0;
+		spin_unlock(&env_reclaim_lock);
+	}
+	else if ((pooled = !shared && pp->pp_ref == 1 && env_npool < ENV_POOL)) {
+		pp->pp_env = NULL;
+		env_pgdir_pool[env_npool++] = pp;
+	}
+	env_set_status(e, ENV_FREE);
+	e->env_doomed = 0;
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
+	spin_unlock(&env_table_lock);
+	if (!pooled && er == NULL)
+		page_decref(pp);
+}
+
+//
+// A free env_reclaim[] entry for env_free to fill, or NULL if there's
+// none.
+//
+static struct Env_reclaim *
+env_reclaim_reserve(void)
+{
+	struct Env_reclaim *er;
+
+	spin_lock(&env_reclaim_lock);
+	for (er = env_reclaim; er < env_reclaim + ENV_RECLAIM_MAX; er++)
+		if (er->er_pgdir == NULL && !er->er_busy) {
+			er->er_busy = 1;
+			env_nreclaim++;
+			break;
+		}
+	spin_unlock(&env_reclaim_lock);
+	return er < env_reclaim + ENV_RECLAIM_MAX ? er : NULL;
+}
+
+//
+// Claim a dead address space no other CPU is taking down, or NULL.
+//
+static struct Env_reclaim *
+env_reclaim_claim(void)
+{
+	struct Env_reclaim *er;
+
+	if (env_nreclaim == 0)
+		return NULL;
+	spin_lock(&env_reclaim_lock);
+	for (er = env_reclaim; er < env_reclaim + ENV_RECLAIM_MAX; er++)
+		if (er->er_pgdir != NULL && !er->er_busy) {
+			er->er_busy = 1;
+			break;
+		}
+	spin_unlock(&env_reclaim_lock);
+	return er < env_reclaim + ENV_RECLAIM_MAX ? er : NULL;
+}
+
+//
+// Take down up to 'n' more page tables of er, which we've claimed,
+// freeing the pages into this CPU's magazine, and give it back.  A page
+// directory left clear goes to the pool, as env_free's own do, if
+// 'pool'; otherwise it's freed.
+//
+static void
+env_reclaim_run(struct Env_reclaim *er, int n, bool pool)
+{
+	pde_t *pgdir = page2kva(er->er_pgdir);
+	struct Page *pp;
+	bool pooled = 0;
+
+	for (; n > 0 && er->er_pdeno < PDX(UTOP); er->er_pdeno++)
+		if (pgdir[er->er_pdeno] & PTE_P) {
+			env_free_pt(pgdir, er->er_pdeno);
+			n--;
+		}
+	spin_lock(&env_reclaim_lock);
+	pp = er->er_pdeno < PDX(UTOP) ? NULL : er->er_pgdir;
+	if (pp != NULL) {
+		er->er_pgdir = NULL;
+		env_nreclaim--;
+	}
+	er->er_busy = 0;
+	spin_unlock(&env_reclaim_lock);
+	if (pp == NULL)
+		return;
+
+	if (pool) {
+		spin_lock(&env_table_lock);
+		if ((pooled = env_npool < ENV_POOL))
+			env_pgdir_pool[env_npool++] = pp;
+		spin_unlock(&env_table_lock);
+	}
+	if (!pooled)
+		page_decref(pp);
+}
+
+//
+// Take down up to 'n' more page tables of the dead address spaces
+// env_free left.  Called from the scheduler's idle path.  Returns whether
+// there may be more for this CPU to do.
+//
+bool
+env_reclaim_idle(int n)
+{
+	struct Env_reclaim *er;
+
+	if ((er = env_reclaim_claim()) == NULL)
+		return 0;
+	env_reclaim_run(er, n, 1);
+	return env_nreclaim > 0;
+}
+
+//
+// Finish taking down every dead address space no other CPU has in hand,
+// page directories and all.  Called by page_alloc when it runs out,
+// before it pages out live envs; it may hold any locks but
+// env_reclaim_lock and those after it (see kern/spinlock.h).  Returns
+// how many address spaces it freed.
+//
+int
+env_reclaim_all(void)
+{
+	struct Env_reclaim *er;
+	int n = 0;
+
+	while ((er = env_reclaim_claim()) != NULL) {
+		env_reclaim_run(er, NPDENTRIES, 0);
+		n++;
+	}
+	return n;
+}
+
+//
+// Change e's status, keeping the scheduler's run queue in step with it.
+// After env_init, every change to env_status must go through here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+    spin_lock(&sched_lock);
+    if (e->env_status == ENV_FREE && status != ENV_FREE)
+        env_nlive++;
+    else if (e->env_status != ENV_FREE && status == ENV_FREE)
+        env_nlive--;
+    if (e->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+        sched_dequeue(e);
+    else if (e->env_status != ENV_RUNNABLE && status == ENV_RUNNABLE)
+        sched_enqueue(e);
+    e->env_status = status;
+    spin_unlock(&sched_lock);
+}
+
+// Put e in class 'priority' for now, which also sets its time slice.
+static void
+env_prio_run(struct Env *e, int priority)
+{
+    spin_lock(&sched_lock);
+    if (e->env_status == ENV_RUNNABLE)
+        sched_dequeue(e);
+    e->env_priority = priority;
+    e->env_quantum = ENV_QUANTUM(priority);
+    if (e->env_ticks > e->env_quantum)
+        e->env_ticks = e->env_quantum;
+    if (e->env_status == ENV_RUNNABLE)
+        sched_enqueue(e);
+    spin_unlock(&sched_lock);
+}
+
+// Calls to the same server nest this deep at most, as far as donation
+// goes; a cycle of calls can't starve the kernel
+#define ENV_DONATE_DEPTH	8
+
+//
+// Priority donation.  A client blocked in sys_ipc_call lends the server
+// its class until the server answers: a high-class env waiting on a
+// server that the low class keeps busy doesn't wait behind everything
+// in between.  e runs in the highest class of its own and its waiting
+// callers', and a server that is itself calling another passes what it
+// has on down the chain.  (The rest of the caller's time slice already
+// goes along when sys_ipc_recv hands the CPU straight to the server.)
+//
+// Bring e's class up to date, and that of the servers it waits on.
+//
+static void
+env_prio_update(struct Env *e)
+{
+    struct Env *s;
+    int prio, depth;
+    for (depth = 0; depth < ENV_DONATE_DEPTH; depth++) {
+        for (prio = 0; prio < e->env_base_priority && e->env_donors[prio] == 0; prio++)
+            ;
+        if (prio == e->env_priority)
+            return;
+        env_prio_run(e, prio);
+        if (e->env_callee == 0)
+            return;
+        if (envid2env(e->env_callee, &s, 0) < 0) {
+            e->env_callee = 0;
+            return;
+        }
+        s->env_donors[e->env_donated]--;
+        s->env_donors[prio]++;
+        e->env_donated = prio;
+        e = s;
+    }
+}
+
+//
+// Move e to scheduling class 'priority' (one of ENV_PRIO_*), which also
+// sets its time slice.  Callers waiting on e may still raise it.
+//
+void
+env_set_priority(struct Env *e, int priority)
+{
+    e->env_base_priority = priority;
+    env_prio_update(e);
+}
+
+// 'caller' waits for 'server' to answer its call.
+void
+env_donate(struct Env *caller, struct Env *server)
+{
+    if (server == caller)
+        return;
+    env_undonate(caller);
+    caller->env_callee = server->env_id;
+    caller->env_donated = caller->env_priority;
+    server->env_donors[caller->env_priority]++;
+    env_prio_update(server);
+}
+
+// 'caller' has its answer, or has stopped waiting for it.
+void
+env_undonate(struct Env *caller)
+{
+    struct Env *s;
+    envid_t id = caller->env_callee;
+    if (id == 0)
+        return;
+    caller->env_callee = 0;
+    if (envid2env(id, &s, 0) == 0) {
+        s->env_donors[caller->env_donated]--;
+        env_prio_update(s);
+    }
+}
+
+//
+// Pin e to CPU 'cpu', or let it run anywhere if cpu is -1.  A pinned env
+// moves to its CPU's run queue, and other CPUs don't steal it.
+//
+void
+env_set_affinity(struct Env *e, int cpu)
+{
+    spin_lock(&sched_lock);
+    if (e->env_status == ENV_RUNNABLE)
+        sched_dequeue(e);
+    e->env_affinity = cpu;
+    if (e->env_status == ENV_RUNNABLE)
+        sched_enqueue(e);
+    spin_unlock(&sched_lock);
+}
+
+//
+// e, interrupted at tf, may lose the CPU: if it was inside one of its
+// restartable atomic sequences, start the sequence over, so that it
+// never finishes with what it read before someone else ran.
+//
+void
+env_ras_restart(struct Env *e, struct Trapframe *tf)
+{
+    struct Env_rasset *rs = &env_ras[e - envs];
+    uint32_t i;
+    for (i = 0; i < rs->rs_n; i++)
+        if (tf->tf_eip > rs->rs_ras[i].ras_start && tf->tf_eip < rs->rs_ras[i].ras_end) {
+            tf->tf_eip = rs->rs_ras[i].ras_start;
+            return;
+        }
 }
 
 //
@@ -408,6 +1152,24 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e) 
 {
+	// If e is running on another CPU, that CPU has its address space
+	// loaded and its trap frame in hand, so it can't be freed from
+	// here.  Mark it dying instead: its CPU frees it the next time it
+	// traps into the kernel.
+	if (e->env_cpunum >= 0 && e != curenv) {
+		env_set_status(e, ENV_DYING);
+		return;
+	}
+
+	// If e stopped partway through something in the kernel, it
+	// finishes that first, and then frees itself (kstack_run).  Lookups
+	// don't find it meanwhile.
+	if (e->env_kesp != 0 && e != curenv) {
+		e->env_doomed = 1;
+		kstack_wake(e);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -417,6 +1179,41 @@ env_destroy(struct Env *e)
 }
 
 
+//
+// CPU time.  Each CPU notes in cpu_tsc when it last charged time to an
+// env.  A trap from user mode charges curenv's user time since then,
+// the way back to user mode its kernel time, and a switch charges the
+// kernel time up to it to the env switched away from.  The time a CPU
+// spends halted goes to nobody.
+//
+static uint64_t
+env_charge_cycles(void)
+{
+	struct Cpu *c = thiscpu;
+	uint64_t now = read_tsc(), d = now - c->cpu_tsc;
+
+	c->cpu_tsc = now;
+	return d;
+}
+
+void
+env_charge_user(struct Env *e)
+{
+	uint64_t d = env_charge_cycles();
+
+	if (e)
+		e->env_utime += d;
+}
+
+void
+env_charge_kernel(struct Env *e)
+{
+	uint64_t d = env_charge_cycles();
+
+	if (e)
+		e->env_stime += d;
+}
+
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -425,6 +1222,9 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
+	cpu_ioff_end();
+	env_charge_kernel(curenv);
+	tlb_to_user();
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -435,6 +1235,32 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// Return to the user environment whose frame tf is, as env_pop_tf does,
+// but by sysexit, for one that entered the kernel by sysenter.  sysexit
+// takes eip from %edx and esp from %ecx, so the stub in lib/syscall.c
+// doesn't expect those back, and it doesn't restore eflags: only IF
+// needs setting, and sti holds interrupts off until the instruction
+// after it, by which time we're in user mode.
+//
+void
+env_sysexit(struct Trapframe *tf)
+{
+	cpu_ioff_end();
+	env_charge_kernel(curenv);
+	tlb_to_user();
+	__asm __volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\tmovl 0x8(%%esp),%%edx\n"	/* tf_eip, past tf_trapno and tf_err */
+		"\tmovl 0x14(%%esp),%%ecx\n"	/* tf_esp */
+		"\tsti\n"
+		"\tsysexit"
+		: : "g" (tf) : "memory");
+	panic("sysexit failed");  /* mostly to placate the compiler */
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
@@ -459,10 +1285,31 @@ env_run(struct Env *e)
 	// LAB 3: Your code here.
 
     if (curenv != e) {
+        trace(TRACE_SWITCH, e->env_id, 0);
+        // The outgoing env's FPU registers go with it, before another
+        // CPU can pick it up
+        fpu_save();
+        pmc_save(curenv);
+        env_charge_kernel(curenv);
+        // Only one CPU runs an env at a time; sched_resched skips
+        // those whose env_cpunum is another's
+        if (curenv != NULL)
+            curenv->env_cpunum = -1;
         curenv = e;
+        curenv->env_cpunum = cpunum();
+        fpu_load(curenv);
+        pmc_load();
         curenv->env_runs += 1;
         lcr3(curenv->env_cr3);
+        tlb_cr3_loads++;
+        // The next trap from user mode pushes its frame straight
+        // into env_tf
+        thiscpu->cpu_ts.ts_esp0 = (uintptr_t)(&curenv->env_tf + 1);
     }
-    env_pop_tf(&curenv->env_tf);
+    // An env that blocked in the kernel carries on there, with the
+    // kernel lock we hold
+    kstack_resume(e);
+    unlock_kernel();
+    env_pop_tf(&e->env_tf);
 }
 
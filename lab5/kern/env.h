@@ -4,6 +4,9 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <inc/envstat.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #ifndef JOS_MULTIENV
 // Change this value to 1 once you're allowing multiple environments
@@ -11,21 +14,105 @@
 #define JOS_MULTIENV 0
 #endif
 
+#ifndef ENV_POOL
+// Page directories env_free keeps for env_alloc to reuse (kern/env.c)
+#define ENV_POOL 16
+#endif
+
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;	        // Current environment
+extern struct EnvStat *envstat;		// Their counts, mapped at UENVSTAT
+extern uint32_t env_ntable;		// envs[] entries backed by memory
+extern uint32_t env_nlive;		// envs[] entries not ENV_FREE
+#define curenv (thiscpu->cpu_env)		// Current environment
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
 
+extern struct spinlock env_table_lock;
+
+// An env's restartable atomic sequences (sys_env_set_ras), which don't
+// fit in struct Env
+struct Env_rasset {
+	uint32_t rs_n;
+	struct Env_ras rs_ras[ENV_NRAS];
+};
+extern struct Env_rasset env_ras[];
+extern struct spinlock env_locks[];
+
+// An env's lock guards its address space against the system calls that
+// change address spaces without the kernel lock.  Threads sharing an
+// address space share its lock, env_locks[env_lockx].  Take two in
+// env_locks[] order, with env_lock2, so two CPUs can't deadlock.
+static inline void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e->env_lockx]);
+}
+
+static inline int
+env_trylock(struct Env *e)
+{
+	return spin_trylock(&env_locks[e->env_lockx]);
+}
+
+static inline void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e->env_lockx]);
+}
+
+static inline void
+env_lock2(struct Env *e1, struct Env *e2)
+{
+	if (e1->env_lockx > e2->env_lockx) {
+		struct Env *t = e1;
+		e1 = e2;
+		e2 = t;
+	}
+	env_lock(e1);
+	if (e2->env_lockx != e1->env_lockx)
+		env_lock(e2);
+}
+
+static inline void
+env_unlock2(struct Env *e1, struct Env *e2)
+{
+	env_unlock(e1);
+	if (e2->env_lockx != e1->env_lockx)
+		env_unlock(e2);
+}
+
 void	env_init(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_thread(struct Env **e, struct Env *parent);
+struct Env *env_vm_owner(struct Env *e);
+bool	env_pgdir_elsewhere(pde_t *pgdir);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, size_t size);
+void	env_reserve_idle(void);
+bool	env_reclaim_idle(int n);
+int	env_reclaim_all(void);
+int	env_autogrow(struct Env *e, uintptr_t va, bool write);
+int	env_load_elf(struct Env *e, const uint8_t *binary, size_t size, bool share);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+void	env_set_priority(struct Env *e, int priority);
+void	env_donate(struct Env *caller, struct Env *server);
+void	env_undonate(struct Env *caller);
+void	env_set_affinity(struct Env *e, int cpu);
+void	env_ras_restart(struct Env *e, struct Trapframe *tf);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock2(envid_t envid1, struct Env **env_store1,
+			envid_t envid2, struct Env **env_store2, bool checkperm);
+// Charge the cycles since this CPU last charged any to e's user or
+// kernel time; e may be NULL, to charge nobody
+void	env_charge_user(struct Env *e);
+void	env_charge_kernel(struct Env *e);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
+void	env_sysexit(struct Trapframe *tf) __attribute__((noreturn));
 
 // For the grading script
 #define ENV_CREATE2(start, size)	{		\
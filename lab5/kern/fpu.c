@@ -0,0 +1,124 @@
+// Lazy FPU and SSE switching.
+//
+// Envs start out not owning the FPU: with CR0.TS set, the first FPU or
+// SSE instruction an env runs traps (#NM), and only then does fpu_trap
+// load its registers -- fresh ones, the first time, with an Fpu_state
+// allocated to save them in.  On a switch to another env, fpu_save
+// saves the registers if CR0.TS is clear, that is, only if the env used
+// the FPU since it came in; envs that never touch it cost nothing.
+//
+// A saved env may be moved to another CPU, so every switch saves.  But
+// fxsave leaves the registers loaded, so if the env comes back to the
+// same CPU with nobody else's state loaded there in between (a CPU's
+// cpu_fpu_env and the env's env_fpu_cpu still name each other),
+// fpu_load clears CR0.TS at once and there's neither a trap nor a
+// reload.
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/fpu.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/slab.h>
+
+static bool fpu_fxsr;		// fxsave rather than fnsave
+
+static void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static void
+stts(void)
+{
+	lcr0(rcr0() | CR0_TS);
+}
+
+void
+fpu_init(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & CPUID_FEAT_FXSR) != 0;
+	if (fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	// Native FPU errors; wait and FPU instructions trap while TS is set
+	lcr0((rcr0() | CR0_MP | CR0_NE | CR0_TS) & ~CR0_EM);
+}
+
+void
+fpu_trap(struct Trapframe *tf)
+{
+	struct Cpu *c = thiscpu;
+	struct Env *e = curenv;
+	uint32_t mxcsr = 0x1F80;	// all SIMD exceptions masked
+
+	if ((tf->tf_cs & 3) == 0)
+		panic("FPU used in the kernel");
+	if (e->env_fpu == NULL && (e->env_fpu = kmalloc(sizeof(struct Fpu_state))) == NULL) {
+		cprintf("[%08x] no memory for FPU state\n", e->env_id);
+		env_destroy(e);
+		return;
+	}
+	clts();
+	if (c->cpu_fpu_env == e && e->env_fpu_cpu == cpunum())
+		return;
+	if (e->env_fpu_cpu < 0) {
+		// First use
+		asm volatile("fninit");
+		if (fpu_fxsr)
+			asm volatile("ldmxcsr %0" :: "m" (mxcsr));
+	} else if (fpu_fxsr)
+		asm volatile("fxrstor %0" :: "m" (*e->env_fpu));
+	else
+		asm volatile("frstor %0" :: "m" (*e->env_fpu));
+	c->cpu_fpu_env = e;
+	e->env_fpu_cpu = cpunum();
+}
+
+void
+fpu_save(void)
+{
+	struct Cpu *c = thiscpu;
+
+	if (rcr0() & CR0_TS)
+		return;
+	assert(c->cpu_fpu_env && c->cpu_fpu_env->env_fpu);
+	if (fpu_fxsr)
+		asm volatile("fxsave %0" : "=m" (*c->cpu_fpu_env->env_fpu));
+	else {
+		// fnsave reinitializes the FPU: nothing is left loaded
+		asm volatile("fnsave %0; fwait" : "=m" (*c->cpu_fpu_env->env_fpu));
+		c->cpu_fpu_env = NULL;
+	}
+	stts();
+}
+
+void
+fpu_load(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_env == e && e->env_fpu_cpu == cpunum())
+		clts();
+}
+
+void
+fpu_free(struct Env *e)
+{
+	struct Cpu *c = thiscpu;
+
+	if (c->cpu_fpu_env == e) {
+		c->cpu_fpu_env = NULL;
+		stts();
+	}
+	// Other CPUs' cpu_fpu_env may still point here, but env_alloc
+	// resets env_fpu_cpu, so they won't match whoever comes next
+	e->env_fpu_cpu = -1;
+	kfree(e->env_fpu);
+	e->env_fpu = NULL;
+}
@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+struct Trapframe;
+
+// An fxsave image (or, on a CPU without it, an fnsave one)
+struct Fpu_state {
+	uint8_t fs_regs[512];
+} __attribute__((aligned(16)));
+
+// Enable the FPU and SSE on this CPU, with CR0.TS set.  The APs take
+// the control registers up from the BSP's.
+void fpu_init(void);
+// #NM: curenv wants the FPU.
+void fpu_trap(struct Trapframe *tf);
+// Save the registers of the env that used the FPU since it was last
+// switched to, if any, and set CR0.TS again.  Call before curenv
+// changes or this CPU stops running it.
+void fpu_save(void);
+// CR0.TS for running e on this CPU: clear if its registers are the
+// ones already loaded.
+void fpu_load(struct Env *e);
+// e is being freed.
+void fpu_free(struct Env *e);
+
+#endif	// !JOS_KERN_FPU_H
@@ -3,6 +3,7 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
@@ -11,52 +12,156 @@
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/slab.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/swap.h>
+#include <kern/pci.h>
+#include <kern/ktimer.h>
+#include <kern/klog.h>
+#include <kern/selftest.h>
 
+static void boot_aps(void);
+
+// How long each part of i386_init took: boot_phase(name) marks the end
+// of the part called name, and boot_report prints them all.
+#define NBOOTPHASE	24
+
+static struct {
+	const char *bp_name;
+	uint64_t bp_tsc;
+} boot_phases[NBOOTPHASE];
+static int nboot_phases;
+static uint64_t boot_tsc;	// rdtsc as i386_init started
+
+static void
+boot_phase(const char *name)
+{
+	if (nboot_phases < NBOOTPHASE) {
+		boot_phases[nboot_phases].bp_name = name;
+		boot_phases[nboot_phases].bp_tsc = read_tsc();
+		nboot_phases++;
+	}
+}
+
+static void
+boot_report(void)
+{
+	uint64_t last = boot_tsc, total;
+	int i;
+
+	total = boot_phases[nboot_phases - 1].bp_tsc - boot_tsc;
+	cprintf("boot: %llu cycles to i386_init, %llu in it%s\n", boot_tsc, total,
+		SELFTEST ? " (with self-checks)" : "");
+	for (i = 0; i < nboot_phases; i++) {
+		cprintf("boot:   %-18s %12llu cycles %3llu%%\n", boot_phases[i].bp_name,
+			boot_phases[i].bp_tsc - last,
+			total ? (boot_phases[i].bp_tsc - last) * 100 / total : 0);
+		last = boot_phases[i].bp_tsc;
+	}
+}
 
 void
 i386_init(void)
 {
 	extern char edata[], end[];
+	uint64_t start = read_tsc();
 
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
+	boot_tsc = start;
 
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
+	boot_phase("cons_init");
 
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
+	boot_phase("i386_detect_memory");
 	i386_vm_init();
+	boot_phase("i386_vm_init");
+	kmem_init();
+	rmap_init();
+	boot_phase("kmem_init");
+	if (SELFTEST) {
+		selftest_run(NULL);
+		boot_phase("selftest");
+	}
+	fpu_init();
+	pmc_init();
+	swap_init();
+	boot_phase("fpu, pmc, swap");
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
+	addr_wait_init();
+	boot_phase("env_init");
 	idt_init();
+	boot_phase("idt_init");
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
+	boot_phase("pic_init");
 	kclock_init();
+	boot_phase("kclock_init");
 
-	// Should always have an idle process as first one.
+	// Multiprocessor initialization functions.  lapic_init times the
+	// LAPIC timer against the TSC, which kclock_init timed against the
+	// 8253, and then the BSP can tick by it.
+	mp_init();
+	lapic_init();
+	kclock_cpu_init();
+	kinfo->ki_ncpu = ncpu;
+	boot_phase("mp_init, lapic_init");
+
+	// Lab 6 hardware initialization functions
+	pci_init();
+	boot_phase("pci_init");
+
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	boot_aps();
+	boot_phase("boot_aps");
+
+	// The kernel halts the CPU itself when there is nothing to run.
+	// Build with IDLE_MONITOR to have an idle process as the first one
+	// instead, which breaks into the monitor; the grading script's
+	// test runs rely on that to know when a test is done.
+#if defined(TEST) || defined(IDLE_MONITOR)
 	ENV_CREATE(user_idle);
+#else
+	env_reserve_idle();
+#endif
 
 	// Start fs.
     ENV_CREATE(fs_fs);
 
+	// Start the network server, envs[NS_ENVX]
+	ENV_CREATE(net_ns);
+
 	// Start init
 #if defined(TEST)
 	// Don't touch -- used by grading script!
 	ENV_CREATE2(TEST, TESTSIZE);
 #else
-	// Touch all you want.
-	// ENV_CREATE(user_writemotd);
-    // ENV_CREATE(user_testfsipc);
+	// Touch all you want.  Only what kern/Makefrag embeds can be
+	// started here; icode spawns everything else, starting with /init,
+	// from the file system.
     ENV_CREATE(user_icode);
 #endif
-
+	boot_phase("ENV_CREATE");
+	boot_report();
+	klog_start();
 
 	// Schedule and run the first user environment!
 	sched_yield();
@@ -64,6 +169,78 @@ i386_init(void)
 
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable, and the control registers to turn paging on with in
+// the others.
+void *mpentry_kstack;
+uint32_t mpentry_cr0, mpentry_cr3, mpentry_cr4;
+
+// The BSP's CR4, which the APs take up once they run at KERNBASE
+static uint32_t boot_cr4;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct Cpu *c;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// The APs turn paging on running at MPENTRY_PADDR, so until they
+	// are past that, map the low 4MB as at KERNBASE, like entry.S's
+	// entry_pgdir does.  The alias shares the global KERNBASE entries, so
+	// the APs leave CR4_PGE off until mp_main, which flushes it away.
+	boot_cr4 = rcr4();
+	mpentry_cr0 = rcr0();
+	mpentry_cr3 = boot_cr3;
+	mpentry_cr4 = boot_cr4 & ~CR4_PGE;
+	boot_pgdir[0] = boot_pgdir[PDX(KERNBASE)];
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use 
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+
+	boot_pgdir[0] = 0;
+	lcr3(boot_cr3);
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// Now at KERNBASE: turn on CR4_PGE, which also flushes the TLB,
+	// and leave mpentry.S's GDT for the kernel's
+	lcr4(boot_cr4);
+	gdt_load();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	kclock_cpu_init();
+	trap_init_percpu();
+	pmc_init();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Take the kernel lock for the scheduler, which runs envs on this
+	// CPU as on the BSP
+	lock_kernel();
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -83,6 +260,8 @@ _panic(const char *file, int line, const char *fmt,...)
 	if (panicstr)
 		goto dead;
 	panicstr = fmt;
+	klog_sync();
+	cons_sync();
 
 	va_start(ap, fmt);
 	cprintf("kernel panic at %s:%d: ", file, line);
@@ -0,0 +1,161 @@
+// IPC traffic between pairs of envs, and each env's share of it in its
+// struct EnvStat.
+//
+// For each (sender, receiver) pair that has talked, ipcstat_pairs counts
+// the messages and pages that went through, the sys_ipc_try_sends that
+// found the receiver not receiving, and the cycles each side spent
+// blocked: the receiver in sys_ipc_recv until this sender's message
+// came, and the sender in the receiver's send queue.  A client spinning
+// on sys_ipc_try_send against a busy server shows up as retries far
+// beyond its sends.
+//
+// Pairs are kept by envid in an open-addressed table; once it's full,
+// new pairs are only counted as lost.  Everything here runs under the
+// kernel lock with the IPC system calls.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/env.h>
+
+#include <kern/ipcstat.h>
+#include <kern/env.h>
+#include <kern/ktimer.h>
+
+#define IPCSTAT_NPAIR	512	// pairs tracked; a power of two
+
+struct IpcPair {
+	envid_t ip_src;		// 0 if the slot is free
+	envid_t ip_dst;
+	uint32_t ip_sends;
+	uint32_t ip_pages;
+	uint32_t ip_retries;
+	uint64_t ip_recv_wait;	// cycles dst waited for src's messages
+	uint64_t ip_send_wait;	// cycles src waited in dst's send queue
+};
+
+static struct IpcPair ipcstat_pairs[IPCSTAT_NPAIR];
+static uint32_t ipcstat_lost;
+// When each env, by ENVX, started waiting to receive or send, or 0
+static uint64_t ipcstat_since[NENV];
+
+static struct IpcPair *
+ipcstat_pair(envid_t src, envid_t dst)
+{
+	uint32_t h, i;
+	struct IpcPair *ip;
+
+	h = (src * 2654435761U) ^ dst;
+	for (i = 0; i < IPCSTAT_NPAIR; i++) {
+		ip = &ipcstat_pairs[(h + i) & (IPCSTAT_NPAIR - 1)];
+		if (ip->ip_src == src && ip->ip_dst == dst)
+			return ip;
+		if (ip->ip_src == 0) {
+			ip->ip_src = src;
+			ip->ip_dst = dst;
+			return ip;
+		}
+	}
+	ipcstat_lost++;
+	return NULL;
+}
+
+// How long e has been waiting, if it was; it isn't any more
+static uint64_t
+ipcstat_waited(struct Env *e)
+{
+	uint64_t *since = &ipcstat_since[ENVX(e->env_id)];
+	uint64_t t = 0;
+
+	if (*since != 0)
+		t = read_tsc() - *since;
+	*since = 0;
+	return t;
+}
+
+void
+ipcstat_send(struct Env *src, struct Env *dst, size_t npages)
+{
+	struct IpcPair *ip;
+	uint64_t recv_wait, send_wait;
+
+	recv_wait = ipcstat_waited(dst);
+	send_wait = ipcstat_waited(src);
+	envstat[ENVX(src->env_id)].es_sends++;
+	envstat[ENVX(src->env_id)].es_pages_sent += npages;
+	envstat[ENVX(src->env_id)].es_send_wait += send_wait;
+	envstat[ENVX(dst->env_id)].es_recvs++;
+	envstat[ENVX(dst->env_id)].es_pages_recvd += npages;
+	envstat[ENVX(dst->env_id)].es_recv_wait += recv_wait;
+	if ((ip = ipcstat_pair(src->env_id, dst->env_id)) == NULL)
+		return;
+	ip->ip_sends++;
+	ip->ip_pages += npages;
+	ip->ip_recv_wait += recv_wait;
+	ip->ip_send_wait += send_wait;
+}
+
+void
+ipcstat_retry(struct Env *src, envid_t dst)
+{
+	struct IpcPair *ip;
+
+	envstat[ENVX(src->env_id)].es_retries++;
+	if ((ip = ipcstat_pair(src->env_id, dst)) != NULL)
+		ip->ip_retries++;
+}
+
+void
+ipcstat_wait(struct Env *e, bool waiting)
+{
+	ipcstat_since[ENVX(e->env_id)] = waiting ? read_tsc() : 0;
+}
+
+void
+ipcstat_reset(void)
+{
+	memset(ipcstat_pairs, 0, sizeof(ipcstat_pairs));
+	ipcstat_lost = 0;
+}
+
+// Cycles as microseconds, once the TSC is calibrated
+static uint64_t
+ipcstat_us(uint64_t cycles)
+{
+	uint64_t mhz = kinfo->ki_tsc_hz / 1000000;
+
+	return mhz ? cycles / mhz : cycles;
+}
+
+void
+ipcstat_dump(int n)
+{
+	static struct IpcPair top[IPCSTAT_NPAIR];
+	struct IpcPair tmp;
+	uint32_t i, ntop = 0;
+	int j;
+
+	for (i = 0; i < IPCSTAT_NPAIR; i++)
+		if (ipcstat_pairs[i].ip_src != 0)
+			top[ntop++] = ipcstat_pairs[i];
+
+	// Most traffic, sends and retries alike, first
+	for (i = 1; i < ntop; i++) {
+		tmp = top[i];
+		for (j = i; j > 0 && top[j - 1].ip_sends + top[j - 1].ip_retries
+			     < tmp.ip_sends + tmp.ip_retries; j--)
+			top[j] = top[j - 1];
+		top[j] = tmp;
+	}
+
+	cprintf("%u pairs%s; waits in %s\n", ntop, ipcstat_lost ? " (table full)" : "",
+		kinfo->ki_tsc_hz ? "us" : "cycles");
+	cprintf("  sender -> receiver     sends    pages  retries    recv wait    send wait\n");
+	for (i = 0; i < ntop && i < n; i++)
+		cprintf("%08x -> %08x %8u %8u %8u %12llu %12llu\n",
+			top[i].ip_src, top[i].ip_dst, top[i].ip_sends, top[i].ip_pages,
+			top[i].ip_retries, ipcstat_us(top[i].ip_recv_wait),
+			ipcstat_us(top[i].ip_send_wait));
+	if (ipcstat_lost)
+		cprintf("%u events for pairs that didn't fit\n", ipcstat_lost);
+}
@@ -0,0 +1,24 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IPCSTAT_H
+#define JOS_KERN_IPCSTAT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// A message from src reached dst, with 'npages' pages.
+void	ipcstat_send(struct Env *src, struct Env *dst, size_t npages);
+// src's sys_ipc_try_send to dst failed with -E_IPC_NOT_RECV.
+void	ipcstat_retry(struct Env *src, envid_t dst);
+// e starts waiting to receive or to send, or if !waiting, stops.
+void	ipcstat_wait(struct Env *e, bool waiting);
+// Forget all counts.
+void	ipcstat_reset(void);
+// Print the 'n' busiest sender-receiver pairs.
+void	ipcstat_dump(int n);
+
+#endif	// !JOS_KERN_IPCSTAT_H
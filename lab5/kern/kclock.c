@@ -2,16 +2,20 @@
 
 /* Support for two time-related hardware gadgets: 1) the run time
  * clock with its NVRAM access functions; 2) the 8253 timer, which
- * generates interrupts on IRQ 0.
+ * generates interrupts on IRQ 0.  Also each CPU's clock: its LAPIC
+ * timer, or on the BSP the 8253 when there's no LAPIC to use.
  */
 
 #include <inc/x86.h>
 #include <inc/stdio.h>
 #include <inc/isareg.h>
 #include <inc/timerreg.h>
+#include <inc/error.h>
 
 #include <kern/kclock.h>
 #include <kern/picirq.h>
+#include <kern/ktimer.h>
+#include <kern/cpu.h>
 
 
 unsigned
@@ -29,15 +33,206 @@ mc146818_write(unsigned reg, unsigned datum)
 }
 
 
+// Timer interrupts per second, and whether the timer stops while the
+// CPU has nothing to run.  Both default from the build (HZ, TICKLESS).
+unsigned timer_hz = HZ;
+bool timer_tickless = TICKLESS;
+
+// On a LAPIC clock, the TSC at which the BSP's next tick falls due.
+// The kernel timers count ticks by the TSC, not by interrupts, so that
+// the BSP's clock can sleep through ticks with nothing to do, as
+// kclock_idle arranges.
+static uint64_t tick_tsc;
+
+// How fast does the TSC count?  Time two periods of the 8253, like
+// lapic_timer_calibrate, for users to turn rdtsc into seconds.
+static uint64_t
+kclock_tsc_calibrate(void)
+{
+	uint64_t start;
+
+	kclock_wait_tick();
+	start = read_tsc();
+	kclock_wait_tick();
+	kclock_wait_tick();
+	return (read_tsc() - start) / 2 * timer_hz;
+}
+
+// (Re)start the 8253 interrupting timer_hz times a second.
+static void
+kclock_start_8253(void)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(IO_TIMER1, TIMER_DIV(timer_hz) % 256);
+	outb(IO_TIMER1, TIMER_DIV(timer_hz) / 256);
+}
+
+// Does this CPU tick by its LAPIC timer?  The APs always do; the BSP
+// unless there's no LAPIC (or it won't count), or the build says not.
+static bool
+kclock_lapic(void)
+{
+	return lapic_timer_freq != 0 && (LAPIC_TIMER || thiscpu != bootcpu);
+}
+
+// TSC cycles a tick
+static uint64_t
+kclock_tick_tsc(void)
+{
+	return kinfo->ki_tsc_hz / timer_hz;
+}
+
+// The 8253 ticks the BSP until kclock_cpu_init, and times the TSC
 void
 kclock_init(void)
 {
-	/* initialize 8253 clock to interrupt 100 times/sec */
-	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
-	outb(IO_TIMER1, TIMER_DIV(100) % 256);
-	outb(IO_TIMER1, TIMER_DIV(100) / 256);
-	cprintf("	Setup timer interrupts via 8259A\n");
+	kclock_start_8253();
+	kinfo->ki_tsc_hz = kclock_tsc_calibrate();
+	cprintf("	Setup timer interrupts via 8259A at %u Hz%s\n", timer_hz,
+		timer_tickless ? ", tickless idle" : "");
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<0));
 	cprintf("	unmasked timer interrupt\n");
 }
 
+// Start this CPU's clock, after lapic_init has timed the LAPIC timer.
+// If the BSP can tick by it too, the 8253 stays counting, for
+// kclock_wait_tick, but IRQ 0 is masked.
+void
+kclock_cpu_init(void)
+{
+	if (thiscpu == bootcpu && kclock_lapic()) {
+		irq_setmask_8259A(irq_mask_8259A | (1<<0));
+		tick_tsc = read_tsc();
+		cprintf("	timer interrupts via LAPIC timer, %u counts a second\n",
+			lapic_timer_freq);
+	}
+	kclock_start();
+}
+
+// (Re)start this CPU's clock ticking timer_hz times a second.
+void
+kclock_start(void)
+{
+	if (kclock_lapic()) {
+		lapic_timer_periodic(timer_hz);
+		// Due at the interrupts, not half a tick off them
+		if (thiscpu == bootcpu) {
+			kclock_sync();
+			tick_tsc = read_tsc() + kclock_tick_tsc();
+		}
+	} else if (thiscpu == bootcpu)
+		kclock_start_8253();
+	thiscpu->cpu_timer_hz = timer_hz;
+}
+
+// Stop this CPU's timer interrupts until kclock_start().  Writing the
+// 8253 a mode word without a count leaves counter 0 waiting for one,
+// with its output (IRQ 0) quiet.
+void
+kclock_stop(void)
+{
+	if (kclock_lapic())
+		lapic_timer_stop();
+	else if (thiscpu == bootcpu)
+		outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+	thiscpu->cpu_timer_hz = 0;
+}
+
+// Restart this CPU's clock if it's stopped, or sleeping in kclock_idle,
+// or ticking at a rate kclock_set_hz has changed since.
+void
+kclock_resume(void)
+{
+	if (thiscpu->cpu_timer_hz != timer_hz)
+		kclock_start();
+	kclock_sync();
+}
+
+// This CPU has nothing to run.  Tickless, the BSP's clock stops if no
+// kernel timer is running.  If one is, a LAPIC clock sleeps till the
+// tick the wheel next has work for; the 8253 can't, so it keeps
+// ticking.  The APs' clocks keep going, so that they notice what the
+// BSP's interrupts made runnable elsewhere.
+void
+kclock_idle(void)
+{
+	uint32_t n;
+
+	if (!timer_tickless || thiscpu != bootcpu)
+		return;
+	if (!ktimer_pending())
+		kclock_stop();
+	else if (kclock_lapic() && (n = ktimer_idle_ticks()) > 1) {
+		kclock_sync();
+		lapic_timer_oneshot(tick_tsc + (n - 1) * kclock_tick_tsc());
+		thiscpu->cpu_timer_hz = 0;
+	}
+}
+
+// Bring the kernel timers' clock up to date.  On a LAPIC clock that's
+// the ticks the TSC says are due, rounding to the nearest, since a
+// periodic interrupt can come a hair before or after the TSC expects
+// it; on the 8253, each BSP interrupt is a tick, counted by kclock_tick.
+// Called with the kernel lock held, on any CPU.
+void
+kclock_sync(void)
+{
+	uint64_t tick = kclock_tick_tsc(), now = read_tsc() + tick / 2;
+	uint32_t n;
+
+	if (!LAPIC_TIMER || lapic_timer_freq == 0 || now < tick_tsc)
+		return;
+	n = (now - tick_tsc) / tick + 1;
+	tick_tsc += n * tick;
+	ktimer_advance(n);
+}
+
+// Called on every timer interrupt, to pick up a new rate and, on the
+// BSP, move the kernel timers on.
+void
+kclock_tick(void)
+{
+	kclock_resume();
+	if (thiscpu == bootcpu && !kclock_lapic())
+		ktimer_tick();
+}
+
+// Counter 0's current count, which runs down to 1 and starts again
+static uint16_t
+kclock_count(void)
+{
+	uint8_t lo;
+
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_LATCH);
+	lo = inb(IO_TIMER1);
+	return lo | (inb(IO_TIMER1) << 8);
+}
+
+// Spin until the start of the next timer period, for timing other
+// clocks against this one.  The timer must be running.
+void
+kclock_wait_tick(void)
+{
+	uint16_t prev, cur;
+
+	prev = kclock_count();
+	while ((cur = kclock_count()) <= prev)
+		prev = cur;
+}
+
+// Change the tick rate.  Returns 0, or -E_INVAL if the 8253 can't tick
+// that fast or that slowly.
+int
+kclock_set_hz(unsigned hz)
+{
+	if (hz < TIMER_MIN_HZ || hz > TIMER_MAX_HZ)
+		return -E_INVAL;
+	// Count the ticks due at the old rate before changing it
+	kclock_sync();
+	timer_hz = hz;
+	kinfo->ki_hz = hz;
+	// The other CPUs follow at their next tick
+	if (thiscpu->cpu_timer_hz != 0)
+		kclock_start();
+	return 0;
+}
@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -26,8 +28,39 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+// Default timer interrupts per second, and whether the timer stops while
+// the CPU idles; override with make HZ=... TICKLESS=...
+#ifndef HZ
+#define HZ		100
+#endif
+#ifndef TICKLESS
+#define TICKLESS	0
+#endif
+// Whether the BSP ticks by its LAPIC timer, when it has one, rather than
+// the 8253; make LAPIC_TIMER=0 keeps the 8253
+#ifndef LAPIC_TIMER
+#define LAPIC_TIMER	1
+#endif
+
+// The 8253's 16-bit divisor limits the rate to TIMER_FREQ/65536 and up.
+// Beyond a few kHz the machine does little but take timer interrupts.
+#define TIMER_MIN_HZ	19
+#define TIMER_MAX_HZ	10000
+
+extern unsigned timer_hz;
+extern bool timer_tickless;
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 void kclock_init(void);
+void kclock_cpu_init(void);
+void kclock_start(void);
+void kclock_stop(void);
+void kclock_resume(void);
+void kclock_idle(void);
+void kclock_tick(void);
+void kclock_sync(void);
+void kclock_wait_tick(void);
+int kclock_set_hz(unsigned hz);
 
 #endif	// !JOS_KERN_KCLOCK_H
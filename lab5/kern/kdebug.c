@@ -103,6 +103,145 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 }
 
 
+// Stab indexes.
+//
+// stab_binsearch skips stabs of other types one at a time, so that each
+// search may look at most of the table.  A StabIndex lists the
+// positions of the N_SO, N_FUN and N_SLINE stabs of one table, each
+// type in order, which makes every search of debuginfo_eip a true
+// binary search.  The kernel's index is built on the first lookup;
+// user programs' stabs are in their own address spaces, so we keep the
+// indexes of the last few envs looked up.  A table with more stabs of
+// those types than an index holds goes back to stab_binsearch.
+
+#define NSTABTYPE	3
+#define KERN_INDEXPOS	16384
+#define USER_INDEXPOS	8192
+#define NUSERINDEX	4
+
+struct StabIndex {
+	envid_t si_env;			// env whose stabs these are, 0 for the kernel
+	const struct Stab *si_stabs;	// 0 if unused
+	int si_nstab;
+	bool si_ok;			// false if the table didn't fit
+	int si_start[NSTABTYPE];	// where each type's positions start
+	int si_n[NSTABTYPE];		// and how many there are
+	int *si_pos;
+	int si_maxpos;
+};
+
+static const uint8_t stabindex_type[NSTABTYPE] = { N_SO, N_FUN, N_SLINE };
+
+static int kern_indexpos[KERN_INDEXPOS];
+static int user_indexpos[NUSERINDEX][USER_INDEXPOS];
+static struct StabIndex kern_index = { .si_pos = kern_indexpos, .si_maxpos = KERN_INDEXPOS };
+static struct StabIndex user_index[NUSERINDEX];
+static int user_index_next;		// slot to reuse next
+
+static void
+stab_index_build(struct StabIndex *si, envid_t env, const struct Stab *stabs, int nstab)
+{
+	int t, i, n = 0;
+
+	si->si_env = env;
+	si->si_stabs = stabs;
+	si->si_nstab = nstab;
+	si->si_ok = 0;
+	for (t = 0; t < NSTABTYPE; t++) {
+		si->si_start[t] = n;
+		for (i = 0; i < nstab; i++)
+			if (stabs[i].n_type == stabindex_type[t]) {
+				if (n == si->si_maxpos)
+					return;
+				si->si_pos[n++] = i;
+			}
+		si->si_n[t] = n - si->si_start[t];
+	}
+	si->si_ok = 1;
+}
+
+// The index of env e's stabs (kernel's if e is 0), built if need be, or
+// 0 if there is none.
+static const struct StabIndex *
+stab_index(struct Env *e, const struct Stab *stabs, int nstab)
+{
+	int i;
+	struct StabIndex *si;
+
+	if (e == NULL) {
+		if (kern_index.si_stabs != stabs)
+			stab_index_build(&kern_index, 0, stabs, nstab);
+		return kern_index.si_ok ? &kern_index : NULL;
+	}
+	for (i = 0; i < NUSERINDEX; i++) {
+		si = &user_index[i];
+		if (si->si_stabs == stabs && si->si_env == e->env_id && si->si_nstab == nstab)
+			return si->si_ok ? si : NULL;
+	}
+	si = &user_index[user_index_next];
+	user_index_next = (user_index_next + 1) % NUSERINDEX;
+	si->si_pos = user_indexpos[si - user_index];
+	si->si_maxpos = USER_INDEXPOS;
+	stab_index_build(si, e->env_id, stabs, nstab);
+	return si->si_ok ? si : NULL;
+}
+
+// The first of the n positions in pos that is at least 'stab'.
+static int
+stab_index_lower(const int *pos, int n, int stab)
+{
+	int l = 0, r = n, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (pos[m] < stab)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+// stab_binsearch through an index, or without one if si is 0.  The
+// same regions come out, except that when no stab of 'type' in the
+// region is at or below 'addr', *region_left > *region_right.
+static void
+stab_search(const struct StabIndex *si, const struct Stab *stabs,
+	    int *region_left, int *region_right, int type, uintptr_t addr)
+{
+	const int *pos;
+	int t, a, b, l, r, m;
+
+	for (t = 0; si && t < NSTABTYPE && stabindex_type[t] != type; t++)
+		/* do nothing */;
+	if (!si || t == NSTABTYPE) {
+		stab_binsearch(stabs, region_left, region_right, type, addr);
+		return;
+	}
+
+	// Positions [a, b) are the region's; find the last at or below addr
+	pos = si->si_pos + si->si_start[t];
+	a = stab_index_lower(pos, si->si_n[t], *region_left);
+	b = stab_index_lower(pos, si->si_n[t], *region_right + 1);
+	l = a;
+	r = b;
+	while (l < r) {
+		m = (l + r) / 2;
+		if (stabs[pos[m]].n_value <= addr)
+			l = m + 1;
+		else
+			r = m;
+	}
+	if (l == a) {
+		*region_right = *region_left - 1;
+		return;
+	}
+	*region_left = pos[l - 1];
+	if (l < b)
+		*region_right = pos[l] - 1;
+}
+
+
 // debuginfo_eip(addr, info)
 //
 //	Fill in the 'info' structure with information about the specified
@@ -112,9 +251,18 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 //
 int
 debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
+{
+	return debuginfo_eip_env(curenv, addr, info);
+}
+
+// As debuginfo_eip, but user addresses are in env 'e', whose address
+// space must be the current one.
+int
+debuginfo_eip_env(struct Env *e, uintptr_t addr, struct Eipdebuginfo *info)
 {
 	const struct Stab *stabs, *stab_end;
 	const char *stabstr, *stabstr_end;
+	const struct StabIndex *si;
 	int lfile, rfile, lfun, rfun, lline, rline;
 
 	// Initialize *info
@@ -142,7 +290,8 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// Make sure this memory is valid.
 		// Return -1 if it is not.  Hint: Call user_mem_check.
 		// LAB 3: Your code here.
-        if (user_mem_check(curenv, (void *)usd, sizeof(struct UserStabData), PTE_U) < 0)
+        if (e == NULL
+            || user_mem_check(e, (void *)usd, sizeof(struct UserStabData), PTE_U) < 0)
             return -1;
 		
 		stabs = usd->stabs;
@@ -153,14 +302,15 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// Make sure the STABS and string table memory is valid.
 		// LAB 3: Your code here.
 
-        if (user_mem_check(curenv, (void *)stabs, stab_end - stabs, PTE_U) < 0
-         || user_mem_check(curenv, (void *)stabstr, stabstr_end -stabstr, PTE_U) < 0)
+        if (user_mem_check(e, (void *)stabs, stab_end - stabs, PTE_U) < 0
+         || user_mem_check(e, (void *)stabstr, stabstr_end -stabstr, PTE_U) < 0)
             return -1;
 	}
 
 	// String table validity checks
 	if (stabstr_end <= stabstr || stabstr_end[-1] != 0)
 		return -1;
+	si = stab_index(addr >= ULIM ? NULL : e, stabs, stab_end - stabs);
 
 	// Now we find the right stabs that define the function containing
 	// 'eip'.  First, we find the basic source file containing 'eip'.
@@ -170,7 +320,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	// Search the entire set of stabs for the source file (type N_SO).
 	lfile = 0;
 	rfile = (stab_end - stabs) - 1;
-	stab_binsearch(stabs, &lfile, &rfile, N_SO, addr);
+	stab_search(si, stabs, &lfile, &rfile, N_SO, addr);
 	if (lfile == 0)
 		return -1;
 
@@ -178,7 +328,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	// (N_FUN).
 	lfun = lfile;
 	rfun = rfile;
-	stab_binsearch(stabs, &lfun, &rfun, N_FUN, addr);
+	stab_search(si, stabs, &lfun, &rfun, N_FUN, addr);
 
 	if (lfun <= rfun) {
 		// stabs[lfun] points to the function name
@@ -210,7 +360,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	//	Look at the STABS documentation and <inc/stab.h> to find
 	//	which one.
 	// Your code here.
-    stab_binsearch(stabs, &lline, &rline, N_SLINE, addr);
+    stab_search(si, stabs, &lline, &rline, N_SLINE, addr);
     if (lline <= rline) {
         info->eip_line = stabs[lline].n_desc;
     }
@@ -15,6 +15,9 @@ struct Eipdebuginfo {
 	int eip_fn_narg;		// Number of function arguments
 };
 
+struct Env;
+
 int debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info);
+int debuginfo_eip_env(struct Env *e, uintptr_t eip, struct Eipdebuginfo *info);
 
 #endif
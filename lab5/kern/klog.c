@@ -0,0 +1,148 @@
+// The kernel log.
+//
+// cprintf doesn't drive the console devices itself: the CGA, the serial
+// port and the parallel port, with its delay loops, are slow, and one
+// cprintf in a hot path would cost more than the work it logs.  It
+// appends to klog_buf instead, a ring of the last KLOG_SIZE bytes
+// logged, and the console catches up later -- from the idle path and
+// the BSP's timer interrupt, and before anything else reaches the
+// console (user output, a read of console input, the monitor's echo) so
+// that the order holds.  A writer that finds the console a whole ring
+// behind drains it itself, so the console never misses anything.  Until
+// the kernel is up (klog_start), and after a panic (klog_sync), every
+// message goes out at once.  sys_klog_read copies the ring out: dmesg.
+//
+// The %C colors are kept in band, as KLOG_COLOR and the color byte.
+// Other CPUs' output may come between two chunks of a message, so each
+// chunk starts with its color.
+//
+// klog_lock guards the ring.  The drain holds cons_lock, so only one
+// CPU drains at a time, and takes klog_lock inside it, but never across
+// the writes to the devices.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/klog.h>
+#include <kern/console.h>
+#include <kern/spinlock.h>
+
+static char klog_buf[KLOG_SIZE];
+// Both run free: how much has ever been logged, and how much of it
+// the console has had
+static uint32_t klog_wpos, klog_cpos;
+static bool klog_buffered;
+// The drain has seen a KLOG_COLOR whose color byte is still to come
+static bool klog_color_next;
+
+struct spinlock klog_lock = SPINLOCK_INIT(klog_lock);
+
+void
+klog_write(const char *s, size_t n)
+{
+	size_t i;
+
+	assert(n <= KLOG_CHUNK);
+	spin_lock(&klog_lock);
+	while (klog_wpos - klog_cpos + n > KLOG_SIZE) {
+		spin_unlock(&klog_lock);
+		klog_flush();
+		spin_lock(&klog_lock);
+	}
+	for (i = 0; i < n; i++)
+		klog_buf[klog_wpos++ % KLOG_SIZE] = s[i];
+	spin_unlock(&klog_lock);
+	if (!klog_buffered)
+		klog_flush();
+}
+
+// Write n bytes of the log to the console, taking the colors out
+static void
+klog_out(const char *s, size_t n)
+{
+	size_t i, run;
+
+	for (i = 0; i < n; i += run) {
+		if (klog_color_next) {
+			cons_color = (uint8_t) s[i];
+			klog_color_next = 0;
+			run = 1;
+		} else if (s[i] == KLOG_COLOR) {
+			klog_color_next = 1;
+			run = 1;
+		} else {
+			for (run = 1; i + run < n && s[i + run] != KLOG_COLOR; run++)
+				;
+			cons_write(s + i, run);
+		}
+	}
+}
+
+void
+klog_flush(void)
+{
+	char buf[KLOG_CHUNK];
+	uint32_t i, n;
+
+	if (klog_cpos == klog_wpos)
+		return;
+	cons_begin();
+	spin_lock(&klog_lock);
+	while (klog_cpos != klog_wpos) {
+		n = MIN(klog_wpos - klog_cpos, KLOG_CHUNK);
+		for (i = 0; i < n; i++)
+			buf[i] = klog_buf[(klog_cpos + i) % KLOG_SIZE];
+		klog_cpos += n;
+		spin_unlock(&klog_lock);
+		klog_out(buf, n);
+		spin_lock(&klog_lock);
+	}
+	spin_unlock(&klog_lock);
+	cons_end();
+}
+
+void
+klog_start(void)
+{
+	klog_buffered = 1;
+}
+
+void
+klog_sync(void)
+{
+	klog_buffered = 0;
+	klog_flush();
+}
+
+size_t
+klog_read(char *buf, size_t n)
+{
+	uint32_t pos, skip, nvis = 0;
+	size_t i;
+	char c;
+
+	spin_lock(&klog_lock);
+	pos = klog_wpos > KLOG_SIZE ? klog_wpos - KLOG_SIZE : 0;
+	// The oldest chunk may have lost its start, color and all: begin
+	// at the next one's
+	if (pos > 0)
+		while (pos != klog_wpos && klog_buf[pos % KLOG_SIZE] != KLOG_COLOR)
+			pos++;
+	for (i = pos; i != klog_wpos; i++)
+		if (klog_buf[i % KLOG_SIZE] == KLOG_COLOR)
+			i++;
+		else
+			nvis++;
+	// Only the latest n of them
+	skip = nvis > n ? nvis - n : 0;
+	for (i = 0; pos != klog_wpos; pos++) {
+		if ((c = klog_buf[pos % KLOG_SIZE]) == KLOG_COLOR)
+			pos++;
+		else if (skip > 0)
+			skip--;
+		else
+			buf[i++] = c;
+	}
+	spin_unlock(&klog_lock);
+	return i;
+}
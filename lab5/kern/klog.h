@@ -0,0 +1,30 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+
+// Marks a color change in the log: the next byte is the new ch_color
+#define KLOG_COLOR	0x01
+// Most that klog_write takes at once
+#define KLOG_CHUNK	128
+
+extern struct spinlock klog_lock;
+
+// Append n bytes, at most KLOG_CHUNK, to the log.
+void	klog_write(const char *s, size_t n);
+// Give the console all of the log it hasn't had yet.
+void	klog_flush(void);
+// The kernel is up: cprintf's output can wait for the console now.
+void	klog_start(void);
+// Flush, and make all later output go out at once, for a panic.
+void	klog_sync(void);
+// Copy the latest of the log, up to n bytes, without the color changes.
+size_t	klog_read(char *buf, size_t n);
+
+#endif	// !JOS_KERN_KLOG_H
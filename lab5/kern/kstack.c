@@ -0,0 +1,158 @@
+// Per-env kernel stacks.
+//
+// Traps run on their CPU's own kernel stack, and a system call that
+// waits records what it's waiting for and never returns: the next trap
+// on that CPU starts the stack over.  Kernel code that has to give up
+// the CPU partway through, and pick up where it left off -- a long
+// operation taking a break between steps, or a wait too deep in the
+// kernel to unwind -- runs instead on a stack of the env's own, by
+// kstack_run.  Giving up the CPU there saves the callee-saved registers
+// and the stack pointer in env_kesp, and runs the scheduler back on the
+// CPU's stack.  When the scheduler next picks the env, env_run carries
+// on from env_kesp, instead of returning to user mode, holding the
+// kernel lock as the code that blocked did.  A system call that never
+// blocks doesn't come here, so it pays nothing for any of this.
+//
+// The scheduler only runs on the CPUs' stacks (sched_resched moves
+// there), so an env's stack is only in use by the CPU running the env.
+// Code on it may hold the kernel lock across a yield, but no spinlock.
+// The stacks have no guard pages, so what runs there must keep its
+// frames small.  An env gets its stack the first time it needs one, and
+// gives it back when it's freed.
+//
+// Long loops under kstack_run have preemption points, kstack_preempt,
+// every so often.  Past KSTACK_PREEMPT_CYCLES with interrupts off, one
+// lets in the interrupts that came meanwhile, for just an instruction:
+// trap() sends them straight back here, sched_tick only counts the tick,
+// and nothing switches envs under us.  Then, if the time slice is up or
+// a more important env is waiting, it yields.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/kstack.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/trap.h>
+
+// Cycles with interrupts off after which a preemption point lets them in
+#define KSTACK_PREEMPT_CYCLES	(1ULL << 18)
+
+void	kstack_switch(uintptr_t *save, uintptr_t esp, void (*fn)(void));
+void	kstack_load(uintptr_t esp) __attribute__((noreturn));
+
+// The bottom frame of an env's stack: run fn, and return its result to
+// user mode.  curenv is still the env we began for, since only it
+// runs here, unless fn destroyed it, when it doesn't return.
+static void __attribute__((noreturn))
+kstack_start(int32_t (*fn)(void *), void *arg)
+{
+	int32_t r = fn(arg);
+
+	// Destroyed meanwhile: we're done, so go (env_destroy)
+	if (curenv->env_doomed)
+		env_destroy(curenv);
+	curenv->env_tf.tf_regs.reg_eax = r;
+	kstack_leave(trap_return);
+}
+
+void
+kstack_run(int32_t (*fn)(void *), void *arg)
+{
+	struct Env *e = curenv;
+	struct Page *pp;
+	uintptr_t *sp;
+
+	assert(!kstack_off_cpu());
+	if (e->env_kstack == NULL) {
+		if (page_alloc_order(&pp, KSTACK_ORDER) < 0) {
+			e->env_tf.tf_regs.reg_eax = -E_NO_MEM;
+			kstack_leave(trap_return);
+		}
+		e->env_kstack = page2kva(pp);
+	}
+	// kstack_switch calls kstack_start with these for arguments
+	sp = (uintptr_t *) ((char *) e->env_kstack + KSTACK_SIZE);
+	*--sp = (uintptr_t) arg;
+	*--sp = (uintptr_t) fn;
+	kstack_switch(NULL, (uintptr_t) sp, (void (*)(void)) kstack_start);
+	panic("kstack_run: kstack_start returned");
+}
+
+void
+kstack_yield(void)
+{
+	struct Env *e = curenv;
+
+	assert(e->env_kstack != NULL && read_esp() - (uintptr_t) e->env_kstack < KSTACK_SIZE);
+	kstack_switch(&e->env_kesp, CPU_KSTACKTOP(cpunum()), sched_yield);
+}
+
+bool
+kstack_preempt_due(void)
+{
+	struct Env *e = curenv;
+
+	return e != NULL && e->env_kstack != NULL
+		&& read_esp() - (uintptr_t) e->env_kstack < KSTACK_SIZE
+		&& read_tsc() - thiscpu->cpu_ioff_tsc >= KSTACK_PREEMPT_CYCLES;
+}
+
+void
+kstack_preempt(void)
+{
+	struct Env *e = curenv;
+
+	cpu_ioff_end();
+	thiscpu->cpu_preempting = 1;
+	asm volatile("sti; nop; cli" : : : "memory");
+	thiscpu->cpu_preempting = 0;
+	cpu_ioff_start();
+	if (e->env_status == ENV_RUNNABLE && (e->env_ticks <= 0 || sched_preempt_pending(e)))
+		kstack_yield();
+}
+
+void
+kstack_sleep(void)
+{
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	kstack_yield();
+}
+
+void
+kstack_wake(struct Env *e)
+{
+	if (e->env_kesp != 0 && e->env_status == ENV_NOT_RUNNABLE)
+		env_set_status(e, ENV_RUNNABLE);
+}
+
+void
+kstack_resume(struct Env *e)
+{
+	uintptr_t esp = e->env_kesp;
+
+	if (esp == 0)
+		return;
+	e->env_kesp = 0;
+	kstack_load(esp);
+}
+
+void
+kstack_leave(void (*fn)(void))
+{
+	kstack_switch(NULL, CPU_KSTACKTOP(cpunum()), fn);
+	panic("kstack_leave: returned");
+}
+
+void
+kstack_free(struct Env *e)
+{
+	e->env_kesp = 0;
+	// If e is destroying itself we're standing on its stack, which the
+	// next env in its slot can have instead
+	if (e->env_kstack == NULL || read_esp() - (uintptr_t) e->env_kstack < KSTACK_SIZE)
+		return;
+	page_free_order(pa2page(PADDR(e->env_kstack)), KSTACK_ORDER);
+	e->env_kstack = NULL;
+}
@@ -0,0 +1,55 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSTACK_H
+#define JOS_KERN_KSTACK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <kern/cpu.h>
+
+struct Env;
+
+// Each env's kernel stack is 2^KSTACK_ORDER pages
+#define KSTACK_ORDER	1
+#define KSTACK_SIZE	(PGSIZE << KSTACK_ORDER)
+
+// Run fn(arg) for curenv on its own kernel stack, where it may block
+// partway.  Never returns: what fn returns is curenv's system call
+// result, or -E_NO_MEM if there's no stack for it, and curenv goes back
+// to user mode as after any trap.
+void	kstack_run(int32_t (*fn)(void *), void *arg) __attribute__((noreturn));
+// From within kstack_run: let the scheduler run something else, and
+// carry on here when curenv next runs.
+void	kstack_yield(void);
+// From within kstack_run: block until something makes curenv runnable
+// again, as kstack_wake does; env_destroy does too, so check again
+// what we're waiting for.
+void	kstack_sleep(void);
+void	kstack_wake(struct Env *e);
+// A preemption point, for long loops under kstack_run.  When
+// kstack_preempt_due says it's time, drop every spinlock but the
+// kernel lock and call kstack_preempt, which lets interrupts in, and
+// lets other envs run if they should come first.
+bool	kstack_preempt_due(void);
+void	kstack_preempt(void);
+// Carry on where e blocked in the kernel, if it did.  From env_run.
+void	kstack_resume(struct Env *e);
+// Call fn, which doesn't return, at the top of this CPU's own stack.
+void	kstack_leave(void (*fn)(void)) __attribute__((noreturn));
+// Forget e's kernel context and give back its stack.  From env_free.
+void	kstack_free(struct Env *e);
+
+// Is this CPU running on some stack other than its own kernel stack: an
+// env's, or, until its first trap, the one it booted on?
+static inline bool
+kstack_off_cpu(void)
+{
+	uintptr_t esp = read_esp(), top = CPU_KSTACKTOP(cpunum());
+
+	return esp <= top - KSTKSIZE || esp > top;
+}
+
+#endif	// !JOS_KERN_KSTACK_H
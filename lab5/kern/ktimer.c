@@ -0,0 +1,143 @@
+// Kernel timers: an env blocked in sys_sleep, or in a receive with a
+// timeout, is woken by its timer instead of polling with sys_yield.
+//
+// The timers hang in a hierarchical timing wheel, ticked by the BSP's
+// timer interrupt.  Level 0 has a slot for each of the next 64 ticks;
+// each slot of level i > 0 holds the timers of a run of 64^i ticks
+// further off, and when the clock reaches the start of the run, they are
+// spread over the levels below.  Arming, cancelling and each tick are
+// O(1), however many envs sleep, and a timer is moved at most three
+// times before it fires.  A tickless BSP with nothing else to do lets
+// its clock sleep till the next tick the wheel has work for, and then
+// makes up the ticks it slept through.
+//
+// Everything here is guarded by the kernel lock: the timer interrupt,
+// and the system calls that block or wake envs, all hold it.
+
+#include <inc/assert.h>
+#include <inc/queue.h>
+
+#include <kern/ktimer.h>
+#include <kern/kclock.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/syscall.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+LIST_HEAD(Env_timerq, Env);
+static struct Env_timerq wheel[WHEEL_LEVELS][WHEEL_SIZE];
+
+uint32_t ktimer_now;
+struct KernInfo *kinfo;
+static uint32_t ktimer_narmed;
+
+// Hang e's timer in the slot of the lowest level that reaches as far as
+// its expiry.  Called with e->env_timer_expires - ktimer_now < 2^24.
+static void
+wheel_insert(struct Env *e)
+{
+	uint32_t delta = e->env_timer_expires - ktimer_now;
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1U << (WHEEL_BITS * (level + 1)))
+			break;
+	LIST_INSERT_HEAD(&wheel[level][(e->env_timer_expires
+		>> (WHEEL_BITS * level)) % WHEEL_SIZE], e, env_timer_link);
+}
+
+void
+ktimer_arm(struct Env *e, uint32_t ticks)
+{
+	assert(ticks > 0);
+	kclock_sync();
+	ktimer_cancel(e);
+	e->env_timer_expires = ktimer_now + MIN(ticks, KTIMER_MAX);
+	e->env_timer_armed = 1;
+	ktimer_narmed++;
+	wheel_insert(e);
+	// A halted BSP's clock may be sleeping past this timer
+	if (thiscpu != bootcpu && bootcpu->cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(bootcpu->cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+void
+ktimer_cancel(struct Env *e)
+{
+	if (!e->env_timer_armed)
+		return;
+	LIST_REMOVE(e, env_timer_link);
+	e->env_timer_armed = 0;
+	ktimer_narmed--;
+}
+
+bool
+ktimer_pending(void)
+{
+	return ktimer_narmed != 0;
+}
+
+// Move the timers in slot 'slot' of 'level' down to the levels below:
+// they all expire within the next 64^level ticks.
+static void
+wheel_cascade(int level, int slot)
+{
+	struct Env *e;
+
+	while ((e = LIST_FIRST(&wheel[level][slot])) != NULL) {
+		LIST_REMOVE(e, env_timer_link);
+		wheel_insert(e);
+	}
+}
+
+void
+ktimer_tick(void)
+{
+	struct Env_timerq *q;
+	struct Env *e;
+	int level;
+
+	kinfo->ki_ticks = ++ktimer_now;
+	if (ktimer_narmed == 0)
+		return;
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (ktimer_now % (1U << (WHEEL_BITS * level)) != 0)
+			break;
+		wheel_cascade(level, (ktimer_now >> (WHEEL_BITS * level)) % WHEEL_SIZE);
+	}
+	q = &wheel[0][ktimer_now % WHEEL_SIZE];
+	while ((e = LIST_FIRST(q)) != NULL) {
+		assert(e->env_timer_expires == ktimer_now);
+		ktimer_cancel(e);
+		timer_signal(e);
+	}
+}
+
+void
+ktimer_advance(uint32_t n)
+{
+	// With nothing in the wheel, there's nothing to fire or move
+	if (ktimer_narmed == 0) {
+		kinfo->ki_ticks = ktimer_now += n;
+		return;
+	}
+	while (n-- > 0)
+		ktimer_tick();
+}
+
+uint32_t
+ktimer_idle_ticks(void)
+{
+	uint32_t n;
+
+	// Slots of the levels above level 0 are only looked at when level 0
+	// comes round again
+	for (n = 1; (ktimer_now + n) % WHEEL_SIZE != 0; n++)
+		if (!LIST_EMPTY(&wheel[0][(ktimer_now + n) % WHEEL_SIZE]))
+			break;
+	return n;
+}
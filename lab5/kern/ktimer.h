@@ -0,0 +1,36 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KTIMER_H
+#define JOS_KERN_KTIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/kinfo.h>
+
+struct Env;
+
+// The longest a timer can run, in ticks; longer ones are cut to this
+#define KTIMER_MAX	((1U << 24) - 1)
+
+extern uint32_t ktimer_now;	// BSP timer ticks since boot
+// The kernel info page, mapped read-only at UKINFO
+extern struct KernInfo *kinfo;
+
+// Wake e in 'ticks' ticks, from 1 to KTIMER_MAX, by timer_signal(e);
+// re-arming replaces e's earlier timer.
+void	ktimer_arm(struct Env *e, uint32_t ticks);
+// Stop e's timer, if it's running.
+void	ktimer_cancel(struct Env *e);
+// Is any timer running?
+bool	ktimer_pending(void);
+// Move the clock on a tick, for a BSP timer interrupt or ktimer_advance.
+void	ktimer_tick(void);
+// Move the clock on by n ticks at once, firing the timers due.
+void	ktimer_advance(uint32_t n);
+// Ticks from now to the next that has work for the wheel: the BSP's
+// clock can sleep through the ones before.
+uint32_t ktimer_idle_ticks(void);
+
+#endif	// !JOS_KERN_KTIMER_H
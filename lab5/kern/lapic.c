@@ -0,0 +1,270 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 8 & Appendix C of Intel processor manual volume 3.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/ktimer.h>
+#include <kern/picirq.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+	#define BUSY       0x00001000
+	#define FIXED      0x00000000
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define PERIODIC   0x00020000   // Periodic
+	#define TSCDEADLINE 0x00040000  // One-shot at a TSC value
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+#define MSR_TSC_DEADLINE 0x6E0	// TSC value for the timer to fire at
+#define CPUID1_TSC_DEADLINE (1 << 24)	// CPUID 1 %ecx: timer has TSCDEADLINE
+
+physaddr_t lapicaddr;        // Initialized in mpconfig.c
+volatile uint32_t *lapic;
+
+// Timer counts per second, measured against the TSC by the BSP; 0 if
+// there's no LAPIC, or it would not count
+uint32_t lapic_timer_freq;
+// Can the timer fire at a TSC value, rather than after a count?
+static bool lapic_tsc_deadline;
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+// How fast does the timer count?  Count it down for 10ms of the TSC,
+// which kclock_init timed against the 8253: a far finer clock than the
+// 8253's own ticks.
+static uint32_t
+lapic_timer_calibrate(void)
+{
+	uint64_t start, span = kinfo->ki_tsc_hz / 100;
+	uint32_t count;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xFFFFFFFF);
+	start = read_tsc();
+	count = lapic[TCCR];
+	while (read_tsc() - start < span)
+		;
+	return span ? (count - lapic[TCCR]) * 100 : 0;
+}
+
+// Interrupt 'hz' times a second, from now until told otherwise.
+void
+lapic_timer_periodic(unsigned hz)
+{
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_timer_freq / hz);
+}
+
+// Interrupt once, when the TSC reaches 'tsc' (at once if it has).
+// Without TSC-deadline mode, count down the time till then instead, or
+// a second of it at most, which is as good: an early interrupt finds
+// nothing due, and the caller asks again.
+void
+lapic_timer_oneshot(uint64_t tsc)
+{
+	uint64_t now = read_tsc(), count;
+
+	if (lapic_tsc_deadline) {
+		lapicw(TIMER, TSCDEADLINE | (IRQ_OFFSET + IRQ_TIMER));
+		wrmsr(MSR_TSC_DEADLINE, MAX(tsc, 1));
+		return;
+	}
+	count = tsc > now ? MIN(tsc - now, kinfo->ki_tsc_hz) * lapic_timer_freq
+		/ kinfo->ki_tsc_hz : 0;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, MAX(count, 1ULL));
+}
+
+// No more timer interrupts until the next lapic_timer_periodic or
+// lapic_timer_oneshot.
+void
+lapic_timer_stop(void)
+{
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0);
+}
+
+void
+lapic_init(void)
+{
+	if (!lapicaddr)
+		return;
+
+	// lapicaddr is the physical address of the LAPIC's 4K MMIO
+	// region.  Map it in to virtual memory so we can access it.
+	// Every CPU's LAPIC is at the same address.
+	if (lapic == NULL)
+		lapic = mmio_map_region(lapicaddr, 4096);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// Each CPU's clock is its LAPIC's timer, which counts down at bus
+	// frequency and then issues an interrupt, repeatedly or once;
+	// kclock_cpu_init starts it.  The BSP times it, and sees whether
+	// it can fire at a TSC value instead.
+	if (thiscpu == bootcpu) {
+		uint32_t ecx;
+
+		lapic_timer_freq = lapic_timer_calibrate();
+		cpuid(1, NULL, NULL, &ecx, NULL);
+		lapic_tsc_deadline = (ecx & CPUID1_TSC_DEADLINE) != 0;
+	}
+	lapicw(TIMER, MASKED);
+
+	// Leave LINT0 of the BSP enabled so that it can get
+	// interrupts from the 8259A chip.
+	//
+	// According to Intel MP Specification, the BIOS should initialize
+	// BSP's local APIC in Virtual Wire Mode, in which 8259A's
+	// INTR is virtually connected to BSP's LINTIN0. In this mode,
+	// we do not need to program the IOAPIC.
+	if (thiscpu != bootcpu)
+		lapicw(LINT0, MASKED);
+
+	// Disable NMI (LINT1) on all CPUs
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to IRQ_ERROR.
+	lapicw(ERROR, IRQ_OFFSET + IRQ_ERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Send an Init Level De-Assert to synchronize arbitration ID's.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, BCAST | INIT | LEVEL);
+	while(lapic[ICRLO] & DELIVS)
+		;
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+}
+
+int
+cpunum(void)
+{
+	if (lapic)
+		return lapic[ID] >> 24;
+	return 0;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+// Spin for a given number of microseconds.  Each read of port 0x84,
+// which nothing decodes, takes about a microsecond on the ISA bus.
+static void
+microdelay(int us)
+{
+	while (us-- > 0)
+		inb(0x84);
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	microdelay(10000);    // should be 10ms
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRHI, apicid << 24);
+		lapicw(ICRLO, STARTUP | (addr >> 12));
+		microdelay(200);
+	}
+}
+
+// Send 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Send 'vector' to every other CPU.
+void
+lapic_ipi(int vector)
+{
+	lapicw(ICRLO, OTHERS | FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
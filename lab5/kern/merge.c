@@ -0,0 +1,225 @@
+// Same-page merging.
+//
+// Many envs forked from one, or running the same program, end up with
+// private pages whose contents are the same.  With PAGE_MERGE, idle
+// CPUs walk the user PTEs of every env, a batch at a time as kern/age.c
+// does, and fold such pages into one copy, shared copy-on-write, much as
+// after fork.  The first write to a shared copy gets a page of its own
+// again (page_cow_break).
+//
+// Each page looked at is hashed into merge_table, which has one entry
+// per hash bucket.  An entry is either one of the shared copies, which
+// have pp_merged set, or just a hint: a private page seen with those
+// contents.  A page that finds a shared copy of itself is replaced by
+// it.  A page that finds a hint becomes a shared copy itself, write
+// protected, and takes the entry; the hint's page finds it the next
+// time the scan comes round.  So each merge changes the PTEs of the one
+// env we hold, never another's.  An all-zero page is simply replaced by
+// the zero page.
+//
+// Only pages mapped once, in an env no CPU is running, and untouched for
+// a while by the aging scan's reckoning, are candidates: merging a page
+// that's about to be written only costs a fault and a copy.  Shared
+// pages, superpages, page tables shared since fork, and the pages of
+// envs with I/O privilege, which devices may be writing by DMA, are
+// left alone.
+//
+// A shared copy stays read-only everywhere while pp_merged is set; the
+// entries themselves are never trusted without comparing the pages.
+// merge_lock keeps the flag, and the reference counts of the pages that
+// have it, from changing under a merge: page_decref and page_cow_reuse
+// come here for those pages.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/merge.h>
+#include <kern/age.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define MERGE_NSLOT	4096	// entries in merge_table; a power of two
+#define MERGE_MIN_AGE	1	// aging sweeps a candidate has gone untouched
+
+struct Merge_slot {
+	uint32_t ms_hash;
+	struct Page *ms_page;	// a shared copy if pp_merged, else a hint
+};
+
+uint32_t merge_nmerged;
+uint32_t merge_nzero;
+
+static struct spinlock merge_lock = SPINLOCK_INIT(merge_lock);
+static struct Merge_slot merge_table[MERGE_NSLOT];
+// Where the scan has got to: the next PTE it looks at
+static uint32_t merge_env;
+static uintptr_t merge_va;
+
+// FNV-1a over the words of a page.  Sets *zero if they are all 0.
+static uint32_t
+merge_hash(const uint32_t *w, bool *zero)
+{
+	uint32_t h = 2166136261U, any = 0;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++) {
+		h = (h ^ w[i]) * 16777619U;
+		any |= w[i];
+	}
+	*zero = (any == 0);
+	return h;
+}
+
+// Is e, or a thread sharing its address space, some CPU's current env?
+static bool
+env_on_cpu(struct Env *e)
+{
+	struct Env *c;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if ((c = cpus[i].cpu_env) != NULL && c->env_pgdir == e->env_pgdir)
+			return 1;
+	return 0;
+}
+
+// Write-protect the PTE *pte for va in e, which is locked.  Returns 0
+// if a CPU has taken e up meanwhile, when the page may still be written.
+static bool
+merge_protect(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	if (*pte & PTE_W) {
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+	}
+	mb();
+	return !env_on_cpu(e);
+}
+
+// Try to merge the page at va in e, behind *pte.  e is locked.
+static void
+merge_page(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct Page *pp = pa2page(PTE_ADDR(*pte)), *sp;
+	struct Merge_slot *ms;
+	uint32_t hash;
+	bool zero;
+
+	if (pp == zero_page || pp->pp_merged || pp->pp_waiters != 0
+	    || page_age(pp) < MERGE_MIN_AGE || !page_mapped_once(pp, e->env_pgdir, (void *) va))
+		return;
+	hash = merge_hash(page2kva(pp), &zero);
+	if (zero) {
+		if (zero_page->pp_ref >= ZERO_PAGE_MAXREF || !merge_protect(e, va, pte))
+			return;
+		merge_hash(page2kva(pp), &zero);
+		if (zero && page_insert(e->env_pgdir, zero_page, (void *) va, *pte & PTE_USER) == 0)
+			merge_nzero++;
+		return;
+	}
+	ms = &merge_table[hash & (MERGE_NSLOT - 1)];
+	sp = ms->ms_page;
+	if (sp == NULL || ms->ms_hash != hash || sp == pp || sp->pp_ref == 0) {
+		// Nothing like it yet: leave it as a hint
+		ms->ms_hash = hash;
+		ms->ms_page = pp;
+		return;
+	}
+	if (!merge_protect(e, va, pte))
+		return;
+	// Once e can't write it, the page is what we compare
+	if (memcmp(page2kva(pp), page2kva(sp), PGSIZE) != 0) {
+		ms->ms_page = pp;
+		return;
+	}
+	if (!sp->pp_merged) {
+		// The hint's page, mapped with ours, merges with it later
+		pp->pp_merged = 1;
+		ms->ms_page = pp;
+		return;
+	}
+	// page_insert drops our reference to pp, freeing it
+	if (sp->pp_ref < ZERO_PAGE_MAXREF
+	    && page_insert(e->env_pgdir, sp, (void *) va, *pte & PTE_USER) == 0)
+		merge_nmerged++;
+}
+
+// Merge e's pages from merge_va on, looking at up to 'n' of them.
+// e is locked.  Returns how many are left of n.
+static int
+merge_scan(struct Env *e, int n)
+{
+	pde_t pde;
+	pte_t *pte;
+
+	for (; merge_va < UTOP && n > 0; merge_va += PGSIZE) {
+		pde = e->env_pgdir[PDX(merge_va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS) || PDE_SHARED(pde)) {
+			merge_va = ROUNDDOWN(merge_va, PTSIZE) + PTSIZE - PGSIZE;
+			n--;
+			continue;
+		}
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(merge_va);
+		if ((*pte & (PTE_P | PTE_U | PTE_SHARE)) != (PTE_P | PTE_U)
+		    || !(*pte & (PTE_W | PTE_COW)) || merge_va == UXSTACKTOP - PGSIZE)
+			continue;
+		n--;
+		merge_page(e, merge_va, pte);
+	}
+	return n;
+}
+
+void
+merge_idle(int n)
+{
+	struct Env *e;
+
+	if (!PAGE_MERGE || !spin_trylock(&merge_lock))
+		return;
+	while (n > 0) {
+		if (merge_env >= env_ntable)
+			merge_env = 0;
+		e = &envs[merge_env];
+		if (e->env_status != ENV_FREE && env_trylock(e)) {
+			// One a CPU is running waits for the next round
+			if (e->env_status != ENV_FREE && e->env_pgdir != NULL
+			    && (e->env_tf.tf_eflags & FL_IOPL_MASK) == 0 && !env_on_cpu(e))
+				n = merge_scan(e, n);
+			env_unlock(e);
+			if (merge_va < UTOP && n == 0)
+				continue;
+		}
+		n--;
+		merge_env++;
+		merge_va = 0;
+	}
+	spin_unlock(&merge_lock);
+}
+
+int
+merge_decref(struct Page *pp)
+{
+	int n;
+
+	spin_lock(&merge_lock);
+	if ((n = page_ref_dec(pp)) == 0)
+		pp->pp_merged = 0;
+	spin_unlock(&merge_lock);
+	return n;
+}
+
+bool
+merge_forget(struct Page *pp, pde_t *pgdir, void *va)
+{
+	bool once;
+
+	spin_lock(&merge_lock);
+	if ((once = page_mapped_once(pp, pgdir, va)))
+		pp->pp_merged = 0;
+	spin_unlock(&merge_lock);
+	return once;
+}
@@ -0,0 +1,29 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_MERGE_H
+#define JOS_KERN_MERGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+/* 'make PAGE_MERGE=1' has idle CPUs look for user pages with the same
+ * contents and share one copy-on-write copy of them (see kern/merge.c) */
+#ifndef PAGE_MERGE
+#define PAGE_MERGE	0
+#endif
+
+extern uint32_t merge_nmerged;	// pages given up for a shared copy
+extern uint32_t merge_nzero;	// pages given up for the zero page
+
+// Look at up to 'n' more user PTEs.  Called from the scheduler's idle path.
+void	merge_idle(int n);
+// Drop a reference to the merged page pp, returning how many are left.
+int	merge_decref(struct Page *pp);
+// pp, merged, is about to be written through its one mapping, at 'va'
+// in 'pgdir': stop sharing it.  Returns 0 if it's mapped elsewhere now.
+bool	merge_forget(struct Page *pp, pde_t *pgdir, void *va);
+
+#endif	// !JOS_KERN_MERGE_H
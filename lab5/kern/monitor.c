@@ -12,6 +12,23 @@
 #include <kern/trap.h>
 #include <kern/kdebug.h>
 #include<kern/pmap.h>
+#include <kern/env.h>
+#include <kern/syscall.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
+#include <kern/kclock.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/slab.h>
+#include <kern/swap.h>
+#include <kern/age.h>
+#include <kern/merge.h>
+#include <kern/cpu.h>
+#include <kern/ktimer.h>
+#include <kern/pmc.h>
+#include <kern/ipcstat.h>
+#include <kern/klog.h>
+#include <kern/selftest.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,6 +42,24 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_alloc_page(int argc, char **argv, struct Trapframe *tf);
 int mon_free_page(int argc, char **argv, struct Trapframe *tf);
 int mon_page_status(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbstat(int argc, char **argv, struct Trapframe *tf);
+int mon_syscallstat(int argc, char **argv, struct Trapframe *tf);
+int mon_ipcstat(int argc, char **argv, struct Trapframe *tf);
+int mon_prof(int argc, char **argv, struct Trapframe *tf);
+int mon_trace(int argc, char **argv, struct Trapframe *tf);
+int mon_pmc(int argc, char **argv, struct Trapframe *tf);
+int mon_timer(int argc, char **argv, struct Trapframe *tf);
+int mon_locks(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
+int mon_swapstat(int argc, char **argv, struct Trapframe *tf);
+int mon_pageage(int argc, char **argv, struct Trapframe *tf);
+int mon_merge(int argc, char **argv, struct Trapframe *tf);
+int mon_latency(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
+int mon_ps(int argc, char **argv, struct Trapframe *tf);
+int mon_top(int argc, char **argv, struct Trapframe *tf);
+int mon_bench(int argc, char **argv, struct Trapframe *tf);
+int mon_selftest(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
 	const char *name;
@@ -41,6 +76,24 @@ static struct Command commands[] = {
 	{ "alloc_page", "Allocate pages explicitly", mon_alloc_page },
 	{ "free_page", "Free pages explicitly", mon_free_page },
 	{ "page_status", "Display status of any given page of physical memory", mon_page_status },
+	{ "tlbstat", "Display TLB flush counters and global kernel mappings", mon_tlbstat },
+	{ "syscallstat", "Display system call counts and cycles, overall or for one env", mon_syscallstat },
+	{ "ipcstat", "Display the env pairs that send each other most, and their waits", mon_ipcstat },
+	{ "prof", "Control the sampling profiler, or display its hottest functions", mon_prof },
+	{ "trace", "Choose the events traced, or display the latest", mon_trace },
+	{ "pmc", "Display performance counter totals, overall or for one env", mon_pmc },
+	{ "timer", "Display or set the timer rate and whether it stops while idle", mon_timer },
+	{ "locks", "Display how often each kernel lock was taken and contended", mon_locks },
+	{ "kmem", "Display the kernel object caches", mon_kmem },
+	{ "swapstat", "Display how much is swapped out, and the page-out counters", mon_swapstat },
+	{ "pageage", "Display how many user pages are hot and cold, and the coldest", mon_pageage },
+	{ "merge", "Display how many user pages same-page merging has saved", mon_merge },
+	{ "latency", "Display or reset the longest each CPU kept interrupts off", mon_latency },
+	{ "memstat", "Display how much memory each env has mapped", mon_memstat },
+	{ "ps", "Display the envs, with the CPU time each has used", mon_ps },
+	{ "top", "Display the busiest envs since the last look, once or live", mon_top },
+	{ "bench", "Time page, page table, env and trap primitives", mon_bench },
+	{ "selftest", "Run the allocators' self-checks, all or those named", mon_selftest },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -108,8 +161,14 @@ mon_showmappings(int argc, char **argv, struct Trapframe *tf)
             {
                 pte = pgdir_walk(boot_pgdir, (void *)i, 0);
                 cprintf("%C0x%x %C- %C0x%x    ", COLOR_GRN, i, COLOR_CYN, COLOR_GRN, i + PGSIZE);
-                if (pte != NULL && (*pte & PTE_P)) {
+                if (pte != NULL && (*pte & PTE_P) && (*pte & PTE_PS)) {
+                    // pgdir_walk handed back a 4MB PDE
+                    cprintf("%Cmapped %C0x%x %C(4MB)  ", COLOR_YLW, COLOR_PUR,
+                        PTE_PS_ADDR(*pte) | (PTX(i) << PTXSHIFT), COLOR_YLW);
+                }
+                else if (pte != NULL && (*pte & PTE_P))
                     cprintf("%Cmapped %C0x%x  ", COLOR_YLW, COLOR_PUR, PTE_ADDR(*pte));
+                if (pte != NULL && (*pte & PTE_P)) {
                     if (*pte & PTE_U)
                         cprintf ("%Cuser: ", COLOR_BLK);
                     else
@@ -138,7 +197,7 @@ mon_alloc_page(int argc, char **argv, struct Trapframe *tf)
 {
     struct Page *page;
     if (page_alloc(&page) == 0) {
-        page->pp_ref += 1;
+        page_incref(page);
         cprintf("    %C0x%x\n%C", COLOR_GRN, page2pa(page), COLOR_CYN);
     }
     else
@@ -163,13 +222,30 @@ mon_free_page(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+// Print one place a page is mapped, for page_status
+static void
+page_status_mapping(pde_t *pgdir, uintptr_t va, void *arg)
+{
+    uint32_t i;
+    for (i = 0; i < env_ntable; i++)
+        if (envs[i].env_status != ENV_FREE && envs[i].env_pgdir == pgdir)
+            break;
+    if (i < env_ntable)
+        cprintf("    %Cmapped at %08x in env %08x\n", COLOR_GRN, va, envs[i].env_id);
+    else
+        cprintf("    %Cmapped at %08x in pgdir %08x\n", COLOR_GRN, va, pgdir);
+}
+
 int 
 mon_page_status(int argc, char **argv, struct Trapframe *tf)
 {
     if (argc == 2) {
         struct Page *page = pa2page(strtol(argv[1], 0, 0));
-        if (page->pp_ref > 0) 
-            cprintf("    %Callocated\n%C", COLOR_GRN, COLOR_CYN);
+        if (page->pp_ref > 0) {
+            cprintf("    %Callocated, %u refs\n", COLOR_GRN, page->pp_ref);
+            page_rmap_walk(page, page_status_mapping, NULL);
+            cprintf("%C", COLOR_CYN);
+        }
         else
             cprintf("    %Cfree\n%C", COLOR_GRN, COLOR_CYN);
     }
@@ -178,6 +254,551 @@ mon_page_status(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+    uint32_t i, j, large = 0, small = 0;
+    pte_t *pt;
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        tlb_cr3_loads = tlb_invlpgs = tlb_shootdowns = 0;
+        return 0;
+    }
+    if (argc != 1) {
+        cprintf("%CUsage: tlbstat [reset]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    // Count the global translations above UTOP; these are the entries
+    // that no longer have to be refilled after every CR3 load
+    for (i = PDX(UTOP); i < NPDENTRIES; i++) {
+        if (!(boot_pgdir[i] & PTE_P) || i == PDX(VPT) || i == PDX(UVPT))
+            continue;
+        if (boot_pgdir[i] & PTE_PS) {
+            if (boot_pgdir[i] & PTE_G)
+                large++;
+            continue;
+        }
+        pt = KADDR(PTE_ADDR(boot_pgdir[i]));
+        for (j = 0; j < NPTENTRIES; j++)
+            if ((pt[j] & (PTE_P | PTE_G)) == (PTE_P | PTE_G))
+                small++;
+    }
+    cprintf("%Cglobal pages: %C%s\n", COLOR_GRN, COLOR_YLW, (rcr4() & CR4_PGE) ? "on" : "off");
+    cprintf("%Ccr3 loads: %C%u\n", COLOR_GRN, COLOR_YLW, tlb_cr3_loads);
+    cprintf("%Cinvlpg flushes: %C%u\n", COLOR_GRN, COLOR_YLW, tlb_invlpgs);
+    cprintf("%Cshootdowns: %C%u\n", COLOR_GRN, COLOR_YLW, tlb_shootdowns);
+    cprintf("%Cglobal kernel mappings: %C%u x 4MB, %u x 4KB\n%C", COLOR_GRN, COLOR_YLW, large, small, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_syscallstat(int argc, char **argv, struct Trapframe *tf)
+{
+    uint32_t i, b;
+    struct Env *e;
+    struct SyscallStat *ss;
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        memset(sysstat, 0, NSYSCALLS * sizeof(struct SyscallStat));
+        return 0;
+    }
+    if (argc == 2) {
+        if (envid2env(strtol(argv[1], 0, 16), &e, 0) < 0) {
+            cprintf("%Cno env %s\n%C", COLOR_GRN, argv[1], COLOR_CYN);
+            return 0;
+        }
+        for (i = 0; i < NSYSCALLS; i++)
+            if (e->env_sc_count[i])
+                cprintf("%C%-22s %C%8u calls %12llu cycles\n", COLOR_GRN, syscall_name(i),
+                        COLOR_YLW, e->env_sc_count[i], e->env_sc_cycles[i]);
+        cprintf("%C", COLOR_CYN);
+        return 0;
+    }
+    if (argc != 1) {
+        cprintf("%CUsage: syscallstat [ENVID | reset]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    // One line per call made, then the non-empty histogram buckets as
+    // <2^n:count, the last also counting all longer calls
+    for (i = 0; i < NSYSCALLS; i++) {
+        ss = &sysstat[i];
+        if (!ss->ss_count)
+            continue;
+        cprintf("%C%-22s %C%8u calls %8u returned %8llu cycles avg\n ", COLOR_GRN, syscall_name(i),
+                COLOR_YLW, ss->ss_count, ss->ss_returns,
+                ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0);
+        for (b = 0; b < SYSSTAT_NHIST; b++)
+            if (ss->ss_hist[b])
+                cprintf(" <2^%u:%u", b + SYSSTAT_SHIFT, ss->ss_hist[b]);
+        cprintf("\n");
+    }
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_ipcstat(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 2 && strcmp(argv[1], "reset") == 0)
+        ipcstat_reset();
+    else if (argc <= 2) {
+        cprintf("%C", COLOR_YLW);
+        ipcstat_dump(argc == 2 ? strtol(argv[1], 0, 0) : 20);
+        cprintf("%C", COLOR_CYN);
+    }
+    else
+        cprintf("%CUsage: ipcstat [reset | NPAIRS]\n%C", COLOR_GRN, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 2 && strcmp(argv[1], "on") == 0)
+        prof_on = 1;
+    else if (argc == 2 && strcmp(argv[1], "off") == 0)
+        prof_on = 0;
+    else if (argc == 2 && strcmp(argv[1], "reset") == 0)
+        prof_reset();
+    else if (argc == 1 || (argc == 2 && argv[1][0] >= '0' && argv[1][0] <= '9')) {
+        cprintf("%C", COLOR_YLW);
+        prof_dump(argc == 2 ? strtol(argv[1], 0, 0) : 20);
+        cprintf("%C", COLOR_CYN);
+    }
+    else
+        cprintf("%CUsage: prof [on | off | reset | NFUNCS]\n%C", COLOR_GRN, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_trace(int argc, char **argv, struct Trapframe *tf)
+{
+    uint32_t mask, t;
+    int i;
+    if (argc >= 2 && strcmp(argv[1], "on") == 0) {
+        // Just the events named, or all of them
+        mask = argc == 2 ? (1 << NTRACE) - 1 : 0;
+        for (i = 2; i < argc; i++) {
+            for (t = 0; t < NTRACE; t++)
+                if (strcmp(argv[i], trace_name(t)) == 0)
+                    break;
+            if (t == NTRACE) {
+                cprintf("%Ctrace: no event %s\n%C", COLOR_RED, argv[i], COLOR_CYN);
+                return 0;
+            }
+            mask |= 1 << t;
+        }
+        trace_enable(mask);
+    }
+    else if (argc == 2 && strcmp(argv[1], "off") == 0)
+        trace_enable(0);
+    else if (argc == 2 && strcmp(argv[1], "reset") == 0)
+        trace_reset();
+    else if (argc == 1 || (argc == 2 && argv[1][0] >= '0' && argv[1][0] <= '9')) {
+        cprintf("%C", COLOR_YLW);
+        trace_dump(argc == 2 ? strtol(argv[1], 0, 0) : 20);
+        cprintf("%C", COLOR_CYN);
+    }
+    else {
+        cprintf("%CUsage: trace [on [EVENT...] | off | reset | NEVENTS]\n  events:", COLOR_GRN);
+        for (t = 0; t < NTRACE; t++)
+            cprintf(" %s", trace_name(t));
+        cprintf("\n%C", COLOR_CYN);
+    }
+    return 0;
+}
+
+int
+mon_pmc(int argc, char **argv, struct Trapframe *tf)
+{
+    struct Env *e;
+    uint64_t *count = pmc_total;
+    int i;
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        memset(pmc_total, 0, sizeof(pmc_total));
+        return 0;
+    }
+    if (argc > 2) {
+        cprintf("%CUsage: pmc [ENVID | reset]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    if (pmc_n == 0) {
+        cprintf("%Cno architectural performance counters\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    if (argc == 2) {
+        if (envid2env(strtol(argv[1], 0, 16), &e, 0) < 0) {
+            cprintf("%Cno env %s\n%C", COLOR_GRN, argv[1], COLOR_CYN);
+            return 0;
+        }
+        count = e->env_pmc;
+    }
+    // Up to the last switch: what the running envs counted since is
+    // still in the counters
+    for (i = 0; i < pmc_n; i++)
+        cprintf("%C%-14s %C%16llu\n", COLOR_GRN, pmc_name(i), COLOR_YLW, count[i]);
+    if (pmc_n > PMC_INSTRS && count[PMC_INSTRS])
+        cprintf("%Ccycles per instruction: %C%llu.%02llu\n", COLOR_GRN, COLOR_YLW,
+                count[PMC_CYCLES] / count[PMC_INSTRS],
+                count[PMC_CYCLES] * 100 / count[PMC_INSTRS] % 100);
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_timer(int argc, char **argv, struct Trapframe *tf)
+{
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "tickless") == 0)
+            timer_tickless = 1;
+        else if (strcmp(argv[i], "ticking") == 0)
+            timer_tickless = 0;
+        else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+            if (kclock_set_hz(strtol(argv[i], 0, 0)) < 0)
+                cprintf("%Ctimer: rate must be %d to %d Hz\n%C", COLOR_RED,
+                        TIMER_MIN_HZ, TIMER_MAX_HZ, COLOR_CYN);
+        }
+        else {
+            cprintf("%CUsage: timer [HZ] [tickless | ticking]\n%C", COLOR_GRN, COLOR_CYN);
+            return 0;
+        }
+    }
+    cprintf("%C%u Hz, %s idle\n%C", COLOR_YLW, timer_hz,
+            timer_tickless ? "tickless" : "ticking", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+    static struct spinlock *locks[] = {
+        &kernel_lock, &env_table_lock, &addrwait_lock, &sched_lock,
+        &page_lock, &cons_lock, &klog_lock,
+    };
+    uint32_t i, acquired = 0, contended = 0;
+    if (argc != 1) {
+        cprintf("%CUsage: locks\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    for (i = 0; i < sizeof(locks) / sizeof(locks[0]); i++)
+        cprintf("%C%-16s %C%10u acquired %10u contended\n", COLOR_GRN, locks[i]->name,
+                COLOR_YLW, locks[i]->nacquired, locks[i]->ncontended);
+    // The per-env locks, summed
+    for (i = 0; i < NENV; i++) {
+        acquired += env_locks[i].nacquired;
+        contended += env_locks[i].ncontended;
+    }
+    cprintf("%C%-16s %C%10u acquired %10u contended\n%C", COLOR_GRN, "env_lock (all)",
+            COLOR_YLW, acquired, contended, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+    cprintf("%C", COLOR_YLW);
+    kmem_dump();
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_swapstat(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc != 1) {
+        cprintf("%CUsage: swapstat\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    if (swap_nslots == 0) {
+        cprintf("%Cno swap disk\n%C", COLOR_YLW, COLOR_CYN);
+        return 0;
+    }
+    cprintf("%Cswap slots: %C%u of %u in use\n", COLOR_GRN, COLOR_YLW, swap_nused, swap_nslots);
+    cprintf("%Cpaged out: %C%u\n", COLOR_GRN, COLOR_YLW, swap_outs);
+    cprintf("%Cpaged in: %C%u\n%C", COLOR_GRN, COLOR_YLW, swap_ins, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_pageage(int argc, char **argv, struct Trapframe *tf)
+{
+    // Ages up to each bound, in sweeps; the last is everything older
+    static const uint32_t bounds[] = { 0, 1, 3, 7, 15, ~0U };
+    static const char *names[] = { "hot", "1", "2-3", "4-7", "8-15", "cold 16+" };
+    uint32_t counts[sizeof(bounds) / sizeof(bounds[0])] = { 0 };
+    struct Page *cold[16];
+    uint32_t i, j, n = 0;
+    if (argc > 2 || (argc == 2 && (n = strtol(argv[1], NULL, 0)) > 16)) {
+        cprintf("%CUsage: pageage [NCOLDEST <= 16]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    for (i = 0; i < npage; i++) {
+        if (pages[i].pp_ref == 0 || pages[i].pp_atime == 0)
+            continue;
+        for (j = 0; page_age(&pages[i]) > bounds[j]; j++)
+            ;
+        counts[j]++;
+    }
+    cprintf("%Csweeps: %C%u\n", COLOR_GRN, COLOR_YLW, age_nsweeps);
+    for (j = 0; j < sizeof(bounds) / sizeof(bounds[0]); j++)
+        cprintf("%C%-10s %C%u pages\n", COLOR_GRN, names[j], COLOR_YLW, counts[j]);
+    n = age_coldest(cold, n);
+    for (i = 0; i < n; i++)
+        cprintf("%Cpa %08x: %Cage %u, %u refs\n", COLOR_GRN, page2pa(cold[i]),
+                COLOR_YLW, page_age(cold[i]), cold[i]->pp_ref);
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_merge(int argc, char **argv, struct Trapframe *tf)
+{
+    uint32_t i, nshared = 0, saved = 0;
+    if (!PAGE_MERGE)
+        cprintf("%C(built without PAGE_MERGE)\n", COLOR_GRN);
+    // A shared copy mapped n times saves n - 1 pages
+    for (i = 0; i < npage; i++)
+        if (pages[i].pp_merged && pages[i].pp_ref > 0) {
+            nshared++;
+            saved += pages[i].pp_ref - 1;
+        }
+    cprintf("%Cmerged: %C%u pages into shared copies, %u into the zero page\n",
+            COLOR_GRN, COLOR_YLW, merge_nmerged, merge_nzero);
+    cprintf("%Cshared now: %C%u copies, saving %u pages (%uKB)\n%C", COLOR_GRN,
+            COLOR_YLW, nshared, saved, saved * PGSIZE / 1024, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_latency(int argc, char **argv, struct Trapframe *tf)
+{
+    int i;
+    uint64_t us;
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+        cprintf("%CUsage: latency [reset]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    for (i = 0; i < ncpu; i++) {
+        if (argc == 2) {
+            cpus[i].cpu_ioff_max = 0;
+            continue;
+        }
+        us = kinfo->ki_tsc_hz ? cpus[i].cpu_ioff_max * 1000000 / kinfo->ki_tsc_hz : 0;
+        cprintf("%CCPU %d: %C%llu cycles (%llu us) with interrupts off, at most\n",
+                COLOR_GRN, i, COLOR_YLW, cpus[i].cpu_ioff_max, us);
+    }
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf)
+{
+    uint32_t i, npages = 0, nptpages = 0;
+    struct Env *e;
+    if (argc != 1) {
+        cprintf("%CUsage: memstat\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    cprintf("%Cenv       pages    shared   ptables  KB       quota\n", COLOR_GRN);
+    for (i = 0; i < env_ntable; i++) {
+        e = &envs[i];
+        if (e->env_status == ENV_FREE)
+            continue;
+        cprintf("%C%08x  %C%-8u %-8u %-8u %-8u ", COLOR_GRN, e->env_id, COLOR_YLW,
+                e->env_npages, e->env_nshared, e->env_nptpages,
+                (e->env_npages + e->env_nptpages + 1) * (PGSIZE / 1024));
+        if (e->env_page_quota != 0)
+            cprintf("%u\n", e->env_page_quota);
+        else
+            cprintf("-\n");
+        npages += e->env_npages;
+        nptpages += e->env_nptpages;
+    }
+    // Pages mapped in several envs count in each
+    cprintf("%Ctotal     %C%-8u          %-8u\n%C", COLOR_GRN, COLOR_YLW, npages, nptpages, COLOR_CYN);
+    return 0;
+}
+
+int
+mon_ps(int argc, char **argv, struct Trapframe *tf)
+{
+    static const char *status[] = { "free", "runnable", "blocked", "dying" };
+    uint64_t utime = 0, stime = 0;
+    uint32_t i;
+    struct Env *e;
+    if (argc != 1) {
+        cprintf("%CUsage: ps\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    cprintf("%Cenv       parent    status    prio cpu runs       user cycles      kernel cycles\n", COLOR_GRN);
+    for (i = 0; i < env_ntable; i++) {
+        e = &envs[i];
+        if (e->env_status == ENV_FREE)
+            continue;
+        cprintf("%C%08x  %C%08x  %-9s %-4d %-3d %-10u %-16llu %llu\n", COLOR_GRN, e->env_id,
+                COLOR_YLW, e->env_parent_id, status[e->env_status], e->env_priority,
+                e->env_cpunum, e->env_runs, e->env_utime, e->env_stime);
+        utime += e->env_utime;
+        stime += e->env_stime;
+    }
+    cprintf("%C%-50s%C%-16llu %llu\n%C", COLOR_GRN, "total", COLOR_YLW, utime, stime, COLOR_CYN);
+    return 0;
+}
+
+// top: what each env did since the previous top, found by keeping a
+// copy of its counters then.  An env freed and reallocated since has a
+// new env_id, and counts from zero.
+struct Top_sample {
+    envid_t ts_id;
+    uint32_t ts_runs;
+    uint32_t ts_ipcs;
+    uint32_t ts_faults;
+    uint64_t ts_cycles;
+};
+
+#define TOP_INTERVAL    (1ULL << 31)    // cycles between live samples, about a second
+
+static struct Top_sample top_samples[NENV];
+static uint64_t top_tsc;                // rdtsc at the previous sample
+static int top_live;                    // envs to show live, or 0
+static uint64_t top_cycles[NENV];       // this sample's deltas, for sorting
+
+static uint32_t
+top_ipcs(struct Env *e)
+{
+    return e->env_sc_count[SYS_ipc_try_send] + e->env_sc_count[SYS_ipc_send]
+        + e->env_sc_count[SYS_ipc_call] + e->env_sc_count[SYS_ipc_reply_wait];
+}
+
+static void
+top_show(int n)
+{
+    static uint32_t order[NENV];
+    uint64_t now = read_tsc(), elapsed = now - top_tsc;
+    struct Top_sample *ts;
+    struct Env *e;
+    uint32_t i, j, k, nenv = 0;
+
+    // Deltas since the last sample, and the envs by them, busiest first
+    for (i = 0; i < env_ntable; i++) {
+        e = &envs[i];
+        if (e->env_status == ENV_FREE)
+            continue;
+        if (top_samples[i].ts_id != e->env_id)
+            memset(&top_samples[i], 0, sizeof(top_samples[i]));
+        top_cycles[i] = e->env_utime + e->env_stime - top_samples[i].ts_cycles;
+        for (j = nenv++; j > 0 && top_cycles[order[j - 1]] < top_cycles[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    cprintf("%C%u envs, %llu Mcycles since the last sample\n", COLOR_GRN, nenv, elapsed >> 20);
+    cprintf("env       %%cpu  runs     ipcs     faults   KB       Mcycles\n");
+    for (k = 0; k < nenv && k < (uint32_t) n; k++) {
+        i = order[k];
+        e = &envs[i];
+        ts = &top_samples[i];
+        cprintf("%C%08x  %C%-5llu %-8u %-8u %-8u %-8u %llu\n", COLOR_GRN, e->env_id, COLOR_YLW,
+                elapsed ? top_cycles[i] * 100 / elapsed : 0, e->env_runs - ts->ts_runs,
+                top_ipcs(e) - ts->ts_ipcs, e->env_kfaults + e->env_ufaults - ts->ts_faults,
+                (e->env_npages + e->env_nptpages + 1) * (PGSIZE / 1024),
+                (e->env_utime + e->env_stime) >> 20);
+    }
+    cprintf("%C", COLOR_CYN);
+
+    for (i = 0; i < env_ntable; i++) {
+        e = &envs[i];
+        ts = &top_samples[i];
+        ts->ts_id = e->env_id;
+        ts->ts_runs = e->env_runs;
+        ts->ts_ipcs = top_ipcs(e);
+        ts->ts_faults = e->env_kfaults + e->env_ufaults;
+        ts->ts_cycles = e->env_utime + e->env_stime;
+    }
+    top_tsc = now;
+}
+
+// Called as the monitor is entered: if top is live and it's time, show
+// it again.  True if the monitor should go straight back, since nobody
+// has pressed a key.
+static bool
+top_refresh(struct Trapframe *tf)
+{
+    // Only the idle env's breakpoint: another env's is for debugging
+    if (!top_live || tf == NULL || curenv != &envs[0])
+        return 0;
+    if (cons_pending()) {
+        top_live = 0;
+        return 0;
+    }
+    if (read_tsc() - top_tsc >= TOP_INTERVAL)
+        top_show(top_live);
+    return 1;
+}
+
+int
+mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+    bool live = argc >= 2 && strcmp(argv[1], "live") == 0;
+    int n = 10;
+    if (argc > 2 + live || (argc == 2 + live && (n = strtol(argv[1 + live], 0, 0)) <= 0)) {
+        cprintf("%CUsage: top [live] [NENVS]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    top_show(n);
+    if (!live)
+        return 0;
+    // Live, we leave the monitor so the envs run, and show top again
+    // each time the idle env breaks back in, until a key is pressed.
+    // That needs an idle env, and a ticking timer to run it.
+    if (tf == NULL || curenv != &envs[0]) {
+        cprintf("%Ctop: live only when the monitor is entered from the idle env\n%C",
+                COLOR_RED, COLOR_CYN);
+        return 0;
+    }
+    top_live = n;
+    return -1;
+}
+
+int
+mon_bench(int argc, char **argv, struct Trapframe *tf)
+{
+    int n = 64;
+    if (argc > 2 || (argc == 2 && (n = strtol(argv[1], 0, 0)) <= 0)) {
+        cprintf("%CUsage: bench [CALLS]\n%C", COLOR_GRN, COLOR_CYN);
+        return 0;
+    }
+    cprintf("%C", COLOR_YLW);
+    pmap_bench(n);
+    cprintf("%C", COLOR_CYN);
+    return 0;
+}
+
+int
+mon_selftest(int argc, char **argv, struct Trapframe *tf)
+{
+    const char *name;
+    int i;
+    // The checks take all the free memory for a while; no other CPU
+    // may be allocating meanwhile
+    for (i = 0; i < ncpu; i++)
+        if (i != cpunum() && cpus[i].cpu_status != CPU_HALTED) {
+            cprintf("%Cselftest: CPU %d is running envs\n%C", COLOR_RED, i, COLOR_CYN);
+            return 0;
+        }
+    for (i = 1; i < argc; i++)
+        if (selftest_run(argv[i]) < 0) {
+            cprintf("%CUsage: selftest [TEST...]\n  tests:", COLOR_GRN);
+            for (i = 0; (name = selftest_name(i)) != NULL; i++)
+                cprintf(" %s", name);
+            cprintf("\n%C", COLOR_CYN);
+            return 0;
+        }
+    if (argc == 1)
+        selftest_run(NULL);
+    return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -227,6 +848,9 @@ monitor(struct Trapframe *tf)
 {
 	char *buf;
 
+	if (top_refresh(tf))
+		return;
+
 	cprintf("%CWelcome to the JOS kernel monitor!\n", COLOR_PUR);
 	cprintf("%CType 'help' for a list of commands.\n%C", COLOR_BLK, COLOR_CYN);
 
@@ -242,6 +866,8 @@ monitor(struct Trapframe *tf)
 			if (runcmd(buf, tf) < 0)
 				break;
 	}
+	// Waiting for us to type isn't the kernel keeping interrupts out
+	cpu_ioff_start();
 }
 
 // return EIP of caller.
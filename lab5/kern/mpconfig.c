@@ -0,0 +1,354 @@
+// Find the processors: search the BIOS for the MultiProcessor
+// Specification's configuration table, or failing that for the ACPI
+// MADT, and fill in cpus[], ncpu, bootcpu and lapicaddr from it.
+// See http://developer.intel.com/design/pentium/datashts/24201606.pdf
+// and the ACPI specification, section 5.2.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+struct Cpu cpus[NCPU];
+struct Cpu *bootcpu;
+int ncpu;
+
+// Per-CPU kernel stacks
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_EN   0x01                // This mpproc is usable
+#define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+
+// See the ACPI Specification, 5.2.5 and following
+
+struct acpi_rsdp {      // root system description pointer [ACPI 5.2.5.3]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdt;                // phys addr of the RSDT
+} __attribute__((__packed__));
+
+struct acpi_sdt {       // common table header [ACPI 5.2.6]
+	uint8_t signature[4];
+	uint32_t length;                // total table length
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtable[8];
+	uint32_t oemrevision;
+	uint32_t creator;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct acpi_madt {      // multiple APIC description table [ACPI 5.2.12]
+	struct acpi_sdt header;         // "APIC"
+	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t flags;
+	uint8_t entries[0];             // interrupt controller structures
+} __attribute__((__packed__));
+
+struct acpi_madt_lapic { // processor local APIC [ACPI 5.2.12.2]
+	uint8_t type;                   // 0
+	uint8_t length;                 // 8
+	uint8_t acpiid;                 // ACPI processor id
+	uint8_t apicid;                 // local APIC id
+	uint32_t flags;                 // bit 0: enabled
+} __attribute__((__packed__));
+
+#define MADT_LAPIC	0x00
+
+
+// Physical memory the firmware left its tables in, if it's inside the
+// KERNBASE direct map.  (KADDR won't do: ACPI tables usually sit at the
+// end of memory, which i386_detect_memory may not have counted.)
+static void *
+fw_kaddr(physaddr_t pa, size_t len)
+{
+	if (pa >= -KERNBASE || len > -KERNBASE - pa)
+		return NULL;
+	return (void *) (pa + KERNBASE);
+}
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *)addr)[i];
+	return sum;
+}
+
+// Look for a 'siglen'-byte signature of a 'len'-byte structure with a
+// checksum, 16-byte aligned, in the 'size' bytes at physical address a.
+static void *
+fw_search1(physaddr_t a, int size, const char *sig, int siglen, int len)
+{
+	uint8_t *p, *e;
+
+	p = KADDR(a);
+	e = KADDR(a + size);
+	for (; p + len <= e; p += 16)
+		if (memcmp(p, sig, siglen) == 0 && sum(p, len) == 0)
+			return p;
+	return NULL;
+}
+
+// The MP floating pointer and ACPI's RSDP are both in one of:
+// 1) the first KB of the EBDA;
+// 2) if there is no EBDA, the last KB of system base memory;
+// 3) the BIOS ROM between 0xE0000 and 0xFFFFF.
+static void *
+fw_search(const char *sig, int siglen, int len)
+{
+	uint8_t *bda;
+	uint32_t p;
+	void *found;
+
+	static_assert(sizeof(struct mp) == 16);
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) KADDR(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((found = fw_search1(p, 1024, sig, siglen, len)))
+			return found;
+	} else {
+		// The size of base memory, in KB is in the two bytes
+		// starting at 0x13 of the BDA.
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((found = fw_search1(p - 1024, 1024, sig, siglen, len)))
+			return found;
+	}
+	return fw_search1(0xE0000, 0x20000, sig, siglen, len);
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = fw_search("_MP_", 4, sizeof(*mp))) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = fw_kaddr(mp->physaddr, sizeof(*conf));
+	if (conf == NULL || memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	if (fw_kaddr(mp->physaddr, conf->length) == NULL
+	    || sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	if (fw_kaddr(mp->physaddr + conf->length, conf->xlength) == NULL
+	    || (sum((uint8_t *)conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+// Note a processor with local APIC ID 'apicid'.  cpunum() reads the
+// APIC ID, so cpus[] is indexed by it, and APIC IDs must run 0, 1, ...
+static void
+mp_addcpu(uint8_t apicid, bool isboot)
+{
+	if (apicid != ncpu || ncpu == NCPU) {
+		cprintf("SMP: ignoring CPU with APIC ID %d\n", apicid);
+		return;
+	}
+	if (isboot)
+		bootcpu = &cpus[ncpu];
+	cpus[ncpu].cpu_id = apicid;
+	ncpu++;
+}
+
+// Find the processors in the MP configuration table.  Returns 0 if
+// there is none.
+static int
+mp_init_mptable(void)
+{
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	uint8_t *p;
+	unsigned int i;
+
+	if ((conf = mpconfig(&mp)) == 0)
+		return 0;
+	lapicaddr = conf->lapicaddr;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *)p;
+			if (proc->flags & MPPROC_EN)
+				mp_addcpu(proc->apicid, proc->flags & MPPROC_BOOT);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+		case MPIOAPIC:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("SMP: unknown config type %x\n", *p);
+			ncpu = 0;
+			return 0;
+		}
+	}
+
+	if (mp->imcrp) {
+		// [MP 3.2.6.1] If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		cprintf("SMP: Setting IMCR to switch from PIC mode to symmetric I/O mode\n");
+		outb(0x22, 0x70);   // Select IMCR
+		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
+	}
+	return 1;
+}
+
+// Find the processors in the ACPI MADT.  Returns 0 if there is none.
+// The MADT doesn't say which processor is the BSP, but we're running
+// on it, and CPUID tells us our initial APIC ID.
+static int
+mp_init_acpi(void)
+{
+	struct acpi_rsdp *rsdp;
+	struct acpi_sdt *rsdt, *sdt;
+	struct acpi_madt *madt = NULL;
+	struct acpi_madt_lapic *lp;
+	uint32_t *ent, ebx;
+	uint8_t *p, *e;
+	int i, n;
+
+	if ((rsdp = fw_search("RSD PTR ", 8, 20)) == NULL)
+		return 0;
+	if ((rsdt = fw_kaddr(rsdp->rsdt, sizeof(*rsdt))) == NULL
+	    || memcmp(rsdt, "RSDT", 4) != 0
+	    || fw_kaddr(rsdp->rsdt, rsdt->length) == NULL
+	    || sum(rsdt, rsdt->length) != 0) {
+		cprintf("SMP: Bad ACPI RSDT\n");
+		return 0;
+	}
+
+	ent = (uint32_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / sizeof(uint32_t);
+	for (i = 0; i < n && madt == NULL; i++) {
+		sdt = fw_kaddr(ent[i], sizeof(*sdt));
+		if (sdt && memcmp(sdt, "APIC", 4) == 0
+		    && fw_kaddr(ent[i], sdt->length) && sum(sdt, sdt->length) == 0)
+			madt = (struct acpi_madt *) sdt;
+	}
+	if (madt == NULL)
+		return 0;
+
+	cpuid(1, NULL, &ebx, NULL, NULL);
+	lapicaddr = madt->lapicaddr;
+	p = madt->entries;
+	e = (uint8_t *) madt + madt->header.length;
+	for (; p + 2 <= e && p[1] >= 2; p += p[1]) {
+		if (p[0] != MADT_LAPIC)
+			continue;
+		lp = (struct acpi_madt_lapic *) p;
+		if (lp->flags & 1)
+			mp_addcpu(lp->apicid, lp->apicid == ebx >> 24);
+	}
+	return 1;
+}
+
+void
+mp_init(void)
+{
+	bootcpu = &cpus[0];
+	bootcpu->cpu_status = CPU_STARTED;
+	if (!mp_init_mptable() && !mp_init_acpi()) {
+		ncpu = 1;
+		return;
+	}
+	if (ncpu == 0 || bootcpu != &cpus[0]) {
+		// Didn't like what we found; fall back to no MP.  The BSP
+		// has to be CPU 0, which is what cpunum() says before the
+		// LAPIC is mapped.
+		ncpu = 1;
+		lapicaddr = 0;
+		bootcpu = &cpus[0];
+		cprintf("SMP: configuration not found, SMP disabled\n");
+		return;
+	}
+	cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_id, ncpu);
+}
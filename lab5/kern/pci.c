@@ -0,0 +1,136 @@
+// PCI enumeration.
+//
+// pci_init walks bus 0 through configuration mechanism #1 and hands
+// each function it finds to the driver in pci_drivers that matches its
+// vendor and product, or else to the one in pci_class_drivers that
+// matches its class.  We don't follow bridges to other buses: the
+// emulators put everything we drive on bus 0.
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <kern/pci.h>
+#include <kern/e1000.h>
+#include <kern/ahci.h>
+
+static struct pci_driver pci_drivers[] = {
+	{ E1000_VENDOR, E1000_PRODUCT, e1000_attach },
+	{ 0, 0, 0 },
+};
+
+static struct pci_class_driver pci_class_drivers[] = {
+	{ PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, ahci_attach },
+	{ 0, 0, 0 },
+};
+
+static void
+pci_conf_addr(struct pci_func *f, uint32_t off)
+{
+	assert(f->dev < PCI_MAX_DEVS && f->func < PCI_MAX_FUNCS);
+	assert(off < 256 && (off & 3) == 0);
+	outl(PCI_CONF_ADDR, (1 << 31) | (f->dev << 11) | (f->func << 8) | off);
+}
+
+uint32_t
+pci_conf_read(struct pci_func *f, uint32_t off)
+{
+	pci_conf_addr(f, off);
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v)
+{
+	pci_conf_addr(f, off);
+	outl(PCI_CONF_DATA, v);
+}
+
+void
+pci_func_enable(struct pci_func *f)
+{
+	uint32_t bar, off, old, rv, size, base;
+	int regnum;
+
+	pci_conf_write(f, PCI_COMMAND_STATUS_REG,
+		       PCI_COMMAND_IO_ENABLE | PCI_COMMAND_MEM_ENABLE |
+		       PCI_COMMAND_MASTER_ENABLE);
+
+	// A BAR's size is the complement of what sticks when we write
+	// all ones to it
+	for (bar = 0; bar < PCI_NBARS; bar++) {
+		off = PCI_BAR_REG(bar);
+		old = pci_conf_read(f, off);
+		pci_conf_write(f, off, 0xFFFFFFFF);
+		rv = pci_conf_read(f, off);
+		pci_conf_write(f, off, old);
+		if (rv == 0)
+			continue;
+
+		regnum = bar;
+		if (rv & PCI_BAR_IO) {
+			size = ~PCI_BAR_IO_ADDR(rv) + 1;
+			base = PCI_BAR_IO_ADDR(old);
+		} else {
+			size = ~PCI_BAR_MEM_ADDR(rv) + 1;
+			base = PCI_BAR_MEM_ADDR(old);
+			// The high half of a 64-bit BAR is the next one;
+			// we only handle addresses under 4GB
+			if (PCI_BAR_MEM_TYPE(rv) == PCI_BAR_MEM_64BIT)
+				bar++;
+		}
+		f->reg_base[regnum] = base;
+		f->reg_size[regnum] = size;
+	}
+	cprintf("PCI: %02x.%x: %04x:%04x enabled, region 0 at 0x%x (%d bytes), irq %d\n",
+		f->dev, f->func, PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id),
+		f->reg_base[0], f->reg_size[0], f->irq_line);
+}
+
+static void
+pci_attach(struct pci_func *f)
+{
+	struct pci_driver *d;
+	struct pci_class_driver *c;
+	int (*attach)(struct pci_func *) = 0;
+	int r;
+
+	for (d = pci_drivers; d->attach && !attach; d++)
+		if (d->vendor == PCI_VENDOR(f->dev_id)
+		    && d->product == PCI_PRODUCT(f->dev_id))
+			attach = d->attach;
+	for (c = pci_class_drivers; c->attach && !attach; c++)
+		if (c->class == PCI_CLASS(f->dev_class)
+		    && c->subclass == PCI_SUBCLASS(f->dev_class))
+			attach = c->attach;
+	if (attach && (r = attach(f)) < 0)
+		cprintf("PCI: %02x.%x: attach failed: %e\n", f->dev, f->func, r);
+}
+
+void
+pci_init(void)
+{
+	struct pci_func f;
+	uint32_t nfuncs;
+
+	memset(&f, 0, sizeof(f));
+	for (f.dev = 0; f.dev < PCI_MAX_DEVS; f.dev++) {
+		f.func = 0;
+		if (PCI_VENDOR(pci_conf_read(&f, PCI_ID_REG)) == 0xFFFF)
+			continue;
+		nfuncs = PCI_HDRTYPE_MULTIFN(pci_conf_read(&f, PCI_BHLC_REG))
+			? PCI_MAX_FUNCS : 1;
+		for (f.func = 0; f.func < nfuncs; f.func++) {
+			struct pci_func af;
+
+			memset(&af, 0, sizeof(af));
+			af.dev = f.dev;
+			af.func = f.func;
+			af.dev_id = pci_conf_read(&af, PCI_ID_REG);
+			if (PCI_VENDOR(af.dev_id) == 0xFFFF)
+				continue;
+			af.dev_class = pci_conf_read(&af, PCI_CLASS_REG);
+			af.irq_line = pci_conf_read(&af, PCI_INTERRUPT_REG) & 0xFF;
+			pci_attach(&af);
+		}
+	}
+}
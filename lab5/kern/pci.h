@@ -0,0 +1,80 @@
+#ifndef JOS_KERN_PCI_H
+#define JOS_KERN_PCI_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Configuration mechanism #1: write the address of a config register
+// to PCI_CONF_ADDR, then read or write it at PCI_CONF_DATA.
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+// Configuration space registers, as byte offsets
+#define PCI_ID_REG		0x00	// device ID << 16 | vendor ID
+#define PCI_COMMAND_STATUS_REG	0x04
+	#define PCI_COMMAND_IO_ENABLE		0x00000001
+	#define PCI_COMMAND_MEM_ENABLE		0x00000002
+	#define PCI_COMMAND_MASTER_ENABLE	0x00000004
+#define PCI_CLASS_REG		0x08	// class, subclass, interface, revision
+#define PCI_BHLC_REG		0x0C	// BIST, header type, latency, line size
+	#define PCI_HDRTYPE_MULTIFN(bhlc)	(((bhlc) >> 16) & 0x80)
+	#define PCI_HDRTYPE_TYPE(bhlc)		(((bhlc) >> 16) & 0x7F)
+#define PCI_BAR_REG(i)		(0x10 + 4 * (i))	// base address registers
+	#define PCI_BAR_IO			0x00000001
+	#define PCI_BAR_MEM_TYPE(bar)		(((bar) >> 1) & 3)
+	#define PCI_BAR_MEM_64BIT		2
+	#define PCI_BAR_MEM_ADDR(bar)		((bar) & ~0xF)
+	#define PCI_BAR_IO_ADDR(bar)		((bar) & ~0x3)
+#define PCI_INTERRUPT_REG	0x3C	// ..., interrupt pin, interrupt line
+
+#define PCI_VENDOR(id)		((id) & 0xFFFF)
+#define PCI_PRODUCT(id)		(((id) >> 16) & 0xFFFF)
+#define PCI_CLASS(class)	(((class) >> 24) & 0xFF)
+#define PCI_SUBCLASS(class)	(((class) >> 16) & 0xFF)
+
+#define PCI_MAX_DEVS	32	// devices on a bus
+#define PCI_MAX_FUNCS	8	// functions of a device
+#define PCI_NBARS	6
+
+// One function of a device on bus 0, the only bus we look at
+struct pci_func {
+	uint32_t dev;
+	uint32_t func;
+
+	uint32_t dev_id;	// PCI_ID_REG
+	uint32_t dev_class;	// PCI_CLASS_REG
+
+	// The base addresses and sizes of its memory or I/O regions, as
+	// pci_func_enable found them; 0 for a BAR that isn't there
+	uint32_t reg_base[PCI_NBARS];
+	uint32_t reg_size[PCI_NBARS];
+	uint8_t irq_line;
+};
+
+// A driver, attached to the functions with this vendor and product ID
+struct pci_driver {
+	uint16_t vendor;
+	uint16_t product;
+	int (*attach)(struct pci_func *pcif);
+};
+
+// A driver for the functions of this class and subclass, for devices
+// with a standard interface, whoever makes them
+struct pci_class_driver {
+	uint8_t class;
+	uint8_t subclass;
+	int (*attach)(struct pci_func *pcif);
+};
+
+// Find the functions on bus 0 and attach the drivers that want them.
+void pci_init(void);
+// Turn on f's memory and I/O decoding and its bus mastering, and fill
+// in f's reg_base[] and reg_size[].
+void pci_func_enable(struct pci_func *f);
+
+uint32_t pci_conf_read(struct pci_func *f, uint32_t off);
+void pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v);
+
+#endif	// !JOS_KERN_PCI_H
@@ -83,3 +83,31 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+// Mask or unmask the one IRQ, quietly: for a PCI device's IRQ, which
+// irq_signal_pci masks each time it comes in.
+void
+irq_set_masked(int irq, bool masked)
+{
+	if (masked)
+		irq_mask_8259A |= 1 << irq;
+	else
+		irq_mask_8259A &= ~(1 << irq);
+	if (!didinit)
+		return;
+	if (irq < 8)
+		outb(IO_PIC1+1, (char)irq_mask_8259A);
+	else
+		outb(IO_PIC2+1, (char)(irq_mask_8259A >> 8));
+}
+
+
+// Acknowledge 'irq' once it has been handled.  The master runs in
+// automatic EOI mode, but the slave does not, so IRQs 8-15 need an
+// explicit non-specific EOI (OCW2 0x20) there before it will raise them
+// again.
+void
+irq_eoi(int irq)
+{
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+}
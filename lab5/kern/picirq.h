@@ -24,6 +24,8 @@
 extern uint16_t irq_mask_8259A;
 void pic_init(void);
 void irq_setmask_8259A(uint16_t mask);
+void irq_eoi(int irq);
+void irq_set_masked(int irq, bool masked);
 
 #endif // !__ASSEMBLER__
 
@@ -9,20 +9,97 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/syscall.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
+#include <kern/swap.h>
+#include <kern/merge.h>
+#include <kern/slab.h>
+#include <kern/trace.h>
+#include <kern/ktimer.h>
+#include <kern/trap.h>
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
 size_t npage;			// Amount of physical memory (in pages)
 static size_t basemem;		// Amount of base memory (in bytes)
 static size_t extmem;		// Amount of extended memory (in bytes)
+static struct E820_entry e820_map[E820_MAXENT];	// the BIOS's memory map,
+static int e820_n;		// if boot.S got one
 
 // These variables are set in i386_vm_init()
 pde_t* boot_pgdir;		// Virtual address of boot time page directory
+static int pte_g;		// PTE_G for kernel mappings, if the CPU has it
+static bool kern_pdes_fixed;	// every kernel page table has been made
 physaddr_t boot_cr3;		// Physical address of boot time page directory
+struct Page *zero_page;		// all zeros, mapped but never written
 static char* boot_freemem;	// Pointer to next byte of free mem
 
 struct Page* pages;		// Virtual address of physical page array
-static struct Page_list page_free_list;	// Free list of physical pages
+// Free lists of the buddy allocator: page_free_area[k] holds free blocks
+// of 2^k physically contiguous pages, each aligned to its own size.
+static struct Page_list page_free_area[PAGE_MAX_ORDER + 1];
+
+// Free memory above what the kernel took at boot goes on the free lists
+// only as it's wanted: page_init frees the pages below page_seed_next,
+// and when the lists run dry buddy_alloc has page_seed put the next
+// PAGE_SEED_BATCH whole 4MB blocks on them.  Pages past page_seed_next
+// are zeroed Page structs, which take part in no merging.
+#define PAGE_SEED_BATCH		4
+static ppn_t page_seed_next;
+
+static void buddy_insert(struct Page *pp, int order);
+static void buddy_free(struct Page *pp, int order);
+
+// With PAGE_COLORS, free single pages by color, page number mod
+// PAGE_COLORS, for page_alloc_at: an aligned run of PAGE_COLORS pages,
+// one of each color, comes off the buddy lists whenever the color
+// wanted has none.  Like magazine pages they're off the buddy lists,
+// and they go back when buddy_alloc finds nothing else.  Guarded by
+// page_lock.
+#if PAGE_COLORS
+static struct Page_list page_color_free[PAGE_COLORS];
+static uint32_t page_color_count;
+#endif
+static bool page_color_drain(void);
+
+// Pages zeroed ahead of time while the machine is idle, handed out first
+// by page_alloc_zeroed().  Pool pages are off the buddy free lists.
+#define PAGE_ZERO_POOL_MAX	128
+static struct Page_list page_zero_pool;
+static uint32_t page_zero_count;
+
+// Page tables env_free has emptied, every entry clear again, kept for
+// pgdir_walk to reuse as they are: no allocation and no zeroing.  Like
+// the zero pool they're off the buddy lists, and page_alloc takes them
+// when it has nothing else.
+#define PAGE_PT_CACHE_MAX	64
+static struct Page_list page_pt_cache;
+static uint32_t page_pt_count;
+
+// While set, page_alloc out of memory just fails, freeing nothing, for
+// the self-checks, which count on it (selftest_run)
+bool page_reclaim_off;
+
+// Guards the free lists, the zero pool and the page-table cache, and the
+// buddy state in the Page structs.  Reference counts are changed atomically instead.
+struct spinlock page_lock = SPINLOCK_INIT(page_lock);
+
+// Each CPU's magazine of free single pages, in front of the buddy lists:
+// page_alloc and page_free use it without page_lock, since only its own
+// CPU touches it, with interrupts off.  An empty magazine refills with
+// PAGE_MAG_BATCH pages at once and a full one gives PAGE_MAG_BATCH back,
+// so page_lock is taken once per batch.  Magazine pages are off the
+// buddy lists and don't coalesce until they go back.
+#define PAGE_MAG_SIZE	32
+#define PAGE_MAG_BATCH	16
+
+struct Page_magazine {
+	struct Page_list pm_pages;
+	uint32_t pm_count;
+};
+static struct Page_magazine page_mags[NCPU];
 
 // Global descriptor table.
 //
@@ -30,7 +107,7 @@ static struct Page_list page_free_list;	// Free list of physical pages
 // To load the SS register, the CPL must equal the DPL.  Thus,
 // we must duplicate the segments for the user and the kernel.
 //
-struct Segdesc gdt[] =
+struct Segdesc gdt[NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -47,8 +124,9 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in idt_init()
-	[GD_TSS >> 3] = SEG_NULL
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in trap_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -61,19 +139,75 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+// Copy the map boot.S left at E820_MAP, if it left one, and return the
+// top of the RAM it lists.  It's read before page_init can hand the
+// page out, through the mapping entry.S made of the first 4MB.
+static uint64_t
+e820_read(void)
+{
+	uint16_t end = *(uint16_t *) (KERNBASE + E820_MAP);
+	struct E820_entry *e = (struct E820_entry *) (KERNBASE + E820_MAP + 4);
+	uint64_t top = 0;
+	int i;
+
+	if (end <= E820_MAP + 4 || end > E820_MAP + 4 + E820_MAXENT * sizeof(*e)
+	    || (end - E820_MAP - 4) % sizeof(*e) != 0)
+		return 0;
+	e820_n = (end - E820_MAP - 4) / sizeof(*e);
+	memmove(e820_map, e, e820_n * sizeof(*e));
+	for (i = 0; i < e820_n; i++)
+		if (e820_map[i].e8_type == E820_RAM)
+			top = MAX(top, e820_map[i].e8_addr + e820_map[i].e8_len);
+	if (top == 0)
+		e820_n = 0;
+	return top;
+}
+
+// Does the BIOS's map have the page at pa as RAM, and nothing else?
+static bool
+e820_ram(physaddr_t pa)
+{
+	uint64_t start, end;
+	bool ram = 0;
+	int i;
+
+	for (i = 0; i < e820_n; i++) {
+		start = e820_map[i].e8_addr;
+		end = start + e820_map[i].e8_len;
+		if (e820_map[i].e8_type == E820_RAM) {
+			if (start <= pa && pa + PGSIZE <= end)
+				ram = 1;
+		} else if (start < pa + PGSIZE && pa < end)
+			return 0;
+	}
+	return ram;
+}
+
 void
 i386_detect_memory(void)
 {
-	// CMOS tells us how many kilobytes there are
-	basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
-	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
-
-	// Calculate the maximum physical address based on whether
-	// or not there is any extended memory.  See comment in <inc/mmu.h>.
-	if (extmem)
-		maxpa = EXTPHYSMEM + extmem;
-	else
-		maxpa = basemem;
+	uint64_t top;
+
+	// The BIOS's E820 map, if we have one, says how much RAM there
+	// is and where.  Otherwise CMOS tells us how many kilobytes there
+	// are, up to 64MB.
+	if ((top = e820_read()) != 0) {
+		// We reach physical memory through the mapping at KERNBASE,
+		// so that's all we can use
+		maxpa = ROUNDDOWN(MIN(top, (uint64_t) (physaddr_t) -KERNBASE), PGSIZE);
+		basemem = MIN(maxpa, IOPHYSMEM);
+		extmem = maxpa > EXTPHYSMEM ? maxpa - EXTPHYSMEM : 0;
+	} else {
+		basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
+		extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
+
+		// Calculate the maximum physical address based on whether
+		// or not there is any extended memory.  See comment in <inc/mmu.h>.
+		if (extmem)
+			maxpa = EXTPHYSMEM + extmem;
+		else
+			maxpa = basemem;
+	}
 
 	npage = maxpa / PGSIZE;
 
@@ -85,10 +219,55 @@ i386_detect_memory(void)
 // Set up initial memory mappings and turn on MMU.
 // --------------------------------------------------------------
 
-static void check_boot_pgdir(void);
-static void check_page_alloc();
-static void page_check(void);
+static void page_steal_free(struct Page_list *fl);
+static int page_zero_take(struct Page **pp_store);
+static int page_pt_take(struct Page **pp_store);
+static void page_mag_drain(struct Page_magazine *pm, uint32_t n);
+static void tlb_invalidate_all(pde_t *pgdir);
+static void page_return_free(struct Page_list *fl);
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static int cpu_has_feature(uint32_t flag);
+
+// Mark the mappings above UTOP global (PTE_G) when the CPU supports PGE,
+// so they stay in the TLB across the lcr3() in env_run().  Every env
+// shares these mappings, so they never need a CR3-driven flush.
+#define KERN_GLOBAL_PAGES	1
+
+// TLB maintenance counters, reported by the monitor's tlbstat command.
+uint32_t tlb_cr3_loads;		// address space switches in env_run()
+uint32_t tlb_invlpgs;		// single-page flushes from tlb_invalidate()
+uint32_t tlb_shootdowns;	// batches sent to other CPUs by tlb_flush()
+
+// Invalidations for other CPUs are batched, one batch per CPU for the
+// operation it's doing, and sent by tlb_flush() -- as a whole-TLB flush
+// if there are more than TLB_BATCH_MAX pages.
+#define TLB_BATCH_MAX	16
+
+struct Tlb_batch {
+	pde_t *tb_pgdir;		// the address space the pages are in
+	uint32_t tb_nva;
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	bool tb_all;			// more than TLB_BATCH_MAX
+};
+static struct Tlb_batch tlb_batch[NCPU];
+
+// The invalidations other CPUs have asked of each CPU, and how many
+// requests it has seen to (tm_done).  The asker waits for tm_done
+// whether the CPU is in user mode or not: in the kernel it may be
+// reading the very pages being freed.  So a CPU in the kernel runs its
+// requests whenever it waits (tlb_poll), as well as on the IRQ_TLB
+// interrupt and on its way back out; tm_polling keeps it from doing so
+// inside the mailbox's own lock.
+struct Tlb_mailbox {
+	struct spinlock tm_lock;
+	uint32_t tm_nva;
+	uintptr_t tm_va[TLB_BATCH_MAX];
+	bool tm_all;
+	volatile uint32_t tm_req;
+	volatile uint32_t tm_done;
+	bool tm_polling;
+};
+static struct Tlb_mailbox tlb_mailbox[NCPU];
 
 //
 // A simple physical memory allocator, used only a few times
@@ -131,8 +310,8 @@ boot_alloc(uint32_t n, uint32_t align)
 // Set up a two-level page table:
 //    boot_pgdir is its linear (virtual) address of the root
 //    boot_cr3 is the physical adresss of the root
-// Then turn on paging.  Then effectively turn off segmentation.
-// (i.e., the segment base addrs are set to zero).
+// Then switch to it from entry_pgdir, which entry.S turned paging on
+// with, and load the kernel's GDT.
 // 
 // This function only sets up the kernel part of the address space
 // (ie. addresses >= UTOP).  The user part of the address space
@@ -143,14 +322,17 @@ boot_alloc(uint32_t n, uint32_t align)
 void
 i386_vm_init(void)
 {
+	extern pde_t entry_pgdir[];
 	pde_t* pgdir;
+	void *zero;
 	uint32_t cr0;
 	size_t n;
+	int i;
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
 	pgdir = boot_alloc(PGSIZE, PGSIZE);
-	memset(pgdir, 0, PGSIZE);
+	page_zero(pgdir);
 	boot_pgdir = pgdir;
 	boot_cr3 = PADDR(pgdir);
 
@@ -181,7 +363,42 @@ i386_vm_init(void)
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
 	// LAB 3: Your code here.
 
-    envs = boot_alloc(NENV * sizeof(struct Env), PGSIZE);
+    // Only the address space: envs_grow backs it as envs are created
+    static_assert(NENV * sizeof(struct Env) <= PTSIZE);
+    envs = (struct Env *) KENVS;
+
+	//////////////////////////////////////////////////////////////////////
+	// Make 'sysstat' point to a page-rounded, zeroed table of
+	// NSYSCALLS 'struct SyscallStat'.
+    sysstat = boot_alloc(ROUNDUP(NSYSCALLS * sizeof(struct SyscallStat), PGSIZE), PGSIZE);
+    memset(sysstat, 0, ROUNDUP(NSYSCALLS * sizeof(struct SyscallStat), PGSIZE));
+
+	//////////////////////////////////////////////////////////////////////
+	// And 'envstat' to NENV zeroed 'struct EnvStat's.
+    static_assert(NSYSCALLS * sizeof(struct SyscallStat) <= UENVSTAT - USYSSTAT);
+    static_assert(NENV * sizeof(struct EnvStat) <= UKINFO - UENVSTAT);
+    envstat = boot_alloc(ROUNDUP(NENV * sizeof(struct EnvStat), PGSIZE), PGSIZE);
+    memset(envstat, 0, ROUNDUP(NENV * sizeof(struct EnvStat), PGSIZE));
+
+	//////////////////////////////////////////////////////////////////////
+	// And 'trace_rings' to TRACE_NRING zeroed 'struct TraceRing's.
+    static_assert(TRACE_NRING * sizeof(struct TraceRing) <= USYSSTAT + PTSIZE - UTRACE);
+    trace_rings = boot_alloc(ROUNDUP(TRACE_NRING * sizeof(struct TraceRing), PGSIZE), PGSIZE);
+    memset(trace_rings, 0, ROUNDUP(TRACE_NRING * sizeof(struct TraceRing), PGSIZE));
+
+	//////////////////////////////////////////////////////////////////////
+	// And 'kinfo' to a zeroed page for the 'struct KernInfo'.
+    static_assert(sizeof(struct KernInfo) <= PGSIZE);
+    kinfo = boot_alloc(PGSIZE, PGSIZE);
+    memset(kinfo, 0, PGSIZE);
+    kinfo->ki_hz = timer_hz;
+
+	//////////////////////////////////////////////////////////////////////
+	// And 'zero_page' to a page of zeros, for demand-zero memory that has
+	// only been read (page_map_zero).  Like everything boot_alloc'ed,
+	// page_init gives it a reference that's never dropped.
+    zero = boot_alloc(PGSIZE, PGSIZE);
+    memset(zero, 0, PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -189,13 +406,13 @@ i386_vm_init(void)
 	// memory management will go through the page_* functions. In
 	// particular, we can now map memory using boot_map_segment or page_insert
 	page_init();
-
-        check_page_alloc();
-
-	page_check();
+    zero_page = pa2page(PADDR(zero));
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory 
+
+    // Everything mapped below is the same in every address space
+    pte_g = (KERN_GLOBAL_PAGES && cpu_has_feature(CPUID_FEAT_PGE)) ? PTE_G : 0;
 	
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
@@ -205,7 +422,7 @@ i386_vm_init(void)
 	//    - the read-only version mapped at UPAGES -- kernel R, user R
 	// Your code goes here:
 
-    boot_map_segment(pgdir, UPAGES, ROUNDUP(npage * sizeof(struct Page), PGSIZE), PADDR(pages), PTE_U | PTE_P);
+    boot_map_segment(pgdir, UPAGES, ROUNDUP(npage * sizeof(struct Page), PGSIZE), PADDR(pages), PTE_U | PTE_P | pte_g);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -214,18 +431,39 @@ i386_vm_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	//    - the image of envs mapped at UENVS  -- kernel R, user R
 
-    boot_map_segment(pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U | PTE_P);
+    // Nothing to map yet: envs_grow fills in the page tables for KENVS
+    // and UENVS, which are made with the others below.
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the kernel stack (symbol name "bootstack").  The complete VA
-	// range of the stack, [KSTACKTOP-PTSIZE, KSTACKTOP), breaks into two
-	// pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed => faults
+	// Map 'sysstat' read-only by the user at linear address USYSSTAT.
+
+    boot_map_segment(pgdir, USYSSTAT, ROUNDUP(NSYSCALLS * sizeof(struct SyscallStat), PGSIZE), PADDR(sysstat), PTE_U | PTE_P | pte_g);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map 'envstat' read-only by the user at linear address UENVSTAT.
+
+    boot_map_segment(pgdir, UENVSTAT, ROUNDUP(NENV * sizeof(struct EnvStat), PGSIZE), PADDR(envstat), PTE_U | PTE_P | pte_g);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map 'trace_rings' read-only by the user at linear address UTRACE.
+
+    boot_map_segment(pgdir, UTRACE, ROUNDUP(TRACE_NRING * sizeof(struct TraceRing), PGSIZE), PADDR(trace_rings), PTE_U | PTE_P | pte_g);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map 'kinfo' read-only by the user at linear address UKINFO.
+
+    boot_map_segment(pgdir, UKINFO, PGSIZE, PADDR(kinfo), PTE_U | PTE_P | pte_g);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map the per-CPU kernel stacks (symbol name "percpu_kstacks";
+	// the BSP boots on "bootstack" but traps onto its own, like the
+	// APs).  CPU i's stack is [CPU_KSTACKTOP(i)-KSTKSIZE, CPU_KSTACKTOP(i)),
+	// backed by physical memory, with the KSTKGAP below it unmapped so
+	// that an overflow faults instead of running into the next CPU's.
 	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
 
-   boot_map_segment(pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | PTE_P); 
+    for (i = 0; i < NCPU; i++)
+        boot_map_segment(pgdir, CPU_KSTACKTOP(i) - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_P | pte_g);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -236,77 +474,117 @@ i386_vm_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here: 
 
-    boot_map_segment(pgdir, KERNBASE, 0xffffffff - KERNBASE + 1, 0, PTE_W | PTE_P);
-
-	// Check that the initial page directory has been set up correctly.
-	check_boot_pgdir();
+    // entry.S has mapped it already, in 4MB pages (CR4.PSE is on): the
+    // whole 256MB takes 64 PDEs and no page-table pages, and each 4MB
+    // needs only one TLB entry.  Take its PDEs, made global.
+    for (i = PDX(KERNBASE); i < NPDENTRIES; i++)
+        pgdir[i] = entry_pgdir[i] | pte_g;
+
+    // Give every kernel PDE above UTOP its page table now.  env_setup_vm
+    // copies these PDEs into each new pgdir, so all of them share the
+    // page tables, and a kernel mapping made later shows up everywhere
+    // with nothing to copy.  VPT and UVPT are each pgdir's own.
+    for (i = PDX(UTOP); i < NPDENTRIES; i++)
+        if (i != PDX(VPT) && i != PDX(UVPT) && !(pgdir[i] & PTE_P)
+            && !pgdir_walk(pgdir, PGADDR(i, 0, 0), 1))
+            panic("i386_vm_init: out of memory for kernel page tables");
+    kern_pdes_fixed = 1;
 
 	//////////////////////////////////////////////////////////////////////
-	// On x86, segmentation maps a VA to a LA (linear addr) and
-	// paging maps the LA to a PA.  I.e. VA => LA => PA.  If paging is
-	// turned off the LA is used as the PA.  Note: there is no way to
-	// turn off segmentation.  The closest thing is to set the base
-	// address to 0, so the VA => LA mapping is the identity.
-
-	// Current mapping: VA KERNBASE+x => PA x.
-	//     (segmentation base=-KERNBASE and paging is off)
-
-	// From here on down we must maintain this VA KERNBASE + x => PA x
-	// mapping, even though we are turning on paging and reconfiguring
-	// segmentation.
-
-	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
-	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	// Paging has been on since entry.S, with the same KERNBASE + x => x
+	// mapping, and entry.S's GDT is flat, so switching is just loading
+	// the new page directory; entry_pgdir's alias of the low 4MB goes
+	// with it.
 
 	// Install page table.
 	lcr3(boot_cr3);
 
-	// Turn on paging.
+	// The rest of the CR0 bits the kernel runs with.
 	cr0 = rcr0();
 	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_TS|CR0_EM|CR0_MP;
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
 
+	// Reload all segment registers.
+	gdt_load();
 
-	// Current mapping: KERNBASE+x => x => x.
-	// (x < 4MB so uses paging pgdir[0])
+    // Only now honor PTE_G, once entry_pgdir's entries are gone from the
+    // TLB.  Setting CR4.PGE also flushes the whole TLB, global entries
+    // included.
+    if (pte_g)
+        lcr4(rcr4() | CR4_PGE);
+}
 
-	// Reload all segment registers.
-	asm volatile("lgdt gdt_pd");
-    asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
-	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
-	asm volatile("movw %%ax,%%es" :: "a" (GD_KD));
-	asm volatile("movw %%ax,%%ds" :: "a" (GD_KD));
-	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
-	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
-	asm volatile("lldt %%ax" :: "a" (0));
+//
+// Take every free page out of the allocator and chain it on 'fl', so that
+// the checks below can run with no free memory; page_return_free() gives
+// the pages back.  Stealing by allocation (rather than by saving the free
+// lists) keeps the stolen pages from coalescing with the pages under test.
+//
+static void
+page_steal_free(struct Page_list *fl)
+{
+	struct Page *pp;
+
+	LIST_INIT(fl);
+	while (page_alloc(&pp) == 0)
+		LIST_INSERT_HEAD(fl, pp, pp_link);
+}
 
-	// Final mapping: KERNBASE+x => KERNBASE+x => x.
+static void
+page_return_free(struct Page_list *fl)
+{
+	struct Page *pp;
 
-	// This mapping was only used after paging was turned on but
-	// before the segment registers were reloaded.
-	pgdir[0] = 0;
+	while ((pp = LIST_FIRST(fl)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free(pp);
+	}
+}
 
-	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
-	lcr3(boot_cr3);
+// How many pages page_alloc could give out now
+static uint32_t
+page_count_free(void)
+{
+	struct Page_list fl;
+	struct Page *pp;
+	uint32_t n = 0;
+
+	page_steal_free(&fl);
+	LIST_FOREACH(pp, &fl, pp_link)
+		n++;
+	page_return_free(&fl);
+	return n;
+}
+
+// A pseudo-random number for the stress tests
+static uint32_t
+check_rand(void)
+{
+	static uint32_t seed = 1;
+
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
 }
 
 //
 // Check the physical page allocator (page_alloc(), page_free(),
-// and page_init()).
+// page_alloc_order(), page_free_order() and page_init()).
 //
-static void
+void
 check_page_alloc()
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl;
+	int i, k;
 	
         // if there's a page that shouldn't be on
         // the free list, try to make sure it
         // eventually causes trouble.
-	LIST_FOREACH(pp0, &page_free_list, pp_link)
-		memset(page2kva(pp0), 0x97, 128);
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+		LIST_FOREACH(pp0, &page_free_area[k], pp_link)
+			for (i = 0; i < (1 << k); i++)
+				memset(page2kva(pp0 + i), 0x97, 128);
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -322,8 +600,7 @@ check_page_alloc()
         assert(page2pa(pp2) < npage*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	page_steal_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -340,18 +617,157 @@ check_page_alloc()
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 	assert(page_alloc(&pp) == -E_NO_MEM);
+	assert(page_alloc_order(&pp, 1) == -E_NO_MEM);
 
 	// give free list back
-	page_free_list = fl;
+	page_return_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// single pages come back from this CPU's magazine, last freed first
+	assert(page_alloc(&pp) == 0 && pp == pp2);
+	page_free(pp);
+
+	// contiguous blocks are aligned to their size, and a freed block
+	// coalesces with its buddies so the same block comes back again
+	for (k = 0; k <= PAGE_MAX_ORDER; k++) {
+		assert(page_alloc_order(&pp0, k) == 0);
+		assert((page2ppn(pp0) & ((1 << k) - 1)) == 0);
+		page_free_order(pp0, k);
+		assert(page_alloc_order(&pp1, k) == 0 && pp1 == pp0);
+		page_free_order(pp1, k);
+	}
+	assert(page_alloc_order(&pp, PAGE_MAX_ORDER + 1) == -E_INVAL);
+
+	// pre-zeroed pages really are zero
+	page_zero_idle(1);
+	assert((k = page_zero_count) > 0);
+	pp0 = LIST_FIRST(&page_zero_pool);
+	assert(page_alloc_zeroed(&pp) == 0 && pp == pp0);
+	for (i = 0; i < PGSIZE; i++)
+		assert(((char *) page2kva(pp))[i] == 0);
+	assert(page_zero_count == k - 1);
+	page_free(pp);
+
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+#define CHECK_NBLOCK	64		// blocks check_page_orders holds at once
+
+//
+// Stress the buddy allocator: allocate and free blocks of random
+// orders, mostly small, in random order, tagging every page of a block
+// so that two blocks handed out over each other show.  Afterwards as
+// many pages are free as before.
+//
+void
+check_page_orders(void)
+{
+	static struct {
+		struct Page *pp;
+		int order;
+	} held[CHECK_NBLOCK];
+	uint32_t nfree = page_count_free(), tag;
+	int i, j, n, order;
+
+	for (n = 0; n < 20 * CHECK_NBLOCK; n++) {
+		i = check_rand() % CHECK_NBLOCK;
+		if (held[i].pp != NULL) {
+			tag = 0x0b100000 | (i << 4) | held[i].order;
+			for (j = 0; j < (1 << held[i].order); j++)
+				assert(*(uint32_t *) page2kva(held[i].pp + j) == tag);
+			page_free_order(held[i].pp, held[i].order);
+			held[i].pp = NULL;
+			continue;
+		}
+		order = check_rand() % 8 == 0 ? check_rand() % (PAGE_MAX_ORDER + 1)
+					       : check_rand() % 4;
+		if (page_alloc_order(&held[i].pp, order) < 0) {
+			held[i].pp = NULL;
+			continue;
+		}
+		assert((page2ppn(held[i].pp) & ((1 << order) - 1)) == 0);
+		held[i].order = order;
+		tag = 0x0b100000 | (i << 4) | order;
+		for (j = 0; j < (1 << order); j++)
+			*(uint32_t *) page2kva(held[i].pp + j) = tag;
+	}
+	for (i = 0; i < CHECK_NBLOCK; i++)
+		if (held[i].pp != NULL) {
+			page_free_order(held[i].pp, held[i].order);
+			held[i].pp = NULL;
+		}
+	assert(page_count_free() == nfree);
+
+	cprintf("check_page_orders() succeeded!\n");
+}
+
+//
+// Map 4MB pages in a scratch page directory, split some of them into
+// page tables, and take them all down again: the pages come back
+// zeroed and aligned, are the same pages after a split, and are all
+// free again after.  Without 4MB pages, or a free 4MB block, there's
+// nothing to check.
+//
+void
+check_super_pages(void)
+{
+	struct Page *dir, *pp;
+	pde_t *pgdir;
+	uint32_t nfree, i, j;
+	uintptr_t va;
+	int r;
+
+	assert(page_alloc_zeroed(&dir) == 0);
+	pgdir = page2kva(dir);
+	nfree = page_count_free();
+	for (i = 0; i < 4; i++) {
+		va = (i + 1) * PTSIZE;
+		if ((r = page_super_alloc(pgdir, (void *) va, PTE_U | PTE_W)) == -E_NO_MEM)
+			break;
+		assert(r == 0 && PDE_SUPER(pgdir[PDX(va)]));
+		pp = pa2page(PTE_PS_ADDR(pgdir[PDX(va)]));
+		assert((page2ppn(pp) & (NPTENTRIES - 1)) == 0);
+		for (j = 0; j < NPTENTRIES; j++) {
+			assert(pp[j].pp_ref == 1);
+			assert(((uint32_t *) page2kva(pp + j))[j] == 0);
+			*(uint32_t *) page2kva(pp + j) = va + j;
+		}
+		if (i % 2 == 0)
+			continue;
+		assert(page_super_split(pgdir, (void *) va) == 0);
+		assert(!PDE_SUPER(pgdir[PDX(va)]));
+		for (j = 0; j < NPTENTRIES; j++) {
+			assert(page_lookup(pgdir, (void *) (va + j * PGSIZE), NULL) == pp + j);
+			assert(page_mapped_once(pp + j, pgdir, (void *) (va + j * PGSIZE)));
+		}
+	}
+	if (i == 0)
+		cprintf("check_super_pages() skipped: no 4MB pages\n");
+	while (i-- > 0) {
+		va = (i + 1) * PTSIZE;
+		pp = pa2page(PDE_SUPER(pgdir[PDX(va)]) ? PTE_PS_ADDR(pgdir[PDX(va)])
+			     : PTE_ADDR(*pgdir_walk(pgdir, (void *) va, 0)));
+		for (j = 0; j < NPTENTRIES; j++)
+			assert(*(uint32_t *) page2kva(pp + j) == va + j);
+		if (PDE_SUPER(pgdir[PDX(va)])) {
+			page_super_put(pgdir, (void *) va);
+			continue;
+		}
+		for (j = 0; j < NPTENTRIES; j++)
+			page_remove(pgdir, (void *) (va + j * PGSIZE));
+		page_decref(pa2page(PTE_ADDR(pgdir[PDX(va)])));
+		pgdir[PDX(va)] = 0;
+	}
+	assert(page_count_free() == nfree);
+	page_free(dir);
+
+	cprintf("check_super_pages() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly(by i386_vm_init()).
@@ -362,7 +778,7 @@ check_page_alloc()
 //
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 
-static void
+void
 check_boot_pgdir(void)
 {
 	uint32_t i, n;
@@ -375,36 +791,48 @@ check_boot_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 	
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
+	// check envs array (new test for lab 3): whatever is mapped of it
+	// is the same at UENVS as at KENVS
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		assert(check_va2pa(pgdir, UENVS + i) == check_va2pa(pgdir, KENVS + i));
+
+	// check syscall statistics
+	n = ROUNDUP(NSYSCALLS*sizeof(struct SyscallStat), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, USYSSTAT + i) == PADDR(sysstat) + i);
+
+	// check per-env counts
+	n = ROUNDUP(NENV*sizeof(struct EnvStat), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, UENVSTAT + i) == PADDR(envstat) + i);
+
+	// check trace rings
+	n = ROUNDUP(TRACE_NRING*sizeof(struct TraceRing), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+		assert(check_va2pa(pgdir, UTRACE + i) == PADDR(trace_rings) + i);
+
+	// check kernel info page
+	assert(check_va2pa(pgdir, UKINFO) == PADDR(kinfo));
 
 	// check phys mem
 	for (i = 0; i < npage; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// check kernel stacks, and the guards between them
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = CPU_KSTACKTOP(n) - KSTKSIZE;
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base - KSTKGAP + i) == ~0);
+	}
 
-	// check for zero/non-zero in PDEs
+	// check for zero/non-zero in PDEs: every kernel one is there
 	for (i = 0; i < NPDENTRIES; i++) {
-		switch (i) {
-		case PDX(VPT):
-		case PDX(UVPT):
-		case PDX(KSTACKTOP-1):
-		case PDX(UPAGES):
-		case PDX(UENVS):
+		if (i >= PDX(UTOP))
 			assert(pgdir[i]);
-			break;
-		default:
-			if (i >= PDX(KERNBASE))
-				assert(pgdir[i]);
-			else
-				assert(pgdir[i] == 0);
-			break;
-		}
+		else
+			assert(pgdir[i] == 0);
 	}
 	cprintf("check_boot_pgdir() succeeded!\n");
 }
@@ -422,6 +850,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_PS_ADDR(*pgdir) | (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -472,28 +902,67 @@ page_init(void)
      *}
      */
     uint32_t i, start, end;
-    LIST_INIT(&page_free_list);
-    for (i = 0; i < npage; i++) {
-        pages[i].pp_ref = 0;
-        LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
-    }
+    for (i = 0; i <= PAGE_MAX_ORDER; i++)
+        LIST_INIT(&page_free_area[i]);
+    LIST_INIT(&page_zero_pool);
+    page_zero_count = 0;
+    LIST_INIT(&page_pt_cache);
+    page_pt_count = 0;
+    memset(pages, 0, npage * sizeof(struct Page));
     // Mark page 0 as in use
     pages[0].pp_ref = 1;
-    LIST_REMOVE(&pages[0], pp_link);
     // Mark IO hole as in use
     start = ROUNDDOWN(IOPHYSMEM, PGSIZE);
     end = ROUNDUP(EXTPHYSMEM, PGSIZE);
-    for (i = start; i < end; i += PGSIZE) {
+    for (i = start; i < end; i += PGSIZE)
         pages[i / PGSIZE].pp_ref = 1;
-        LIST_REMOVE(&pages[i / PGSIZE], pp_link);
-    }
     // Mark kernel, page table and page list as in use
     start = ROUNDDOWN(EXTPHYSMEM, PGSIZE);
     end = ROUNDUP(PADDR(boot_freemem), PGSIZE);
-    for (i = start; i < end; i += PGSIZE) {
+    for (i = start; i < end; i += PGSIZE)
         pages[i / PGSIZE].pp_ref = 1;
-        LIST_REMOVE(&pages[i / PGSIZE], pp_link);
+    // Mark the page the APs' boot code is copied to as in use
+    pages[MPENTRY_PADDR / PGSIZE].pp_ref = 1;
+    // and whatever the BIOS's map doesn't call RAM
+    if (e820_n > 0)
+        for (i = 0; i < npage; i++)
+            if (!e820_ram(i * PGSIZE))
+                pages[i].pp_ref = 1;
+    // Hand the rest of the first 4MB block past the kernel's to the
+    // buddy allocator, which merges neighbouring free pages into the
+    // largest aligned blocks it can; page_seed hands out what's left
+    page_seed_next = MIN(ROUNDUP(end / PGSIZE, 1 << PAGE_MAX_ORDER), npage);
+    for (i = 0; i < page_seed_next; i++)
+        if (pages[i].pp_ref == 0)
+            page_free_order(&pages[i], 0);
+}
+
+//
+// Put up to PAGE_SEED_BATCH more blocks past page_seed_next on the free
+// lists, whole ones of the largest order while they last.  Returns
+// whether there were any.  The caller holds page_lock.
+//
+static bool
+page_seed(void)
+{
+    uint32_t n, i, end;
+    if (page_seed_next >= npage)
+        return 0;
+    for (n = 0; n < PAGE_SEED_BATCH && page_seed_next < npage; n++) {
+        end = MIN(page_seed_next + (1 << PAGE_MAX_ORDER), npage);
+        // A whole block the BIOS has no holes in goes on as it is;
+        // otherwise, as at the top of memory, the free pages one by one
+        for (i = page_seed_next; i < end && pages[i].pp_ref == 0; i++)
+            ;
+        if (i == page_seed_next + (1 << PAGE_MAX_ORDER))
+            buddy_insert(&pages[page_seed_next], PAGE_MAX_ORDER);
+        else
+            for (i = page_seed_next; i < end; i++)
+                if (pages[i].pp_ref == 0)
+                    buddy_free(&pages[i], 0);
+        page_seed_next = end;
     }
+    return 1;
 }
 
 //
@@ -507,6 +976,121 @@ page_initpp(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
+//
+// Put the block of 2^order pages starting at 'pp' on its free list,
+// or take it off again.
+//
+static void
+buddy_insert(struct Page *pp, int order)
+{
+    pp->pp_order = order;
+    pp->pp_free = 1;
+    LIST_INSERT_HEAD(&page_free_area[order], pp, pp_link);
+}
+
+static void
+buddy_remove(struct Page *pp)
+{
+    pp->pp_free = 0;
+    LIST_REMOVE(pp, pp_link);
+}
+
+//
+// page_alloc_order and page_free_order, for callers holding page_lock.
+//
+static int
+buddy_alloc(struct Page **pp_store, int order)
+{
+    struct Page *pp;
+    int k, i;
+    do {
+        for (k = order; k <= PAGE_MAX_ORDER; k++)
+            if (!LIST_EMPTY(&page_free_area[k]))
+                break;
+    } while (k > PAGE_MAX_ORDER && (page_seed() || page_color_drain()));
+    if (k > PAGE_MAX_ORDER)
+        return -E_NO_MEM;
+    pp = LIST_FIRST(&page_free_area[k]);
+    buddy_remove(pp);
+    // Split off the upper halves until the block is small enough
+    while (k > order) {
+        k--;
+        buddy_insert(pp + (1 << k), k);
+    }
+    for (i = 0; i < (1 << order); i++)
+        page_initpp(pp + i);
+    *pp_store = pp;
+    return 0;
+}
+
+static void
+buddy_free(struct Page *pp, int order)
+{
+    struct Page *buddy;
+    ppn_t ppn = page2ppn(pp);
+    assert(order >= 0 && order <= PAGE_MAX_ORDER);
+    assert((ppn & ((1 << order) - 1)) == 0);
+    assert(!pp->pp_free);
+    while (order < PAGE_MAX_ORDER) {
+        if ((ppn ^ (1 << order)) >= npage)
+            break;
+        buddy = &pages[ppn ^ (1 << order)];
+        if (!buddy->pp_free || buddy->pp_order != order)
+            break;
+        buddy_remove(buddy);
+        ppn &= ~(1 << order);
+        order++;
+    }
+    buddy_insert(&pages[ppn], order);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned on a
+// (2^order * PGSIZE)-byte boundary.  The smallest free block that is
+// large enough is split in halves until it has the requested size;
+// the unused halves go back on the smaller free lists.
+// Like page_alloc, the pages are not zeroed and pp_ref is left at 0.
+//
+// *pp_store -- is set to point to the Page struct of the first page
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- if no large enough block is free
+//   -E_INVAL -- if order is out of range
+//
+int
+page_alloc_order(struct Page **pp_store, int order)
+{
+    int r;
+    if (order < 0 || order > PAGE_MAX_ORDER)
+        return -E_INVAL;
+    spin_lock(&page_lock);
+    r = buddy_alloc(pp_store, order);
+    spin_unlock(&page_lock);
+    // Our magazine's pages may be what keeps a large enough block from
+    // forming; give them back and try again
+    if (r < 0 && order > 0 && page_mags[cpunum()].pm_count > 0) {
+        page_mag_drain(&page_mags[cpunum()], PAGE_MAG_SIZE);
+        spin_lock(&page_lock);
+        r = buddy_alloc(pp_store, order);
+        spin_unlock(&page_lock);
+    }
+    return r;
+}
+
+//
+// Return a block allocated by page_alloc_order(pp_store, order).
+// The block is merged with its buddy for as long as the buddy is
+// free and of the same size.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+    spin_lock(&page_lock);
+    buddy_free(pp, order);
+    spin_unlock(&page_lock);
+}
+
 //
 // Allocates a physical page.
 // Does NOT set the contents of the physical page to zero -
@@ -525,15 +1109,254 @@ int
 page_alloc(struct Page **pp_store)
 {
 	// Fill this function in
-    if (LIST_FIRST(&page_free_list) != NULL) {
-        *pp_store = LIST_FIRST(&page_free_list);
-        // Remove the page from page_free_list
-        LIST_REMOVE(*pp_store, pp_link);
-        page_initpp(*pp_store);
-        return 0;
+    // A single page comes from our magazine, which refills with the
+    // smallest buddy blocks; out of those, fall back on the pre-zeroed
+    // pages.  No page we freed may go to anyone before the other CPUs
+    // have forgotten it
+    struct Page_magazine *pm = &page_mags[cpunum()];
+    struct Page *pp;
+    int r = 0;
+    tlb_flush();
+    if (pm->pm_count == 0) {
+        spin_lock(&page_lock);
+        while (pm->pm_count < PAGE_MAG_BATCH && buddy_alloc(&pp, 0) == 0) {
+            LIST_INSERT_HEAD(&pm->pm_pages, pp, pp_link);
+            pm->pm_count++;
+        }
+        if (pm->pm_count == 0 && (r = page_zero_take(pp_store)) < 0)
+            r = page_pt_take(pp_store);
+        spin_unlock(&page_lock);
+        if (pm->pm_count == 0) {
+            // Out of memory: finish freeing dead envs' memory, or
+            // else page out some cold pages, and try again
+            if (r < 0 && !page_reclaim_off
+                && (env_reclaim_all() > 0 || swap_reclaim() > 0))
+                return page_alloc(pp_store);
+            return r;
+        }
     }
-    else {
+    pp = LIST_FIRST(&pm->pm_pages);
+    LIST_REMOVE(pp, pp_link);
+    pm->pm_count--;
+    page_initpp(pp);
+    *pp_store = pp;
+    return 0;
+}
+
+//
+// Give the first 'n' pages of magazine 'pm' back to the buddy lists.
+//
+static void
+page_mag_drain(struct Page_magazine *pm, uint32_t n)
+{
+    struct Page *pp;
+    tlb_flush();
+    spin_lock(&page_lock);
+    while (n-- > 0 && (pp = LIST_FIRST(&pm->pm_pages)) != NULL) {
+        LIST_REMOVE(pp, pp_link);
+        pm->pm_count--;
+        buddy_free(pp, 0);
+    }
+    spin_unlock(&page_lock);
+}
+
+//
+// Pop a page off the pre-zeroed pool, or return -E_NO_MEM if it is empty.
+// The caller holds page_lock.
+//
+static int
+page_zero_take(struct Page **pp_store)
+{
+    struct Page *pp = LIST_FIRST(&page_zero_pool);
+    if (pp == NULL)
+        return -E_NO_MEM;
+    LIST_REMOVE(pp, pp_link);
+    page_zero_count--;
+    page_initpp(pp);
+    *pp_store = pp;
+    return 0;
+}
+
+//
+// Pop a page off the page-table cache, or return -E_NO_MEM if it is
+// empty.  The caller holds page_lock.
+//
+static int
+page_pt_take(struct Page **pp_store)
+{
+    struct Page *pp = LIST_FIRST(&page_pt_cache);
+    if (pp == NULL)
         return -E_NO_MEM;
+    LIST_REMOVE(pp, pp_link);
+    page_pt_count--;
+    page_initpp(pp);
+    *pp_store = pp;
+    return 0;
+}
+
+//
+// Drop a reference to the user page table 'pt', every entry of which
+// is clear.  The last reference keeps it in the page-table cache while
+// there's room, and frees it otherwise.
+//
+void
+page_table_decref(struct Page *pt)
+{
+    if (page_ref_dec(pt) != 0)
+        return;
+    spin_lock(&page_lock);
+    if (page_pt_count < PAGE_PT_CACHE_MAX) {
+        LIST_INSERT_HEAD(&page_pt_cache, pt, pp_link);
+        page_pt_count++;
+        pt = NULL;
+    }
+    spin_unlock(&page_lock);
+    if (pt != NULL)
+        page_free(pt);
+}
+
+//
+// Like page_alloc, but the page's contents are zeroed.
+// Uses a page from the pre-zeroed pool when there is one, so the memset
+// is usually off the caller's path; the pool is shared, so we only take
+// page_lock when a peek says it's worth it.
+//
+int
+page_alloc_zeroed(struct Page **pp_store)
+{
+    int r;
+    if (page_zero_count > 0) {
+        spin_lock(&page_lock);
+        r = page_zero_take(pp_store);
+        spin_unlock(&page_lock);
+        if (r == 0)
+            return 0;
+    }
+    if ((r = page_alloc(pp_store)) < 0)
+        return r;
+    page_zero(page2kva(*pp_store));
+    return 0;
+}
+
+//
+// Give every page on the color lists back to the buddy lists.  Returns
+// whether there were any.  The caller holds page_lock.
+//
+static bool
+page_color_drain(void)
+{
+#if PAGE_COLORS
+    struct Page *pp;
+    int c;
+    if (page_color_count == 0)
+        return 0;
+    for (c = 0; c < PAGE_COLORS; c++)
+        while ((pp = LIST_FIRST(&page_color_free[c])) != NULL) {
+            LIST_REMOVE(pp, pp_link);
+            buddy_free(pp, 0);
+        }
+    page_color_count = 0;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+//
+// Like page_alloc, for a page to be mapped at user address 'va'.  With
+// PAGE_COLORS it's of va's color if we can find one, and otherwise any
+// page.
+//
+int
+page_alloc_at(struct Page **pp_store, const void *va)
+{
+#if PAGE_COLORS
+    struct Page *pp, *run;
+    int c = VPN(va) % PAGE_COLORS, i;
+    static_assert((PAGE_COLORS & (PAGE_COLORS - 1)) == 0);
+    static_assert(PAGE_COLORS <= (1 << PAGE_MAX_ORDER));
+    spin_lock(&page_lock);
+    if (LIST_EMPTY(&page_color_free[c])
+        && buddy_alloc(&run, __builtin_ctz(PAGE_COLORS)) == 0) {
+        for (i = 0; i < PAGE_COLORS; i++)
+            LIST_INSERT_HEAD(&page_color_free[(page2ppn(run) + i) % PAGE_COLORS],
+                             run + i, pp_link);
+        page_color_count += PAGE_COLORS;
+    }
+    if ((pp = LIST_FIRST(&page_color_free[c])) != NULL) {
+        LIST_REMOVE(pp, pp_link);
+        page_color_count--;
+    }
+    spin_unlock(&page_lock);
+    if (pp != NULL) {
+        page_initpp(pp);
+        *pp_store = pp;
+        return 0;
+    }
+#endif
+    return page_alloc(pp_store);
+}
+
+//
+// Like page_alloc_zeroed, for a page to be mapped at user address 'va',
+// of its color as page_alloc_at finds one.  The pre-zeroed pool's pages
+// are of any color, so with PAGE_COLORS we zero the page ourselves.
+//
+int
+page_alloc_zeroed_at(struct Page **pp_store, const void *va)
+{
+    int r;
+    if (!PAGE_COLORS)
+        return page_alloc_zeroed(pp_store);
+    if ((r = page_alloc_at(pp_store, va)) < 0)
+        return r;
+    page_zero(page2kva(*pp_store));
+    return 0;
+}
+
+//
+// Zero a page with non-temporal stores, which go around the cache: a
+// page zeroed for the pool may not be used for a while, and should not
+// push out what the caches hold in the meantime.  movnti takes only
+// general registers, so there's no FPU state to worry about.
+//
+static void
+page_zero_nt(void *va)
+{
+    uint32_t *p = va, *end = p + PGSIZE / 4;
+    static int has_sse2 = -1;
+    if (has_sse2 < 0)
+        has_sse2 = cpu_has_feature(CPUID_FEAT_SSE2);
+    if (!has_sse2) {
+        page_zero(va);
+        return;
+    }
+    for (; p < end; p += 8)
+        asm volatile("movnti %1, 0(%0); movnti %1, 4(%0)\n"
+                     "movnti %1, 8(%0); movnti %1, 12(%0)\n"
+                     "movnti %1, 16(%0); movnti %1, 20(%0)\n"
+                     "movnti %1, 24(%0); movnti %1, 28(%0)"
+                     :: "r" (p), "r" (0) : "memory");
+    // Order the stores before the page is handed out
+    asm volatile("sfence" ::: "memory");
+}
+
+//
+// Zero up to 'n' free pages into the pre-zeroed pool.
+// Called from the scheduler when nothing else is runnable.
+//
+void
+page_zero_idle(int n)
+{
+    struct Page *pp;
+    while (n-- > 0 && page_zero_count < PAGE_ZERO_POOL_MAX) {
+        if (page_alloc_order(&pp, 0) < 0)
+            return;
+        page_zero_nt(page2kva(pp));
+        spin_lock(&page_lock);
+        LIST_INSERT_HEAD(&page_zero_pool, pp, pp_link);
+        page_zero_count++;
+        spin_unlock(&page_lock);
     }
 }
 
@@ -552,7 +1375,11 @@ page_free(struct Page *pp)
      *    LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
      *}
      */
-    LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+    struct Page_magazine *pm = &page_mags[cpunum()];
+    assert(!pp->pp_free);
+    LIST_INSERT_HEAD(&pm->pm_pages, pp, pp_link);
+    if (++pm->pm_count > PAGE_MAG_SIZE)
+        page_mag_drain(pm, PAGE_MAG_BATCH);
     return;
 }
 
@@ -563,21 +1390,186 @@ page_free(struct Page *pp)
 void
 page_decref(struct Page* pp)
 {
-	if (--pp->pp_ref == 0)
+	// Let anyone sleeping on this page re-check; it may be the peer
+	// they are waiting for that is unmapping it
+	if (pp->pp_waiters != 0)
+		addr_wake_page(pp);
+	if ((pp->pp_merged ? merge_decref(pp) : page_ref_dec(pp)) == 0)
 		page_free(pp);
 }
 
-// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
-// a pointer to the page table entry (PTE) for linear address 'va'.
-// This requires walking the two-level page table structure.
 //
-// If the relevant page table doesn't exist in the page directory, then:
-//    - If create == 0, pgdir_walk returns NULL.
-//    - Otherwise, pgdir_walk tries to allocate a new page table
+// Reverse mappings.  Each page mapped in user space keeps a chain,
+// pp_rmap, of the (pgdir, va) pairs it's mapped at, so that we can find
+// every PTE that refers to it.  page_insert adds to the chain and
+// page_remove takes away, as do the few places that write user PTEs
+// themselves.  The kernel's own mappings aren't kept, nor those in
+// boot_pgdir, page_check's and the bench's.  rmap_lock
+// guards every chain; entries are allocated and freed outside it.
+//
+struct Rmap {
+	pde_t *rm_pgdir;
+	uintptr_t rm_va;
+	struct Rmap *rm_next;
+};
+
+static struct Kmem_cache *rmap_cache;
+static struct spinlock rmap_lock = SPINLOCK_INIT(rmap_lock);
+
+void
+rmap_init(void)
+{
+	rmap_cache = kmem_cache_create("rmap", sizeof(struct Rmap), 0, NULL);
+	assert(rmap_cache != NULL);
+}
+
+// Map a page twice in a scratch page directory, and see the chain
+// follow page_insert and page_remove.
+void
+check_rmap(void)
+{
+	struct Page *dir, *pp;
+	pde_t *pgdir;
+	void *va1 = (void *) PGSIZE, *va2 = (void *) (3 * PGSIZE);
+
+	assert(page_alloc_zeroed(&dir) == 0 && page_alloc(&pp) == 0);
+	pgdir = page2kva(dir);
+	assert(page_insert(pgdir, pp, va1, PTE_U) == 0);
+	assert(page_mapped_once(pp, pgdir, va1) && !page_mapped_once(pp, pgdir, va2));
+	assert(page_insert(pgdir, pp, va2, PTE_U) == 0);
+	assert(pp->pp_ref == 2 && !page_mapped_once(pp, pgdir, va1));
+	// mapping it again where it is leaves one entry for the place
+	assert(page_insert(pgdir, pp, va1, PTE_U | PTE_W) == 0);
+	assert(pp->pp_ref == 2 && pp->pp_rmap->rm_next->rm_next == NULL);
+	page_remove(pgdir, va1);
+	assert(page_mapped_once(pp, pgdir, va2));
+	page_incref(pp);
+	page_remove(pgdir, va2);
+	assert(pp->pp_ref == 1 && pp->pp_rmap == NULL);
+	page_decref(pp);
+	page_decref(pa2page(PTE_ADDR(pgdir[0])));
+	page_free(dir);
+	cprintf("check_rmap() succeeded!\n");
+}
+
+//
+// Note that pp is mapped at 'va' in 'pgdir'.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+page_rmap_add(struct Page *pp, pde_t *pgdir, void *va)
+{
+	struct Rmap *rm;
+
+	// The zero page is mapped all over and never paged out, so it has none
+	if (pgdir == boot_pgdir || pp == zero_page)
+		return 0;
+	if ((rm = kmem_cache_alloc(rmap_cache)) == NULL)
+		return -E_NO_MEM;
+	rm->rm_pgdir = pgdir;
+	rm->rm_va = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	spin_lock(&rmap_lock);
+	rm->rm_next = pp->pp_rmap;
+	pp->pp_rmap = rm;
+	spin_unlock(&rmap_lock);
+	return 0;
+}
+
+//
+// Note that pp isn't mapped at 'va' in 'pgdir' any more.
+//
+void
+page_rmap_remove(struct Page *pp, pde_t *pgdir, void *va)
+{
+	struct Rmap **rmp, *rm = NULL;
+
+	if (pgdir == boot_pgdir || pp == zero_page)
+		return;
+	spin_lock(&rmap_lock);
+	for (rmp = &pp->pp_rmap; *rmp != NULL; rmp = &(*rmp)->rm_next)
+		if ((*rmp)->rm_pgdir == pgdir && (*rmp)->rm_va == ROUNDDOWN((uintptr_t) va, PGSIZE)) {
+			rm = *rmp;
+			*rmp = rm->rm_next;
+			break;
+		}
+	spin_unlock(&rmap_lock);
+	if (rm == NULL)
+		panic("page_rmap_remove: page %08x isn't mapped at %08x", page2pa(pp), va);
+	kmem_cache_free(rmap_cache, rm);
+}
+
+//
+// Call fn(pgdir, va, arg) for each place pp is mapped in user space,
+// with rmap_lock held.
+//
+void
+page_rmap_walk(struct Page *pp, void (*fn)(pde_t *, uintptr_t, void *), void *arg)
+{
+	struct Rmap *rm;
+
+	spin_lock(&rmap_lock);
+	for (rm = pp->pp_rmap; rm != NULL; rm = rm->rm_next)
+		fn(rm->rm_pgdir, rm->rm_va, arg);
+	spin_unlock(&rmap_lock);
+}
+
+//
+// Is the mapping at 'va' in 'pgdir' the only thing referring to pp?
+//
+bool
+page_mapped_once(struct Page *pp, pde_t *pgdir, void *va)
+{
+	struct Rmap *rm;
+	bool once;
+
+	spin_lock(&rmap_lock);
+	rm = pp->pp_rmap;
+	once = pp->pp_ref == 1 && rm != NULL && rm->rm_next == NULL
+		&& rm->rm_pgdir == pgdir && rm->rm_va == ROUNDDOWN((uintptr_t) va, PGSIZE);
+	spin_unlock(&rmap_lock);
+	return once;
+}
+
+//
+// Memory accounting.  Each env counts the user pages mapped in its
+// address space (env_npages, and env_nshared for PTE_SHARE ones) and its
+// page tables below UTOP (env_nptpages).  A page mapped twice counts
+// twice, and a swapped-out one not at all.  Whatever writes a user PTE
+// or makes a page table calls pgdir_account, with the address space
+// locked; the env comes from the page directory's pp_env, which
+// env_setup_vm sets.  Scratch page directories have none.
+//
+void
+pgdir_account(pde_t *pgdir, int npages, bool shared, int nptpages)
+{
+	struct Env *e;
+
+	if (pgdir == boot_pgdir || (e = pa2page(PADDR(pgdir))->pp_env) == NULL)
+		return;
+	e->env_npages += npages;
+	if (shared)
+		e->env_nshared += npages;
+	e->env_nptpages += nptpages;
+}
+
+// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
+// a pointer to the page table entry (PTE) for linear address 'va'.
+// This requires walking the two-level page table structure.
+//
+// If the relevant page table doesn't exist in the page directory, then:
+//    - If create == 0, pgdir_walk returns NULL.
+//    - Otherwise, pgdir_walk tries to allocate a new page table
 //	with page_alloc.  If this fails, pgdir_walk returns NULL.
 //    - pgdir_walk sets pp_ref to 1 for the new page table.
 //    - Finally, pgdir_walk returns a pointer into the new page table.
 //
+// If 'va' lies in a 4MB page (the PDE has PTE_PS set) there is no page
+// table, so pgdir_walk returns a pointer to the PDE itself; callers that
+// may see kernel addresses, or user superpages, must check for PTE_PS.
+// With create, a user superpage is split into a page table instead
+// (page_super_split), and a page table shared since fork copied
+// (pgdir_pt_unshare), and NULL returned if that's out of memory.
+//
 // Hint: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 pte_t *
@@ -586,6 +1578,19 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// Fill this function in
     // Notice: pte_t is physical address
     struct Page * page;
+    int r = -E_NO_MEM;
+    if ((pgdir[PDX(va)] & (PTE_PS | PTE_P)) == (PTE_PS | PTE_P)) {
+        // A caller that's going to write a PTE in a user superpage
+        // gets the superpage split up first
+        if (!create || (uintptr_t) va >= UTOP)
+            return &pgdir[PDX(va)];
+        if (page_super_split(pgdir, (void *)va) < 0)
+            return NULL;
+    }
+    // Likewise one that's going to write a PTE in a page table shared
+    // since fork gets its own copy of the table
+    if (create && PDE_SHARED(pgdir[PDX(va)]) && pgdir_pt_unshare(pgdir, (void *)va) < 0)
+        return NULL;
     if ((pgdir[PDX(va)] & PTE_P) == 1) {
         // If the page exists(P = 1)
         return (pte_t *)KADDR(PTE_ADDR(pgdir[PDX(va)])) + PTX(va);
@@ -593,12 +1598,24 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     else {
         if (create == 0)
             return NULL;
+        // Kernel page tables are all made at boot and shared; one made
+        // now would be in this pgdir only
+        else if ((uintptr_t) va >= UTOP && kern_pdes_fixed)
+            panic("pgdir_walk: no kernel page table for %08x", va);
         else {
-            // Allocate a page for page table
-            if (page_alloc(&page) == 0) {
-                // Initial the page for page table
-                memset(page2kva(page), 0, PGSIZE);
-                page->pp_ref = 1;
+            // Allocate a zeroed page for page table: an emptied one
+            // from the cache if there is one, like page_alloc_zeroed
+            // peeking first
+            if (page_pt_count > 0) {
+                tlb_flush();
+                spin_lock(&page_lock);
+                r = page_pt_take(&page);
+                spin_unlock(&page_lock);
+            }
+            if (r == 0 || page_alloc_zeroed(&page) == 0) {
+                page_incref(page);
+                if ((uintptr_t) va < UTOP)
+                    pgdir_account(pgdir, 0, 0, 1);
                 // Modify contents in page directory
                 pgdir[PDX(va)] = page2pa(page) | PTE_U | PTE_W | PTE_P ;
                 // Wrong permission will cause unexcepted result
@@ -637,16 +1654,85 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
     pte_t *pte;
     pte = pgdir_walk(pgdir, va, 1);
     if (pte != NULL) {
-        pp->pp_ref += 1;
+        if (va < (void *)UTOP && page_rmap_add(pp, pgdir, va) < 0)
+            return -E_NO_MEM;
+        page_incref(pp);
         if ((*pte & PTE_P) == 1)
             page_remove(pgdir, va);
+        else if (PTE_SWAPPED(*pte))
+            swap_free(*pte);
         *pte = page2pa(pp) | perm | PTE_P;
+        if (va < (void *)UTOP)
+            pgdir_account(pgdir, 1, perm & PTE_SHARE, 0);
         return 0;
     }
     else
         return -E_NO_MEM;
 }
 
+//
+// Load the kernel's GDT and reload all segment registers from it.  The
+// BSP does this once paging is on; each AP does it in mp_main(), to
+// leave the boot GDT in mpentry.S.
+//
+void
+gdt_load(void)
+{
+	asm volatile("lgdt gdt_pd");
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%es" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
+	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
+	asm volatile("lldt %%ax" :: "a" (0));
+}
+
+//
+// Reserve size bytes in the MMIO region [MMIOBASE, MMIOLIM) and map
+// [pa, pa+size) there, uncached, since device registers don't behave
+// like memory.  Neither pa nor size needs to be page-aligned.  Returns
+// the virtual address of pa.  Regions are never unmapped.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+    static uintptr_t base = MMIOBASE;
+    uintptr_t va = base;
+    physaddr_t start = ROUNDDOWN(pa, PGSIZE);
+    size = ROUNDUP(pa + size, PGSIZE) - start;
+    if (size > MMIOLIM - base)
+        panic("mmio_map_region: out of MMIO space");
+    boot_map_segment(boot_pgdir, va, size, start, PTE_W | PTE_PCD | PTE_PWT);
+    base += size;
+    return (void *)(va + (pa - start));
+}
+
+//
+// Back envs[0..n) with memory, read-write at KENVS and read-only at
+// UENVS.  Pages are added, never taken away.  Both regions' page tables
+// were made in i386_vm_init and are shared by every pgdir, so a new page
+// shows up in all address spaces at once, and since no valid entry
+// changes no TLB needs flushing.  Returns -E_NO_MEM if out of memory,
+// leaving what was mapped.  Callers serialize (env_table_lock).
+//
+int
+envs_grow(uint32_t n)
+{
+    static uintptr_t mapped;	// bytes of envs[] backed so far
+    size_t size = ROUNDUP(n * sizeof(struct Env), PGSIZE);
+    struct Page *pp;
+    int r;
+    for (; mapped < size; mapped += PGSIZE) {
+        if ((r = page_alloc_zeroed(&pp)) < 0)
+            return r;
+        page_incref(pp);
+        *pgdir_walk(boot_pgdir, (void *) (KENVS + mapped), 0) = page2pa(pp) | PTE_W | PTE_P | pte_g;
+        *pgdir_walk(boot_pgdir, (void *) (UENVS + mapped), 0) = page2pa(pp) | PTE_U | PTE_P | pte_g;
+    }
+    return 0;
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -670,13 +1756,27 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
     }
 }
 
+//
+// Does the CPU report 'flag' (one of the CPUID_FEAT_* bits) in CPUID 1?
+//
+static int
+cpu_has_feature(uint32_t flag)
+{
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    return (edx & flag) != 0;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
 // of the pte for this page.  This is used by page_remove
 // but should not be used by other callers.
 //
-// Return 0 if there is no page mapped at va.
+// Return 0 if there is no page mapped at va.  A page that was swapped
+// out is brought back first, so the caller needs the address space
+// locked; if it can't come back, we return 0 as well, and the same if
+// va's page table is shared since fork and there's no memory to copy it.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -685,11 +1785,21 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
     pte_t *pte;
+    // The caller may map the page elsewhere as the PTE allows, or write
+    // the PTE, so a page table still shared since fork is copied first
+    if (pgdir_pt_unshare(pgdir, va) < 0)
+        return 0;
     pte = pgdir_walk(pgdir, va, 0);
     if (pte == NULL)
         return 0;
     if (pte_store != NULL)
         *pte_store = pte;
+    if (PTE_SWAPPED(*pte) && swap_in(pgdir, va) < 0)
+        return 0;
+    if (!(*pte & PTE_P))
+        return 0;
+    if (*pte & PTE_PS)
+        return pa2page(PTE_PS_ADDR(*pte) | (PTX(va) << PTXSHIFT));
     return pa2page(*pte);
 
 }
@@ -715,8 +1825,31 @@ page_remove(pde_t *pgdir, void *va)
 	// Fill this function in
     struct Page* page;
     pte_t *pte;
+    // Only one page of a superpage goes: it's split up first, or if
+    // there's no memory for that, the whole 4MB goes
+    if (va < (void *)UTOP && PDE_SUPER(pgdir[PDX(va)]) && page_super_split(pgdir, va) < 0) {
+        page_super_put(pgdir, va);
+        return;
+    }
+    // The same for a page table shared since fork that can't be copied
+    if (va < (void *)UTOP && PDE_SHARED(pgdir[PDX(va)]) && pgdir_pt_unshare(pgdir, va) < 0) {
+        pgdir_pt_leave(pgdir, va);
+        return;
+    }
+    // A swapped-out page needn't come back just to go
+    pte = pgdir_walk(pgdir, va, 0);
+    if (pte != NULL && PTE_SWAPPED(*pte)) {
+        swap_free(*pte);
+        *pte = 0;
+        pmap_revoked();
+        return;
+    }
     page = page_lookup(pgdir, va, &pte);
     if (page != NULL) {
+        if (va < (void *)UTOP) {
+            page_rmap_remove(page, pgdir, va);
+            pgdir_account(pgdir, -1, *pte & PTE_SHARE, 0);
+        }
         page_decref(page);
         *pte = 0;
     }
@@ -725,6 +1858,479 @@ page_remove(pde_t *pgdir, void *va)
 
 }
 
+// Guards the page tables pgdir_cow_copy shares (see pgdir_pt_unshare)
+static struct spinlock pt_share_lock = SPINLOCK_INIT(pt_share_lock);
+
+//
+// Give 'dst' a copy-on-write copy of the page table of 'src' mapping
+// the 4MB at 'base', a page at a time.  Writable and copy-on-write pages
+// are mapped PTE_COW and read-only in both page directories; read-only
+// and PTE_SHARE pages are mapped with their current permissions.  The
+// user exception stack is left out, since the page fault handler writes
+// to it directly.  Swapped-out pages are brought back first.
+//
+static int
+pt_cow_copy(pde_t *dst, pde_t *src, uintptr_t base)
+{
+    uintptr_t va;
+    pte_t *spte, *dpte;
+    int perm, err;
+    for (va = base; va < base + PTSIZE; va += PGSIZE) {
+        spte = pgdir_walk(src, (void *)va, 0);
+        if (PTE_SWAPPED(*spte) && (err = swap_in(src, (void *)va)) < 0)
+            return err;
+        if ((*spte & (PTE_P | PTE_U)) != (PTE_P | PTE_U) || va == UXSTACKTOP - PGSIZE)
+            continue;
+        perm = *spte & PTE_USER;
+        if ((perm & (PTE_W | PTE_COW)) != 0 && (perm & PTE_SHARE) == 0) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            *spte = PTE_ADDR(*spte) | perm;
+            tlb_invalidate(src, (void *)va);
+        }
+        dpte = pgdir_walk(dst, (void *)va, 1);
+        if (dpte == NULL || page_rmap_add(pa2page(PTE_ADDR(*spte)), dst, (void *)va) < 0)
+            return -E_NO_MEM;
+        page_incref(pa2page(PTE_ADDR(*spte)));
+        *dpte = PTE_ADDR(*spte) | perm;
+        pgdir_account(dst, 1, perm & PTE_SHARE, 0);
+    }
+    return 0;
+}
+
+//
+// Give 'dst' a copy-on-write copy of the user part of 'src' (below UTOP).
+// Rather than copy each PTE, 'dst' shares the page tables of 'src', with
+// their PDEs made read-only in both (PDE_SHARED): a write anywhere in the
+// 4MB, by either, faults, and pgdir_pt_unshare gives the writer its own
+// copy of the table then, with the pages copy-on-write.  So forking costs
+// a PDE per 4MB in use, and only the regions written afterwards cost a
+// page table and a PTE per page.  Superpages in 'src' are split up first.
+//
+// The table with the user exception stack, and any that has had pages
+// swapped out (PDE_SWAPS), are copied a page at a time (pt_cow_copy)
+// instead: a shared table never holds swapped-out PTEs.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated for 'dst' or a
+//	superpage split, or a page brought back
+//   -E_FAULT, if a page can't be read back from the swap disk
+//
+int
+pgdir_cow_copy(pde_t *dst, pde_t *src)
+{
+    uintptr_t va;
+    struct Page *tp;
+    int err = 0;
+    for (va = 0; va < UTOP && err == 0; va += PTSIZE) {
+        if ((src[PDX(va)] & PTE_P) == 0)
+            continue;
+        // Superpages are shared copy-on-write a page at a time
+        if (PDE_SUPER(src[PDX(va)]) && page_super_split(src, (void *)va) < 0) {
+            err = -E_NO_MEM;
+            break;
+        }
+        if (va == ROUNDDOWN(UXSTACKTOP - PGSIZE, PTSIZE) || (src[PDX(va)] & PDE_SWAPS)) {
+            err = pt_cow_copy(dst, src, va);
+            continue;
+        }
+        tp = pa2page(PTE_ADDR(src[PDX(va)]));
+        spin_lock(&pt_share_lock);
+        if (!PDE_SHARED(src[PDX(va)])) {
+            tp->pp_ptdir = src;
+            src[PDX(va)] = PTE_ADDR(src[PDX(va)]) | PTE_COW | PTE_U | PTE_P;
+        }
+        page_incref(tp);
+        spin_unlock(&pt_share_lock);
+        dst[PDX(va)] = src[PDX(va)];
+        pgdir_account(dst, 0, 0, 1);
+    }
+    // Our PDEs lost PTE_W
+    tlb_invalidate_all(src);
+    return err;
+}
+
+//
+// Page tables shared copy-on-write by pgdir_cow_copy.  A shared table's
+// pp_ref counts the page directories using it.  Its pages hold one
+// reference for the table, whoever uses it, and rmap entries for
+// pp_ptdir only, the page directory that made the table; pp_ptdir goes
+// NULL when that one stops using it, and the table's pages belong to
+// none of those left in particular until one gets them (pt_claim).
+// Likewise the pages count in pp_ptdir's env_npages, and in each other
+// user's only once it has its own copy.
+//
+// The envs sharing a table needn't share a lock, so pt_share_lock guards
+// the shared tables' PTEs, pp_ref and pp_ptdir, taken inside env locks.
+//
+
+//
+// Give 'pgdir' the rmap entries for the pages of the shared table 'pt',
+// at 'base', that nobody has, and count them in its memory use.
+// Returns 0 or -E_NO_MEM.
+//
+static int
+pt_claim(pde_t *pgdir, uintptr_t base, pte_t *pt)
+{
+    int i, n = 0, nshared = 0;
+    for (i = 0; i < NPTENTRIES; i++) {
+        if (!(pt[i] & PTE_P))
+            continue;
+        if (page_rmap_add(pa2page(PTE_ADDR(pt[i])), pgdir, (void *)(base + i * PGSIZE)) < 0) {
+            while (--i >= 0)
+                if (pt[i] & PTE_P)
+                    page_rmap_remove(pa2page(PTE_ADDR(pt[i])), pgdir, (void *)(base + i * PGSIZE));
+            return -E_NO_MEM;
+        }
+        n++;
+        if (pt[i] & PTE_SHARE)
+            nshared++;
+    }
+    pgdir_account(pgdir, n - nshared, 0, 0);
+    pgdir_account(pgdir, nshared, 1, 0);
+    return 0;
+}
+
+//
+// Give 'pgdir' its own copy of the page table mapping 'va', if it shares
+// it, so its PTEs can be written.  The writable pages in the table become
+// copy-on-write, for everyone sharing it.  The last one left with a
+// shared table just takes it over.
+//
+// RETURNS
+//   0 on success, or if the table isn't shared
+//   -E_NO_MEM, if there's no memory for the table or the rmap
+//
+int
+pgdir_pt_unshare(pde_t *pgdir, void *va)
+{
+    pde_t pde = pgdir[PDX(va)];
+    uintptr_t base = ROUNDDOWN((uintptr_t)va, PTSIZE);
+    struct Page *tp, *np, *pp;
+    pte_t *pt, *npt;
+    bool owner;
+    int i, n = 0, nshared = 0, err = 0;
+    if (!PDE_SHARED(pde) || base >= UTOP)
+        return 0;
+    tp = pa2page(PTE_ADDR(pde));
+    pt = page2kva(tp);
+    // Likely needed, and page_alloc may page out other envs
+    if (page_alloc(&np) < 0)
+        np = NULL;
+    spin_lock(&pt_share_lock);
+    owner = tp->pp_ptdir == pgdir;
+    if (tp->pp_ref == 1) {
+        if (!owner && (err = pt_claim(pgdir, base, pt)) < 0)
+            goto out;
+        tp->pp_ptdir = NULL;
+        pgdir[PDX(va)] = PTE_ADDR(pde) | PTE_U | PTE_W | PTE_P;
+        goto out;
+    }
+    if (np == NULL) {
+        err = -E_NO_MEM;
+        goto out;
+    }
+    npt = page2kva(np);
+    for (i = 0; i < NPTENTRIES; i++) {
+        npt[i] = pt[i];
+        if (!(pt[i] & PTE_P))
+            continue;
+        if ((pt[i] & (PTE_W | PTE_COW)) != 0 && (pt[i] & PTE_SHARE) == 0)
+            npt[i] = pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+        pp = pa2page(PTE_ADDR(pt[i]));
+        // The owner's entries and counts go with its copy
+        if (!owner && page_rmap_add(pp, pgdir, (void *)(base + i * PGSIZE)) < 0) {
+            while (--i >= 0)
+                if (npt[i] & PTE_P) {
+                    page_rmap_remove(pa2page(PTE_ADDR(npt[i])), pgdir, (void *)(base + i * PGSIZE));
+                    page_decref(pa2page(PTE_ADDR(npt[i])));
+                }
+            err = -E_NO_MEM;
+            goto out;
+        }
+        page_incref(pp);
+        n++;
+        if (pt[i] & PTE_SHARE)
+            nshared++;
+    }
+    if (owner)
+        tp->pp_ptdir = NULL;
+    else {
+        pgdir_account(pgdir, n - nshared, 0, 0);
+        pgdir_account(pgdir, nshared, 1, 0);
+    }
+    page_incref(np);
+    page_decref(tp);
+    pgdir[PDX(va)] = page2pa(np) | PTE_U | PTE_W | PTE_P;
+    np = NULL;
+out:
+    spin_unlock(&pt_share_lock);
+    if (np != NULL)
+        page_free(np);
+    if (err == 0)
+        tlb_invalidate_all(pgdir);
+    return err;
+}
+
+//
+// Unmap the whole 4MB that the shared page table at 'va' maps in 'pgdir',
+// dropping pgdir's use of the table.
+//
+void
+pgdir_pt_leave(pde_t *pgdir, void *va)
+{
+    struct Page *tp = pa2page(PTE_ADDR(pgdir[PDX(va)]));
+    pte_t *pt = page2kva(tp);
+    uintptr_t base = ROUNDDOWN((uintptr_t)va, PTSIZE);
+    bool owner, last;
+    int i, n = 0, nshared = 0;
+    assert(PDE_SHARED(pgdir[PDX(va)]));
+    spin_lock(&pt_share_lock);
+    owner = tp->pp_ptdir == pgdir;
+    last = tp->pp_ref == 1;
+    for (i = 0; (owner || last) && i < NPTENTRIES; i++) {
+        if (!(pt[i] & PTE_P))
+            continue;
+        if (owner) {
+            page_rmap_remove(pa2page(PTE_ADDR(pt[i])), pgdir, (void *)(base + i * PGSIZE));
+            n++;
+            if (pt[i] & PTE_SHARE)
+                nshared++;
+        }
+        if (last)
+            page_decref(pa2page(PTE_ADDR(pt[i])));
+    }
+    pgdir_account(pgdir, -(n - nshared), 0, -1);
+    pgdir_account(pgdir, -nshared, 1, 0);
+    if (owner)
+        tp->pp_ptdir = NULL;
+    pgdir[PDX(va)] = 0;
+    page_decref(tp);
+    spin_unlock(&pt_share_lock);
+    tlb_invalidate_all(pgdir);
+}
+
+//
+// Make the copy-on-write page at 'va' in 'pgdir' writable again in
+// place, if no one else refers to it any more: everyone who shared it
+// has gone, or broken away already.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if 'va' isn't mapped copy-on-write, or the page is still
+//	shared
+//   -E_NO_MEM, if its page table is shared and can't be copied
+//
+int
+page_cow_reuse(pde_t *pgdir, void *va)
+{
+    pte_t *pte;
+    if (pgdir_pt_unshare(pgdir, va) < 0)
+        return -E_NO_MEM;
+    pte = pgdir_walk(pgdir, va, 0);
+    if (pte == NULL || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW)
+        || !page_mapped_once(pa2page(PTE_ADDR(*pte)), pgdir, va))
+        return -E_INVAL;
+    // A merged page may have been found by more envs since
+    if (pa2page(PTE_ADDR(*pte))->pp_merged
+        && !merge_forget(pa2page(PTE_ADDR(*pte)), pgdir, va))
+        return -E_INVAL;
+    *pte = PTE_ADDR(*pte) | ((*pte & PTE_USER) & ~PTE_COW) | PTE_W;
+    tlb_invalidate(pgdir, va);
+    return 0;
+}
+
+//
+// Resolve a write to the copy-on-write page at 'va' in 'pgdir': the page
+// is copied into a fresh private page, or simply made writable again if
+// no one else refers to it any more.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if 'va' isn't mapped copy-on-write
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+    struct Page *pp, *np;
+    pte_t *pte;
+    int perm, err;
+    if (page_cow_reuse(pgdir, va) == 0)
+        return 0;
+    pte = pgdir_walk(pgdir, va, 0);
+    if (pte == NULL || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+        return -E_INVAL;
+    pp = pa2page(PTE_ADDR(*pte));
+    perm = ((*pte & PTE_USER) & ~PTE_COW) | PTE_W;
+    if (pp == zero_page) {
+        // Demand-zero memory written for the first time
+        if ((err = page_alloc_zeroed_at(&np, va)) < 0)
+            return err;
+    } else if ((err = page_alloc_at(&np, va)) < 0)
+        return err;
+    else
+        page_copy(page2kva(np), page2kva(pp));
+    // page_insert drops our reference to the shared page
+    if ((err = page_insert(pgdir, np, va, perm)) < 0) {
+        page_free(np);
+        return err;
+    }
+    return 0;
+}
+
+//
+// Map the shared zero page at 'va' in 'pgdir', for memory that reads as
+// zeros until it's written: read-only, and copy-on-write if 'perm' has
+// PTE_W, so the first write gets a fresh zeroed page with 'perm' instead
+// (page_cow_break).  Reading sparse memory then costs no pages, and no
+// zeroing.  A page of its own is mapped if the zero page's 16-bit
+// reference count is running out.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if a page table or page couldn't be allocated
+//
+int
+page_map_zero(pde_t *pgdir, void *va, int perm)
+{
+    struct Page *pp;
+    int err;
+    if (zero_page->pp_ref < ZERO_PAGE_MAXREF)
+        return page_insert(pgdir, zero_page, va,
+                           (perm & PTE_W) ? (perm & ~PTE_W) | PTE_COW : perm);
+    if ((err = page_alloc_zeroed_at(&pp, va)) < 0)
+        return err;
+    if ((err = page_insert(pgdir, pp, va, perm)) < 0)
+        page_free(pp);
+    return err;
+}
+
+//
+// Is 'va' in 'pgdir' mapped to the shared zero page?
+//
+bool
+page_maps_zero(pde_t *pgdir, void *va)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 0);
+    return pte != NULL && (*pte & (PTE_P | PTE_PS)) == PTE_P
+        && pa2page(PTE_ADDR(*pte)) == zero_page;
+}
+
+//
+// Superpages.  An aligned 4MB of user space can be mapped with one PDE
+// (PTE_PS) rather than a page table, from a block of NPTENTRIES pages
+// that page_alloc_order hands out in one piece: the region then takes
+// a single TLB entry and no page-table page.  Each page of the block
+// holds one reference for the 4MB mapping, so a page that's also mapped
+// elsewhere outlives it, and the rest go back to the buddy lists one by
+// one, to merge there.  The 4MB mapping has no rmap entries.
+//
+// A PTE for a single page of the region -- to page_insert over it,
+// page_remove it, or share it copy-on-write -- needs a page table, so
+// the superpage is split first into NPTENTRIES ordinary PTEs for the
+// same pages.  Swapping and page aging pass superpages over.
+//
+#define SUPER_ORDER	10
+
+//
+// Map a fresh, zeroed 4MB page at 'va' in 'pgdir' with permissions
+// 'perm|PTE_PS|PTE_P', in place of whatever was mapped in [va, va+PTSIZE).
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if va isn't PTSIZE-aligned and below UTOP
+//   -E_NO_MEM, if there's no free block of 4MB, or the CPU has no 4MB
+//	pages; the caller can map ordinary pages instead
+//
+int
+page_super_alloc(pde_t *pgdir, void *va, int perm)
+{
+    struct Page *pp;
+    pde_t pde;
+    int i;
+    static_assert((PGSIZE << SUPER_ORDER) == PTSIZE && SUPER_ORDER <= PAGE_MAX_ORDER);
+    if ((uintptr_t)va % PTSIZE != 0 || va >= (void *)UTOP)
+        return -E_INVAL;
+    if (!(rcr4() & CR4_PSE) || page_alloc_order(&pp, SUPER_ORDER) < 0)
+        return -E_NO_MEM;
+    for (i = 0; i < NPTENTRIES; i++) {
+        page_zero(page2kva(pp + i));
+        page_incref(pp + i);
+    }
+    pde = pgdir[PDX(va)];
+    if (PDE_SUPER(pde))
+        page_super_put(pgdir, va);
+    else if (PDE_SHARED(pde))
+        pgdir_pt_leave(pgdir, va);
+    else if (pde & PTE_P) {
+        for (i = 0; i < NPTENTRIES; i++)
+            page_remove(pgdir, va + i * PGSIZE);
+        pgdir[PDX(va)] = 0;
+        tlb_invalidate(pgdir, va);
+        page_decref(pa2page(PTE_ADDR(pde)));
+        pgdir_account(pgdir, 0, 0, -1);
+    }
+    pgdir[PDX(va)] = page2pa(pp) | perm | PTE_PS | PTE_P;
+    pgdir_account(pgdir, NPTENTRIES, perm & PTE_SHARE, 0);
+    return 0;
+}
+
+//
+// Split the superpage that maps 'va' in 'pgdir', if there is one, into
+// a page table mapping the same pages with the same permissions.
+//
+// RETURNS
+//   0 on success, or if va isn't in a superpage
+//   -E_NO_MEM, if there's no memory for the page table or the rmap
+//
+int
+page_super_split(pde_t *pgdir, void *va)
+{
+    pde_t pde = pgdir[PDX(va)];
+    uintptr_t base = ROUNDDOWN((uintptr_t)va, PTSIZE);
+    struct Page *pp, *pt;
+    pte_t *ptes;
+    int i;
+    if (!PDE_SUPER(pde) || base >= UTOP)
+        return 0;
+    pp = pa2page(PTE_PS_ADDR(pde));
+    if (page_alloc(&pt) < 0)
+        return -E_NO_MEM;
+    ptes = page2kva(pt);
+    for (i = 0; i < NPTENTRIES; i++) {
+        if (page_rmap_add(pp + i, pgdir, (void *)(base + i * PGSIZE)) < 0) {
+            while (--i >= 0)
+                page_rmap_remove(pp + i, pgdir, (void *)(base + i * PGSIZE));
+            page_free(pt);
+            return -E_NO_MEM;
+        }
+        ptes[i] = page2pa(pp + i) | (pde & (PTE_USER | PTE_A | PTE_D));
+    }
+    page_incref(pt);
+    pgdir[PDX(va)] = page2pa(pt) | PTE_U | PTE_W | PTE_P;
+    pgdir_account(pgdir, 0, 0, 1);
+    tlb_invalidate(pgdir, (void *)base);
+    return 0;
+}
+
+//
+// Unmap the whole superpage that maps 'va' in 'pgdir', dropping the
+// reference it holds on each of its pages.
+//
+void
+page_super_put(pde_t *pgdir, void *va)
+{
+    struct Page *pp = pa2page(PTE_PS_ADDR(pgdir[PDX(va)]));
+    int i;
+    assert(PDE_SUPER(pgdir[PDX(va)]));
+    pgdir_account(pgdir, -NPTENTRIES, pgdir[PDX(va)] & PTE_SHARE, 0);
+    pgdir[PDX(va)] = 0;
+    tlb_invalidate(pgdir, (void *)ROUNDDOWN((uintptr_t)va, PTSIZE));
+    for (i = 0; i < NPTENTRIES; i++)
+        page_decref(pp + i);
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -732,13 +2338,172 @@ page_remove(pde_t *pgdir, void *va)
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct Tlb_batch *tb = &tlb_batch[cpunum()];
+
+	pmap_revoked();
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (!curenv || curenv->env_pgdir == pgdir) {
 		invlpg(va);
+		tlb_invlpgs++;
+	}
+
+	// Another CPU may be running in pgdir too; tell it, in tlb_flush()
+	if (pgdir == boot_pgdir || ncpu == 1)
+		return;
+	if (tb->tb_pgdir != pgdir) {
+		tlb_flush();
+		tb->tb_pgdir = pgdir;
+	}
+	if (tb->tb_nva < TLB_BATCH_MAX)
+		tb->tb_va[tb->tb_nva++] = (uintptr_t) va;
+	else
+		tb->tb_all = 1;
+}
+
+//
+// Invalidate all of pgdir's TLB entries, after its PDEs change: invlpg
+// drops the entries for one page only.
+//
+static void
+tlb_invalidate_all(pde_t *pgdir)
+{
+	tlb_invalidate(pgdir, 0);
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(rcr3());
+	if (pgdir != boot_pgdir && ncpu > 1)
+		tlb_batch[cpunum()].tb_all = 1;
+}
+
+//
+// Send this CPU's batch of invalidations to the other CPUs running in
+// its address space, and wait until they have done them.  An env runs
+// on one CPU at a time and every other CPU loads a fresh CR3 before it
+// runs the env, so those are the CPUs whose curenv runs in the pgdir:
+// at most one, unless threads share it (sys_thread_create).
+// Called at the end of each operation that changed page tables: on the
+// way back to user mode, before halting, and before a page is allocated
+// or leaves our magazine -- a page that was unmapped must not be reused
+// while another CPU can still reach it through its TLB.
+//
+void
+tlb_flush(void)
+{
+	struct Tlb_batch *tb = &tlb_batch[cpunum()];
+	struct Tlb_mailbox *tm;
+	struct Env *e;
+	uint32_t i, req;
+	int cpu;
+
+	if (tb->tb_pgdir == NULL)
+		return;
+	// Our PTE stores must be visible before we look at who is running
+	// where; a CPU that starts running the env after this loads CR3
+	// and so sees the new PTEs.
+	mb();
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		e = cpus[cpu].cpu_env;
+		if (cpu == cpunum() || e == NULL || e->env_pgdir != tb->tb_pgdir)
+			continue;
+		tm = &tlb_mailbox[cpu];
+		spin_lock(&tm->tm_lock);
+		for (i = 0; i < tb->tb_nva && tm->tm_nva < TLB_BATCH_MAX; i++)
+			tm->tm_va[tm->tm_nva++] = tb->tb_va[i];
+		if (tb->tb_all || i < tb->tb_nva)
+			tm->tm_all = 1;
+		req = ++tm->tm_req;
+		spin_unlock(&tm->tm_lock);
+		tlb_shootdowns++;
+		lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_TLB);
+		// It may be waiting for us likewise
+		while ((int32_t) (tm->tm_done - req) < 0) {
+			tlb_poll();
+			pause();
+		}
+	}
+	tb->tb_pgdir = NULL;
+	tb->tb_nva = 0;
+	tb->tb_all = 0;
+}
+
+//
+// Do the invalidations other CPUs have asked of us.
+//
+static void
+tlb_mailbox_run(struct Tlb_mailbox *tm)
+{
+	uint32_t i;
+
+	spin_lock(&tm->tm_lock);
+	if (tm->tm_all)
+		tlbflush();
+	else
+		for (i = 0; i < tm->tm_nva; i++)
+			invlpg((void *) tm->tm_va[i]);
+	tm->tm_nva = 0;
+	tm->tm_all = 0;
+	tm->tm_done = tm->tm_req;
+	spin_unlock(&tm->tm_lock);
+}
+
+//
+// Do the invalidations other CPUs have asked of us, if there are any
+// and we aren't in the middle of doing them.  A CPU in the kernel
+// calls this whenever it waits, in spin_lock and tlb_flush, so that a
+// CPU waiting on it in tlb_flush can't wait forever.
+//
+void
+tlb_poll(void)
+{
+	struct Tlb_mailbox *tm = &tlb_mailbox[cpunum()];
+
+	if (tm->tm_done == tm->tm_req || tm->tm_polling)
+		return;
+	tm->tm_polling = 1;
+	tlb_mailbox_run(tm);
+	tm->tm_polling = 0;
+}
+
+//
+// env_pop_tf and env_sysexit call tlb_to_user() last thing, with
+// interrupts off: our own invalidations go out, and we pick up the
+// other CPUs' requests.
+//
+void
+tlb_to_user(void)
+{
+	tlb_flush();
+	tlb_poll();
+}
+
+//
+// The IRQ_TLB interrupt: another CPU changed the page tables we're
+// running in.
+//
+void
+tlb_shootdown_intr(void)
+{
+	tlb_poll();
+	lapic_eoi();
 }
 
 static uintptr_t user_mem_check_addr;
 
+// Bumped each time a user mapping may lose rights it had -- it's unmapped,
+// write-protected or paged out -- so that a range user_mem_check passed
+// before is checked again.  Every such change comes through
+// tlb_invalidate, but for those of PTEs that weren't present, or that no
+// CPU can have cached (swap_out).  The PTE store comes first, and a
+// checker reads pmap_revokes before walking, so it never caches a range
+// as of a count that's older than the PTEs it saw.
+volatile uint32_t pmap_revokes;
+
+void
+pmap_revoked(void)
+{
+	atomic_inc(&pmap_revokes);
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -757,29 +2522,83 @@ static uintptr_t user_mem_check_addr;
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
+// The page tables are walked a page table at a time rather than with a
+// pgdir_walk per page, and the running env remembers the last range that
+// passed, for the callers that check the same buffer call after call.
+// Only curenv's is kept: no other CPU checks it meanwhile.
+//
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here. 
     uintptr_t lva = (uintptr_t)va;
-    uintptr_t hva = (uintptr_t)(va + len);
-    uintptr_t iva ;
+    uintptr_t hva = lva + len;
+    uintptr_t iva, next;
+    uint32_t revokes = pmap_revokes;
+    pde_t pde;
+    pte_t *pte;
     perm = perm | PTE_U | PTE_P;
-    for (iva = lva; iva < hva; iva += PGSIZE) {
-        if (iva < ULIM) {
-            pte_t *pte = pgdir_walk(env->env_pgdir, (void *)iva, 0);
-            if (!pte || ((*pte & perm) != perm)) {
-                user_mem_check_addr = iva;
-                return -E_FAULT;
-            }
+    if (hva < lva) {
+        user_mem_check_addr = lva;
+        return -E_FAULT;
+    }
+    if (env == curenv && env->env_umc_revokes == revokes
+        && lva >= env->env_umc_va && hva <= env->env_umc_end
+        && (env->env_umc_perm & perm) == perm)
+        return 0;
+    for (iva = ROUNDDOWN(lva, PGSIZE); iva < hva; iva = next) {
+        if (iva >= ULIM)
+            goto fault;
+        // The kernel is about to write, so a page table shared since
+        // fork, read-only, gets copied now, as a write from env would
+        if ((perm & PTE_W) && PDE_SHARED(env->env_pgdir[PDX(iva)])) {
+            bool locked = spin_holding(&env_locks[env->env_lockx]);
+            if (!locked)
+                env_lock(env);
+            pgdir_pt_unshare(env->env_pgdir, (void *)iva);
+            if (!locked)
+                env_unlock(env);
         }
-        else {
-            user_mem_check_addr = iva;
-            return -E_FAULT;
+        // The PDE's rights limit those of each of its PTEs, and a
+        // superpage has no PTEs
+        if (((pde = env->env_pgdir[PDX(iva)]) & perm) != perm)
+            goto fault;
+        next = MIN(ROUNDDOWN(iva, PTSIZE) + PTSIZE, hva);
+        if (pde & PTE_PS)
+            continue;
+        pte = (pte_t *)KADDR(PTE_ADDR(pde)) + PTX(iva);
+        for (; iva < next; iva += PGSIZE, pte++) {
+            // The kernel is about to touch the page, so one that was
+            // swapped out comes back now, and the zero page, if the
+            // kernel will write, is swapped for a page of env's own;
+            // the caller may hold env's lock already
+            if (PTE_SWAPPED(*pte) || ((perm & PTE_W) && (*pte & PTE_P)
+                                      && pa2page(PTE_ADDR(*pte)) == zero_page)) {
+                bool locked = spin_holding(&env_locks[env->env_lockx]);
+                if (!locked)
+                    env_lock(env);
+                if (PTE_SWAPPED(*pte))
+                    swap_in(env->env_pgdir, (void *)iva);
+                else
+                    page_cow_break(env->env_pgdir, (void *)iva);
+                if (!locked)
+                    env_unlock(env);
+            }
+            if ((*pte & perm) != perm)
+                goto fault;
         }
-        iva = ROUNDDOWN(iva, PGSIZE);
-    } 
+    }
+    if (env == curenv) {
+        env->env_umc_va = lva;
+        env->env_umc_end = hva;
+        env->env_umc_perm = perm;
+        env->env_umc_revokes = revokes;
+    }
     return 0;
+
+fault:
+    user_mem_check_addr = MAX(iva, lva);
+    return -E_FAULT;
 }
 
 //
@@ -799,7 +2618,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 }
 
 // check page_insert, page_remove, &c
-static void
+void
 page_check(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
@@ -819,8 +2638,7 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	page_steal_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -944,7 +2762,7 @@ page_check(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_return_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -954,3 +2772,156 @@ page_check(void)
 	cprintf("page_check() succeeded!\n");
 }
 
+//
+// The monitor's bench: time the memory-management primitives, each n
+// times in a row, and print the fastest and the mean cycles per call.
+// The page-table work is done in boot_pgdir at BENCH_VA, below UTOP,
+// where nothing is mapped: no env uses boot_pgdir's user half.
+//
+
+#define BENCH_VA	0x10000000
+#define BENCH_MAX	64		// most calls timed per primitive
+
+static uint64_t bench_start, bench_min, bench_total;
+
+static void
+bench_begin(void)
+{
+	bench_min = ~0ULL;
+	bench_total = 0;
+}
+
+static void
+bench_in(void)
+{
+	bench_start = read_tsc();
+}
+
+static void
+bench_out(void)
+{
+	uint64_t c = read_tsc() - bench_start;
+
+	bench_total += c;
+	if (c < bench_min)
+		bench_min = c;
+}
+
+static void
+bench_print(const char *name, int n)
+{
+	cprintf("%-22s min %8llu  mean %8llu cycles\n", name, bench_min, bench_total / n);
+}
+
+void
+pmap_bench(int n)
+{
+	static struct Page *pp[BENCH_MAX];
+	extern void trap_bench_handler();
+	struct Gatedesc saved;
+	struct Env *e;
+	int i, r;
+
+	n = MIN(MAX(n, 1), BENCH_MAX);
+	for (i = 0; i < n; i++)
+		assert(!(boot_pgdir[PDX(BENCH_VA + i * PTSIZE)] & PTE_P));
+
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		r = page_alloc(&pp[i]);
+		bench_out();
+		if (r < 0)
+			panic("pmap_bench: page_alloc: %e", r);
+	}
+	bench_print("page_alloc", n);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		page_free(pp[i]);
+		bench_out();
+	}
+	bench_print("page_free", n);
+
+	// A page table each, made and then found
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		r = pgdir_walk(boot_pgdir, (void *) (BENCH_VA + i * PTSIZE), 1) != NULL;
+		bench_out();
+		if (!r)
+			panic("pmap_bench: pgdir_walk: out of memory");
+	}
+	bench_print("pgdir_walk, creating", n);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		pgdir_walk(boot_pgdir, (void *) (BENCH_VA + i * PTSIZE), 0);
+		bench_out();
+	}
+	bench_print("pgdir_walk", n);
+
+	// Into those page tables
+	for (i = 0; i < n; i++)
+		if ((r = page_alloc(&pp[i])) < 0)
+			panic("pmap_bench: page_alloc: %e", r);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		r = page_insert(boot_pgdir, pp[i], (void *) (BENCH_VA + i * PTSIZE), PTE_W);
+		bench_out();
+		if (r < 0)
+			panic("pmap_bench: page_insert: %e", r);
+	}
+	bench_print("page_insert", n);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		page_remove(boot_pgdir, (void *) (BENCH_VA + i * PTSIZE));
+		bench_out();
+	}
+	bench_print("page_remove", n);
+	for (i = 0; i < n; i++) {
+		pp[i] = pa2page(PTE_ADDR(boot_pgdir[PDX(BENCH_VA + i * PTSIZE)]));
+		boot_pgdir[PDX(BENCH_VA + i * PTSIZE)] = 0;
+		page_decref(pp[i]);
+	}
+
+	// As sys_exofork makes them, so no CPU runs them meanwhile
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		r = env_alloc(&e, 0);
+		if (r == 0)
+			env_set_status(e, ENV_NOT_RUNNABLE);
+		bench_out();
+		if (r < 0)
+			panic("pmap_bench: env_alloc: %e", r);
+		env_free(e);
+	}
+	bench_print("env_alloc", n);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		if ((r = env_alloc(&e, 0)) < 0)
+			panic("pmap_bench: env_alloc: %e", r);
+		env_set_status(e, ENV_NOT_RUNNABLE);
+		bench_in();
+		env_free(e);
+		bench_out();
+	}
+	bench_print("env_free", n);
+
+	// A trap to a handler that saves and restores a Trapframe, as
+	// trapentry.S and env_pop_tf do, but doesn't go through trap()
+	saved = idt[T_BENCH];
+	SETGATE(idt[T_BENCH], 0, GD_KT, trap_bench_handler, 0);
+	bench_begin();
+	for (i = 0; i < n; i++) {
+		bench_in();
+		asm volatile("int %0" : : "i" (T_BENCH) : "memory");
+		bench_out();
+	}
+	idt[T_BENCH] = saved;
+	bench_print("trap round trip", n);
+}
+
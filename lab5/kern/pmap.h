@@ -9,6 +9,16 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 struct Env;
+struct Rmap;
+
+/* 'make PAGE_COLORS=n', n a power of two, gives user pages physical
+ * addresses of the same cache color as their virtual ones: page number
+ * mod n, where n is the cache size over its ways times PGSIZE.  Pages
+ * side by side in an env then don't compete for cache sets (see
+ * page_alloc_at).  0 for any page. */
+#ifndef PAGE_COLORS
+#define PAGE_COLORS	0
+#endif
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -37,6 +47,9 @@ struct Env;
 
 
 
+// Largest block the buddy allocator hands out: 2^10 pages = 4MB.
+#define PAGE_MAX_ORDER	10
+
 extern char bootstacktop[], bootstack[];
 
 extern struct Page *pages;
@@ -45,25 +58,71 @@ extern size_t npage;
 extern physaddr_t boot_cr3;
 extern pde_t *boot_pgdir;
 
+// A page of zeros, mapped copy-on-write for demand-zero memory; it's
+// never written, nor freed (see page_map_zero)
+extern struct Page *zero_page;
+#define ZERO_PAGE_MAXREF	0xF000
+
+extern struct spinlock page_lock;
+extern bool page_reclaim_off;
+
+extern uint32_t tlb_cr3_loads;
+extern uint32_t tlb_invlpgs;
+extern uint32_t tlb_shootdowns;
+extern volatile uint32_t pmap_revokes;
+
 extern struct Segdesc gdt[];
 extern struct Pseudodesc gdt_pd;
 
 void	i386_vm_init();
 void	i386_detect_memory();
+void	gdt_load(void);
+void *	mmio_map_region(physaddr_t pa, size_t size);
+int	envs_grow(uint32_t n);
+void	pmap_bench(int n);
 
 void	page_init(void);
 int	page_alloc(struct Page **pp_store);
 void	page_free(struct Page *pp);
+int	page_alloc_zeroed(struct Page **pp_store);
+int	page_alloc_at(struct Page **pp_store, const void *va);
+int	page_alloc_zeroed_at(struct Page **pp_store, const void *va);
+void	page_zero_idle(int n);
+int	page_alloc_order(struct Page **pp_store, int order);
+void	page_free_order(struct Page *pp, int order);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	pmap_revoked(void);
+void	tlb_flush(void);
+void	tlb_poll(void);
+void	tlb_to_user(void);
+void	tlb_shootdown_intr(void);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
+// Page reference counts change on several CPUs at once, with no lock
+// in common, so they change atomically.
+static inline void
+page_incref(struct Page *pp)
+{
+	asm volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "memory");
+}
+
+// Drop a reference, returning how many are left.  page_decref() frees
+// the page when there are none.
+static inline int
+page_ref_dec(struct Page *pp)
+{
+	uint16_t old = -1;
+	asm volatile("lock; xaddw %0, %1" : "+r" (old), "+m" (pp->pp_ref) : : "memory");
+	return old - 1;
+}
+
 static inline ppn_t
 page2ppn(struct Page *pp)
 {
@@ -91,5 +150,39 @@ page2kva(struct Page *pp)
 }
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+void	pgdir_account(pde_t *pgdir, int npages, bool shared, int nptpages);
+void	page_table_decref(struct Page *pt);
+int	pgdir_cow_copy(pde_t *dst, pde_t *src);
+int	pgdir_pt_unshare(pde_t *pgdir, void *va);
+void	pgdir_pt_leave(pde_t *pgdir, void *va);
+void	rmap_init(void);
+int	page_rmap_add(struct Page *pp, pde_t *pgdir, void *va);
+void	page_rmap_remove(struct Page *pp, pde_t *pgdir, void *va);
+void	page_rmap_walk(struct Page *pp, void (*fn)(pde_t *, uintptr_t, void *), void *arg);
+bool	page_mapped_once(struct Page *pp, pde_t *pgdir, void *va);
+int	page_cow_reuse(pde_t *pgdir, void *va);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	page_map_zero(pde_t *pgdir, void *va, int perm);
+bool	page_maps_zero(pde_t *pgdir, void *va);
+int	page_super_alloc(pde_t *pgdir, void *va, int perm);
+int	page_super_split(pde_t *pgdir, void *va);
+void	page_super_put(pde_t *pgdir, void *va);
+
+// Self-checks, for selftest_run
+void	check_page_alloc(void);
+void	check_page_orders(void);
+void	check_super_pages(void);
+void	page_check(void);
+void	check_boot_pgdir(void);
+void	check_rmap(void);
+
+// Is 'pde' a user superpage's, mapping 4MB without a page table?
+#define PDE_SUPER(pde)	(((pde) & (PTE_PS | PTE_P | PTE_U)) == (PTE_PS | PTE_P | PTE_U))
+// Is 'pde' a page table's that fork left shared, read-only and PTE_COW,
+// with another page directory (see pgdir_cow_copy)?
+#define PDE_SHARED(pde)	(((pde) & (PTE_PS | PTE_P | PTE_COW)) == (PTE_P | PTE_COW))
+// In a PDE: some PTE of the table has been swapped out, so fork copies
+// the table rather than share it
+#define PDE_SWAPS	PTE_SWAP
 
 #endif /* !JOS_KERN_PMAP_H */
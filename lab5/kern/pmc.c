@@ -0,0 +1,78 @@
+// Per-env hardware performance counters (see inc/pmc.h).
+//
+// IA32_PERFEVTSELi picks counter i's event; only its low 32 bits of
+// the counter can be written with wrmsr, so rather than reload an
+// env's count on each switch we start from zero and add up on the way
+// out.  The counters count only user mode, so the kernel's own work,
+// cycles in system calls included, goes to nobody; syscallstat has
+// those cycles.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+
+#include <kern/pmc.h>
+#include <kern/env.h>
+
+#define MSR_PMC0		0x0C1
+#define MSR_PERFEVTSEL0		0x186
+#define PERFEVTSEL_USR		(1 << 16)
+#define PERFEVTSEL_EN		(1 << 22)
+
+int pmc_n;
+uint64_t pmc_total[PMC_N];
+
+// Event select and unit mask for each PMC_*
+static const struct {
+	const char *name;
+	uint8_t event, umask;
+} pmc_events[PMC_N] = {
+	[PMC_CYCLES] =		{ "cycles", 0x3C, 0x00 },
+	[PMC_INSTRS] =		{ "instructions", 0xC0, 0x00 },
+	[PMC_LLC_MISS] =	{ "llc-misses", 0x2E, 0x41 },
+};
+
+void
+pmc_init(void)
+{
+	int i;
+
+	if ((pmc_n = pmc_ncounters()) == 0)
+		return;
+	for (i = 0; i < pmc_n; i++) {
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		wrmsr(MSR_PMC0 + i, 0);
+		wrmsr(MSR_PERFEVTSEL0 + i, pmc_events[i].event
+		      | (pmc_events[i].umask << 8) | PERFEVTSEL_USR | PERFEVTSEL_EN);
+	}
+	lcr4(rcr4() | CR4_PCE);
+}
+
+void
+pmc_save(struct Env *e)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < pmc_n; i++) {
+		v = rdpmc(i);
+		pmc_total[i] += v;
+		if (e)
+			e->env_pmc[i] += v;
+	}
+}
+
+void
+pmc_load(void)
+{
+	int i;
+
+	for (i = 0; i < pmc_n; i++)
+		wrmsr(MSR_PMC0 + i, 0);
+}
+
+const char *
+pmc_name(int i)
+{
+	return pmc_events[i].name;
+}
@@ -0,0 +1,29 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PMC_H
+#define JOS_KERN_PMC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/pmc.h>
+
+struct Env;
+
+// Counters programmed, the same on every CPU
+extern int pmc_n;
+// Everything counted, by PMC_*, whichever env it went to
+extern uint64_t pmc_total[PMC_N];
+
+// Program this CPU's counters and allow rdpmc in user mode.  Run on
+// each CPU: the MSRs are per CPU.
+void pmc_init(void);
+// Add what the counters counted since the last pmc_load to e (which
+// may be NULL, for an env destroyed meanwhile) and the totals.  Call
+// before curenv changes or this CPU stops running it.
+void pmc_save(struct Env *e);
+// Start the counters afresh for curenv.
+void pmc_load(void);
+const char *pmc_name(int i);
+
+#endif	// !JOS_KERN_PMC_H
@@ -1,24 +1,85 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel log (kern/klog.c), which the
+// console reads from.
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <inc/string.h>
+
+#include <kern/klog.h>
+
+extern int ch_color;
+
+// A message gathers here, and goes to the log a chunk at a time
+struct printbuf {
+	int idx;
+	int cnt;
+	int color;	// the last color noted in buf
+	char buf[KLOG_CHUNK];
+};
+
+// Note ch_color in b, with room after it for a character
+static void
+putcolor(struct printbuf *b)
+{
+	if (b->idx + 3 > KLOG_CHUNK) {
+		klog_write(b->buf, b->idx);
+		b->idx = 0;
+	}
+	b->buf[b->idx++] = KLOG_COLOR;
+	b->buf[b->idx++] = ch_color;
+	b->color = ch_color;
+}
 
 static void
-putch(int ch, int *cnt)
+putch(int ch, struct printbuf *b)
 {
-	cputchar(ch);
-	*cnt++;
+	// Each chunk starts with its color
+	if (b->idx == 0 || ch_color != b->color)
+		putcolor(b);
+	b->buf[b->idx++] = ch;
+	if (b->idx == KLOG_CHUNK) {
+		klog_write(b->buf, b->idx);
+		b->idx = 0;
+	}
+	b->cnt++;
+}
+
+static void
+putstr(const char *s, size_t n, struct printbuf *b)
+{
+	size_t m;
+
+	while (n > 0) {
+		if (b->idx == 0 || ch_color != b->color)
+			putcolor(b);
+		m = MIN(n, KLOG_CHUNK - b->idx);
+		memmove(b->buf + b->idx, s, m);
+		b->idx += m;
+		b->cnt += m;
+		s += m;
+		n -= m;
+		if (b->idx == KLOG_CHUNK) {
+			klog_write(b->buf, b->idx);
+			b->idx = 0;
+		}
+	}
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
-	int cnt = 0;
+	struct printbuf b;
 
-	vprintfmt((void*)putch, &cnt, fmt, ap);
-	return cnt;
+	b.idx = 0;
+	b.cnt = 0;
+	vprintfmt_bulk((void*)putch, (void*)putstr, &b, fmt, ap);
+	// A color set at the end is for the console's next output
+	if (b.idx == 0 || ch_color != b.color)
+		putcolor(&b);
+	klog_write(b.buf, b.idx);
+	return b.cnt;
 }
 
 int
@@ -33,4 +94,3 @@ cprintf(const char *fmt, ...)
 
 	return cnt;
 }
-
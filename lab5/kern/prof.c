@@ -0,0 +1,126 @@
+// Sampling profiler.
+//
+// While prof_on is set, every clock tick records which env was running
+// and at what eip, in a ring holding the last NPROFSAMPLE samples.
+// Nothing is looked up then; prof_dump turns the samples into a
+// histogram by function, through the kernel's or the env's stabs.
+
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+
+#include <kern/prof.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kdebug.h>
+
+#define NPROFSAMPLE	4096	// a power of two
+#define NPROFFN		128	// functions prof_dump tells apart
+#define PROFNAMELEN	32
+
+struct ProfSample {
+	envid_t ps_env;		// 0 for the kernel
+	uintptr_t ps_eip;
+};
+
+struct ProfFn {
+	envid_t pf_env;
+	uintptr_t pf_addr;	// function's address, or the eip if unknown
+	uint32_t pf_count;
+	char pf_name[PROFNAMELEN];
+};
+
+bool prof_on;
+static struct ProfSample prof_ring[NPROFSAMPLE];
+static uint32_t prof_nsample;	// samples since the last reset
+static struct ProfFn prof_fns[NPROFFN];
+
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfSample *ps;
+
+	ps = &prof_ring[prof_nsample++ & (NPROFSAMPLE - 1)];
+	ps->ps_env = (tf->tf_cs & 3) && curenv ? curenv->env_id : 0;
+	ps->ps_eip = tf->tf_eip;
+}
+
+void
+prof_reset(void)
+{
+	prof_nsample = 0;
+}
+
+// Find the function around 'eip' in env 'envid' (0 for the kernel).
+// A user env's stabs are in its own address space, so we switch to it
+// while we look, and copy the name out before switching back.
+static void
+prof_lookup(envid_t envid, uintptr_t eip, struct ProfFn *fn)
+{
+	struct Eipdebuginfo info;
+	struct Env *e = NULL;
+	uint32_t cr3 = rcr3();
+
+	fn->pf_env = envid;
+	fn->pf_addr = eip;
+	fn->pf_count = 0;
+	strcpy(fn->pf_name, "<unknown>");
+	if (envid != 0) {
+		if (envid2env(envid, &e, 0) < 0) {
+			strcpy(fn->pf_name, "<exited>");
+			return;
+		}
+		lcr3(e->env_cr3);
+	}
+	debuginfo_eip_env(e, eip, &info);
+	if (info.eip_fn_addr != eip || strncmp(info.eip_fn_name, "<unknown>", 9) != 0) {
+		fn->pf_addr = info.eip_fn_addr;
+		strncpy(fn->pf_name, info.eip_fn_name, MIN(info.eip_fn_namelen, PROFNAMELEN - 1));
+		fn->pf_name[MIN(info.eip_fn_namelen, PROFNAMELEN - 1)] = '\0';
+	}
+	lcr3(cr3);
+}
+
+void
+prof_dump(int n)
+{
+	uint32_t i, nsample, nfn, other;
+	int j;
+	struct ProfSample *ps;
+	struct ProfFn fn, tmp;
+
+	nsample = MIN(prof_nsample, NPROFSAMPLE);
+	nfn = 0;
+	other = 0;
+	for (i = 0; i < nsample; i++) {
+		ps = &prof_ring[i];
+		prof_lookup(ps->ps_env, ps->ps_eip, &fn);
+		for (j = 0; j < nfn; j++)
+			if (prof_fns[j].pf_env == fn.pf_env && prof_fns[j].pf_addr == fn.pf_addr)
+				break;
+		if (j == nfn) {
+			if (nfn == NPROFFN) {
+				other++;
+				continue;
+			}
+			prof_fns[nfn++] = fn;
+		}
+		prof_fns[j].pf_count++;
+	}
+
+	// Most samples first
+	for (i = 1; i < nfn; i++) {
+		tmp = prof_fns[i];
+		for (j = i; j > 0 && prof_fns[j - 1].pf_count < tmp.pf_count; j--)
+			prof_fns[j] = prof_fns[j - 1];
+		prof_fns[j] = tmp;
+	}
+
+	cprintf("%u samples%s\n", nsample, prof_nsample > NPROFSAMPLE ? " (the latest)" : "");
+	for (i = 0; i < nfn && i < n; i++)
+		cprintf("%6u %3u%%  %08x  %s\n", prof_fns[i].pf_count,
+			prof_fns[i].pf_count * 100 / nsample,
+			prof_fns[i].pf_env, prof_fns[i].pf_name);
+	if (other)
+		cprintf("%6u in other functions\n", other);
+}
@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+// Is the profiler taking samples?  The monitor's prof command sets it.
+extern bool prof_on;
+
+// Timer tick: record where the trapped code was.
+void prof_tick(struct Trapframe *tf);
+// Forget all samples.
+void prof_reset(void);
+// Print the 'n' functions with most samples.
+void prof_dump(int n);
+
+#endif	// !JOS_KERN_PROF_H
@@ -1,9 +1,242 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/kclock.h>
+#include <kern/ktimer.h>
+#include <kern/console.h>
+#include <kern/cpu.h>
+#include <kern/trace.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/age.h>
+#include <kern/merge.h>
+#include <kern/kstack.h>
+#include <kern/klog.h>
 
+// Pages to zero into the pre-zeroed pool each time we find nothing to run
+#define PAGE_ZERO_IDLE_BATCH	4
+// and user PTEs to age
+#define AGE_IDLE_BATCH		256
+// and to look at for merging (kern/merge.c)
+#define MERGE_IDLE_BATCH	64
+// and dead envs' page tables to take down (env_reclaim_idle)
+#define RECLAIM_IDLE_BATCH	4
+
+TAILQ_HEAD(Env_runq, Env);
+
+// Every ENV_RUNNABLE environment except the idle env, envs[0] (there
+// is one only in kernels built to break into the monitor when idle), is
+// on one CPU's run queues, env_rq_cpu's: one queue per scheduling class
+// (inc/env.h), each in the order its envs will get that CPU.  An env
+// keeps to the CPU it last ran on, so that it finds its cache warm, and
+// a CPU with nothing of a class to run steals one from another's queue.
+// env_set_status(), env_set_priority() and env_set_affinity() keep the
+// queues up to date.
+static struct Env_runq env_runq[NCPU][ENV_NPRIO];
+
+// Guards the run queues, and env_status changes.  Without it the envs
+// that system calls outside the kernel lock wake could slip onto a
+// halting CPU's queue unseen.
+struct spinlock sched_lock = SPINLOCK_INIT(sched_lock);
+
+static void sched_try_run(void);
+
+void
+sched_init(void)
+{
+    int cpu, prio;
+    for (cpu = 0; cpu < NCPU; cpu++)
+        for (prio = 0; prio < ENV_NPRIO; prio++)
+            TAILQ_INIT(&env_runq[cpu][prio]);
+}
+
+//
+// Queue e on its CPU: the one it's pinned to, or else the one it ran on
+// last, or else ours.  A halted CPU won't look at its queues until an
+// interrupt wakes it, so send it one.  The caller holds sched_lock, as
+// for sched_dequeue.
+//
+void
+sched_enqueue(struct Env *e)
+{
+    int cpu;
+    if (e == envs)
+        return;
+    if (e->env_affinity >= 0)
+        e->env_rq_cpu = e->env_affinity;
+    else if (e->env_rq_cpu < 0)
+        e->env_rq_cpu = cpunum();
+    cpu = e->env_rq_cpu;
+    TAILQ_INSERT_TAIL(&env_runq[cpu][e->env_priority], e, env_run_link);
+    if (cpu != cpunum() && cpus[cpu].cpu_status == CPU_HALTED)
+        lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+void
+sched_dequeue(struct Env *e)
+{
+    if (e != envs)
+        TAILQ_REMOVE(&env_runq[e->env_rq_cpu][e->env_priority], e, env_run_link);
+}
+
+//
+// Nothing can run.  Halt until an interrupt -- the disk, console input,
+// the timer -- makes something runnable; trap() then schedules afresh.
+// Each wakeup starts again at the top of the kernel stack, so halting
+// never nests.  Tickless, no time slice needs ending meanwhile, so the
+// BSP's clock stops too, or sleeps till a kernel timer needs it
+// (kclock_idle), which may fire timers first.  A halted CPU holds
+// neither the kernel lock nor an env.  We look at the queues one last
+// time with sched_lock held until we're marked halted, so that an env
+// queued for us meanwhile brings the wakeup IPI.
+//
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+    tlb_flush();
+    kclock_idle();
+    spin_lock(&sched_lock);
+    sched_try_run();
+    fpu_save();
+    pmc_save(curenv);
+    env_charge_kernel(curenv);
+    if (curenv != NULL)
+        curenv->env_cpunum = -1;
+    curenv = NULL;
+    xchg(&thiscpu->cpu_status, CPU_HALTED);
+    spin_unlock(&sched_lock);
+    unlock_kernel();
+    cpu_ioff_end();
+    asm volatile("movl %0, %%esp\n"
+                 "xorl %%ebp, %%ebp\n"
+                 "sti\n"
+                 "1: hlt\n"
+                 "jmp 1b\n" : : "r" (CPU_KSTACKTOP(cpunum())));
+    panic("sched_halt: hlt returned");
+}
+
+// Is there any environment left, but for the idle env?  env_set_status
+// counts them, so we needn't look through envs[].
+static int
+sched_anyenv(void)
+{
+    return env_nlive > (envs[0].env_status != ENV_FREE);
+}
+
+//
+// Is anything runnable that should take this CPU from e right away?
+// That is any env of a higher class on our queues, or any env at all if
+// e is idle.
+//
+int
+sched_preempt_pending(struct Env *e)
+{
+    int prio, top, pending = 0, cpu = cpunum();
+    top = (e == envs) ? ENV_NPRIO : e->env_priority;
+    spin_lock(&sched_lock);
+    for (prio = 0; prio < top && !pending; prio++)
+        pending = !TAILQ_EMPTY(&env_runq[cpu][prio]);
+    spin_unlock(&sched_lock);
+    return pending;
+}
+
+// The first env on queue q that may run on 'cpu': not running on
+// another CPU, nor pinned to another.
+static struct Env *
+sched_runq_first(struct Env_runq *q, int cpu)
+{
+    struct Env *e;
+    TAILQ_FOREACH(e, q, env_run_link)
+        if ((e->env_cpunum < 0 || e->env_cpunum == cpu)
+            && (e->env_affinity < 0 || e->env_affinity == cpu))
+            return e;
+    return NULL;
+}
+
+//
+// Run the first env of the highest class we can find one in, starting
+// it on a fresh time slice if it used up its last one.  Our own queue
+// for the class comes first; if that's empty, take a waiting env from
+// another CPU's, looking at the CPUs after ours first so that thieves
+// spread around.  Called with sched_lock held, which we drop to run the
+// env; returns, still holding it, if there's nothing to run.
+//
+static void
+sched_try_run(void)
+{
+    struct Env *e;
+    int prio, i, victim, cpu = cpunum();
+    for (prio = 0; prio < ENV_NPRIO; prio++) {
+        e = sched_runq_first(&env_runq[cpu][prio], cpu);
+        for (i = 1; e == NULL && i < ncpu; i++) {
+            victim = (cpu + i) % ncpu;
+            if ((e = sched_runq_first(&env_runq[victim][prio], cpu)) != NULL) {
+                TAILQ_REMOVE(&env_runq[victim][prio], e, env_run_link);
+                e->env_rq_cpu = cpu;
+                TAILQ_INSERT_TAIL(&env_runq[cpu][prio], e, env_run_link);
+            }
+        }
+        if (e != NULL) {
+            if (e->env_ticks <= 0)
+                e->env_ticks = e->env_quantum;
+            spin_unlock(&sched_lock);
+            kclock_resume();
+            env_run(e);
+        }
+    }
+}
+
+//
+// Run the best env sched_try_run finds, or idle if nothing is runnable.
+// Unlike sched_yield, curenv keeps its place.
+//
+void
+sched_resched(void)
+{
+    // Never on an env's kernel stack, which that env may need next
+    if (kstack_off_cpu())
+        kstack_leave(sched_resched);
+again:
+    spin_lock(&sched_lock);
+    sched_try_run();
+    spin_unlock(&sched_lock);
+
+	// Nothing else is runnable, so the machine has nothing better to
+	// do than catch the console up with the kernel log (kern/klog.c),
+	// free dead envs' memory, a batch at a time until it's all free or
+	// something is runnable, zero a few pages and age a few more.  Then
+	// halt, unless the kernel was built with the idle environment (the
+	// debugging option, and the grade script's), which breaks into the
+	// monitor: run that -- with a tickless timer, only once there's
+	// console input for it.  The idle env and the monitor are the
+	// BSP's; the APs just halt.
+    klog_flush();
+    if (env_reclaim_idle(RECLAIM_IDLE_BATCH))
+        goto again;
+    page_zero_idle(PAGE_ZERO_IDLE_BATCH);
+    age_idle(AGE_IDLE_BATCH);
+    merge_idle(MERGE_IDLE_BATCH);
+    if (thiscpu == bootcpu) {
+        if (envs[0].env_status == ENV_RUNNABLE) {
+            if (!timer_tickless || cons_pending()) {
+                kclock_resume();
+                env_run(&envs[0]);
+            }
+        }
+        else if (!sched_anyenv()) {
+            cprintf("Destroyed all environments - nothing more to do!\n");
+            while (1)
+                monitor(NULL);
+        }
+    }
+    sched_halt();
+}
 
 // Choose a user environment to run and run it.
 void
@@ -20,29 +253,31 @@ sched_yield(void)
 
 	// LAB 4: Your code here.
 
-    int i;
-    struct Env *ienv;
-    if (curenv == NULL)
-        ienv = envs + 1;
-    else
-        ienv = curenv + 1;
-    for (i = 0 ; i < NENV; i++, ienv++) {
-        if (ienv >= envs + NENV) {
-            ienv = envs + 1;
-        }
-        if (ienv->env_status == ENV_RUNNABLE) {
-            env_run(ienv);
-            return;
-        }
-    }
-    
-	// Run the special idle environment when nothing else is runnable.
-    if (envs[0].env_status == ENV_RUNNABLE) {
-		env_run(&envs[0]);
+    trace(TRACE_YIELD, curenv ? curenv->env_id : 0, 0);
+    // Round robin within each class in O(1): the env that just ran gives
+    // up the rest of its slice and goes to the back of its queue
+    if (curenv != NULL && curenv != envs && curenv->env_status == ENV_RUNNABLE) {
+        curenv->env_ticks = 0;
+        spin_lock(&sched_lock);
+        sched_dequeue(curenv);
+        sched_enqueue(curenv);
+        spin_unlock(&sched_lock);
     }
-	else {
-		cprintf("Destroyed all environments - nothing more to do!\n");
-		while (1)
-			monitor(NULL);
-	}
+    sched_resched();
+}
+
+//
+// Called on every timer interrupt: charge the tick to curenv and keep
+// running it until its time slice is used up.
+//
+void
+sched_tick(void)
+{
+    if (curenv != NULL && curenv != envs && curenv->env_status == ENV_RUNNABLE
+        && --curenv->env_ticks > 0)
+        return;
+    // At a preemption point, kstack_preempt sees the slice is up
+    if (thiscpu->cpu_preempting)
+        return;
+    sched_yield();
 }
@@ -6,7 +6,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_resched(void) __attribute__((noreturn));
+
+// Timer tick: returns while curenv still has time left in its slice.
+void sched_tick(void);
+int sched_preempt_pending(struct Env *e);
+
+// Keep the run queues in step with env_status; use env_set_status().
+extern struct spinlock sched_lock;
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,56 @@
+// The kernel's self-checks.
+//
+// Each allocator keeps its own checks next to its code: the ones the
+// labs came with, which check a fresh allocator's exact behavior, and
+// stress tests that churn it at random and then check nothing leaked.
+// None of them runs on a normal boot.  'make SELFTEST=1' runs them all
+// from i386_init, once the allocators they use are up, and the
+// monitor's 'selftest' runs any of them later, while no other CPU is
+// about to allocate.  The checks run out of memory on purpose and count
+// the free pages, so meanwhile page_alloc frees none by paging out live
+// envs or finishing dead ones (page_reclaim_off).  A check that fails
+// panics, as at boot.
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+
+#include <kern/selftest.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+
+static struct Selftest {
+	const char *st_name;
+	void (*st_fn)(void);
+} selftests[] = {
+	{ "page_alloc", check_page_alloc },
+	{ "page_check", page_check },
+	{ "boot_pgdir", check_boot_pgdir },
+	{ "page_orders", check_page_orders },
+	{ "super_pages", check_super_pages },
+	{ "rmap", check_rmap },
+	{ "kmem", check_kmem },
+	{ "kmem_stress", check_kmem_stress },
+};
+#define NSELFTEST	(sizeof(selftests) / sizeof(selftests[0]))
+
+int
+selftest_run(const char *name)
+{
+	int i, n = 0;
+
+	page_reclaim_off = 1;
+	for (i = 0; i < NSELFTEST; i++)
+		if (name == NULL || strcmp(name, selftests[i].st_name) == 0) {
+			selftests[i].st_fn();
+			n++;
+		}
+	page_reclaim_off = 0;
+	return n > 0 ? 0 : -E_INVAL;
+}
+
+const char *
+selftest_name(int i)
+{
+	return i >= 0 && i < NSELFTEST ? selftests[i].st_name : NULL;
+}
@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SELFTEST_H
+#define JOS_KERN_SELFTEST_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+/* 'make SELFTEST=1' runs all the self-checks at boot, as the grading
+ * script wants; otherwise only the monitor's 'selftest' runs them */
+#ifndef SELFTEST
+#define SELFTEST	0
+#endif
+
+// Run the self-check called 'name', or all of them if name is NULL.
+// A check that fails panics.  Returns -E_INVAL if there's no such check.
+int	selftest_run(const char *name);
+// The name of check i, or NULL past the last.
+const char *selftest_name(int i);
+
+#endif	// !JOS_KERN_SELFTEST_H
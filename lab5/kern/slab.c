@@ -0,0 +1,346 @@
+// Slab allocator for small kernel objects.
+//
+// Each object cache hands out objects of one size, carved from whole
+// pages ("slabs") taken with page_alloc.  A slab starts with a struct
+// Slab, followed by a stack of the indices of its free objects, and
+// then the objects themselves; kfree and kmem_cache_free find an
+// object's slab by rounding its address down to the page.  A cache
+// keeps its slabs on three lists -- partly used, full, and empty -- and
+// allocates from a partly used one first.  It keeps one empty slab
+// rather than going to page_alloc for every object it gives out after
+// a free, and gives any more back.
+//
+// A cache's lock comes after sched_lock and before page_lock in the
+// order kern/spinlock.h gives.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/queue.h>
+
+#include <kern/slab.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MAX_CACHES	32
+#define KMEM_MIN_ALIGN	4
+
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;
+	struct Kmem_cache *sl_cache;
+	uint16_t sl_nfree;
+	uint16_t sl_free[];		// free objects' indices, a stack
+};
+
+LIST_HEAD(Slab_list, Slab);
+
+struct Kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			// object size, a multiple of the alignment
+	uint32_t kc_nobj;		// objects per slab
+	uint32_t kc_off;		// where in the slab the first one starts
+	void (*kc_ctor)(void *);
+	struct spinlock kc_lock;	// guards the lists and the slabs on them
+	struct Slab_list kc_partial;
+	struct Slab_list kc_full;
+	struct Slab_list kc_empty;	// at most one
+	uint32_t kc_nslab;
+	uint32_t kc_nalloc;		// objects handed out
+};
+
+static struct Kmem_cache kmem_caches[KMEM_MAX_CACHES];
+static uint32_t kmem_ncache;
+static struct spinlock kmem_lock = SPINLOCK_INIT(kmem_lock);
+
+// kmalloc's caches: kmalloc_caches[i] holds objects of 16 << i bytes
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_NCACHE		8	// up to KMEM_MAX_SIZE
+static struct Kmem_cache *kmalloc_caches[KMALLOC_NCACHE];
+
+static void *
+slab_obj(struct Kmem_cache *c, struct Slab *s, uint32_t i)
+{
+	return (char *) s + c->kc_off + i * c->kc_size;
+}
+
+struct Kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct Kmem_cache *c;
+	uint32_t n;
+
+	if (size == 0 || size > KMEM_MAX_SIZE)
+		return NULL;
+	if (align == 0)
+		align = size >= PGSIZE / 8 ? 16 : MIN(size & -size, 16);
+	align = MAX(align, KMEM_MIN_ALIGN);
+	assert((align & (align - 1)) == 0);
+
+	spin_lock(&kmem_lock);
+	if (kmem_ncache == KMEM_MAX_CACHES) {
+		spin_unlock(&kmem_lock);
+		return NULL;
+	}
+	c = &kmem_caches[kmem_ncache++];
+	spin_unlock(&kmem_lock);
+
+	memset(c, 0, sizeof(*c));
+	c->kc_name = name;
+	c->kc_size = ROUNDUP(size, align);
+	c->kc_ctor = ctor;
+	c->kc_lock.name = "kc_lock";
+	// As many objects as fit behind the header and its index stack
+	n = (PGSIZE - sizeof(struct Slab)) / (c->kc_size + sizeof(uint16_t));
+	while (ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align)
+	       + n * c->kc_size > PGSIZE)
+		n--;
+	assert(n > 0);
+	c->kc_nobj = n;
+	c->kc_off = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align);
+	return c;
+}
+
+// A new slab for c, its objects constructed.  Called without c's lock,
+// since the constructor may take a while.
+static struct Slab *
+slab_create(struct Kmem_cache *c)
+{
+	struct Page *pp;
+	struct Slab *s;
+	uint32_t i;
+
+	if (page_alloc(&pp) < 0)
+		return NULL;
+	pp->pp_ref = 1;
+	s = page2kva(pp);
+	s->sl_cache = c;
+	s->sl_nfree = c->kc_nobj;
+	// Hand out the lowest addresses first
+	for (i = 0; i < c->kc_nobj; i++) {
+		s->sl_free[i] = c->kc_nobj - 1 - i;
+		if (c->kc_ctor)
+			c->kc_ctor(slab_obj(c, s, i));
+	}
+	return s;
+}
+
+void *
+kmem_cache_alloc(struct Kmem_cache *c)
+{
+	struct Slab *s;
+	void *obj;
+
+	spin_lock(&c->kc_lock);
+	if ((s = LIST_FIRST(&c->kc_partial)) == NULL) {
+		if ((s = LIST_FIRST(&c->kc_empty)) != NULL)
+			LIST_REMOVE(s, sl_link);
+		else {
+			spin_unlock(&c->kc_lock);
+			if ((s = slab_create(c)) == NULL)
+				return NULL;
+			spin_lock(&c->kc_lock);
+			c->kc_nslab++;
+		}
+		LIST_INSERT_HEAD(&c->kc_partial, s, sl_link);
+	}
+	obj = slab_obj(c, s, s->sl_free[--s->sl_nfree]);
+	if (s->sl_nfree == 0) {
+		LIST_REMOVE(s, sl_link);
+		LIST_INSERT_HEAD(&c->kc_full, s, sl_link);
+	}
+	c->kc_nalloc++;
+	spin_unlock(&c->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct Kmem_cache *c, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+	uint32_t i = ((char *) obj - (char *) s - c->kc_off) / c->kc_size;
+
+	assert(s->sl_cache == c);
+	assert(obj == slab_obj(c, s, i) && i < c->kc_nobj);
+	spin_lock(&c->kc_lock);
+	assert(s->sl_nfree < c->kc_nobj);
+	if (s->sl_nfree == 0) {
+		LIST_REMOVE(s, sl_link);
+		LIST_INSERT_HEAD(&c->kc_partial, s, sl_link);
+	}
+	s->sl_free[s->sl_nfree++] = i;
+	c->kc_nalloc--;
+	if (s->sl_nfree == c->kc_nobj) {
+		LIST_REMOVE(s, sl_link);
+		if (LIST_EMPTY(&c->kc_empty))
+			LIST_INSERT_HEAD(&c->kc_empty, s, sl_link);
+		else {
+			c->kc_nslab--;
+			spin_unlock(&c->kc_lock);
+			page_decref(pa2page(PADDR(s)));
+			return;
+		}
+	}
+	spin_unlock(&c->kc_lock);
+}
+
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	if (size > KMEM_MAX_SIZE)
+		return NULL;
+	for (i = 0; (16U << i) < size; i++)
+		/* find the smallest that fits */;
+	return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void
+kfree(void *p)
+{
+	struct Slab *s;
+
+	if (p == NULL)
+		return;
+	s = ROUNDDOWN(p, PGSIZE);
+	kmem_cache_free(s->sl_cache, p);
+}
+
+void
+kmem_dump(void)
+{
+	struct Kmem_cache *c;
+	uint32_t i;
+
+	cprintf("%-16s %6s %8s %6s %8s\n", "cache", "size", "per slab", "slabs", "in use");
+	for (i = 0; i < kmem_ncache; i++) {
+		c = &kmem_caches[i];
+		cprintf("%-16s %6u %8u %6u %8u\n", c->kc_name, c->kc_size,
+			c->kc_nobj, c->kc_nslab, c->kc_nalloc);
+	}
+}
+
+void
+kmem_init(void)
+{
+	static const char *names[KMALLOC_NCACHE] = {
+		"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+		"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+	};
+	int i;
+
+	static_assert((16 << (KMALLOC_NCACHE - 1)) == KMEM_MAX_SIZE);
+	for (i = 0; i < KMALLOC_NCACHE; i++)
+		kmalloc_caches[i] = kmem_cache_create(names[i],
+			1 << (KMALLOC_MIN_SHIFT + i), 0, NULL);
+}
+
+static void
+check_kmem_ctor(void *obj)
+{
+	*(uint32_t *) obj = 0x5ab5ab;
+}
+
+void
+check_kmem(void)
+{
+	static void *objs[512];
+	static struct Kmem_cache *c;
+	uint32_t i, n, nslab;
+
+	// Enough objects for several slabs: each constructed, aligned,
+	// and apart from the others.  Once made, the cache keeps one
+	// empty slab between runs.
+	if (c == NULL)
+		c = kmem_cache_create("check", 24, 8, check_kmem_ctor);
+	assert(c != NULL && c->kc_size == 24);
+	n = 3 * c->kc_nobj + 1;
+	assert(n <= sizeof(objs) / sizeof(objs[0]));
+	for (i = 0; i < n; i++) {
+		assert((objs[i] = kmem_cache_alloc(c)) != NULL);
+		assert((uintptr_t) objs[i] % 8 == 0);
+		assert(*(uint32_t *) objs[i] == 0x5ab5ab);
+		if (i > 0 && ROUNDDOWN(objs[i], PGSIZE) == ROUNDDOWN(objs[i - 1], PGSIZE))
+			assert(objs[i] >= objs[i - 1] + 24);
+	}
+	assert(c->kc_nslab == 4 && c->kc_nalloc == n);
+	// Freeing gives back all but one slab
+	for (i = 0; i < n; i++)
+		kmem_cache_free(c, objs[i]);
+	assert(c->kc_nslab == 1 && c->kc_nalloc == 0);
+	// The slab kept is the first to have emptied
+	objs[1] = kmem_cache_alloc(c);
+	assert(ROUNDDOWN(objs[1], PGSIZE) == ROUNDDOWN(objs[0], PGSIZE));
+	nslab = c->kc_nslab;
+	kmem_cache_free(c, objs[1]);
+	assert(c->kc_nslab == nslab);
+
+	// kmalloc picks the smallest cache that fits
+	for (i = 1; i <= KMEM_MAX_SIZE; i = i * 3 + 1) {
+		assert((objs[0] = kmalloc(i)) != NULL);
+		assert(((struct Slab *) ROUNDDOWN(objs[0], PGSIZE))->sl_cache->kc_size >= i);
+		assert(((struct Slab *) ROUNDDOWN(objs[0], PGSIZE))->sl_cache->kc_size < 2 * i + 16);
+		memset(objs[0], 0xa5, i);
+		kfree(objs[0]);
+	}
+	assert(kmalloc(KMEM_MAX_SIZE + 1) == NULL);
+	assert(kmem_cache_create("too big", KMEM_MAX_SIZE + 1, 0, NULL) == NULL);
+
+	cprintf("check_kmem() succeeded!\n");
+}
+
+#define CHECK_NOBJ	256		// objects check_kmem_stress holds at once
+
+static uint32_t
+kmalloc_nalloc(void)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < KMALLOC_NCACHE; i++)
+		n += kmalloc_caches[i]->kc_nalloc;
+	return n;
+}
+
+//
+// Stress kmalloc: allocate random sizes, fill each object with a byte
+// of its own, and free them in random order, checking each is intact
+// when it goes.  Afterwards the caches hold as many objects as before.
+//
+void
+check_kmem_stress(void)
+{
+	static struct {
+		uint8_t *p;
+		size_t size;
+	} held[CHECK_NOBJ];
+	static uint32_t seed = 1;
+	uint32_t nalloc = kmalloc_nalloc(), i, n;
+	size_t j;
+
+	for (n = 0; n < 40 * CHECK_NOBJ; n++) {
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 8) % CHECK_NOBJ;
+		if (held[i].p != NULL) {
+			for (j = 0; j < held[i].size; j++)
+				assert(held[i].p[j] == (uint8_t) (i + held[i].size));
+			kfree(held[i].p);
+			held[i].p = NULL;
+			continue;
+		}
+		seed = seed * 1103515245 + 12345;
+		// mostly small, as kernel objects are
+		held[i].size = 1 + (seed >> 8) % ((seed & 0x80) ? KMEM_MAX_SIZE : 64);
+		if ((held[i].p = kmalloc(held[i].size)) == NULL)
+			continue;
+		memset(held[i].p, i + held[i].size, held[i].size);
+	}
+	for (i = 0; i < CHECK_NOBJ; i++)
+		if (held[i].p != NULL) {
+			kfree(held[i].p);
+			held[i].p = NULL;
+		}
+	assert(kmalloc_nalloc() == nalloc);
+
+	cprintf("check_kmem_stress() succeeded!\n");
+}
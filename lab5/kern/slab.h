@@ -0,0 +1,43 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// The largest object a cache can hold, and the largest kmalloc size
+#define KMEM_MAX_SIZE	2048
+
+struct Kmem_cache;
+
+void kmem_init(void);
+
+// A cache of 'size'-byte objects aligned to 'align' (a power of two, or
+// 0 for the natural alignment), carved from pages.  If ctor isn't NULL
+// it runs on each object once, when its page joins the cache; objects
+// stay constructed while free, so a caller gives an object back in its
+// constructed state.  Returns NULL if there are too many caches or size
+// is more than KMEM_MAX_SIZE.
+struct Kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+// NULL if out of memory.
+void *kmem_cache_alloc(struct Kmem_cache *c);
+void kmem_cache_free(struct Kmem_cache *c, void *obj);
+
+// General-purpose allocation from power-of-two caches of 16 bytes to
+// KMEM_MAX_SIZE.  Memory is not zeroed.  NULL if out of memory or size
+// is too large.
+void *kmalloc(size_t size);
+void kfree(void *p);
+
+// Print each cache's usage.
+void kmem_dump(void);
+
+// Self-checks, for selftest_run
+void check_kmem(void);
+void check_kmem_stress(void);
+
+#endif	// !JOS_KERN_SLAB_H
@@ -0,0 +1,91 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+
+// The big kernel lock
+struct spinlock kernel_lock = SPINLOCK_INIT(kernel_lock);
+
+// Check whether this CPU is holding the lock.
+int
+spin_holding(struct spinlock *lock)
+{
+	return lock->locked && lock->cpu == thiscpu;
+}
+
+void
+__spin_initlock(struct spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+	lk->cpu = 0;
+	lk->nacquired = 0;
+	lk->ncontended = 0;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	bool contended = 0;
+
+#ifdef DEBUG_SPINLOCK
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it. 
+	while (xchg(&lk->locked, 1) != 0) {
+		contended = 1;
+		// The holder may be waiting on us to flush our TLB
+		tlb_poll();
+		asm volatile ("pause");
+	}
+
+	lk->cpu = thiscpu;
+	lk->nacquired++;
+	lk->ncontended += contended;
+}
+
+// Take the lock only if nobody holds it, this CPU included, without
+// spinning.  Returns 1 if we got it.  A trylock may go against the lock
+// order in kern/spinlock.h, since it can never wait.
+int
+spin_trylock(struct spinlock *lk)
+{
+	if (xchg(&lk->locked, 1) != 0)
+		return 0;
+	lk->cpu = thiscpu;
+	lk->nacquired++;
+	return 1;
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!spin_holding(lk))
+		panic("CPU %d cannot release %s: held by CPU %d",
+		      cpunum(), lk->name, lk->cpu ? (int) (lk->cpu - cpus) : -1);
+#endif
+	lk->cpu = 0;
+
+	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
+	// respect to any other instruction which references the same memory.
+	// x86 CPUs will not reorder loads/stores across locked instructions
+	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
+	// gcc will not reorder C statements across the xchg.
+	xchg(&lk->locked, 0);
+}
@@ -0,0 +1,76 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Comment this to disable spinlock debugging
+#define DEBUG_SPINLOCK
+
+// Mutual exclusion lock.
+struct spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+	const char *name;		// Name of lock.
+	struct Cpu *cpu;		// The CPU holding the lock.
+
+	// How often the lock is taken, and how often the taker had to
+	// spin for it: kept by the holder, shown by the monitor's locks
+	uint32_t nacquired;
+	uint32_t ncontended;
+};
+
+void __spin_initlock(struct spinlock *lk, const char *name);
+void spin_lock(struct spinlock *lk);
+int spin_trylock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+int spin_holding(struct spinlock *lk);
+
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+
+// Static initializer: struct spinlock foo_lock = SPINLOCK_INIT(foo_lock);
+#define SPINLOCK_INIT(lock)	{ .name = #lock }
+
+// The big kernel lock: whoever is in the kernel holds it, so that only
+// one CPU at a time runs kernel code -- except for the system calls that
+// syscall.c marks as running without it, and the state they share with
+// the rest of the kernel, which has locks of its own.  Take locks in this
+// order, skipping those you don't need:
+//
+//	kernel_lock
+//	env_table_lock		(kern/env.c) the free list, and envid2env
+//	env_lock(e)		(kern/env.h) e's address space;
+//				two envs' in env_locks[] order, with env_lock2()
+//	env_reclaim_lock	(kern/env.c) dead address spaces to take down
+//	addrwait_lock		(kern/syscall.c) sys_addr_wait's sleepers
+//	sched_lock		(kern/sched.c) run queues and env_status
+//	swap_lock		(kern/swap.c) swap slots and the swap disk
+//	kc_lock			(kern/slab.c) each object cache's slabs
+//	rmap_lock		(kern/pmap.c) the pages' reverse mappings
+//	page_lock		(kern/pmap.c) the page allocator
+//	cons_lock		(kern/console.c) console output
+//	klog_lock		(kern/klog.c) the kernel log
+//
+// Page reference counts need no lock: they're changed atomically.
+extern struct spinlock kernel_lock;
+
+static inline void
+lock_kernel(void)
+{
+	spin_lock(&kernel_lock);
+}
+
+static inline void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+
+	// Normally we wouldn't need to do this, but QEMU only runs
+	// one CPU at a time and has a long time-slice.  Without the
+	// pause, this CPU is likely to reacquire the lock before
+	// another CPU has even been given a chance to acquire it.
+	asm volatile("pause");
+}
+
+#endif
@@ -0,0 +1,346 @@
+// Paging out to disk.
+//
+// When page_alloc runs out, it calls swap_reclaim, which goes round the
+// envs' address spaces like a clock hand and pages out the user pages
+// nobody touched since the hand last went by: it clears PTE_A as it
+// passes, so a page whose PTE_A is still clear the next time round has
+// gone a whole sweep unused.  The page goes to a slot on the swap disk,
+// and its PTE keeps the slot number, with PTE_SWAP and without PTE_P
+// (see inc/mmu.h).  The env's next touch faults, and swap_in reads the
+// page back; so do page_lookup and user_mem_check, for the kernel.
+//
+// Only pages an env has to itself are paged out -- not PTE_SHARE or
+// copy-on-write pages, nor any page with another reference -- so a slot
+// always belongs to exactly one PTE.  Envs that some CPU is running are
+// left alone, and so are envs with IOPL, like the file system server,
+// whose block cache goes by PTE_P and PTE_D to know what's cached and
+// what's dirty.
+//
+// The swap disk is the master on the second IDE channel.  The first one
+// is the file system server's, which drives it itself from user space;
+// a command of ours in the middle of one of its own would wreck both.
+// We poll, with the drive's interrupt off, holding swap_lock.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/swap.h>
+#include <kern/age.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define SWAP_IOBASE	0x170	// the second channel's command block
+#define SWAP_CTL	0x376	// and its device control register
+#define SWAP_CTL_NIEN	0x02	// no interrupts
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define SECTSIZE	512
+#define SECTS_PER_PAGE	(PGSIZE / SECTSIZE)
+#define SWAP_TIMEOUT	1000000	// status reads before we give up on the disk
+
+#define SWAP_MAXSLOTS	32768	// 128MB of swap at most
+#define SWAP_BATCH	16	// pages swap_reclaim frees at a time
+
+uint32_t swap_nslots;
+uint32_t swap_nused;
+uint32_t swap_outs;
+uint32_t swap_ins;
+
+static struct spinlock swap_lock = SPINLOCK_INIT(swap_lock);
+static uint32_t swap_map[SWAP_MAXSLOTS / 32];	// bit set: slot in use
+static uint32_t swap_hint;			// where to look for a free slot
+
+// The clock hand: the next page swap_reclaim looks at
+static uint32_t hand_env;
+static uintptr_t hand_va;
+
+// Wait for the drive to be ready, and, with 'drq', to have data for us
+// or want it from us.  Returns -1 on an error, or if it never is.
+static int
+swap_wait(bool drq)
+{
+	uint32_t i;
+	int r, want = IDE_DRDY | (drq ? IDE_DRQ : 0);
+
+	for (i = 0; i < SWAP_TIMEOUT; i++) {
+		r = inb(SWAP_IOBASE + 7);
+		if (r == 0xFF || (r & (IDE_DF | IDE_ERR)) != 0)
+			return -1;
+		if ((r & (IDE_BSY | want)) == want)
+			return 0;
+	}
+	return -1;
+}
+
+// Read or write the page in 'slot'.
+static int
+swap_rw(uint32_t slot, void *va, bool write)
+{
+	uint32_t secno = slot * SECTS_PER_PAGE;
+	int i;
+
+	if (swap_wait(0) < 0)
+		return -1;
+	outb(SWAP_IOBASE + 2, SECTS_PER_PAGE);
+	outb(SWAP_IOBASE + 3, secno & 0xFF);
+	outb(SWAP_IOBASE + 4, (secno >> 8) & 0xFF);
+	outb(SWAP_IOBASE + 5, (secno >> 16) & 0xFF);
+	outb(SWAP_IOBASE + 6, 0xE0 | ((secno >> 24) & 0x0F));
+	outb(SWAP_IOBASE + 7, write ? 0x30 : 0x20);	// write/read sectors
+
+	for (i = 0; i < SECTS_PER_PAGE; i++, va += SECTSIZE) {
+		if (swap_wait(1) < 0)
+			return -1;
+		if (write)
+			outsl(SWAP_IOBASE, va, SECTSIZE / 4);
+		else
+			insl(SWAP_IOBASE, va, SECTSIZE / 4);
+	}
+	return swap_wait(0);
+}
+
+void
+swap_init(void)
+{
+	uint16_t id[SECTSIZE / 2];
+	uint32_t nsecs;
+
+	outb(SWAP_CTL, SWAP_CTL_NIEN);
+	outb(SWAP_IOBASE + 6, 0xE0);
+	if (swap_wait(0) < 0)
+		goto none;
+	outb(SWAP_IOBASE + 7, 0xEC);	// identify device
+	if (swap_wait(1) < 0)
+		goto none;
+	insl(SWAP_IOBASE, id, sizeof(id) / 4);
+	// words 60 and 61: sectors addressable with 28-bit LBA
+	nsecs = id[60] | (id[61] << 16);
+	swap_nslots = MIN(nsecs / SECTS_PER_PAGE, SWAP_MAXSLOTS);
+	if (swap_nslots == 0)
+		goto none;
+	cprintf("swap: %u pages on disk\n", swap_nslots);
+	return;
+
+none:
+	swap_nslots = 0;
+	cprintf("swap: no swap disk\n");
+}
+
+// Take a free slot.  Returns -E_NO_MEM if the disk is full.
+static int
+slot_alloc(void)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < swap_nslots; i++) {
+		slot = (swap_hint + i) % swap_nslots;
+		if (!(swap_map[slot / 32] & (1 << (slot % 32)))) {
+			swap_map[slot / 32] |= 1 << (slot % 32);
+			swap_hint = slot + 1;
+			swap_nused++;
+			return slot;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+static void
+slot_free(uint32_t slot)
+{
+	assert(slot < swap_nslots && (swap_map[slot / 32] & (1 << (slot % 32))));
+	swap_map[slot / 32] &= ~(1 << (slot % 32));
+	swap_nused--;
+}
+
+void
+swap_free(pte_t pte)
+{
+	assert(PTE_SWAPPED(pte));
+	spin_lock(&swap_lock);
+	slot_free(PTE_ADDR(pte) >> PGSHIFT);
+	spin_unlock(&swap_lock);
+}
+
+//
+// Bring the page at 'va' in 'pgdir' back from the swap disk, if it's
+// out there.  The caller holds the env_lock of the address space.
+//
+// RETURNS
+//   0 if va is mapped now, whether or not it was swapped out
+//   -E_INVAL, if va isn't mapped, nor swapped out
+//   -E_NO_MEM, if there's no page to read it into
+//   -E_FAULT, if the disk won't give it back
+//
+int
+swap_in(pde_t *pgdir, void *va)
+{
+	struct Page *pp;
+	pte_t *pte = pgdir_walk(pgdir, va, 0);
+	uint32_t slot;
+	int r;
+
+	if (pte != NULL && (*pte & PTE_P))
+		return 0;
+	if (pte == NULL || !PTE_SWAPPED(*pte))
+		return -E_INVAL;
+	// page_alloc may page out other envs, but not ours: it's locked
+	if ((r = page_alloc(&pp)) < 0)
+		return r;
+	if (page_rmap_add(pp, pgdir, va) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+	slot = PTE_ADDR(*pte) >> PGSHIFT;
+	spin_lock(&swap_lock);
+	if ((r = swap_rw(slot, page2kva(pp), 0)) == 0) {
+		slot_free(slot);
+		swap_ins++;
+	}
+	spin_unlock(&swap_lock);
+	if (r < 0) {
+		page_rmap_remove(pp, pgdir, va);
+		page_free(pp);
+		return -E_FAULT;
+	}
+	page_incref(pp);
+	*pte = page2pa(pp) | (*pte & (PTE_W | PTE_U)) | PTE_P;
+	pgdir_account(pgdir, 1, 0, 0);
+	return 0;
+}
+
+// Is e, or a thread sharing its address space, some CPU's current env?
+// A CPU that makes it so after we look loads CR3 before it next runs
+// one, and so sees the PTEs we stored before looking, provided we mb()
+// in between.
+static bool
+env_on_cpu(struct Env *e)
+{
+	struct Env *c;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if ((c = cpus[i].cpu_env) != NULL && c->env_pgdir == e->env_pgdir)
+			return 1;
+	return 0;
+}
+
+// May swap_reclaim look at e's pages?
+static bool
+env_swappable(struct Env *e)
+{
+	return (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE)
+		&& e->env_pgdir != NULL
+		&& (e->env_tf.tf_eflags & FL_IOPL_MASK) == 0
+		&& !env_on_cpu(e);
+}
+
+// Page out the page at va, behind *pte, which belongs to e; e is locked.  Once
+// the PTE says the page is gone and no CPU runs e, nothing can write to
+// the page while it goes out.  If a CPU took e up meanwhile, we put the
+// page back; if e faulted on it there, it's waiting for e's lock, and
+// finds the page mapped again.
+static int
+swap_out(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct Page *pp = pa2page(PTE_ADDR(*pte));
+	pte_t old = *pte;
+	int slot;
+
+	if ((slot = slot_alloc()) < 0)
+		return slot;
+	*pte = (slot << PGSHIFT) | (old & (PTE_W | PTE_U)) | PTE_SWAP;
+	pmap_revoked();
+	mb();
+	if (env_on_cpu(e) || swap_rw(slot, page2kva(pp), 1) < 0) {
+		*pte = old;
+		slot_free(slot);
+		return -E_FAULT;
+	}
+	page_rmap_remove(pp, e->env_pgdir, (void *) va);
+	page_decref(pp);
+	pgdir_account(e->env_pgdir, -1, 0, 0);
+	e->env_pgdir[PDX(va)] |= PDE_SWAPS;
+	swap_outs++;
+	return 0;
+}
+
+// Move the clock hand across e's pages from hand_va, freeing the cold
+// ones, until 'want' pages are free or it's past e's last.  e is locked.
+// Returns how many it freed, or < 0 if the swap disk is full or failing.
+static int
+swap_sweep(struct Env *e, int want)
+{
+	pte_t *pte;
+	struct Page *pp;
+	int freed = 0, r;
+
+	for (; hand_va < UTOP && freed < want; hand_va += PGSIZE) {
+		// Superpages, and page tables shared since fork, stay in
+		if (!(e->env_pgdir[PDX(hand_va)] & PTE_P) || (e->env_pgdir[PDX(hand_va)] & PTE_PS)
+		    || PDE_SHARED(e->env_pgdir[PDX(hand_va)])) {
+			hand_va = ROUNDDOWN(hand_va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = pgdir_walk(e->env_pgdir, (void *) hand_va, 0);
+		if ((*pte & (PTE_P | PTE_U | PTE_SHARE | PTE_COW | PTE_SWAP)) != (PTE_P | PTE_U))
+			continue;
+		pp = pa2page(PTE_ADDR(*pte));
+		if (pp->pp_ref != 1)
+			continue;
+		// No CPU runs e, so no TLB holds the PTE: the page table is
+		// the only place PTE_A is
+		if (age_harvest(pte))
+			continue;
+		if ((r = swap_out(e, hand_va, pte)) < 0)
+			return freed ? freed : r;
+		freed++;
+	}
+	return freed;
+}
+
+//
+// Page out up to SWAP_BATCH cold pages of envs other than the ones that
+// are running.  The hand goes round every env at most twice: once to
+// clear PTE_A, once more to find it still clear.  Envs that are locked
+// are passed over, rather than waited for against the lock order.
+// Called by page_alloc when it runs out.
+//
+int
+swap_reclaim(void)
+{
+	struct Env *e;
+	uint32_t n, nenv;
+	int freed = 0, r;
+
+	if (swap_nslots == 0)
+		return 0;
+	spin_lock(&swap_lock);
+	nenv = env_ntable;
+	for (n = 0; n < 2 * nenv + 1 && freed < SWAP_BATCH; n++) {
+		if (hand_env >= nenv)
+			hand_env = 0;
+		e = &envs[hand_env];
+		if (env_swappable(e) && env_trylock(e)) {
+			r = env_swappable(e) ? swap_sweep(e, SWAP_BATCH - freed) : 0;
+			env_unlock(e);
+			if (r < 0)
+				break;
+			freed += r;
+			if (freed >= SWAP_BATCH)
+				break;
+		}
+		hand_env++;
+		hand_va = 0;
+	}
+	spin_unlock(&swap_lock);
+	return freed;
+}
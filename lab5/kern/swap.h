@@ -0,0 +1,30 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Is this PTE a page that's out on the swap disk?
+#define PTE_SWAPPED(pte)	(((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+
+extern uint32_t swap_nslots;	// pages the swap disk holds, 0 if none
+extern uint32_t swap_nused;	// slots holding a page
+extern uint32_t swap_outs;	// pages written out by swap_reclaim
+extern uint32_t swap_ins;	// pages read back by swap_in
+
+// Find the swap disk, if there is one.
+void	swap_init(void);
+// Page out some cold user pages.  Returns how many pages it freed.
+int	swap_reclaim(void);
+// Bring the page at va back, if it's swapped out; with the address
+// space's env_lock held.
+int	swap_in(pde_t *pgdir, void *va);
+// Forget the swapped-out page in the PTE 'pte'.
+void	swap_free(pte_t pte);
+
+#endif	// !JOS_KERN_SWAP_H
@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/net.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -11,11 +12,20 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/picirq.h>
+#include <kern/swap.h>
+#include <kern/trace.h>
+#include <kern/e1000.h>
+#include <kern/ahci.h>
+#include <kern/ktimer.h>
+#include <kern/kstack.h>
+#include <kern/ipcstat.h>
+#include <kern/klog.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
-static void
+static int
 sys_cputs(const char *s, size_t len)
 {
 	// Check that the user has permission to read memory [s, s+len).
@@ -25,23 +35,76 @@ sys_cputs(const char *s, size_t len)
     
     user_mem_assert(curenv, (void *)s, len, PTE_U);
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user, at most up to a NUL,
+	// after what the kernel printed before.
+    klog_flush();
+    cons_begin();
+    cons_write(s, strnlen(s, len));
+    cons_end();
+    return 0;
 }
 
-// Read a character from the system console.
-// Returns the character.
+// Copy the latest of the kernel log (kern/klog.c), up to 'len' bytes,
+// to 'buf'; KLOG_SIZE bytes take all the kernel keeps.
+// Returns the number of bytes copied.  Destroys the env if buf isn't
+// writable.
+static int
+sys_klog_read(char *buf, size_t len)
+{
+    user_mem_assert(curenv, buf, len, PTE_U | PTE_W);
+    return klog_read(buf, len);
+}
+
+// Read a character from the system console without waiting.
+// Returns the character, or 0 if there is no input.
 static int
 sys_cgetc(void)
 {
-	int c;
+	return cons_getc();
+}
+
+// Envs asleep in sys_cgetc_wait, in the order they went to sleep
+static TAILQ_HEAD(Env_consq, Env) cons_waiters = TAILQ_HEAD_INITIALIZER(cons_waiters);
 
-	// The cons_getc() primitive doesn't wait for a character,
-	// but the sys_cgetc() system call does.
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+// sys_event_wait's, below
+static void event_signal(struct Env *e, uint32_t ev);
+static void event_wake_all(uint32_t ev);
+static void event_wake_addr(physaddr_t pa, physaddr_t mask);
+static void event_unwatch(struct Env *e);
+
+// Read a character from the system console, sleeping until there is one.
+// Returns the character.
+static int
+sys_cgetc_wait(void)
+{
+    int c;
+    if ((c = cons_getc()) != 0)
+        return c;
+    curenv->env_cons_waiting = 1;
+    TAILQ_INSERT_TAIL(&cons_waiters, curenv, env_cons_link);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_yield();
+}
 
-	return c;
+//
+// Called from trap_dispatch after a keyboard or serial interrupt has
+// filled the console buffer: hand its characters to the envs asleep in
+// sys_cgetc_wait, one each, first come first served.  If any is left,
+// wake those waiting for it in sys_event_wait.
+//
+void
+cons_signal(void)
+{
+    struct Env *e;
+    int c;
+    while ((e = TAILQ_FIRST(&cons_waiters)) != NULL && (c = cons_getc()) != 0) {
+        TAILQ_REMOVE(&cons_waiters, e, env_cons_link);
+        e->env_cons_waiting = 0;
+        e->env_tf.tf_regs.reg_eax = c;
+        env_set_status(e, ENV_RUNNABLE);
+    }
+    if (cons_pending())
+        event_wake_all(EVENT_CONS);
 }
 
 // Returns the current environment's envid.
@@ -51,6 +114,14 @@ sys_getenvid(void)
 	return curenv->env_id;
 }
 
+// sys_env_destroy's work, on curenv's kernel stack.
+static int32_t
+env_destroy_run(void *e)
+{
+	env_destroy(e);
+	return 0;
+}
+
 // Destroy a given environment (possibly the currently running environment).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
@@ -64,8 +135,9 @@ sys_env_destroy(envid_t envid)
 
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
-	return 0;
+	// Freeing a big address space takes a while, so do it where it can
+	// stop for other envs (kstack_preempt)
+	kstack_run(env_destroy_run, e);
 }
 
 // Deschedule current environment and pick a different one to run.
@@ -75,6 +147,41 @@ sys_yield(void)
 	sched_yield();
 }
 
+// Sleep for 'ticks' ticks of the clock (timer_hz a second), giving up
+// the CPU meanwhile, rather than spinning on sys_yield.  A kernel timer
+// (kern/ktimer.c) wakes us; sleeps longer than KTIMER_MAX ticks are cut
+// short to that.  Returns 0.
+static int
+sys_sleep(uint32_t ticks)
+{
+    if (ticks == 0)
+        return 0;
+    ktimer_arm(curenv, ticks);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_yield();
+}
+
+//
+// Called from ktimer_tick when e's timer goes off: end its sys_sleep or
+// sys_event_wait, or fail its receive with -E_TIMEOUT.
+//
+void
+timer_signal(struct Env *e)
+{
+    if (e->env_event != NULL) {
+        spin_lock(&addrwait_lock);
+        event_signal(e, EVENT_TIMEOUT);
+        spin_unlock(&addrwait_lock);
+        return;
+    }
+    if (e->env_ipc_recving) {
+        e->env_ipc_recving = 0;
+        e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+    } else
+        e->env_tf.tf_regs.reg_eax = 0;
+    env_set_status(e, ENV_RUNNABLE);
+}
+
 // Allocate a new environment.
 // Returns envid of new environment, or < 0 on error.  Errors are:
 //	-E_NO_FREE_ENV if no free environment is available.
@@ -92,9 +199,11 @@ sys_exofork(void)
     struct Env *env;
     err = env_alloc(&env, curenv->env_id);
     if (err >= 0) {
-        env->env_status = ENV_NOT_RUNNABLE;
+        env_set_status(env, ENV_NOT_RUNNABLE);
         env->env_tf = curenv->env_tf;
         env->env_tf.tf_regs.reg_eax = 0;
+        memmove(env->env_regions, curenv->env_regions, sizeof(env->env_regions));
+        env_ras[ENVX(env->env_id)] = env_ras[ENVX(curenv->env_id)];
         return env->env_id;
     }
     else
@@ -102,6 +211,122 @@ sys_exofork(void)
 
 }
 
+// Fork the current environment in one system call.
+// Like sys_exofork, except that the child also gets a copy-on-write copy
+// of the caller's address space below UTOP (see pgdir_cow_copy), a fresh
+// user exception stack if the caller has one, the caller's page fault
+// upcall, and is left ENV_RUNNABLE.  From then on the kernel resolves
+// copy-on-write faults for both environments in page_fault_handler.
+//
+// Returns envid of new environment (0 in the child), or < 0 on error.
+// Errors are the same as for sys_exofork.
+static envid_t
+sys_cow_fork(void)
+{
+    int err;
+    struct Env *env;
+    struct Page *page;
+    void *xstack = (void *)(UXSTACKTOP - PGSIZE);
+    err = env_alloc(&env, curenv->env_id);
+    if (err < 0)
+        return err;
+    env->env_tf = curenv->env_tf;
+    env->env_tf.tf_regs.reg_eax = 0;
+    env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    memmove(env->env_regions, curenv->env_regions, sizeof(env->env_regions));
+    env_ras[ENVX(env->env_id)] = env_ras[ENVX(curenv->env_id)];
+    env_lock2(curenv, env);
+    err = pgdir_cow_copy(env->env_pgdir, curenv->env_pgdir);
+    if (err == 0 && page_lookup(curenv->env_pgdir, xstack, NULL) != NULL) {
+        err = page_alloc_zeroed(&page);
+        if (err == 0 && (err = page_insert(env->env_pgdir, page, xstack, PTE_U | PTE_W | PTE_P)) < 0)
+            page_free(page);
+    }
+    env_unlock2(curenv, env);
+    if (err < 0) {
+        env_free(env);
+        return err;
+    }
+    curenv->env_fault_flags |= ENV_FAULT_COW;
+    env->env_fault_flags |= ENV_FAULT_COW;
+    return env->env_id;
+}
+
+// Start a new child running the ELF image at [binary, binary + size)
+// in one system call: the kernel loads its segments as load_icode does,
+// moves the caller's page at 'stack' to the child's USTACKTOP - PGSIZE,
+// and starts the child at the image's entry with esp 'esp'.  This is
+// spawn without the sys_exofork, the page calls and the trapframe and
+// status calls.
+//
+// Returns envid of the new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_NOT_EXEC if the image is not an ELF we can load.
+//	-E_INVAL if the image isn't all mapped in the caller,
+//		if stack is not a page-aligned page of the caller,
+//		or if esp is not in the child's stack page.
+static envid_t
+sys_exec(const void *binary, size_t size, void *stack, uintptr_t esp)
+{
+    int err;
+    struct Env *env;
+    struct Page *page;
+    pte_t *pte;
+    if (esp < USTACKTOP - PGSIZE || esp > USTACKTOP)
+        return -E_INVAL;
+    err = env_alloc(&env, curenv->env_id);
+    if (err < 0)
+        return err;
+    env_lock2(curenv, env);
+    if (user_mem_check(curenv, binary, size, PTE_U | PTE_P) < 0
+        || (uintptr_t)stack >= UTOP || PGOFF(stack) != 0
+        || (page = page_lookup(curenv->env_pgdir, stack, &pte)) == NULL
+        || !(*pte & PTE_U))
+        err = -E_INVAL;
+    else if ((err = env_load_elf(env, binary, size, 0)) == 0
+             && (err = page_insert(env->env_pgdir, page, (void *)(USTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P)) == 0)
+        page_remove(curenv->env_pgdir, stack);
+    env_unlock2(curenv, env);
+    if (err < 0) {
+        env_free(env);
+        return err;
+    }
+    env->env_tf.tf_esp = esp;
+    return env->env_id;
+}
+
+// Create a thread: a new env, left ENV_NOT_RUNNABLE as by sys_exofork,
+// that shares the caller's address space instead of getting a copy of
+// it (see env_alloc_thread).  It starts at 'eip' with stack pointer
+// 'esp', and takes page faults through the caller's upcall but on its
+// own exception stack, the page below 'xstacktop'.  It gets the
+// caller's fault flags and auto-grow regions, and otherwise starts as
+// env_alloc leaves it.  The caller makes it runnable with
+// sys_env_set_status once its stack is ready.
+//
+// Returns envid of the new thread, or < 0 on error.  Errors are those of
+// sys_exofork, or -E_INVAL if xstacktop is above UXSTACKTOP.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+    int err;
+    struct Env *env;
+    if (xstacktop > UXSTACKTOP)
+        return -E_INVAL;
+    if ((err = env_alloc_thread(&env, curenv)) < 0)
+        return err;
+    env_set_status(env, ENV_NOT_RUNNABLE);
+    env->env_tf.tf_eip = eip;
+    env->env_tf.tf_esp = esp;
+    env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    env->env_xstacktop = xstacktop;
+    env->env_fault_flags = curenv->env_fault_flags;
+    memmove(env->env_regions, curenv->env_regions, sizeof(env->env_regions));
+    env_ras[ENVX(env->env_id)] = env_ras[ENVX(curenv->env_id)];
+    return env->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -123,7 +348,8 @@ sys_env_set_status(envid_t envid, int status)
         struct Env *env = NULL;
         int err = envid2env(envid, &env, 1);
         if (err == 0) {
-            env->env_status = status;
+            ktimer_cancel(env);
+            env_set_status(env, status);
             return 0;
         }
         else
@@ -161,6 +387,49 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
         return err;
 }
 
+// Put envid in scheduling class 'priority' (ENV_PRIO_HIGH, _NORMAL or
+// _LOW; see inc/env.h), which also sets the length of its time slice.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is not a valid class.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+    int err;
+    struct Env *env;
+    if (priority < 0 || priority >= ENV_NPRIO)
+        return -E_INVAL;
+    err = envid2env(envid, &env, 1);
+    if (err < 0)
+        return err;
+    env_set_priority(env, priority);
+    return 0;
+}
+
+// Pin envid to run only on CPU 'cpu', numbered from 0 as cpunum() does;
+// 0 is the CPU that takes the device interrupts.  cpu -1 lets it run on
+// any CPU again.  A pinned env waits for its CPU even while others idle.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpu is neither -1 nor a CPU of this machine.
+static int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+    int err;
+    struct Env *env;
+    if (cpu < -1 || cpu >= ncpu)
+        return -E_INVAL;
+    err = envid2env(envid, &env, 1);
+    if (err < 0)
+        return err;
+    env_set_affinity(env, cpu);
+    return 0;
+}
+
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
@@ -184,6 +453,144 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
         return err;
 }
 
+// Choose which copy-on-write faults of 'envid' the kernel resolves on
+// its own, without going through the upcall: 'flags' is made of
+// ENV_FAULT_* (inc/env.h), and replaces what was there before.  The
+// faults left over still go to env_pgfault_upcall.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if flags has bits other than ENV_FAULT_*.
+static int
+sys_env_set_fault_flags(envid_t envid, uint32_t flags)
+{
+    int err;
+    struct Env *env;
+    if ((flags & ~(ENV_FAULT_REUSE | ENV_FAULT_COW)) != 0)
+        return -E_INVAL;
+    if ((err = envid2env(envid, &env, 1)) < 0)
+        return err;
+    env->env_fault_flags = flags;
+    return 0;
+}
+
+// Would 'npages' more pages take env past its env_page_quota?
+static bool
+over_quota(struct Env *env, uint32_t npages)
+{
+    env = env_vm_owner(env);
+    return env->env_page_quota != 0 && env->env_npages + npages > env->env_page_quota;
+}
+
+// Limit the pages sys_page_alloc will map in envid to 'npages' in all,
+// counting every page envid has mapped (env_npages); 0 is no limit.
+// Pages that come in other ways, by sys_page_map, IPC or copy-on-write,
+// aren't stopped, though they count.  Threads share one quota, with
+// their address space.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_page_quota(envid_t envid, uint32_t npages)
+{
+    int err;
+    struct Env *env;
+    if ((err = envid2env(envid, &env, 1)) < 0)
+        return err;
+    env_vm_owner(env)->env_page_quota = npages;
+    return 0;
+}
+
+// sys_page_alloc for a 4MB region at va: a superpage if there's one to
+// be had, page by page if not.
+static int
+sys_page_alloc_super(envid_t envid, void *va, int perm)
+{
+    int err;
+    size_t i;
+    struct Env *env;
+    struct Page *page;
+    if ((uintptr_t)va % PTSIZE != 0 || (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
+        return -E_INVAL;
+    err = envid2env_lock(envid, &env, 1);
+    if (err < 0)
+        return err;
+    if (over_quota(env, NPTENTRIES))
+        err = -E_NO_MEM;
+    else if (page_super_alloc(env->env_pgdir, va, perm) < 0) {
+        for (i = 0; i < NPTENTRIES && err == 0; i++) {
+            err = page_alloc_zeroed_at(&page, va + i * PGSIZE);
+            if (err == 0 && (err = page_insert(env->env_pgdir, page, va + i * PGSIZE, perm)) < 0)
+                page_free(page);
+        }
+        // Leave nothing half done
+        while (err < 0 && i-- > 0)
+            page_remove(env->env_pgdir, va + i * PGSIZE);
+    }
+    env_unlock(env);
+    return err;
+}
+
+// Allocate 'npages' pages that are contiguous in physical memory, for a
+// user-level driver's DMA, and map them from 'va' in curenv with 'perm'.
+// The pages are zeroed.  They come from one block of the buddy allocator,
+// of at most 2^PAGE_MAX_ORDER pages, but are ordinary pages once mapped:
+// each is unmapped and freed on its own.  Envs with I/O privilege aren't
+// swapped, so the physical addresses the driver reads from its page
+// table stay good.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if curenv may not do I/O.
+//	-E_INVAL if va is not page-aligned, the pages don't fit below UTOP,
+//		npages is 0 or more than a block holds, or perm is
+//		inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no block of physically contiguous pages
+//		free, no memory for page tables, or the pages would take
+//		curenv past its quota.
+static int
+sys_page_alloc_contig(void *va, size_t npages, int perm)
+{
+    int err, order;
+    size_t i, j;
+    struct Env *env;
+    struct Page *pp;
+    if ((uintptr_t)va % PGSIZE != 0 || (uintptr_t)va >= UTOP
+        || npages == 0 || npages > (1 << PAGE_MAX_ORDER)
+        || npages > (UTOP - (uintptr_t)va) / PGSIZE)
+        return -E_INVAL;
+    if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+        || (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
+        return -E_INVAL;
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    for (order = 0; (1U << order) < npages; order++)
+        ;
+    if ((err = envid2env_lock(0, &env, 1)) < 0)
+        return err;
+    if (over_quota(env, npages))
+        err = -E_NO_MEM;
+    else if ((err = page_alloc_order(&pp, order)) == 0) {
+        // The rest of the block goes back at once
+        for (i = npages; i < (1U << order); i++)
+            page_free_order(pp + i, 0);
+        for (i = 0; i < npages && err == 0; i++) {
+            memset(page2kva(pp + i), 0, PGSIZE);
+            err = page_insert(env->env_pgdir, pp + i, va + i * PGSIZE, perm);
+        }
+        // Leave nothing half done: page i - 1 didn't go in
+        if (err < 0) {
+            for (j = i - 1; j < npages; j++)
+                page_free_order(pp + j, 0);
+            while (--i > 0)
+                page_remove(env->env_pgdir, va + (i - 1) * PGSIZE);
+        }
+    }
+    env_unlock(env);
+    return err;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -193,13 +600,23 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.
 //
+// With PTE_PS in perm, a whole 4MB at a PTSIZE-aligned va is allocated
+// instead: one superpage if a 4MB block is free (see page_super_alloc),
+// else NPTENTRIES ordinary pages.
+//
+// With PTE_COW in perm, the page is demand-zero: the kernel's zero page
+// is mapped copy-on-write (see page_map_zero), and the first write gets
+// a page of its own, writable.  PTE_SHARE can't go with it.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned
+//		(PTSIZE-aligned, with PTE_PS).
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
-//		or to allocate any necessary page tables.
+//		or to allocate any necessary page tables, or the page
+//		would take envid past its quota (sys_env_set_page_quota).
 static int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
@@ -217,28 +634,28 @@ sys_page_alloc(envid_t envid, void *va, int perm)
         return -E_INVAL;
     if ((perm & PTE_U) == 0 && (perm & PTE_P) == 0)
         return -E_INVAL;
+    if ((perm & PTE_PS) != 0)
+        return sys_page_alloc_super(envid, va, perm & ~PTE_PS);
     if ((perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
         return -E_INVAL;
-    err = envid2env(envid, &env, 1);
-    if (err == 0) {
+    if ((perm & (PTE_COW | PTE_SHARE)) == (PTE_COW | PTE_SHARE))
+        return -E_INVAL;
+    err = envid2env_lock(envid, &env, 1);
+    if (err == 0 && (perm & PTE_COW)) {
+        err = over_quota(env, 1) ? -E_NO_MEM
+            : page_map_zero(env->env_pgdir, va, (perm & ~PTE_COW) | PTE_W);
+        env_unlock(env);
+    } else if (err == 0) {
         struct Page *page;
-        err = page_alloc(&page);
+        err = over_quota(env, 1) ? -E_NO_MEM : page_alloc_zeroed_at(&page, va);
         if (err == 0) {
             err = page_insert(env->env_pgdir, page, va, perm);
-            if (err == 0) {
-                memset(page2kva(page), 0, PGSIZE);
-                return 0;
-            }
-            else {
+            if (err < 0)
                 page_free(page);
-                return err;
-            }
         }
-        else
-            return err;
+        env_unlock(env);
     }
-    else
-        return err;
+    return err;
 
 }
 
@@ -283,18 +700,121 @@ sys_page_map(envid_t srcenvid, void *srcva,
         return -E_INVAL;
     if ((perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
         return -E_INVAL;
-    err = envid2env(srcenvid, &srcenv, 1);
-    if (err < 0)
-        return err;
-    err = envid2env(dstenvid, &dstenv, 1);
+    err = envid2env_lock2(srcenvid, &srcenv, dstenvid, &dstenv, 1);
     if (err < 0)
         return err;
     page = page_lookup(srcenv->env_pgdir, srcva, &pte);
     if (page == NULL || ((perm & PTE_W) != 0 && (*pte & PTE_W) == 0))
+        err = -E_INVAL;
+    else
+        err = page_insert(dstenv->env_pgdir, page, dstva, perm);
+    env_unlock2(srcenv, dstenv);
+    return err;
+}
+
+// Let toenvid map pages into [va, va + npages pages) of envid's address
+// space with sys_page_map_range, until the next sys_page_grant for
+// envid; npages 0 takes any grant back.  envid is us or a child of ours.
+// This is how a server hands a client (or a child the client is
+// building) many pages in one request, which the client asked for,
+// though the client isn't the server's child.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if envid doesn't exist or isn't ours.
+//	-E_INVAL if va isn't page-aligned or the range runs past UTOP.
+static int
+sys_page_grant(envid_t envid, envid_t toenvid, void *va, size_t npages)
+{
+    struct Env *e;
+    int err;
+    if ((err = envid2env(envid, &e, 1)) < 0)
+        return err;
+    if (npages == 0) {
+        e->env_grant_npages = 0;
+        return 0;
+    }
+    if (PGOFF(va) != 0 || (uintptr_t)va >= UTOP
+        || npages > (UTOP - (uintptr_t)va) / PGSIZE)
+        return -E_INVAL;
+    e->env_grant_envid = toenvid;
+    e->env_grant_va = (uintptr_t)va;
+    e->env_grant_npages = npages;
+    return 0;
+}
+
+// Map the 'npages' pages starting at 'srcva' in srcenvid's address space
+// at the same offsets from 'dstva' in dstenvid's address space, all with
+// permission 'perm', in one system call.  Source pages that are not
+// mapped are skipped, so the range may span holes.
+// Pages are mapped in order; if one fails, the earlier ones stay mapped.
+//
+// Return 0 on success, < 0 on error.  Errors are as for sys_page_map,
+// plus:
+//	-E_INVAL if either range runs past UTOP.
+// dstenvid need not be ours if it has granted us the range with
+// sys_page_grant.
+// Pages mapped PTE_COW into another environment are copied by the kernel
+// when that environment first writes them, as after sys_cow_fork.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+	     envid_t dstenvid, void *dstva, size_t npages, int perm)
+{
+    struct Env *srcenv, *dstenv;
+    int err;
+    size_t i;
+    pte_t *pte;
+    if (srcva >= (void *)UTOP || srcva != ROUNDUP(srcva, PGSIZE))
+        return -E_INVAL;
+    if (dstva >= (void *)UTOP || dstva != ROUNDUP(dstva, PGSIZE))
+        return -E_INVAL;
+    if (npages > ((uintptr_t)UTOP - (uintptr_t)srcva) / PGSIZE ||
+        npages > ((uintptr_t)UTOP - (uintptr_t)dstva) / PGSIZE)
         return -E_INVAL;
-    err = page_insert(dstenv->env_pgdir, page, dstva, perm);
+    if ((perm & PTE_U) == 0 && (perm & PTE_P) == 0)
+        return -E_INVAL;
+    if ((perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
+        return -E_INVAL;
+    err = envid2env(srcenvid, &srcenv, 1);
+    if (err < 0)
+        return err;
+    err = envid2env(dstenvid, &dstenv, 1);
+    if (err < 0) {
+        // Not ours, but it may have granted us the range
+        if (envid2env(dstenvid, &dstenv, 0) < 0
+            || dstenv->env_grant_envid != curenv->env_id
+            || (uintptr_t)dstva < dstenv->env_grant_va
+            || ((uintptr_t)dstva - dstenv->env_grant_va) / PGSIZE + npages
+               > dstenv->env_grant_npages)
+            return err;
+    }
+    env_lock2(srcenv, dstenv);
+    for (i = 0; i < npages && err >= 0; i++, srcva += PGSIZE, dstva += PGSIZE) {
+        // The PTE's PTE_W must be what the page really allows
+        if ((err = pgdir_pt_unshare(srcenv->env_pgdir, srcva)) < 0)
+            continue;
+        pte = pgdir_walk(srcenv->env_pgdir, srcva, 0);
+        if (pte == NULL) {
+            // No page table: skip the rest of this 4MB
+            i += NPTENTRIES - PTX(srcva) - 1;
+            dstva += (NPTENTRIES - PTX(srcva) - 1) * PGSIZE;
+            srcva += (NPTENTRIES - PTX(srcva) - 1) * PGSIZE;
+            continue;
+        }
+        if (PTE_SWAPPED(*pte) && (err = swap_in(srcenv->env_pgdir, srcva)) < 0)
+            continue;
+        if ((*pte & PTE_P) == 0)
+            continue;
+        if ((perm & PTE_W) != 0 && (*pte & PTE_W) == 0)
+            err = -E_INVAL;
+        else
+            // page_lookup knows the page in a superpage, too
+            err = page_insert(dstenv->env_pgdir, page_lookup(srcenv->env_pgdir, srcva, NULL), dstva, perm);
+    }
+    env_unlock2(srcenv, dstenv);
     if (err < 0)
         return err;
+    if ((perm & PTE_COW) != 0 && dstenv != curenv)
+        dstenv->env_fault_flags |= ENV_FAULT_COW;
     return 0;
 }
 
@@ -315,34 +835,446 @@ sys_page_unmap(envid_t envid, void *va)
     struct Env *env;
     if (va >= (void *)UTOP || va != ROUNDUP(va, PGSIZE))
         return -E_INVAL;
-    err = envid2env(envid, &env, 1);
+    err = envid2env_lock(envid, &env, 1);
     if (err == 0) {
         page_remove(env->env_pgdir, va);
-        return 0;
+        env_unlock(env);
     }
-    else
-        return err;
+    return err;
 }
 
-// Try to send 'value' to the target env 'envid'.
-// If va != 0, then also send page currently mapped at 'va',
-// so that receiver gets a duplicate mapping of the same page.
-//
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target has not requested IPC with sys_ipc_recv.
-//
-// Otherwise, the send succeeds, and the target's ipc fields are
-// updated as follows:
-//    env_ipc_recving is set to 0 to block future sends;
-//    env_ipc_from is set to the sending envid;
-//    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused ipc_recv system call.
+// Make [va, va + len) an auto-grow region of curenv: a page fault on a
+// page there that isn't mapped gets a fresh zeroed page, mapped
+// PTE_U | PTE_W | PTE_P, right in the kernel, without a trip through
+// the page fault upcall.  Good for stacks and sparse heaps, which don't
+// have to map their pages ahead of use.  A zero 'len' removes the
+// region starting at va.  Children from sys_exofork and sys_cow_fork
+// get the caller's regions.  If memory runs out at fault time, the
+// fault goes on to the upcall as any other.
 //
-// If the sender sends a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
-// The ipc doesn't happen unless no errors occur.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va or len is not page-aligned, the region is not below
+//		UTOP, or it overlaps one curenv already has (or, to remove,
+//		no region starts at va).
+//	-E_NO_MEM if curenv has ENV_NREGION regions already.
+static int
+sys_page_autogrow(void *va, size_t len)
+{
+    struct Env_region *r, *free = NULL;
+    uintptr_t start = (uintptr_t)va;
+    if (PGOFF(start) != 0 || PGOFF(len) != 0 || start >= UTOP || len > UTOP - start)
+        return -E_INVAL;
+    for (r = curenv->env_regions; r < curenv->env_regions + ENV_NREGION; r++) {
+        if (r->r_start == r->r_end) {
+            if (free == NULL)
+                free = r;
+            continue;
+        }
+        if (len == 0 && r->r_start == start) {
+            r->r_start = r->r_end = 0;
+            return 0;
+        }
+        if (start < r->r_end && r->r_start < start + len)
+            return -E_INVAL;
+    }
+    if (len == 0)
+        return -E_INVAL;
+    if (free == NULL)
+        return -E_NO_MEM;
+    free->r_start = start;
+    free->r_end = start + len;
+    return 0;
+}
+
+// Make the 'n' sequences at 'ras' envid's restartable atomic sequences
+// (see struct Env_ras), replacing any it had; n 0 removes them all.
+// They belong to the address space: threads in it get them too, as do
+// children from sys_exofork, sys_cow_fork and sys_thread_create.  An
+// env taking an interrupt or a page fault inside one starts it over.
+// That makes a sequence atomic against the other envs on the same CPU,
+// not against those running on another at the same time.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if n > ENV_NRAS, ras isn't readable, or a sequence is
+//		empty or not below UTOP.
+static int
+sys_env_set_ras(envid_t envid, const struct Env_ras *ras, size_t n)
+{
+    struct Env_rasset rs;
+    struct Env *env;
+    int err;
+    uint32_t i;
+    if ((err = envid2env(envid, &env, 1)) < 0)
+        return err;
+    if (n > ENV_NRAS || user_mem_check(curenv, ras, n * sizeof(*ras), PTE_U | PTE_P) < 0)
+        return -E_INVAL;
+    rs.rs_n = n;
+    memmove(rs.rs_ras, ras, n * sizeof(*ras));
+    for (i = 0; i < n; i++)
+        if (rs.rs_ras[i].ras_start >= rs.rs_ras[i].ras_end || rs.rs_ras[i].ras_end > UTOP)
+            return -E_INVAL;
+    for (i = 0; i < env_ntable; i++)
+        if (envs[i].env_status != ENV_FREE && envs[i].env_cr3 == env->env_cr3)
+            env_ras[i] = rs;
+    return 0;
+}
+
+// The copy-on-write fault shortcut for lib/fork.c's pgfault: if curenv
+// is all that's left referring to its copy-on-write page at 'va', make
+// the page writable where it is, which saves the copy.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, va isn't mapped copy-on-write, or someone
+//		else still shares the page, so it must be copied.
+static int
+sys_page_cow_reuse(void *va)
+{
+    int err;
+    if (va >= (void *)UTOP)
+        return -E_INVAL;
+    env_lock(curenv);
+    err = page_cow_reuse(curenv->env_pgdir, ROUNDDOWN(va, PGSIZE));
+    env_unlock(curenv);
+    return err;
+}
+
+// Check that 'src' may send the page at 'srcva' with 'perm' (ignored if
+// srcva >= UTOP), returning the page, or the error for sys_ipc_try_send.
+static int
+ipc_check_page(struct Env *src, void *srcva, unsigned perm, struct Page **page)
+{
+    pte_t *pte;
+    *page = NULL;
+    if (srcva >= (void *)UTOP)
+        return 0;
+    if (ROUNDDOWN(srcva, PGSIZE) != srcva) 
+        return -E_INVAL;
+    if ((perm & PTE_U) == 0 && (perm & PTE_P) == 0)
+        return -E_INVAL;
+    if ((perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
+        return -E_INVAL;
+    *page = page_lookup(src->env_pgdir, srcva, &pte);
+    if (*page == NULL) 
+        return -E_INVAL;
+    if ((perm & PTE_W) != 0 && (*pte & PTE_W) == 0)
+        return -E_INVAL;
+    return 0;
+}
+
+// Map the 'npages' pages from 'srcva' in src at dst's env_ipc_dstva,
+// in one pass over src's page tables, with src and dst locked.  The
+// first is known good.  If any fails, none is left mapped (nor what dst
+// had mapped in its window before), and we return the sys_ipc_try_send
+// error.
+static int
+ipc_map_range(struct Env *src, void *srcva, struct Env *dst, size_t npages, unsigned perm)
+{
+    struct Page *page;
+    pte_t *pte;
+    size_t i;
+    int err = 0;
+    for (i = 0; i < npages && err == 0; i++) {
+        page = page_lookup(src->env_pgdir, srcva + i * PGSIZE, &pte);
+        if (page == NULL || ((perm & PTE_W) != 0 && (*pte & PTE_W) == 0))
+            err = -E_INVAL;
+        else
+            err = page_insert(dst->env_pgdir, page,
+                              dst->env_ipc_dstva + i * PGSIZE, perm);
+    }
+    if (err < 0)
+        while (i-- > 0)
+            page_remove(dst->env_pgdir, dst->env_ipc_dstva + i * PGSIZE);
+    return err;
+}
+
+//
+// Deliver a message from 'src' to 'dst', which must be receiving, and
+// make dst runnable again.  The message is (value, srcva, npages, perm)
+// with the npages pages from srcva in src's address space, of which dst
+// gets as many as fit its window: env_ipc_dstnpages pages from
+// env_ipc_dstva, or none if that's UTOP.  'words', if not null, are the
+// IPC_NWORDS words of a short message (sys_ipc_send_short), which dst
+// finds in env_ipc_words; otherwise they are zero.  Returns 0 or the
+// sys_ipc_try_send error.
+//
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva,
+            size_t npages, unsigned perm, const uint32_t *words)
+{
+    int err;
+    struct Page *page;
+    size_t n = 0;
+    env_lock2(src, dst);
+    err = ipc_check_page(src, srcva, perm, &page);
+    if (err == 0 && page != NULL && dst->env_ipc_dstva < (void *)UTOP) {
+        n = MIN(npages, dst->env_ipc_dstnpages);
+        err = ipc_map_range(src, srcva, dst, n, perm);
+    }
+    env_unlock2(src, dst);
+    if (err < 0)
+        return err;
+    dst->env_ipc_perm = n > 0 ? perm : 0;
+    dst->env_ipc_npages = n;
+    ipcstat_send(src, dst, n);
+    /*cprintf("ipc_deliver: to env 0x%x perm 0x%x srcva 0x%x dstva 0x%x\n",  dst, dst->env_ipc_perm, srcva, dst->env_ipc_dstva);*/
+    trace(TRACE_IPC_SEND, src->env_id, dst->env_id);
+    ktimer_cancel(dst);
+    dst->env_ipc_recving = 0;
+    dst->env_ipc_from = src->env_id;
+    dst->env_ipc_value = value;
+    if (words != NULL)
+        memmove(dst->env_ipc_words, words, sizeof(dst->env_ipc_words));
+    else
+        memset(dst->env_ipc_words, 0, sizeof(dst->env_ipc_words));
+
+    env_set_status(dst, ENV_RUNNABLE);
+    dst->env_tf.tf_regs.reg_eax = 0;
+    // Whatever dst was calling has answered, or it wouldn't be receiving
+    env_undonate(dst);
+    return 0;
+}
+
+//
+// Queue curenv, which is sending (value, srcva, npages, perm, words) to
+// 'dst', behind any other env already waiting for dst to receive, and
+// give up the CPU.  If 'call' curenv receives a reply at
+// curenv->env_ipc_dstva after the send, as in sys_ipc_call.
+//
+static void
+ipc_send_wait(struct Env *dst, uint32_t value, void *srcva, size_t npages,
+              unsigned perm, const uint32_t *words, bool call)
+{
+    curenv->env_ipc_send_to = dst->env_id;
+    curenv->env_ipc_send_value = value;
+    curenv->env_ipc_send_srcva = srcva;
+    curenv->env_ipc_send_npages = npages;
+    curenv->env_ipc_send_perm = perm;
+    curenv->env_ipc_send_short = words != NULL;
+    if (words != NULL)
+        memmove(curenv->env_ipc_send_words, words, sizeof(curenv->env_ipc_send_words));
+    curenv->env_ipc_send_call = call;
+    TAILQ_INSERT_TAIL(&dst->env_ipc_senders, curenv, env_ipc_send_link);
+    ipcstat_wait(curenv, 1);
+    if (dst->env_event != NULL) {
+        spin_lock(&addrwait_lock);
+        event_signal(dst, EVENT_IPC);
+        spin_unlock(&addrwait_lock);
+    }
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_yield();
+}
+
+//
+// Take 'e' off the send queue it is waiting in, and finish its send
+// with result 'err': the send syscall returns err, or for a successful
+// sys_ipc_call, e goes on to wait for the reply.
+//
+static void
+ipc_send_done(struct Env *e, int err)
+{
+    struct Env *dst = &envs[ENVX(e->env_ipc_send_to)];
+    TAILQ_REMOVE(&dst->env_ipc_senders, e, env_ipc_send_link);
+    e->env_ipc_send_to = 0;
+    // A call's sender goes on waiting, for the reply
+    ipcstat_wait(e, err == 0 && e->env_ipc_send_call);
+    if (err == 0 && e->env_ipc_send_call) {
+        e->env_ipc_recving = 1;
+        e->env_ipc_from = 0;
+        return;
+    }
+    env_undonate(e);
+    e->env_tf.tf_regs.reg_eax = err;
+    env_set_status(e, ENV_RUNNABLE);
+}
+
+// IRQs the kernel handles itself: the clock, the keyboard, the cascade
+// from the slave PIC, and the serial port (IRQ 4).
+#define IRQ_KERNEL	((1<<IRQ_TIMER) | (1<<IRQ_KBD) | (1<<IRQ_SLAVE) | (1<<4))
+
+// The env each device IRQ is delivered to (see sys_irq_listen), whether
+// it is blocked in sys_irq_wait, and whether an IRQ came in that it
+// hasn't seen yet.
+static struct Env *irq_owner[MAX_IRQS];
+static bool irq_waiting[MAX_IRQS];
+static bool irq_pending[MAX_IRQS];
+
+// The env blocked in sys_net_recv, and where it wants the packets
+static struct Env *net_recver;
+static uintptr_t net_recv_va;
+static int net_recv_n;
+
+// Hand 'irq' to 'e', which is receiving, as a message from the kernel:
+// envid 0, value irq, no page.
+static void
+irq_recv(struct Env *e, int irq)
+{
+    ktimer_cancel(e);
+    env_undonate(e);
+    e->env_ipc_recving = 0;
+    e->env_ipc_from = 0;
+    e->env_ipc_value = irq;
+    e->env_ipc_perm = 0;
+    e->env_ipc_npages = 0;
+}
+
+// If an IRQ owned by 'e' is pending, take it and return its number;
+// otherwise return -1.
+static int
+irq_take_pending(struct Env *e)
+{
+    int i;
+    for (i = 0; i < MAX_IRQS; i++)
+        if (irq_owner[i] == e && irq_pending[i]) {
+            irq_pending[i] = 0;
+            return i;
+        }
+    return -1;
+}
+
+//
+// Called from trap_dispatch when a device IRQ that user space handles
+// arrives: acknowledge it, then wake its owner from sys_irq_wait, or
+// deliver it to the owner if it is blocked receiving, or remember it
+// for later.
+//
+void
+irq_signal(int irq)
+{
+    struct Env *e = irq_owner[irq];
+    irq_eoi(irq);
+    if (e != NULL && irq_waiting[irq]) {
+        irq_waiting[irq] = 0;
+        e->env_tf.tf_regs.reg_eax = 0;
+        env_set_status(e, ENV_RUNNABLE);
+    } else if (e != NULL && e->env_ipc_recving && e->env_status == ENV_NOT_RUNNABLE) {
+        irq_recv(e, irq);
+        e->env_tf.tf_regs.reg_eax = 0;
+        env_set_status(e, ENV_RUNNABLE);
+    } else
+        irq_pending[irq] = 1;
+}
+
+//
+// Called from trap_dispatch for any other device IRQ: one a PCI device
+// drives, for a user-level driver.  PCI interrupts are level-triggered
+// and the line stays up until the driver has told its device, so the
+// IRQ is masked until the owner next calls sys_irq_listen or
+// sys_irq_wait.  Returns 0 if nobody listens for irq.
+//
+bool
+irq_signal_pci(int irq)
+{
+    if (irq_owner[irq] == NULL)
+        return 0;
+    irq_set_masked(irq, 1);
+    irq_signal(irq);
+    return 1;
+}
+
+//
+// Envs blocked in sys_addr_wait, hashed by the physical page of the word
+// they wait on, oldest first.  An env is in a bucket iff its env_wait_pa
+// is nonzero.
+#define ADDR_WAIT_HASH	64
+#define ADDR_WAIT_BUCKET(pa)	(&addr_waitq[((pa) >> PGSHIFT) % ADDR_WAIT_HASH])
+
+TAILQ_HEAD(Env_waitq, Env);
+static struct Env_waitq addr_waitq[ADDR_WAIT_HASH];
+
+void
+addr_wait_init(void)
+{
+    int i;
+    for (i = 0; i < ADDR_WAIT_HASH; i++)
+        TAILQ_INIT(&addr_waitq[i]);
+}
+
+// Called when 'e' is freed: stop waiting to send, in sys_addr_wait,
+// sys_event_wait or for console input, stop its timer, give up its IRQs, and fail the sends of everyone waiting on e with -E_BAD_ENV.
+//
+void
+ipc_cancel(struct Env *e)
+{
+    struct Env *s;
+    int i;
+    if (e->env_ipc_send_to != 0) {
+        struct Env *dst = &envs[ENVX(e->env_ipc_send_to)];
+        TAILQ_REMOVE(&dst->env_ipc_senders, e, env_ipc_send_link);
+        e->env_ipc_send_to = 0;
+    }
+    while ((s = TAILQ_FIRST(&e->env_ipc_senders)) != NULL)
+        ipc_send_done(s, -E_BAD_ENV);
+    ipcstat_wait(e, 0);
+    env_undonate(e);
+    spin_lock(&addrwait_lock);
+    if (e->env_wait_pa != 0) {
+        TAILQ_REMOVE(ADDR_WAIT_BUCKET(e->env_wait_pa), e, env_wait_link);
+        pa2page(e->env_wait_pa)->pp_waiters--;
+        e->env_wait_pa = 0;
+    }
+    if (e->env_event != NULL)
+        event_unwatch(e);
+    spin_unlock(&addrwait_lock);
+    if (e->env_cons_waiting) {
+        TAILQ_REMOVE(&cons_waiters, e, env_cons_link);
+        e->env_cons_waiting = 0;
+    }
+    ktimer_cancel(e);
+    for (i = 0; i < MAX_IRQS; i++)
+        if (irq_owner[i] == e) {
+            irq_owner[i] = NULL;
+            irq_waiting[i] = 0;
+            irq_pending[i] = 0;
+        }
+    if (net_recver == e)
+        net_recver = NULL;
+}
+
+// sys_ipc_try_send, sending the 'npages' pages from 'srcva', and the
+// words of a short message if 'words' isn't null
+static int
+ipc_try_send(envid_t envid, uint32_t value, void *srcva, size_t npages,
+             unsigned perm, const uint32_t *words)
+{
+    struct Env *env;
+    int err;
+    //	-E_BAD_ENV if environment envid doesn't currently exist.
+    err = envid2env(envid, &env, 0);
+    if (err < 0)
+        return err;
+    //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
+    //		or another environment managed to send first.
+    if (env->env_ipc_recving != 1 || env->env_ipc_from != 0)
+        return -E_IPC_NOT_RECV;
+    err = ipc_deliver(curenv, env, value, srcva, npages, perm, words);
+    if (err < 0)
+        return err;
+    curenv->env_ipc_handoff = env->env_id;
+
+    return 0;
+}
+
+// Try to send 'value' to the target env 'envid'.
+// If va != 0, then also send page currently mapped at 'va',
+// so that receiver gets a duplicate mapping of the same page.
+//
+// The send fails with a return value of -E_IPC_NOT_RECV if the
+// target has not requested IPC with sys_ipc_recv.
+//
+// Otherwise, the send succeeds, and the target's ipc fields are
+// updated as follows:
+//    env_ipc_recving is set to 0 to block future sends;
+//    env_ipc_from is set to the sending envid;
+//    env_ipc_value is set to the 'value' parameter;
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+// The target environment is marked runnable again, returning 0
+// from the paused ipc_recv system call.
+//
+// If the sender sends a page but the receiver isn't asking for one,
+// then no page mapping is transferred, but no error occurs.
+// The ipc doesn't happen unless no errors occur.
 //
 // Returns 0 on success where no page mapping occurs,
 // 1 on success where a page mapping occurs, and < 0 on error.
@@ -362,51 +1294,66 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
+    int err = ipc_try_send(envid, value, srcva, 1, perm, NULL);
+    if (err == -E_IPC_NOT_RECV)
+        ipcstat_retry(curenv, envid);
+    trace(TRACE_IPC_TRY, envid, err);
+    return err;
+}
+
+// Like sys_ipc_try_send, but if envid isn't receiving yet, block until
+// it is instead of failing.  Senders blocked on the same env are served
+// in the order they arrived, one per sys_ipc_recv.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send except -E_IPC_NOT_RECV; if envid exits while we
+// wait, -E_BAD_ENV.
+static int
+ipc_send(envid_t envid, uint32_t value, void *srcva, size_t npages,
+         unsigned perm, const uint32_t *words)
+{
     struct Env *env;
-    int err;
-    pte_t *pte;
     struct Page *page;
-    //	-E_BAD_ENV if environment envid doesn't currently exist.
-    err = envid2env(envid, &env, 0);
+    int err;
+    err = ipc_try_send(envid, value, srcva, npages, perm, words);
+    if (err != -E_IPC_NOT_RECV)
+        return err;
+    envid2env(envid, &env, 0);
+    if (env == curenv)
+        return -E_INVAL;
+    // Fail bad pages now rather than when envid gets round to us
+    err = ipc_check_page(curenv, srcva, perm, &page);
     if (err < 0)
         return err;
-    //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-    //		or another environment managed to send first.
-    if (env->env_ipc_recving != 1 || env->env_ipc_from != 0)
-        return -E_IPC_NOT_RECV;
-    if (srcva < (void *)UTOP) {
-        err = -E_INVAL;
-        if (ROUNDDOWN(srcva, PGSIZE) != srcva) 
-            return err;
-        if ((perm & PTE_U) == 0 && (perm & PTE_P) == 0)
-            return err;
-        if ((perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) != 0)
-            return err;
-        page = page_lookup(curenv->env_pgdir, srcva, &pte);
-        if (page == NULL) 
-            return err;
-        if ((perm & PTE_W) != 0 && (*pte & PTE_W) == 0)
-            return err;
-        //if (env->env_ipc_dstva < (void *)UTOP) {
-        if (env->env_ipc_dstva != 0) {
-            err = page_insert(env->env_pgdir, page, env->env_ipc_dstva, perm);
-            if (err < 0)
-                return err;
-            else
-                env->env_ipc_perm = perm;
-        }
-    }
-    /*cprintf("sys_ipc_try_send: to env 0x%x perm 0x%x srcva 0x%x dstva 0x%x\n",  env, env->env_ipc_perm, srcva, env->env_ipc_dstva);*/
-    env->env_ipc_recving = 0;
-    env->env_ipc_from = curenv->env_id;
-    env->env_ipc_value = value;
-    
-    env->env_status = ENV_RUNNABLE;
-    env->env_tf.tf_regs.reg_eax = 0;
-
+    ipc_send_wait(env, value, srcva, npages, perm, words, 0);
     return 0;
 }
 
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    return ipc_send(envid, value, srcva, 1, perm, NULL);
+}
+
+// Like sys_ipc_send, but send the 'npages' pages from 'srcva', all with
+// 'perm', in one rendezvous: the receiver gets as many as fit the window
+// it gave sys_ipc_recv_range, from the start, and finds how many in
+// env_ipc_npages.  The pages are looked up when they're sent, so they
+// must stay mapped until then; the first one is checked now.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of sys_ipc_send,
+// plus:
+//	-E_INVAL if srcva < UTOP and npages is 0 or the range runs past
+//		UTOP, or a page the receiver would get isn't mapped.
+static int
+sys_ipc_send_range(envid_t envid, uint32_t value, void *srcva, size_t npages, unsigned perm)
+{
+    if (srcva < (void *)UTOP
+        && (npages == 0 || npages > ((uintptr_t)UTOP - (uintptr_t)srcva) / PGSIZE))
+        return -E_INVAL;
+    return ipc_send(envid, value, srcva, npages, perm, NULL);
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -414,26 +1361,863 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If some env is already blocked in sys_ipc_send or sys_ipc_call to us,
+// take the first one's message instead and return at once.  A pending
+// interrupt of a device IRQ we own (see sys_irq_listen) goes before
+// either.
+//
+// If we are blocking right after waking someone with a send (a call or a
+// reply), switch straight to that env on the rest of our time slice
+// rather than waiting for the scheduler to get round to it -- unless
+// something of a higher class is runnable.
+//
+// Pages sent with sys_ipc_send_range map at successive pages from
+// dstva, as many as 'npages' of them.
+//
+// If 'ticks' isn't 0 and nothing has come for us in that many clock
+// ticks, stop receiving and fail with -E_TIMEOUT.  With IPC_NONBLOCK in
+// 'flags', fail so at once if there is nothing to take: a server can
+// poll for requests between other work.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP and npages is 0 or the window runs past UTOP.
+//	-E_INVAL if flags has bits other than IPC_NONBLOCK.
+//	-E_TIMEOUT if the timeout ran out first, or nothing was waiting.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv_range(void *dstva, size_t npages, uint32_t ticks, int flags)
 {
 	// LAB 4: Your code here.
+    struct Env *s;
+    int err, irq;
     if (dstva < (void *)UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva) {
         return -E_INVAL;
     }
+    if (dstva < (void *)UTOP
+        && (npages == 0 || npages > ((uintptr_t)UTOP - (uintptr_t)dstva) / PGSIZE))
+        return -E_INVAL;
+    if ((flags & ~IPC_NONBLOCK) != 0)
+        return -E_INVAL;
+    trace(TRACE_IPC_RECV, (uint32_t) dstva, 0);
     curenv->env_ipc_recving = 1;
     curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
+    curenv->env_ipc_dstnpages = npages;
     curenv->env_ipc_from = 0;
+    ipcstat_wait(curenv, 0);
+
+    // Our device's interrupts come first
+    if ((irq = irq_take_pending(curenv)) >= 0) {
+        irq_recv(curenv, irq);
+        curenv->env_ipc_handoff = 0;
+        return 0;
+    }
+    while ((s = TAILQ_FIRST(&curenv->env_ipc_senders)) != NULL) {
+        err = ipc_deliver(s, curenv, s->env_ipc_send_value, s->env_ipc_send_srcva,
+                          s->env_ipc_send_npages, s->env_ipc_send_perm,
+                          s->env_ipc_send_short ? s->env_ipc_send_words : NULL);
+        ipc_send_done(s, err);
+        if (err == 0) {
+            curenv->env_ipc_handoff = 0;
+            return 0;
+        }
+    }
+    if (flags & IPC_NONBLOCK) {
+        curenv->env_ipc_recving = 0;
+        return -E_TIMEOUT;
+    }
+    if (ticks != 0)
+        ktimer_arm(curenv, ticks);
+    ipcstat_wait(curenv, 1);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+
+    if (curenv->env_ipc_handoff != 0) {
+        struct Env *e;
+        envid_t to = curenv->env_ipc_handoff;
+        curenv->env_ipc_handoff = 0;
+        if (envid2env(to, &e, 0) == 0 && e->env_status == ENV_RUNNABLE
+            && e->env_cpunum < 0
+            && (e->env_affinity < 0 || e->env_affinity == cpunum())
+            && e->env_ipc_from == curenv->env_id && !sched_preempt_pending(e)) {
+            e->env_ticks = curenv->env_ticks > 0 ? curenv->env_ticks : e->env_quantum;
+            curenv->env_ticks = 0;
+            env_run(e);
+        }
+    }
 
     /*cprintf("sys_ipc_recv: env 0x%x perm 0x%x envid 0x%x dstva 0x%x\n", curenv, curenv->env_ipc_perm, curenv->env_id, dstva);*/
     sched_yield();
 }
 
+// Receive as sys_ipc_recv_range does, at most a page, and waiting as
+// long as it takes.
+static int
+sys_ipc_recv(void *dstva)
+{
+    return sys_ipc_recv_range(dstva, 1, 0, 0);
+}
+
+// Send to 'envid' as sys_ipc_send does, then block receiving at
+// 'dstva' as sys_ipc_recv does, all in one trap: the client half of a
+// request/response exchange.  Since we don't leave the kernel in
+// between, the reply can't arrive before we are ready for it, and the
+// direct handoff in sys_ipc_recv runs the server at once.  If the
+// server isn't receiving yet we wait our turn in its send queue.
+// Either way the server runs in our class, if that's higher than its
+// own, until it answers (env_donate).
+//
+// This function only returns on error, but the system call will eventually
+// return 0 on success.
+// Return < 0 on error.  Errors are those of sys_ipc_send and
+// sys_ipc_recv; nothing is sent if dstva is bad.
+static int
+ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+         const uint32_t *words, void *dstva)
+{
+    struct Env *env;
+    struct Page *page;
+    int err;
+    if (dstva < (void *)UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva)
+        return -E_INVAL;
+    err = ipc_try_send(envid, value, srcva, 1, perm, words);
+    if (err == -E_IPC_NOT_RECV) {
+        envid2env(envid, &env, 0);
+        if (env == curenv)
+            return -E_INVAL;
+        err = ipc_check_page(curenv, srcva, perm, &page);
+        if (err < 0)
+            return err;
+        curenv->env_ipc_dstva = dstva;
+        curenv->env_ipc_dstnpages = 1;
+        env_donate(curenv, env);
+        ipc_send_wait(env, value, srcva, 1, perm, words, 1);
+    }
+    if (err < 0)
+        return err;
+    if (envid2env(envid, &env, 0) == 0)
+        env_donate(curenv, env);
+    return sys_ipc_recv(dstva);
+}
+
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+    return ipc_call(envid, value, srcva, perm, NULL, dstva);
+}
+
+// Short messages: 'value' and the IPC_NWORDS words w0..w2, all passed in
+// registers and no page, for requests with a few small arguments.  The
+// receiver finds the words in env_ipc_words, as it finds the value in
+// env_ipc_value; any other message leaves them zero.  Otherwise these
+// are sys_ipc_send and sys_ipc_call with no page.
+static int
+sys_ipc_send_short(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+    uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+    return ipc_send(envid, value, (void *)UTOP, 0, 0, words);
+}
+
+// The reply is received with no page.
+static int
+sys_ipc_call_short(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+    uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+    return ipc_call(envid, value, (void *)UTOP, 0, words, (void *)UTOP);
+}
+
+// The server half: reply to 'envid', which should be blocked in
+// sys_ipc_call, then block for the next request at 'dstva'.  Pass
+// envid 0 to skip the reply (the first time round the loop).
+//
+// A client that has gone away or isn't waiting for the reply is not the
+// server's problem, so -E_BAD_ENV and -E_IPC_NOT_RECV from the send are
+// ignored and we wait as usual.
+//
+// This function only returns on error, but the system call will eventually
+// return 0 on success.
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	Any other error from sys_ipc_try_send; then we don't block.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+    int err;
+    if (dstva < (void *)UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva)
+        return -E_INVAL;
+    if (envid != 0) {
+        err = sys_ipc_try_send(envid, value, srcva, perm);
+        if (err < 0 && err != -E_BAD_ENV && err != -E_IPC_NOT_RECV)
+            return err;
+    }
+    return sys_ipc_recv(dstva);
+}
+
+// Guards addr_waitq, env_wait_pa and pp_waiters.  Unmapping a page,
+// which the page system calls do without the kernel lock, wakes its
+// waiters.
+struct spinlock addrwait_lock = SPINLOCK_INIT(addrwait_lock);
+
+// Make 'e', blocked in sys_addr_wait, runnable; the call returns 0.
+static void
+addr_wait_done(struct Env *e)
+{
+    TAILQ_REMOVE(ADDR_WAIT_BUCKET(e->env_wait_pa), e, env_wait_link);
+    pa2page(e->env_wait_pa)->pp_waiters--;
+    e->env_wait_pa = 0;
+    e->env_tf.tf_regs.reg_eax = 0;
+    env_set_status(e, ENV_RUNNABLE);
+}
+
+//
+// Wake everyone waiting on a word in page 'pp'.  page_decref calls this,
+// so that when an env dies or unmaps a page it shares, its peers sleeping
+// on the page get to notice.
+//
+void
+addr_wake_page(struct Page *pp)
+{
+    struct Env *e, *next;
+    physaddr_t pa = page2pa(pp);
+    spin_lock(&addrwait_lock);
+    for (e = TAILQ_FIRST(ADDR_WAIT_BUCKET(pa)); e != NULL; e = next) {
+        next = TAILQ_NEXT(e, env_wait_link);
+        if (ROUNDDOWN(e->env_wait_pa, PGSIZE) == pa)
+            addr_wait_done(e);
+    }
+    event_wake_addr(pa, ~(PGSIZE - 1));
+    spin_unlock(&addrwait_lock);
+}
+
+// Find the physical address behind the user word at 'va' for
+// sys_addr_wait and sys_addr_wake, with curenv locked.
+static int
+addr_lookup(const void *va, physaddr_t *pa)
+{
+    struct Page *pp;
+    if ((uintptr_t)va % sizeof(uint32_t) != 0)
+        return -E_INVAL;
+    if (user_mem_check(curenv, va, sizeof(uint32_t), PTE_U | PTE_P) < 0)
+        return -E_INVAL;
+    pp = page_lookup(curenv->env_pgdir, (void *)va, NULL);
+    *pa = page2pa(pp) + PGOFF(va);
+    return 0;
+}
+
+// Sleep until someone calls sys_addr_wake on the 32-bit word at 'va',
+// provided the word still holds 'val'; the check and going to sleep are
+// atomic.  Other envs see the same word through a shared mapping of its
+// page.  This is the slow path for user-level synchronization like the
+// channel rings in lib/chan.c and the mutexes in lib/sync.c, which only
+// trap when they have to wait: a futex wait, keyed by physical address.
+//
+// Wakeups may be spurious: the page being unmapped by anyone wakes all
+// its waiters, so callers must re-check their condition.
+//
+// Returns 0 once woken or if *va != val, < 0 on error.  Errors are:
+//	-E_INVAL if va is not word-aligned or not readable by us.
+static int
+sys_addr_wait(const volatile uint32_t *va, uint32_t val)
+{
+    physaddr_t pa;
+    int err;
+    env_lock(curenv);
+    err = addr_lookup((const void *)va, &pa);
+    if (err < 0 || *va != val) {
+        env_unlock(curenv);
+        return err;
+    }
+    spin_lock(&addrwait_lock);
+    curenv->env_wait_pa = pa;
+    TAILQ_INSERT_TAIL(ADDR_WAIT_BUCKET(pa), curenv, env_wait_link);
+    pa2page(pa)->pp_waiters++;
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    spin_unlock(&addrwait_lock);
+    env_unlock(curenv);
+    sched_yield();
+}
+
+// Wake up to 'max' envs sleeping in sys_addr_wait on the word at 'va',
+// those that have slept longest first; ADDR_WAKE_ALL wakes every one.
+// A lock's release wakes one waiter, so that the rest don't all wake to
+// fight over it.
+//
+// Returns the number of envs woken, < 0 on error.  Errors are:
+//	-E_INVAL if va is not word-aligned or not readable by us.
+static int
+sys_addr_wake(const volatile uint32_t *va, uint32_t max)
+{
+    struct Env *e, *next;
+    physaddr_t pa;
+    int err, n = 0;
+    env_lock(curenv);
+    err = addr_lookup((const void *)va, &pa);
+    env_unlock(curenv);
+    if (err < 0)
+        return err;
+    spin_lock(&addrwait_lock);
+    for (e = TAILQ_FIRST(ADDR_WAIT_BUCKET(pa)); e != NULL && n < max; e = next) {
+        next = TAILQ_NEXT(e, env_wait_link);
+        if (e->env_wait_pa == pa) {
+            addr_wait_done(e);
+            n++;
+        }
+    }
+    // Those watching it in sys_event_wait only look, so they don't count
+    event_wake_addr(pa, ~0);
+    spin_unlock(&addrwait_lock);
+    return n;
+}
+
+//
+// sys_event_wait: sleep till any of several things happens -- a message
+// comes, console input comes, one of a set of shared words moves -- for
+// event loops that serve pipes, the console and IPC all at once (poll()
+// in lib/fd.c).  Like sys_addr_wait's sleepers, its sleepers are woken
+// by sys_addr_wake, or the unmapping of a watched word's page, but they
+// don't count among the woken, so a lock's release still wakes one of
+// its own waiters.
+//
+// A sleeper sleeps on its kernel stack (kern/kstack.c), where its
+// Event_wait is, and env_event points to it.  The sleepers are on
+// event_waiters, oldest first; that and their Event_waits are guarded by
+// addrwait_lock.  Once woken, a sleeper finds out for itself what's
+// ready, and leaves the list.
+//
+static TAILQ_HEAD(Env_eventq, Env) event_waiters = TAILQ_HEAD_INITIALIZER(event_waiters);
+
+struct Event_wait {
+    uint32_t ev_events;		// EVENT_IPC, EVENT_CONS to wait for
+    uint32_t ev_ticks;		// timeout, or 0
+    int ev_nwatch;
+    struct EventWatch ev_watch[EVENT_NWATCH];
+    physaddr_t ev_pa[EVENT_NWATCH]; // where the words are, while asleep
+    uint32_t ev_fired;		// EVENT_* that have woken us
+};
+
+// Wake e, asleep in sys_event_wait, for 'ev' (EVENT_*).  addrwait_lock
+// is held.
+static void
+event_signal(struct Env *e, uint32_t ev)
+{
+    e->env_event->ev_fired |= ev;
+    if (e->env_status == ENV_NOT_RUNNABLE)
+        env_set_status(e, ENV_RUNNABLE);
+}
+
+// Wake everyone in sys_event_wait for 'ev'.
+static void
+event_wake_all(uint32_t ev)
+{
+    struct Env *e;
+    spin_lock(&addrwait_lock);
+    TAILQ_FOREACH(e, &event_waiters, env_event_link)
+        if (e->env_event->ev_events & ev)
+            event_signal(e, ev);
+    spin_unlock(&addrwait_lock);
+}
+
+// Wake everyone in sys_event_wait watching a word at pa, as far as the
+// bits of 'mask' go: a word, or with the page offset masked, a page.
+// addrwait_lock is held.
+static void
+event_wake_addr(physaddr_t pa, physaddr_t mask)
+{
+    struct Env *e;
+    int i;
+    TAILQ_FOREACH(e, &event_waiters, env_event_link)
+        for (i = 0; i < e->env_event->ev_nwatch; i++)
+            if ((e->env_event->ev_pa[i] & mask) == pa) {
+                event_signal(e, EVENT_ADDR);
+                break;
+            }
+}
+
+// Take e off event_waiters.  addrwait_lock is held.
+static void
+event_unwatch(struct Env *e)
+{
+    struct Event_wait *ev = e->env_event;
+    int i;
+    TAILQ_REMOVE(&event_waiters, e, env_event_link);
+    for (i = 0; i < ev->ev_nwatch; i++)
+        pa2page(ev->ev_pa[i])->pp_waiters--;
+    e->env_event = NULL;
+}
+
+// Which of ev's events are ready: EVENT_IPC if a sender waits for us,
+// EVENT_CONS if there's console input, EVENT_ADDR if a watched word
+// has moved from its value, or can't be read any more.  The words'
+// physical addresses go in ev_pa[].  curenv is locked.
+static uint32_t
+event_ready(struct Event_wait *ev)
+{
+    const struct EventWatch *w;
+    uint32_t ready = 0;
+    int i;
+    if ((ev->ev_events & EVENT_IPC) && !TAILQ_EMPTY(&curenv->env_ipc_senders))
+        ready |= EVENT_IPC;
+    if ((ev->ev_events & EVENT_CONS) && cons_pending())
+        ready |= EVENT_CONS;
+    for (i = 0, w = ev->ev_watch; i < ev->ev_nwatch; i++, w++)
+        if (addr_lookup((const void *)w->ew_addr, &ev->ev_pa[i]) < 0
+            || *w->ew_addr != w->ew_val)
+            ready |= EVENT_ADDR;
+    return ready;
+}
+
+// sys_event_wait's sleep, on curenv's kernel stack.
+static int32_t
+event_wait_run(void *arg)
+{
+    struct Event_wait ev = *(struct Event_wait *)arg;
+    struct Env *e = curenv;
+    uint32_t ready;
+    int i;
+
+    // Checking and going to sleep are atomic, as in sys_addr_wait
+    env_lock(e);
+    if ((ready = event_ready(&ev)) != 0) {
+        env_unlock(e);
+        return ready;
+    }
+    spin_lock(&addrwait_lock);
+    ev.ev_fired = 0;
+    for (i = 0; i < ev.ev_nwatch; i++)
+        pa2page(ev.ev_pa[i])->pp_waiters++;
+    e->env_event = &ev;
+    TAILQ_INSERT_TAIL(&event_waiters, e, env_event_link);
+    env_set_status(e, ENV_NOT_RUNNABLE);
+    spin_unlock(&addrwait_lock);
+    env_unlock(e);
+    if (ev.ev_ticks != 0)
+        ktimer_arm(e, ev.ev_ticks);
+    kstack_yield();
+
+    ktimer_cancel(e);
+    spin_lock(&addrwait_lock);
+    ready = ev.ev_fired;
+    event_unwatch(e);
+    spin_unlock(&addrwait_lock);
+    env_lock(e);
+    ready |= event_ready(&ev);
+    env_unlock(e);
+    return ready;
+}
+
+// Sleep until one of 'events' -- EVENT_IPC, EVENT_CONS -- is ready, or
+// one of the 'nwatch' words in watch[] no longer holds its value or is
+// woken by sys_addr_wake, or 'ticks' ticks pass, if ticks isn't 0.  With
+// EVENT_NONBLOCK, don't sleep.  A watched word that is woken, or whose
+// page is unmapped by anyone, wakes us whatever it holds, so callers
+// must re-check their words.
+//
+// Returns the EVENT_* that are ready or woke us (EVENT_TIMEOUT if the
+// time ran out), 0 if none is with EVENT_NONBLOCK, < 0 on error.  Errors
+// are:
+//	-E_INVAL if 'events' has other bits, or nwatch isn't 0 to
+//		EVENT_NWATCH, or watch[] or a word in it isn't word-aligned
+//		and readable by us.
+static int
+sys_event_wait(uint32_t events, const struct EventWatch *watch, int nwatch, uint32_t ticks)
+{
+    struct Event_wait ev;
+    uint32_t ready;
+    int i, err = 0;
+    if ((events & ~(EVENT_IPC | EVENT_CONS | EVENT_NONBLOCK)) != 0
+        || nwatch < 0 || nwatch > EVENT_NWATCH
+        || user_mem_check(curenv, watch, nwatch * sizeof(*watch), PTE_U | PTE_P) < 0)
+        return -E_INVAL;
+    ev.ev_events = events & ~EVENT_NONBLOCK;
+    ev.ev_ticks = ticks;
+    ev.ev_nwatch = nwatch;
+    memmove(ev.ev_watch, watch, nwatch * sizeof(*watch));
+    env_lock(curenv);
+    for (i = 0; i < nwatch && err == 0; i++)
+        err = addr_lookup((const void *)ev.ev_watch[i].ew_addr, &ev.ev_pa[i]);
+    ready = err < 0 ? 0 : event_ready(&ev);
+    env_unlock(curenv);
+    if (err < 0)
+        return err;
+    if (ready != 0 || (events & EVENT_NONBLOCK))
+        return ready;
+    kstack_run(event_wait_run, &ev);
+}
+
+// Make curenv the owner of device interrupt 'irq' and unmask it, so a
+// user-level driver like the file server's IDE code can sleep through
+// transfers instead of polling the device.  From now on the IRQ wakes
+// curenv from sys_irq_wait, or, if curenv is blocked receiving instead,
+// arrives as an IPC message from envid 0 with the IRQ number as its
+// value: an event-driven server can wait for requests and for its
+// device at once.  An IRQ that arrives while curenv is doing neither
+// is kept until it next does one or the other.
+//
+// Only envs with I/O privilege may own IRQs, one env per IRQ.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is not a device IRQ, is one the kernel handles
+//		itself, or has another owner.
+//	-E_BAD_ENV if curenv may not do I/O.
+static int
+sys_irq_listen(int irq)
+{
+    if (irq < 0 || irq >= MAX_IRQS || (IRQ_KERNEL & (1 << irq))
+        || (e1000_irq != 0 && irq == e1000_irq))
+        return -E_INVAL;
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    if (irq_owner[irq] != NULL && irq_owner[irq] != curenv)
+        return -E_INVAL;
+    // A PCI IRQ that came in is masked until its owner listens again
+    if ((irq_mask_8259A & (1 << irq)) && irq_owner[irq] == curenv)
+        irq_set_masked(irq, 0);
+    else if (irq_mask_8259A & (1 << irq))
+        irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+    irq_owner[irq] = curenv;
+    return 0;
+}
+
+// Block until device interrupt 'irq' arrives, taking ownership of it
+// first as sys_irq_listen does if need be.  An IRQ that arrived since
+// we last looked returns at once.  The driver must still check its
+// device's status afterwards, since that IRQ may be left over from an
+// earlier command.
+//
+// Returns 0 once the IRQ has arrived, < 0 on error.  Errors are those
+// of sys_irq_listen.
+static int
+sys_irq_wait(int irq)
+{
+    int err;
+    if ((err = sys_irq_listen(irq)) < 0)
+        return err;
+    if (irq_pending[irq]) {
+        irq_pending[irq] = 0;
+        return 0;
+    }
+    irq_waiting[irq] = 1;
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_yield();
+}
+
+// Check the arguments of sys_net_*: npkts pages from va, for an env
+// that may do I/O, with a card to talk to.
+static int
+net_check(void *va, int npkts)
+{
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    if (e1000_irq == 0 || npkts <= 0 || npkts > NET_BATCH)
+        return -E_INVAL;
+    if (PGOFF(va) != 0 || (uintptr_t)va >= UTOP
+        || npkts > (UTOP - (uintptr_t)va) / PGSIZE)
+        return -E_INVAL;
+    return 0;
+}
+
+// Send the npkts pages from va, each holding a struct NetPkt, in one
+// go.  The pages are the card's now: they are unmapped from us, and
+// the card sends straight from them.  As many go as there's room for
+// in the transmit ring.
+//
+// Returns the number of packets queued, 0 if the ring is full, or < 0
+// on error.  Errors are:
+//	-E_BAD_ENV if curenv may not do I/O.
+//	-E_INVAL if there's no network card, npkts isn't between 1 and
+//		NET_BATCH, va isn't page-aligned or the pages run past
+//		UTOP, or a page isn't mapped or its np_len is not between
+//		1 and NET_MAXPKT.
+static int
+sys_net_try_send(void *va, int npkts)
+{
+    struct Page *pps[NET_BATCH];
+    struct NetPkt *pkt;
+    int i, err;
+    if ((err = net_check(va, npkts)) < 0)
+        return err;
+    env_lock(curenv);
+    for (i = 0; i < npkts; i++) {
+        pps[i] = page_lookup(curenv->env_pgdir, va + i * PGSIZE, NULL);
+        if (pps[i] == NULL) {
+            env_unlock(curenv);
+            return -E_INVAL;
+        }
+        pkt = page2kva(pps[i]);
+        if (pkt->np_len <= 0 || pkt->np_len > NET_MAXPKT) {
+            env_unlock(curenv);
+            return -E_INVAL;
+        }
+    }
+    npkts = e1000_tx(pps, npkts);
+    for (i = 0; i < npkts; i++)
+        page_remove(curenv->env_pgdir, va + i * PGSIZE);
+    env_unlock(curenv);
+    return npkts;
+}
+
+// Map up to npkts received packets into e, a page each from va.
+// Returns how many, or -E_NO_MEM if even the first couldn't be mapped.
+static int
+net_recv_into(struct Env *e, uintptr_t va, int npkts)
+{
+    struct Page *pps[NET_BATCH];
+    int i, j, n;
+    n = e1000_rx(pps, npkts);
+    env_lock(e);
+    for (i = 0; i < n; i++) {
+        if (page_insert(e->env_pgdir, pps[i], (void *)(va + i * PGSIZE),
+                        PTE_P | PTE_U | PTE_W) < 0)
+            break;
+        page_decref(pps[i]);
+    }
+    env_unlock(e);
+    // The packets we had no page tables for are lost
+    for (j = i; j < n; j++)
+        page_decref(pps[j]);
+    return i == 0 && n > 0 ? -E_NO_MEM : i;
+}
+
+// Receive up to npkts packets, mapping them a page each, as struct
+// NetPkt, from va; whatever was mapped there is unmapped.  Blocks until
+// at least one has come in.
+//
+// Returns the number of packets received, or < 0 on error.  Errors are
+// those of sys_net_try_send, apart from the ones about the pages, plus:
+//	-E_INVAL if another env is blocked in sys_net_recv.
+//	-E_NO_MEM if there was no memory to map a packet.
+static int
+sys_net_recv(void *va, int npkts)
+{
+    int r;
+    if ((r = net_check(va, npkts)) < 0)
+        return r;
+    if (net_recver != NULL && net_recver != curenv)
+        return -E_INVAL;
+    if ((r = net_recv_into(curenv, (uintptr_t)va, npkts)) != 0)
+        return r;
+    net_recver = curenv;
+    net_recv_va = (uintptr_t)va;
+    net_recv_n = npkts;
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_yield();
+}
+
+// Copy the card's Ethernet address, 6 bytes, to mac.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if curenv may not do I/O.
+//	-E_INVAL if there's no network card.
+static int
+sys_net_hwaddr(uint8_t *mac)
+{
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    if (e1000_irq == 0)
+        return -E_INVAL;
+    user_mem_assert(curenv, mac, sizeof(e1000_mac), PTE_U | PTE_W);
+    memmove(mac, e1000_mac, sizeof(e1000_mac));
+    return 0;
+}
+
+// May curenv reach the AHCI register at byte offset 'off'?
+static int
+ahci_check(uint32_t off)
+{
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    if (ahci_regs == NULL || off % 4 != 0 || off >= ahci_regs_size)
+        return -E_INVAL;
+    return 0;
+}
+
+// Read the AHCI controller's register at byte offset 'off' in its ABAR
+// into *val, for the file server's driver, which can't map the
+// registers itself.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if curenv may not do I/O.
+//	-E_INVAL if there's no controller, or off isn't the aligned
+//		offset of a register.
+static int
+sys_ahci_read(uint32_t off, uint32_t *val)
+{
+    int err;
+    if ((err = ahci_check(off)) < 0)
+        return err;
+    user_mem_assert(curenv, val, sizeof(*val), PTE_U | PTE_W);
+    *val = ahci_regs[off / 4];
+    return 0;
+}
+
+// Write 'val' to the AHCI controller's register at byte offset 'off'.
+// Errors are those of sys_ahci_read.
+static int
+sys_ahci_write(uint32_t off, uint32_t val)
+{
+    int err;
+    if ((err = ahci_check(off)) < 0)
+        return err;
+    ahci_regs[off / 4] = val;
+    return 0;
+}
+
+//
+// Called from e1000_intr when packets have come in: hand them to the
+// env blocked in sys_net_recv, if there is one.
+//
+void
+net_signal(void)
+{
+    struct Env *e = net_recver;
+    int r;
+    if (e == NULL || (r = net_recv_into(e, net_recv_va, net_recv_n)) == 0)
+        return;
+    net_recver = NULL;
+    e->env_tf.tf_regs.reg_eax = r;
+    env_set_status(e, ENV_RUNNABLE);
+}
+
+// sys_page_map_range as its syscall gets it: perm rides in the low bits
+// of the page-aligned dstva.
+static int
+sys_page_map_range_packed(envid_t srcenvid, void *srcva, envid_t dstenvid,
+                          uintptr_t dstva_perm, size_t npages)
+{
+    return sys_page_map_range(srcenvid, srcva, dstenvid,
+        (void *)ROUNDDOWN(dstva_perm, PGSIZE), npages, (int)PGOFF(dstva_perm));
+}
+
+// Every sys_* takes at most five 32-bit arguments, left to right, so
+// each is called as if it took all five; the ones it doesn't take are
+// the caller's to pop and do no harm.
+typedef int32_t (*syscall_fn)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+struct Syscall {
+    syscall_fn sc_fn;
+    int sc_nargs;
+    const char *sc_name;
+    bool sc_nolock;
+    bool sc_batch;
+    uint8_t sc_envarg;		// 1 or 3: the argument naming the env whose
+				// mappings a nolock call changes, if not curenv
+};
+
+#define SYSCALL(name, fn, nargs) \
+    [SYS_##name] = { (syscall_fn)(fn), (nargs), #name, 0, 0, 0 }
+
+// A call that trap() may run without the kernel lock: it touches only
+// curenv's own fields and what the finer locks guard (see spinlock.h).
+// It may not block or switch envs, so it may be batched too.  The
+// mappings it changes are curenv's, or those of the env its argument
+// 'envarg' names.
+#define SYSCALL_NOLOCK(name, fn, nargs, envarg) \
+    [SYS_##name] = { (syscall_fn)(fn), (nargs), #name, 1, 1, (envarg) }
+
+// A call that wants the kernel lock but always returns to its caller,
+// without blocking or switching envs, so that sys_batch may run it.
+#define SYSCALL_BATCH(name, fn, nargs) \
+    [SYS_##name] = { (syscall_fn)(fn), (nargs), #name, 0, 1, 0 }
+
+static int32_t sys_batch(struct SyscallReq *reqs, uint32_t n);
+
+static const struct Syscall syscalls[NSYSCALLS] = {
+    SYSCALL(cputs, sys_cputs, 2),
+    SYSCALL(cgetc, sys_cgetc, 0),
+    SYSCALL_NOLOCK(getenvid, sys_getenvid, 0, 0),
+    SYSCALL(env_destroy, sys_env_destroy, 1),
+    SYSCALL_NOLOCK(page_alloc, sys_page_alloc, 3, 1),
+    SYSCALL_NOLOCK(page_map, sys_page_map, 5, 3),
+    SYSCALL_NOLOCK(page_unmap, sys_page_unmap, 2, 1),
+    SYSCALL(exofork, sys_exofork, 0),
+    SYSCALL_BATCH(env_set_status, sys_env_set_status, 2),
+    SYSCALL_BATCH(env_set_trapframe, sys_env_set_trapframe, 2),
+    SYSCALL_BATCH(env_set_pgfault_upcall, sys_env_set_pgfault_upcall, 2),
+    SYSCALL(yield, sys_yield, 0),
+    SYSCALL(ipc_try_send, sys_ipc_try_send, 4),
+    SYSCALL(ipc_recv, sys_ipc_recv, 1),
+    SYSCALL(ipc_send, sys_ipc_send, 4),
+    SYSCALL(ipc_call, sys_ipc_call, 5),
+    SYSCALL(ipc_reply_wait, sys_ipc_reply_wait, 5),
+    SYSCALL_BATCH(env_set_priority, sys_env_set_priority, 2),
+    SYSCALL(cow_fork, sys_cow_fork, 0),
+    SYSCALL_BATCH(page_map_range, sys_page_map_range_packed, 5),
+    SYSCALL(addr_wait, sys_addr_wait, 2),
+    SYSCALL(addr_wake, sys_addr_wake, 2),
+    SYSCALL(irq_listen, sys_irq_listen, 1),
+    SYSCALL(irq_wait, sys_irq_wait, 1),
+    SYSCALL_BATCH(page_grant, sys_page_grant, 4),
+    SYSCALL(exec, sys_exec, 4),
+    SYSCALL_BATCH(env_set_affinity, sys_env_set_affinity, 2),
+    SYSCALL(cgetc_wait, sys_cgetc_wait, 0),
+    SYSCALL_NOLOCK(page_autogrow, sys_page_autogrow, 2, 0),
+    SYSCALL_NOLOCK(page_cow_reuse, sys_page_cow_reuse, 1, 0),
+    SYSCALL_BATCH(env_set_fault_flags, sys_env_set_fault_flags, 2),
+    SYSCALL_BATCH(env_set_page_quota, sys_env_set_page_quota, 2),
+    SYSCALL(net_try_send, sys_net_try_send, 2),
+    SYSCALL(net_recv, sys_net_recv, 2),
+    SYSCALL(net_hwaddr, sys_net_hwaddr, 1),
+    SYSCALL(sleep, sys_sleep, 1),
+    SYSCALL(ipc_recv_range, sys_ipc_recv_range, 4),
+    SYSCALL(ipc_send_range, sys_ipc_send_range, 5),
+    SYSCALL(ipc_send_short, sys_ipc_send_short, 5),
+    SYSCALL(ipc_call_short, sys_ipc_call_short, 5),
+    SYSCALL(thread_create, sys_thread_create, 3),
+    SYSCALL(batch, sys_batch, 2),
+    SYSCALL_NOLOCK(page_alloc_contig, sys_page_alloc_contig, 3, 0),
+    SYSCALL_BATCH(ahci_read, sys_ahci_read, 2),
+    SYSCALL_BATCH(ahci_write, sys_ahci_write, 2),
+    SYSCALL(event_wait, sys_event_wait, 4),
+    SYSCALL(klog_read, sys_klog_read, 2),
+    SYSCALL_BATCH(env_set_ras, sys_env_set_ras, 3),
+};
+
+struct SyscallStat *sysstat;
+
+// The name of system call 'num', or 0 if there's no such call.
+const char *
+syscall_name(uint32_t num)
+{
+    return num < NSYSCALLS ? syscalls[num].sc_name : 0;
+}
+
+// May system call 'num', with first and third arguments a1 and a3, run
+// without the kernel lock?  Not on an address space that another CPU
+// is running in: code there under the kernel lock reads user memory
+// straight after user_mem_assert (sys_cputs, say), and a page unmapped
+// under it meanwhile would be a kernel page fault, or a stale TLB
+// entry to a page that's been reused.  Those calls take the lock.
+bool
+syscall_nolock(uint32_t num, uint32_t a1, uint32_t a3)
+{
+    const struct Syscall *sc;
+    envid_t envid;
+    struct Env *e;
+    if (num >= NSYSCALLS || !(sc = &syscalls[num])->sc_nolock)
+        return 0;
+    if (env_pgdir_elsewhere(curenv->env_pgdir))
+        return 0;
+    envid = sc->sc_envarg == 1 ? a1 : sc->sc_envarg == 3 ? a3 : 0;
+    return envid == 0 || envid2env(envid, &e, 0) < 0 || !env_pgdir_elsewhere(e->env_pgdir);
+}
+
+// Charge a call of 'cycles' to 'ss'.  The calls that run without the
+// kernel lock may race here on several CPUs; the counts are only
+// statistics, so we let them.
+static void
+sysstat_add(struct SyscallStat *ss, uint64_t cycles)
+{
+    uint32_t b;
+    ss->ss_returns++;
+    ss->ss_cycles += cycles;
+    if (cycles >> SYSSTAT_SHIFT == 0)
+        b = 0;
+    else if (cycles >> 32 != 0)
+        b = SYSSTAT_NHIST - 1;
+    else
+        b = MIN(bsr((uint32_t)cycles) - SYSSTAT_SHIFT + 1, SYSSTAT_NHIST - 1);
+    ss->ss_hist[b]++;
+}
 
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
@@ -443,53 +2227,52 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
 
-    int32_t ret = 0;
-    switch(syscallno) {
-        case SYS_cputs:
-            sys_cputs((const char *)a1, (size_t)a2);
-            break;
-        case SYS_cgetc:
-            ret = sys_cgetc();
-            break;
-        case SYS_getenvid:
-            ret = sys_getenvid();
-            break;
-        case SYS_env_destroy:
-            ret = sys_env_destroy((envid_t)a1);
-            break;
-        case SYS_yield:
-            sys_yield();
-            break;
-        case SYS_exofork:
-            ret = sys_exofork();
-            break;
-        case SYS_env_set_status:
-            ret = sys_env_set_status((envid_t)a1, (int)a2);
-            break;
-        case SYS_env_set_trapframe:
-            ret = sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
-            break;
-        case SYS_page_alloc:
-            ret = sys_page_alloc((envid_t)a1, (void *)a2, (int)a3);
-            break;
-        case SYS_page_map:
-            ret = sys_page_map((envid_t)a1, (void *)a2, (envid_t)a3, (void *)a4, (int)a5);
-            break;
-        case SYS_page_unmap:
-            ret = sys_page_unmap((envid_t)a1, (void *)a2);
-            break;
-        case SYS_env_set_pgfault_upcall:
-            ret = sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
-            break;
-        case SYS_ipc_try_send:
-            ret = sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
-            break;
-        case SYS_ipc_recv:
-            ret = sys_ipc_recv((void *)a1);
-            break;
-        default:
-            ret = -E_INVAL;
-    }
+    struct Env *e = curenv;
+    uint64_t start, cycles;
+    int32_t ret;
+    if (syscallno >= NSYSCALLS || syscalls[syscallno].sc_fn == NULL)
+        return -E_INVAL;
+    sysstat[syscallno].ss_count++;
+    e->env_sc_count[syscallno]++;
+    trace(TRACE_SYSCALL, syscallno, 0);
+    start = read_tsc();
+    ret = syscalls[syscallno].sc_fn(a1, a2, a3, a4, a5);
+    cycles = read_tsc() - start;
+    trace(TRACE_SYSRET, syscallno, ret);
+    sysstat_add(&sysstat[syscallno], cycles);
+    e->env_sc_cycles[syscallno] += cycles;
     return ret;
 }
 
+// Run the 'n' calls at 'reqs' in order, with one trap, each as syscall()
+// would from the registers, leaving each one's result in its sr_ret.
+// Stops after the first that fails, or that leaves us no longer
+// runnable.  A call that may block or switch envs, sys_batch itself
+// among them, fails with -E_INVAL and runs nothing.  A call may unmap
+// the requests themselves, so each is checked as it's read and written.
+// Returns how many calls ran, -E_INVAL if n > SYSBATCH_MAX, or -E_FAULT
+// if the first request isn't ours to write.
+static int32_t
+sys_batch(struct SyscallReq *reqs, uint32_t n)
+{
+    struct SyscallReq rq;
+    uint32_t i;
+    if (n > SYSBATCH_MAX)
+        return -E_INVAL;
+    for (i = 0; i < n; i++) {
+        if (user_mem_check(curenv, &reqs[i], sizeof(reqs[i]), PTE_U | PTE_W) < 0)
+            return i == 0 ? -E_FAULT : i;
+        rq = reqs[i];
+        if (rq.sr_num >= NSYSCALLS || !syscalls[rq.sr_num].sc_batch)
+            rq.sr_ret = -E_INVAL;
+        else
+            rq.sr_ret = syscall(rq.sr_num, rq.sr_args[0], rq.sr_args[1],
+                                rq.sr_args[2], rq.sr_args[3], rq.sr_args[4]);
+        if (user_mem_check(curenv, &reqs[i], sizeof(reqs[i]), PTE_U | PTE_W) < 0)
+            return i + 1;
+        reqs[i].sr_ret = rq.sr_ret;
+        if (rq.sr_ret < 0 || curenv->env_status != ENV_RUNNABLE)
+            return i + 1;
+    }
+    return n;
+}
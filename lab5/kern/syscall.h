@@ -6,6 +6,24 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+struct Page;
+
+void ipc_cancel(struct Env *e);
+void addr_wait_init(void);
+void addr_wake_page(struct Page *pp);
+void irq_signal(int irq);
+bool irq_signal_pci(int irq);
+void cons_signal(void);
+void net_signal(void);
+void timer_signal(struct Env *e);
+// Per-syscall statistics, mapped read-only at USYSSTAT
+extern struct SyscallStat *sysstat;
+
+extern struct spinlock addrwait_lock;
+
+const char *syscall_name(uint32_t num);
+bool syscall_nolock(uint32_t num, uint32_t a1, uint32_t a3);
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
 #endif /* !JOS_KERN_SYSCALL_H */
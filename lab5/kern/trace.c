@@ -0,0 +1,187 @@
+// Event trace.
+//
+// trace() records an event in this CPU's ring, overwriting the oldest,
+// with the time stamp counter and the env running.  Only this CPU
+// writes its ring, with interrupts off as always in the kernel, so it
+// takes no lock; readers at UTRACE may see an event half written.
+//
+// A trace point turned off is a nop, so that tracing costs nothing
+// until the monitor turns it on; trace_enable rewrites each point's nop
+// as a call to trace_thunk, or back.  A point's 5 bytes lie in one
+// aligned 8-byte word, written with one locked cmpxchg8b, so that a
+// CPU running through it meanwhile sees the old instruction or the new,
+// never half of each.
+
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/trace.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+
+struct TraceRing *trace_rings;
+uint32_t trace_mask;
+
+extern const struct Tracepoint __TRACEPOINTS_BEGIN__[], __TRACEPOINTS_END__[];
+
+// What a trace point turned off is: nopl 0(%eax,%eax)
+static const uint8_t trace_nop[5] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+void trace_thunk(void);
+void trace_hit(uintptr_t ret, uint32_t a0, uint32_t a1);
+
+// Called at a trace point turned on, with a0 in %eax and a1 in %edx,
+// none of which it may change but the flags
+asm(".text\n"
+    ".globl trace_thunk\n"
+    "trace_thunk:\n"
+    "	pushl %eax\n"
+    "	pushl %ecx\n"
+    "	pushl %edx\n"
+    "	pushl %edx\n"
+    "	pushl %eax\n"
+    "	pushl 20(%esp)\n"
+    "	call trace_hit\n"
+    "	addl $12, %esp\n"
+    "	popl %edx\n"
+    "	popl %ecx\n"
+    "	popl %eax\n"
+    "	ret\n");
+
+static const char *trace_names[NTRACE] = {
+	[TRACE_SWITCH] =	"switch",
+	[TRACE_IPC_SEND] =	"ipc_send",
+	[TRACE_IPC_RECV] =	"ipc_recv",
+	[TRACE_PGFAULT] =	"pgfault",
+	[TRACE_SYSCALL] =	"syscall",
+	[TRACE_SYSRET] =	"sysret",
+	[TRACE_IRQ] =		"irq",
+	[TRACE_IPC_TRY] =	"ipc_try",
+	[TRACE_YIELD] =		"yield",
+};
+
+const char *
+trace_name(uint32_t type)
+{
+	return type < NTRACE ? trace_names[type] : 0;
+}
+
+void
+trace_event(uint32_t type, uint32_t a0, uint32_t a1)
+{
+	struct TraceRing *tr = &trace_rings[cpunum()];
+	struct TraceEvent *te;
+
+	static_assert(NCPU <= TRACE_NRING);
+	te = &tr->tr_ev[tr->tr_head % TRACE_NEVENT];
+	te->te_tsc = read_tsc();
+	te->te_type = type;
+	te->te_env = curenv ? curenv->env_id : 0;
+	te->te_a0 = a0;
+	te->te_a1 = a1;
+	tr->tr_head++;
+}
+
+// The trace point that called trace_thunk to return to 'ret'
+void
+trace_hit(uintptr_t ret, uint32_t a0, uint32_t a1)
+{
+	const struct Tracepoint *tp;
+
+	for (tp = __TRACEPOINTS_BEGIN__; tp < __TRACEPOINTS_END__; tp++)
+		if (tp->tp_site + 5 == ret) {
+			trace_event(tp->tp_type, a0, a1);
+			return;
+		}
+}
+
+// Make the 5 bytes at 'site' 'insn'.
+static void
+trace_patch(uintptr_t site, const uint8_t *insn)
+{
+	volatile uint64_t *w = (volatile uint64_t *) ROUNDDOWN(site, 8);
+	uint64_t old, new, seen;
+
+	assert(site % 8 + 5 <= 8);
+	do {
+		old = *w;
+		new = old;
+		memmove((uint8_t *) &new + site % 8, insn, 5);
+		if (new == old)
+			return;
+		seen = old;
+		asm volatile("lock; cmpxchg8b %0"
+			     : "+m" (*w), "+A" (seen)
+			     : "b" ((uint32_t) new), "c" ((uint32_t) (new >> 32))
+			     : "memory", "cc");
+	} while (seen != old);
+}
+
+void
+trace_enable(uint32_t mask)
+{
+	const struct Tracepoint *tp;
+	uint8_t call[5];
+	int32_t rel;
+
+	trace_mask = mask;
+	for (tp = __TRACEPOINTS_BEGIN__; tp < __TRACEPOINTS_END__; tp++) {
+		if (!(mask & (1 << tp->tp_type))) {
+			trace_patch(tp->tp_site, trace_nop);
+			continue;
+		}
+		rel = (uintptr_t) trace_thunk - (tp->tp_site + 5);
+		call[0] = 0xe8;
+		memmove(call + 1, &rel, 4);
+		trace_patch(tp->tp_site, call);
+	}
+}
+
+void
+trace_reset(void)
+{
+	memset(trace_rings, 0, TRACE_NRING * sizeof(struct TraceRing));
+}
+
+void
+trace_dump(int n)
+{
+	uint32_t pos[NCPU], total, skip;
+	struct TraceRing *tr;
+	struct TraceEvent *te, *best;
+	int cpu, bcpu;
+
+	// Each ring from its oldest event still there
+	for (cpu = 0, total = 0; cpu < ncpu; cpu++) {
+		tr = &trace_rings[cpu];
+		pos[cpu] = tr->tr_head > TRACE_NEVENT ? tr->tr_head - TRACE_NEVENT : 0;
+		total += tr->tr_head - pos[cpu];
+	}
+	// Merge them by time, printing only the newest n
+	skip = total > n ? total - n : 0;
+	for (;;) {
+		best = 0;
+		bcpu = 0;
+		for (cpu = 0; cpu < ncpu; cpu++) {
+			tr = &trace_rings[cpu];
+			if (pos[cpu] == tr->tr_head)
+				continue;
+			te = &tr->tr_ev[pos[cpu] % TRACE_NEVENT];
+			if (!best || te->te_tsc < best->te_tsc) {
+				best = te;
+				bcpu = cpu;
+			}
+		}
+		if (!best)
+			break;
+		pos[bcpu]++;
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+		cprintf("%d %016llx %08x %-8s %08x %08x\n", bcpu, best->te_tsc,
+			best->te_env, trace_name(best->te_type), best->te_a0, best->te_a1);
+	}
+}
@@ -0,0 +1,46 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/trace.h>
+
+// The rings, mapped read-only at UTRACE
+extern struct TraceRing *trace_rings;
+// Bit 1 << TRACE_x set: TRACE_x events are recorded.  Set it with
+// trace_enable, which patches the trace points to match.
+extern uint32_t trace_mask;
+
+// One trace point, in section .tracepoints
+struct Tracepoint {
+	uintptr_t tp_site;	// its 5-byte nop, 8-byte aligned
+	uint32_t tp_type;	// TRACE_*
+};
+
+void trace_event(uint32_t type, uint32_t a0, uint32_t a1);
+// Record just the events in 'mask' from now on.
+void trace_enable(uint32_t mask);
+// Forget all events.
+void trace_reset(void);
+// Print the last 'n' events, all CPUs' merged in time order.
+void trace_dump(int n);
+const char *trace_name(uint32_t type);
+
+// A trace point.  Off, it's a 5-byte nop, its place in .tracepoints,
+// and a0 and a1 put in %eax and %edx -- no test, no branch.  On,
+// trace_enable has made the nop a call to trace_thunk, which passes
+// them and the type to trace_event.  'type' must be a constant.
+#define trace(type, a0, a1)						\
+	asm volatile(".balign 8\n"					\
+		     "1:	.byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n"		\
+		     ".pushsection .tracepoints, \"a\"\n"		\
+		     "	.balign 4\n"					\
+		     "	.long 1b, %c0\n"					\
+		     ".popsection"						\
+		     : : "i" (type), "a" ((uint32_t) (a0)),		\
+		       "d" ((uint32_t) (a1)) : "cc")
+
+#endif	// !JOS_KERN_TRACE_H
@@ -10,9 +10,17 @@
 #include <kern/syscall.h>
 #include <kern/sched.h>
 #include <kern/kclock.h>
+#include <kern/ktimer.h>
 #include <kern/picirq.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/swap.h>
+#include <kern/e1000.h>
+#include <kern/klog.h>
 
-static struct Taskstate ts;
 
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
@@ -102,6 +110,10 @@ idt_init(void)
     extern void irqhandler_irq13();
     extern void irqhandler_irq14();
     extern void irqhandler_irq15();
+    extern void irqhandler_error();
+    extern void irqhandler_wakeup();
+    extern void irqhandler_tlb();
+    extern void irqhandler_spurious();
 
     SETGATE(idt[T_DIVIDE], 0, GD_KT, traphandler_divide, 0);
     SETGATE(idt[T_DEBUG], 0, GD_KT, traphandler_debug, 0);
@@ -140,22 +152,55 @@ idt_init(void)
     SETGATE(idt[IRQ_OFFSET + 13], 0, GD_KT, irqhandler_irq13, 0);
     SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, irqhandler_irq14, 0);
     SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, irqhandler_irq15, 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irqhandler_error, 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, irqhandler_wakeup, 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, irqhandler_tlb, 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irqhandler_spurious, 0);
+
+	// trapentry.S finds tf_cs by hand, and sysenter_handler ts_esp0
+	static_assert(offsetof(struct Trapframe, tf_cs) == 52);
+	static_assert(offsetof(struct Taskstate, ts_esp0) == 4);
+
+	// Per-CPU setup
+	trap_init_percpu();
+}
+
+// Initialize and load the per-CPU TSS and IDT
+void
+trap_init_percpu(void)
+{
+	extern struct Segdesc gdt[];
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int i = cpunum();
 
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	ts->ts_esp0 = CPU_KSTACKTOP(i);
+	ts->ts_ss0 = GD_KD;
 
-	// Initialize the TSS field of the gdt.
-	gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	// Initialize the TSS slot of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
-	// Load the TSS
-	ltr(GD_TSS);
+	// Load the TSS selector (like other segment selectors, the
+	// bottom three bits are special; we leave them 0)
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
+
+	// sysenter goes to sysenter_handler, which, like a trap from
+	// user mode, puts its frame at ts_esp0 and then runs on the empty
+	// kernel stack.  It starts with %esp at this CPU's TSS, to find
+	// ts_esp0.  GD_UT and GD_UD follow GD_KT and GD_KD, as sysexit
+	// needs.
+	if (cpu_has_sysenter()) {
+		extern void sysenter_handler();
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t) ts);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -188,47 +233,141 @@ print_regs(struct PushRegs *regs)
 }
 
 static void
-trap_dispatch(struct Trapframe *tf)
+trap_syscall(struct Trapframe *tf)
 {
-	// Handle processor exceptions.
-	// LAB 3: Your code here.
-	
-    if (tf->tf_trapno == T_PGFLT) {
-        page_fault_handler(tf);
-        return;
-    }
+    tf->tf_regs.reg_eax = syscall(
+        tf->tf_regs.reg_eax,
+        tf->tf_regs.reg_edx,
+        tf->tf_regs.reg_ecx,
+        tf->tf_regs.reg_ebx,
+        tf->tf_regs.reg_edi,
+        tf->tf_regs.reg_esi
+        );
+}
 
-    if (tf->tf_trapno == T_BRKPT) {
-        monitor(tf);
-        return;
-    }
+// The ticks come from the LAPIC timers, which want an EOI -- before
+// sched_tick, which may not return -- or on the BSP from the 8253 in
+// auto-EOI mode, if it has no LAPIC to use.  The kernel timers go by the
+// BSP's clock alone (kclock_tick).
+static void
+trap_timer(struct Trapframe *tf)
+{
+    lapic_eoi();
+    if (prof_on)
+        prof_tick(tf);
+    // The console catches up with the kernel log
+    if (thiscpu == bootcpu)
+        klog_flush();
+    kclock_tick();
+    sched_tick();
+}
 
-    if (tf->tf_trapno == T_SYSCALL) {
-        int ret;
-        ret = syscall(
-            tf->tf_regs.reg_eax,
-            tf->tf_regs.reg_edx,
-            tf->tf_regs.reg_ecx,
-            tf->tf_regs.reg_ebx,
-            tf->tf_regs.reg_edi,
-            tf->tf_regs.reg_esi
-            );
-        tf->tf_regs.reg_eax = ret;
-        /*if (ret < 0)*/
-            /*panic("trap dispatch: System call number %d is invalid.", tf->tf_regs.reg_eax);*/
-        return;
-    }
+// The disk tells the file server it's done
+static void
+trap_ide(struct Trapframe *tf)
+{
+    irq_signal(IRQ_IDE);
+}
 
-	// Handle clock and serial interrupts.
-	// LAB 4: Your code here.
+// Console input, which may wake a halted CPU: read it into the console
+// buffer for sys_cgetc and the monitor, and wake whoever sleeps in
+// sys_cgetc_wait
+static void
+trap_kbd(struct Trapframe *tf)
+{
+    kbd_intr();
+    cons_signal();
+}
+
+static void
+trap_serial(struct Trapframe *tf)
+{
+    serial_intr();
+    cons_signal();
+}
+
+// Another CPU queued an env for us while we were halted; trap() then
+// schedules it
+static void
+trap_wakeup(struct Trapframe *tf)
+{
+    lapic_eoi();
+}
+
+// A shootdown that found us halted, so there's nothing left to flush
+static void
+trap_tlb(struct Trapframe *tf)
+{
+    tlb_shootdown_intr();
+}
+
+// The LAPIC raises a spurious interrupt when one it was delivering went
+// away; it wants no EOI
+static void
+trap_spurious(struct Trapframe *tf)
+{
+}
+
+static void
+trap_lapic_error(struct Trapframe *tf)
+{
+    cprintf("CPU %d: LAPIC error\n", cpunum());
+    lapic_eoi();
+}
 
-    if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+// What trap_dispatch does for each trap vector; traps without an
+// entry are unexpected.
+static void (* const trap_handlers[256])(struct Trapframe *) = {
+    [T_DEVICE] = fpu_trap,
+    [T_PGFLT] = page_fault_handler,
+    [T_BRKPT] = monitor,
+    [T_SYSCALL] = trap_syscall,
+    [IRQ_OFFSET + IRQ_TIMER] = trap_timer,
+    [IRQ_OFFSET + IRQ_KBD] = trap_kbd,
+    [IRQ_OFFSET + IRQ_SERIAL] = trap_serial,
+    [IRQ_OFFSET + IRQ_IDE] = trap_ide,
+    [IRQ_OFFSET + IRQ_ERROR] = trap_lapic_error,
+    [IRQ_OFFSET + IRQ_WAKEUP] = trap_wakeup,
+    [IRQ_OFFSET + IRQ_TLB] = trap_tlb,
+    [IRQ_OFFSET + IRQ_SPURIOUS] = trap_spurious,
+};
+
+// Every trap from user mode starts here.  env_run pointed ts_esp0 just
+// past 'curenv->env_tf', so the trap frame is already there, and
+// running the environment will restart at the trap point.  If another
+// CPU destroyed curenv while it ran here, finish the job.
+static void
+trap_from_user(struct Trapframe *tf)
+{
+    lock_kernel();
+    assert(curenv && tf == &curenv->env_tf);
+    if (curenv->env_status == ENV_DYING) {
+        env_free(curenv);
+        curenv = NULL;
         sched_yield();
-        return;
     }
+}
 
-	// Handle keyboard interrupts.
-	// LAB 5: Your code here.
+static void
+trap_dispatch(struct Trapframe *tf)
+{
+	// Handle processor exceptions, interrupts and system calls.
+
+    if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + 16)
+        trace(TRACE_IRQ, tf->tf_trapno - IRQ_OFFSET, 0);
+    // The e1000's IRQ is whichever the BIOS gave it
+    if (e1000_irq != 0 && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+        e1000_intr();
+        return;
+    }
+    if (trap_handlers[tf->tf_trapno & 0xFF] != NULL) {
+        trap_handlers[tf->tf_trapno & 0xFF](tf);
+        return;
+    }
+	// Any other device IRQ goes to the driver that listens for it
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && irq_signal_pci(tf->tf_trapno - IRQ_OFFSET))
+		return;
 
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
@@ -240,32 +379,158 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// A system call that syscall.c lets run without the kernel lock, such
+// as the page calls that fork and the file server make by the thousand.
+// If curenv may go on running, it goes straight back, by sysexit if
+// 'sysexit'; otherwise we take the kernel lock and schedule as trap()
+// does.
+static void
+trap_syscall_nolock(struct Trapframe *tf, uint32_t a5, bool sysexit)
+{
+	assert(curenv && tf == &curenv->env_tf);
+	tf->tf_regs.reg_eax = syscall(
+		tf->tf_regs.reg_eax,
+		tf->tf_regs.reg_edx,
+		tf->tf_regs.reg_ecx,
+		tf->tf_regs.reg_ebx,
+		tf->tf_regs.reg_edi,
+		a5);
+	if (curenv->env_status == ENV_RUNNABLE && !sched_preempt_pending(curenv)) {
+		if (sysexit)
+			env_sysexit(tf);
+		env_pop_tf(tf);
+	}
+	trap_from_user(tf);
+	if (curenv->env_status == ENV_RUNNABLE)
+		sched_resched();
+	sched_yield();
+}
+
+// Go back to the kernel code a trap interrupted: as env_pop_tf, but
+// iret to the same privilege level pops no stack pointer.
+static void __attribute__((noreturn))
+trap_resume_kernel(struct Trapframe *tf)
+{
+	asm volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n"	/* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("trap_resume_kernel: iret failed");
+}
+
 void
 trap(struct Trapframe *tf)
 {
+	cpu_ioff_start();
+
+	// A halted CPU woken by an interrupt gave up the kernel lock
+	// in sched_halt; take it back
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		lock_kernel();
+
 	if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		assert(curenv);
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		env_charge_user(curenv);
+		// Another CPU's TLB shootdown wants neither the kernel
+		// lock nor the scheduler
+		if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+			tlb_shootdown_intr();
+			env_pop_tf(tf);
+		}
+		if (tf->tf_trapno == T_SYSCALL
+		    && syscall_nolock(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ebx))
+			trap_syscall_nolock(tf, tf->tf_regs.reg_esi, 0);
+		trap_from_user(tf);
+		// The timer and the devices preempt, and a page fault may
+		// sleep or run the upcall
+		if ((tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno != T_SYSCALL)
+		    || tf->tf_trapno == T_PGFLT)
+			env_ras_restart(curenv, tf);
 	}
 	
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// An interrupt let in at a preemption point goes straight back to
+	// the kernel code it came in on, which decides whether to yield
+	if (thiscpu->cpu_preempting)
+		trap_resume_kernel(tf);
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNABLE)
-		env_run(curenv);
+	trap_return();
+}
+
+// Return to curenv, if it's still runnable, as at the end of a trap.
+// If the trap woke a higher-priority env (say, an IPC to the file
+// server), that one goes first.
+void
+trap_return(void)
+{
+	if (curenv && curenv->env_status == ENV_RUNNABLE) {
+		if (!sched_preempt_pending(curenv))
+			env_run(curenv);
+		sched_resched();
+	}
 	else
 		sched_yield();
 }
 
+// A system call by sysenter.  As trap(), but with the fifth argument
+// on the user stack, and straight back by sysexit when we return to
+// the caller unchanged.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	uint32_t eflags, a5;
+
+	cpu_ioff_start();
+	env_charge_user(curenv);
+
+	// sysenter clears IF, so the flags we saved have it clear
+	tf->tf_eflags |= FL_IF;
+	eflags = tf->tf_eflags;
+
+	if (syscall_nolock(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ebx)) {
+		env_lock(curenv);
+		if (user_mem_check(curenv, (void *) tf->tf_esp, sizeof(uint32_t), PTE_U) == 0) {
+			a5 = *(uint32_t *) tf->tf_esp;
+			env_unlock(curenv);
+			trap_syscall_nolock(tf, a5, 1);
+		}
+		// A bad stack destroys us, which wants the kernel lock
+		env_unlock(curenv);
+	}
+
+	trap_from_user(tf);
+
+	user_mem_assert(curenv, (void *) tf->tf_esp, sizeof(uint32_t), PTE_U);
+	tf->tf_regs.reg_eax = syscall(
+		tf->tf_regs.reg_eax,
+		tf->tf_regs.reg_edx,
+		tf->tf_regs.reg_ecx,
+		tf->tf_regs.reg_ebx,
+		tf->tf_regs.reg_edi,
+		*(uint32_t *) tf->tf_esp);
+
+	// sysexit can't set the flags, so a frame the call changed them
+	// in (sys_env_set_trapframe on ourselves) goes back by iret
+	if (curenv && curenv->env_status == ENV_RUNNABLE) {
+		if (!sched_preempt_pending(curenv)) {
+			if (curenv->env_tf.tf_eflags == eflags) {
+				unlock_kernel();
+				env_sysexit(tf);
+			}
+			env_run(curenv);
+		}
+		sched_resched();
+	}
+	else
+		sched_yield();
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -281,6 +546,7 @@ page_fault_handler(struct Trapframe *tf)
 
     if ((tf->tf_cs & 3) == 0)
         panic("Page fault in kernel mode");
+    trace(TRACE_PGFAULT, fault_va, tf->tf_eip);
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
@@ -312,12 +578,78 @@ page_fault_handler(struct Trapframe *tf)
 	
 	// LAB 4: Your code here.
 
+    // The kernel resolves the simple faults itself, with no UTrapframe
+    // and no trip through the upcall: each of these returns straight to
+    // the faulting instruction.
+    //
+    // A page of curenv's that was swapped out comes back from the
+    // swap disk
+    if (!(tf->tf_err & FEC_PR) && fault_va < UTOP) {
+        int err;
+        env_lock(curenv);
+        err = swap_in(curenv->env_pgdir, (void *)ROUNDDOWN(fault_va, PGSIZE));
+        env_unlock(curenv);
+        if (err == 0) {
+            curenv->env_kfaults++;
+            env_run(curenv);
+        }
+    }
+
+    // A missing page in one of curenv's auto-grow regions is filled
+    // in right here too
+    if (!(tf->tf_err & FEC_PR) && fault_va < UTOP
+        && env_autogrow(curenv, fault_va, tf->tf_err & FEC_WR) == 0) {
+        curenv->env_kfaults++;
+        env_run(curenv);
+    }
+
+    // A write into a page table fork left shared with another env gets
+    // curenv its own copy of the table (pgdir_pt_unshare); the write is
+    // tried again, and may fault again on a copy-on-write page
+    if ((tf->tf_err & FEC_WR) && (tf->tf_err & FEC_PR) && fault_va < UTOP
+        && PDE_SHARED(curenv->env_pgdir[PDX(fault_va)])) {
+        int err;
+        env_lock(curenv);
+        err = pgdir_pt_unshare(curenv->env_pgdir, (void *)fault_va);
+        env_unlock(curenv);
+        if (err == 0) {
+            curenv->env_kfaults++;
+            env_run(curenv);
+        }
+    }
+
+    // So are the copy-on-write faults curenv asked for with
+    // sys_env_set_fault_flags, or got from sys_cow_fork: the page is made
+    // writable where it is if nobody else has it, else copied
+    // (ENV_FAULT_COW only).  A write to the zero page, mapped for
+    // demand-zero memory, always gets a fresh page.
+    if ((tf->tf_err & FEC_WR) && (tf->tf_err & FEC_PR) && fault_va < UTOP
+        && ((curenv->env_fault_flags & (ENV_FAULT_REUSE | ENV_FAULT_COW))
+            || page_maps_zero(curenv->env_pgdir, (void *)fault_va))) {
+        int err;
+        void *va = (void *)ROUNDDOWN(fault_va, PGSIZE);
+        env_lock(curenv);
+        if ((curenv->env_fault_flags & ENV_FAULT_COW) || page_maps_zero(curenv->env_pgdir, va))
+            err = page_cow_break(curenv->env_pgdir, va);
+        else
+            err = page_cow_reuse(curenv->env_pgdir, va);
+        env_unlock(curenv);
+        if (err == 0) {
+            curenv->env_kfaults++;
+            envstat[ENVX(curenv->env_id)].es_cow_faults++;
+            env_run(curenv);
+        }
+    }
+
     if (curenv->env_pgfault_upcall != NULL) {
         struct UTrapframe *utf;
-        if (tf->tf_esp < UXSTACKTOP && tf->tf_esp >= UXSTACKTOP - PGSIZE) 
+        // Each thread has its own exception stack, the page below
+        // env_xstacktop
+        uintptr_t xtop = curenv->env_xstacktop;
+        if (tf->tf_esp < xtop && tf->tf_esp >= ROUNDDOWN(xtop - 1, PGSIZE))
             utf = (struct UTrapframe *)(tf->tf_esp - 4 - sizeof(struct UTrapframe));
         else
-            utf = (struct UTrapframe *)(UXSTACKTOP - sizeof(struct UTrapframe));
+            utf = (struct UTrapframe *)(xtop - sizeof(struct UTrapframe));
         user_mem_assert(curenv, (void *)utf, sizeof(struct UTrapframe), PTE_U | PTE_W);
         utf->utf_fault_va = fault_va;
         utf->utf_err = tf->tf_err;
@@ -327,6 +659,7 @@ page_fault_handler(struct Trapframe *tf)
         utf->utf_esp = tf->tf_esp;
         curenv->env_tf.tf_esp = (uint32_t)utf;
         curenv->env_tf.tf_eip = (uint32_t)curenv->env_pgfault_upcall;
+        curenv->env_ufaults++;
         env_run(curenv);
     }
 
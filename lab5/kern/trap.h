@@ -13,6 +13,8 @@
 extern struct Gatedesc idt[];
 
 void idt_init(void);
+void trap_init_percpu(void);
+void trap_return(void) __attribute__((noreturn));
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
@@ -0,0 +1,68 @@
+// Batched system calls: queue calls in a struct SyscallBatch and make
+// them all with one sys_batch, for code that makes many page calls at
+// once.  Only the calls the kernel lets be batched may be queued (see
+// struct SyscallReq).  A queued call hasn't happened yet: nothing may
+// depend on it until batch_flush.
+
+#include <inc/lib.h>
+
+// Queue system call 'num' with the arguments syscall() in kern/syscall.c
+// would get, flushing the batch first if it's full.  Returns 0, or the
+// error of a call in the batch flushed.
+int
+batch_add(struct SyscallBatch *b, uint32_t num, uint32_t a1, uint32_t a2,
+	  uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SyscallReq *rq;
+	int r;
+
+	if (b->sb_n == SYSBATCH_MAX && (r = batch_flush(b)) < 0)
+		return r;
+	rq = &b->sb_req[b->sb_n++];
+	rq->sr_num = num;
+	rq->sr_args[0] = a1;
+	rq->sr_args[1] = a2;
+	rq->sr_args[2] = a3;
+	rq->sr_args[3] = a4;
+	rq->sr_args[4] = a5;
+	return 0;
+}
+
+// Make the queued calls, in order, and empty the batch.  The kernel
+// stops at the first that fails.  Returns 0 if they all succeeded, or
+// the first one's error.
+int
+batch_flush(struct SyscallBatch *b)
+{
+	uint32_t n = b->sb_n;
+	int r;
+
+	if (n == 0)
+		return 0;
+	b->sb_n = 0;
+	if ((r = sys_batch(b->sb_req, n)) < 0)
+		return r;
+	if (r > 0 && b->sb_req[r - 1].sr_ret < 0)
+		return b->sb_req[r - 1].sr_ret;
+	return r == n ? 0 : -E_FAULT;
+}
+
+int
+batch_page_alloc(struct SyscallBatch *b, envid_t envid, void *va, int perm)
+{
+	return batch_add(b, SYS_page_alloc, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+batch_page_map(struct SyscallBatch *b, envid_t srcenv, void *srcva,
+	       envid_t dstenv, void *dstva, int perm)
+{
+	return batch_add(b, SYS_page_map, srcenv, (uint32_t) srcva,
+			 dstenv, (uint32_t) dstva, perm);
+}
+
+int
+batch_page_unmap(struct SyscallBatch *b, envid_t envid, void *va)
+{
+	return batch_add(b, SYS_page_unmap, envid, (uint32_t) va, 0, 0, 0);
+}
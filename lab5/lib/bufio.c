@@ -0,0 +1,392 @@
+// Buffered I/O: see inc/bufio.h.
+//
+// A FILE is reading, writing, or neither.  While writing, f_buf[0,
+// f_len) is data not yet written out; while reading, f_buf[f_pos,
+// f_len) is data read ahead and not yet handed out, so the descriptor's
+// offset is ahead of the FILE's by f_len - f_pos.  Changing direction
+// flushes the writes, or seeks back over the read-ahead.
+//
+// Data bigger than the buffer goes straight through, once whatever is
+// buffered has gone before it.  exit() flushes every FILE.
+
+#include <inc/lib.h>
+
+#define FD_CONS		-1		// console: sys_cputs
+
+#define F_READ		0x01		// may read
+#define F_WRITE		0x02		// may write
+#define F_READING	0x04
+#define F_WRITING	0x08
+#define F_EOF		0x10
+#define F_ERR		0x20
+#define F_OWNBUF	0x40		// we malloced f_buf
+
+struct Bufio {
+	int f_fd;
+	int f_flags;
+	int f_mode;			// _IOFBF, _IOLBF or _IONBF
+	char *f_buf;
+	size_t f_size;
+	size_t f_pos;
+	size_t f_len;
+	FILE *f_next;			// on file_list
+};
+
+static FILE std_files[2] = {
+	{ .f_fd = FD_CONS, .f_flags = F_WRITE, .f_mode = _IOLBF, .f_next = &std_files[1] },
+	{ .f_fd = FD_CONS, .f_flags = F_WRITE, .f_mode = _IONBF },
+};
+FILE *stdout = &std_files[0];
+FILE *stderr = &std_files[1];
+
+static FILE *file_list = &std_files[0];
+
+static ssize_t
+bufio_write(FILE *f, const char *buf, size_t n)
+{
+	ssize_t r;
+	size_t done;
+
+	if (f->f_fd == FD_CONS) {
+		cflush();
+		sys_cputs(buf, n);
+		return n;
+	}
+	for (done = 0; done < n; done += r)
+		if ((r = write(f->f_fd, buf + done, n - done)) <= 0) {
+			f->f_flags |= F_ERR;
+			return r < 0 ? r : -E_UNSPECIFIED;
+		}
+	return n;
+}
+
+// The buffer, the first time it's needed
+static int
+bufio_setup(FILE *f)
+{
+	if (f->f_mode == _IONBF || f->f_buf)
+		return 0;
+	if ((f->f_buf = malloc(f->f_size ? f->f_size : BUFSIZ)) == NULL) {
+		f->f_mode = _IONBF;
+		return 0;
+	}
+	if (!f->f_size)
+		f->f_size = BUFSIZ;
+	f->f_flags |= F_OWNBUF;
+	return 0;
+}
+
+// Get ready to write: out of reading, if we were
+static int
+bufio_to_write(FILE *f)
+{
+	struct Fd *fd;
+	int r;
+
+	if (!(f->f_flags & F_WRITE))
+		return -E_INVAL;
+	if (f->f_flags & F_READING) {
+		if (f->f_len > f->f_pos) {
+			if ((r = fd_lookup(f->f_fd, &fd)) < 0
+			    || (r = seek(f->f_fd, fd->fd_offset - (f->f_len - f->f_pos))) < 0)
+				return r;
+		}
+		f->f_pos = f->f_len = 0;
+		f->f_flags &= ~F_READING;
+	}
+	f->f_flags |= F_WRITING;
+	return bufio_setup(f);
+}
+
+int
+fflush(FILE *f)
+{
+	int r, err = 0;
+
+	if (f == NULL) {
+		for (f = file_list; f; f = f->f_next)
+			if ((r = fflush(f)) < 0)
+				err = r;
+		return err;
+	}
+	if (!(f->f_flags & F_WRITING) || f->f_len == 0)
+		return 0;
+	r = bufio_write(f, f->f_buf, f->f_len);
+	f->f_len = 0;
+	return r < 0 ? r : 0;
+}
+
+size_t
+fwrite(const void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+	const char *p = ptr, *nl;
+	size_t n = size * nmemb, k;
+
+	if (n == 0 || bufio_to_write(f) < 0)
+		return 0;
+	if (f->f_mode == _IONBF || n >= f->f_size) {
+		// Too big to buffer: what's buffered first, then straight out
+		if (fflush(f) < 0 || bufio_write(f, p, n) < 0)
+			return 0;
+		return nmemb;
+	}
+	if (f->f_len + n > f->f_size) {
+		// Top the buffer up and write it out; the rest then fits
+		k = f->f_size - f->f_len;
+		memmove(f->f_buf + f->f_len, p, k);
+		f->f_len += k;
+		p += k;
+		n -= k;
+		if (fflush(f) < 0)
+			return 0;
+	}
+	memmove(f->f_buf + f->f_len, p, n);
+	f->f_len += n;
+	if (f->f_mode == _IOLBF) {
+		for (nl = p + n; nl > p && nl[-1] != '\n'; nl--)
+			/* find the last newline */;
+		if (nl > p && fflush(f) < 0)
+			return 0;
+	}
+	return nmemb;
+}
+
+// Read up to n bytes straight from the descriptor
+static ssize_t
+bufio_read(FILE *f, char *buf, size_t n)
+{
+	ssize_t r;
+
+	if (f->f_fd == FD_CONS)
+		return -E_INVAL;
+	if ((r = read(f->f_fd, buf, n)) == 0)
+		f->f_flags |= F_EOF;
+	else if (r < 0)
+		f->f_flags |= F_ERR;
+	return r;
+}
+
+size_t
+fread(void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+	char *p = ptr;
+	size_t n = size * nmemb, done = 0, k;
+	ssize_t r;
+
+	if (n == 0 || !(f->f_flags & F_READ))
+		return 0;
+	if (f->f_flags & F_WRITING) {
+		if (fflush(f) < 0)
+			return 0;
+		f->f_flags &= ~F_WRITING;
+	}
+	f->f_flags |= F_READING;
+	bufio_setup(f);
+	while (done < n) {
+		if (f->f_pos < f->f_len) {
+			k = MIN(n - done, f->f_len - f->f_pos);
+			memmove(p + done, f->f_buf + f->f_pos, k);
+			f->f_pos += k;
+			done += k;
+		} else if (f->f_mode == _IONBF || n - done >= f->f_size) {
+			if ((r = bufio_read(f, p + done, n - done)) <= 0)
+				break;
+			done += r;
+		} else {
+			f->f_pos = f->f_len = 0;
+			if ((r = bufio_read(f, f->f_buf, f->f_size)) <= 0)
+				break;
+			f->f_len = r;
+		}
+	}
+	return done / size;
+}
+
+int
+fgetc(FILE *f)
+{
+	unsigned char c;
+
+	if ((f->f_flags & F_READING) && f->f_pos < f->f_len)
+		return (unsigned char) f->f_buf[f->f_pos++];
+	return fread(&c, 1, 1, f) == 1 ? c : -1;
+}
+
+int
+fputc(int c, FILE *f)
+{
+	char ch = c;
+
+	// The common case: room in a buffer we're already writing to
+	if ((f->f_flags & F_WRITING) && f->f_buf && f->f_len < f->f_size
+	    && f->f_mode == _IOFBF) {
+		f->f_buf[f->f_len++] = ch;
+		return (unsigned char) ch;
+	}
+	return fwrite(&ch, 1, 1, f) == 1 ? (unsigned char) ch : -1;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+	size_t n = strlen(s);
+
+	return fwrite(s, 1, n, f) == n ? 0 : -1;
+}
+
+struct bprintbuf {
+	FILE *f;
+	int cnt;
+};
+
+static void
+bputch(int ch, void *thunk)
+{
+	struct bprintbuf *b = thunk;
+
+	if (fputc(ch, b->f) >= 0)
+		b->cnt++;
+}
+
+static void
+bputstr(const char *s, size_t n, void *thunk)
+{
+	struct bprintbuf *b = thunk;
+
+	b->cnt += fwrite(s, 1, n, b->f);
+}
+
+int
+vbprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct bprintbuf b = { f, 0 };
+
+	vprintfmt_bulk(bputch, bputstr, &b, fmt, ap);
+	return b.cnt;
+}
+
+int
+bprintf(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+	int cnt;
+
+	va_start(ap, fmt);
+	cnt = vbprintf(f, fmt, ap);
+	va_end(ap);
+	return cnt;
+}
+
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (f->f_flags & (F_READING | F_WRITING))
+		return -E_INVAL;
+	if ((mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+	    || (buf && size == 0))
+		return -E_INVAL;
+	if (f->f_flags & F_OWNBUF)
+		free(f->f_buf);
+	f->f_flags &= ~F_OWNBUF;
+	f->f_mode = mode;
+	f->f_buf = buf;
+	f->f_size = size;
+	return 0;
+}
+
+FILE *
+fdopen(int fd, const char *mode)
+{
+	FILE *f;
+	int flags;
+
+	if (mode[0] == 'r')
+		flags = F_READ;
+	else if (mode[0] == 'w' || mode[0] == 'a')
+		flags = F_WRITE;
+	else
+		return NULL;
+	if (mode[1] == '+')
+		flags = F_READ | F_WRITE;
+	if ((f = malloc(sizeof(*f))) == NULL)
+		return NULL;
+	memset(f, 0, sizeof(*f));
+	f->f_fd = fd;
+	f->f_flags = flags;
+	f->f_mode = _IOFBF;
+	f->f_next = file_list;
+	file_list = f;
+	return f;
+}
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+	struct Stat st;
+	FILE *f;
+	int fd, omode;
+
+	switch (mode[0]) {
+	case 'r':
+		omode = mode[1] == '+' ? O_RDWR : O_RDONLY;
+		break;
+	case 'w':
+		omode = (mode[1] == '+' ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		omode = (mode[1] == '+' ? O_RDWR : O_WRONLY) | O_CREAT;
+		break;
+	default:
+		return NULL;
+	}
+	if ((fd = open(path, omode)) < 0)
+		return NULL;
+	// No O_APPEND: start at the end, and stay there if only writing
+	if (mode[0] == 'a' && (fstat(fd, &st) < 0 || seek(fd, st.st_size) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	if ((f = fdopen(fd, mode)) == NULL)
+		close(fd);
+	return f;
+}
+
+int
+fclose(FILE *f)
+{
+	FILE **fp;
+	int r, r2;
+
+	r = fflush(f);
+	if (f >= std_files && f < std_files + 2)
+		return r;
+	for (fp = &file_list; *fp; fp = &(*fp)->f_next)
+		if (*fp == f) {
+			*fp = f->f_next;
+			break;
+		}
+	if ((r2 = close(f->f_fd)) < 0 && r == 0)
+		r = r2;
+	if (f->f_flags & F_OWNBUF)
+		free(f->f_buf);
+	free(f);
+	return r;
+}
+
+int
+feof(FILE *f)
+{
+	return (f->f_flags & F_EOF) != 0;
+}
+
+int
+ferror(FILE *f)
+{
+	return (f->f_flags & F_ERR) != 0;
+}
+
+int
+fileno(FILE *f)
+{
+	return f->f_fd;
+}
@@ -0,0 +1,407 @@
+// Channels: one-way byte streams between environments through a ring
+// buffer in shared memory.
+//
+// The reader only moves ch_rpos and the writer only moves ch_wpos, so
+// while the ring has data (or room) both sides work with plain loads
+// and stores.  Only a reader that finds the ring empty, or a writer that
+// finds it full, traps: it raises its wait flag and sleeps on the other
+// side's position word with sys_addr_wait, and the other side calls
+// sys_addr_wake when it next moves that word and sees the flag.
+//
+// Pipes (lib/pipe.c) are channels too, with a bigger ring; any device
+// built on the ring uses chan_alloc and the chan_fd* functions below.
+// A device with more than one ring per fd, such as a socket's pair
+// (lib/sockets.c), uses chan_readv and chan_writev on each ring; a
+// server that keeps the other end of a ring in its event loop uses
+// chan_put, chan_peek and chan_consume, which never block.  poll() in
+// lib/fd.c waits on a ring as chan_wait does, with the rest of its fds.
+
+#include <inc/string.h>
+#include <inc/lib.h>
+#include <inc/chan.h>
+
+#define debug 0
+
+// Pages of ring buffer behind each channel made by chan(), after the
+// header page
+#define CHAN_BUFPAGES	1
+
+struct Dev devchan =
+{
+	.dev_id =	'r',
+	.dev_name =	"chan",
+	.dev_read =	chan_fdread,
+	.dev_write =	chan_fdwrite,
+	.dev_close =	chan_fdclose,
+	.dev_stat =	chan_fdstat,
+	.dev_readv =	chan_fdreadv,
+	.dev_writev =	chan_fdwritev,
+	.dev_poll =	chan_fdpoll,
+};
+
+// Create a channel: fd[0] for reading, fd[1] for writing.
+// Returns 0 on success, < 0 on failure.
+int
+chan(int chfd[2])
+{
+	return chan_alloc(chfd, &devchan, CHAN_BUFPAGES);
+}
+
+// Create a ring of 'npages' pages (a power of two, at most
+// CHAN_MAXPAGES) and a reading and a writing fd of device 'dev' for it.
+// The pages are PTE_SHARE, so the ends stay connected across fork and
+// spawn.
+// Returns 0 on success, < 0 on failure.
+int
+chan_alloc(int chfd[2], struct Dev *dev, int npages)
+{
+	int r, i;
+	struct Fd *fd0, *fd1;
+	struct Chan *ch;
+	char *va;
+
+	if (npages <= 0 || npages > CHAN_MAXPAGES || (npages & (npages - 1)) != 0)
+		return -E_INVAL;
+
+	// allocate the file descriptor table entries
+	if ((r = fd_alloc(&fd0)) < 0
+	    || (r = sys_page_alloc(0, fd0, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		goto err;
+	if ((r = fd_alloc(&fd1)) < 0
+	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		goto err1;
+
+	// allocate the header and ring pages and map them at both fds' data
+	va = fd2data(fd0);
+	for (i = 0; i < 1 + npages; i++) {
+		if ((r = sys_page_alloc(0, va + i*PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+	}
+	if ((r = sys_page_map_range(0, va, 0, fd2data(fd1), 1 + npages,
+				    PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		goto err3;
+	ch = (struct Chan *) va;
+	ch->ch_size = npages * PGSIZE;
+
+	fd0->fd_dev_id = dev->dev_id;
+	fd0->fd_omode = O_RDONLY;
+	fd1->fd_dev_id = dev->dev_id;
+	fd1->fd_omode = O_WRONLY;
+
+	if (debug)
+		cprintf("[%08x] %s create %08x\n", env->env_id, dev->dev_name, va);
+
+	chfd[0] = fd2num(fd0);
+	chfd[1] = fd2num(fd1);
+	return 0;
+
+    err3:
+	for (i = 0; i < 1 + npages; i++)
+		sys_page_unmap(0, fd2data(fd1) + i*PGSIZE);
+    err2:
+	for (i = 0; i < 1 + npages; i++)
+		sys_page_unmap(0, va + i*PGSIZE);
+	sys_page_unmap(0, fd1);
+    err1:
+	sys_page_unmap(0, fd0);
+    err:
+	return r;
+}
+
+// Is the other end of the channel closed?  Every end maps the header
+// page, so if everyone mapping it maps our fd page too, all of the
+// mappings are ours.
+static int
+_chan_isclosed(struct Fd *fd, struct Chan *ch)
+{
+	int n, nn, ret;
+
+	while (1) {
+		// Someone else may run between the two pageref()s and
+		// change them; retry until nobody has
+		n = env->env_runs;
+		ret = pageref(fd) == pageref(ch);
+		nn = env->env_runs;
+		if (n == nn)
+			return ret;
+	}
+}
+
+int
+chan_isclosed(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	return _chan_isclosed(fd, (struct Chan *) fd2data(fd));
+}
+
+// Sleep until *pos moves from 'val', the other end closes, or we're
+// woken for some other reason; our caller re-checks.  'flag' tells the
+// other end we need a sys_addr_wake.
+static void
+chan_wait(struct Fd *fd, struct Chan *ch, volatile uint32_t *flag,
+	  volatile uint32_t *pos, uint32_t val)
+{
+	uint32_t runs;
+
+	*flag = 1;
+	runs = env->env_runs;
+	if (*pos != val || _chan_isclosed(fd, ch))
+		return;
+	// If anyone ran since we checked, they may have closed their end
+	// without seeing us asleep: look again before sleeping
+	if (env->env_runs != runs)
+		return;
+	sys_addr_wait(pos, val);
+}
+
+// Wake the other end, asleep on *pos.
+static void
+chan_wake(struct Chan *ch, volatile uint32_t *pos)
+{
+	if (ch->ch_server)
+		ipc_send(ch->ch_server, ch->ch_server_value, 0, 0);
+	else
+		sys_addr_wake(pos, ADDR_WAKE_ALL);
+}
+
+ssize_t
+chan_fdread(struct Fd *fd, void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { buf, n };
+
+	return chan_fdreadv(fd, &iov, 1, offset);
+}
+
+ssize_t
+chan_fdwrite(struct Fd *fd, const void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { (void *) buf, n };
+
+	return chan_fdwritev(fd, &iov, 1, offset);
+}
+
+// Tell a sleeping reader about what's been written up to 'wpos'.
+static void
+chan_publish(struct Chan *ch, uint32_t wpos)
+{
+	ch->ch_wpos = wpos;
+	mb();
+	if (ch->ch_rwait) {
+		ch->ch_rwait = 0;
+		chan_wake(ch, &ch->ch_wpos);
+	}
+}
+
+ssize_t
+chan_fdreadv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	USED(offset);
+	return chan_readv(fd, (struct Chan *) fd2data(fd), iov, iovcnt);
+}
+
+// Read into iov from the ring 'ch' of 'fd', as readv does.
+ssize_t
+chan_readv(struct Fd *fd, struct Chan *ch, const struct iovec *iov, int iovcnt)
+{
+	uint32_t rpos, wpos, off, m, first;
+	size_t n, tot;
+	int i;
+
+	for (i = 0, n = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+	if (n == 0)
+		return 0;
+	rpos = ch->ch_rpos;
+	while ((wpos = ch->ch_wpos) == rpos) {
+		// Ring is empty: return what we have at end of stream
+		if (_chan_isclosed(fd, ch))
+			return 0;
+		chan_wait(fd, ch, &ch->ch_rwait, &ch->ch_wpos, wpos);
+	}
+
+	// Copy out at most what's there, each buffer in up to two pieces
+	// round the end of the ring
+	n = MIN(n, wpos - rpos);
+	for (i = 0, tot = 0; tot < n; i++) {
+		m = MIN(n - tot, iov[i].iov_len);
+		off = (rpos + tot) & (ch->ch_size - 1);
+		first = MIN(m, ch->ch_size - off);
+		memmove(iov[i].iov_base, CHAN_BUF(ch) + off, first);
+		memmove((uint8_t *) iov[i].iov_base + first, CHAN_BUF(ch), m - first);
+		tot += m;
+	}
+	ch->ch_rpos = rpos + n;
+	mb();
+
+	if (ch->ch_wwait) {
+		ch->ch_wwait = 0;
+		chan_wake(ch, &ch->ch_rpos);
+	}
+	return n;
+}
+
+// The reader hears of what's written only when the ring fills or all of
+// it is in, so a header and body written together arrive together.
+ssize_t
+chan_fdwritev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	USED(offset);
+	return chan_writev(fd, (struct Chan *) fd2data(fd), iov, iovcnt);
+}
+
+// Write iov to the ring 'ch' of 'fd', as writev does.
+ssize_t
+chan_writev(struct Fd *fd, struct Chan *ch, const struct iovec *iov, int iovcnt)
+{
+	const uint8_t *buf;
+	uint32_t rpos, wpos, off, m, first;
+	size_t i, tot;
+	int j;
+
+	wpos = ch->ch_wpos;
+	for (j = 0, tot = 0; j < iovcnt; j++) {
+		buf = iov[j].iov_base;
+		for (i = 0; i < iov[j].iov_len; i += m) {
+			while ((rpos = ch->ch_rpos) + ch->ch_size == wpos) {
+				// Ring is full: nobody will ever drain it if
+				// the reader has gone
+				chan_publish(ch, wpos);
+				if (_chan_isclosed(fd, ch))
+					return tot + i;
+				chan_wait(fd, ch, &ch->ch_wwait, &ch->ch_rpos, rpos);
+			}
+
+			m = MIN(iov[j].iov_len - i, ch->ch_size - (wpos - rpos));
+			off = wpos & (ch->ch_size - 1);
+			first = MIN(m, ch->ch_size - off);
+			memmove(CHAN_BUF(ch) + off, buf + i, first);
+			memmove(CHAN_BUF(ch), buf + i + first, m - first);
+			wpos += m;
+		}
+		tot += iov[j].iov_len;
+	}
+	chan_publish(ch, wpos);
+	return tot;
+}
+
+// The server's end: write up to n bytes of buf to the ring, as many as
+// there's room for, and wake a reader asleep on it.  Returns how many.
+size_t
+chan_put(struct Chan *ch, const void *buf, size_t n)
+{
+	uint32_t wpos = ch->ch_wpos, off, first;
+
+	n = MIN(n, chan_room(ch));
+	off = wpos & (ch->ch_size - 1);
+	first = MIN(n, ch->ch_size - off);
+	memmove(CHAN_BUF(ch) + off, buf, first);
+	memmove(CHAN_BUF(ch), (const uint8_t *) buf + first, n - first);
+	ch->ch_wpos = wpos + n;
+	mb();
+	if (n > 0 && ch->ch_rwait) {
+		ch->ch_rwait = 0;
+		sys_addr_wake(&ch->ch_wpos, ADDR_WAKE_ALL);
+	}
+	return n;
+}
+
+// Copy the n bytes from 'off' bytes past the read position into buf,
+// leaving them in the ring.  n + off must be at most chan_avail(ch).
+void
+chan_peek(struct Chan *ch, uint32_t off, void *buf, size_t n)
+{
+	uint32_t first;
+
+	off = (ch->ch_rpos + off) & (ch->ch_size - 1);
+	first = MIN(n, ch->ch_size - off);
+	memmove(buf, CHAN_BUF(ch) + off, first);
+	memmove((uint8_t *) buf + first, CHAN_BUF(ch), n - first);
+}
+
+// Drop the first n bytes in the ring, and wake a writer asleep on it.
+void
+chan_consume(struct Chan *ch, size_t n)
+{
+	ch->ch_rpos += n;
+	mb();
+	if (n > 0 && ch->ch_wwait) {
+		ch->ch_wwait = 0;
+		sys_addr_wake(&ch->ch_rpos, ADDR_WAKE_ALL);
+	}
+}
+
+int
+chan_fdclose(struct Fd *fd)
+{
+	struct Chan *ch = (struct Chan *) fd2data(fd);
+	char *va = fd2data(fd);
+	int i;
+
+	// Unmapping the header wakes a peer asleep in sys_addr_wait on it,
+	// which then finds us gone
+	for (i = ch->ch_size / PGSIZE; i >= 0; i--)
+		(void) sys_page_unmap(0, va + i*PGSIZE);
+	return 0;
+}
+
+int
+chan_fdstat(struct Fd *fd, struct Stat *stat)
+{
+	struct Chan *ch = (struct Chan *) fd2data(fd);
+	struct Dev *dev;
+	int r;
+
+	if ((r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	snprintf(stat->st_name, MAXNAMELEN, "<%s>", dev->dev_name);
+	stat->st_size = ch->ch_wpos - ch->ch_rpos;
+	stat->st_isdir = 0;
+	stat->st_dev = dev;
+	return 0;
+}
+
+// Is the ring 'ch' of 'fd' ready to read, if 'rd', or else to write?
+// Returns POLLIN or POLLOUT if so, POLLHUP if it never will be as the
+// other end is closed, or 0 having added the word to sleep on at
+// ew[*nwatch], with its wait flag up, as dev_poll does.
+int
+chan_poll(struct Fd *fd, struct Chan *ch, bool rd, struct EventWatch *ew, int *nwatch)
+{
+	volatile uint32_t *flag = rd ? &ch->ch_rwait : &ch->ch_wwait;
+	volatile uint32_t *pos = rd ? &ch->ch_wpos : &ch->ch_rpos;
+	uint32_t val, runs;
+
+	while (1) {
+		val = *pos;
+		if (rd ? chan_avail(ch) != 0 : chan_room(ch) != 0)
+			return rd ? POLLIN : POLLOUT;
+		if (_chan_isclosed(fd, ch))
+			return POLLHUP;
+		// As in chan_wait: if anyone ran since we looked, they may
+		// have moved *pos or closed without seeing the flag
+		runs = env->env_runs;
+		*flag = 1;
+		mb();
+		if (*pos == val && !_chan_isclosed(fd, ch) && env->env_runs == runs)
+			break;
+	}
+	ew[*nwatch].ew_addr = pos;
+	ew[*nwatch].ew_val = val;
+	(*nwatch)++;
+	return 0;
+}
+
+// A channel fd reads or writes, as it was opened
+int
+chan_fdpoll(struct Fd *fd, int events, struct EventWatch *ew, int *nwatch)
+{
+	bool rd = (fd->fd_omode & O_ACCMODE) == O_RDONLY;
+
+	if (!(events & (rd ? POLLIN : POLLOUT)))
+		return 0;
+	return chan_poll(fd, (struct Chan *) fd2data(fd), rd, ew, nwatch);
+}
@@ -1,7 +1,26 @@
-
 #include <inc/string.h>
 #include <inc/lib.h>
 
+// cputchar's output is kept here and goes out a line, or a buffer, per
+// sys_cputs, and before we wait for input, exit, or fork -- so a child
+// doesn't print it again.  Once we've sfork'd, the buffer would be
+// shared with our siblings, and every character goes straight out.
+#define CONSBUFSIZE	128
+
+static char cons_buf[CONSBUFSIZE];
+static int cons_len;
+bool cons_unbuffered;
+
+// Print what cputchar has kept back.
+void
+cflush(void)
+{
+	if (cons_len > 0) {
+		sys_cputs(cons_buf, cons_len);
+		cons_len = 0;
+	}
+}
+
 void
 cputchar(int ch)
 {
@@ -9,13 +28,107 @@ cputchar(int ch)
 
 	// Unlike standard Unix's putchar,
 	// the cputchar function _always_ outputs to the system console.
-	sys_cputs(&c, 1);
+	if (cons_unbuffered) {
+		sys_cputs(&c, 1);
+		return;
+	}
+	cons_buf[cons_len++] = c;
+	if (c == '\n' || cons_len == CONSBUFSIZE)
+		cflush();
 }
 
 int
 getchar(void)
 {
-	return sys_cgetc();
+	cflush();
+	return sys_cgetc_wait();
+}
+
+// The console as a file descriptor, opened by opencons.  Reads come a
+// character at a time from sys_cgetc_wait; writes go straight to
+// sys_cputs from the caller's buffer -- for splice, the file's own
+// pages -- a page per call so the kernel can take interrupts between.
+static ssize_t devcons_read(struct Fd *fd, void *buf, size_t n, off_t offset);
+static ssize_t devcons_write(struct Fd *fd, const void *buf, size_t n, off_t offset);
+static int devcons_close(struct Fd *fd);
+static int devcons_stat(struct Fd *fd, struct Stat *stat);
+
+struct Dev devcons =
+{
+	.dev_id =	'c',
+	.dev_name =	"cons",
+	.dev_read =	devcons_read,
+	.dev_write =	devcons_write,
+	.dev_close =	devcons_close,
+	.dev_stat =	devcons_stat
+};
+
+int
+iscons(int fdnum)
+{
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	return fd->fd_dev_id == devcons.dev_id;
+}
+
+int
+opencons(void)
+{
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_alloc(&fd)) < 0)
+		return r;
+	if ((r = sys_page_alloc(0, fd, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	fd->fd_dev_id = devcons.dev_id;
+	fd->fd_omode = O_RDWR;
+	return fd2num(fd);
+}
+
+static ssize_t
+devcons_read(struct Fd *fd, void *buf, size_t n, off_t offset)
+{
+	int c;
+
+	if (n == 0)
+		return 0;
+	cflush();
+	if ((c = sys_cgetc_wait()) < 0)
+		return c;
+	// ctl-d is end of file
+	if (c == 0x04)
+		return 0;
+	*(char *) buf = c;
+	return 1;
+}
+
+static ssize_t
+devcons_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
+{
+	size_t tot, m;
+
+	// After whatever cputchar kept back, to keep the order
+	cflush();
+	for (tot = 0; tot < n; tot += m) {
+		m = MIN(n - tot, PGSIZE);
+		sys_cputs((const char *) buf + tot, m);
+	}
+	return n;
 }
 
+static int
+devcons_close(struct Fd *fd)
+{
+	return 0;
+}
 
+static int
+devcons_stat(struct Fd *fd, struct Stat *stat)
+{
+	strcpy(stat->st_name, "<cons>");
+	return 0;
+}
@@ -4,7 +4,8 @@
 void
 exit(void)
 {
-    close_all();
+    fflush(NULL);
+    close_all_exit();
 	sys_env_destroy(0);
 }
 
@@ -0,0 +1,265 @@
+// The file cache.
+//
+// Opening a file and mapping its pages are IPCs to the file server, even
+// for a program spawned over and over that never changes.  The server
+// hands out leases instead (struct FsLease): while an open's lease
+// holds, the pages the open mapped are still the file's.  So when a
+// read-only open is closed, the pages it mapped come here, into a window
+// of the file's own, under its path; and once all of the file's pages
+// are here, a read-only open of the path makes its Fd itself, maps the
+// window into the fd's data with one system call, and asks the server
+// nothing.  Such an fd has no open at the server (FCACHE_FILEID): closing
+// it only unmaps it, and spawn loads a program from it by itself.
+//
+// The windows' pages, like the lease page, are PTE_SHARE, so that forked
+// and spawned children have them as we do; the table is copied to a
+// fork child like any page, and spawn gives the child a copy of it
+// (fcache_give).  At most FCACHE_NPAGES pages are kept, the files least
+// recently opened going first.  The server can't evict blocks we have
+// mapped, so when it runs short it starts a new lease epoch, and we let
+// what we have go the next time we look.
+
+#include <inc/lib.h>
+
+#define FCACHE_NENT	8
+#define FCACHE_FILEPAGES	128	// pages in a window: the biggest file kept
+#define FCACHE_NPAGES	256	// pages kept in all
+#define FCACHE_PATHLEN	96
+
+struct FcacheEnt {
+	char e_path[FCACHE_PATHLEN];	// "" if the entry is free
+	struct File e_file;		// as the open that made it found it
+	uint32_t e_slot;		// its lease
+	uint32_t e_gen;
+	uint32_t e_epoch;
+	uint32_t e_npages;		// pages in the window
+	uint32_t e_used;		// c_tick when last opened
+	struct Fd *e_fd;		// the open whose pages it will get, if any
+};
+
+struct Fcache {
+	uint32_t c_tick;
+	uint32_t c_npages;		// pages in all the windows
+	struct FcacheEnt c_ent[FCACHE_NENT];
+};
+
+#define fslease		((volatile struct FsLease *) FCACHE)
+#define fcache		((struct Fcache *) (FCACHE + PGSIZE))
+#define WINDOW(e)	((char *) FCACHE + PTSIZE + ((e) - fcache->c_ent) * FCACHE_FILEPAGES * PGSIZE)
+
+static bool
+va_mapped(const void *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+// How many pages the file has
+static uint32_t
+file_npages(const struct File *f)
+{
+	if (f->f_flags & FILE_INLINE)
+		return 0;
+	return ROUNDUP(f->f_size, PGSIZE) / PGSIZE;
+}
+
+// Does e's lease still hold?
+static bool
+fcache_valid(struct FcacheEnt *e)
+{
+	return va_mapped((void *) FCACHE) && fslease->l_epoch == e->e_epoch
+		&& fslease->l_gen[e->e_slot] == e->e_gen;
+}
+
+// Empty e's window and free it.
+static void
+fcache_drop(struct FcacheEnt *e)
+{
+	struct SyscallBatch b = BATCH_INIT;
+	char *va = WINDOW(e);
+	uint32_t i;
+
+	for (i = 0; i < FCACHE_FILEPAGES && e->e_npages > 0; i++)
+		if (va_mapped(va + i * PGSIZE)) {
+			batch_page_unmap(&b, 0, va + i * PGSIZE);
+			e->e_npages--;
+			fcache->c_npages--;
+		}
+	batch_flush(&b);
+	fcache->c_npages -= e->e_npages;
+	memset(e, 0, sizeof(*e));
+}
+
+static struct FcacheEnt *
+fcache_find(const char *path)
+{
+	struct FcacheEnt *e;
+
+	for (e = fcache->c_ent; e < fcache->c_ent + FCACHE_NENT; e++)
+		if (e->e_path[0] && strcmp(e->e_path, path) == 0)
+			return e;
+	return NULL;
+}
+
+// The least recently opened entry in use but 'keep', or NULL
+static struct FcacheEnt *
+fcache_lru(struct FcacheEnt *keep)
+{
+	struct FcacheEnt *e, *v = NULL;
+
+	for (e = fcache->c_ent; e < fcache->c_ent + FCACHE_NENT; e++)
+		if (e != keep && e->e_path[0] && (v == NULL || e->e_used < v->e_used))
+			v = e;
+	return v;
+}
+
+// Open path to read from the cache, at fd, which fd_alloc found.
+// Returns 1 if we could, 0 if the server must.
+int
+fcache_open(const char *path, struct Fd *fd)
+{
+	struct FcacheEnt *e;
+	uint32_t n;
+
+	if (!va_mapped(fcache) || (e = fcache_find(path)) == NULL)
+		return 0;
+	if (!fcache_valid(e)) {
+		fcache_drop(e);
+		return 0;
+	}
+	n = file_npages(&e->e_file);
+	if (e->e_npages < n || sys_page_alloc(0, fd, PTE_P|PTE_U|PTE_W|PTE_SHARE) < 0)
+		return 0;
+	fd->fd_dev_id = devfile.dev_id;
+	fd->fd_offset = 0;
+	fd->fd_omode = O_RDONLY;
+	fd->fd_file.id = FCACHE_FILEID;
+	fd->fd_file.file = e->e_file;
+	fd->fd_file.size = e->e_file.f_size;
+	fd->fd_file.lease_slot = e->e_slot;
+	fd->fd_file.lease_gen = e->e_gen;
+	fd->fd_file.lease_epoch = e->e_epoch;
+	if (n > 0 && sys_page_map_range(0, WINDOW(e), 0, fd2data(fd), n, PTE_P|PTE_U|PTE_SHARE) < 0) {
+		sys_page_unmap(0, fd);
+		return 0;
+	}
+	e->e_used = ++fcache->c_tick;
+	return 1;
+}
+
+// The server has just opened path to read at fd: have the pages the
+// open maps when it's closed, if the file is one we'd keep.
+void
+fcache_note(const char *path, struct Fd *fd)
+{
+	struct File *f = &fd->fd_file.file;
+	struct FcacheEnt *e;
+
+	if (f->f_type != FTYPE_REG || file_npages(f) > FCACHE_FILEPAGES
+	    || strlen(path) >= FCACHE_PATHLEN)
+		return;
+	if (!va_mapped(fcache) && sys_page_alloc(0, fcache, PTE_P|PTE_U|PTE_W) < 0)
+		return;
+	// What's there from an older lease may not be the file any more
+	if ((e = fcache_find(path)) != NULL
+	    && (e->e_slot != fd->fd_file.lease_slot || e->e_gen != fd->fd_file.lease_gen
+		|| e->e_epoch != fd->fd_file.lease_epoch || e->e_file.f_size != f->f_size))
+		fcache_drop(e);
+	if ((e = fcache_find(path)) == NULL) {
+		for (e = fcache->c_ent; e < fcache->c_ent + FCACHE_NENT && e->e_path[0]; e++)
+			;
+		if (e == fcache->c_ent + FCACHE_NENT)
+			fcache_drop(e = fcache_lru(NULL));
+		strcpy(e->e_path, path);
+		e->e_file = *f;
+		e->e_slot = fd->fd_file.lease_slot;
+		e->e_gen = fd->fd_file.lease_gen;
+		e->e_epoch = fd->fd_file.lease_epoch;
+	}
+	e->e_fd = fd;
+	e->e_used = ++fcache->c_tick;
+}
+
+// fd is being closed: if fcache_note is waiting for its pages, and the
+// lease still holds, add those it mapped to the window, making room for
+// them by dropping other files.
+void
+fcache_donate(struct Fd *fd)
+{
+	struct SyscallBatch b = BATCH_INIT;
+	struct FcacheEnt *e, *v;
+	uint32_t i, n, nnew;
+	char *src, *dst;
+
+	if (!va_mapped(fcache))
+		return;
+	for (e = fcache->c_ent; e < fcache->c_ent + FCACHE_NENT; e++)
+		if (e->e_path[0] && e->e_fd == fd)
+			break;
+	if (e == fcache->c_ent + FCACHE_NENT)
+		return;
+	e->e_fd = NULL;
+	if (!fcache_valid(e) || fd->fd_file.lease_slot != e->e_slot
+	    || fd->fd_file.lease_gen != e->e_gen) {
+		fcache_drop(e);
+		return;
+	}
+	n = file_npages(&e->e_file);
+	src = fd2data(fd);
+	dst = WINDOW(e);
+	for (i = 0, nnew = 0; i < n; i++)
+		if (va_mapped(src + i * PGSIZE) && !va_mapped(dst + i * PGSIZE))
+			nnew++;
+	while (fcache->c_npages + nnew > FCACHE_NPAGES && (v = fcache_lru(e)) != NULL)
+		fcache_drop(v);
+	if (nnew == 0 || fcache->c_npages + nnew > FCACHE_NPAGES)
+		return;
+	for (i = 0; i < n; i++)
+		if (va_mapped(src + i * PGSIZE) && !va_mapped(dst + i * PGSIZE)
+		    && batch_page_map(&b, 0, src + i * PGSIZE, 0, dst + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_SHARE) >= 0) {
+			e->e_npages++;
+			fcache->c_npages++;
+		}
+	if (batch_flush(&b) < 0)
+		fcache_drop(e);
+}
+
+// Map all of the file open as fdnum, if the cache will have its pages
+// when it's closed: for spawn, which otherwise has the server map them
+// into the child, not us.
+void
+fcache_fill(int fdnum)
+{
+	struct FcacheEnt *e;
+	struct Fd *fd;
+	void *blk;
+
+	if (!va_mapped(fcache) || fd_lookup(fdnum, &fd) < 0)
+		return;
+	for (e = fcache->c_ent; e < fcache->c_ent + FCACHE_NENT; e++)
+		if (e->e_path[0] && e->e_fd == fd && file_npages(&e->e_file) > 0) {
+			(void) read_map_range(fdnum, 0, e->e_file.f_size, &blk);
+			return;
+		}
+}
+
+// Give the new env 'child' a copy of our table; it gets the windows'
+// pages, and the lease page, with the rest of our PTE_SHARE pages.
+int
+fcache_give(envid_t child)
+{
+	struct Fcache *c = (struct Fcache *) UTEMP;
+	int i, r;
+
+	if (!va_mapped(fcache))
+		return 0;
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(c, fcache, sizeof(*c));
+	// Our opens aren't its
+	for (i = 0; i < FCACHE_NENT; i++)
+		c->c_ent[i].e_fd = NULL;
+	r = sys_page_map(0, UTEMP, child, fcache, PTE_P|PTE_U|PTE_W);
+	sys_page_unmap(0, UTEMP);
+	return r;
+}
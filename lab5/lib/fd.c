@@ -2,19 +2,47 @@
 
 #define debug		0
 
-// Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
-// Bottom of file data area
-#define FILEBASE	0xD0000000
+// Bottom of file data area, which runs up to 0xD0000000
+#define FILEBASE	(0xD0000000 - MAXFD*FDWINDOW)
 // Bottom of file descriptor area
 #define FDTABLE		(FILEBASE - PTSIZE)
+// Bytes of file data area for each file descriptor: a whole file
+#define FDWINDOW	MAXFILESIZE
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
 // Return the file data pointer for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEBASE + (i)*PTSIZE))
+#define INDEX2DATA(i)	((char*) (FILEBASE + (i)*FDWINDOW))
 
 
+// Bit i set: fd i's page is known to be mapped, so fd_lookup needn't
+// look at the page tables.  A clear bit tells nothing -- a spawned
+// child starts with its parent's shared fds and none of this -- so then
+// the page tables decide, and the bit is set if the page is there.  Only
+// fd_close and dup's error path unmap an fd page they might have marked.
+static uint32_t fd_open[(MAXFD + 31) / 32];
+
+static bool
+fd_known(int i)
+{
+	return fd_open[i / 32] & (1 << (i % 32));
+}
+
+static void
+fd_mark(int i, bool open)
+{
+	if (open)
+		fd_open[i / 32] |= 1 << (i % 32);
+	else
+		fd_open[i / 32] &= ~(1 << (i % 32));
+}
+
+static bool
+fd_mapped(struct Fd *fd)
+{
+	return (vpd[PDX(fd)] & PTE_P) && (vpt[VPN(fd)] & PTE_P);
+}
+
 /********************************
  * FILE DESCRIPTOR MANIPULATORS *
  *                              *
@@ -55,11 +83,19 @@ fd_alloc(struct Fd **fd_store)
     int i;
     struct Fd *tmp;
     for (i = 0; i < MAXFD; i++) {
+        // Skip a word of fds known to be open at a time
+        if (i % 32 == 0 && fd_open[i / 32] == ~0U) {
+            i += 31;
+            continue;
+        }
+        if (fd_known(i))
+            continue;
         tmp = INDEX2FD(i);
-        if ((vpd[PDX(tmp)] & PTE_P) == 0 || (vpt[VPN(tmp)] & PTE_P) == 0) {
+        if (!fd_mapped(tmp)) {
             *fd_store = tmp;
             return 0;
         }
+        fd_mark(i, 1);
     }
     *fd_store = 0;
 	return -E_MAX_OPEN;
@@ -78,15 +114,31 @@ fd_lookup(int fdnum, struct Fd **fd_store)
 
     if (fdnum >= 0 && fdnum < MAXFD) {
         *fd_store = INDEX2FD(fdnum);
-        if ((vpd[PDX(*fd_store)] & PTE_P) == 0 || (vpt[VPN(*fd_store)] & PTE_P) == 0) 
-            return -E_INVAL;
-        else
+        if (fd_known(fdnum))
             return 0;
+        if (!fd_mapped(*fd_store))
+            return -E_INVAL;
+        fd_mark(fdnum, 1);
+        return 0;
     }
     else
         return -E_INVAL;
 }
 
+// If va is in the data area of an open file descriptor, set *fd_store
+// to that fd.
+//
+// Returns 0 on success, -E_INVAL if va is in no open fd's data area.
+int
+fd_data_lookup(void *va, struct Fd **fd_store)
+{
+	uintptr_t a = (uintptr_t) va;
+
+	if (a < FILEBASE || a >= FILEBASE + MAXFD*FDWINDOW)
+		return -E_INVAL;
+	return fd_lookup((a - FILEBASE) / FDWINDOW, fd_store);
+}
+
 // Frees file descriptor 'fd' by closing the corresponding file
 // and unmapping the file descriptor page.
 // If 'must_exist' is 0, then fd can be a closed or nonexistent file
@@ -108,6 +160,7 @@ fd_close(struct Fd *fd, bool must_exist)
 	// Make sure fd is unmapped.  Might be a no-op if
 	// (*dev->dev_close)(fd) already unmapped it.
 	(void) sys_page_unmap(0, fd);
+	fd_mark(fd2num(fd), 0);
 	return r;
 }
 
@@ -120,6 +173,10 @@ fd_close(struct Fd *fd, bool must_exist)
 static struct Dev *devtab[] =
 {
 	&devfile,
+	&devchan,
+	&devpipe,
+	&devsock,
+	&devcons,
 	0
 };
 
@@ -153,10 +210,28 @@ void
 close_all(void)
 {
 	int i;
+
+	cflush();
 	for (i = 0; i < MAXFD; i++)
 		close(i);
 }
 
+// close_all for exit: every file goes in one request to the server
+// (file_close_all), and the rest are closed as usual, but nothing
+// env_free will unmap anyway is unmapped.
+void
+close_all_exit(void)
+{
+	struct Fd *fd;
+	int i;
+
+	cflush();
+	file_close_all();
+	for (i = 0; i < MAXFD; i++)
+		if (fd_lookup(i, &fd) == 0 && fd->fd_dev_id != devfile.dev_id)
+			close(i);
+}
+
 // Make file descriptor 'newfdnum' a duplicate of file descriptor 'oldfdnum'.
 // For instance, writing onto either file descriptor will affect the
 // file and the file offset of the other.
@@ -180,14 +255,17 @@ dup(int oldfdnum, int newfdnum)
 
 	if ((r = sys_page_map(0, oldfd, 0, newfd, vpt[VPN(oldfd)] & PTE_USER)) < 0)
 		goto err;
-	if (vpd[PDX(ova)]) {
-		for (i = 0; i < PTSIZE; i += PGSIZE) {
-			pte = vpt[VPN(ova + i)];
-			if (pte&PTE_P) {
-				// should be no error here -- pd is already allocated
-				if ((r = sys_page_map(0, ova + i, 0, nva + i, pte & PTE_USER)) < 0)
-					goto err;
-			}
+	// The window is several page tables' worth; skip the absent ones
+	for (i = 0; i < FDWINDOW; i += PGSIZE) {
+		if (!vpd[PDX(ova + i)]) {
+			i += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = vpt[VPN(ova + i)];
+		if (pte&PTE_P) {
+			// should be no error here -- pd is already allocated
+			if ((r = sys_page_map(0, ova + i, 0, nva + i, pte & PTE_USER)) < 0)
+				goto err;
 		}
 	}
 
@@ -195,8 +273,13 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	for (i = 0; i < PTSIZE; i += PGSIZE)
-		sys_page_unmap(0, nva + i);
+	fd_mark(newfdnum, 0);
+	for (i = 0; i < FDWINDOW; i += PGSIZE) {
+		if (!vpd[PDX(nva + i)])
+			i += PTSIZE - PGSIZE;
+		else
+			sys_page_unmap(0, nva + i);
+	}
 	return r;
 }
 
@@ -258,6 +341,135 @@ write(int fdnum, const void *buf, size_t n)
 	return r;
 }
 
+// Copy up to 'n' bytes from fdin's seek position on to fdout's, as read
+// and write would, but with no buffer between them where fdin's device
+// has dev_map: fdout's dev_write reads the data where it lies, so a
+// file's pages go straight into a pipe's ring, or to sys_cputs for the
+// console.  Otherwise the data goes through a buffer here.  Returns the
+// number of bytes moved, less than n at end of input or after a short
+// write, or < 0 on error if none moved.
+ssize_t
+splice(int fdin, int fdout, size_t n)
+{
+	char buf[512];
+	const void *blk;
+	struct Dev *din, *dout;
+	struct Fd *in, *out;
+	ssize_t m, r;
+	size_t tot;
+
+	if ((r = fd_lookup(fdin, &in)) < 0
+	    || (r = dev_lookup(in->fd_dev_id, &din)) < 0
+	    || (r = fd_lookup(fdout, &out)) < 0
+	    || (r = dev_lookup(out->fd_dev_id, &dout)) < 0)
+		return r;
+	if ((in->fd_omode & O_ACCMODE) == O_WRONLY
+	    || (out->fd_omode & O_ACCMODE) == O_RDONLY) {
+		cprintf("[%08x] splice %d %d -- bad mode\n", env->env_id, fdin, fdout);
+		return -E_INVAL;
+	}
+
+	for (tot = 0; tot < n; tot += r) {
+		if (din->dev_map)
+			m = (*din->dev_map)(in, n - tot, in->fd_offset, &blk);
+		else {
+			m = (*din->dev_read)(in, buf, MIN(n - tot, sizeof(buf)), in->fd_offset);
+			blk = buf;
+			// What's read is gone from fdin whether or not it's written
+			if (m > 0)
+				in->fd_offset += m;
+		}
+		if (m <= 0)
+			return tot ? tot : m;
+		if ((r = (*dout->dev_write)(out, blk, m, out->fd_offset)) <= 0)
+			return tot ? tot : r;
+		if (din->dev_map)
+			in->fd_offset += r;
+		out->fd_offset += r;
+		if (r < m)
+			return tot + r;
+	}
+	return tot;
+}
+
+// Do a readv or writev on a device that has no hook for it: a read or
+// write per buffer, stopping at the first that comes up short.
+static ssize_t
+rwv(struct Fd *fd, struct Dev *dev, const struct iovec *iov, int iovcnt, bool wr)
+{
+	ssize_t r, tot;
+	int i;
+
+	for (i = 0, tot = 0; i < iovcnt; i++) {
+		if (wr)
+			r = (*dev->dev_write)(fd, iov[i].iov_base, iov[i].iov_len, fd->fd_offset + tot);
+		else
+			r = (*dev->dev_read)(fd, iov[i].iov_base, iov[i].iov_len, fd->fd_offset + tot);
+		if (r < 0)
+			return tot > 0 ? tot : r;
+		tot += r;
+		if (r < iov[i].iov_len)
+			break;
+	}
+	return tot;
+}
+
+// Read into the 'iovcnt' buffers of 'iov' in turn, as one read would
+// into a buffer made of them all.  A device with dev_readv does it in
+// one operation.
+ssize_t
+readv(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY) {
+		cprintf("[%08x] readv %d -- bad mode\n", env->env_id, fdnum);
+		return -E_INVAL;
+	}
+	if (dev->dev_readv)
+		r = (*dev->dev_readv)(fd, iov, iovcnt, fd->fd_offset);
+	else
+		r = rwv(fd, dev, iov, iovcnt, 0);
+	if (r > 0)
+		fd->fd_offset += r;
+	return r;
+}
+
+// Write the 'iovcnt' buffers of 'iov' in turn, as one write.  A device
+// with dev_writev does it in one operation: a file grows once, a
+// channel's reader sees all of it at once.
+ssize_t
+writev(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY) {
+		cprintf("[%08x] writev %d -- bad mode\n", env->env_id, fdnum);
+		return -E_INVAL;
+	}
+	if (dev->dev_writev)
+		r = (*dev->dev_writev)(fd, iov, iovcnt, fd->fd_offset);
+	else
+		r = rwv(fd, dev, iov, iovcnt, 1);
+	if (r > 0)
+		fd->fd_offset += r;
+	return r;
+}
+
 int
 seek(int fdnum, off_t offset)
 {
@@ -304,15 +516,92 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// Every path is the file server's, which looks it up for us without
+// our opening it.
 int
 stat(const char *path, struct Stat *stat)
 {
-	int fd, r;
+	return fsipc_stat(path, stat);
+}
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return fd;
-	r = fstat(fd, stat);
-	close(fd);
-	return r;
+
+// What fds[i] is ready for, as far as its device can tell.  A pollfd
+// for console input or IPC is the kernel's to answer: its EVENT_* goes
+// in *events.  Words to sleep on go at ew[*nwatch].
+static int
+poll_dev(struct pollfd *pfd, struct EventWatch *ew, int *nwatch, uint32_t *events)
+{
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if (pfd->fd == POLLFD_CONS || pfd->fd == POLLFD_IPC) {
+		if (pfd->events & POLLIN)
+			*events |= pfd->fd == POLLFD_CONS ? EVENT_CONS : EVENT_IPC;
+		return 0;
+	}
+	if (pfd->fd < 0)
+		return 0;
+	if (fd_lookup(pfd->fd, &fd) < 0 || dev_lookup(fd->fd_dev_id, &dev) < 0)
+		return POLLNVAL;
+	if (!dev->dev_poll)
+		return pfd->events & (POLLIN | POLLOUT);
+	return (*dev->dev_poll)(fd, pfd->events, ew, nwatch);
 }
 
+// Wait until one of the 'nfds' fds in fds[] is ready for what its
+// 'events' ask, as Unix's poll does, and say what each is ready for in
+// its 'revents'.  Besides fds, a pollfd may watch for console input
+// (POLLFD_CONS) or a message to receive (POLLFD_IPC), so that one
+// event loop can serve pipes, sockets, the console and IPC, and sleep
+// in sys_event_wait while none of them has work.  'timeout' is in ticks:
+// 0 only looks, and < 0 waits as long as it takes.
+//
+// Returns the number of fds with revents, 0 on timeout, < 0 on error.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct EventWatch ew[EVENT_NWATCH + POLL_DEV_NWATCH];
+	uint32_t events, deadline = kinfo.ki_ticks + timeout, ticks;
+	int i, n, r, nwatch;
+	bool overflow;
+
+	while (1) {
+		n = 0;
+		nwatch = 0;
+		events = 0;
+		overflow = 0;
+		for (i = 0; i < nfds; i++) {
+			if ((fds[i].revents = poll_dev(&fds[i], ew, &nwatch, &events)) != 0)
+				n++;
+			if (nwatch > EVENT_NWATCH) {
+				// Too many words to watch: look again each tick
+				nwatch = EVENT_NWATCH;
+				overflow = 1;
+			}
+		}
+		if (n > 0 && events == 0)
+			return n;
+
+		// Something's ready, or time's up: just ask the kernel what
+		// else is
+		ticks = timeout < 0 ? 0 : deadline - kinfo.ki_ticks;
+		if (n > 0 || (timeout >= 0 && (int32_t) ticks <= 0)) {
+			events |= EVENT_NONBLOCK;
+			ticks = 0;
+		} else if (overflow && (ticks == 0 || ticks > 1))
+			ticks = 1;
+		if ((r = sys_event_wait(events, ew, nwatch, ticks)) < 0)
+			return r;
+		for (i = 0; i < nfds; i++)
+			if ((fds[i].fd == POLLFD_CONS && (r & EVENT_CONS))
+			    || (fds[i].fd == POLLFD_IPC && (r & EVENT_IPC))) {
+				if (fds[i].revents == 0)
+					n++;
+				fds[i].revents |= POLLIN & fds[i].events;
+			}
+		if (n > 0 || (events & EVENT_NONBLOCK))
+			return n;
+		if ((r & EVENT_TIMEOUT) && !overflow)
+			return 0;
+	}
+}
@@ -0,0 +1,263 @@
+// Cooperative threads within one env, for servers.
+//
+// Each request a server is working on runs in a fiber: a stack of its
+// own, from the heap, and a saved stack pointer.  A fiber runs until it
+// has to wait -- in the file server, for the disk, for a block another
+// fiber is reading in, for the request lock -- and then fiber_sleep
+// switches back to the server's main loop, which receives more requests
+// and runs the fibers that fiber_wakeup has made runnable again.
+// Fibers never preempt one another, so code between two sleeps needs no
+// locking, and a switch costs a few instructions, with no trap.
+//
+// A server with its own main loop, like the file server, calls
+// fiber_init, then fiber_start for each request and fiber_run between
+// receives.  A simpler one leaves the loop to fiber_serve.
+
+#include <inc/lib.h>
+#include <inc/fiber.h>
+
+#define FIBER_FREE	0
+#define FIBER_RUNNABLE	1
+#define FIBER_RUNNING	2
+#define FIBER_SLEEPING	3
+
+struct Fiber {
+	int f_state;
+	uint32_t f_esp;		// saved stack pointer while switched out
+	void (*f_fn)(void *);
+	void *f_arg;
+	struct Fiber *f_next;	// next on the run queue or a FiberQ
+};
+
+static struct Fiber fibers[FIBER_MAX];
+static uint8_t *fiber_stacks[FIBER_MAX];
+static int fiber_nfiber;		// fibers with stacks
+static struct Fiber *fiber_cur;		// running fiber, 0 in the main loop
+static uint32_t fiber_main_esp;		// main loop's stack while a fiber runs
+static struct FiberQ fiber_runq;
+
+// Save the callee-saved registers and the stack pointer in *save_esp,
+// then switch to the stack 'esp' and pop the registers saved there.
+void fiber_switch(uint32_t *save_esp, uint32_t esp);
+
+asm(".text\n"
+    ".globl fiber_switch\n"
+    "fiber_switch:\n"
+    "	movl 4(%esp), %eax\n"
+    "	movl 8(%esp), %edx\n"
+    "	pushl %ebp\n"
+    "	pushl %ebx\n"
+    "	pushl %esi\n"
+    "	pushl %edi\n"
+    "	movl %esp, (%eax)\n"
+    "	movl %edx, %esp\n"
+    "	popl %edi\n"
+    "	popl %esi\n"
+    "	popl %ebx\n"
+    "	popl %ebp\n"
+    "	ret\n");
+
+static void
+fiberq_push(struct FiberQ *q, struct Fiber *f)
+{
+	f->f_next = 0;
+	if (q->fq_head)
+		q->fq_tail->f_next = f;
+	else
+		q->fq_head = f;
+	q->fq_tail = f;
+}
+
+static struct Fiber *
+fiberq_pop(struct FiberQ *q)
+{
+	struct Fiber *f;
+
+	if ((f = q->fq_head) != 0)
+		q->fq_head = f->f_next;
+	return f;
+}
+
+// Where every fiber starts.  When its function returns, the fiber is
+// free again and we go back to the main loop for good.
+static void
+fiber_entry(void)
+{
+	struct Fiber *f = fiber_cur;
+
+	f->f_fn(f->f_arg);
+	f->f_state = FIBER_FREE;
+	fiber_switch(&f->f_esp, fiber_main_esp);
+	panic("fiber_entry: free fiber %d resumed", f - fibers);
+}
+
+// Make fibers 0 to nfiber - 1 ready for fiber_start, giving each its
+// stack.  Returns 0, -E_INVAL if nfiber is over FIBER_MAX, or -E_NO_MEM.
+int
+fiber_init(int nfiber)
+{
+	if (nfiber > FIBER_MAX)
+		return -E_INVAL;
+	for (; fiber_nfiber < nfiber; fiber_nfiber++)
+		if (!(fiber_stacks[fiber_nfiber] = malloc(FIBER_STKSIZE)))
+			return -E_NO_MEM;
+	return 0;
+}
+
+// Start fn(arg) in fiber number id, which must be free.  It runs the
+// next time the main loop calls fiber_run.
+void
+fiber_start(int id, void (*fn)(void *), void *arg)
+{
+	struct Fiber *f;
+	uint32_t *sp;
+
+	assert(id >= 0 && id < fiber_nfiber);
+	f = &fibers[id];
+	assert(f->f_state == FIBER_FREE);
+	f->f_fn = fn;
+	f->f_arg = arg;
+
+	// A frame for fiber_switch to pop: four registers, then
+	// fiber_entry as the return address, then fiber_entry's own
+	// return address, which it never uses
+	sp = (uint32_t *) (fiber_stacks[id] + FIBER_STKSIZE);
+	*--sp = 0;
+	*--sp = (uint32_t) fiber_entry;
+	*--sp = 0;		// ebp
+	*--sp = 0;		// ebx
+	*--sp = 0;		// esi
+	*--sp = 0;		// edi
+	f->f_esp = (uint32_t) sp;
+
+	f->f_state = FIBER_RUNNABLE;
+	fiberq_push(&fiber_runq, f);
+}
+
+// Run fibers until none is runnable.  Only the main loop calls this.
+void
+fiber_run(void)
+{
+	struct Fiber *f;
+
+	assert(fiber_cur == 0);
+	while ((f = fiberq_pop(&fiber_runq)) != 0) {
+		fiber_cur = f;
+		f->f_state = FIBER_RUNNING;
+		fiber_switch(&fiber_main_esp, f->f_esp);
+		fiber_cur = 0;
+	}
+}
+
+// The number of the running fiber, or -1 in the main loop.
+int
+fiber_self(void)
+{
+	return fiber_cur ? fiber_cur - fibers : -1;
+}
+
+// Let the other runnable fibers run, then carry on.
+void
+fiber_yield(void)
+{
+	struct Fiber *f = fiber_cur;
+
+	assert(f != 0);
+	f->f_state = FIBER_RUNNABLE;
+	fiberq_push(&fiber_runq, f);
+	fiber_switch(&f->f_esp, fiber_main_esp);
+}
+
+// Sleep on q until some fiber_wakeup(q).  Wakeups may be spurious, so
+// callers re-check what they were waiting for.
+void
+fiber_sleep(struct FiberQ *q)
+{
+	struct Fiber *f = fiber_cur;
+
+	assert(f != 0);
+	f->f_state = FIBER_SLEEPING;
+	fiberq_push(q, f);
+	fiber_switch(&f->f_esp, fiber_main_esp);
+}
+
+// Make every fiber sleeping on q runnable.
+void
+fiber_wakeup(struct FiberQ *q)
+{
+	struct Fiber *f;
+
+	while ((f = fiberq_pop(q)) != 0) {
+		f->f_state = FIBER_RUNNABLE;
+		fiberq_push(&fiber_runq, f);
+	}
+}
+
+// fiber_serve's requests, one per fiber
+struct FiberReq {
+	bool fr_busy;
+	fiber_handler fr_fn;
+	envid_t fr_whom;
+	uint32_t fr_value;
+	void *fr_pg;
+	int fr_perm;
+};
+
+static struct FiberReq fiber_reqs[FIBER_MAX];
+
+static void
+fiber_serve_one(void *arg)
+{
+	struct FiberReq *fr = arg;
+	int32_t r;
+
+	r = fr->fr_fn(fr->fr_whom, fr->fr_value, fr->fr_perm ? fr->fr_pg : 0, fr->fr_perm);
+	// Clients wait in ipc_call, so they are receiving; if one has
+	// gone, the reply is dropped
+	(void) sys_ipc_try_send(fr->fr_whom, r, (void *) UTOP, 0);
+	if (fr->fr_perm)
+		sys_page_unmap(0, fr->fr_pg);
+	fr->fr_busy = 0;
+}
+
+//
+// Serve requests forever, each in a fiber of its own, up to 'nfiber'
+// at once: receive a message, with any page at pgbase + i * PGSIZE for
+// fiber i, and run fn(whom, value, pg, perm) on it, pg being 0 if no
+// page came.  fn may fiber_sleep until another request wakes it; its
+// return value is the reply.  A request that finds every fiber busy is
+// answered -E_NO_FREE_ENV at once, without running fn.
+//
+void
+fiber_serve(fiber_handler fn, uintptr_t pgbase, int nfiber)
+{
+	struct FiberReq *fr;
+	envid_t whom;
+	uint32_t value;
+	int i, perm, r;
+
+	if ((r = fiber_init(nfiber)) < 0)
+		panic("fiber_serve: %e", r);
+	while (1) {
+		fiber_run();
+		for (i = 0; i < nfiber && fiber_reqs[i].fr_busy; i++)
+			;
+		if (i == nfiber) {
+			value = ipc_recv(&whom, 0, 0);
+			if (whom != 0)
+				(void) sys_ipc_try_send(whom, -E_NO_FREE_ENV, (void *) UTOP, 0);
+			continue;
+		}
+		fr = &fiber_reqs[i];
+		fr->fr_pg = (void *) (pgbase + i * PGSIZE);
+		value = ipc_recv(&whom, fr->fr_pg, &perm);
+		if (whom == 0)
+			continue;
+		fr->fr_busy = 1;
+		fr->fr_fn = fn;
+		fr->fr_whom = whom;
+		fr->fr_value = value;
+		fr->fr_perm = perm;
+		fiber_start(i, fiber_serve_one, fr);
+	}
+}
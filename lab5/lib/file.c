@@ -7,8 +7,10 @@
 static int file_close(struct Fd *fd);
 static ssize_t file_read(struct Fd *fd, void *buf, size_t n, off_t offset);
 static ssize_t file_write(struct Fd *fd, const void *buf, size_t n, off_t offset);
+static ssize_t file_writev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
 static int file_stat(struct Fd *fd, struct Stat *stat);
 static int file_trunc(struct Fd *fd, off_t newsize);
+static ssize_t file_map(struct Fd *fd, size_t n, off_t offset, const void **blk);
 
 struct Dev devfile =
 {
@@ -18,12 +20,31 @@ struct Dev devfile =
 	.dev_write =	file_write,
 	.dev_close =	file_close,
 	.dev_stat =	file_stat,
-	.dev_trunc =	file_trunc
+	.dev_trunc =	file_trunc,
+	.dev_writev =	file_writev,
+	.dev_map =	file_map
 };
 
 // Helper functions for file access
-static int fmap(struct Fd *fd, off_t oldsize, off_t newsize);
+static int fmap(struct Fd *fd, off_t offset, size_t npages);
 static int funmap(struct Fd *fd, off_t oldsize, off_t newsize, bool dirty);
+static int file_pgfault(struct UTrapframe *utf);
+static int file_publish(struct Fd *fd);
+static int mmap_detach(struct Fd *fd);
+static int close_add(int fileid, off_t offset, uint32_t npages);
+static int close_send(void);
+
+// Pages file_pgfault maps at once: the one touched and a few after it
+#define FAULT_PAGES	8
+
+// The least file_write grows the server's size by when it must grow it
+#define FILE_RESERVE_MIN	(4 * PGSIZE)
+
+// The FSREQ_CLOSE_BATCH being built: runs of written pages, which
+// funmap and mmap_flush add, and closes.  close_add sends it on when
+// it's full, close_send when we're done.
+static struct Fsclose_ent closebuf[FSCLOSE_MAXENT];
+static uint32_t nclose;
 
 // Open a file (or directory),
 // returning the file descriptor index on success, < 0 on failure.
@@ -36,7 +57,8 @@ open(const char *path, int mode)
 	// (fd_alloc does not allocate a page, it just returns an
 	// unused fd address.  Do you need to allocate a page?  Look
 	// at fsipc.c if you aren't sure.)
-	// Then map the file data (you may find fmap() helpful).
+	// The file data is mapped page by page as it is first touched
+	// (see file_pgfault).
 	// Return the file descriptor index.
 	// If any step fails, use fd_close to free the file descriptor.
 
@@ -47,16 +69,17 @@ open(const char *path, int mode)
     r = fd_alloc(&fd);
     if (r < 0)
         return r;
+    add_pgfault_handler(file_pgfault);
+    // A file the cache has whole needs no server at all (fcache.c)
+    if (mode == O_RDONLY && fcache_open(path, fd))
+        return fd2num(fd);
     r = fsipc_open(path, mode, fd);
     if (r < 0)
         return r;
-    r = fmap(fd, 0, fd->fd_file.file.f_size);
-    if (r < 0) {
-        fd_close(fd, 1);
-        return r;
-    }
-    else
-        return fd2num(fd);
+    fd->fd_file.size = fd->fd_file.file.f_size;
+    if (mode == O_RDONLY)
+        fcache_note(path, fd);
+    return fd2num(fd);
 }
 
 // Clean up a file-server file descriptor.
@@ -70,15 +93,27 @@ file_close(struct Fd *fd)
 
 	// LAB 5: Your code here.
 
-    int r;
-    r = funmap(fd, fd->fd_file.file.f_size, 0, 1);
-    if (r < 0)
-        return r;
-    r = fsipc_close(fd->fd_file.id);
-    if (r < 0)
-        return r;
-    else
-        return 0;
+    // What was written, here and through shared mmaps, the size it
+    // really has if writing reserved more, and the close itself: all
+    // in one FSREQ_CLOSE_BATCH
+    int r, ret = 0;
+    nclose = 0;
+    if ((r = mmap_detach(fd)) < 0)
+        ret = r;
+    // The server never heard of an fd the cache made
+    if (fd->fd_file.id == FCACHE_FILEID) {
+        funmap(fd, fd->fd_file.file.f_size, 0, 0);
+        return ret;
+    }
+    // The cache may want the pages we read
+    fcache_donate(fd);
+    if ((r = funmap(fd, fd->fd_file.file.f_size, 0, 1)) < 0)
+        ret = r;
+    if ((r = close_add(fd->fd_file.id, fd->fd_file.size, 0)) < 0)
+        ret = r;
+    if ((r = close_send()) < 0)
+        ret = r;
+    return ret;
 }
 
 // Read 'n' bytes from 'fd' at the current seek position into 'buf'.
@@ -90,67 +125,185 @@ file_read(struct Fd *fd, void *buf, size_t n, off_t offset)
 	size_t size;
 
 	// avoid reading past the end of file
-	size = fd->fd_file.file.f_size;
+	size = fd->fd_file.size;
 	if (offset > size)
 		return 0;
 	if (offset + n > size)
 		n = size - offset;
 
+	// An inline file's data came in the Fd page with the open, until
+	// the server moves it to a block and clears the flag
+	if ((fd->fd_file.file.f_flags & FILE_INLINE) && offset + n <= FILE_INLINE_MAX) {
+		memmove(buf, fd->fd_file.file.f_data + offset, n);
+		return n;
+	}
+
 	// read the data by copying from the file mapping
 	memmove(buf, fd2data(fd) + offset, n);
 	return n;
 }
 
+// The file's data from 'offset' on, where it lies: the inline data in
+// the Fd page, or else up to FSMAP_MAXPAGES pages of the file mapping,
+// which we map in first so that the kernel can be handed them.
+static ssize_t
+file_map(struct Fd *fd, size_t n, off_t offset, const void **blk)
+{
+	size_t size;
+	int r;
+
+	size = fd->fd_file.size;
+	if (offset >= size)
+		return 0;
+	if (offset + n > size)
+		n = size - offset;
+
+	if ((fd->fd_file.file.f_flags & FILE_INLINE) && offset + n <= FILE_INLINE_MAX) {
+		*blk = fd->fd_file.file.f_data + offset;
+		return n;
+	}
+
+	if (n > FSMAP_MAXPAGES * PGSIZE - offset % PGSIZE)
+		n = FSMAP_MAXPAGES * PGSIZE - offset % PGSIZE;
+	if ((r = fmap(fd, ROUNDDOWN(offset, PGSIZE),
+		      (ROUNDUP(offset + n, PGSIZE) - ROUNDDOWN(offset, PGSIZE)) / PGSIZE)) < 0)
+		return r;
+	*blk = fd2data(fd) + offset;
+	return n;
+}
+
 // Find the page that maps the file block starting at 'offset',
 // and store its address in '*blk'.
 int
 read_map(int fdnum, off_t offset, void **blk)
+{
+	return read_map_range(fdnum, offset, 1, blk);
+}
+
+// Like read_map, but make sure all of the file's pages from 'offset' up
+// to 'offset + len' are mapped, so that the kernel can be handed them:
+// it doesn't take page faults for us.
+int
+read_map_range(int fdnum, off_t offset, size_t len, void **blk)
 {
 	int r;
-	char *va;
 	struct Fd *fd;
 
 	if ((r = fd_lookup(fdnum, &fd)) < 0)
 		return r;
 	if (fd->fd_dev_id != devfile.dev_id)
 		return -E_INVAL;
-	va = fd2data(fd) + offset;
-	if (offset >= MAXFILESIZE)
+	if (offset + len > ROUNDUP(fd->fd_file.size, PGSIZE))
 		return -E_NO_DISK;
-	if (!(vpd[PDX(va)] & PTE_P) || !(vpt[VPN(va)] & PTE_P))
-		return -E_NO_DISK;
-	*blk = (void*) va;
+	if ((r = fmap(fd, ROUNDDOWN(offset, PGSIZE),
+		      (ROUNDUP(offset + len, PGSIZE) - ROUNDDOWN(offset, PGSIZE)) / PGSIZE)) < 0)
+		return r;
+	*blk = (void*) (fd2data(fd) + offset);
 	return 0;
 }
 
-// Write 'n' bytes from 'buf' to 'fd' at the current seek position.
-static ssize_t
-file_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
+// Like read, but when 'buf' and the seek position are both page-aligned,
+// the whole pages are not copied: the file's own pages are mapped at
+// 'buf' copy-on-write, so 'buf' shares the server's cache until the first
+// write to each page copies it.  Until then 'buf' sees what is written
+// to the file, and the server can't evict the blocks.  Whatever doesn't
+// fill a page, and a file that isn't on the file server, is copied.
+ssize_t
+read_zc(int fdnum, void *buf, size_t n)
 {
+	struct Fd *fd;
+	size_t size, npages;
 	int r;
-	size_t tot;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || (fd->fd_omode & O_ACCMODE) == O_WRONLY
+	    || (uintptr_t) buf % PGSIZE != 0 || fd->fd_offset % PGSIZE != 0
+	    || (fd->fd_file.file.f_flags & FILE_INLINE))
+		return read(fdnum, buf, n);
+
+	size = fd->fd_file.size;
+	if (fd->fd_offset >= size)
+		return 0;
+	n = MIN(n, size - fd->fd_offset);
+	npages = n / PGSIZE;
+	if (npages > 0) {
+		// The kernel breaks the sharing when buf is written
+		if (!(env->env_fault_flags & ENV_FAULT_COW))
+			sys_env_set_fault_flags(0, env->env_fault_flags | ENV_FAULT_COW);
+		if ((r = fmap(fd, fd->fd_offset, npages)) < 0
+		    || (r = sys_page_map_range(0, fd2data(fd) + fd->fd_offset,
+					       0, buf, npages, PTE_P|PTE_U|PTE_COW)) < 0)
+			return r;
+	}
+	memmove((char *) buf + npages * PGSIZE,
+		fd2data(fd) + fd->fd_offset + npages * PGSIZE, n - npages * PGSIZE);
+	fd->fd_offset += n;
+	return n;
+}
+
+// Make room in the file for writes up to offset 'tot'.  Growing past the
+// server's size grows it geometrically, and later writes fill the room
+// with no IPC.
+static int
+file_grow(struct Fd *fd, size_t tot)
+{
+	int r;
+	size_t resv;
 
 	// don't write past the maximum file size
-	tot = offset + n;
 	if (tot > MAXFILESIZE)
 		return -E_NO_DISK;
 
 	// increase the file's size if necessary
 	if (tot > fd->fd_file.file.f_size) {
-		if ((r = file_trunc(fd, tot)) < 0)
+		resv = MAX(tot, MAX(2 * fd->fd_file.file.f_size, FILE_RESERVE_MIN));
+		resv = MIN(ROUNDUP(resv, PGSIZE), MAXFILESIZE);
+		// If the disk can't spare the room, just what's needed
+		if ((r = fsipc_set_size(fd->fd_file.id, resv)) < 0
+		    && (r = fsipc_set_size(fd->fd_file.id, tot)) < 0)
 			return r;
 	}
+	if (tot > fd->fd_file.size)
+		fd->fd_file.size = tot;
+	return 0;
+}
+
+// Write 'n' bytes from 'buf' to 'fd' at the current seek position.
+static ssize_t
+file_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
+{
+	int r;
+
+	if ((r = file_grow(fd, offset + n)) < 0)
+		return r;
 
 	// write the data
 	memmove(fd2data(fd) + offset, buf, n);
 	return n;
 }
 
+// Write all of the buffers with at most one trip to the server to grow.
+static ssize_t
+file_writev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t n;
+	int i, r;
+
+	for (i = 0, n = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+	if ((r = file_grow(fd, offset + n)) < 0)
+		return r;
+	for (i = 0, n = 0; i < iovcnt; n += iov[i].iov_len, i++)
+		memmove(fd2data(fd) + offset + n, iov[i].iov_base, iov[i].iov_len);
+	return n;
+}
+
 static int
 file_stat(struct Fd *fd, struct Stat *st)
 {
 	strcpy(st->st_name, fd->fd_file.file.f_name);
-	st->st_size = fd->fd_file.file.f_size;
+	st->st_size = fd->fd_file.size;
 	st->st_isdir = (fd->fd_file.file.f_type == FTYPE_DIR);
 	return 0;
 }
@@ -171,65 +324,183 @@ file_trunc(struct Fd *fd, off_t newsize)
 	if ((r = fsipc_set_size(fileid, newsize)) < 0)
 		return r;
 	assert(fd->fd_file.file.f_size == newsize);
+	fd->fd_file.size = newsize;
 
-	if ((r = fmap(fd, oldsize, newsize)) < 0)
-		return r;
+	// Growing maps nothing now: pages come in as they're touched
 	funmap(fd, oldsize, newsize, 0);
 
 	return 0;
 }
 
-// Call the file system server to obtain and map file pages
-// when the size of the file as mapped in our memory increases.
-// Harmlessly does nothing if oldsize >= newsize.
+static bool
+fpage_mapped(char *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+// Call the file system server to map the 'npages' file pages from
+// 'offset' on that aren't mapped yet, a few requests' worth at a time.
 // Returns 0 on success, < 0 on error.
-// If there is an error, unmaps any newly allocated pages.
 static int
-fmap(struct Fd* fd, off_t oldsize, off_t newsize)
+fmap(struct Fd *fd, off_t offset, size_t npages)
 {
-	size_t i;
+	size_t i, n;
 	char *va;
 	int r;
 
-	va = fd2data(fd);
-	for (i = ROUNDUP(oldsize, PGSIZE); i < newsize; i += PGSIZE) {
-		if ((r = fsipc_map(fd->fd_file.id, i, va + i)) < 0) {
-			// unmap anything we may have mapped so far
-			funmap(fd, i, oldsize, 0);
-			return r;
+	va = fd2data(fd) + offset;
+	for (i = 0; i < npages; i += n) {
+		if (fpage_mapped(va + i * PGSIZE)) {
+			n = 1;
+			continue;
 		}
+		// An fd the cache made has all of its pages, or nothing
+		if (fd->fd_file.id == FCACHE_FILEID)
+			return -E_INVAL;
+		// Up to the next page that's there already
+		for (n = 1; n < FSMAP_MAXPAGES && i + n < npages
+			     && !fpage_mapped(va + (i + n) * PGSIZE); n++)
+			;
+		if ((r = fsipc_map_range(fd->fd_file.id, offset + i * PGSIZE,
+					 va + i * PGSIZE, n)) <= 0)
+			return r < 0 ? r : -E_NO_DISK;
+		n = r;
 	}
 	return 0;
 }
 
+// Map the page of an open file that was touched, and a few after it in
+// case the file is being read through.
+// Returns 1 if the fault was in a file page, 0 if it wasn't ours.
+static int
+file_pgfault(struct UTrapframe *utf)
+{
+	struct Fd *fd;
+	off_t offset, size;
+	size_t n;
+	int r;
+
+	// Only missing pages; writes to read-only ones are true faults
+	if (utf->utf_err & FEC_PR)
+		return 0;
+	if (fd_data_lookup((void *) utf->utf_fault_va, &fd) < 0
+	    || fd->fd_dev_id != devfile.dev_id)
+		return 0;
+	offset = ROUNDDOWN(utf->utf_fault_va - (uintptr_t) fd2data(fd), PGSIZE);
+	size = fd->fd_file.file.f_size;
+	if (offset >= size)
+		return 0;
+	n = MIN(FAULT_PAGES, ROUNDUP(size - offset, PGSIZE) / PGSIZE);
+	if ((r = fmap(fd, offset, n)) < 0)
+		panic("file_pgfault: mapping %s at %d: %e", fd->fd_file.file.f_name, offset, r);
+	return 1;
+}
+
+static int
+close_add(int fileid, off_t offset, uint32_t npages)
+{
+	int r = 0;
+
+	if (nclose == FSCLOSE_MAXENT) {
+		r = fsipc_close_batch(closebuf, nclose);
+		nclose = 0;
+	}
+	closebuf[nclose].ce_fileid = fileid;
+	closebuf[nclose].ce_offset = offset;
+	closebuf[nclose].ce_npages = npages;
+	nclose++;
+	return r;
+}
+
+// Add the runs of written pages among the 'npages' at 'va', which hold
+// the file from 'offset' on, to the close batch.
+static int
+close_add_dirty(int fileid, char *va, off_t offset, size_t npages)
+{
+	size_t i, run;
+	int r, ret = 0;
+
+	for (i = 0, run = 0; i <= npages; i++) {
+		if (i < npages && fpage_mapped(va + i * PGSIZE)
+		    && (vpt[VPN(va + i * PGSIZE)] & PTE_D)) {
+			run++;
+			continue;
+		}
+		if (run > 0 && (r = close_add(fileid, offset + (i - run) * PGSIZE, run)) < 0)
+			ret = r;
+		run = 0;
+	}
+	return ret;
+}
+
+static int
+close_send(void)
+{
+	int r = 0;
+
+	if (nclose > 0)
+		r = fsipc_close_batch(closebuf, nclose);
+	nclose = 0;
+	return r;
+}
+
 // Unmap any file pages that no longer represent valid file pages
 // when the size of the file as mapped in our address space decreases.
+// If 'dirty', the pages written go in the close batch first.
 // Harmlessly does nothing if newsize >= oldsize.
 static int
 funmap(struct Fd* fd, off_t oldsize, off_t newsize, bool dirty)
 {
 	size_t i;
 	char *va;
-	int r, ret;
+	int ret;
 
 	va = fd2data(fd);
 
-	// Check vpd to see if anything is mapped.
-	if (!(vpd[VPD(va)] & PTE_P))
-		return 0;
-
 	ret = 0;
-	for (i = ROUNDUP(newsize, PGSIZE); i < oldsize; i += PGSIZE)
-		if (vpt[VPN(va + i)] & PTE_P) {
-			if (dirty
-			    && (vpt[VPN(va + i)] & PTE_D)
-			    && (r = fsipc_dirty(fd->fd_file.id, i)) < 0)
-				ret = r;
+	newsize = ROUNDUP(newsize, PGSIZE);
+	if (dirty && newsize < oldsize)
+		ret = close_add_dirty(fd->fd_file.id, va + newsize, newsize,
+				      (ROUNDUP(oldsize, PGSIZE) - newsize) / PGSIZE);
+	for (i = newsize; i < oldsize; i += PGSIZE)
+		// Check vpd to see if anything is mapped: the file may span
+		// several page tables
+		if (fpage_mapped(va + i))
 			sys_page_unmap(0, va + i);
-		}
   	return ret;
 }
 
+// Tell the server the size the file really has, if writing reserved
+// more
+static int
+file_publish(struct Fd *fd)
+{
+	if (fd->fd_file.size == fd->fd_file.file.f_size)
+		return 0;
+	return file_trunc(fd, fd->fd_file.size);
+}
+
+// Give the file open as fdnum its blocks from 'offset' up to 'offset +
+// len' now, in one run on disk if there's room, growing it to that size
+// if it's shorter: for a writer that knows how much it will write.
+int
+fallocate(int fdnum, off_t offset, off_t len)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	// The server puts its size in the Fd page
+	if ((r = fsipc_fallocate(fd->fd_file.id, offset, len)) < 0)
+		return r;
+	if (offset + len > fd->fd_file.size)
+		fd->fd_file.size = offset + len;
+	return 0;
+}
+
 // Delete a file
 int
 remove(const char *path)
@@ -237,10 +508,217 @@ remove(const char *path)
 	return fsipc_remove(path);
 }
 
-// Synchronize disk with buffer cache
+// Synchronize disk with buffer cache, once our open files' sizes are
+// what we've written
 int
 sync(void)
 {
+	struct Fd *fd;
+	int i;
+
+	for (i = 0; i < MAXFD; i++)
+		if (fd_lookup(i, &fd) == 0 && fd->fd_dev_id == devfile.dev_id)
+			file_publish(fd);
 	return fsipc_sync();
 }
 
+
+// Mappings made by mmap.  A shared one's pages are the server's, so
+// what's written to them is in the buffer cache already; the server
+// only needs telling which blocks are dirty, which is done at munmap
+// and, for what's still mapped, when the file is closed.
+struct Mmap {
+	char *m_va;		// 0 if the slot is free
+	size_t m_npages;
+	off_t m_offset;		// in the file
+	int m_flags;
+	struct Fd *m_fd;	// 0 once the file is closed
+};
+
+#define NMMAP	16
+
+static struct Mmap mmaps[NMMAP];
+
+// Put the pages of m written since it was mapped in the close batch.
+static int
+mmap_flush(struct Mmap *m)
+{
+	if (!(m->m_flags & MAP_SHARED) || m->m_fd == 0)
+		return 0;
+	return close_add_dirty(m->m_fd->fd_file.id, m->m_va, m->m_offset, m->m_npages);
+}
+
+// fd is being closed: put what its mappings wrote in the close batch.
+// They stay mapped, but what's written to them from now on goes nowhere.
+static int
+mmap_detach(struct Fd *fd)
+{
+	int i, r, ret = 0;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].m_va && mmaps[i].m_fd == fd) {
+			if ((r = mmap_flush(&mmaps[i])) < 0)
+				ret = r;
+			mmaps[i].m_fd = 0;
+		}
+	return ret;
+}
+
+// Map 'len' bytes of the file open as 'fdnum', from 'offset' on, at 'va'.
+// Both 'va' and 'offset' must be page-aligned, and the range must be
+// within the file: mappings don't grow it.  With MAP_SHARED the pages
+// are the file's and writes reach it, which PROT_WRITE needs the file
+// open for writing for; with MAP_PRIVATE they are copied on the first
+// write, and the file never sees it.  The pages at 'va' are replaced.
+// Returns 0 on success, < 0 on error.
+int
+mmap(void *va, size_t len, int prot, int flags, int fdnum, off_t offset)
+{
+	struct Fd *fd;
+	struct Mmap *m;
+	size_t npages;
+	int perm, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (va == 0 || (uintptr_t) va % PGSIZE != 0 || offset % PGSIZE != 0 || len == 0
+	    || offset + len > ROUNDUP(fd->fd_file.size, PGSIZE)
+	    || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+		return -E_INVAL;
+	if ((prot & PROT_WRITE) && (flags & MAP_SHARED)
+	    && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	for (m = mmaps; m < mmaps + NMMAP && m->m_va; m++)
+		;
+	if (m == mmaps + NMMAP)
+		return -E_NO_MEM;
+
+	perm = PTE_P|PTE_U;
+	if (flags & MAP_SHARED)
+		perm |= PTE_SHARE | (prot & PROT_WRITE ? PTE_W : 0);
+	else if (prot & PROT_WRITE) {
+		perm |= PTE_COW;
+		// The kernel copies the page when it's written
+		if (!(env->env_fault_flags & ENV_FAULT_COW))
+			sys_env_set_fault_flags(0, env->env_fault_flags | ENV_FAULT_COW);
+	}
+	npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+	if ((r = fmap(fd, offset, npages)) < 0
+	    || (r = sys_page_map_range(0, fd2data(fd) + offset, 0, va, npages, perm)) < 0)
+		return r;
+
+	m->m_va = va;
+	m->m_npages = npages;
+	m->m_offset = offset;
+	m->m_flags = flags;
+	m->m_fd = fd;
+	return 0;
+}
+
+// Undo the mmap at 'va', telling the server which of a shared mapping's
+// pages were written.  'len' must be what was mapped.
+int
+munmap(void *va, size_t len)
+{
+	struct Mmap *m;
+	size_t i;
+	int r;
+
+	for (m = mmaps; m < mmaps + NMMAP; m++)
+		if (m->m_va == va && m->m_npages == ROUNDUP(len, PGSIZE) / PGSIZE)
+			break;
+	if (va == 0 || m == mmaps + NMMAP)
+		return -E_INVAL;
+	nclose = 0;
+	if ((r = mmap_flush(m)) == 0)
+		r = close_send();
+	else
+		close_send();
+	for (i = 0; i < m->m_npages; i++)
+		sys_page_unmap(0, m->m_va + i * PGSIZE);
+	m->m_va = 0;
+	return r;
+}
+
+// Close every open file in as few requests as will hold them: what
+// each has written, its size, and the close all go in one batch, as
+// FSREQ_DIRTY, FSREQ_SET_SIZE and FSREQ_CLOSE would one at a time.
+// Nothing is unmapped -- this is for exit, and env_free does that --
+// so the fds stay open as far as fd_lookup knows, and the caller must
+// not use them again.
+int
+file_close_all(void)
+{
+	struct Fd *fd, *fd2;
+	int i, j, r, ret = 0;
+
+	nclose = 0;
+	for (i = 0; i < MAXFD; i++) {
+		if (fd_lookup(i, &fd) < 0 || fd->fd_dev_id != devfile.dev_id
+		    || fd->fd_file.id == FCACHE_FILEID)
+			continue;
+		if ((r = close_add_dirty(fd->fd_file.id, fd2data(fd), 0,
+					 ROUNDUP(fd->fd_file.file.f_size, PGSIZE) / PGSIZE)) < 0)
+			ret = r;
+		if ((r = mmap_detach(fd)) < 0)
+			ret = r;
+	}
+	// Then the closes, once per file however many fds share it
+	for (i = 0; i < MAXFD; i++) {
+		if (fd_lookup(i, &fd) < 0 || fd->fd_dev_id != devfile.dev_id
+		    || fd->fd_file.id == FCACHE_FILEID)
+			continue;
+		for (j = 0; j < i; j++)
+			if (fd_lookup(j, &fd2) == 0 && fd2->fd_dev_id == devfile.dev_id
+			    && fd2->fd_file.id == fd->fd_file.id)
+				break;
+		if (j == i && (r = close_add(fd->fd_file.id, fd->fd_file.size, 0)) < 0)
+			ret = r;
+	}
+	if ((r = close_send()) < 0)
+		ret = r;
+	return ret;
+}
+
+
+// The last batch of directory entries readdir got, and how far through
+// it we are.  It's good while the same directory is read on from where
+// the batch left off; a seek, or another directory, means a new one.
+static struct Fsret_readdir dirbuf;
+static int dirbuf_fileid = -1;
+static uint32_t dirbuf_pos;
+
+// Read the next entry of the directory open as fd into *ent.
+// The server sends a page of entries at a time, packed, so listing a
+// directory takes an IPC per batch and no mapping of the directory.
+// Returns 1 if there was an entry, 0 at the end, < 0 on error.
+int
+readdir(int fdnum, struct Dirent *ent)
+{
+	struct Fd *fd;
+	struct Fsdirent *d;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (dirbuf_fileid != fd->fd_file.id || dirbuf.ret_offset != fd->fd_offset
+	    || dirbuf_pos >= dirbuf.ret_len) {
+		dirbuf_fileid = -1;
+		if ((r = fsipc_readdir(fd->fd_file.id, fd->fd_offset, &dirbuf)) <= 0)
+			return r;
+		dirbuf_fileid = fd->fd_file.id;
+		dirbuf_pos = 0;
+		fd->fd_offset = dirbuf.ret_offset;
+	}
+	d = (struct Fsdirent *) (dirbuf.ret_buf + dirbuf_pos);
+	dirbuf_pos += FSDIRENT_SIZE(d->d_namelen);
+	memmove(ent->d_name, d->d_name, MIN(d->d_namelen + 1, MAXNAMELEN));
+	ent->d_name[MAXNAMELEN - 1] = 0;
+	ent->d_size = d->d_size;
+	ent->d_isdir = (d->d_type == FTYPE_DIR);
+	return 1;
+}
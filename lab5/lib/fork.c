@@ -3,9 +3,12 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
+// PTE_COW (inc/mmu.h) marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+
+// Let the kernel copy the address space and resolve copy-on-write faults
+// itself (sys_cow_fork).  Set to 0 for the library-only fork below.
+#define FORK_IN_KERNEL	1
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -38,11 +41,15 @@ pgfault(struct UTrapframe *utf)
 	
 	// LAB 4: Your code here.
 	
+    // No copy at all if nobody shares the page any more: the other side
+    // of the fork has exited, or copied it already
+    if (sys_page_cow_reuse(addr) == 0)
+        return;
     r = sys_page_alloc(0, (void *)PFTEMP, PTE_U | PTE_W | PTE_P);
     if (r < 0)
         panic("pgfault: new page allocate failed");
     addr = ROUNDDOWN(addr, PGSIZE);
-    memmove(PFTEMP, addr, PGSIZE);
+    page_copy(PFTEMP, addr);
     r = sys_page_map(0, (void *)PFTEMP, 0, addr, PTE_U | PTE_W | PTE_P);
     if (r < 0)
         panic("pgfault: page map failed");
@@ -91,6 +98,145 @@ duppage(envid_t envid, unsigned pn)
     }
 }
 
+//
+// Like duppage, but for every mapped page in [start, end), which must all
+// need the same treatment: 'perm' is PTE_U|PTE_COW|PTE_P for writable and
+// copy-on-write pages, which are then marked copy-on-write in our mapping
+// too; any other perm is used as is (read-only and, for sfork, shared pages).
+// Costs one or two system calls for the whole range.
+//
+static int
+duprange(envid_t envid, uintptr_t start, uintptr_t end, int perm)
+{
+    int r;
+    size_t npages = (end - start) / PGSIZE;
+    r = sys_page_map_range(0, (void *)start, envid, (void *)start, npages, perm);
+    if (r < 0)
+        return r;
+    if ((perm & PTE_COW) != 0)
+        return sys_page_map_range(0, (void *)start, 0, (void *)start, npages, perm);
+    return 0;
+}
+
+// What a uvm_runs classifier returns for a page to treat as unmapped:
+// not a perm, since no perm has this bit
+#define UVM_HOLE	0x10000
+
+//
+// Walk our address space over [start, end) a page table at a time, and
+// call 'map' once per run of pages that 'classify' gives the same
+// nonzero perm, with the run's bounds.  classify sees each PTE that
+// isn't 0 -- for a 4MB page the PDE, once for all of it -- and returns
+// the perm to map it with, 0 to leave it out, UVM_HOLE to treat it as
+// unmapped, or < 0 for an error.  Unmapped pages, and whole page tables
+// that aren't there, count as 'hole': UVM_HOLE to let runs go on over
+// them, since the kernel skips what isn't mapped, or 0 to end runs
+// there.  The PTEs are read straight out of vpt, a page table's worth
+// to a loop, so the cost goes with the page tables there are, not the
+// size of the range.
+//
+// Returns 0, or the first error of classify or map.
+//
+static int
+uvm_runs(uintptr_t start, uintptr_t end, int hole,
+         int (*classify)(uintptr_t va, pte_t pte, void *arg),
+         int (*map)(uintptr_t start, uintptr_t end, int perm, void *arg), void *arg)
+{
+    int r, perm, run_perm = 0;
+    uintptr_t addr, next, run = start;
+    const volatile pte_t *pt;
+    pde_t pde;
+    for (addr = start; addr < end; addr = next) {
+        next = MIN(ROUNDDOWN(addr, PTSIZE) + PTSIZE, end);
+        pde = vpd[VPD(addr)];
+        if ((pde & PTE_P) == 0 || (pde & PTE_PS) != 0) {
+            // Nothing to look at page by page
+            perm = (pde & PTE_P) ? classify(addr, pde, arg) : hole;
+            if (perm < 0)
+                return perm;
+            if (perm == UVM_HOLE || perm == run_perm)
+                continue;
+            if (run_perm != 0 && (r = map(run, addr, run_perm, arg)) < 0)
+                return r;
+            run = addr;
+            run_perm = perm;
+            continue;
+        }
+        pt = &vpt[VPN(addr)];
+        for (; addr < next; addr += PGSIZE, pt++) {
+            perm = *pt ? classify(addr, *pt, arg) : hole;
+            if (perm < 0)
+                return perm;
+            if (perm == UVM_HOLE || perm == run_perm)
+                continue;
+            if (run_perm != 0 && (r = map(run, addr, run_perm, arg)) < 0)
+                return r;
+            run = addr;
+            run_perm = perm;
+        }
+    }
+    if (run_perm != 0)
+        return map(run, end, run_perm, arg);
+    return 0;
+}
+
+// uvm_runs callbacks for dup_shared: PTE_SHARE pages, with their perms
+static int
+share_classify(uintptr_t va, pte_t pte, void *arg)
+{
+    if ((pte & (PTE_P | PTE_U | PTE_SHARE)) == (PTE_P | PTE_U | PTE_SHARE))
+        return pte & PTE_USER;
+    return 0;
+}
+
+static int
+share_map(uintptr_t start, uintptr_t end, int perm, void *arg)
+{
+    envid_t envid = *(envid_t *)arg;
+    return sys_page_map_range(0, (void *)start, envid, (void *)start,
+                              (end - start) / PGSIZE, perm);
+}
+
+//
+// Map every PTE_SHARE page of ours -- fd table pages, file and pipe data,
+// channels -- into envid at the same address and with the same
+// permissions, so that it shares them rather than getting copies.  Each
+// run of pages mapped alike takes one sys_page_map_range, and page
+// tables with nothing in them are skipped whole.  Shared pages are never
+// copy-on-write or swapped out, so our own mappings are left as they are.
+// fork and spawn both use it.
+//
+// Returns: 0 on success, < 0 on error.
+//
+int
+dup_shared(envid_t envid)
+{
+    // A run ends at any page not mapped just like it, or the kernel
+    // would map a private page in it shared too
+    return uvm_runs(0, UTOP, 0, share_classify, share_map, &envid);
+}
+
+// uvm_runs callbacks for fork: private pages copy-on-write if they're
+// writable, read-only ones as they are; swapped-out pages count, since
+// mapping them brings them back.  PTE_SHARE pages are dup_shared's.
+static int
+fork_classify(uintptr_t va, pte_t pte, void *arg)
+{
+    if ((pte & (PTE_P | PTE_SWAP)) == 0 || (pte & PTE_U) == 0)
+        return UVM_HOLE;
+    if ((pte & PTE_SHARE) != 0)
+        return 0;
+    if ((pte & (PTE_W | PTE_COW)) != 0)
+        return PTE_U | PTE_COW | PTE_P;
+    return PTE_U | PTE_P;
+}
+
+static int
+fork_map(uintptr_t start, uintptr_t end, int perm, void *arg)
+{
+    return duprange(*(envid_t *)arg, start, end, perm);
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -113,17 +259,33 @@ fork(void)
 	// LAB 4: Your code here.
 
     int r;
-    uint32_t addr;
     envid_t envid;
+    // Or the child would print what cputchar has kept back too
+    cflush();
+    if (FORK_IN_KERNEL) {
+        // The kernel snapshots the whole address space atomically, so
+        // unlike sys_exofork this needn't be inlined into fork's frame
+        envid = sys_cow_fork();
+        if (envid == 0)
+            env = env_lookup();
+        return envid;
+    }
     set_pgfault_handler(pgfault);
+    // Copy-on-write pages of ours that the child lets go of are made
+    // writable again in the kernel, without the upcall
+    sys_env_set_fault_flags(0, env->env_fault_flags | ENV_FAULT_REUSE);
     envid = sys_exofork();
     if (envid >= 0) {
         // Parent
         if (envid > 0) {
-            for (addr = UTEXT; addr < UXSTACKTOP - PGSIZE; addr += PGSIZE) {
-                if ((vpd[VPD(addr)] & PTE_P) != 0 && (vpt[VPN(addr)] & PTE_P) != 0 && (vpt[VPN(addr)] & PTE_U) != 0)
-                    duppage(envid, VPN(addr));
-            }
+            // Duplicate each run of pages mapped the same way with one
+            // batched call; unmapped pages inside a run are skipped by
+            // the kernel
+            if ((r = uvm_runs(UTEXT, UXSTACKTOP - PGSIZE, UVM_HOLE,
+                              fork_classify, fork_map, &envid)) < 0)
+                return r;
+            if ((r = dup_shared(envid)) < 0)
+                return r;
             r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P);
             if (r == 0) {
                 extern void _pgfault_upcall(void);
@@ -143,7 +305,7 @@ fork(void)
         }
         // Child
         else {
-            env = envs + ENVX(sys_getenvid());
+            env = env_lookup();
             return 0;
         }
     }
@@ -152,10 +314,84 @@ fork(void)
         return envid;
 }
 
-// Challenge!
+//
+// Give ourselves a private, writable copy of the copy-on-write page at
+// 'addr', as pgfault would on a write fault.
+//
+static int
+cowcopy(void *addr)
+{
+    int r;
+    if (sys_page_cow_reuse(addr) == 0)
+        return 0;
+    r = sys_page_alloc(0, (void *)PFTEMP, PTE_U | PTE_W | PTE_P);
+    if (r < 0)
+        return r;
+    page_copy(PFTEMP, addr);
+    r = sys_page_map(0, (void *)PFTEMP, 0, addr, PTE_U | PTE_W | PTE_P);
+    if (r < 0)
+        return r;
+    return sys_page_unmap(0, (void *)PFTEMP);
+}
+
+// uvm_runs callbacks for sfork: fork's for the private stack, and
+// everything else shared as it's mapped
+static int
+sfork_classify(uintptr_t va, pte_t pte, void *arg)
+{
+    int r;
+    if ((pte & (PTE_P | PTE_SWAP)) == 0 || (pte & PTE_U) == 0)
+        return UVM_HOLE;
+    // Private stack: copy-on-write, as in fork
+    if (va >= USTACKTOP - PTSIZE && va < USTACKTOP)
+        return fork_classify(va, pte, arg);
+    // Shared: a page that is still copy-on-write from an earlier fork
+    // must become ours first, or the first write would split it again
+    if ((pte & PTE_COW) != 0 && (r = cowcopy((void *)va)) < 0)
+        return r;
+    return upte(va) & PTE_USER;
+}
+
+//
+// Shared-memory fork.  The child shares every page with us, writable
+// ones included, except for the normal user stack -- the region below
+// USTACKTOP -- which it gets copy-on-write as in fork(), and the user
+// exception stack, which is fresh.  'env' lives on the stack (ENVSLOT),
+// so it stays private to each environment.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
 int
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+    int r;
+    envid_t envid;
+    // The console buffer is about to be shared
+    cflush();
+    cons_unbuffered = 1;
+    set_pgfault_handler(pgfault);
+    // Copy-on-write pages of ours that the child lets go of are made
+    // writable again in the kernel, without the upcall
+    sys_env_set_fault_flags(0, env->env_fault_flags | ENV_FAULT_REUSE);
+    envid = sys_exofork();
+    if (envid < 0)
+        return envid;
+    if (envid == 0) {
+        env = env_lookup();
+        return 0;
+    }
+    if ((r = uvm_runs(UTEXT, UXSTACKTOP - PGSIZE, UVM_HOLE,
+                      sfork_classify, fork_map, &envid)) < 0)
+        return r;
+    r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P);
+    if (r < 0)
+        return r;
+    extern void _pgfault_upcall(void);
+    r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
+    if (r < 0)
+        return r;
+    r = sys_env_set_status(envid, ENV_RUNNABLE);
+    if (r < 0)
+        return r;
+    return envid;
 }
@@ -37,6 +37,25 @@ putch(int ch, void *thunk)
 	}
 }
 
+static void
+putstr(const char *s, size_t n, void *thunk)
+{
+	struct printbuf *b = (struct printbuf *) thunk;
+	size_t m;
+
+	while (n > 0) {
+		m = MIN(n, 256 - b->idx);
+		memmove(b->buf + b->idx, s, m);
+		b->idx += m;
+		s += m;
+		n -= m;
+		if (b->idx == 256) {
+			writebuf(b);
+			b->idx = 0;
+		}
+	}
+}
+
 int
 vfprintf(int fd, const char *fmt, va_list ap)
 {
@@ -46,7 +65,7 @@ vfprintf(int fd, const char *fmt, va_list ap)
 	b.idx = 0;
 	b.result = 0;
 	b.error = 1;
-	vprintfmt(putch, &b, fmt, ap);
+	vprintfmt_bulk(putch, putstr, &b, fmt, ap);
 	if (b.idx > 0)
 		writebuf(&b);
 
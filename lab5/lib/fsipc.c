@@ -5,6 +5,38 @@
 
 extern uint8_t fsipcbuf[PGSIZE];	// page-aligned, declared in entry.S
 
+// fsipc_map_range's own request page: file_pgfault calls it at whatever
+// point the fault interrupted, perhaps half way through filling fsipcbuf.
+static uint8_t fsipcmapbuf[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// The request pages the server keeps for us (see FSREQ_SETUP): slot 0 is
+// fsipcbuf and slot 1 fsipcmapbuf.  The server has the physical page we
+// had at setup, so a fork, after which our next store into the page
+// gets us a copy, or another env, means giving it the page again.
+static envid_t fsslot_env[FSREQ_NSLOT];
+static physaddr_t fsslot_pa[FSREQ_NSLOT];
+
+// Make sure the server has the page at 'pg' as our request page 'slot'.
+// Returns 1 if it has, 0 if requests must bring the page along.
+static int
+fsipc_keep(int slot, void *pg)
+{
+	if (!(vpd[VPD(pg)] & PTE_P) || !(vpt[VPN(pg)] & PTE_P))
+		return 0;
+	if (fsslot_env[slot] == env->env_id && fsslot_pa[slot] == PTE_ADDR(vpt[VPN(pg)]))
+		return 1;
+	// A copy-on-write page is about to be replaced; have it done now
+	if (!(vpt[VPN(pg)] & PTE_W))
+		*(volatile uint8_t *) pg = *(volatile uint8_t *) pg;
+	// The server's lease page comes back (see lib/fcache.c)
+	if (ipc_call(envs[1].env_id, FSREQ_SETUP_SLOT(slot), pg, PTE_P | PTE_W | PTE_U,
+		     (void *) FCACHE, 0) < 0)
+		return 0;
+	fsslot_env[slot] = env->env_id;
+	fsslot_pa[slot] = PTE_ADDR(vpt[VPN(pg)]);
+	return 1;
+}
+
 // Send an IP request to the file server, and wait for a reply.
 // type: request code, passed as the simple integer IPC value.
 // fsreq: page to send containing additional request data, usually fsipcbuf.
@@ -15,13 +47,17 @@ extern uint8_t fsipcbuf[PGSIZE];	// page-aligned, declared in entry.S
 static int
 fsipc(unsigned type, void *fsreq, void *dstva, int *perm)
 {
-	envid_t whom;
+	int slot;
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", env->env_id, type, fsipcbuf);
 
-	ipc_send(envs[1].env_id, type, fsreq, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(&whom, dstva, perm);
+	// One trap sends the request and waits for the reply, with no page
+	// to map if the server has this one already
+	slot = fsreq == fsipcbuf ? 0 : fsreq == fsipcmapbuf ? 1 : -1;
+	if (slot >= 0 && fsipc_keep(slot, fsreq))
+		return ipc_call(envs[1].env_id, FSREQ_INSLOT(type, slot), 0, 0, dstva, perm);
+	return ipc_call(envs[1].env_id, type, fsreq, PTE_P | PTE_W | PTE_U, dstva, perm);
 }
 
 // Send file-open request to the file server.
@@ -64,16 +100,62 @@ fsipc_map(int fileid, off_t offset, void *dstva)
 	return 0;
 }
 
+// Ask the file server to map up to 'npages' blocks from 'offset' on at
+// dstva, all in one request.
+// Returns the number of blocks mapped, < 0 on failure.
+int
+fsipc_map_range(int fileid, off_t offset, void *dstva, size_t npages)
+{
+	int r;
+	struct Fsreq_map_range *req;
+
+	if ((r = sys_page_grant(0, envs[1].env_id, dstva, npages)) < 0)
+		return r;
+	req = (struct Fsreq_map_range*) fsipcmapbuf;
+	req->req_fileid = fileid;
+	req->req_offset = offset;
+	req->req_npages = npages;
+	req->req_va = (uintptr_t) dstva;
+	r = fsipc(FSREQ_MAP_RANGE, req, 0, 0);
+	sys_page_grant(0, 0, 0, 0);
+	return r;
+}
+
+// Ask the file server to load the program open as 'fileid' into the new
+// environment 'child': it maps the text and the file's whole pages of
+// data (copy-on-write) straight into child, and describes the loadable
+// segments in *ret so that we can fill in the rest.
+// Returns 0 on success, < 0 on failure.
+int
+fsipc_exec(int fileid, envid_t child, struct Fsret_exec *ret)
+{
+	int r;
+	struct Fsreq_exec *req;
+
+	if ((r = sys_page_grant(child, envs[1].env_id, (void *) UTEXT,
+				(USTACKTOP - PGSIZE - UTEXT) / PGSIZE)) < 0)
+		return r;
+	req = (struct Fsreq_exec*) fsipcbuf;
+	req->req_fileid = fileid;
+	req->req_child = child;
+	if ((r = fsipc(FSREQ_EXEC, req, 0, 0)) >= 0)
+		memmove(ret, fsipcbuf, sizeof(*ret));
+	sys_page_grant(child, 0, 0, 0);
+	return r;
+}
+
 // Make a set-file-size request to the file server.
 int
 fsipc_set_size(int fileid, off_t size)
 {
-	struct Fsreq_set_size *req;
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_SET_SIZE), fileid, size, 0);
+}
 
-	req = (struct Fsreq_set_size*) fsipcbuf;
-	req->req_fileid = fileid;
-	req->req_size = size;
-	return fsipc(FSREQ_SET_SIZE, req, 0, 0);
+// Make a request to allocate a file's blocks up front.
+int
+fsipc_fallocate(int fileid, off_t offset, off_t len)
+{
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_FALLOCATE), fileid, offset, len);
 }
 
 // Make a file-close request to the file server.
@@ -81,23 +163,28 @@ fsipc_set_size(int fileid, off_t size)
 int
 fsipc_close(int fileid)
 {
-	struct Fsreq_close *req;
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_CLOSE), fileid, 0, 0);
+}
 
-	req = (struct Fsreq_close*) fsipcbuf;
-	req->req_fileid = fileid;
-	return fsipc(FSREQ_CLOSE, req, 0, 0);
+// Send the file server the 'n' entries of a close batch.
+int
+fsipc_close_batch(const struct Fsclose_ent *ent, uint32_t n)
+{
+	struct Fsreq_close_batch *req;
+
+	if (n > FSCLOSE_MAXENT)
+		return -E_INVAL;
+	req = (struct Fsreq_close_batch*) fsipcbuf;
+	req->req_n = n;
+	memmove(req->req_ent, ent, n * sizeof(*ent));
+	return fsipc(FSREQ_CLOSE_BATCH, req, 0, 0);
 }
 
 // Ask the file server to mark a particular file block dirty.
 int
 fsipc_dirty(int fileid, off_t offset)
 {
-	struct Fsreq_dirty *req;
-
-	req = (struct Fsreq_dirty*) fsipcbuf;
-	req->req_fileid = fileid;
-	req->req_offset = offset;
-	return fsipc(FSREQ_DIRTY, req, 0, 0);
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_DIRTY), fileid, offset, 0);
 }
 
 // Ask the file server to delete a file, given its pathname.
@@ -118,6 +205,67 @@ fsipc_remove(const char *path)
 int
 fsipc_sync(void)
 {
-	return fsipc(FSREQ_SYNC, fsipcbuf, 0, 0);
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_SYNC), 0, 0, 0);
+}
+
+// Ask the file server to sync, then forget the blocks it has cached,
+// so that they're read from the disk again.  Returns how many it
+// forgot.
+int
+fsipc_drop_cache(void)
+{
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_DROP_CACHE), 0, 0, 0);
+}
+
+// Ask the file server to do snapshot operation 'op' (SNAPREQ_*, see
+// inc/fs.h), with a store of nblocks blocks for SNAPREQ_TAKE.
+int
+fsipc_snapshot(int op, uint32_t nblocks)
+{
+	return ipc_call_short(envs[1].env_id, FSREQ_INREGS(FSREQ_SNAPSHOT), op, nblocks, 0);
+}
+
+
+// Ask the file server for the entries of the directory open as 'fileid'
+// from 'offset' on, a page of them at most, copying them into *ret.
+// Returns the number of entries, 0 at the end, < 0 on failure.
+int
+fsipc_readdir(int fileid, off_t offset, struct Fsret_readdir *ret)
+{
+	int r;
+	struct Fsreq_readdir *req;
+	struct Fsret_readdir *rret;
+
+	req = (struct Fsreq_readdir*) fsipcbuf;
+	req->req_fileid = fileid;
+	req->req_offset = offset;
+	if ((r = fsipc(FSREQ_READDIR, req, 0, 0)) >= 0) {
+		rret = (struct Fsret_readdir*) fsipcbuf;
+		memmove(ret, rret, offsetof(struct Fsret_readdir, ret_buf)
+			+ MIN(rret->ret_len, sizeof(rret->ret_buf)));
+	}
+	return r;
 }
 
+// Ask the file server about 'path' without opening it.
+// Returns 0 on success, < 0 on failure.
+int
+fsipc_stat(const char *path, struct Stat *st)
+{
+	int r;
+	struct Fsreq_stat *req;
+	struct Fsret_stat *ret;
+
+	req = (struct Fsreq_stat*) fsipcbuf;
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(req->req_path, path);
+	if ((r = fsipc(FSREQ_STAT, req, 0, 0)) < 0)
+		return r;
+	ret = (struct Fsret_stat*) fsipcbuf;
+	strcpy(st->st_name, ret->ret_name);
+	st->st_size = ret->ret_size;
+	st->st_isdir = ret->ret_isdir;
+	st->st_dev = &devfile;
+	return 0;
+}
@@ -43,12 +43,44 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
         return env->env_ipc_value;
 }
 
+// ipc_recv with sys_ipc_recv_range's 'ticks' and 'flags'
+static int32_t
+ipc_recv_flags(envid_t *from_env_store, void *pg, int *perm_store,
+               uint32_t ticks, int flags)
+{
+    int err;
+    err = sys_ipc_recv_range(pg != NULL ? pg : (void *)UTOP, 1, ticks, flags);
+    if (from_env_store != NULL)
+        *from_env_store = err < 0 ? 0 : env->env_ipc_from;
+    if (perm_store != NULL)
+        *perm_store = err < 0 ? 0 : env->env_ipc_perm;
+    if (err < 0)
+        return err;
+    return env->env_ipc_value;
+}
+
+// As ipc_recv, but if nothing has come after 'ticks' clock ticks, give
+// up and return -E_TIMEOUT.  'ticks' 0 waits as long as ipc_recv does.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store, uint32_t ticks)
+{
+    return ipc_recv_flags(from_env_store, pg, perm_store, ticks, 0);
+}
+
+// As ipc_recv, but only take a message that's already waiting: a sender
+// blocked in ipc_send or ipc_call, or one of our IRQs.  Returns
+// -E_TIMEOUT if there's none.
+int32_t
+ipc_poll(envid_t *from_env_store, void *pg, int *perm_store)
+{
+    return ipc_recv_flags(from_env_store, pg, perm_store, 0, IPC_NONBLOCK);
+}
+
 // Send 'val' (and 'pg' with 'perm', assuming 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function sleeps in the kernel until 'toenv' receives it.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -70,11 +102,103 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
      *}
      *while (err < 0);
      */
-    while ((err = sys_ipc_try_send(to_env, val, pg != NULL ? pg : (void *)UTOP, perm)) < 0) {
-        if (err != -E_IPC_NOT_RECV)
-            panic("ipc_send: send message failed. %e", err);
-        sys_yield();
-    }
+    // Blocks in the kernel's send queue for to_env instead of polling
+    // with sys_ipc_try_send and sys_yield
+    err = sys_ipc_send(to_env, val, pg != NULL ? pg : (void *)UTOP, perm);
+    if (err < 0)
+        panic("ipc_send: send message failed. %e", err);
     /*cprintf("ipc_send: env 0x%x perm 0x%x envid 0x%x va 0x%x\n", envs + 1, envs[1].env_ipc_perm, envs[1].env_id, pg);*/
 }
 
+// ipc_send, but with the 'npages' pages from 'pg', in one rendezvous
+// rather than a send for each.  The receiver gets as many as it asked
+// for with ipc_recv_range.
+void
+ipc_send_range(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
+{
+    int err;
+    err = sys_ipc_send_range(to_env, val, pg != NULL ? pg : (void *)UTOP, npages, perm);
+    if (err < 0)
+        panic("ipc_send_range: send message failed. %e", err);
+}
+
+// ipc_recv, but take up to 'npages' pages, mapped from 'pg' on, as
+// ipc_send_range sends them.  If 'npages_store' is nonnull, store how
+// many came there (0 on failure).
+int32_t
+ipc_recv_range(envid_t *from_env_store, void *pg, size_t npages,
+               size_t *npages_store, int *perm_store)
+{
+    int err;
+    err = sys_ipc_recv_range(pg != NULL ? pg : (void *)UTOP, npages, 0, 0);
+    if (from_env_store != NULL)
+        *from_env_store = err < 0 ? 0 : env->env_ipc_from;
+    if (npages_store != NULL)
+        *npages_store = err < 0 ? 0 : env->env_ipc_npages;
+    if (perm_store != NULL)
+        *perm_store = err < 0 ? 0 : env->env_ipc_perm;
+    if (err < 0)
+        return err;
+    return env->env_ipc_value;
+}
+
+
+// Send 'val' (and 'pg' with 'perm') to 'to_env' and wait for its answer,
+// which is received as by ipc_recv(NULL, rcv_pg, perm_store).  Costs one
+// trap; if 'to_env' isn't receiving yet we sleep in its send queue.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg, int *perm_store)
+{
+    int err;
+    err = sys_ipc_call(to_env, val, pg != NULL ? pg : (void *)UTOP, perm,
+                       rcv_pg != NULL ? rcv_pg : (void *)UTOP);
+    if (perm_store != NULL)
+        *perm_store = err < 0 ? 0 : env->env_ipc_perm;
+    if (err < 0)
+        return err;
+    return env->env_ipc_value;
+}
+
+// Short messages: send 'val' and the words w0..w2 to 'to_env', with no
+// page.  The receiver finds the words in env->env_ipc_words, as it finds
+// the value in env->env_ipc_value.  Panics on error, as ipc_send does.
+void
+ipc_send_short(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+    int err;
+    err = sys_ipc_send_short(to_env, val, w0, w1, w2);
+    if (err < 0)
+        panic("ipc_send_short: send message failed. %e", err);
+}
+
+// ipc_call with a short message, receiving an answer with no page.
+int32_t
+ipc_call_short(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+    int err;
+    err = sys_ipc_call_short(to_env, val, w0, w1, w2);
+    if (err < 0)
+        return err;
+    return env->env_ipc_value;
+}
+
+// Server loop step: send the reply 'val' (and 'pg' with 'perm') to
+// 'to_env', a client blocked in ipc_call, then wait for the next
+// request as ipc_recv(from_env_store, rcv_pg, perm_store) would.
+// 'to_env' 0 sends nothing.  Lost replies (the client is gone) are
+// silently dropped by the kernel.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg,
+               envid_t *from_env_store, int *perm_store)
+{
+    int err;
+    err = sys_ipc_reply_wait(to_env, val, pg != NULL ? pg : (void *)UTOP, perm,
+                             rcv_pg != NULL ? rcv_pg : (void *)UTOP);
+    if (from_env_store != NULL)
+        *from_env_store = err < 0 ? 0 : env->env_ipc_from;
+    if (perm_store != NULL)
+        *perm_store = err < 0 ? 0 : env->env_ipc_perm;
+    if (err < 0)
+        return err;
+    return env->env_ipc_value;
+}
@@ -3,22 +3,25 @@
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
+// The most the stack grows to.  Below the page it starts with, at
+// USTACKTOP - PGSIZE, the kernel maps pages as they're touched.
+#define STACKSIZE	(256 * PGSIZE)
 
-volatile struct Env *env;
 char *binaryname = "(PROGRAM NAME UNKNOWN)";
 
 void
-libmain(int argc, char **argv)
+libmain(void (*umain)(int argc, char **argv), int argc, char **argv)
 {
 	// set env to point at our env structure in envs[].
 	// LAB 3: Your code here.
-	env = envs + ENVX(sys_getenvid());
+	env = env_lookup();
 
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
 
+	sys_page_autogrow((void *) (USTACKTOP - STACKSIZE), STACKSIZE - PGSIZE);
+
 	// call user main routine
 	umain(argc, argv);
 
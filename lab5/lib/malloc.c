@@ -0,0 +1,218 @@
+// User-level heap: malloc and free.
+//
+// The heap lives in [HEAPBASE, HEAPBASE + HEAPPAGES pages), an
+// auto-grow region (see sys_page_autogrow), so the kernel maps each
+// page when it's first touched; heap_used marks which pages are taken.
+// If the region can't be had, pages are mapped with sys_page_alloc as
+// runs are handed out, and running out of memory makes malloc return
+// NULL rather than fault.  Memory is handed out in runs of pages, each
+// starting with a struct Run, so free() finds an object's run by
+// rounding its address down to a page.
+//
+// A small request (up to MAXSMALL bytes) is rounded up to a power of
+// two and carved from a one-page run of that size class; the free
+// objects of a run are linked through their first words, and the runs
+// of a class with free objects are on class_runs.  A larger request
+// gets a run of its own, big enough for the header and the request.
+// Runs that empty go back to the kernel with sys_page_unmap, except one
+// small run per class, so that a malloc-free loop doesn't trap.
+
+#include <inc/lib.h>
+
+#define HEAPBASE	0x08000000
+#define HEAPPAGES	16384		// 64MB
+
+#define MINSHIFT	4		// 16 bytes
+#define NCLASS		7		// up to 1024 bytes
+#define MAXSMALL	(1 << (MINSHIFT + NCLASS - 1))
+
+#define RUN_SMALL	0x5a11
+#define RUN_LARGE	0x1a26
+
+struct Run {
+	uint16_t r_magic;		// RUN_SMALL or RUN_LARGE
+	uint16_t r_class;
+	uint16_t r_nobj;		// small runs: objects in the run
+	uint16_t r_nfree;		// and how many are free
+	uint32_t r_npages;
+	void *r_free;			// free objects, linked through their first word
+	struct Run *r_next;		// on class_runs, while r_nfree > 0
+	struct Run *r_prev;
+};
+
+// Objects start this far into a run: the header, keeping them 16-aligned
+#define RUNHDR		ROUNDUP(sizeof(struct Run), 16)
+
+static uint32_t heap_used[HEAPPAGES / 32];
+static uint32_t heap_hint;		// no free page below this one
+static struct Run *class_runs[NCLASS];
+static bool heap_init;
+static bool heap_autogrow;		// the kernel maps pages as they're touched
+
+static bool
+heap_test(uint32_t i)
+{
+	return heap_used[i / 32] & (1 << (i % 32));
+}
+
+static void
+heap_mark(uint32_t i, uint32_t n, bool used)
+{
+	for (; n > 0; i++, n--)
+		if (used)
+			heap_used[i / 32] |= 1 << (i % 32);
+		else
+			heap_used[i / 32] &= ~(1 << (i % 32));
+}
+
+static void
+run_unmap(struct Run *r, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, (char *) r + i * PGSIZE);
+}
+
+// Map a run of 'npages' heap pages, first fit, or return NULL.
+static struct Run *
+run_alloc(uint32_t npages)
+{
+	uint32_t i, n;
+	struct Run *r;
+	int err;
+
+	for (i = heap_hint, n = 0; i < HEAPPAGES && n < npages; i++)
+		n = heap_test(i) ? 0 : n + 1;
+	if (n < npages)
+		return NULL;
+	i -= npages;
+	r = (struct Run *) (HEAPBASE + i * PGSIZE);
+	if (!heap_init) {
+		heap_autogrow = sys_page_autogrow((void *) HEAPBASE, HEAPPAGES * PGSIZE) == 0;
+		heap_init = 1;
+	}
+	for (n = 0; !heap_autogrow && n < npages; n++)
+		if ((err = sys_page_alloc(0, (char *) r + n * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0) {
+			run_unmap(r, n);
+			return NULL;
+		}
+	heap_mark(i, npages, 1);
+	if (i == heap_hint)
+		for (heap_hint = i + npages; heap_hint < HEAPPAGES && heap_test(heap_hint); heap_hint++)
+			/* skip used pages */;
+	r->r_npages = npages;
+	return r;
+}
+
+static void
+run_free(struct Run *r)
+{
+	uint32_t i = ((uintptr_t) r - HEAPBASE) / PGSIZE, n = r->r_npages;
+
+	run_unmap(r, n);
+	heap_mark(i, n, 0);
+	heap_hint = MIN(heap_hint, i);
+}
+
+static void
+class_unlink(struct Run *r)
+{
+	if (r->r_prev)
+		r->r_prev->r_next = r->r_next;
+	else
+		class_runs[r->r_class] = r->r_next;
+	if (r->r_next)
+		r->r_next->r_prev = r->r_prev;
+}
+
+static void
+class_link(struct Run *r)
+{
+	r->r_prev = NULL;
+	r->r_next = class_runs[r->r_class];
+	if (r->r_next)
+		r->r_next->r_prev = r;
+	class_runs[r->r_class] = r;
+}
+
+// A fresh run for size class c, all its objects free.
+static struct Run *
+class_refill(int c)
+{
+	struct Run *r;
+	uint32_t size = 1 << (MINSHIFT + c), i;
+	char *obj;
+
+	if ((r = run_alloc(1)) == NULL)
+		return NULL;
+	r->r_magic = RUN_SMALL;
+	r->r_class = c;
+	r->r_nobj = r->r_nfree = (PGSIZE - RUNHDR) / size;
+	r->r_free = NULL;
+	for (i = r->r_nobj; i > 0; i--) {
+		obj = (char *) r + RUNHDR + (i - 1) * size;
+		*(void **) obj = r->r_free;
+		r->r_free = obj;
+	}
+	class_link(r);
+	return r;
+}
+
+void *
+malloc(size_t size)
+{
+	struct Run *r;
+	void *obj;
+	int c;
+
+	if (size == 0)
+		return NULL;
+	if (size > MAXSMALL) {
+		if (size > HEAPPAGES * PGSIZE - RUNHDR)
+			return NULL;
+		if ((r = run_alloc(ROUNDUP(size + RUNHDR, PGSIZE) / PGSIZE)) == NULL)
+			return NULL;
+		r->r_magic = RUN_LARGE;
+		return (char *) r + RUNHDR;
+	}
+
+	for (c = 0; (1U << (MINSHIFT + c)) < size; c++)
+		/* find the smallest class that fits */;
+	if ((r = class_runs[c]) == NULL && (r = class_refill(c)) == NULL)
+		return NULL;
+	obj = r->r_free;
+	r->r_free = *(void **) obj;
+	if (--r->r_nfree == 0)
+		class_unlink(r);
+	return obj;
+}
+
+void
+free(void *addr)
+{
+	struct Run *r;
+
+	if (addr == NULL)
+		return;
+	r = ROUNDDOWN(addr, PGSIZE);
+	if ((uintptr_t) addr < HEAPBASE || (uintptr_t) addr >= HEAPBASE + HEAPPAGES * PGSIZE
+	    || (r->r_magic != RUN_SMALL && r->r_magic != RUN_LARGE))
+		panic("free: %08x was not malloced", addr);
+	if (r->r_magic == RUN_LARGE) {
+		if (addr != (char *) r + RUNHDR)
+			panic("free: %08x was not malloced", addr);
+		run_free(r);
+		return;
+	}
+
+	*(void **) addr = r->r_free;
+	r->r_free = addr;
+	if (r->r_nfree++ == 0)
+		class_link(r);
+	// An empty run goes back, unless it's the only one its class has
+	else if (r->r_nfree == r->r_nobj && (r->r_next || r->r_prev)) {
+		class_unlink(r);
+		run_free(r);
+	}
+}
@@ -0,0 +1,115 @@
+// Requests to the network server (net/serv.c).
+
+#include <inc/ns.h>
+#include <inc/lib.h>
+
+#define debug 0
+
+static uint8_t nsipcbuf[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// The server keeps the physical page we last brought it as our request
+// page.  After a fork, our next store into nsipcbuf gets us a copy; so
+// does the child's, and it isn't us anyway: then we bring it again.
+static envid_t nsbuf_env;
+static physaddr_t nsbuf_pa;
+
+// Send the request in nsipcbuf to the network server, and wait for the
+// answer.  Returns the answer, < 0 on failure.
+static int
+nsipc(unsigned type)
+{
+	envid_t ns = envs[NS_ENVX].env_id;
+	int r;
+
+	if (debug)
+		cprintf("[%08x] nsipc %d\n", env->env_id, type);
+
+	if (nsbuf_env == env->env_id && nsbuf_pa == PTE_ADDR(vpt[VPN(nsipcbuf)]))
+		return ipc_call(ns, type, 0, 0, 0, 0);
+	// A copy-on-write page is about to be replaced; have it done now
+	if (!(vpt[VPN(nsipcbuf)] & PTE_W))
+		*(volatile uint8_t *) nsipcbuf = *(volatile uint8_t *) nsipcbuf;
+	if ((r = ipc_call(ns, type, nsipcbuf, PTE_P|PTE_W|PTE_U, 0, 0)) >= 0) {
+		nsbuf_env = env->env_id;
+		nsbuf_pa = PTE_ADDR(vpt[VPN(nsipcbuf)]);
+	}
+	return r;
+}
+
+// Ask for a request that maps a socket's rings at va: let the server
+// map them there, but only for as long as it takes.
+static int
+nsipc_granting(unsigned type, void *va)
+{
+	int r;
+
+	if ((r = sys_page_grant(0, envs[NS_ENVX].env_id, va, SOCK_NPAGES)) < 0)
+		return r;
+	r = nsipc(type);
+	sys_page_grant(0, 0, 0, 0);
+	return r;
+}
+
+// Make a socket with its rings at va.  Returns its id.
+int
+nsipc_socket(void *va)
+{
+	struct Nsreq_socket *req = (struct Nsreq_socket *) nsipcbuf;
+
+	req->req_va = (uintptr_t) va;
+	return nsipc_granting(NSREQ_SOCKET, va);
+}
+
+int
+nsipc_bind(int sockid, const struct sockaddr_in *addr)
+{
+	struct Nsreq_bind *req = (struct Nsreq_bind *) nsipcbuf;
+
+	req->req_sockid = sockid;
+	req->req_addr = *addr;
+	return nsipc(NSREQ_BIND);
+}
+
+int
+nsipc_listen(int sockid, int backlog)
+{
+	struct Nsreq_listen *req = (struct Nsreq_listen *) nsipcbuf;
+
+	req->req_sockid = sockid;
+	req->req_backlog = backlog;
+	return nsipc(NSREQ_LISTEN);
+}
+
+// Wait for a connection to the listening socket sockid, and map its
+// rings at va.  Returns the new socket's id, and the peer in *addr.
+int
+nsipc_accept(int sockid, void *va, struct sockaddr_in *addr)
+{
+	struct Nsreq_accept *req = (struct Nsreq_accept *) nsipcbuf;
+	int r;
+
+	req->req_sockid = sockid;
+	req->req_va = (uintptr_t) va;
+	if ((r = nsipc_granting(NSREQ_ACCEPT, va)) >= 0 && addr)
+		*addr = req->ret_addr;
+	return r;
+}
+
+int
+nsipc_connect(int sockid, const struct sockaddr_in *addr)
+{
+	struct Nsreq_connect *req = (struct Nsreq_connect *) nsipcbuf;
+
+	req->req_sockid = sockid;
+	req->req_addr = *addr;
+	return nsipc(NSREQ_CONNECT);
+}
+
+int
+nsipc_close(int sockid)
+{
+	struct Nsreq_close *req = (struct Nsreq_close *) nsipcbuf;
+
+	req->req_sockid = sockid;
+	return nsipc(NSREQ_CLOSE);
+}
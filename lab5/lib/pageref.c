@@ -5,10 +5,25 @@ pageref(void *v)
 {
 	pte_t pte;
 
-	if (!(vpd[PDX(v)] & PTE_P))
-		return 0;
-	pte = vpt[VPN(v)];
+	pte = upte((uintptr_t) v);
 	if (!(pte & PTE_P))
 		return 0;
+	if (pte & PTE_PS)
+		return pages[PPN(PTE_PS_ADDR(pte)) + PTX(v)].pp_ref;
 	return pages[PPN(pte)].pp_ref;
 }
+
+// The entry in our page tables that maps va: its PTE, or the PDE itself
+// if va is in a 4MB page (PTE_PS), where vpt holds no PTE at all; 0 if
+// there's no page table.
+pte_t
+upte(uintptr_t va)
+{
+	pde_t pde = vpd[VPD(va)];
+
+	if (!(pde & PTE_P))
+		return 0;
+	if (pde & PTE_PS)
+		return pde;
+	return vpt[VPN(va)];
+}
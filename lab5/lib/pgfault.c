@@ -9,18 +9,36 @@
 extern void _pgfault_upcall(void);
 
 // Pointer to currently installed C-language pgfault handler.
+// Once there is one, it is pgfault_dispatch.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
+// The handler set_pgfault_handler installed, and the ones library code
+// added with add_pgfault_handler, which pgfault_dispatch tries first.
+#define NPGFAULT_LIB	4
+static void (*pgfault_user)(struct UTrapframe *utf);
+static int (*pgfault_lib[NPGFAULT_LIB])(struct UTrapframe *utf);
+static int npgfault_lib;
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
+{
+	int i;
+
+	for (i = 0; i < npgfault_lib; i++)
+		if (pgfault_lib[i](utf))
+			return;
+	if (pgfault_user == 0)
+		panic("page fault va %08x ip %08x err %x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	pgfault_user(utf);
+}
+
 // The first time we register a handler, we need to 
 // allocate an exception stack (one page of memory with its top
 // at UXSTACKTOP), and tell the kernel to call the assembly-language
 // _pgfault_upcall routine when a page fault occurs.
-//
-void
-set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+static void
+pgfault_install(void)
 {
 	int r;
 
@@ -34,6 +52,37 @@ set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 	}
 
 	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	_pgfault_handler = pgfault_dispatch;
+}
+
+//
+// Set the page fault handler function.
+// It sees every fault the handlers added with add_pgfault_handler
+// don't claim.
+//
+void
+set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+{
+	pgfault_install();
+	pgfault_user = handler;
 }
 
+//
+// Add a handler for faults that library code resolves on its own, such
+// as touching a file page that isn't mapped yet (lib/file.c).  It
+// returns 1 if it dealt with the fault and 0 to pass it on.
+// Adding the same handler again does nothing.
+//
+void
+add_pgfault_handler(int (*handler)(struct UTrapframe *utf))
+{
+	int i;
+
+	for (i = 0; i < npgfault_lib; i++)
+		if (pgfault_lib[i] == handler)
+			return;
+	if (npgfault_lib == NPGFAULT_LIB)
+		panic("add_pgfault_handler: too many handlers");
+	pgfault_install();
+	pgfault_lib[npgfault_lib++] = handler;
+}
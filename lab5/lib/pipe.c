@@ -0,0 +1,36 @@
+// Pipes: channels (lib/chan.c) with a ring big enough that a writer
+// seldom fills it.  Reads and writes are plain copies to and from the
+// shared ring; only an empty or full ring costs a system call.
+
+#include <inc/lib.h>
+
+// Pages of buffer behind each pipe (a power of two)
+#define PIPEBUFPAGES	4
+
+struct Dev devpipe =
+{
+	.dev_id =	'p',
+	.dev_name =	"pipe",
+	.dev_read =	chan_fdread,
+	.dev_write =	chan_fdwrite,
+	.dev_close =	chan_fdclose,
+	.dev_stat =	chan_fdstat,
+	.dev_readv =	chan_fdreadv,
+	.dev_writev =	chan_fdwritev,
+	.dev_poll =	chan_fdpoll,
+};
+
+// Create a pipe: pfd[0] is the read end, pfd[1] the write end.
+// Returns 0 on success, < 0 on failure.
+int
+pipe(int pfd[2])
+{
+	return chan_alloc(pfd, &devpipe, PIPEBUFPAGES);
+}
+
+// Has everyone else closed their end of the pipe?
+int
+pipeisclosed(int fdnum)
+{
+	return chan_isclosed(fdnum);
+}
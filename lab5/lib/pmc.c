@@ -0,0 +1,24 @@
+// Reading the performance counters from user mode (see inc/pmc.h).
+
+#include <inc/lib.h>
+
+// This env's count for PMC_* counter i, or 0 if the CPU hasn't got it.
+uint64_t
+pmc_read(int i)
+{
+	static int n = -1;
+	uint32_t runs;
+	uint64_t v;
+
+	if (n < 0)
+		n = pmc_ncounters();
+	if (i < 0 || i >= n)
+		return 0;
+	// A switch between reading env_pmc and the counter would lose
+	// what was counted before it; env_runs says whether there was one
+	do {
+		runs = env->env_runs;
+		v = env->env_pmc[i] + rdpmc(i);
+	} while (runs != env->env_runs);
+	return v;
+}
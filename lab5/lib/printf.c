@@ -34,14 +34,35 @@ putch(int ch, struct printbuf *b)
 	b->cnt++;
 }
 
+static void
+putstr(const char *s, size_t n, struct printbuf *b)
+{
+	size_t m;
+
+	while (n > 0) {
+		m = MIN(n, 256-1 - b->idx);
+		memmove(b->buf + b->idx, s, m);
+		b->idx += m;
+		b->cnt += m;
+		s += m;
+		n -= m;
+		if (b->idx == 256-1) {
+			sys_cputs(b->buf, b->idx);
+			b->idx = 0;
+		}
+	}
+}
+
 int
 vcprintf(const char *fmt, va_list ap)
 {
 	struct printbuf b;
 
+	// Whatever cputchar kept back came first
+	cflush();
 	b.idx = 0;
 	b.cnt = 0;
-	vprintfmt((void*)putch, &b, fmt, ap);
+	vprintfmt_bulk((void*)putch, (void*)putstr, &b, fmt, ap);
 	sys_cputs(b.buf, b.idx);
 
 	return b.cnt;
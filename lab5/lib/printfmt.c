@@ -37,27 +37,73 @@ static const char * const error_string[MAXERROR + 1] =
 	"invalid path",
 	"file already exists",
 	"file is not a valid executable",
+	"network is down",
+	"connection refused",
+	"connection timed out",
+	"address already in use",
+	"timed out",
 };
 
+// Where vprintfmt's output goes: each character to putch, or runs of
+// them -- literal text, strings, converted numbers -- to putstr, if
+// there is one.
+struct fmtout {
+	void (*putch)(int, void*);
+	void (*putstr)(const char*, size_t, void*);
+	void *putdat;
+};
+
+static void
+fmt_out(const struct fmtout *o, const char *s, size_t n)
+{
+	if (o->putstr)
+		o->putstr(s, n, o->putdat);
+	else
+		while (n-- > 0)
+			o->putch(*s++, o->putdat);
+}
+
+// n copies of c
+static void
+fmt_pad(const struct fmtout *o, int c, int n)
+{
+	char pad[16];
+	int m;
+
+	if (n <= 0)
+		return;
+	memset(pad, c, MIN(n, sizeof(pad)));
+	for (; n > 0; n -= m) {
+		m = MIN(n, sizeof(pad));
+		fmt_out(o, pad, m);
+	}
+}
+
 /*
- * Print a number (base <= 16) in reverse order,
- * using specified putch function and associated pointer putdat.
+ * Print a number (base <= 16), padded on the left with padc to width.
+ * The digits come out least significant first, into a buffer; 32 bits
+ * at a time when the number fits, since 64-bit division is slow.
  */
 static void
-printnum(void (*putch)(int, void*), void *putdat,
-	 unsigned long long num, unsigned base, int width, int padc)
+printnum(const struct fmtout *o, unsigned long long num, unsigned base,
+	 int width, int padc)
 {
-	// first recursively print all preceding (more significant) digits
-	if (num >= base) {
-		printnum(putch, putdat, num / base, base, width - 1, padc);
-	} else {
-		// print any needed pad characters before first digit
-		while (--width > 0)
-			putch(padc, putdat);
+	static const char digits[] = "0123456789abcdef";
+	char buf[24];		// enough for 64 bits in octal
+	char *p = buf + sizeof(buf);
+	uint32_t n32;
+
+	while (num > 0xFFFFFFFFULL) {
+		*--p = digits[num % base];
+		num /= base;
 	}
-
-	// then print this (the least significant) digit
-	putch("0123456789abcdef"[num % base], putdat);
+	n32 = num;
+	do {
+		*--p = digits[n32 % base];
+		n32 /= base;
+	} while (n32 != 0);
+	fmt_pad(o, padc, width - (buf + sizeof(buf) - p));
+	fmt_out(o, p, buf + sizeof(buf) - p);
 }
 
 // Get an unsigned int of various possible sizes from a varargs list,
@@ -86,25 +132,50 @@ getint(va_list *ap, int lflag)
 		return va_arg(*ap, int);
 }
 
+static void fmt_printf(const struct fmtout *o, const char *fmt, ...);
 
-// Main function to format and print a string.
-void printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
+// Print string p, of len characters; with altflag, the unprintable
+// ones as '?'
+static void
+printstr(const struct fmtout *o, const char *p, size_t len, int altflag)
+{
+	size_t i, j;
 
-void
-vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+	if (!altflag) {
+		fmt_out(o, p, len);
+		return;
+	}
+	for (i = 0; i < len; i = j) {
+		for (j = i; j < len && p[j] >= ' ' && p[j] <= '~'; j++)
+			;
+		fmt_out(o, p + i, j - i);
+		if (j < len) {
+			o->putch('?', o->putdat);
+			j++;
+		}
+	}
+}
+
+// Main function to format and print a string.
+static void
+fmt_format(const struct fmtout *o, const char *fmt, va_list ap)
 {
 	register const char *p;
 	register int ch, err;
 	unsigned long long num;
 	int base, lflag, width, precision, altflag;
+	size_t len;
 	char padc;
 
 	while (1) {
-		while ((ch = *(unsigned char *) fmt++) != '%') {
-			if (ch == '\0')
-				return;
-			putch(ch, putdat);
-		}
+		// The literal text up to the next %-escape, all at once
+		for (p = fmt; *p != '%' && *p != '\0'; p++)
+			/* do nothing */;
+		if (p != fmt)
+			fmt_out(o, fmt, p - fmt);
+		if (*p == '\0')
+			return;
+		fmt = p + 1;
 
 		// Process a %-escape sequence
 		padc = ' ';
@@ -168,7 +239,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// character
 		case 'c':
-			putch(va_arg(ap, int), putdat);
+			o->putch(va_arg(ap, int), o->putdat);
 			break;
 
 		// error message
@@ -177,32 +248,29 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			if (err < 0)
 				err = -err;
 			if (err > MAXERROR || (p = error_string[err]) == NULL)
-				printfmt(putch, putdat, "error %d", err);
+				fmt_printf(o, "error %d", err);
 			else
-				printfmt(putch, putdat, "%s", p);
+				fmt_out(o, p, strlen(p));
 			break;
 
 		// string
 		case 's':
 			if ((p = va_arg(ap, char *)) == NULL)
 				p = "(null)";
-			if (width > 0 && padc != '-')
-				for (width -= strnlen(p, precision); width > 0; width--)
-					putch(padc, putdat);
-			for (; (ch = *p++) != '\0' && (precision < 0 || --precision >= 0); width--)
-				if (altflag && (ch < ' ' || ch > '~'))
-					putch('?', putdat);
-				else
-					putch(ch, putdat);
-			for (; width > 0; width--)
-				putch(' ', putdat);
+			len = strnlen(p, precision);
+			if (width > 0 && padc != '-') {
+				fmt_pad(o, padc, width - len);
+				width = 0;
+			}
+			printstr(o, p, len, altflag);
+			fmt_pad(o, ' ', width - (int) len);
 			break;
 
 		// (signed) decimal
 		case 'd':
 			num = getint(&ap, lflag);
 			if ((long long) num < 0) {
-				putch('-', putdat);
+				o->putch('-', o->putdat);
 				num = -(long long) num;
 			}
 			base = 10;
@@ -222,8 +290,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// pointer
 		case 'p':
-			putch('0', putdat);
-			putch('x', putdat);
+			fmt_out(o, "0x", 2);
 			num = (unsigned long long)
 				(uintptr_t) va_arg(ap, void *);
 			base = 16;
@@ -234,7 +301,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			num = getuint(&ap, lflag);
 			base = 16;
 		number:
-			printnum(putch, putdat, num, base, width, padc);
+			printnum(o, num, base, width, padc);
 			break;
 
 		// Color
@@ -244,12 +311,12 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// escaped '%' character
 		case '%':
-			putch(ch, putdat);
+			o->putch(ch, o->putdat);
 			break;
 			
 		// unrecognized escape sequence - just print it literally
 		default:
-			putch('%', putdat);
+			o->putch('%', o->putdat);
 			for (fmt--; fmt[-1] != '%'; fmt--)
 				/* do nothing */;
 			break;
@@ -257,6 +324,35 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 	}
 }
 
+static void
+fmt_printf(const struct fmtout *o, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fmt_format(o, fmt, ap);
+	va_end(ap);
+}
+
+void
+vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+{
+	struct fmtout o = { putch, NULL, putdat };
+
+	fmt_format(&o, fmt, ap);
+}
+
+// Like vprintfmt, but hand putstr the output a run at a time where it
+// can; only single characters go to putch.
+void
+vprintfmt_bulk(void (*putch)(int, void*), void (*putstr)(const char*, size_t, void*),
+	       void *putdat, const char *fmt, va_list ap)
+{
+	struct fmtout o = { putch, putstr, putdat };
+
+	fmt_format(&o, fmt, ap);
+}
+
 void
 printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...)
 {
@@ -281,6 +377,16 @@ sprintputch(int ch, struct sprintbuf *b)
 		*b->buf++ = ch;
 }
 
+static void
+sprintputstr(const char *s, size_t n, struct sprintbuf *b)
+{
+	size_t m = MIN(n, (size_t) (b->ebuf - b->buf));
+
+	memmove(b->buf, s, m);
+	b->buf += m;
+	b->cnt += n;
+}
+
 int
 vsnprintf(char *buf, int n, const char *fmt, va_list ap)
 {
@@ -290,7 +396,7 @@ vsnprintf(char *buf, int n, const char *fmt, va_list ap)
 		return -E_INVAL;
 
 	// print the string to the buffer
-	vprintfmt((void*)sprintputch, &b, fmt, ap);
+	vprintfmt_bulk((void*)sprintputch, (void*)sprintputstr, &b, fmt, ap);
 
 	// null terminate the buffer
 	*b.buf = '\0';
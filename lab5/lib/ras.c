@@ -0,0 +1,138 @@
+// Restartable atomic sequences, and a counter and a queue built on them.
+//
+// Each operation below is a short run of instructions whose last is the
+// one store that makes it happen.  The kernel knows where they are
+// (sys_env_set_ras): if we're interrupted, or fault, inside one, it
+// sends us back to the start, so the run either isn't there yet or has
+// gone through without anyone else on the CPU in between.  The queue's
+// store into a slot before the tail moves is no harm if we start over:
+// nobody reads a slot past the tail.
+//
+// We register the first time an operation runs.  Our children from
+// fork and sfork, and our threads, have the sequences too; spawn takes
+// them from its child, which runs a program of its own.
+
+#include <inc/lib.h>
+
+#define STR(x)	#x
+#define XSTR(x)	STR(x)
+#define NSEQ	(sizeof(ras_seqs) / sizeof(ras_seqs[0]))
+
+uint32_t ras_add_seq(volatile uint32_t *c, uint32_t n);
+int rasq_put_seq(struct RasQueue *q, void *item);
+void *rasq_get_seq(struct RasQueue *q);
+extern char ras_add_start[], ras_add_end[];
+extern char rasq_put_start[], rasq_put_end[];
+extern char rasq_get_start[], rasq_get_end[];
+
+// Each returns with the result in %eax, clobbering only %ecx and %edx
+asm(".text\n"
+    ".globl ras_add_seq\n"
+    "ras_add_seq:\n"
+    "	movl 4(%esp), %edx\n"
+    "	movl 8(%esp), %ecx\n"
+    "ras_add_start:\n"
+    "	movl (%edx), %eax\n"
+    "	addl %ecx, %eax\n"
+    "	movl %eax, (%edx)\n"
+    "ras_add_end:\n"
+    "	ret\n"
+    "\n"
+    ".globl rasq_put_seq\n"
+    "rasq_put_seq:\n"
+    "	pushl %ebx\n"
+    "	movl 8(%esp), %edx\n"		// q
+    "	movl 12(%esp), %ebx\n"		// item
+    "rasq_put_start:\n"
+    "	movl 4(%edx), %ecx\n"		// tail
+    "	movl %ecx, %eax\n"
+    "	subl (%edx), %eax\n"
+    "	cmpl $" XSTR(RASQ_SIZE) ", %eax\n"
+    "	jae 1f\n"
+    "	movl %ecx, %eax\n"
+    "	andl $" XSTR(RASQ_SIZE - 1) ", %eax\n"
+    "	movl %ebx, 8(%edx,%eax,4)\n"
+    "	incl %ecx\n"
+    "	movl %ecx, 4(%edx)\n"
+    "rasq_put_end:\n"
+    "	xorl %eax, %eax\n"
+    "	popl %ebx\n"
+    "	ret\n"
+    "1:	movl $-" XSTR(E_NO_MEM) ", %eax\n"
+    "	popl %ebx\n"
+    "	ret\n"
+    "\n"
+    ".globl rasq_get_seq\n"
+    "rasq_get_seq:\n"
+    "	movl 4(%esp), %edx\n"		// q
+    "rasq_get_start:\n"
+    "	movl (%edx), %ecx\n"		// head
+    "	cmpl 4(%edx), %ecx\n"
+    "	je 1f\n"
+    "	movl %ecx, %eax\n"
+    "	andl $" XSTR(RASQ_SIZE - 1) ", %eax\n"
+    "	movl 8(%edx,%eax,4), %eax\n"
+    "	incl %ecx\n"
+    "	movl %ecx, (%edx)\n"
+    "rasq_get_end:\n"
+    "	ret\n"
+    "1:	xorl %eax, %eax\n"
+    "	ret\n");
+
+static const struct Env_ras ras_seqs[] = {
+	{ (uintptr_t) ras_add_start, (uintptr_t) ras_add_end },
+	{ (uintptr_t) rasq_put_start, (uintptr_t) rasq_put_end },
+	{ (uintptr_t) rasq_get_start, (uintptr_t) rasq_get_end },
+};
+
+static bool ras_registered;
+
+static void
+ras_register(void)
+{
+	int r;
+
+	static_assert(NSEQ <= ENV_NRAS);
+	static_assert(offsetof(struct RasQueue, q_tail) == 4);
+	static_assert(offsetof(struct RasQueue, q_slot) == 8);
+	if ((r = sys_env_set_ras(0, ras_seqs, NSEQ)) < 0)
+		panic("sys_env_set_ras: %e", r);
+	ras_registered = 1;
+}
+
+// Add n to *c, returning the sum.
+uint32_t
+ras_add(volatile uint32_t *c, uint32_t n)
+{
+	if (!ras_registered)
+		ras_register();
+	return ras_add_seq(c, n);
+}
+
+// Put item at the tail of q.  Returns 0, or -E_NO_MEM if q is full.
+int
+rasq_put(struct RasQueue *q, void *item)
+{
+	if (!ras_registered)
+		ras_register();
+	return rasq_put_seq(q, item);
+}
+
+// Take the item at the head of q, or NULL if q is empty.
+void *
+rasq_get(struct RasQueue *q)
+{
+	if (!ras_registered)
+		ras_register();
+	return rasq_get_seq(q);
+}
+
+// envid, a child of ours from sys_exofork, is to run another program:
+// take our sequences from it.
+int
+ras_forget(envid_t envid)
+{
+	if (!ras_registered)
+		return 0;
+	return sys_env_set_ras(envid, NULL, 0);
+}
@@ -0,0 +1,209 @@
+// Sockets: file descriptors for TCP connections through the network
+// server (net/).  A socket's fd data is the pair of rings the server
+// maps there (SOCK_RX and SOCK_TX in inc/ns.h), so reads and writes are
+// chan_readv and chan_writev on them, and cost the server an IPC only
+// when it was waiting on the ring.  The other requests go to the server.
+
+#include <inc/lib.h>
+#include <inc/chan.h>
+
+static ssize_t sock_read(struct Fd *fd, void *buf, size_t n, off_t offset);
+static ssize_t sock_write(struct Fd *fd, const void *buf, size_t n, off_t offset);
+static ssize_t sock_readv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+static ssize_t sock_writev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+static int sock_close(struct Fd *fd);
+static int sock_stat(struct Fd *fd, struct Stat *stat);
+static int sock_poll(struct Fd *fd, int events, struct EventWatch *ew, int *nwatch);
+
+struct Dev devsock =
+{
+	.dev_id =	's',
+	.dev_name =	"sock",
+	.dev_read =	sock_read,
+	.dev_write =	sock_write,
+	.dev_close =	sock_close,
+	.dev_stat =	sock_stat,
+	.dev_readv =	sock_readv,
+	.dev_writev =	sock_writev,
+	.dev_poll =	sock_poll,
+};
+
+// The socket fd 's', or < 0.
+static int
+sock_lookup(int s, struct Fd **fdp)
+{
+	int r;
+
+	if ((r = fd_lookup(s, fdp)) < 0)
+		return r;
+	if ((*fdp)->fd_dev_id != devsock.dev_id)
+		return -E_INVAL;
+	return 0;
+}
+
+// A new fd for a socket, which 'mk' makes with its rings at the fd's
+// data.  Returns the fd number.
+static int
+sock_alloc(int (*mk)(struct Fd *fd, void *arg), void *arg)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_alloc(&fd)) < 0
+	    || (r = sys_page_alloc(0, fd, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		return r;
+	if ((r = mk(fd, arg)) < 0) {
+		sys_page_unmap(0, fd);
+		return r;
+	}
+	fd->fd_dev_id = devsock.dev_id;
+	fd->fd_omode = O_RDWR;
+	fd->fd_sock.sockid = r;
+	return fd2num(fd);
+}
+
+static int
+sock_mk(struct Fd *fd, void *arg)
+{
+	USED(arg);
+	return nsipc_socket(fd2data(fd));
+}
+
+int
+socket(int domain, int type, int protocol)
+{
+	if (domain != AF_INET || type != SOCK_STREAM || protocol != 0)
+		return -E_INVAL;
+	return sock_alloc(sock_mk, 0);
+}
+
+int
+bind(int s, const struct sockaddr_in *addr)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = sock_lookup(s, &fd)) < 0)
+		return r;
+	return nsipc_bind(fd->fd_sock.sockid, addr);
+}
+
+int
+listen(int s, int backlog)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = sock_lookup(s, &fd)) < 0)
+		return r;
+	return nsipc_listen(fd->fd_sock.sockid, backlog);
+}
+
+struct AcceptArgs {
+	int sockid;
+	struct sockaddr_in *addr;
+};
+
+static int
+accept_mk(struct Fd *fd, void *arg)
+{
+	struct AcceptArgs *a = arg;
+
+	return nsipc_accept(a->sockid, fd2data(fd), a->addr);
+}
+
+// Wait for a connection to the listening socket s.  Returns a socket
+// for it, and the peer's address in *addr if addr isn't null.
+int
+accept(int s, struct sockaddr_in *addr)
+{
+	struct AcceptArgs a;
+	struct Fd *fd;
+	int r;
+
+	if ((r = sock_lookup(s, &fd)) < 0)
+		return r;
+	a.sockid = fd->fd_sock.sockid;
+	a.addr = addr;
+	return sock_alloc(accept_mk, &a);
+}
+
+// Connect s to addr, waiting until the connection is made.
+int
+connect(int s, const struct sockaddr_in *addr)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = sock_lookup(s, &fd)) < 0)
+		return r;
+	return nsipc_connect(fd->fd_sock.sockid, addr);
+}
+
+static ssize_t
+sock_readv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	USED(offset);
+	return chan_readv(fd, SOCK_RX(fd2data(fd)), iov, iovcnt);
+}
+
+static ssize_t
+sock_writev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	USED(offset);
+	return chan_writev(fd, SOCK_TX(fd2data(fd)), iov, iovcnt);
+}
+
+// Readable by the receive ring, writable by the send ring
+static int
+sock_poll(struct Fd *fd, int events, struct EventWatch *ew, int *nwatch)
+{
+	int r = 0;
+
+	if (events & POLLIN)
+		r |= chan_poll(fd, SOCK_RX(fd2data(fd)), 1, ew, nwatch);
+	if (events & POLLOUT)
+		r |= chan_poll(fd, SOCK_TX(fd2data(fd)), 0, ew, nwatch);
+	return r;
+}
+
+static ssize_t
+sock_read(struct Fd *fd, void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { buf, n };
+
+	return sock_readv(fd, &iov, 1, offset);
+}
+
+static ssize_t
+sock_write(struct Fd *fd, const void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { (void *) buf, n };
+
+	return sock_writev(fd, &iov, 1, offset);
+}
+
+// Unmap the rings, then tell the server, which closes the connection
+// once nobody else has them.
+static int
+sock_close(struct Fd *fd)
+{
+	char *va = fd2data(fd);
+	int i;
+
+	for (i = SOCK_NPAGES - 1; i >= 0; i--)
+		(void) sys_page_unmap(0, va + i*PGSIZE);
+	return nsipc_close(fd->fd_sock.sockid);
+}
+
+static int
+sock_stat(struct Fd *fd, struct Stat *stat)
+{
+	struct Chan *rx = SOCK_RX(fd2data(fd));
+
+	strcpy(stat->st_name, "<sock>");
+	stat->st_size = (upte((uintptr_t) rx) & PTE_P) ? rx->ch_wpos - rx->ch_rpos : 0;
+	stat->st_isdir = 0;
+	stat->st_dev = &devsock;
+	return 0;
+}
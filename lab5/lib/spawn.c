@@ -5,8 +5,15 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Most envs spawn_prewarm makes at once
+#define PREWARM_MAX		16
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
+static int exec_image(envid_t child, int fdnum, struct Fd *fd, struct Fsret_exec *x);
+static int load_data(envid_t child, int fdnum, struct Fsret_exec *x);
+static int load_shlib(envid_t child, const char *path);
+static int stack_page(const char **argv, uintptr_t *init_esp);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -18,12 +25,11 @@ spawn(const char *prog, const char **argv)
 {
     int r;
     int fdnum;
-	unsigned char elf_buf[512];
 	struct Trapframe child_tf;
 	envid_t child;
 	(void) child;
-    struct Elf *ELFHDR;
-    struct Proghdr *ph, *eph;
+    struct Fd *fd;
+    struct Fsret_exec x;
 
 	// Insert your code, following approximately this procedure:
 	//
@@ -88,79 +94,267 @@ spawn(const char *prog, const char **argv)
 
 	// LAB 5: Your code here.
 	
-    fdnum = open(prog, O_RDWR);
+    // The file server maps the text and the data pages straight into
+    // the child, and keeps the headers of programs it loaded lately, so
+    // spawning a program again reads nothing from it.  What is left for
+    // us is the page each data segment ends in, whose tail must be
+    // cleared, and the bss.
+    fdnum = open(prog, O_RDONLY);
     if (fdnum < 0)
         return fdnum;
-    read(fdnum, elf_buf, 512);
-    ELFHDR = (struct Elf *)elf_buf;
-    if (ELFHDR->e_magic != ELF_MAGIC) {
-        panic("load_icode: Give binary is not a valid ELF.\n");
-        return -E_INVAL;
-    }
+    if ((r = fd_lookup(fdnum, &fd)) < 0)
+        goto out;
     child = sys_exofork();
-    if (child < 0)
-        return child;
+    if (child < 0) {
+        r = child;
+        goto out;
+    }
     child_tf =  envs[ENVX(child)].env_tf;
-    child_tf.tf_eip = ELFHDR->e_entry;
+    if ((r = ras_forget(child)) < 0)
+        goto err;
     r = init_stack(child, argv, &child_tf.tf_esp);
     if (r < 0)
-        return r;
-    ph = (struct Proghdr *)((uint8_t *) ELFHDR + ELFHDR->e_phoff);
-    eph = ph + ELFHDR->e_phnum;
-    for (; ph < eph; ph++) {
-        if (ph->p_type == ELF_PROG_LOAD) {
-            uintptr_t start = ROUNDDOWN(ph->p_offset, PGSIZE);
-            uintptr_t end;
-            uintptr_t va = ROUNDDOWN(ph->p_va, PGSIZE);
-            int i;
-            void *blk;
-            if ((ph->p_flags & ELF_PROG_FLAG_WRITE) == 0) {
-                // Text
-                end = ROUNDUP(ph->p_filesz + ph->p_offset, PGSIZE);
-                for (i = start; i < end; i += PGSIZE) {
-                    r = read_map(fdnum, i, &blk);
-                    if (r < 0)
-                        return r;
-                    r = sys_page_map(0, blk, child, (void *)(va + i - start), PTE_U | PTE_P);
-                    if (r < 0)
-                        return r;
-                }
-            }
-            else {
-                // Bss and Date
-                uintptr_t limit = ph->p_offset + ph->p_filesz;
-                end = ROUNDUP(ph->p_memsz + ph->p_offset, PGSIZE);
-                seek(fdnum, ph->p_offset);
-                for (i = start; i < end; i += PGSIZE) {
-                    r = sys_page_alloc(0, UTEMP, PTE_U | PTE_W | PTE_P);
-                    if (r < 0)
-                        return r;
-                    memset(UTEMP, 0, PGSIZE);
-                    if (i < limit) {
-                        // Data
-                        r = read(fdnum, UTEMP, PGSIZE);
-                        if (r < 0)
-                            return r;
-                        if (i == ROUNDDOWN(limit, PGSIZE))
-                            memset(UTEMP + limit - i, 0, PGSIZE - (limit - i));
-                    }
-                    r = sys_page_map(0, UTEMP, child, (void *)(va + i - start), PTE_U | PTE_W | PTE_P);
-                    if (r < 0)
-                        return r;
-                    r = sys_page_unmap(0, UTEMP);
-                    if (r < 0)
-                        return r;
-                }
-            }
-        }
-    }
+        goto err;
+    r = exec_image(child, fdnum, fd, &x);
+    if (r < 0)
+        goto err;
+    child_tf.tf_eip = x.ret_entry;
+    r = load_data(child, fdnum, &x);
+    if (r < 0)
+        goto err;
+    // A program linked against libjos.so: the same again for the library
+    if (x.ret_interp[0] != 0 && (r = load_shlib(child, x.ret_interp)) < 0)
+        goto err;
+    // The child inherits our open files, pipes and channels, but not
+    // the program's
+    close(fdnum);
+    fdnum = -1;
+    r = dup_shared(child);
+    if (r < 0)
+        goto err;
+    // And the files we keep: dup_shared gave it their pages
+    r = fcache_give(child);
+    if (r < 0)
+        goto err;
     r = sys_env_set_trapframe(child, &child_tf);
     if (r < 0)
-        return r;
+        goto err;
     r = sys_env_set_status(child, ENV_RUNNABLE);
     if (r < 0)
-        return r;
+        goto err;
     return child;
+
+err:
+    sys_page_unmap(0, UTEMP);
+    sys_env_destroy(child);
+out:
+    if (fdnum >= 0)
+        close(fdnum);
+    return r;
+}
+
+// Map the program open as fdnum (at fd) into child, as fsipc_exec does,
+// and say what it is in *x.  An fd the file cache made (fcache.c) has
+// the whole image mapped already, so we check the headers as serve_exec
+// would and map the pages from there ourselves; otherwise the file
+// server does it, and if the cache is keeping the file, we map it too,
+// so that the cache has its pages when it's closed.
+static int
+exec_image(envid_t child, int fdnum, struct Fd *fd, struct Fsret_exec *x)
+{
+    int r, i;
+    char *img = fd2data(fd);
+    size_t size = fd->fd_file.size;
+    struct Elf *elf = (struct Elf *) img;
+    struct Proghdr *ph;
+    struct Fsexec_seg *seg;
+    uintptr_t start, end;
+
+    if (fd->fd_file.id != FCACHE_FILEID) {
+        if ((r = fsipc_exec(fd->fd_file.id, child, x)) >= 0)
+            fcache_fill(fdnum);
+        return r;
+    }
+    if ((fd->fd_file.file.f_flags & FILE_INLINE)
+        || size < sizeof(struct Elf) || elf->e_magic != ELF_MAGIC
+        || elf->e_phoff > BLKSIZE
+        || elf->e_phnum > (BLKSIZE - elf->e_phoff) / sizeof(struct Proghdr))
+        return -E_INVAL;
+    x->ret_entry = elf->e_entry;
+    x->ret_nseg = 0;
+    x->ret_interp[0] = 0;
+    ph = (struct Proghdr *) (img + elf->e_phoff);
+    for (i = 0; i < elf->e_phnum; i++, ph++) {
+        if (ph->p_type == ELF_PROG_INTERP) {
+            if (ph->p_filesz == 0 || ph->p_filesz > FSEXEC_MAXINTERP
+                || ph->p_offset + ph->p_filesz > size)
+                return -E_INVAL;
+            memmove(x->ret_interp, img + ph->p_offset, ph->p_filesz);
+            x->ret_interp[ph->p_filesz - 1] = 0;
+        }
+        if (ph->p_type != ELF_PROG_LOAD)
+            continue;
+        if (x->ret_nseg == FSEXEC_MAXSEG
+            || ph->p_filesz > ph->p_memsz
+            || ph->p_offset + ph->p_filesz > size
+            || PGOFF(ph->p_offset) != PGOFF(ph->p_va)
+            || ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va)
+            return -E_INVAL;
+        seg = &x->ret_seg[x->ret_nseg++];
+        seg->s_va = ph->p_va;
+        seg->s_offset = ph->p_offset;
+        seg->s_filesz = ph->p_filesz;
+        seg->s_memsz = ph->p_memsz;
+        seg->s_flags = ph->p_flags;
+    }
+    // Text whole; of data, only the pages the data fills
+    for (seg = x->ret_seg; seg < x->ret_seg + x->ret_nseg; seg++) {
+        start = ROUNDDOWN(seg->s_offset, PGSIZE);
+        if (seg->s_flags & ELF_PROG_FLAG_WRITE)
+            end = ROUNDDOWN(seg->s_offset + seg->s_filesz, PGSIZE);
+        else
+            end = ROUNDUP(seg->s_offset + seg->s_filesz, PGSIZE);
+        if (end <= start)
+            continue;
+        r = sys_page_map_range(0, img + start, child, (void *) ROUNDDOWN(seg->s_va, PGSIZE),
+                               (end - start) / PGSIZE,
+                               (seg->s_flags & ELF_PROG_FLAG_WRITE)
+                               ? PTE_P | PTE_U | PTE_COW : PTE_P | PTE_U);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+// Fill in what fsipc_exec left of the writable segments *x describes,
+// of the program open as fdnum, in child: the page each segment's data
+// ends in, and the bss.
+static int
+load_data(envid_t child, int fdnum, struct Fsret_exec *x)
+{
+    int r;
+    struct Fsexec_seg *seg;
+    // The page calls go in one batch per segment: one trap for the bss,
+    // however big, instead of three per page
+    struct SyscallBatch b = BATCH_INIT;
+    for (seg = x->ret_seg; seg < x->ret_seg + x->ret_nseg; seg++) {
+        uintptr_t start = ROUNDDOWN(seg->s_offset, PGSIZE);
+        uintptr_t limit = seg->s_offset + seg->s_filesz;
+        uintptr_t end = ROUNDUP(seg->s_offset + seg->s_memsz, PGSIZE);
+        uintptr_t va = ROUNDDOWN(seg->s_va, PGSIZE);
+        uintptr_t i;
+        if ((seg->s_flags & ELF_PROG_FLAG_WRITE) == 0)
+            continue;
+        for (i = MAX(start, ROUNDDOWN(limit, PGSIZE)); i < end; i += PGSIZE) {
+            void *dva = (void *)(va + i - start);
+            if (i >= limit) {
+                // Bss: demand-zero, left to the kernel's zero page
+                // until the child writes it
+                r = batch_page_alloc(&b, child, dva, PTE_U | PTE_W | PTE_P | PTE_COW);
+                if (r < 0)
+                    return r;
+                continue;
+            }
+            // Data
+            r = sys_page_alloc(0, UTEMP, PTE_U | PTE_W | PTE_P);
+            if (r < 0)
+                return r;
+            seek(fdnum, i);
+            r = readn(fdnum, UTEMP, limit - i);
+            if (r < 0)
+                return r;
+            if ((r = batch_page_map(&b, 0, UTEMP, child, dva, PTE_U | PTE_W | PTE_P)) < 0
+                || (r = batch_page_unmap(&b, 0, UTEMP)) < 0)
+                return r;
+        }
+        // UTEMP must be free before the next segment's data page
+        r = batch_flush(&b);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+// Load the shared library at 'path' into child, which is linked against
+// it.  The file server maps its text from the block cache, so all the
+// envs running it share the one copy; we make its data and bss.  It is
+// linked at ULIB and needs no relocation, and its entry is unused:
+// _start, in the program, calls libmain in it.
+static int
+load_shlib(envid_t child, const char *path)
+{
+    int r, fdnum;
+    struct Fd *fd;
+    struct Fsret_exec x;
+    fdnum = open(path, O_RDONLY);
+    if (fdnum < 0)
+        return fdnum;
+    if ((r = fd_lookup(fdnum, &fd)) >= 0
+        && (r = exec_image(child, fdnum, fd, &x)) >= 0)
+        r = x.ret_interp[0] != 0 ? -E_INVAL : load_data(child, fdnum, &x);
+    close(fdnum);
+    return r;
+}
+
+// Spawn a child like spawn(), but have the kernel load the program with
+// sys_exec: the whole file is mapped into our fd window, and the kernel
+// copies its segments into the child, which starts with the stack page
+// we built for it.  The child gets private copies of every page rather
+// than sharing its text, but is built in one system call.
+// Returns child envid on success, < 0 on failure.
+envid_t
+spawn_exec(const char *prog, const char **argv)
+{
+    int r, fdnum;
+    struct Stat st;
+    void *blk;
+    uintptr_t esp;
+
+    fdnum = open(prog, O_RDONLY);
+    if (fdnum < 0)
+        return fdnum;
+    if ((r = fstat(fdnum, &st)) < 0
+        || (r = read_map_range(fdnum, 0, st.st_size, &blk)) < 0
+        || (r = stack_page(argv, &esp)) < 0)
+        goto out;
+    r = sys_exec(blk, st.st_size, UTEMP, esp);
+    sys_page_unmap(0, UTEMP);
+out:
+    close(fdnum);
+    return r;
+}
+
+// Make ready to spawn 'prog' up to n times quickly.  The first of n
+// scratch children has the program, and its shared library, mapped
+// into it through the file server, which so keeps the image's headers
+// (serve_exec) and brings its blocks into the block cache.  Destroying
+// the children, which never ran, leaves their page directories in the
+// kernel's pool for the next env_allocs (kern/env.c), up to ENV_POOL.
+// Returns the number of children made, or < 0 on failure.
+int
+spawn_prewarm(const char *prog, int n)
+{
+    int r, i, fdnum;
+    struct Fd *fd;
+    struct Fsret_exec x;
+    envid_t child[PREWARM_MAX];
+
+    n = MIN(MAX(n, 1), PREWARM_MAX);
+    fdnum = open(prog, O_RDONLY);
+    if (fdnum < 0)
+        return fdnum;
+    for (i = 0; i < n && (child[i] = sys_exofork()) > 0; i++)
+        ;
+    if (i == 0)
+        r = child[0] < 0 ? child[0] : -E_NO_FREE_ENV;
+    else if ((r = fd_lookup(fdnum, &fd)) >= 0
+             && (r = exec_image(child[0], fdnum, fd, &x)) >= 0
+             && (x.ret_interp[0] == 0 || (r = load_shlib(child[0], x.ret_interp)) >= 0))
+        r = i;
+    close(fdnum);
+    while (i-- > 0)
+        sys_env_destroy(child[i]);
+    return r;
 }
 
 // Spawn, taking command-line arguments array directly on the stack.
@@ -180,6 +374,32 @@ spawnl(const char *prog, const char *arg0, ...)
 // Returns < 0 on failure.
 static int
 init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
+{
+	int r;
+
+	if ((r = stack_page(argv, init_esp)) < 0)
+		return r;
+
+	// After completing the stack, map it into the child's address space
+	// and unmap it from ours!
+	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+		goto error;
+	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	sys_page_unmap(0, UTEMP);
+	return r;
+}
+
+// Build the initial stack page for a child at UTEMP, which is left
+// mapped for the caller to hand to the child, with *init_esp the
+// child's initial stack pointer.
+// Returns < 0 on failure.
+static int
+stack_page(const char **argv, uintptr_t *init_esp)
 {
 	size_t string_size;
 	int argc, i, r;
@@ -196,8 +416,9 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	// Set up pointers into the temporary page 'UTEMP'; we'll map a page
 	// there later, then remap that page into the child environment
 	// at (USTACKTOP - PGSIZE).
-	// strings is the topmost thing on the stack.
-	string_store = (char*) UTEMP + PGSIZE - string_size;
+	// strings is the topmost thing on the stack, apart from the
+	// word reserved for 'env' (ENVSLOT).
+	string_store = (char*) UTEMP + PGSIZE - (USTACKTOP - ENVSLOT) - string_size;
 	// argv is below that.  There's one argument pointer per argument, plus
 	// a null pointer.
 	argv_store = (uintptr_t*) (ROUNDDOWN(string_store, 4) - 4 * (argc + 1));
@@ -248,18 +469,7 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
     *(argv_store - 2) = argc;
 	*init_esp = UTEMP2USTACK(argv_store - 2);
 
-	// After completing the stack, map it into the child's address space
-	// and unmap it from ours!
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
-		goto error;
-
 	return 0;
-
-error:
-	sys_page_unmap(0, UTEMP);
-	return r;
 }
 
 
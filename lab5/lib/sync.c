@@ -0,0 +1,89 @@
+// Mutexes and condition variables on sys_addr_wait and sys_addr_wake.
+//
+// A mutex is one word.  Taking a free one and dropping one nobody waits
+// for are a locked instruction each, with no trap.  A locker that finds
+// it held spins for a while, since a holder on another CPU is likely to
+// let go soon, then marks it contended (2) and sleeps on the word; the
+// unlocker of a contended mutex wakes one sleeper, which takes it as
+// contended again, as it can't tell whether others still sleep.
+//
+// A condition variable is a sequence word that waiters sleep on: a
+// signal bumps it, so a waiter that was about to sleep on the old value
+// doesn't, and nothing is lost between dropping the mutex and sleeping.
+// Signal and broadcast with the mutex held, so c_nwait is up to date:
+// they skip the trap when nobody waits.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Times round the spin loop before a contended locker sleeps
+#define MUTEX_SPIN	100
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+	int i;
+
+	for (i = 0; i < MUTEX_SPIN; i++) {
+		if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+			return;
+		if (c == 2)
+			break;
+		pause();
+	}
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_addr_wait(&m->m_state, 2);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+// Take m if it's free.  Returns 1 if we got it, 0 if not.
+int
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_addr_wake(&m->m_state, 1);
+}
+
+// Drop m, wait for a signal, and take m again.  Wakeups may be spurious,
+// so callers re-check their condition in a loop.
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	uint32_t seq = c->c_seq;
+
+	c->c_nwait++;
+	mutex_unlock(m);
+	sys_addr_wait(&c->c_seq, seq);
+	mutex_lock(m);
+	c->c_nwait--;
+}
+
+// Wake one waiter on c.
+void
+cond_signal(struct Cond *c)
+{
+	if (c->c_nwait == 0)
+		return;
+	c->c_seq++;
+	sys_addr_wake(&c->c_seq, 1);
+}
+
+// Wake every waiter on c.
+void
+cond_broadcast(struct Cond *c)
+{
+	if (c->c_nwait == 0)
+		return;
+	c->c_seq++;
+	sys_addr_wake(&c->c_seq, ADDR_WAKE_ALL);
+}
@@ -2,12 +2,43 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Enter the kernel by sysenter rather than int?  -1 until we've asked
+// the CPU.  The kernel sets sysenter up whenever the CPU has it.
+static int use_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+	if (use_sysenter < 0)
+		use_sysenter = cpu_has_sysenter();
+
+	// Fast system call: as below, except that the fifth parameter goes
+	// on the stack, since SI carries the return address to the kernel
+	// and BP our stack pointer.  sysexit returns with the return
+	// address in DX and the stack pointer in CX, so those are lost.
+	if (use_sysenter) {
+		asm volatile("pushl %%ebp\n"
+			     "\tpushl %%esi\n"
+			     "\tmovl %%esp, %%ebp\n"
+			     "\tmovl $1f, %%esi\n"
+			     "\tsysenter\n"
+			     "1:\taddl $4, %%esp\n"
+			     "\tpopl %%ebp"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2),
+			  "+S" (a5)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "cc", "memory");
+		goto out;
+	}
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -31,6 +62,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		  "S" (a5)
 		: "cc", "memory");
 	
+out:
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -67,6 +99,18 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_sleep(uint32_t ticks)
+{
+	return syscall(SYS_sleep, 0, ticks, 0, 0, 0, 0);
+}
+
+int
+sys_cgetc_wait(void)
+{
+	return syscall(SYS_cgetc_wait, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
@@ -79,6 +123,28 @@ sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 	return syscall(SYS_page_map, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
 }
 
+// There are only five argument registers, so perm is passed in the
+// low twelve bits of dstva, which must be page-aligned anyway.
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, size_t npages, int perm)
+{
+	if (PGOFF(dstva) != 0 || (perm & ~0xFFF) != 0)
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva | perm, npages);
+}
+
+int
+sys_page_autogrow(void *va, size_t len)
+{
+	return syscall(SYS_page_autogrow, 0, (uint32_t) va, len, 0, 0, 0);
+}
+
+int
+sys_page_cow_reuse(void *va)
+{
+	return syscall(SYS_page_cow_reuse, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
 int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -87,6 +153,12 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_cow_fork(void)
+{
+	return syscall(SYS_cow_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -99,12 +171,36 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	return syscall(SYS_env_set_trapframe, 1, envid, (uint32_t) tf, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpu, 0, 0, 0);
+}
+
 int
 sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 {
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_fault_flags(envid_t envid, uint32_t flags)
+{
+	return syscall(SYS_env_set_fault_flags, 1, envid, flags, 0, 0, 0);
+}
+
+int
+sys_env_set_page_quota(envid_t envid, uint32_t npages)
+{
+	return syscall(SYS_env_set_page_quota, 1, envid, npages, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -117,3 +213,147 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_range(void *dstva, size_t npages, uint32_t ticks, int flags)
+{
+	return syscall(SYS_ipc_recv_range, 0, (uint32_t)dstva, npages, ticks, flags, 0);
+}
+
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_send_range(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_send_range, 0, envid, value, (uint32_t) srcva, npages, perm);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_send_short(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	return syscall(SYS_ipc_send_short, 0, envid, value, w0, w1, w2);
+}
+
+int
+sys_ipc_call_short(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	return syscall(SYS_ipc_call_short, 0, envid, value, w0, w1, w2);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_addr_wait(const volatile uint32_t *addr, uint32_t val)
+{
+	return syscall(SYS_addr_wait, 0, (uint32_t) addr, val, 0, 0, 0);
+}
+
+int
+sys_addr_wake(const volatile uint32_t *addr, uint32_t max)
+{
+	return syscall(SYS_addr_wake, 0, (uint32_t) addr, max, 0, 0, 0);
+}
+
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_net_try_send(void *va, int npkts)
+{
+	return syscall(SYS_net_try_send, 0, (uint32_t) va, npkts, 0, 0, 0);
+}
+
+int
+sys_net_recv(void *va, int npkts)
+{
+	return syscall(SYS_net_recv, 0, (uint32_t) va, npkts, 0, 0, 0);
+}
+
+int
+sys_net_hwaddr(uint8_t *mac)
+{
+	return syscall(SYS_net_hwaddr, 0, (uint32_t) mac, 0, 0, 0, 0);
+}
+
+int
+sys_page_grant(envid_t envid, envid_t toenvid, void *va, size_t npages)
+{
+	return syscall(SYS_page_grant, 0, envid, toenvid, (uint32_t) va, npages, 0);
+}
+
+envid_t
+sys_exec(const void *binary, size_t size, void *stack, uintptr_t esp)
+{
+	return syscall(SYS_exec, 0, (uint32_t) binary, size, (uint32_t) stack, esp, 0);
+}
+
+envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	return syscall(SYS_thread_create, 0, eip, esp, xstacktop, 0, 0);
+}
+
+int
+sys_batch(struct SyscallReq *reqs, uint32_t n)
+{
+	return syscall(SYS_batch, 0, (uint32_t) reqs, n, 0, 0, 0);
+}
+
+int
+sys_page_alloc_contig(void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_contig, 1, (uint32_t) va, npages, perm, 0, 0);
+}
+
+int
+sys_ahci_read(uint32_t off, uint32_t *val)
+{
+	return syscall(SYS_ahci_read, 0, off, (uint32_t) val, 0, 0, 0);
+}
+
+int
+sys_ahci_write(uint32_t off, uint32_t val)
+{
+	return syscall(SYS_ahci_write, 0, off, val, 0, 0, 0);
+}
+
+int
+sys_event_wait(uint32_t events, const struct EventWatch *watch, int nwatch, uint32_t ticks)
+{
+	return syscall(SYS_event_wait, 0, events, (uint32_t) watch, nwatch, ticks, 0);
+}
+
+int
+sys_klog_read(char *buf, size_t len)
+{
+	return syscall(SYS_klog_read, 0, (uint32_t) buf, len, 0, 0, 0);
+}
+
+int
+sys_env_set_ras(envid_t envid, const struct Env_ras *ras, size_t n)
+{
+	return syscall(SYS_env_set_ras, 1, envid, (uint32_t) ras, n, 0, 0);
+}
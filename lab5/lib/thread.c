@@ -0,0 +1,150 @@
+// Threads: envs made by sys_thread_create, which run in our address
+// space -- .data, the heap and every stack included -- so they can work
+// on the same memory without fork's copy-on-write or the cost of IPC.
+// Each runs on its own stack slot in [UTHREADS, UTHREADSTOP) (see
+// inc/lib.h), and so sees its own 'env'.
+//
+// Thread i's slot has its exception stack on top; its normal stack
+// starts with one page below that and grows on demand, as the main
+// stack does, down to the guard page at the bottom of the slot.  A
+// thread's slot is free again once it has been joined, so every thread
+// should be.
+//
+// Most of the rest of the library expects one thread at a time: give
+// malloc, the fd table and stdio buffers to one thread, or lock them.
+// Console output goes unbuffered from the first thread_create on, as
+// after sfork.  Install page fault handlers before creating threads,
+// which take the upcall of the env that made them.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+struct Thread {
+	volatile uint32_t t_busy;	// slot in use; claimed with xchg
+	envid_t t_id;			// the thread in it
+	volatile uint32_t t_done;	// it has called thread_exit
+};
+
+static struct Thread threads[NTHREAD];
+
+#define SLOTVA(i)	(UTHREADS + (i) * THREAD_STKSIZE)
+
+// The slot the running thread's stack is in, or -1 for the main stack.
+static int
+thread_self(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp < UTHREADS || esp >= UTHREADSTOP)
+		return -1;
+	return (esp - UTHREADS) / THREAD_STKSIZE;
+}
+
+// Where a thread starts: fn and arg are on the stack thread_create made.
+static void
+thread_main(void (*fn)(void *), void *arg)
+{
+	uintptr_t slot = SLOTVA(thread_self());
+
+	// The rest of the normal stack, above the guard page.  If we're out
+	// of auto-grow regions, the stack is just the page we're on.
+	(void) sys_page_autogrow((void *) (slot + PGSIZE), THREAD_STKSIZE - 3 * PGSIZE);
+	fn(arg);
+	thread_exit();
+}
+
+//
+// Start a thread running fn(arg) in our address space; it ends when fn
+// returns, or with thread_exit.
+//
+// Returns the thread's envid, or < 0 on error: -E_NO_FREE_ENV if
+// NTHREAD threads haven't been joined yet, or the errors of
+// sys_page_alloc and sys_thread_create.
+//
+envid_t
+thread_create(void (*fn)(void *), void *arg)
+{
+	struct Thread *t;
+	uintptr_t top;
+	uint32_t *sp;
+	envid_t tid;
+	int i, r;
+
+	for (i = 0; i < NTHREAD; i++)
+		if (xchg(&threads[i].t_busy, 1) == 0)
+			break;
+	if (i == NTHREAD)
+		return -E_NO_FREE_ENV;
+	t = &threads[i];
+	top = SLOTVA(i) + THREAD_STKSIZE;
+
+	// The exception stack and the first page of the normal one
+	if ((r = sys_page_alloc(0, (void *) (top - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0
+	    || (r = sys_page_alloc(0, (void *) (top - 2 * PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+
+	// A call frame for thread_main(fn, arg), with no return address
+	sp = (uint32_t *) (top - PGSIZE);
+	*--sp = (uint32_t) arg;
+	*--sp = (uint32_t) fn;
+	*--sp = 0;
+
+	// The console buffer is about to be shared
+	cflush();
+	cons_unbuffered = 1;
+	if ((r = tid = sys_thread_create((uintptr_t) thread_main, (uintptr_t) sp, top - 4)) < 0)
+		goto fail;
+	t->t_id = tid;
+	t->t_done = 0;
+	*(volatile struct Env **) (top - 4) = &envs[ENVX(tid)];
+	if ((r = sys_env_set_status(tid, ENV_RUNNABLE)) < 0) {
+		sys_env_destroy(tid);
+		goto fail;
+	}
+	return tid;
+
+fail:
+	t->t_busy = 0;
+	return r;
+}
+
+//
+// Wait for thread 'tid' to end, and free its slot.
+// Returns 0, or -E_INVAL if tid isn't a thread we can join.
+//
+int
+thread_join(envid_t tid)
+{
+	struct Thread *t;
+	volatile struct Env *e = &envs[ENVX(tid)];
+
+	for (t = threads; t < threads + NTHREAD; t++)
+		if (t->t_busy && t->t_id == tid)
+			break;
+	if (t == threads + NTHREAD)
+		return -E_INVAL;
+	while (!t->t_done)
+		sys_addr_wait(&t->t_done, 0);
+	// It's still on its stack until sys_env_destroy takes it away
+	while (e->env_id == tid && e->env_status != ENV_FREE)
+		sys_yield();
+	t->t_busy = 0;
+	return 0;
+}
+
+//
+// End the running thread.  From the main stack, this is exit().
+//
+void
+thread_exit(void)
+{
+	int i = thread_self();
+
+	if (i >= 0) {
+		threads[i].t_done = 1;
+		sys_addr_wake(&threads[i].t_done, ADDR_WAKE_ALL);
+		sys_env_destroy(0);
+	} else
+		exit();
+	panic("thread_exit: still here");
+}
@@ -0,0 +1,227 @@
+// Ethernet and ARP.
+//
+// Packets to send collect in the pages at TXVA, and ether_flush hands
+// the batch to the card with one sys_net_try_send, which takes the
+// pages from us; ether_alloc maps fresh ones as they're wanted.  An
+// answer built in the page its request came in, as ARP and ICMP echo
+// replies are, goes out in that page (ether_reuse).
+
+#include "ns.h"
+
+#define debug 0
+
+#define ARP_REQUEST	1
+#define ARP_REPLY	2
+
+struct arp_hdr {
+	uint16_t ar_hrd;	// 1, Ethernet
+	uint16_t ar_pro;	// ETH_IP
+	uint8_t ar_hln;		// 6
+	uint8_t ar_pln;		// 4
+	uint16_t ar_op;
+	uint8_t ar_sha[6];
+	uint32_t ar_spa;
+	uint8_t ar_tha[6];
+	uint32_t ar_tpa;
+} __attribute__((packed));
+
+// Hosts on the local network we know the Ethernet address of, the
+// oldest replaced first
+#define NARP	16
+
+struct ArpEntry {
+	uint32_t a_ip;		// 0 if free
+	uint8_t a_mac[6];
+};
+
+static struct ArpEntry arp_cache[NARP];
+static int arp_next;
+
+static const uint8_t eth_broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+uint8_t ether_mac[6];
+
+// Packets queued at TXVA
+static int tx_n;
+
+static void
+arp_learn(uint32_t ip, const uint8_t *mac)
+{
+	int i;
+
+	if (ip == 0)
+		return;
+	for (i = 0; i < NARP; i++)
+		if (arp_cache[i].a_ip == ip)
+			break;
+	if (i == NARP) {
+		i = arp_next;
+		arp_next = (arp_next + 1) % NARP;
+		arp_cache[i].a_ip = ip;
+	}
+	memmove(arp_cache[i].a_mac, mac, 6);
+}
+
+static const uint8_t *
+arp_lookup(uint32_t ip)
+{
+	int i;
+
+	for (i = 0; i < NARP; i++)
+		if (arp_cache[i].a_ip == ip)
+			return arp_cache[i].a_mac;
+	return 0;
+}
+
+// Queue pkt, the page from ether_alloc or ether_reuse, whose np_data
+// has 'len' bytes after the Ethernet header, for 'dst'.
+static void
+ether_queue(struct NetPkt *pkt, const uint8_t *dst, uint16_t type, int len)
+{
+	struct eth_hdr *eh = (struct eth_hdr *) pkt->np_data;
+
+	assert(pkt == (struct NetPkt *) (TXVA + tx_n * PGSIZE));
+	memmove(eh->eth_dst, dst, 6);
+	memmove(eh->eth_src, ether_mac, 6);
+	eh->eth_type = htons(type);
+	pkt->np_len = ETH_HLEN + len;
+	tx_n++;
+}
+
+// Build an ARP packet in pkt and queue it.
+static void
+arp_output(struct NetPkt *pkt, int op, const uint8_t *tha, uint32_t tpa)
+{
+	struct arp_hdr *ar = (struct arp_hdr *) (pkt->np_data + ETH_HLEN);
+
+	ar->ar_hrd = htons(1);
+	ar->ar_pro = htons(ETH_IP);
+	ar->ar_hln = 6;
+	ar->ar_pln = 4;
+	ar->ar_op = htons(op);
+	memmove(ar->ar_sha, ether_mac, 6);
+	ar->ar_spa = htonl(NS_IPADDR);
+	memmove(ar->ar_tha, op == ARP_REQUEST ? (const uint8_t *) "\0\0\0\0\0\0" : tha, 6);
+	ar->ar_tpa = htonl(tpa);
+	ether_queue(pkt, op == ARP_REQUEST ? eth_broadcast : tha, ETH_ARP,
+		    sizeof(*ar));
+}
+
+static void
+arp_input(struct NetPkt *pkt, int len)
+{
+	struct arp_hdr *ar = (struct arp_hdr *) (pkt->np_data + ETH_HLEN);
+	uint8_t sha[6];
+	uint32_t spa;
+
+	if (len < (int) sizeof(*ar) || ar->ar_hrd != htons(1)
+	    || ar->ar_pro != htons(ETH_IP) || ar->ar_hln != 6 || ar->ar_pln != 4)
+		return;
+	spa = ntohl(ar->ar_spa);
+	memmove(sha, ar->ar_sha, 6);
+	arp_learn(spa, sha);
+	if (ar->ar_op != htons(ARP_REQUEST) || ntohl(ar->ar_tpa) != NS_IPADDR)
+		return;
+	if ((pkt = ether_reuse(pkt)) != 0)
+		arp_output(pkt, ARP_REPLY, sha, spa);
+}
+
+void
+ether_input(struct NetPkt *pkt)
+{
+	struct eth_hdr *eh = (struct eth_hdr *) pkt->np_data;
+	struct ip_hdr *ip;
+	int len = pkt->np_len - ETH_HLEN;
+
+	if (len < 0 || len > NET_MAXPKT - ETH_HLEN)
+		return;
+	switch (ntohs(eh->eth_type)) {
+	case ETH_ARP:
+		arp_input(pkt, len);
+		break;
+	case ETH_IP:
+		// A neighbour's address comes with each packet it sends
+		ip = PKT_IP(pkt);
+		if (len >= IP_HLEN
+		    && ((ntohl(ip->ip_src) ^ NS_IPADDR) & NS_NETMASK) == 0)
+			arp_learn(ntohl(ip->ip_src), eh->eth_src);
+		ip_input(pkt, len);
+		break;
+	}
+}
+
+// A page to build a packet in, or 0 if the queue is full even after a
+// flush.  The page is the queue's next: build the packet and
+// ether_output it before asking for another.
+struct NetPkt *
+ether_alloc(void)
+{
+	uintptr_t va;
+
+	if (tx_n == NET_BATCH)
+		ether_flush();
+	if (tx_n == NET_BATCH)
+		return 0;
+	va = TXVA + tx_n * PGSIZE;
+	if (!(upte(va) & PTE_P) && sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;
+	return (struct NetPkt *) va;
+}
+
+// The packet page 'pkt', which came in, moved to the queue to be sent
+// back out, as for ether_alloc; 0 if the queue is full.
+struct NetPkt *
+ether_reuse(struct NetPkt *pkt)
+{
+	uintptr_t va;
+
+	if (tx_n == NET_BATCH)
+		ether_flush();
+	if (tx_n == NET_BATCH)
+		return 0;
+	va = TXVA + tx_n * PGSIZE;
+	if (sys_page_map(0, pkt, 0, (void *) va, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;
+	return (struct NetPkt *) va;
+}
+
+// Send pkt, with 'len' bytes after the Ethernet header, to the host
+// 'nexthop' on the local network.  If we don't know its Ethernet
+// address yet, the page asks for it instead and the packet is lost:
+// TCP sends it again.
+void
+ether_output(struct NetPkt *pkt, uint32_t nexthop, uint16_t type, int len)
+{
+	const uint8_t *mac;
+
+	if ((mac = arp_lookup(nexthop)) != 0)
+		ether_queue(pkt, mac, type, len);
+	else {
+		if (debug)
+			cprintf("ns: who has %08x?\n", nexthop);
+		arp_output(pkt, ARP_REQUEST, 0, nexthop);
+	}
+}
+
+// Hand the queued packets to the card.  If its transmit ring stays
+// full, give up on the rest; their pages are used again.
+void
+ether_flush(void)
+{
+	int i, r, tries;
+
+	for (i = 0, tries = 0; i < tx_n && tries < 10; i += r) {
+		if ((r = sys_net_try_send((void *) (TXVA + i * PGSIZE), tx_n - i)) < 0) {
+			cprintf("ns: sys_net_try_send: %e\n", r);
+			break;
+		}
+		// The card takes what fits in its ring, and the pages it
+		// took are unmapped; wait for it to send some
+		if (r == 0) {
+			tries++;
+			sys_yield();
+		}
+	}
+	if (i < tx_n)
+		cprintf("ns: %d packets not sent\n", tx_n - i);
+	tx_n = 0;
+}
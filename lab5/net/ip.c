@@ -0,0 +1,111 @@
+// IPv4 and ICMP.
+//
+// We take only datagrams for us, whole: fragments are dropped, and we
+// never fragment, sending nothing bigger than an Ethernet frame.  The
+// only ICMP we answer is echo, in the page the request came in.
+
+#include "ns.h"
+
+#define ICMP_ECHOREPLY	0
+#define ICMP_ECHO	8
+
+struct icmp_hdr {
+	uint8_t ic_type;
+	uint8_t ic_code;
+	uint16_t ic_sum;
+	uint16_t ic_id;
+	uint16_t ic_seq;
+} __attribute__((packed));
+
+static uint16_t ip_id;
+
+// The Internet checksum of the 'len' bytes at buf, plus 'sum', a sum of
+// 16-bit words in host order (as for a pseudo-header), complemented.
+// A buffer whose checksum field is right sums to 0.
+uint16_t
+inet_cksum(const void *buf, int len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+
+	for (; len > 1; len -= 2, p += 2)
+		sum += (p[0] << 8) | p[1];
+	if (len > 0)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+static void
+icmp_input(struct NetPkt *pkt, struct ip_hdr *ip, uint8_t *data, int len)
+{
+	struct icmp_hdr *ic = (struct icmp_hdr *) data;
+	uint32_t src, off;
+
+	if (len < (int) sizeof(*ic) || inet_cksum(ic, len, 0) != 0
+	    || ic->ic_type != ICMP_ECHO)
+		return;
+	src = ntohl(ip->ip_src);
+	off = data - (uint8_t *) pkt;
+	if ((pkt = ether_reuse(pkt)) == 0)
+		return;
+	// The reply has no IP options
+	memmove(PKT_IPDATA(pkt), (uint8_t *) pkt + off, len);
+	ic = (struct icmp_hdr *) PKT_IPDATA(pkt);
+	ic->ic_type = ICMP_ECHOREPLY;
+	ic->ic_sum = 0;
+	ic->ic_sum = htons(inet_cksum(ic, len, 0));
+	ip_output(pkt, src, IP_PROTO_ICMP, len);
+}
+
+// A packet came in, 'len' bytes after its Ethernet header.
+void
+ip_input(struct NetPkt *pkt, int len)
+{
+	struct ip_hdr *ip = PKT_IP(pkt);
+	int hlen, iplen;
+
+	if (len < IP_HLEN || (ip->ip_vhl >> 4) != 4)
+		return;
+	hlen = (ip->ip_vhl & 0xF) * 4;
+	iplen = ntohs(ip->ip_len);
+	if (hlen < IP_HLEN || iplen < hlen || iplen > len
+	    || inet_cksum(ip, hlen, 0) != 0)
+		return;
+	if (ntohl(ip->ip_dst) != NS_IPADDR
+	    || (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+		return;
+
+	switch (ip->ip_proto) {
+	case IP_PROTO_ICMP:
+		icmp_input(pkt, ip, (uint8_t *) ip + hlen, iplen - hlen);
+		break;
+	case IP_PROTO_TCP:
+		tcp_input(ip, (struct tcp_hdr *) ((uint8_t *) ip + hlen), iplen - hlen);
+		break;
+	}
+}
+
+// Send pkt, the page from ether_alloc or ether_reuse, which has 'len'
+// bytes of 'proto' at PKT_IPDATA, to 'dst'.
+void
+ip_output(struct NetPkt *pkt, uint32_t dst, int proto, int len)
+{
+	struct ip_hdr *ip = PKT_IP(pkt);
+
+	ip->ip_vhl = (4 << 4) | (IP_HLEN / 4);
+	ip->ip_tos = 0;
+	ip->ip_len = htons(IP_HLEN + len);
+	ip->ip_id = htons(ip_id++);
+	ip->ip_off = htons(0x4000);	// don't fragment
+	ip->ip_ttl = 64;
+	ip->ip_proto = proto;
+	ip->ip_src = htonl(NS_IPADDR);
+	ip->ip_dst = htonl(dst);
+	ip->ip_sum = 0;
+	ip->ip_sum = htons(inet_cksum(ip, IP_HLEN, 0));
+
+	// Hosts on our network directly, the rest through the gateway
+	ether_output(pkt, ((dst ^ NS_IPADDR) & NS_NETMASK) == 0 ? dst : NS_GATEWAY,
+		     ETH_IP, IP_HLEN + len);
+}
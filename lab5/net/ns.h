@@ -0,0 +1,120 @@
+#ifndef JOS_NET_NS_H
+#define JOS_NET_NS_H
+
+#include <inc/lib.h>
+#include <inc/chan.h>
+#include <inc/ns.h>
+
+// Our address, the local network's mask, and where everything else
+// goes: the defaults of Bochs's vnet network (see .bochsrc)
+#define NS_IPADDR	IP4(192, 168, 10, 2)
+#define NS_NETMASK	IP4(255, 255, 255, 0)
+#define NS_GATEWAY	IP4(192, 168, 10, 1)
+
+// Sockets, and clients keeping a request page with us
+#define NS_NSOCK	32
+#define NS_NCLIENT	64
+
+// Our clock ticks, in the kernel's, which the timer helper (serv.c)
+// sleeps for: 100ms at the kernel's default HZ
+#ifndef NS_TICK
+#define NS_TICK		10
+#endif
+
+// Where things are in our address space:
+// a request that came with a page,
+#define REQVA		0x0ffff000
+// the packets the input helper received, NET_BATCH pages,
+#define RXVA		0xDF000000
+// the packets waiting to go out, NET_BATCH pages (ether.c),
+#define TXVA		0xDF400000
+// socket s's rings (the layout of inc/ns.h's SOCK_RX and SOCK_TX),
+#define SOCKVA(s)	(0xE0000000 + (s) * 16 * PGSIZE)
+// and client c's request page
+#define CLIENTVA(c)	(0xEC000000 + (c) * PGSIZE)
+
+// Headers, in network order
+struct eth_hdr {
+	uint8_t eth_dst[6];
+	uint8_t eth_src[6];
+	uint16_t eth_type;
+} __attribute__((packed));
+
+#define ETH_HLEN	14
+#define ETH_IP		0x0800
+#define ETH_ARP		0x0806
+
+struct ip_hdr {
+	uint8_t ip_vhl;		// version 4, header length in words
+	uint8_t ip_tos;
+	uint16_t ip_len;	// of the datagram
+	uint16_t ip_id;
+	uint16_t ip_off;	// fragment offset and flags
+	uint8_t ip_ttl;
+	uint8_t ip_proto;
+	uint16_t ip_sum;
+	uint32_t ip_src;
+	uint32_t ip_dst;
+} __attribute__((packed));
+
+#define IP_HLEN		20
+#define IP_PROTO_ICMP	1
+#define IP_PROTO_TCP	6
+#define IP_MF		0x2000	// more fragments
+#define IP_OFFMASK	0x1FFF
+
+struct tcp_hdr {
+	uint16_t th_sport;
+	uint16_t th_dport;
+	uint32_t th_seq;
+	uint32_t th_ack;
+	uint8_t th_off;		// header length in words, in the top 4 bits
+	uint8_t th_flags;
+	uint16_t th_win;
+	uint16_t th_sum;
+	uint16_t th_urp;
+} __attribute__((packed));
+
+#define TCP_HLEN	20
+#define TH_FIN		0x01
+#define TH_SYN		0x02
+#define TH_RST		0x04
+#define TH_PSH		0x08
+#define TH_ACK		0x10
+
+// The largest segment we send or take: an Ethernet frame's worth
+#define TCP_MSS		(1500 - IP_HLEN - TCP_HLEN)
+
+// Where a packet's IP header and its payload are
+#define PKT_IP(pkt)	((struct ip_hdr *) ((pkt)->np_data + ETH_HLEN))
+#define PKT_IPDATA(pkt)	((pkt)->np_data + ETH_HLEN + IP_HLEN)
+
+// serv.c
+void ns_reply(envid_t envid, int32_t value);
+void ns_timer_armed(void);
+
+// ether.c
+extern uint8_t ether_mac[6];
+void ether_input(struct NetPkt *pkt);
+struct NetPkt *ether_alloc(void);
+struct NetPkt *ether_reuse(struct NetPkt *pkt);
+void ether_output(struct NetPkt *pkt, uint32_t nexthop, uint16_t type, int len);
+void ether_flush(void);
+
+// ip.c
+uint16_t inet_cksum(const void *buf, int len, uint32_t sum);
+void ip_input(struct NetPkt *pkt, int len);
+void ip_output(struct NetPkt *pkt, uint32_t dst, int proto, int len);
+
+// tcp.c
+void tcp_input(struct ip_hdr *ip, struct tcp_hdr *th, int len);
+int tcp_socket(envid_t envid, struct Nsreq_socket *rq);
+int tcp_bind(struct Nsreq_bind *rq);
+int tcp_listen(struct Nsreq_listen *rq);
+void tcp_accept(envid_t envid, struct Nsreq_accept *rq);
+void tcp_connect(envid_t envid, struct Nsreq_connect *rq);
+int tcp_close(struct Nsreq_close *rq);
+void tcp_flush(void);
+bool tcp_timer(void);
+
+#endif	// !JOS_NET_NS_H
@@ -0,0 +1,280 @@
+// The network server: sockets for its clients, over the TCP/IP stack
+// in ether.c, ip.c and tcp.c and the e1000's sys_net_* calls.
+//
+// Like the file server, we answer requests one at a time from an
+// ipc_reply_wait loop, and each client sends its requests in a page it
+// has given us to keep.  A socket's data never comes here by IPC: it
+// moves through the socket's rings, and the client's only message about
+// it is an NSREQ_KICK when a ring we were waiting on moves.  Requests
+// that must wait (accept, connect) are answered later, with
+// sys_ipc_try_send, the client still blocked in ipc_call.
+//
+// Two helpers we fork do the waiting we can't do while we wait for
+// requests: one sits in sys_net_recv and brings us each batch of
+// packets with NSREQ_INPUT, and the other sends NSREQ_TIMER each clock
+// tick -- only while some TCP timer is running, since we hold back our
+// answer to its tick until one is.
+
+#include "ns.h"
+
+#define debug 0
+
+struct Client {
+	envid_t c_envid;	// 0 if free
+};
+
+static struct Client clients[NS_NCLIENT];
+static uint16_t client_ix[NENV];	// ENVX(envid) -> client number + 1
+
+static envid_t input_env, timer_env;
+static bool timer_parked;	// we're holding back timer_env's answer
+static bool no_net;		// there's no network card
+
+// The env whose request we're serving, and the answer to send it with
+// the next ipc_reply_wait
+static envid_t serve_whom;
+static envid_t reply_envid;
+static int32_t reply_value;
+
+// Is the env that was client c gone?
+static bool
+client_gone(int c)
+{
+	envid_t id = clients[c].c_envid;
+
+	return id == 0 || envs[ENVX(id)].env_id != id
+		|| envs[ENVX(id)].env_status == ENV_FREE;
+}
+
+// Find envid's client number, giving it one if 'create' is set.
+// Returns -E_INVAL if it has none, -E_MAX_OPEN if they're all taken.
+static int
+client_lookup(envid_t envid, bool create)
+{
+	int c = client_ix[ENVX(envid)] - 1;
+
+	if (c >= 0 && clients[c].c_envid == envid)
+		return c;
+	if (!create)
+		return -E_INVAL;
+	if (c < 0 || !client_gone(c))
+		for (c = 0; c < NS_NCLIENT && !client_gone(c); c++)
+			;
+	if (c == NS_NCLIENT)
+		return -E_MAX_OPEN;
+	sys_page_unmap(0, (void *) CLIENTVA(c));
+	if (clients[c].c_envid && client_ix[ENVX(clients[c].c_envid)] == c + 1)
+		client_ix[ENVX(clients[c].c_envid)] = 0;
+	clients[c].c_envid = envid;
+	client_ix[ENVX(envid)] = c + 1;
+	return c;
+}
+
+// Answer envid: with the next ipc_reply_wait if it's the env whose
+// request we're serving, or else now.
+void
+ns_reply(envid_t envid, int32_t value)
+{
+	if (envid == serve_whom && reply_envid == 0) {
+		reply_envid = envid;
+		reply_value = value;
+	} else
+		(void) sys_ipc_try_send(envid, value, (void *) UTOP, 0);
+}
+
+// A TCP timer has started: let the clock run.
+void
+ns_timer_armed(void)
+{
+	if (timer_parked) {
+		timer_parked = 0;
+		(void) sys_ipc_try_send(timer_env, 0, (void *) UTOP, 0);
+	}
+}
+
+// The input helper has n packets for us, at its RXVA.
+static void
+serve_input(int n)
+{
+	int i, r;
+
+	if (n <= 0 || n > NET_BATCH)
+		return;
+	if ((r = sys_page_map_range(input_env, (void *) RXVA, 0, (void *) RXVA,
+				    n, PTE_P|PTE_U|PTE_W)) < 0) {
+		cprintf("ns: can't map input packets: %e\n", r);
+		ns_reply(input_env, 0);
+		return;
+	}
+	// Let it wait for the next batch while we handle this one
+	(void) sys_ipc_try_send(input_env, 0, (void *) UTOP, 0);
+	for (i = 0; i < n; i++)
+		ether_input((struct NetPkt *) (RXVA + i * PGSIZE));
+}
+
+// A request from a client, in 'pg' if it came with one.
+static void
+serve_request(envid_t whom, uint32_t req, int perm)
+{
+	void *rq;
+	int c, r;
+
+	// Requests come in the client's page; one that brings its page
+	// makes that the client's page from now on
+	if ((c = client_lookup(whom, perm & PTE_P)) < 0) {
+		ns_reply(whom, c);
+		return;
+	}
+	if ((perm & PTE_P)
+	    && (r = sys_page_map(0, (void *) REQVA, 0, (void *) CLIENTVA(c),
+				 PTE_P|PTE_U|PTE_W)) < 0) {
+		ns_reply(whom, r);
+		return;
+	}
+	if (!(vpt[VPN(CLIENTVA(c))] & PTE_P)) {
+		cprintf("ns: invalid request from %08x: no argument page\n", whom);
+		ns_reply(whom, -E_INVAL);
+		return;
+	}
+	rq = (void *) CLIENTVA(c);
+	if (debug)
+		cprintf("ns req %d from %08x\n", NSREQ_TYPE(req), whom);
+
+	if (no_net && NSREQ_TYPE(req) != NSREQ_SETUP) {
+		ns_reply(whom, -E_NO_NET);
+		return;
+	}
+	switch (NSREQ_TYPE(req)) {
+	case NSREQ_SETUP:
+		r = 0;
+		break;
+	case NSREQ_SOCKET:
+		r = tcp_socket(whom, rq);
+		break;
+	case NSREQ_BIND:
+		r = tcp_bind(rq);
+		break;
+	case NSREQ_LISTEN:
+		r = tcp_listen(rq);
+		break;
+	case NSREQ_CLOSE:
+		r = tcp_close(rq);
+		break;
+	case NSREQ_ACCEPT:
+		// These answer for themselves, maybe later
+		tcp_accept(whom, rq);
+		return;
+	case NSREQ_CONNECT:
+		tcp_connect(whom, rq);
+		return;
+	default:
+		cprintf("ns: invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+		break;
+	}
+	ns_reply(whom, r);
+}
+
+static void
+serve(void)
+{
+	uint32_t req;
+	envid_t whom;
+	int perm;
+
+	while (1) {
+		req = ipc_reply_wait(reply_envid, reply_value, 0, 0, (void *) REQVA,
+				     &whom, &perm);
+		reply_envid = 0;
+		if ((int32_t) req < 0) {
+			cprintf("ns: ipc_reply_wait failed: %e\n", req);
+			continue;
+		}
+
+		serve_whom = whom;
+		if (whom == input_env && NSREQ_TYPE(req) == NSREQ_INPUT)
+			serve_input(NSREQ_ARG(req));
+		else if (whom == timer_env && NSREQ_TYPE(req) == NSREQ_TIMER) {
+			if (tcp_timer())
+				ns_reply(timer_env, 0);
+			else
+				timer_parked = 1;
+		} else if (NSREQ_TYPE(req) == NSREQ_KICK && !(perm & PTE_P)) {
+			// No answer: the client didn't wait for one.
+			// tcp_flush does the work.
+		} else
+			serve_request(whom, req, perm);
+
+		// Everything this brought about goes out together
+		if (!no_net) {
+			tcp_flush();
+			ether_flush();
+		}
+		serve_whom = 0;
+	}
+}
+
+// Bring the server packets as they come in.
+static void
+input_helper(envid_t ns)
+{
+	int n;
+
+	binaryname = "ns_input";
+	while (1) {
+		if ((n = sys_net_recv((void *) RXVA, NET_BATCH)) < 0) {
+			cprintf("ns_input: sys_net_recv: %e\n", n);
+			sys_yield();
+			continue;
+		}
+		ipc_call(ns, NSREQ_WITHARG(NSREQ_INPUT, n), 0, 0, 0, 0);
+	}
+}
+
+// Tick the server's clock, once it asks for the next tick.
+static void
+timer_helper(envid_t ns)
+{
+	binaryname = "ns_timer";
+	while (1) {
+		sys_sleep(NS_TICK);
+		ipc_call(ns, NSREQ_TIMER, 0, 0, 0, 0);
+	}
+}
+
+static envid_t
+start_helper(void (*helper)(envid_t))
+{
+	envid_t ns = sys_getenvid(), id;
+
+	if ((id = fork()) < 0)
+		panic("ns: fork: %e", id);
+	if (id == 0) {
+		helper(ns);
+		exit();
+	}
+	return id;
+}
+
+void
+umain(void)
+{
+	int r;
+
+	binaryname = "ns";
+	if ((r = sys_net_hwaddr(ether_mac)) < 0) {
+		// Answer anyway, so clients hear there's no network
+		cprintf("ns: no network card: %e\n", r);
+		no_net = 1;
+		serve();
+	}
+	cprintf("ns: %d.%d.%d.%d, MAC %02x:%02x:%02x:%02x:%02x:%02x\n",
+		NS_IPADDR >> 24, (NS_IPADDR >> 16) & 0xFF,
+		(NS_IPADDR >> 8) & 0xFF, NS_IPADDR & 0xFF,
+		ether_mac[0], ether_mac[1], ether_mac[2],
+		ether_mac[3], ether_mac[4], ether_mac[5]);
+
+	input_env = start_helper(input_helper);
+	timer_env = start_helper(timer_helper);
+	serve();
+}
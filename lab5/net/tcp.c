@@ -0,0 +1,834 @@
+// TCP.
+//
+// A socket's data lives in its two rings (see inc/ns.h), which the
+// client maps too.  What the peer sends goes straight into the receive
+// ring, and the window we offer is the room left in it.  The transmit
+// ring holds what the client has written and is our retransmission
+// buffer as well: its read position is the oldest byte the peer hasn't
+// acknowledged, so the byte ch_rpos + i has sequence number
+// s_snd_una + i (once the SYN is acknowledged).
+//
+// It's a small TCP.  Segments that arrive out of order are dropped, to
+// be sent again; a lost segment is recovered by going back to it when
+// the retransmission timer runs out; there is no TIME_WAIT, no window
+// scaling, and no urgent data.  Segments are answered in batches: input
+// only notes that an ACK is due, and tcp_flush, which serv.c calls
+// after each batch of packets or request, sends one per socket.
+//
+// The client tells us it's done with a socket by unmapping its rings;
+// we notice when we are the only one left mapping the transmit ring
+// and close the connection once what it wrote has gone out.  The
+// client hears of the end of the stream from the peer the same way,
+// when we unmap the receive ring, and of a reset too, after which what
+// it writes is thrown away.
+
+#include <inc/x86.h>
+#include "ns.h"
+
+#define debug 0
+
+enum {
+	TCP_FREE = 0,
+	TCP_CLOSED,		// not connected, or the connection is over
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RCVD,
+	TCP_ESTABLISHED,	// or closing, by s_fin_sent and s_fin_rcvd
+};
+
+// Timers, in ticks of NS_TICK
+#define TCP_RTO_INIT	5	// first retransmission timeout
+#define TCP_RTO_MAX	64
+#define TCP_MAXRETRIES	8	// timeouts in a row before giving up
+#define TCP_FINWAIT	100	// how long a closed socket waits for the peer's FIN
+
+#define TCP_MAXBACKLOG	8
+#define TCP_PORT_FIRST	49152	// ports bind and connect pick
+
+#define SEQ_LT(a, b)	((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)	((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a, b)	((int32_t) ((a) - (b)) > 0)
+
+#define RING_SIZE	(SOCK_RINGPAGES * PGSIZE)
+#define SOCK_PERM	(PTE_P|PTE_U|PTE_W|PTE_SHARE)
+
+struct Sock {
+	int s_state;
+	uint32_t s_gen;		// changes each time the slot is freed
+	struct Chan *s_rx;	// 0 once the client has been told EOF
+	struct Chan *s_tx;
+	bool s_accepted;	// a client has the socket; not so for
+				// connections waiting in a listen queue
+	bool s_orphan;		// every client has closed it
+
+	uint16_t s_lport;	// host order
+	uint16_t s_rport;
+	uint32_t s_raddr;
+
+	// Listening, the number of connections we may queue; the env
+	// blocked in accept or connect, and its request
+	int s_backlog;
+	struct Sock *s_listener;	// listening socket, until accepted
+	uint32_t s_queued;	// when it joined the listen queue
+	envid_t s_waiter;
+	struct Nsreq_accept *s_waiter_rq;
+
+	// Sequence numbers
+	uint32_t s_iss;		// our first
+	uint32_t s_snd_una;	// oldest unacknowledged
+	uint32_t s_snd_nxt;	// next to send
+	uint32_t s_snd_max;	// highest sent, past s_snd_nxt after a timeout
+	uint32_t s_snd_wnd;	// the peer's window, from s_snd_una
+	uint32_t s_fin_seq;	// our FIN's, if s_fin_sent
+	uint32_t s_rcv_nxt;	// next we expect
+	uint32_t s_rcv_adv;	// window we last offered
+	bool s_fin_sent, s_fin_acked, s_fin_rcvd;
+	bool s_ack_due;		// send an ACK at the next tcp_output
+	bool s_probe;		// may send a byte into a closed window
+
+	int s_timer;		// ticks left, 0 if not running
+	int s_rto;
+	int s_retries;
+};
+
+static struct Sock socks[NS_NSOCK];
+static uint16_t tcp_next_port = TCP_PORT_FIRST;
+static uint32_t tcp_nqueued;
+
+static void tcp_output(struct Sock *s);
+
+static int
+sockid(struct Sock *s)
+{
+	return (s->s_gen % 1024) * NS_NSOCK + (s - socks);
+}
+
+static struct Sock *
+sock_lookup(int id)
+{
+	struct Sock *s;
+
+	if (id < 0)
+		return 0;
+	s = &socks[id % NS_NSOCK];
+	if (s->s_state == TCP_FREE || sockid(s) != id)
+		return 0;
+	return s;
+}
+
+// A free socket, with its rings mapped at SOCKVA, or 0.
+static struct Sock *
+sock_alloc(void)
+{
+	struct Sock *s;
+	uint32_t gen;
+	int i, r;
+	uintptr_t va;
+
+	for (s = socks; s < socks + NS_NSOCK && s->s_state != TCP_FREE; s++)
+		;
+	if (s == socks + NS_NSOCK)
+		return 0;
+	va = SOCKVA(s - socks);
+	for (i = 0; i < SOCK_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (void *) (va + i * PGSIZE), SOCK_PERM)) < 0) {
+			while (--i >= 0)
+				sys_page_unmap(0, (void *) (va + i * PGSIZE));
+			return 0;
+		}
+	gen = s->s_gen;
+	memset(s, 0, sizeof(*s));
+	s->s_gen = gen;
+	s->s_state = TCP_CLOSED;
+	s->s_rx = SOCK_RX(va);
+	s->s_tx = SOCK_TX(va);
+	s->s_rx->ch_size = s->s_tx->ch_size = RING_SIZE;
+	s->s_rx->ch_server = s->s_tx->ch_server = env->env_id;
+	s->s_rx->ch_server_value = s->s_tx->ch_server_value
+		= NSREQ_WITHARG(NSREQ_KICK, sockid(s));
+	s->s_rto = TCP_RTO_INIT;
+	return s;
+}
+
+static void
+sock_free(struct Sock *s)
+{
+	uintptr_t va = SOCKVA(s - socks);
+	int i;
+
+	if (debug)
+		cprintf("ns: free socket %d\n", sockid(s));
+	if (s->s_waiter)
+		ns_reply(s->s_waiter, -E_CONN_TIMEOUT);
+	for (i = 0; i < SOCK_NPAGES; i++)
+		sys_page_unmap(0, (void *) (va + i * PGSIZE));
+	s->s_state = TCP_FREE;
+	s->s_gen++;
+}
+
+// The end of the stream from the peer: the client reads what's in the
+// ring, then finds we've gone.
+static void
+sock_eof(struct Sock *s)
+{
+	uintptr_t va = (uintptr_t) s->s_rx;
+	int i;
+
+	if (!s->s_rx)
+		return;
+	s->s_rx = 0;
+	for (i = 0; i < 1 + SOCK_RINGPAGES; i++)
+		sys_page_unmap(0, (void *) (va + i * PGSIZE));
+}
+
+static void
+timer_start(struct Sock *s, int ticks)
+{
+	s->s_timer = ticks;
+	ns_timer_armed();
+}
+
+static uint16_t
+tcp_cksum(uint32_t src, uint32_t dst, const void *th, int len)
+{
+	return inet_cksum(th, len, (src >> 16) + (src & 0xFFFF) + (dst >> 16)
+			  + (dst & 0xFFFF) + IP_PROTO_TCP + len);
+}
+
+// Send a segment from lport to raddr:rport, its data the n bytes 'off'
+// into the ring 'data'; a SYN says what MSS we take.
+static int
+tcp_xmit(uint16_t lport, uint32_t raddr, uint16_t rport, uint32_t seq,
+	 uint32_t ack, int flags, uint32_t win, struct Chan *data,
+	 uint32_t off, uint32_t n)
+{
+	struct NetPkt *pkt;
+	struct tcp_hdr *th;
+	uint8_t *opt;
+	int hlen = TCP_HLEN;
+
+	if ((pkt = ether_alloc()) == 0)
+		return -E_NO_MEM;
+	th = (struct tcp_hdr *) PKT_IPDATA(pkt);
+	opt = (uint8_t *) (th + 1);
+	if (flags & TH_SYN) {
+		opt[0] = 2;
+		opt[1] = 4;
+		opt[2] = TCP_MSS >> 8;
+		opt[3] = TCP_MSS & 0xFF;
+		hlen += 4;
+	}
+	th->th_sport = htons(lport);
+	th->th_dport = htons(rport);
+	th->th_seq = htonl(seq);
+	th->th_ack = (flags & TH_ACK) ? htonl(ack) : 0;
+	th->th_off = (hlen / 4) << 4;
+	th->th_flags = flags;
+	th->th_win = htons(MIN(win, 0xFFFF));
+	th->th_sum = 0;
+	th->th_urp = 0;
+	if (n > 0)
+		chan_peek(data, off, (uint8_t *) th + hlen, n);
+	th->th_sum = htons(tcp_cksum(NS_IPADDR, raddr, th, hlen + n));
+	ip_output(pkt, raddr, IP_PROTO_TCP, hlen + n);
+	return 0;
+}
+
+// Send a segment on s, with its ACK and window.
+static int
+tcp_send(struct Sock *s, uint32_t seq, int flags, uint32_t off, uint32_t n)
+{
+	uint32_t win = s->s_rx ? chan_room(s->s_rx) : 0;
+	int r;
+
+	if ((r = tcp_xmit(s->s_lport, s->s_raddr, s->s_rport, seq, s->s_rcv_nxt,
+			  flags, win, s->s_tx, off, n)) < 0)
+		return r;
+	if (flags & TH_ACK) {
+		s->s_rcv_adv = win;
+		s->s_ack_due = 0;
+	}
+	return 0;
+}
+
+// Answer a segment no socket wants with a reset.
+static void
+tcp_reset_reply(struct ip_hdr *ip, struct tcp_hdr *th, int dlen)
+{
+	uint32_t seq = ntohl(th->th_seq);
+
+	if (th->th_flags & TH_RST)
+		return;
+	if (th->th_flags & TH_ACK)
+		tcp_xmit(ntohs(th->th_dport), ntohl(ip->ip_src), ntohs(th->th_sport),
+			 ntohl(th->th_ack), 0, TH_RST, 0, 0, 0, 0);
+	else
+		tcp_xmit(ntohs(th->th_dport), ntohl(ip->ip_src), ntohs(th->th_sport),
+			 0, seq + dlen + !!(th->th_flags & TH_SYN)
+			 + !!(th->th_flags & TH_FIN), TH_RST | TH_ACK, 0, 0, 0, 0);
+}
+
+// The connection is over, by a reset (err < 0) or a timeout.
+static void
+tcp_drop(struct Sock *s, int err, bool send_rst)
+{
+	if (send_rst && s->s_state >= TCP_SYN_RCVD)
+		tcp_xmit(s->s_lport, s->s_raddr, s->s_rport, s->s_snd_nxt, 0,
+			 TH_RST, 0, 0, 0, 0);
+	if (s->s_waiter) {
+		ns_reply(s->s_waiter, err);
+		s->s_waiter = 0;
+	}
+	s->s_state = TCP_CLOSED;
+	s->s_timer = 0;
+	sock_eof(s);
+	if (s->s_orphan || !s->s_accepted)
+		sock_free(s);
+}
+
+// Is the connection over, both ways?
+static void
+tcp_check_done(struct Sock *s)
+{
+	if (s->s_state != TCP_ESTABLISHED || !s->s_fin_acked || !s->s_fin_rcvd)
+		return;
+	s->s_state = TCP_CLOSED;
+	s->s_timer = 0;
+	if (s->s_orphan)
+		sock_free(s);
+}
+
+// Give the listening socket l's waiting accept the connection c.
+static void
+tcp_accept_done(struct Sock *l, struct Sock *c)
+{
+	struct Nsreq_accept *rq = l->s_waiter_rq;
+	int r;
+
+	if ((r = sys_page_map_range(0, (void *) SOCKVA(c - socks), l->s_waiter,
+				    (void *) rq->req_va, SOCK_NPAGES, SOCK_PERM)) < 0) {
+		ns_reply(l->s_waiter, r);
+		l->s_waiter = 0;
+		return;
+	}
+	c->s_accepted = 1;
+	c->s_listener = 0;
+	rq->ret_addr.sin_family = AF_INET;
+	rq->ret_addr.sin_port = htons(c->s_rport);
+	rq->ret_addr.sin_addr = htonl(c->s_raddr);
+	ns_reply(l->s_waiter, sockid(c));
+	l->s_waiter = 0;
+}
+
+static void
+tcp_established(struct Sock *s)
+{
+	s->s_state = TCP_ESTABLISHED;
+	if (s->s_listener) {
+		s->s_queued = ++tcp_nqueued;
+		if (s->s_listener->s_waiter)
+			tcp_accept_done(s->s_listener, s);
+	} else if (s->s_waiter) {
+		ns_reply(s->s_waiter, 0);
+		s->s_waiter = 0;
+	}
+}
+
+// A SYN came to the listening socket l: start a connection for accept.
+static void
+tcp_syn(struct Sock *l, uint32_t raddr, uint16_t rport, uint32_t seq, uint32_t win)
+{
+	struct Sock *c;
+	int n = 0;
+
+	for (c = socks; c < socks + NS_NSOCK; c++)
+		if (c->s_state != TCP_FREE && c->s_listener == l)
+			n++;
+	if (n >= l->s_backlog || (c = sock_alloc()) == 0)
+		return;
+	c->s_state = TCP_SYN_RCVD;
+	c->s_listener = l;
+	c->s_lport = l->s_lport;
+	c->s_raddr = raddr;
+	c->s_rport = rport;
+	c->s_rcv_nxt = seq + 1;
+	c->s_snd_wnd = win;
+	c->s_iss = c->s_snd_una = c->s_snd_nxt = c->s_snd_max = read_tsc();
+	tcp_output(c);
+}
+
+// The peer acknowledged everything before 'ack'.
+static void
+tcp_acked(struct Sock *s, uint32_t ack)
+{
+	uint32_t n = ack - s->s_snd_una;
+
+	// The SYN and FIN have sequence numbers, but no place in the ring
+	if (s->s_snd_una == s->s_iss) {
+		n--;
+		if (s->s_state == TCP_SYN_RCVD)
+			tcp_established(s);
+	}
+	if (s->s_fin_sent && SEQ_GT(ack, s->s_fin_seq)) {
+		n--;
+		s->s_fin_acked = 1;
+	}
+	chan_consume(s->s_tx, n);
+	s->s_snd_una = ack;
+	if (SEQ_LT(s->s_snd_nxt, ack))
+		s->s_snd_nxt = ack;
+	s->s_retries = 0;
+	s->s_rto = TCP_RTO_INIT;
+	if (s->s_snd_una != s->s_snd_max)
+		timer_start(s, s->s_rto);
+	else if (s->s_fin_acked && !s->s_fin_rcvd)
+		timer_start(s, TCP_FINWAIT);
+	else
+		s->s_timer = 0;
+}
+
+// A TCP segment came in: 'len' bytes at th.
+void
+tcp_input(struct ip_hdr *ip, struct tcp_hdr *th, int len)
+{
+	struct Sock *s, *l;
+	uint32_t raddr, seq, ack, win, dlen, n, trim;
+	uint16_t lport, rport;
+	uint8_t *data;
+	int hlen, flags;
+
+	if (len < TCP_HLEN)
+		return;
+	hlen = (th->th_off >> 4) * 4;
+	raddr = ntohl(ip->ip_src);
+	if (hlen < TCP_HLEN || hlen > len
+	    || tcp_cksum(raddr, NS_IPADDR, th, len) != 0)
+		return;
+	data = (uint8_t *) th + hlen;
+	dlen = len - hlen;
+	seq = ntohl(th->th_seq);
+	ack = ntohl(th->th_ack);
+	win = ntohs(th->th_win);
+	flags = th->th_flags;
+	lport = ntohs(th->th_dport);
+	rport = ntohs(th->th_sport);
+
+	// A connection, or else a listening socket
+	l = 0;
+	for (s = socks; s < socks + NS_NSOCK; s++) {
+		if (s->s_state == TCP_LISTEN && s->s_lport == lport)
+			l = s;
+		if (s->s_state >= TCP_SYN_SENT && s->s_lport == lport
+		    && s->s_raddr == raddr && s->s_rport == rport)
+			break;
+	}
+	if (s == socks + NS_NSOCK)
+		s = l;
+	if (!s) {
+		tcp_reset_reply(ip, th, dlen);
+		return;
+	}
+
+	switch (s->s_state) {
+	case TCP_LISTEN:
+		if (flags & TH_RST)
+			return;
+		if (flags & TH_ACK)
+			tcp_reset_reply(ip, th, dlen);
+		else if (flags & TH_SYN)
+			tcp_syn(s, raddr, rport, seq, win);
+		return;
+
+	case TCP_SYN_SENT:
+		if ((flags & TH_ACK) && ack != s->s_iss + 1) {
+			tcp_reset_reply(ip, th, dlen);
+			return;
+		}
+		if (flags & TH_RST) {
+			if (flags & TH_ACK)
+				tcp_drop(s, -E_CONN_REFUSED, 0);
+			return;
+		}
+		if ((flags & (TH_SYN | TH_ACK)) != (TH_SYN | TH_ACK))
+			return;
+		s->s_rcv_nxt = seq + 1;
+		s->s_snd_wnd = win;
+		tcp_acked(s, ack);
+		s->s_ack_due = 1;
+		tcp_established(s);
+		return;
+	}
+
+	// A synchronized connection
+	if (flags & TH_RST) {
+		if (SEQ_LEQ(s->s_rcv_nxt, seq)
+		    && SEQ_LT(seq, s->s_rcv_nxt + MAX(s->s_rcv_adv, 1)))
+			tcp_drop(s, -E_CONN_REFUSED, 0);
+		return;
+	}
+	if (flags & TH_SYN) {
+		// Our SYN-ACK was lost, and the peer sent its SYN again
+		if (s->s_state == TCP_SYN_RCVD && seq + 1 == s->s_rcv_nxt)
+			s->s_snd_nxt = s->s_snd_una;
+		s->s_ack_due = 1;
+		return;
+	}
+	if (!(flags & TH_ACK))
+		return;
+	if (SEQ_GT(ack, s->s_snd_max)) {
+		s->s_ack_due = 1;
+		return;
+	}
+	if (s->s_state == TCP_SYN_RCVD && ack != s->s_iss + 1) {
+		tcp_reset_reply(ip, th, dlen);
+		return;
+	}
+	if (SEQ_GT(ack, s->s_snd_una)) {
+		tcp_acked(s, ack);
+		tcp_check_done(s);
+		if (s->s_state != TCP_ESTABLISHED)
+			return;
+	}
+	if (ack == s->s_snd_una) {
+		// The window opened: no more probing
+		if (win > 0 && s->s_snd_wnd == 0 && s->s_snd_una == s->s_snd_max)
+			s->s_timer = 0;
+		s->s_snd_wnd = win;
+	}
+
+	if (dlen > 0 || (flags & TH_FIN)) {
+		// Keep the part of it we haven't had
+		if (SEQ_LT(seq, s->s_rcv_nxt)) {
+			trim = MIN(s->s_rcv_nxt - seq, dlen);
+			data += trim;
+			dlen -= trim;
+			seq += trim;
+		}
+		s->s_ack_due = 1;
+		if (seq != s->s_rcv_nxt)
+			return;
+		if (dlen > 0 && (!s->s_rx || s->s_orphan)) {
+			// Nobody will read it
+			tcp_drop(s, -E_CONN_REFUSED, 1);
+			return;
+		}
+		n = dlen > 0 ? chan_put(s->s_rx, data, dlen) : 0;
+		s->s_rcv_nxt += n;
+		if ((flags & TH_FIN) && n == dlen && !s->s_fin_rcvd) {
+			s->s_rcv_nxt++;
+			s->s_fin_rcvd = 1;
+			sock_eof(s);
+			tcp_check_done(s);
+		}
+	}
+}
+
+// Has the client read enough since our last ACK to offer more window?
+static bool
+tcp_window_grew(struct Sock *s)
+{
+	uint32_t room;
+
+	if (!s->s_rx)
+		return 0;
+	room = chan_room(s->s_rx);
+	return room > s->s_rcv_adv && room - s->s_rcv_adv >= MIN(TCP_MSS, RING_SIZE / 2);
+}
+
+// Send what we can on s: data the window allows, then a FIN if the
+// client has gone and it's all out, or just an ACK if one is due.
+static void
+tcp_output(struct Sock *s)
+{
+	uint32_t avail, off, n, wnd;
+
+	switch (s->s_state) {
+	case TCP_CLOSED:
+		// Nobody will send what the client writes
+		chan_consume(s->s_tx, chan_avail(s->s_tx));
+		s->s_tx->ch_rwait = 1;
+		return;
+
+	case TCP_SYN_SENT:
+	case TCP_SYN_RCVD:
+		if (s->s_snd_nxt == s->s_iss) {
+			if (tcp_send(s, s->s_iss, TH_SYN | (s->s_state == TCP_SYN_RCVD ? TH_ACK : 0),
+				     0, 0) < 0)
+				return;
+			s->s_snd_nxt = s->s_snd_max = s->s_iss + 1;
+			if (!s->s_timer)
+				timer_start(s, s->s_rto);
+		} else if (s->s_ack_due)
+			tcp_send(s, s->s_snd_nxt, TH_ACK, 0, 0);
+		return;
+
+	case TCP_ESTABLISHED:
+		break;
+
+	default:
+		return;
+	}
+
+again:
+	avail = chan_avail(s->s_tx);
+	while (!s->s_fin_sent && (off = s->s_snd_nxt - s->s_snd_una) < avail) {
+		wnd = SEQ_GT(s->s_snd_una + s->s_snd_wnd, s->s_snd_nxt)
+			? s->s_snd_una + s->s_snd_wnd - s->s_snd_nxt : 0;
+		if (wnd == 0) {
+			if (!s->s_probe)
+				break;
+			s->s_probe = 0;
+			wnd = 1;
+		}
+		n = MIN(MIN(avail - off, wnd), TCP_MSS);
+		if (tcp_send(s, s->s_snd_nxt, TH_ACK | (off + n == avail ? TH_PSH : 0),
+			     off, n) < 0)
+			break;
+		s->s_snd_nxt += n;
+	}
+	if (s->s_orphan && !s->s_fin_sent && s->s_snd_nxt - s->s_snd_una == avail
+	    && tcp_send(s, s->s_snd_nxt, TH_FIN | TH_ACK, 0, 0) == 0) {
+		s->s_fin_sent = 1;
+		s->s_fin_seq = s->s_snd_nxt++;
+	}
+	if (SEQ_GT(s->s_snd_nxt, s->s_snd_max))
+		s->s_snd_max = s->s_snd_nxt;
+
+	// Offer the room the client's reads have made, once it's worth it
+	if (tcp_window_grew(s))
+		s->s_ack_due = 1;
+	if (s->s_ack_due)
+		tcp_send(s, s->s_snd_nxt, TH_ACK, 0, 0);
+
+	// Time what's out; probe a closed window with what's waiting
+	if (!s->s_timer && (s->s_snd_una != s->s_snd_max
+			    || (avail > s->s_snd_nxt - s->s_snd_una && !s->s_fin_sent)))
+		timer_start(s, s->s_rto);
+
+	// Have the client kick us when it writes, if we'd send it, and
+	// when its reads open a window we've let shrink
+	if (!s->s_fin_sent && SEQ_GT(s->s_snd_una + s->s_snd_wnd, s->s_snd_nxt)) {
+		s->s_tx->ch_rwait = 1;
+		mb();
+		if (chan_avail(s->s_tx) != avail)
+			goto again;
+	}
+	if (s->s_rx && s->s_rcv_adv < RING_SIZE / 2) {
+		s->s_rx->ch_wwait = 1;
+		mb();
+		if (tcp_window_grew(s))
+			goto again;
+	}
+}
+
+// The retransmission timer ran out: go back to the oldest segment not
+// acknowledged, or probe the window.
+static void
+tcp_timeout(struct Sock *s)
+{
+	if (s->s_fin_acked) {
+		// The peer never sent its FIN
+		tcp_drop(s, 0, 1);
+		return;
+	}
+	if (s->s_snd_una == s->s_snd_max) {
+		s->s_probe = 1;
+		tcp_output(s);
+		return;
+	}
+	if (++s->s_retries > TCP_MAXRETRIES) {
+		tcp_drop(s, -E_CONN_TIMEOUT, 1);
+		return;
+	}
+	s->s_rto = MIN(2 * s->s_rto, TCP_RTO_MAX);
+	s->s_snd_nxt = s->s_snd_una;
+	if (s->s_fin_sent && !s->s_fin_acked)
+		s->s_fin_sent = 0;
+	s->s_timer = s->s_rto;
+	tcp_output(s);
+}
+
+// A clock tick.  Returns whether any timer is still running.
+bool
+tcp_timer(void)
+{
+	struct Sock *s;
+	bool running = 0;
+
+	for (s = socks; s < socks + NS_NSOCK; s++) {
+		if (s->s_state == TCP_FREE || s->s_timer == 0)
+			continue;
+		if (--s->s_timer == 0)
+			tcp_timeout(s);
+		if (s->s_state != TCP_FREE && s->s_timer)
+			running = 1;
+	}
+	return running;
+}
+
+// Every client has closed s.
+static void
+sock_release(struct Sock *s)
+{
+	struct Sock *c;
+
+	s->s_orphan = 1;
+	switch (s->s_state) {
+	case TCP_LISTEN:
+		for (c = socks; c < socks + NS_NSOCK; c++)
+			if (c->s_state != TCP_FREE && c->s_listener == s)
+				tcp_drop(c, 0, 1);
+		// fall through
+	case TCP_CLOSED:
+	case TCP_SYN_SENT:
+		sock_free(s);
+		break;
+	default:
+		// Unread data is lost, and the peer must hear so
+		if (s->s_rx && chan_avail(s->s_rx) > 0)
+			tcp_drop(s, 0, 1);
+	}
+}
+
+// Has every env that had s closed it?  Only we map the transmit ring
+// then.
+static void
+sock_check_orphan(struct Sock *s)
+{
+	if (s->s_accepted && !s->s_orphan && pageref(s->s_tx) == 1)
+		sock_release(s);
+}
+
+// After each event: send on every socket whatever there's to send.
+void
+tcp_flush(void)
+{
+	struct Sock *s;
+
+	for (s = socks; s < socks + NS_NSOCK; s++) {
+		if (s->s_state == TCP_FREE)
+			continue;
+		sock_check_orphan(s);
+		if (s->s_state != TCP_FREE)
+			tcp_output(s);
+	}
+}
+
+int
+tcp_socket(envid_t envid, struct Nsreq_socket *rq)
+{
+	struct Sock *s;
+	int r;
+
+	if ((s = sock_alloc()) == 0)
+		return -E_MAX_OPEN;
+	if ((r = sys_page_map_range(0, (void *) SOCKVA(s - socks), envid,
+				    (void *) rq->req_va, SOCK_NPAGES, SOCK_PERM)) < 0) {
+		sock_free(s);
+		return r;
+	}
+	s->s_accepted = 1;
+	return sockid(s);
+}
+
+static uint16_t
+tcp_pick_port(void)
+{
+	struct Sock *s;
+
+	while (1) {
+		if (++tcp_next_port < TCP_PORT_FIRST)
+			tcp_next_port = TCP_PORT_FIRST;
+		for (s = socks; s < socks + NS_NSOCK; s++)
+			if (s->s_state != TCP_FREE && s->s_lport == tcp_next_port)
+				break;
+		if (s == socks + NS_NSOCK)
+			return tcp_next_port;
+	}
+}
+
+int
+tcp_bind(struct Nsreq_bind *rq)
+{
+	struct Sock *s, *o;
+	uint16_t port = ntohs(rq->req_addr.sin_port);
+
+	if ((s = sock_lookup(rq->req_sockid)) == 0 || s->s_state != TCP_CLOSED
+	    || s->s_lport != 0 || rq->req_addr.sin_family != AF_INET
+	    || (rq->req_addr.sin_addr != INADDR_ANY
+		&& ntohl(rq->req_addr.sin_addr) != NS_IPADDR))
+		return -E_INVAL;
+	if (port == 0)
+		port = tcp_pick_port();
+	for (o = socks; o < socks + NS_NSOCK; o++)
+		if (o->s_state != TCP_FREE && o->s_lport == port)
+			return -E_ADDR_IN_USE;
+	s->s_lport = port;
+	return 0;
+}
+
+int
+tcp_listen(struct Nsreq_listen *rq)
+{
+	struct Sock *s;
+
+	if ((s = sock_lookup(rq->req_sockid)) == 0 || s->s_state != TCP_CLOSED
+	    || s->s_lport == 0 || s->s_rport != 0)
+		return -E_INVAL;
+	s->s_state = TCP_LISTEN;
+	s->s_backlog = MAX(1, MIN(rq->req_backlog, TCP_MAXBACKLOG));
+	return 0;
+}
+
+void
+tcp_accept(envid_t envid, struct Nsreq_accept *rq)
+{
+	struct Sock *l, *c, *first = 0;
+
+	if ((l = sock_lookup(rq->req_sockid)) == 0 || l->s_state != TCP_LISTEN
+	    || l->s_waiter) {
+		ns_reply(envid, -E_INVAL);
+		return;
+	}
+	l->s_waiter = envid;
+	l->s_waiter_rq = rq;
+	// The connection that has waited longest
+	for (c = socks; c < socks + NS_NSOCK; c++)
+		if (c->s_state == TCP_ESTABLISHED && c->s_listener == l
+		    && (!first || SEQ_LT(c->s_queued, first->s_queued)))
+			first = c;
+	if (first)
+		tcp_accept_done(l, first);
+}
+
+void
+tcp_connect(envid_t envid, struct Nsreq_connect *rq)
+{
+	struct Sock *s;
+
+	if ((s = sock_lookup(rq->req_sockid)) == 0 || s->s_state != TCP_CLOSED
+	    || s->s_rport != 0 || rq->req_addr.sin_family != AF_INET
+	    || rq->req_addr.sin_port == 0) {
+		ns_reply(envid, -E_INVAL);
+		return;
+	}
+	if (s->s_lport == 0)
+		s->s_lport = tcp_pick_port();
+	s->s_raddr = ntohl(rq->req_addr.sin_addr);
+	s->s_rport = ntohs(rq->req_addr.sin_port);
+	s->s_iss = s->s_snd_una = s->s_snd_nxt = s->s_snd_max = read_tsc();
+	s->s_state = TCP_SYN_SENT;
+	s->s_waiter = envid;
+	tcp_output(s);
+}
+
+int
+tcp_close(struct Nsreq_close *rq)
+{
+	struct Sock *s;
+
+	if ((s = sock_lookup(rq->req_sockid)) == 0)
+		return -E_INVAL;
+	sock_check_orphan(s);
+	return 0;
+}
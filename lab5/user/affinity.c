@@ -0,0 +1,27 @@
+// Pin ourselves to each CPU in turn and check that we end up running
+// there, then unpin.  Pinning to a CPU the machine doesn't have fails.
+
+#include <inc/lib.h>
+
+void
+umain(void)
+{
+	volatile struct Env *e = &envs[ENVX(sys_getenvid())];
+	int cpu, r;
+
+	for (cpu = 0; (r = sys_env_set_affinity(0, cpu)) == 0; cpu++) {
+		// The kernel moves us at the next reschedule
+		sys_yield();
+		if (e->env_cpunum != cpu)
+			panic("pinned to CPU %d but running on %d", cpu, e->env_cpunum);
+		if (e->env_affinity != cpu)
+			panic("env_affinity is %d, not %d", e->env_affinity, cpu);
+	}
+	if (r != -E_INVAL)
+		panic("pinning to CPU %d: %e, not -E_INVAL", cpu, r);
+	if ((r = sys_env_set_affinity(0, -2)) != -E_INVAL)
+		panic("pinning to CPU -2: %e, not -E_INVAL", r);
+	if ((r = sys_env_set_affinity(0, -1)) < 0)
+		panic("unpinning: %e", r);
+	cprintf("affinity ok: %d CPU(s)\n", cpu);
+}
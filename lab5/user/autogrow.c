@@ -0,0 +1,73 @@
+// Check auto-grow regions: a stack that runs far past its first page,
+// and a sparse region whose pages appear, zeroed, as they're touched,
+// all without a single sys_page_alloc.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x20000000)
+#define NPAGES	16
+
+static uint32_t
+page_allocs(void)
+{
+	return envs[ENVX(sys_getenvid())].env_sc_count[SYS_page_alloc];
+}
+
+// About 1KB of stack per level
+static int
+recurse(int depth)
+{
+	volatile char buf[1000];
+
+	buf[0] = depth;
+	buf[sizeof(buf) - 1] = depth;
+	if (depth == 0)
+		return 0;
+	return recurse(depth - 1) + buf[0] - buf[sizeof(buf) - 1] + 1;
+}
+
+void
+umain(void)
+{
+	uint32_t allocs = page_allocs();
+	envid_t child;
+	int r, i;
+
+	if ((r = recurse(100)) != 100)
+		panic("recurse returned %d", r);
+	cprintf("autogrow: 100KB of stack ok\n");
+
+	if ((r = sys_page_autogrow(REGION, NPAGES * PGSIZE)) < 0)
+		panic("sys_page_autogrow: %e", r);
+	if (sys_page_autogrow(REGION + PGSIZE, PGSIZE) != -E_INVAL)
+		panic("an overlapping region was accepted");
+	if (sys_page_autogrow(REGION + 1, PGSIZE) != -E_INVAL)
+		panic("an unaligned region was accepted");
+	if (sys_page_autogrow((void *) UTOP, PGSIZE) != -E_INVAL)
+		panic("a region above UTOP was accepted");
+
+	for (i = 0; i < NPAGES; i += 5) {
+		if (REGION[i * PGSIZE + 123] != 0)
+			panic("page %d of the region is not zeroed", i);
+		REGION[i * PGSIZE + 123] = i + 1;
+	}
+	if ((vpt[VPN(REGION + PGSIZE)] & PTE_P))
+		panic("an untouched page got mapped");
+	if (page_allocs() != allocs)
+		panic("%d sys_page_allocs", page_allocs() - allocs);
+
+	// A child gets the region too
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (REGION[5 * PGSIZE + 123] != 6 || REGION[3 * PGSIZE] != 0)
+			panic("child sees the wrong region contents");
+		exit();
+	}
+	while (envs[ENVX(child)].env_id == child && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+
+	if ((r = sys_page_autogrow(REGION, 0)) < 0)
+		panic("removing the region: %e", r);
+	cprintf("autogrow ok\n");
+}
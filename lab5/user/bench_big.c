@@ -0,0 +1,14 @@
+// A large binary that does nothing, for bench_proc to spawn: the
+// initialized array makes it a quarter megabyte more to load
+// than the small one.
+
+#include <inc/lib.h>
+
+char big[256 * 1024] = { 1 };
+
+void
+umain(void)
+{
+	if (big[0] != 1)
+		panic("bench_big: data not loaded");
+}
@@ -0,0 +1,200 @@
+// File system benchmarks: sequential write and read, random 4KB reads,
+// creating and removing small files, and lookups down a deep path and
+// in a large directory.  The reads and lookups run cold, right after
+// fsipc_drop_cache has emptied the server's block cache, and then warm.
+// `make bench-fs` runs this on the fixed image it builds (see
+// fs/Makefrag); the tests whose files aren't there are skipped.  Each
+// result is one line
+//	BENCH fs <test> cache=<cold|warm> n=<ops> bytes=<n> cycles=<c> per_op=<c>
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SEQFILE		"/bench_seq"
+#define SEQSIZE		(512 * 1024)
+#define CHUNK		(16 * 1024)
+#define DATAFILE	"/data"		// 1MB, in the fixed image
+#define NRAND		256
+#define NSMALL		64
+#define DEEPPATH	"/deep/d1/d2/d3/d4/d5/d6/d7/d8/leaf"
+#define BIGDIR		"/bigdir"	// f0 to f255, in the fixed image
+#define NBIGDIR		256
+#define NLOOKUP		64
+
+static char buf[CHUNK] __attribute__((aligned(PGSIZE)));
+
+static void
+result(const char *test, bool cold, int n, uint32_t bytes, uint64_t cycles)
+{
+	cprintf("BENCH fs %s cache=%s n=%d bytes=%u cycles=%llu per_op=%llu\n",
+		test, cold ? "cold" : "warm", n, bytes, cycles, cycles / n);
+}
+
+static void
+drop_cache(void)
+{
+	int r;
+
+	if ((r = fsipc_drop_cache()) < 0)
+		panic("fsipc_drop_cache: %e", r);
+}
+
+static int
+xopen(const char *path, int mode)
+{
+	int fd;
+
+	if ((fd = open(path, mode)) < 0)
+		panic("open %s: %e", path, fd);
+	return fd;
+}
+
+// Write SEQFILE in CHUNKs, up to when sync has it on the disk.
+static void
+bench_seqwrite(void)
+{
+	uint64_t start;
+	int fd, i, r;
+
+	memset(buf, 0x5a, sizeof(buf));
+	start = read_tsc();
+	fd = xopen(SEQFILE, O_WRONLY|O_CREAT|O_TRUNC);
+	for (i = 0; i < SEQSIZE / CHUNK; i++)
+		if ((r = write(fd, buf, CHUNK)) != CHUNK)
+			panic("write %s: %e", SEQFILE, r);
+	close(fd);
+	if ((r = fsipc_sync()) < 0)
+		panic("sync: %e", r);
+	result("seqwrite", 0, SEQSIZE / CHUNK, SEQSIZE, read_tsc() - start);
+}
+
+static void
+bench_seqread(bool cold)
+{
+	uint64_t start;
+	int fd, i, r;
+
+	if (cold)
+		drop_cache();
+	start = read_tsc();
+	fd = xopen(SEQFILE, O_RDONLY);
+	for (i = 0; i < SEQSIZE / CHUNK; i++)
+		if ((r = readn(fd, buf, CHUNK)) != CHUNK)
+			panic("read %s: %e", SEQFILE, r);
+	close(fd);
+	result("seqread", cold, SEQSIZE / CHUNK, SEQSIZE, read_tsc() - start);
+}
+
+// NRAND reads of random blocks of DATAFILE
+static void
+bench_randread(bool cold)
+{
+	static uint32_t seed = 1;
+	struct Stat st;
+	uint64_t start;
+	uint32_t nblocks;
+	int fd, i, r;
+
+	if (stat(DATAFILE, &st) < 0 || st.st_size < BLKSIZE) {
+		cprintf("bench_fs: no %s, skipping randread\n", DATAFILE);
+		return;
+	}
+	nblocks = st.st_size / BLKSIZE;
+	if (cold)
+		drop_cache();
+	start = read_tsc();
+	fd = xopen(DATAFILE, O_RDONLY);
+	for (i = 0; i < NRAND; i++) {
+		seed = seed * 1103515245 + 12345;
+		seek(fd, (seed >> 8) % nblocks * BLKSIZE);
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read %s: %e", DATAFILE, r);
+	}
+	close(fd);
+	result("randread", cold, NRAND, NRAND * BLKSIZE, read_tsc() - start);
+}
+
+// Create NSMALL files of a few bytes, then remove them
+static void
+bench_small(void)
+{
+	char path[32];
+	uint64_t start;
+	int fd, i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NSMALL; i++) {
+		snprintf(path, sizeof(path), "/bench_small%d", i);
+		fd = xopen(path, O_WRONLY|O_CREAT|O_TRUNC);
+		if ((r = write(fd, path, strlen(path))) < 0)
+			panic("write %s: %e", path, r);
+		close(fd);
+	}
+	result("create", 0, NSMALL, 0, read_tsc() - start);
+
+	start = read_tsc();
+	for (i = 0; i < NSMALL; i++) {
+		snprintf(path, sizeof(path), "/bench_small%d", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	result("remove", 0, NSMALL, 0, read_tsc() - start);
+}
+
+// NLOOKUP stats of the path path(i); cold, each after dropping the cache
+static void
+bench_lookup(const char *test, const char *(*path)(int), bool cold)
+{
+	struct Stat st;
+	uint64_t start, cycles = 0;
+	int i, r;
+
+	if (stat(path(0), &st) < 0) {
+		cprintf("bench_fs: no %s, skipping %s\n", path(0), test);
+		return;
+	}
+	for (i = 0; i < NLOOKUP; i++) {
+		if (cold)
+			drop_cache();
+		start = read_tsc();
+		if ((r = stat(path(i), &st)) < 0)
+			panic("stat %s: %e", path(i), r);
+		cycles += read_tsc() - start;
+	}
+	result(test, cold, NLOOKUP, 0, cycles);
+}
+
+static const char *
+deep_path(int i)
+{
+	return DEEPPATH;
+}
+
+// Entries all over the directory, the last one first
+static const char *
+bigdir_path(int i)
+{
+	static char path[32];
+
+	snprintf(path, sizeof(path), BIGDIR "/f%d", NBIGDIR - 1 - i * 37 % NBIGDIR);
+	return path;
+}
+
+void
+umain(void)
+{
+	int cold;
+
+	binaryname = "bench_fs";
+	bench_seqwrite();
+	for (cold = 1; cold >= 0; cold--)
+		bench_seqread(cold);
+	for (cold = 1; cold >= 0; cold--)
+		bench_randread(cold);
+	bench_small();
+	for (cold = 1; cold >= 0; cold--)
+		bench_lookup("deeplookup", deep_path, cold);
+	for (cold = 1; cold >= 0; cold--)
+		bench_lookup("bigdirlookup", bigdir_path, cold);
+	remove(SEQFILE);
+}
@@ -0,0 +1,104 @@
+// Time IPC round trips to a child that answers at once: by ipc_send
+// and ipc_recv, and by ipc_call and ipc_reply_wait, each with and
+// without a page going both ways.  For `make bench-ipc`, each result
+// is one line
+//	BENCH ipc <test> n=<round trips> median=<cycles> mean=<cycles>
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NTRIP	1000
+#define NWARM	16		// round trips not timed, to fault everything in
+#define PAGE	((void *) 0x10000000)
+
+enum { SENDRECV, CALL };
+
+static const char *test_names[2][2] = {
+	[SENDRECV] = { "sendrecv", "sendrecv_page" },
+	[CALL] = { "call", "call_page" },
+};
+
+static uint32_t cycles[NTRIP];
+
+static void
+server(int how, bool page)
+{
+	envid_t from = 0;
+	int i, perm;
+	uint32_t v = 0;
+
+	if (how == CALL) {
+		for (i = 0; i < NWARM + NTRIP + 1; i++)
+			v = ipc_reply_wait(from, v, page ? PAGE : NULL, PTE_P|PTE_U|PTE_W,
+					   PAGE, &from, &perm);
+		return;
+	}
+	for (i = 0; i < NWARM + NTRIP; i++) {
+		v = ipc_recv(&from, PAGE, &perm);
+		ipc_send(from, v, page ? PAGE : NULL, PTE_P|PTE_U|PTE_W);
+	}
+}
+
+static uint32_t
+median(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 1; i < NTRIP; i++) {
+		c = cycles[i];
+		for (j = i; j > 0 && cycles[j - 1] > c; j--)
+			cycles[j] = cycles[j - 1];
+		cycles[j] = c;
+	}
+	return cycles[NTRIP / 2];
+}
+
+static void
+measure(int how, bool page)
+{
+	envid_t child;
+	uint64_t start, total = 0;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, PAGE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		server(how, page);
+		exit();
+	}
+	for (i = 0; i < NWARM + NTRIP; i++) {
+		start = read_tsc();
+		if (how == CALL)
+			r = ipc_call(child, i, page ? PAGE : NULL, PTE_P|PTE_U|PTE_W, PAGE, NULL);
+		else {
+			ipc_send(child, i, page ? PAGE : NULL, PTE_P|PTE_U|PTE_W);
+			r = ipc_recv(NULL, PAGE, NULL);
+		}
+		if (r != i)
+			panic("%s: round trip %d came back as %d", test_names[how][page], i, r);
+		if (i >= NWARM) {
+			cycles[i - NWARM] = read_tsc() - start;
+			total += cycles[i - NWARM];
+		}
+	}
+	// One last send so the server's final reply_wait returns
+	if (how == CALL)
+		ipc_send(child, 0, NULL, 0);
+	while (envs[ENVX(child)].env_id == child && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+	cprintf("BENCH ipc %s n=%d median=%u mean=%llu\n",
+		test_names[how][page], NTRIP, median(), total / NTRIP);
+}
+
+void
+umain(void)
+{
+	binaryname = "bench_ipc";
+	measure(SENDRECV, 0);
+	measure(SENDRECV, 1);
+	measure(CALL, 0);
+	measure(CALL, 1);
+}
@@ -0,0 +1,76 @@
+// Time many clients' requests to one server, the file server: 1, 2, 4
+// and 8 clients each stat a file NREQ times at once.  For `make
+// bench-ipc`, each result is one line
+//	BENCH ipcfan clients=<n> n=<requests> cycles_per_req=<c> latency=<c>
+// where cycles_per_req is the elapsed time over all the requests made
+// and latency the clients' mean time per request.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NREQ		200
+#define MAXCLIENT	8
+
+// Shared across fork: the clients start together once go is set, and
+// leave their mean cycles per request in latency
+static volatile struct {
+	uint32_t go;
+	uint64_t latency[MAXCLIENT];
+} *shared = (void *) 0x10000000;
+
+static void
+client(int i)
+{
+	struct Stat st;
+	uint64_t start;
+	int j, r;
+
+	while (!shared->go)
+		sys_yield();
+	start = read_tsc();
+	for (j = 0; j < NREQ; j++)
+		if ((r = stat("/newmotd", &st)) < 0)
+			panic("stat /newmotd: %e", r);
+	shared->latency[i] = (read_tsc() - start) / NREQ;
+}
+
+static void
+measure(int nclient)
+{
+	envid_t child[MAXCLIENT];
+	uint64_t start, elapsed, sum = 0;
+	int i;
+
+	shared->go = 0;
+	for (i = 0; i < nclient; i++) {
+		if ((child[i] = fork()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0) {
+			client(i);
+			exit();
+		}
+	}
+	start = read_tsc();
+	shared->go = 1;
+	for (i = 0; i < nclient; i++)
+		while (envs[ENVX(child[i])].env_id == child[i]
+		       && envs[ENVX(child[i])].env_status != ENV_FREE)
+			sys_yield();
+	elapsed = read_tsc() - start;
+	for (i = 0; i < nclient; i++)
+		sum += shared->latency[i];
+	cprintf("BENCH ipcfan clients=%d n=%d cycles_per_req=%llu latency=%llu\n",
+		nclient, nclient * NREQ, elapsed / (nclient * NREQ), sum / nclient);
+}
+
+void
+umain(void)
+{
+	int n, r;
+
+	binaryname = "bench_ipcfan";
+	if ((r = sys_page_alloc(0, (void *) shared, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (n = 1; n <= MAXCLIENT; n *= 2)
+		measure(n);
+}
@@ -0,0 +1,134 @@
+// Time process life cycles: fork+exit, fork with the child touching
+// NCOW copy-on-write pages, spawn of a small and of a large binary, the
+// small one again after spawn_prewarm, and destroying an env that maps NTEAR pages.  Each from the parent's
+// fork (or spawn, or destroy) to when the child's Env is free again.
+// For `make bench-proc`, each result is one line
+//	BENCH proc <test> n=<runs> min=<c> p50=<c> p90=<c> p99=<c> max=<c>
+// in cycles: a distribution, since the slow runs matter too.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NRUN	64
+#define NCOW	64
+#define NTEAR	256
+#define REGION	((char *) 0x10000000)
+
+static uint64_t cycles[NRUN];
+
+static void
+wait_free(envid_t child)
+{
+	while (envs[ENVX(child)].env_id == child && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+}
+
+static void
+report(const char *test, int n)
+{
+	uint64_t c;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		c = cycles[i];
+		for (j = i; j > 0 && cycles[j - 1] > c; j--)
+			cycles[j] = cycles[j - 1];
+		cycles[j] = c;
+	}
+	cprintf("BENCH proc %s n=%d min=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+		test, n, cycles[0], cycles[n / 2], cycles[n * 90 / 100],
+		cycles[n * 99 / 100], cycles[n - 1]);
+}
+
+// Fork NRUN children that touch 'ntouch' pages of REGION and exit.
+static void
+bench_fork(const char *test, int ntouch)
+{
+	uint64_t start;
+	envid_t child;
+	int i, j;
+
+	for (i = 0; i < NRUN; i++) {
+		start = read_tsc();
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0) {
+			for (j = 0; j < ntouch; j++)
+				REGION[j * PGSIZE] = j;
+			exit();
+		}
+		wait_free(child);
+		cycles[i] = read_tsc() - start;
+	}
+	report(test, NRUN);
+}
+
+static void
+bench_spawn(const char *test, const char *prog)
+{
+	uint64_t start;
+	envid_t child;
+	int i;
+
+	for (i = 0; i < NRUN / 4; i++) {
+		start = read_tsc();
+		if ((child = spawnl(prog, prog, "exit", 0)) < 0)
+			panic("spawn %s: %e", prog, child);
+		wait_free(child);
+		cycles[i] = read_tsc() - start;
+	}
+	report(test, NRUN / 4);
+}
+
+// Children that map NTEAR pages and wait, destroyed from sys_env_destroy
+// until they're free.
+static void
+bench_teardown(void)
+{
+	uint64_t start;
+	envid_t child;
+	int i, j, r;
+
+	for (i = 0; i < NRUN / 4; i++) {
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0) {
+			for (j = 0; j < NTEAR; j++)
+				if ((r = sys_page_alloc(0, REGION + j * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+					panic("sys_page_alloc: %e", r);
+			ipc_send(env->env_parent_id, 0, NULL, 0);
+			ipc_recv(NULL, NULL, NULL);
+			panic("teardown child woke up");
+		}
+		ipc_recv(NULL, NULL, NULL);
+		start = read_tsc();
+		if ((r = sys_env_destroy(child)) < 0)
+			panic("sys_env_destroy: %e", r);
+		wait_free(child);
+		cycles[i] = read_tsc() - start;
+	}
+	report("teardown", NRUN / 4);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	// Spawned as the small binary
+	if (argc > 1 && strcmp(argv[1], "exit") == 0)
+		return;
+
+	binaryname = "bench_proc";
+	for (i = 0; i < NCOW; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	bench_fork("fork_exit", 0);
+	bench_fork("fork_cow", NCOW);
+	bench_spawn("spawn_small", "/bench_proc");
+	bench_spawn("spawn_large", "/bench_big");
+	if ((r = spawn_prewarm("/bench_proc", NRUN / 4)) < 0)
+		panic("spawn_prewarm: %e", r);
+	bench_spawn("spawn_warm", "/bench_proc");
+	bench_teardown();
+}
@@ -0,0 +1,143 @@
+// Scheduler benchmark: with 0, 1, 2 and 4 CPU hogs running, how evenly
+// do the hogs share the CPUs, and how long does an env blocked in
+// ipc_recv take to run once it's sent a message?  Each hog counts its
+// loops in a shared page; the fairness is Jain's index over those
+// counts, (sum x)^2 / (n * sum x^2), 1 when they're all equal.  A
+// sleeper waits in ipc_recv NWAKE times, and measures from the rdtsc
+// we take just before each send to when it runs.  For `make
+// bench-sched`, each result is one line
+//	BENCH sched hogs=<n> fairness=<index> p50=<c> p90=<c> p99=<c> max=<c>
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define MAXHOG		4
+#define NWAKE		128
+#define GAP		(1 << 20)	// cycles between wakeups, for the hogs to run
+
+static volatile struct {
+	uint32_t ready;			// the sleeper is about to receive
+	uint64_t sent;			// rdtsc before the send
+	uint64_t progress[MAXHOG];	// each hog's loops
+	uint64_t latency[NWAKE];
+} *shared = (void *) 0x10000000;
+
+static void
+hog(int i)
+{
+	for (;;)
+		shared->progress[i]++;
+}
+
+static void
+sleeper(void)
+{
+	int i;
+
+	for (i = 0; i < NWAKE; i++) {
+		shared->ready = 1;
+		ipc_recv(NULL, NULL, NULL);
+		shared->latency[i] = read_tsc() - shared->sent;
+	}
+}
+
+static envid_t
+xfork(void (*f)(int), int arg)
+{
+	envid_t child;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		f(arg);
+		exit();
+	}
+	return child;
+}
+
+static void
+sleeper_main(int arg)
+{
+	sleeper();
+}
+
+static void
+wait_free(envid_t child)
+{
+	while (envs[ENVX(child)].env_id == child && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+}
+
+// The fairness index, in thousandths, of the hogs' loops since base
+static uint32_t
+fairness(int nhog, const uint64_t *base)
+{
+	uint64_t sum = 0, sumsq = 0, x;
+	int i;
+
+	for (i = 0; i < nhog; i++) {
+		// In thousands of loops, so that the squares fit
+		x = (shared->progress[i] - base[i]) / 1000;
+		sum += x;
+		sumsq += x * x;
+	}
+	return sumsq ? sum * sum * 1000 / (nhog * sumsq) : 0;
+}
+
+static void
+measure(int nhog)
+{
+	envid_t hogs[MAXHOG], sl;
+	uint64_t c, start, base[MAXHOG];
+	uint32_t f;
+	int i, j, r;
+
+	memset((void *) shared, 0, PGSIZE);
+	for (i = 0; i < nhog; i++)
+		hogs[i] = xfork(hog, i);
+	sl = xfork(sleeper_main, 0);
+	// The hogs forked first got a head start
+	for (i = 0; i < nhog; i++)
+		base[i] = shared->progress[i];
+
+	for (i = 0; i < NWAKE; i++) {
+		for (start = read_tsc(); read_tsc() - start < GAP || !shared->ready; )
+			sys_yield();
+		shared->ready = 0;
+		shared->sent = read_tsc();
+		ipc_send(sl, 0, NULL, 0);
+	}
+	wait_free(sl);
+	for (i = 0; i < nhog; i++)
+		if ((r = sys_env_destroy(hogs[i])) < 0)
+			panic("sys_env_destroy: %e", r);
+	for (i = 0; i < nhog; i++)
+		wait_free(hogs[i]);
+
+	for (i = 1; i < NWAKE; i++) {
+		c = shared->latency[i];
+		for (j = i; j > 0 && shared->latency[j - 1] > c; j--)
+			shared->latency[j] = shared->latency[j - 1];
+		shared->latency[j] = c;
+	}
+	if (nhog > 0) {
+		f = fairness(nhog, base);
+		cprintf("BENCH sched hogs=%d fairness=%u.%03u", nhog, f / 1000, f % 1000);
+	} else
+		cprintf("BENCH sched hogs=0 fairness=-");
+	cprintf(" p50=%llu p90=%llu p99=%llu max=%llu\n",
+		shared->latency[NWAKE / 2], shared->latency[NWAKE * 90 / 100],
+		shared->latency[NWAKE * 99 / 100], shared->latency[NWAKE - 1]);
+}
+
+void
+umain(void)
+{
+	int n, r;
+
+	binaryname = "bench_sched";
+	if ((r = sys_page_alloc(0, (void *) shared, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (n = 0; n <= MAXHOG; n = n ? n * 2 : 1)
+		measure(n);
+}
@@ -0,0 +1,60 @@
+// Stream data through a channel between a parent and a forked child,
+// in chunk sizes that don't line up with the ring, and check that the
+// reader sees every byte in order and then end of stream.
+
+#include <inc/lib.h>
+
+#define NBYTES	(64 * 1024)
+
+static uint8_t buf[3 * PGSIZE];
+
+static uint8_t
+pattern(uint32_t i)
+{
+	return (i * 7 + 3) & 0xFF;
+}
+
+void
+umain(void)
+{
+	int p[2], r;
+	uint32_t i, j, n, chunk;
+	envid_t child;
+
+	if ((r = chan(p)) < 0)
+		panic("chan: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		// Writer: odd-sized chunks, some bigger than the ring
+		close(p[0]);
+		for (i = 0, chunk = 1; i < NBYTES; i += n, chunk = chunk * 3 + 1) {
+			n = MIN(chunk % sizeof(buf) + 1, NBYTES - i);
+			for (j = 0; j < n; j++)
+				buf[j] = pattern(i + j);
+			if ((r = write(p[1], buf, n)) != n)
+				panic("write %d at %d: got %d", n, i, r);
+		}
+		close(p[1]);
+		exit();
+	}
+
+	// Reader
+	close(p[1]);
+	for (i = 0, chunk = 5; i < NBYTES; i += r, chunk = chunk * 5 + 2) {
+		n = chunk % sizeof(buf) + 1;
+		if ((r = read(p[0], buf, n)) <= 0)
+			panic("read at %d: got %d", i, r);
+		for (j = 0; j < r; j++)
+			if (buf[j] != pattern(i + j))
+				panic("byte %d is %02x, not %02x", i + j, buf[j], pattern(i + j));
+	}
+	if ((r = read(p[0], buf, sizeof(buf))) != 0)
+		panic("read at end of stream: got %d", r);
+	if (!chan_isclosed(p[0]))
+		panic("chan_isclosed: writer still there");
+	close(p[0]);
+	cprintf("chanring ok\n");
+}
@@ -0,0 +1,15 @@
+#include <inc/lib.h>
+
+// All of the kernel log the kernel keeps
+char buf[KLOG_SIZE];
+
+void
+umain(int argc, char **argv)
+{
+	int n, r;
+
+	argv0 = "dmesg";
+	n = sys_klog_read(buf, sizeof(buf));
+	if ((r = write(1, buf, n)) != n)
+		panic("write error: %e", r);
+}
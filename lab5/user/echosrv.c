@@ -0,0 +1,46 @@
+// TCP echo server on port 7: each connection gets back what it sends,
+// one at a time.  From the host, with Bochs's vnet network:
+//	echo hello | nc 192.168.10.2 7
+
+#include <inc/lib.h>
+
+#define PORT	7
+
+static char buf[4 * PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	int s, c, n, r;
+
+	binaryname = "echosrv";
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		panic("socket: %e", s);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr = INADDR_ANY;
+	if ((r = bind(s, &addr)) < 0)
+		panic("bind: %e", r);
+	if ((r = listen(s, 5)) < 0)
+		panic("listen: %e", r);
+	cprintf("echosrv: listening on port %d\n", PORT);
+
+	while (1) {
+		if ((c = accept(s, &addr)) < 0)
+			panic("accept: %e", c);
+		cprintf("echosrv: connection from %d.%d.%d.%d:%d\n",
+			ntohl(addr.sin_addr) >> 24, (ntohl(addr.sin_addr) >> 16) & 0xFF,
+			(ntohl(addr.sin_addr) >> 8) & 0xFF, ntohl(addr.sin_addr) & 0xFF,
+			ntohs(addr.sin_port));
+		while ((n = read(c, buf, sizeof(buf))) > 0)
+			if ((r = write(c, buf, n)) != n) {
+				cprintf("echosrv: write: %e\n", r);
+				break;
+			}
+		if (n < 0)
+			cprintf("echosrv: read: %e\n", n);
+		close(c);
+	}
+}
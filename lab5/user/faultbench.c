@@ -0,0 +1,143 @@
+// Time page faults, each kind two ways: sent up to our page fault upcall,
+// a UTrapframe on the exception stack and a system call to resolve it,
+// and resolved by the kernel without the upcall (sys_env_set_fault_flags,
+// sys_page_autogrow).  Prints the median cycles per fault for each.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define REGION	((char *) 0x10000000)
+#define ALIAS	((char *) 0x18000000)	// second mappings, for shared pages
+#define NFAULT	256
+
+enum { COW_UNSHARED, COW_SHARED, ZERO };
+
+static const char *kind_names[] = {
+	[COW_UNSHARED] = "copy-on-write, unshared",
+	[COW_SHARED] = "copy-on-write, shared",
+	[ZERO] = "demand-zero",
+};
+
+static uint32_t cycles[NFAULT];
+
+static void
+handler(struct UTrapframe *utf)
+{
+	void *addr = ROUNDDOWN((void *) utf->utf_fault_va, PGSIZE);
+	int r;
+
+	if (!(vpd[VPD(addr)] & PTE_P) || !(vpt[VPN(addr)] & PTE_P)) {
+		if ((r = sys_page_alloc(0, addr, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		return;
+	}
+	if (!(utf->utf_err & FEC_WR) || !(vpt[VPN(addr)] & PTE_COW))
+		panic("unexpected fault at %08x, err %x", utf->utf_fault_va, utf->utf_err);
+	if (sys_page_cow_reuse(addr) == 0)
+		return;
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	page_copy(PFTEMP, addr);
+	if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+}
+
+// Lay out NFAULT pages at REGION that fault the 'kind' way when written.
+static void
+setup(int kind)
+{
+	char *va;
+	int i, r;
+
+	for (i = 0; i < NFAULT; i++) {
+		va = REGION + i * PGSIZE;
+		if (kind == ZERO)
+			continue;
+		if ((r = sys_page_alloc(0, va, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		*va = i;
+		if ((r = sys_page_map(0, va, 0, va, PTE_P | PTE_U | PTE_COW)) < 0)
+			panic("sys_page_map: %e", r);
+		if (kind == COW_SHARED
+		    && (r = sys_page_map(0, va, 0, ALIAS + i * PGSIZE, PTE_P | PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	}
+}
+
+static void
+cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < NFAULT; i++) {
+		sys_page_unmap(0, REGION + i * PGSIZE);
+		sys_page_unmap(0, ALIAS + i * PGSIZE);
+	}
+}
+
+static uint32_t
+median(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 1; i < NFAULT; i++) {
+		c = cycles[i];
+		for (j = i; j > 0 && cycles[j - 1] > c; j--)
+			cycles[j] = cycles[j - 1];
+		cycles[j] = c;
+	}
+	return cycles[NFAULT / 2];
+}
+
+// Fault on every page once, 'in_kernel' or through the upcall, and
+// return the median cycles per fault.
+static uint32_t
+measure(int kind, bool in_kernel)
+{
+	volatile char *va;
+	uint32_t kfaults, ufaults;
+	uint64_t start;
+	int i, r;
+
+	setup(kind);
+	if (kind == ZERO && in_kernel && (r = sys_page_autogrow(REGION, NFAULT * PGSIZE)) < 0)
+		panic("sys_page_autogrow: %e", r);
+	if (kind != ZERO)
+		sys_env_set_fault_flags(0, !in_kernel ? 0
+					: kind == COW_SHARED ? ENV_FAULT_COW : ENV_FAULT_REUSE);
+
+	kfaults = env->env_kfaults;
+	ufaults = env->env_ufaults;
+	for (i = 0; i < NFAULT; i++) {
+		va = REGION + i * PGSIZE;
+		start = read_tsc();
+		*va = 1;
+		cycles[i] = read_tsc() - start;
+	}
+	kfaults = env->env_kfaults - kfaults;
+	ufaults = env->env_ufaults - ufaults;
+
+	sys_env_set_fault_flags(0, 0);
+	if (kind == ZERO && in_kernel)
+		sys_page_autogrow(REGION, 0);
+	if ((in_kernel ? kfaults : ufaults) != NFAULT || (in_kernel ? ufaults : kfaults) != 0)
+		panic("%s: %d faults in the kernel, %d upcalls", kind_names[kind], kfaults, ufaults);
+	for (i = 0; i < NFAULT; i++)
+		if (kind == COW_SHARED && ALIAS[i * PGSIZE] != (char) i)
+			panic("%s: the shared page %d changed under its copy", kind_names[kind], i);
+	cleanup();
+	return median();
+}
+
+void
+umain(void)
+{
+	int kind;
+
+	set_pgfault_handler(handler);
+	for (kind = COW_UNSHARED; kind <= ZERO; kind++)
+		cprintf("faultbench: %s: upcall %u, kernel %u cycles per fault\n",
+			kind_names[kind], measure(kind, 0), measure(kind, 1));
+	cprintf("faultbench ok\n");
+}
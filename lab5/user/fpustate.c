@@ -0,0 +1,45 @@
+// Several envs each keep their own value in an x87 register and in
+// %xmm0 across many yields, so that they switch, and maybe move between
+// CPUs, with the values live.  Each must get its own back.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NYIELD	200
+
+static void
+child(uint32_t id)
+{
+	uint32_t x87 = 1000 + id, xmm = 0x5e5e0000 + id, x87_out, xmm_out;
+	int i;
+
+	asm volatile("fildl %0" :: "m" (x87));
+	asm volatile("movd %0, %%xmm0" :: "r" (xmm));
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+	asm volatile("fistpl %0" : "=m" (x87_out));
+	asm volatile("movd %%xmm0, %0" : "=r" (xmm_out));
+	if (x87_out != x87 || xmm_out != xmm)
+		panic("child %d: x87 %d, xmm0 %08x; wanted %d, %08x",
+		      id, x87_out, xmm_out, x87, xmm);
+}
+
+void
+umain(void)
+{
+	int i, r;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			child(i);
+			exit();
+		}
+	}
+	// And the parent, while its children are still at it
+	child(NCHILD);
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+	cprintf("fpustate ok\n");
+}
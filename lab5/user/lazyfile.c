@@ -0,0 +1,66 @@
+// Check that file pages are mapped as they're touched, not at open,
+// and that read_zc shares them copy-on-write.
+
+#include <inc/lib.h>
+
+static bool
+mapped(char *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+static char zcbuf[2 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(void)
+{
+	int fdnum, r;
+	struct Fd *fd;
+	struct Stat st;
+	char *va, c;
+
+	if ((fdnum = open("/cat", O_RDONLY)) < 0)
+		panic("open /cat: %e", fdnum);
+	if ((r = fstat(fdnum, &st)) < 0)
+		panic("fstat: %e", r);
+	if (st.st_size <= 16 * PGSIZE)
+		panic("/cat is only %d bytes", st.st_size);
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		panic("fd_lookup: %e", r);
+	va = fd2data(fd);
+	if (mapped(va))
+		panic("open mapped the file");
+
+	// The first read brings in a few pages, not the whole file
+	if ((r = readn(fdnum, &c, 1)) != 1)
+		panic("read: %d", r);
+	if (!mapped(va) || mapped(va + 16 * PGSIZE))
+		panic("first read mapped the wrong pages");
+
+	// Reading the end maps the end
+	if ((r = seek(fdnum, st.st_size - 1)) < 0)
+		panic("seek: %e", r);
+	if ((r = readn(fdnum, &c, 1)) != 1)
+		panic("read at end: %d", r);
+	if (!mapped(va + ROUNDDOWN(st.st_size - 1, PGSIZE)))
+		panic("last page not mapped");
+
+	// read_zc maps the file's own pages, and a write copies them
+	if ((r = seek(fdnum, PGSIZE)) < 0)
+		panic("seek: %e", r);
+	if ((r = read_zc(fdnum, zcbuf, sizeof(zcbuf))) != sizeof(zcbuf))
+		panic("read_zc: %d", r);
+	if (PTE_ADDR(vpt[VPN(zcbuf)]) != PTE_ADDR(vpt[VPN(va + PGSIZE)])
+	    || !(vpt[VPN(zcbuf + PGSIZE)] & PTE_COW))
+		panic("read_zc copied the pages");
+	c = va[PGSIZE];
+	zcbuf[0] = c + 1;
+	if (PTE_ADDR(vpt[VPN(zcbuf)]) == PTE_ADDR(vpt[VPN(va + PGSIZE)])
+	    || va[PGSIZE] != c)
+		panic("a write through read_zc's buffer reached the file");
+
+	close(fdnum);
+	if (mapped(va) || mapped(va + ROUNDDOWN(st.st_size - 1, PGSIZE)))
+		panic("close left pages mapped");
+	cprintf("lazyfile ok\n");
+}
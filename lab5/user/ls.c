@@ -23,17 +23,15 @@ void
 lsdir(const char *path, const char *prefix)
 {
 	int fd, n;
-	struct File f;
+	struct Dirent d;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	while ((n = readdir(fd, &d)) > 0)
+		ls1(prefix, d.d_isdir, d.d_size, d.d_name);
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
+	close(fd);
 }
 
 void
@@ -0,0 +1,94 @@
+// Stress malloc and free: a pseudo-random mix of mostly small and some
+// large blocks, allocated and freed in no particular order, each filled
+// with a pattern that must survive until it's freed.  Prints the cycles
+// per operation and how many page system calls the heap made.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NSLOT	512
+#define NOPS	20000
+
+static struct {
+	uint8_t *p;
+	size_t size;
+} slots[NSLOT];
+
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7FFF;
+}
+
+// Mostly up to 256 bytes, one in sixteen up to 16KB
+static size_t
+rand_size(void)
+{
+	if (rand() % 16 == 0)
+		return rand() % (16 * 1024) + 1;
+	return rand() % 256 + 1;
+}
+
+static void
+check(int i)
+{
+	size_t j;
+
+	for (j = 0; j < slots[i].size; j += 61)
+		if (slots[i].p[j] != (uint8_t) (i + j))
+			panic("slot %d: byte %d of %d clobbered", i, j, slots[i].size);
+}
+
+static uint32_t
+page_calls(void)
+{
+	volatile struct Env *e = &envs[ENVX(sys_getenvid())];
+
+	return e->env_sc_count[SYS_page_alloc] + e->env_sc_count[SYS_page_unmap];
+}
+
+void
+umain(void)
+{
+	uint64_t start, cycles;
+	uint32_t calls;
+	size_t j;
+	int i, op, nmalloc = 0;
+
+	calls = page_calls();
+	start = read_tsc();
+	for (op = 0; op < NOPS; op++) {
+		i = rand() % NSLOT;
+		if (slots[i].p) {
+			check(i);
+			free(slots[i].p);
+			slots[i].p = NULL;
+			continue;
+		}
+		slots[i].size = rand_size();
+		if ((slots[i].p = malloc(slots[i].size)) == NULL)
+			panic("malloc(%d) failed", slots[i].size);
+		if ((uintptr_t) slots[i].p % 16 != 0)
+			panic("malloc(%d) returned unaligned %08x", slots[i].size, slots[i].p);
+		for (j = 0; j < slots[i].size; j += 61)
+			slots[i].p[j] = i + j;
+		nmalloc++;
+	}
+	for (i = 0; i < NSLOT; i++)
+		if (slots[i].p) {
+			check(i);
+			free(slots[i].p);
+		}
+	cycles = read_tsc() - start;
+	cprintf("mallocbench: %d mallocs, %llu cycles per operation, %d page calls\n",
+		nmalloc, cycles / (NOPS + NSLOT), page_calls() - calls);
+
+	// Everything was freed, so the heap can hand out a large block again
+	if ((slots[0].p = malloc(1024 * 1024)) == NULL)
+		panic("heap did not come back after freeing everything");
+	free(slots[0].p);
+	cprintf("mallocbench ok\n");
+}
@@ -0,0 +1,43 @@
+// Check the per-env memory counts in struct Env, and that a page quota
+// stops sys_page_alloc.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x10000000)
+#define QUOTA	64
+
+void
+umain(void)
+{
+	volatile struct Env *e = env;
+	uint32_t npages = e->env_npages, nshared = e->env_nshared;
+	uint32_t nptpages = e->env_nptpages;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, REGION, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (e->env_npages != npages + 1 || e->env_nptpages != nptpages + 1)
+		panic("one page and a page table came to %d pages, %d page tables",
+		      e->env_npages - npages, e->env_nptpages - nptpages);
+	if ((r = sys_page_map(0, REGION, 0, REGION + PGSIZE, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_map: %e", r);
+	if (e->env_npages != npages + 2 || e->env_nshared != nshared + 1)
+		panic("a shared mapping wasn't counted");
+	sys_page_unmap(0, REGION);
+	sys_page_unmap(0, REGION + PGSIZE);
+	if (e->env_npages != npages || e->env_nshared != nshared)
+		panic("unmapping left %d pages, %d shared", e->env_npages - npages,
+		      e->env_nshared - nshared);
+
+	if ((r = sys_env_set_page_quota(0, e->env_npages + QUOTA)) < 0)
+		panic("sys_env_set_page_quota: %e", r);
+	for (i = 0; i < 2 * QUOTA; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			break;
+	if (i != QUOTA || r != -E_NO_MEM)
+		panic("a quota of %d more pages let %d through (%e)", QUOTA, i, r);
+	sys_env_set_page_quota(0, 0);
+	for (i = 0; i < QUOTA; i++)
+		sys_page_unmap(0, REGION + i * PGSIZE);
+	cprintf("memquota ok\n");
+}
@@ -0,0 +1,50 @@
+// Check mmap: a shared mapping writes through to the file, a private
+// one keeps its writes to itself.
+
+#include <inc/lib.h>
+
+#define SHARED	((char *) 0x20000000)
+#define PRIVATE	((char *) 0x20100000)
+#define NPAGES	3
+
+void
+umain(void)
+{
+	int fdnum, r, i;
+	char c;
+
+	if ((fdnum = open("/tmp/mmapfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /tmp/mmapfile: %e", fdnum);
+	for (i = 0; i < NPAGES * PGSIZE; i++) {
+		c = 'a' + i % 26;
+		if ((r = write(fdnum, &c, 1)) != 1)
+			panic("write: %e", r);
+	}
+
+	if ((r = mmap(SHARED, 4 * PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fdnum, 0)) != -E_INVAL)
+		panic("mmap past the end of the file: %e", r);
+	if ((r = mmap(SHARED, NPAGES * PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fdnum, 0)) < 0)
+		panic("mmap shared: %e", r);
+	if ((r = mmap(PRIVATE, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fdnum, PGSIZE)) < 0)
+		panic("mmap private: %e", r);
+	if (SHARED[PGSIZE + 1] != 'a' + (PGSIZE + 1) % 26 || PRIVATE[1] != SHARED[PGSIZE + 1])
+		panic("mmap mapped the wrong data");
+
+	SHARED[2 * PGSIZE] = '!';
+	PRIVATE[0] = '?';
+	if ((r = munmap(SHARED, NPAGES * PGSIZE)) < 0)
+		panic("munmap shared: %e", r);
+	if ((r = seek(fdnum, 2 * PGSIZE)) < 0 || (r = readn(fdnum, &c, 1)) != 1 || c != '!')
+		panic("a write to the shared mapping didn't reach the file");
+	if ((r = seek(fdnum, PGSIZE)) < 0 || (r = readn(fdnum, &c, 1)) != 1 || c == '?')
+		panic("a write to the private mapping reached the file");
+	if (munmap(SHARED, NPAGES * PGSIZE) != -E_INVAL)
+		panic("munmap twice succeeded");
+
+	close(fdnum);
+	if (PRIVATE[0] != '?')
+		panic("close lost the private copy");
+	munmap(PRIVATE, PGSIZE);
+	remove("/tmp/mmapfile");
+	cprintf("mmapfile ok\n");
+}
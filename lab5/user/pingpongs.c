@@ -0,0 +1,32 @@
+// Ping-pong a counter between two shared-memory processes.
+// Only need to start one of these -- splits into two with sfork.
+// The counter lives in .data, which sfork shares, so both sides
+// see each other's increments; 'env' must still differ in each.
+
+#include <inc/lib.h>
+
+uint32_t val;
+
+void
+umain(void)
+{
+	envid_t who;
+
+	if ((who = sfork()) != 0) {
+		// get the ball rolling
+		cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
+		ipc_send(who, 0, 0, 0);
+	}
+
+	while (1) {
+		ipc_recv(&who, 0, 0);
+		assert(env->env_id == sys_getenvid());
+		cprintf("%x got %d from %x\n", sys_getenvid(), val, who);
+		if (val == 10)
+			return;
+		++val;
+		ipc_send(who, 0, 0, 0);
+		if (val == 10)
+			return;
+	}
+}
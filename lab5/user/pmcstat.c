@@ -0,0 +1,38 @@
+// Check the per-env performance counters: a loop of known length
+// retires at least that many instructions, and yielding to other envs
+// doesn't charge their work to us.
+
+#include <inc/lib.h>
+
+#define NLOOP	100000
+
+void
+umain(void)
+{
+	uint64_t instrs, cycles, idle;
+	volatile int i;
+
+	if (pmc_ncounters() <= PMC_INSTRS) {
+		cprintf("pmcstat: no performance counters, skipping\n");
+		return;
+	}
+	instrs = pmc_read(PMC_INSTRS);
+	cycles = pmc_read(PMC_CYCLES);
+	for (i = 0; i < NLOOP; i++)
+		;
+	instrs = pmc_read(PMC_INSTRS) - instrs;
+	cycles = pmc_read(PMC_CYCLES) - cycles;
+	if (instrs < NLOOP)
+		panic("%d loops retired only %llu instructions", NLOOP, instrs);
+	cprintf("pmcstat: %d loops, %llu instructions, %llu cycles\n",
+		NLOOP, instrs, cycles);
+
+	// Whatever runs while we yield isn't ours
+	idle = pmc_read(PMC_INSTRS);
+	for (i = 0; i < 10; i++)
+		sys_yield();
+	idle = pmc_read(PMC_INSTRS) - idle;
+	if (idle > instrs)
+		panic("10 yields charged us %llu instructions", idle);
+	cprintf("pmcstat ok\n");
+}
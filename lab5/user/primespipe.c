@@ -4,7 +4,8 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENVS is 1024, we can print 1022 primes before running out.
+// Since NENV is 4096, we can print up to 4094 primes before running out,
+// memory permitting.
 // The remaining two environments are the integer generator at the bottom
 // of main and user/idle.
 
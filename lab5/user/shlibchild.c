@@ -0,0 +1,19 @@
+// Linked against libjos.so (SHAREDAPPS in fs/Makefrag), for testshlib:
+// tells our parent how many envs map the library's text, and waits to
+// be let go so that the next one sees us among them.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = env->env_parent_id;
+
+	if ((uintptr_t) cprintf < ULIB)
+		panic("cprintf at %08x, not in libjos.so", cprintf);
+	// Written by libmain, so our own copy by now
+	if (pageref(&binaryname) != 1)
+		panic("library data page shared %d ways", pageref(&binaryname));
+	ipc_send(parent, pageref(cprintf), 0, 0);
+	ipc_recv(0, 0, 0);
+}
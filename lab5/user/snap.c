@@ -0,0 +1,42 @@
+// Work the file system's snapshot (fs/snap.c): take one, with a store
+// of NBLOCKS blocks or else half the free ones; have the next boot roll
+// the disk back to it; drop it; or, by default, say how many blocks
+// have changed since it was taken.
+
+#include <inc/lib.h>
+
+void
+usage(void)
+{
+	cprintf("usage: snap [take [NBLOCKS] | rollback | drop | stat]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *op = argc > 1 ? argv[1] : "stat";
+	int r;
+
+	binaryname = "snap";
+	if (strcmp(op, "take") == 0 && argc <= 3) {
+		if ((r = fsipc_snapshot(SNAPREQ_TAKE, argc > 2 ? strtol(argv[2], 0, 0) : 0)) < 0)
+			panic("take: %e", r);
+		cprintf("snapshot taken, store of %d blocks\n", r);
+	} else if (strcmp(op, "rollback") == 0 && argc == 2) {
+		if ((r = fsipc_snapshot(SNAPREQ_ROLLBACK, 0)) < 0)
+			panic("rollback: %e", r);
+		cprintf("%d blocks go back at the next boot\n", r);
+	} else if (strcmp(op, "drop") == 0 && argc == 2) {
+		if ((r = fsipc_snapshot(SNAPREQ_DROP, 0)) < 0)
+			panic("drop: %e", r);
+	} else if (strcmp(op, "stat") == 0 && argc <= 2) {
+		if ((r = fsipc_snapshot(SNAPREQ_STAT, 0)) == -E_NOT_FOUND)
+			cprintf("no snapshot\n");
+		else if (r < 0)
+			cprintf("snapshot overflowed its store: drop it\n");
+		else
+			cprintf("%d blocks changed since the snapshot\n", r);
+	} else
+		usage();
+}
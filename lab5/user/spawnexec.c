@@ -0,0 +1,10 @@
+#include <inc/lib.h>
+
+void
+umain(void)
+{
+	int r;
+	cprintf("i am parent environment %08x\n", env->env_id);
+	if ((r = spawn_exec("hello", (const char *[]) { "hello", 0 })) < 0)
+		panic("spawn_exec(hello) failed: %e", r);
+}
@@ -0,0 +1,78 @@
+// Check 4MB user pages: sys_page_alloc with PTE_PS maps a zeroed 4MB
+// region with a single PDE if it can, and the region still acts like
+// 1024 ordinary pages when we fork, or unmap one page of it.  Prints
+// the cycles a page-strided walk takes over it and over the same 4MB
+// of ordinary pages, which need a TLB entry each.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SUPER	((char *) 0x20000000)
+#define SMALL	((char *) 0x20400000)
+#define NWALK	64
+
+static uint32_t
+walk(volatile char *va)
+{
+	uint64_t start = read_tsc();
+	int i, j;
+
+	for (j = 0; j < NWALK; j++)
+		for (i = 0; i < NPTENTRIES; i++)
+			va[i * PGSIZE]++;
+	return (read_tsc() - start) / (NWALK * NPTENTRIES);
+}
+
+void
+umain(void)
+{
+	envid_t who;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, SUPER, PTE_P | PTE_U | PTE_W | PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(vpd[VPD(SUPER)] & PTE_PS))
+		cprintf("superpage: no 4MB block free, got ordinary pages\n");
+	for (i = 0; i < PTSIZE; i += 509)
+		if (SUPER[i] != 0)
+			panic("byte %d wasn't zeroed", i);
+	for (i = 0; i < NPTENTRIES; i++)
+		SUPER[i * PGSIZE] = i;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		if ((r = sys_page_alloc(0, SMALL + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	cprintf("superpage: walk %u cycles per page in 4MB pages, %u in 4KB pages\n",
+		walk(SUPER), walk(SMALL));
+	for (i = 0; i < NPTENTRIES; i++)
+		SUPER[i * PGSIZE] -= NWALK;
+
+	// The child gets a copy-on-write copy; its writes are its own
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < NPTENTRIES; i++)
+			if (SUPER[i * PGSIZE] != (char) i)
+				panic("child: page %d is %d", i, SUPER[i * PGSIZE]);
+		memset(SUPER, 0xFF, PGSIZE);
+		exit();
+	}
+	while (envs[ENVX(who)].env_id == who && envs[ENVX(who)].env_status != ENV_FREE)
+		sys_yield();
+	if (SUPER[0] != 0)
+		panic("the child's write showed through");
+
+	// Unmapping one page leaves the rest
+	if ((r = sys_page_unmap(0, SUPER + 5 * PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (vpt[VPN(SUPER + 5 * PGSIZE)] & PTE_P)
+		panic("page 5 is still mapped");
+	for (i = 0; i < NPTENTRIES; i++)
+		if (i != 5 && SUPER[i * PGSIZE] != (char) i)
+			panic("page %d is %d after unmapping page 5", i, SUPER[i * PGSIZE]);
+	for (i = 0; i < NPTENTRIES; i++) {
+		sys_page_unmap(0, SUPER + i * PGSIZE);
+		sys_page_unmap(0, SMALL + i * PGSIZE);
+	}
+	cprintf("superpage ok\n");
+}
@@ -0,0 +1,64 @@
+// Check paging out: a child fills some pages and goes to sleep, then we
+// take all the memory there is, which pushes the child's pages out to
+// the swap disk.  Once we let it go, the child checks that every page
+// comes back as it left it.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x10000000)	// ours
+#define NMAX	16384			// pages we take at most: 64MB
+#define CREGION	((char *) 0x08000000)	// the child's
+#define NCHILD	1024
+
+static void
+child(envid_t parent)
+{
+	int i, r, swapped = 0;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = sys_page_alloc(0, CREGION + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(CREGION + i * PGSIZE, i, PGSIZE);
+	}
+	ipc_send(parent, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+
+	for (i = 0; i < NCHILD; i++)
+		if ((vpt[VPN(CREGION + i * PGSIZE)] & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+			swapped++;
+	for (i = 0; i < NCHILD * PGSIZE; i += 509)
+		if (CREGION[i] != (char) (i / PGSIZE))
+			panic("byte %d of page %d came back as %d",
+			      i % PGSIZE, i / PGSIZE, CREGION[i]);
+	ipc_send(parent, swapped, 0, 0);
+}
+
+void
+umain(void)
+{
+	envid_t who;
+	int i, n, r, swapped;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		child(ipc_recv(0, 0, 0));
+		return;
+	}
+	ipc_send(who, sys_getenvid(), 0, 0);
+	ipc_recv(0, 0, 0);
+
+	for (n = 0; n < NMAX; n++)
+		if ((r = sys_page_alloc(0, REGION + n * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			break;
+	cprintf("swapout: took %d pages\n", n);
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, REGION + i * PGSIZE);
+
+	ipc_send(who, 0, 0, 0);
+	swapped = ipc_recv(0, 0, 0);
+	cprintf("swapout: %d of the child's %d pages were swapped out\n", swapped, NCHILD);
+	if (swapped == 0)
+		panic("nothing was swapped out");
+	cprintf("swapout ok\n");
+}
@@ -0,0 +1,65 @@
+// Check that the kernel counts our system calls, both in the global
+// table at USYSSTAT and in our own Env.  Other envs may make calls
+// while we run, so only our own count must be exact.  And that our
+// Env counts the CPU time we take, in user mode and in the kernel.
+// And that our IPC is counted at UENVSTAT.
+
+#include <inc/lib.h>
+
+#define NCALLS	10
+
+void
+umain(void)
+{
+	uint32_t count, returns, mine, recvs, retries;
+	uint64_t utime, stime;
+	volatile struct Env *e = &envs[ENVX(sys_getenvid())];
+	volatile struct EnvStat *es = &envstat[ENVX(sys_getenvid())];
+	volatile int i;
+	envid_t child;
+
+	utime = e->env_utime;
+	stime = e->env_stime;
+	count = sysstat[SYS_getenvid].ss_count;
+	returns = sysstat[SYS_getenvid].ss_returns;
+	mine = e->env_sc_count[SYS_getenvid];
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	if (sysstat[SYS_getenvid].ss_count - count < NCALLS)
+		panic("sysstat count went up by %d, not %d",
+		      sysstat[SYS_getenvid].ss_count - count, NCALLS);
+	if (sysstat[SYS_getenvid].ss_returns - returns < NCALLS)
+		panic("sysstat returns went up by %d, not %d",
+		      sysstat[SYS_getenvid].ss_returns - returns, NCALLS);
+	if (e->env_sc_count[SYS_getenvid] - mine != NCALLS)
+		panic("env_sc_count went up by %d, not %d",
+		      e->env_sc_count[SYS_getenvid] - mine, NCALLS);
+	if (e->env_sc_cycles[SYS_getenvid] == 0)
+		panic("no cycles charged to sys_getenvid");
+	if (e->env_stime == stime)
+		panic("no kernel time charged for %d calls", NCALLS);
+	// A spin runs in user mode; the time is ours as of the next trap
+	for (i = 0; i < 1000000; i++)
+		;
+	sys_getenvid();
+	if (e->env_utime - utime < 1000000)
+		panic("a million loops charged only %llu user cycles", e->env_utime - utime);
+
+	// We aren't receiving, so a send to ourselves is a retry
+	retries = es->es_retries;
+	if (sys_ipc_try_send(sys_getenvid(), 0, 0, 0) != -E_IPC_NOT_RECV)
+		panic("a send to ourselves went through");
+	if (es->es_retries - retries != 1)
+		panic("es_retries went up by %d, not 1", es->es_retries - retries);
+	recvs = es->es_recvs;
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		ipc_send(env->env_parent_id, 0, 0, 0);
+		exit();
+	}
+	ipc_recv(0, 0, 0);
+	if (es->es_recvs - recvs != 1)
+		panic("es_recvs went up by %d, not 1", es->es_recvs - recvs);
+	cprintf("sysstat ok\n");
+}
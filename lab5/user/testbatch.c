@@ -0,0 +1,71 @@
+// Test sys_batch: the calls in a batch must run in order with their
+// results written back, the batch must stop at the first that fails,
+// and calls that can't be batched, or too many, must be refused.
+
+#include <inc/lib.h>
+
+#define NPAGES	(SYSBATCH_MAX + 8)
+#define VA(i)	((char *) UTEMP + (i) * PGSIZE)
+
+void
+umain(int argc, char **argv)
+{
+	struct SyscallBatch b = BATCH_INIT;
+	struct SyscallReq rq[SYSBATCH_MAX + 1];
+	int i, r;
+
+	// More pages than fit in one batch: batch_add must flush
+	for (i = 0; i < NPAGES; i++)
+		if ((r = batch_page_alloc(&b, 0, VA(i), PTE_U | PTE_W | PTE_P)) < 0)
+			panic("batch_page_alloc: %e", r);
+	if ((r = batch_flush(&b)) < 0)
+		panic("batch_flush: %e", r);
+	for (i = 0; i < NPAGES; i++) {
+		if (!(vpd[PDX(VA(i))] & PTE_P) || !(vpt[VPN(VA(i))] & PTE_P))
+			panic("page %d not allocated", i);
+		*(int *) VA(i) = i;
+	}
+	// Map page 0 over page 1, then unmap page 2
+	batch_page_map(&b, 0, VA(0), 0, VA(1), PTE_U | PTE_P);
+	batch_page_unmap(&b, 0, VA(2));
+	if ((r = batch_flush(&b)) < 0)
+		panic("batch_flush: %e", r);
+	if (*(int *) VA(1) != 0 || (vpt[VPN(VA(1))] & PTE_W))
+		panic("page 1 not remapped read-only");
+	if (vpt[VPN(VA(2))] & PTE_P)
+		panic("page 2 still mapped");
+	cprintf("batch ran in order\n");
+
+	// A failing call stops the batch; its error comes back in place
+	memset(rq, 0, sizeof(rq));
+	for (i = 0; i < 3; i++) {
+		rq[i].sr_num = SYS_page_unmap;
+		rq[i].sr_args[1] = (uint32_t) VA(3 + i);
+	}
+	rq[1].sr_args[1] = (uint32_t) UTEMP + 1;	// not page-aligned
+	if ((r = sys_batch(rq, 3)) != 2)
+		panic("batch with a bad call ran %d calls, not 2", r);
+	if (rq[0].sr_ret != 0 || rq[1].sr_ret != -E_INVAL)
+		panic("results %d %d, not 0 %d", rq[0].sr_ret, rq[1].sr_ret, -E_INVAL);
+	if ((vpt[VPN(VA(3))] & PTE_P) || !(vpt[VPN(VA(5))] & PTE_P))
+		panic("batch didn't stop at the bad call");
+	cprintf("batch stopped at the failing call\n");
+
+	// Calls that may block or trap can't be batched
+	memset(rq, 0, sizeof(rq));
+	rq[0].sr_num = SYS_yield;
+	rq[1].sr_num = NSYSCALLS;
+	if ((r = sys_batch(rq, 1)) != 1 || rq[0].sr_ret != -E_INVAL)
+		panic("batched sys_yield: %d, %e", r, rq[0].sr_ret);
+	if ((r = sys_batch(rq + 1, 1)) != 1 || rq[1].sr_ret != -E_INVAL)
+		panic("batched bad call number: %d, %e", r, rq[1].sr_ret);
+	if ((r = sys_batch(rq, SYSBATCH_MAX + 1)) != -E_INVAL)
+		panic("oversized batch: %e, not -E_INVAL", r);
+	if ((r = sys_batch((struct SyscallReq *) ULIM, 1)) != -E_FAULT)
+		panic("batch in kernel memory: %e, not -E_FAULT", r);
+	cprintf("batch refused bad calls\n");
+
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(0, VA(i));
+	cprintf("testbatch ok\n");
+}
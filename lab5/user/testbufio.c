@@ -0,0 +1,62 @@
+// Write many short lines through a FILE, read them back through
+// another, a byte at a time and in blocks bigger than the buffer, and
+// check that switching between reading and writing keeps our place.
+
+#include <inc/lib.h>
+
+#define NLINE	2000
+
+static char big[3 * BUFSIZ];
+
+void
+umain(void)
+{
+	char line[32], want[32];
+	FILE *f;
+	int i, c, n;
+
+	if ((f = fopen("/bufio-test", "w")) == NULL)
+		panic("fopen for writing failed");
+	for (i = 0; i < NLINE; i++)
+		bprintf(f, "line %d\n", i);
+	if (fclose(f) < 0)
+		panic("fclose failed");
+
+	if ((f = fopen("/bufio-test", "r")) == NULL)
+		panic("fopen for reading failed");
+	for (i = 0; i < NLINE; i++) {
+		for (n = 0; (c = fgetc(f)) != '\n'; n++) {
+			if (c < 0 || n == sizeof(line) - 1)
+				panic("line %d cut short", i);
+			line[n] = c;
+		}
+		line[n] = 0;
+		snprintf(want, sizeof(want), "line %d", i);
+		if (strcmp(line, want) != 0)
+			panic("read '%s', wanted '%s'", line, want);
+	}
+	if (fgetc(f) != -1 || !feof(f))
+		panic("no end of file after %d lines", NLINE);
+	fclose(f);
+
+	// Straight through, past the buffer
+	if ((f = fopen("/bufio-test", "r+")) == NULL)
+		panic("fopen for updating failed");
+	if (fread(line, 1, 5, f) != 5 || fread(big, 1, sizeof(big), f) != sizeof(big))
+		panic("short read");
+	if (memcmp(line, "line ", 5) != 0 || memcmp(big, "0\nline 1\n", 9) != 0)
+		panic("read back the wrong data");
+	// A write after reading lands where reading stopped
+	n = 5 + sizeof(big);
+	fwrite("XYZ", 1, 3, f);
+	fclose(f);
+	if ((f = fopen("/bufio-test", "r")) == NULL)
+		panic("reopen failed");
+	if (fread(big, 1, sizeof(big), f) != sizeof(big) || fread(line, 1, 8, f) != 8)
+		panic("short read");
+	if (memcmp(line + n - sizeof(big), "XYZ", 3) != 0)
+		panic("write after read went astray");
+	fclose(f);
+
+	bprintf(stdout, "testbufio ok\n");
+}
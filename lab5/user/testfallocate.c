@@ -0,0 +1,49 @@
+// Test fallocate: the file grows to the size asked for, reads as zeros
+// there, and writes into the allocated range stay where they went.
+
+#include <inc/lib.h>
+
+#define SIZE	(3 * PGSIZE + 10)
+
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	int fd, i, r;
+
+	if ((fd = open("/falloc", O_RDWR | O_CREAT)) < 0)
+		panic("open /falloc: %e", fd);
+	if ((r = fallocate(fd, 0, SIZE)) < 0)
+		panic("fallocate: %e", r);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size != SIZE)
+		panic("fstat after fallocate: %e, size %d", r, st.st_size);
+	// Inside the file: nothing to grow
+	if ((r = fallocate(fd, PGSIZE, 10)) < 0)
+		panic("fallocate inside: %e", r);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size != SIZE)
+		panic("fstat after fallocate inside: %e, size %d", r, st.st_size);
+	for (i = 0; i < SIZE; i += r)
+		if ((r = read(fd, buf, sizeof(buf))) <= 0)
+			panic("read at %d: %e", i, r);
+		else if (buf[0] != 0 || buf[r - 1] != 0)
+			panic("fallocated block at %d isn't zero", i);
+	cprintf("fallocate size and zeros are good\n");
+
+	seek(fd, PGSIZE);
+	if ((r = write(fd, "hello", 5)) != 5)
+		panic("write: %e", r);
+	close(fd);
+	if ((fd = open("/falloc", O_RDONLY)) < 0)
+		panic("open /falloc again: %e", fd);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size != SIZE)
+		panic("fstat after reopen: %e, size %d", r, st.st_size);
+	seek(fd, PGSIZE);
+	if ((r = readn(fd, buf, 5)) != 5 || memcmp(buf, "hello", 5) != 0)
+		panic("read back: %e", r);
+	close(fd);
+	if ((r = remove("/falloc")) < 0)
+		panic("remove /falloc: %e", r);
+	cprintf("fallocate write is good\n");
+}
@@ -0,0 +1,93 @@
+// Test lib/fiber.c: fiber_yield takes turns, and fiber_serve keeps a
+// request asleep in its fiber while it serves others.  The server is a
+// lock: a second acquire waits, in the server's fiber and its caller's
+// ipc_call, until the holder releases.
+
+#include <inc/lib.h>
+#include <inc/fiber.h>
+
+#define LOCK_ACQUIRE	1
+#define LOCK_RELEASE	2
+#define LOCK_STOP	3
+
+#define PGBASE		0x30000000
+
+static char turns[9];
+static int nturn;
+
+static void
+taker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		turns[nturn++] = *(char *) arg;
+		fiber_yield();
+	}
+}
+
+static bool lock_held;
+static int lock_releases;
+static struct FiberQ lock_waitq;
+
+static int32_t
+lock_serve(envid_t whom, uint32_t value, void *pg, int perm)
+{
+	switch (value) {
+	case LOCK_ACQUIRE:
+		while (lock_held)
+			fiber_sleep(&lock_waitq);
+		lock_held = 1;
+		return lock_releases;
+	case LOCK_RELEASE:
+		lock_held = 0;
+		lock_releases++;
+		fiber_wakeup(&lock_waitq);
+		return 0;
+	case LOCK_STOP:
+		cprintf("fiber server ok\n");
+		exit();
+	}
+	return -E_INVAL;
+}
+
+// A client that takes the lock after 'delay' ticks and holds it for
+// 'hold'; it panics unless it saw 'releases' releases before its turn.
+static void
+client(envid_t server, uint32_t delay, uint32_t hold, int releases)
+{
+	int r;
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r > 0)
+		return;
+	sys_sleep(delay);
+	if ((r = ipc_call(server, LOCK_ACQUIRE, 0, 0, 0, 0)) != releases)
+		panic("acquire after %d releases, not %d", r, releases);
+	sys_sleep(hold);
+	ipc_call(server, LOCK_RELEASE, 0, 0, 0, 0);
+	if (releases == 1)
+		ipc_call(server, LOCK_STOP, 0, 0, 0, 0);
+	exit();
+}
+
+void
+umain(void)
+{
+	int r;
+
+	if ((r = fiber_init(2)) < 0)
+		panic("fiber_init: %e", r);
+	fiber_start(0, taker, "a");
+	fiber_start(1, taker, "b");
+	fiber_run();
+	if (nturn != 8 || strcmp(turns, "abababab") != 0)
+		panic("fibers took turns %s", turns);
+	cprintf("fiber yield ok\n");
+
+	// The first takes the lock and holds it while the second asks
+	client(sys_getenvid(), 1, 20, 0);
+	client(sys_getenvid(), 5, 1, 1);
+	fiber_serve(lock_serve, PGBASE, 4);
+}
@@ -16,9 +16,13 @@ const char *msg = "This is the NEW message of the day!\n\n";
 void
 umain(void)
 {
-	int r;
+	int r, n;
 	int fileid;
+	uint32_t i;
 	struct Fd *fd;
+	struct Fsdirent *d;
+	static struct Fsret_readdir rd;
+	struct Stat st;
 
 	if ((r = fsipc_open("/not-found", O_RDONLY, FVA)) < 0 && r != -E_NOT_FOUND)
 		panic("serve_open /not-found: %e", r);
@@ -47,5 +51,29 @@ umain(void)
 	if ((r = fsipc_map(fileid, 0, UTEMP)) != -E_INVAL)
 		panic("serve_map does not handle stale fileids correctly");
 	cprintf("stale fileid is good\n");
+
+	// The root lists newmotd, with its size
+	if ((r = fsipc_open("/", O_RDONLY, FVA)) < 0)
+		panic("serve_open /: %e", r);
+	if ((n = fsipc_readdir(fd->fd_file.id, 0, &rd)) <= 0)
+		panic("serve_readdir /: %e", n);
+	for (i = 0, d = 0; n > 0; n--, i += FSDIRENT_SIZE(d->d_namelen)) {
+		d = (struct Fsdirent *) (rd.ret_buf + i);
+		if (strcmp(d->d_name, "newmotd") == 0)
+			break;
+	}
+	if (n == 0 || d->d_size != strlen(msg) || d->d_type != FTYPE_REG)
+		panic("serve_readdir did not list /newmotd");
+	fsipc_close(fd->fd_file.id);
+	sys_page_unmap(0, (void*) FVA);
+	cprintf("serve_readdir is good\n");
+
+	if ((r = fsipc_stat("/newmotd", &st)) < 0)
+		panic("serve_stat /newmotd: %e", r);
+	if (strcmp(st.st_name, "newmotd") != 0 || st.st_size != strlen(msg) || st.st_isdir)
+		panic("serve_stat /newmotd returned the wrong file");
+	if ((r = fsipc_stat("/not-found", &st)) != -E_NOT_FOUND)
+		panic("serve_stat /not-found: %e", r);
+	cprintf("serve_stat is good\n");
 }
 
@@ -0,0 +1,58 @@
+// Test inline files: /motd is small enough for fsformat to put it in its
+// struct File.  Reading it comes straight from the Fd page the open
+// returned, with no block mapped; mapping it moves the data out to a
+// block, and every open of it then reads the block.
+
+#include <inc/lib.h>
+
+static char want[FILE_INLINE_MAX + 1];
+
+static bool
+mapped(void *va)
+{
+	return (vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char buf[FILE_INLINE_MAX + 1];
+	struct Fd *fd, *fd2;
+	int f, f2, n, r;
+	void *blk;
+
+	if ((f = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd: %e", f);
+	if ((f2 = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd again: %e", f2);
+	if ((r = fd_lookup(f, &fd)) < 0 || (r = fd_lookup(f2, &fd2)) < 0)
+		panic("fd_lookup: %e", r);
+	if (!(fd->fd_file.file.f_flags & FILE_INLINE))
+		panic("/motd isn't inline");
+	n = fd->fd_file.file.f_size;
+	memmove(want, fd->fd_file.file.f_data, n);
+
+	if ((r = readn(f, buf, sizeof(buf))) != n)
+		panic("read /motd: %e, not %d", r, n);
+	if (memcmp(buf, want, n) != 0)
+		panic("read /motd: wrong data");
+	if (mapped(fd2data(fd)))
+		panic("read /motd mapped a page");
+	cprintf("inline read is good\n");
+
+	// Mapping it needs a block, which the other open sees too
+	if ((r = read_map(f, 0, &blk)) < 0)
+		panic("read_map /motd: %e", r);
+	if (memcmp(blk, want, n) != 0)
+		panic("read_map /motd: wrong data");
+	if ((fd->fd_file.file.f_flags & FILE_INLINE)
+	    || (fd2->fd_file.file.f_flags & FILE_INLINE))
+		panic("/motd is inline after mapping");
+	if ((r = readn(f2, buf, sizeof(buf))) != n || memcmp(buf, want, n) != 0)
+		panic("read /motd after mapping: %e", r);
+	if (!mapped(fd2data(fd2)))
+		panic("read /motd after mapping didn't map the block");
+	close(f);
+	close(f2);
+	cprintf("inline file moved to a block\n");
+}
@@ -0,0 +1,55 @@
+// Test ipc_send_range and ipc_recv_range: a 64KB buffer in one send,
+// and a send larger than the receiver's window.
+
+#include <inc/lib.h>
+
+#define NPAGES	16
+
+static uint8_t *srcva = (uint8_t *) 0x10000000;
+static uint8_t *dstva = (uint8_t *) 0x20000000;
+
+void
+umain(void)
+{
+	envid_t parent = sys_getenvid(), child;
+	size_t i, n;
+	int perm, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, srcva + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(srcva + i * PGSIZE, 'a' + i, PGSIZE);
+	}
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = ipc_recv_range(0, dstva, NPAGES, &n, &perm)) != 1)
+			panic("ipc_recv_range: %e", r);
+		if (n != NPAGES || !(perm & PTE_W))
+			panic("got %d pages, perm %x", n, perm);
+		for (i = 0; i < NPAGES; i++)
+			if (dstva[i * PGSIZE] != 'a' + i
+			    || dstva[i * PGSIZE + PGSIZE - 1] != 'a' + i)
+				panic("page %d has %c", i, dstva[i * PGSIZE]);
+		// The pages are shared: the parent sees this
+		dstva[0] = 'z';
+
+		// Only two of four fit; the window's third page is untouched
+		if ((r = ipc_recv_range(0, dstva, 2, &n, 0)) != 2)
+			panic("ipc_recv_range: %e", r);
+		if (n != 2 || dstva[0] != 'e' || dstva[PGSIZE] != 'f'
+		    || dstva[2 * PGSIZE] != 'c')
+			panic("got %d pages into a 2-page window", n);
+		ipc_send(parent, 0, 0, 0);
+		exit();
+	}
+
+	ipc_send_range(child, 1, srcva, NPAGES, PTE_P|PTE_U|PTE_W);
+	ipc_send_range(child, 2, srcva + 4 * PGSIZE, 4, PTE_P|PTE_U);
+	if ((r = ipc_recv(0, 0, 0)) < 0)
+		panic("ipc_recv: %e", r);
+	if (srcva[0] != 'z')
+		panic("child's write didn't show through");
+	cprintf("ipc range ok\n");
+}
@@ -0,0 +1,39 @@
+// Test short messages: ipc_call_short's words arrive in env_ipc_words,
+// the answer comes back with no page, and a plain send leaves the words
+// zero.
+
+#include <inc/lib.h>
+
+void
+umain(void)
+{
+	envid_t parent = sys_getenvid(), child, who;
+	int r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = ipc_call_short(parent, 1, 10, 20, 30)) != 60)
+			panic("ipc_call_short: got %e, not 60", r);
+		ipc_send_short(parent, 2, 0xdeadbeef, 0, 7);
+		ipc_send(parent, 3, 0, 0);
+		exit();
+	}
+
+	if ((r = ipc_recv(&who, 0, 0)) != 1 || who != child)
+		panic("ipc_recv: %e", r);
+	if (env->env_ipc_perm != 0)
+		panic("a page came with a short message");
+	ipc_send(child, env->env_ipc_words[0] + env->env_ipc_words[1]
+		 + env->env_ipc_words[2], 0, 0);
+	if ((r = ipc_recv(0, 0, 0)) != 2)
+		panic("ipc_recv: %e", r);
+	if (env->env_ipc_words[0] != 0xdeadbeef || env->env_ipc_words[1] != 0
+	    || env->env_ipc_words[2] != 7)
+		panic("short send: wrong words");
+	if ((r = ipc_recv(0, 0, 0)) != 3)
+		panic("ipc_recv: %e", r);
+	if (env->env_ipc_words[0] || env->env_ipc_words[1] || env->env_ipc_words[2])
+		panic("plain send left words behind");
+	cprintf("ipc short ok\n");
+}
@@ -0,0 +1,40 @@
+// Test the kernel info page at UKINFO and env_lookup: a forked child
+// must find its own Env without sys_getenvid, and the tick count must
+// move with sys_sleep.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+void
+umain(void)
+{
+	uint32_t start, ticks;
+	uint64_t tsc;
+	envid_t parent = sys_getenvid(), child;
+
+	if (env_lookup() != &envs[ENVX(parent)])
+		panic("env_lookup: %08x, not %08x", env_lookup()->env_id, parent);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (env->env_id != sys_getenvid())
+			panic("child's env is %08x, not %08x", env->env_id,
+			      sys_getenvid());
+		ipc_send(parent, 0, 0, 0);
+		exit();
+	}
+	ipc_recv(0, 0, 0);
+	cprintf("env_lookup ok\n");
+
+	if (kinfo.ki_hz == 0 || kinfo.ki_ncpu == 0 || kinfo.ki_tsc_hz == 0)
+		panic("kinfo: %u Hz, %u CPUs, TSC %u kHz", kinfo.ki_hz,
+		      kinfo.ki_ncpu, (uint32_t) (kinfo.ki_tsc_hz / 1000));
+	start = kinfo.ki_ticks;
+	tsc = read_tsc();
+	sys_sleep(10);
+	if ((ticks = kinfo.ki_ticks - start) < 10)
+		panic("slept 10 ticks, but ki_ticks moved %u", ticks);
+	cprintf("%u ticks at %u Hz took %u ms of TSC\n", ticks, kinfo.ki_hz,
+		(uint32_t) ((read_tsc() - tsc) * 1000 / kinfo.ki_tsc_hz));
+	cprintf("kinfo ok\n");
+}
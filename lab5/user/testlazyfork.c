@@ -0,0 +1,95 @@
+// Test fork's shared page tables: after fork, parent and child share
+// each 4MB region's page table read-only until one of them writes there,
+// then only that one gets its own.  A write -- by the env, or by the
+// kernel for it -- must not show through to the other, and a region
+// nobody writes must stay shared.
+
+#include <inc/lib.h>
+
+#define R1	((char *) 0x10000000)
+#define R2	((char *) (0x10000000 + PTSIZE))
+
+static bool
+pt_shared(void *va)
+{
+	return (vpd[PDX(va)] & (PTE_P | PTE_W)) == PTE_P;
+}
+
+// Fork, with the child running fn and telling us when it's done.
+static void
+fork_and_wait(void (*fn)(void))
+{
+	envid_t parent = sys_getenvid(), child;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		fn();
+		ipc_send(parent, 0, 0, 0);
+		exit();
+	}
+	ipc_recv(0, 0, 0);
+}
+
+static void
+grandchild(void)
+{
+	strcpy(R2, "grandchild");
+}
+
+static void
+child(void)
+{
+	struct SyscallReq *rq = (struct SyscallReq *) (R2 + PGSIZE);
+	int r;
+
+	if (!pt_shared(R1) || !pt_shared(R2))
+		panic("child: page tables not shared after fork");
+	if (strcmp(R1, "parent r1") != 0 || strcmp(R2, "parent r2") != 0)
+		panic("child: read %s, %s", R1, R2);
+	strcpy(R1, "child r1");
+	if (pt_shared(R1) || !pt_shared(R2))
+		panic("child: a write to r1 didn't copy just its table");
+
+	// The kernel writes the result back into the shared table's page;
+	// even sys_batch must not write through to our parent
+	if ((r = sys_batch(rq, 1)) != 1 || rq->sr_ret != sys_getenvid())
+		panic("child: sys_batch into a shared table: %e, %08x", r, rq->sr_ret);
+	if (pt_shared(R2))
+		panic("child: kernel write didn't copy r2's table");
+
+	// Three share the grandchild's table now; its writes stay its own
+	strcpy(R2, "child r2");
+	fork_and_wait(grandchild);
+	if (strcmp(R2, "child r2") != 0)
+		panic("child: grandchild's write showed through: %s", R2);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct SyscallReq *rq = (struct SyscallReq *) (R2 + PGSIZE);
+	int r;
+
+	if ((r = sys_page_alloc(0, R1, PTE_U | PTE_W | PTE_P)) < 0
+	    || (r = sys_page_alloc(0, R2, PTE_U | PTE_W | PTE_P)) < 0
+	    || (r = sys_page_alloc(0, R2 + PGSIZE, PTE_U | PTE_W | PTE_P)) < 0)
+		panic("sys_page_alloc: %e", r);
+	strcpy(R1, "parent r1");
+	strcpy(R2, "parent r2");
+	memset(rq, 0, sizeof(*rq));
+	rq->sr_num = SYS_getenvid;
+	rq->sr_ret = -1;
+
+	fork_and_wait(child);
+	if (strcmp(R1, "parent r1") != 0 || strcmp(R2, "parent r2") != 0
+	    || rq->sr_ret != -1)
+		panic("parent: child's writes showed through: %s, %s, %d",
+		      R1, R2, rq->sr_ret);
+	// We're the last with these tables now, and take them over
+	strcpy(R1, "parent again");
+	strcpy(R2, "parent again");
+	if (pt_shared(R1) || pt_shared(R2))
+		panic("parent: tables still read-only");
+	cprintf("lazy fork ok\n");
+}
@@ -0,0 +1,33 @@
+// Test user_mem_check's page table walk and its cache of the last range
+// passed: a buffer across a page table boundary must pass, and a word
+// that passed before must fail once it's unmapped.
+
+#include <inc/lib.h>
+
+#define PT_EDGE	((char *) 0x10000000)
+#define EDGE_WORD	((uint32_t *) PT_EDGE)
+
+void
+umain(void)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, PT_EDGE - PGSIZE, PTE_P | PTE_U | PTE_W)) < 0
+	    || (r = sys_page_alloc(0, PT_EDGE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	strcpy(PT_EDGE - 2, "across a page table\n");
+	sys_cputs(PT_EDGE - 2, strlen(PT_EDGE - 2));
+
+	// Checked twice, so the second may come from the cache
+	if ((r = sys_addr_wake(EDGE_WORD, 1)) < 0 || (r = sys_addr_wake(EDGE_WORD, 1)) < 0)
+		panic("wake on a mapped word: %e", r);
+	if ((r = sys_page_unmap(0, PT_EDGE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if ((r = sys_addr_wake(EDGE_WORD, 1)) != -E_INVAL)
+		panic("wake on an unmapped word: %e, not -E_INVAL", r);
+	if ((r = sys_addr_wake(EDGE_WORD - 1, 1)) < 0)
+		panic("wake on the page below: %e", r);
+	if ((r = sys_addr_wake((uint32_t *) ULIM, 1)) != -E_INVAL)
+		panic("wake at ULIM: %e, not -E_INVAL", r);
+	cprintf("user_mem_check ok\n");
+}
@@ -0,0 +1,87 @@
+// Test mutexes and condition variables between threads: a counter
+// bumped under a mutex comes out exact, and a bounded queue with two
+// condition variables hands every item over once.
+
+#include <inc/lib.h>
+
+#define NTHR	4
+#define NINC	2000
+#define NITEM	500
+#define QSIZE	4
+
+static struct Mutex mu = MUTEX_INIT;
+static uint32_t counter;
+
+static struct Mutex qmu = MUTEX_INIT;
+static struct Cond nonempty = COND_INIT, nonfull = COND_INIT;
+static int queue[QSIZE], qhead, qlen;
+
+static void
+incr(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NINC; i++) {
+		mutex_lock(&mu);
+		counter++;
+		// Give the others a chance to find it held
+		if (i % 64 == 0)
+			sys_yield();
+		mutex_unlock(&mu);
+	}
+}
+
+static void
+producer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NITEM; i++) {
+		mutex_lock(&qmu);
+		while (qlen == QSIZE)
+			cond_wait(&nonfull, &qmu);
+		queue[(qhead + qlen++) % QSIZE] = i;
+		cond_signal(&nonempty);
+		mutex_unlock(&qmu);
+	}
+}
+
+void
+umain(void)
+{
+	envid_t tid[NTHR];
+	int i, r, item;
+
+	for (i = 0; i < NTHR; i++)
+		if ((tid[i] = thread_create(incr, 0)) < 0)
+			panic("thread_create: %e", tid[i]);
+	for (i = 0; i < NTHR; i++)
+		if ((r = thread_join(tid[i])) < 0)
+			panic("thread_join: %e", r);
+	if (counter != NTHR * NINC)
+		panic("counter %u, not %u", counter, NTHR * NINC);
+	if (!mutex_trylock(&mu))
+		panic("mutex still held");
+	if (mutex_trylock(&mu))
+		panic("mutex taken twice");
+	mutex_unlock(&mu);
+	cprintf("mutex ok\n");
+
+	if ((tid[0] = thread_create(producer, 0)) < 0)
+		panic("thread_create: %e", tid[0]);
+	for (i = 0; i < NITEM; i++) {
+		mutex_lock(&qmu);
+		while (qlen == 0)
+			cond_wait(&nonempty, &qmu);
+		item = queue[qhead];
+		qhead = (qhead + 1) % QSIZE;
+		qlen--;
+		cond_signal(&nonfull);
+		mutex_unlock(&qmu);
+		if (item != i)
+			panic("got item %d, not %d", item, i);
+	}
+	if ((r = thread_join(tid[0])) < 0)
+		panic("thread_join: %e", r);
+	cprintf("cond ok\n");
+}
@@ -0,0 +1,115 @@
+#include <inc/lib.h>
+
+char *msg = "Now is the time for all good men to come to the aid of their party.";
+
+static char buf[8 * PGSIZE];
+
+void
+umain(void)
+{
+	char tmp[100];
+	int i, pid, p[2], r;
+	struct Stat st;
+	struct iovec iov[2];
+
+	binaryname = "pipereadeof";
+
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+
+	if ((pid = fork()) < 0)
+		panic("fork: %e", i);
+
+	if (pid == 0) {
+		cprintf("[%08x] pipereadeof close %d\n", env->env_id, p[1]);
+		close(p[1]);
+		cprintf("[%08x] pipereadeof readn %d\n", env->env_id, p[0]);
+		i = readn(p[0], buf, sizeof buf-1);
+		if (i < 0)
+			panic("read: %e", i);
+		buf[i] = 0;
+		if (strcmp(buf, msg) == 0)
+			cprintf("\npipe read closed properly\n");
+		else
+			cprintf("\ngot %d bytes: %s\n", i, buf);
+		exit();
+	} else {
+		cprintf("[%08x] pipereadeof close %d\n", env->env_id, p[0]);
+		close(p[0]);
+		cprintf("[%08x] pipereadeof write %d\n", env->env_id, p[1]);
+		if ((i = write(p[1], msg, strlen(msg))) != strlen(msg))
+			panic("write: %e", i);
+		close(p[1]);
+	}
+
+	binaryname = "pipebig";
+
+	// More than a page fits in the pipe without the writer blocking
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+	for (i = 0; i < 2 * PGSIZE; i++)
+		buf[i] = i;
+	if ((r = write(p[1], buf, 2 * PGSIZE)) != 2 * PGSIZE)
+		panic("write %d bytes: got %d", 2 * PGSIZE, r);
+	if ((r = fstat(p[0], &st)) < 0)
+		panic("fstat: %e", r);
+	if (st.st_size != 2 * PGSIZE || strcmp(st.st_name, "<pipe>") != 0)
+		panic("fstat: %s size %d", st.st_name, st.st_size);
+	memset(buf, 0, 2 * PGSIZE);
+	if ((r = readn(p[0], buf, 2 * PGSIZE)) != 2 * PGSIZE)
+		panic("readn: got %d", r);
+	for (i = 0; i < 2 * PGSIZE; i++)
+		if ((uint8_t) buf[i] != (uint8_t) i)
+			panic("byte %d is %02x", i, (uint8_t) buf[i]);
+	close(p[0]);
+	close(p[1]);
+	cprintf("\npipe holds %d bytes\n", 2 * PGSIZE);
+
+	binaryname = "pipevec";
+
+	// A header and body written together come out split differently
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+	iov[0].iov_base = "head:";
+	iov[0].iov_len = 5;
+	iov[1].iov_base = msg;
+	iov[1].iov_len = strlen(msg);
+	if ((r = writev(p[1], iov, 2)) != 5 + strlen(msg))
+		panic("writev: got %d", r);
+	iov[0].iov_base = tmp;
+	iov[0].iov_len = 10;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = sizeof(buf);
+	if ((r = readv(p[0], iov, 2)) != 5 + strlen(msg))
+		panic("readv: got %d", r);
+	if (memcmp(tmp, "head:", 5) != 0 || memcmp(tmp + 5, msg, 5) != 0
+	    || memcmp(buf, msg + 5, strlen(msg) - 5) != 0)
+		panic("readv got the wrong bytes");
+	close(p[0]);
+	close(p[1]);
+	cprintf("\npipe readv and writev are good\n");
+
+	binaryname = "pipewriteeof";
+
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+
+	if ((pid = fork()) < 0)
+		panic("fork: %e", i);
+
+	if (pid == 0) {
+		close(p[0]);
+		// Fill the pipe; the write that finds it full then finds
+		// the reader gone
+		for (i = 0; write(p[1], "x", 1) == 1; i++)
+			;
+		cprintf("\npipe write closed properly after %d bytes\n", i);
+		exit();
+	}
+	close(p[0]);
+	close(p[1]);
+	while (envs[ENVX(pid)].env_id == pid && envs[ENVX(pid)].env_status != ENV_FREE)
+		sys_yield();
+
+	cprintf("pipe tests passed\n");
+}
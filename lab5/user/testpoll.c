@@ -0,0 +1,81 @@
+// Test poll() and sys_event_wait: one wait over two pipes and IPC must
+// sleep until the first of them has something, time out when none do,
+// and see a closed writer as POLLHUP.
+
+#include <inc/lib.h>
+
+enum { PIPE_A, PIPE_B, IPC, NPOLL };
+
+static struct pollfd pfd[NPOLL];
+
+// Fork a child that, after 'ticks' ticks, writes 'c' to fd 'wfd', or
+// sends 'c' to the parent if wfd < 0; and then exits, closing its
+// copies of the pipes.
+static void
+child(int wfd, uint32_t ticks, char c)
+{
+	envid_t parent = sys_getenvid(), pid;
+
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+	if (pid == 0) {
+		sys_sleep(ticks);
+		if (wfd < 0)
+			ipc_send(parent, c, 0, 0);
+		else if (write(wfd, &c, 1) != 1)
+			panic("child write");
+		exit();
+	}
+}
+
+// Poll for up to 'timeout' ticks, insisting that only entry 'which' is
+// ready, with 'revents'.
+static void
+expect(int timeout, int which, int revents)
+{
+	int i, r;
+
+	if ((r = poll(pfd, NPOLL, timeout)) != (which >= 0))
+		panic("poll: %e, expecting %d ready", r, which >= 0);
+	for (i = 0; i < NPOLL; i++)
+		if (pfd[i].revents != (i == which ? revents : 0))
+			panic("poll entry %d: revents %x", i, pfd[i].revents);
+}
+
+void
+umain(void)
+{
+	int a[2], b[2], r;
+	char c;
+
+	if ((r = pipe(a)) < 0 || (r = pipe(b)) < 0)
+		panic("pipe: %e", r);
+	pfd[PIPE_A] = (struct pollfd) { a[0], POLLIN, 0 };
+	pfd[PIPE_B] = (struct pollfd) { b[0], POLLIN, 0 };
+	pfd[IPC] = (struct pollfd) { POLLFD_IPC, POLLIN, 0 };
+
+	expect(0, -1, 0);
+	expect(5, -1, 0);
+	cprintf("poll timeouts ok\n");
+
+	child(b[1], 10, 'b');
+	expect(-1, PIPE_B, POLLIN);
+	if (read(b[0], &c, 1) != 1 || c != 'b')
+		panic("read pipe b");
+	child(-1, 10, 'i');
+	expect(-1, IPC, POLLIN);
+	if ((r = ipc_recv(0, 0, 0)) != 'i')
+		panic("ipc_recv: %e", r);
+	cprintf("poll wakeups ok\n");
+
+	// The write end is ready to write; with no writer left, the read
+	// end hangs up
+	pfd[PIPE_A] = (struct pollfd) { a[1], POLLOUT, 0 };
+	expect(0, PIPE_A, POLLOUT);
+	close(a[0]);
+	pfd[PIPE_A] = (struct pollfd) { b[0], POLLIN, 0 };
+	pfd[PIPE_B].fd = -1;
+	close(b[1]);
+	expect(-1, PIPE_A, POLLHUP);
+	cprintf("poll hangups ok\n");
+}
@@ -0,0 +1,83 @@
+// Test restartable atomic sequences between threads on one CPU: a
+// counter bumped with ras_add by several threads at once comes out
+// exact, and items several threads put on a RasQueue all come off it
+// once.  The loops are long enough for the timer to preempt threads
+// inside a sequence many times.
+
+#include <inc/lib.h>
+
+#define NTHR	4
+#define NINC	200000
+#define NITEM	2000
+
+static volatile uint32_t counter;
+static struct RasQueue queue = RASQ_INIT;
+static uint8_t seen[NTHR * NITEM];
+
+// Run on CPU 0, with everyone else here
+static void
+pin(void)
+{
+	int r;
+
+	if ((r = sys_env_set_affinity(0, 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	sys_yield();
+}
+
+static void
+incr(void *arg)
+{
+	int i;
+
+	pin();
+	for (i = 0; i < NINC; i++)
+		ras_add(&counter, 1);
+}
+
+static void
+producer(void *arg)
+{
+	uintptr_t base = (uintptr_t) arg * NITEM;
+	int i;
+
+	pin();
+	for (i = 0; i < NITEM; i++)
+		while (rasq_put(&queue, (void *) (base + i + 1)) < 0)
+			sys_yield();
+}
+
+void
+umain(void)
+{
+	envid_t tid[NTHR];
+	uintptr_t item;
+	int i, n, r;
+
+	pin();
+	for (i = 0; i < NTHR; i++)
+		if ((tid[i] = thread_create(incr, 0)) < 0)
+			panic("thread_create: %e", tid[i]);
+	for (i = 0; i < NTHR; i++)
+		if ((r = thread_join(tid[i])) < 0)
+			panic("thread_join: %e", r);
+	if (counter != NTHR * NINC)
+		panic("counter %u, not %u", counter, NTHR * NINC);
+	cprintf("ras counter ok\n");
+
+	for (i = 0; i < NTHR; i++)
+		if ((tid[i] = thread_create(producer, (void *) i)) < 0)
+			panic("thread_create: %e", tid[i]);
+	for (n = 0; n < NTHR * NITEM; n++) {
+		while ((item = (uintptr_t) rasq_get(&queue)) == 0)
+			sys_yield();
+		if (item > NTHR * NITEM || seen[item - 1]++)
+			panic("got item %u twice or out of range", item);
+	}
+	for (i = 0; i < NTHR; i++)
+		if ((r = thread_join(tid[i])) < 0)
+			panic("thread_join: %e", r);
+	if (rasq_get(&queue) != NULL)
+		panic("queue not empty");
+	cprintf("ras queue ok\n");
+}
@@ -0,0 +1,33 @@
+// Test spawning programs linked against the shared library: two of them
+// running at once must share its text, and each work.
+
+#include <inc/lib.h>
+
+static envid_t
+spawn_child(int *nref)
+{
+	envid_t child, from;
+
+	if ((child = spawnl("/shlibchild", "shlibchild", (char *) 0)) < 0)
+		panic("spawn shlibchild: %e", child);
+	*nref = ipc_recv(&from, 0, 0);
+	if (from != child)
+		panic("message from %08x, not %08x", from, child);
+	return child;
+}
+
+void
+umain(void)
+{
+	envid_t a, b;
+	int nref_a, nref_b;
+
+	a = spawn_child(&nref_a);
+	b = spawn_child(&nref_b);
+	if (nref_b <= nref_a)
+		panic("library text mapped %d ways with two children, %d with one",
+		      nref_b, nref_a);
+	ipc_send(a, 0, 0, 0);
+	ipc_send(b, 0, 0, 0);
+	cprintf("shared library ok\n");
+}
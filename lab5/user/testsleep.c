@@ -0,0 +1,60 @@
+// Test sys_sleep, ipc_recv_timeout and ipc_poll: children that sleep
+// for different times must wake in order of their sleeps, not their
+// start, and a receive must time out only when nothing was sent in time.
+
+#include <inc/lib.h>
+
+#define NCHILD	3
+
+static const uint32_t naps[NCHILD] = { 70, 5, 40 };	// 70 > 64 needs a cascade
+static const int order[NCHILD] = { 1, 2, 0 };
+
+// Fork a child that sends 'value' to 'parent' after 'ticks' ticks.
+static void
+child_send(envid_t parent, uint32_t ticks, uint32_t value)
+{
+	envid_t child;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_sleep(ticks);
+		ipc_send(parent, value, 0, 0);
+		exit();
+	}
+}
+
+void
+umain(void)
+{
+	envid_t parent = sys_getenvid();
+	int i, r;
+
+	for (i = 0; i < NCHILD; i++)
+		child_send(parent, naps[i], i);
+	for (i = 0; i < NCHILD; i++)
+		if ((r = ipc_recv(0, 0, 0)) != order[i])
+			panic("woke child %d, not %d", r, order[i]);
+	cprintf("sleepers woke in order\n");
+
+	if ((r = ipc_recv_timeout(0, 0, 0, 3)) != -E_TIMEOUT)
+		panic("receive with nobody sending: %e, not -E_TIMEOUT", r);
+	child_send(parent, 2, 42);
+	if ((r = ipc_recv_timeout(0, 0, 0, 50)) != 42)
+		panic("receive with a sender: %e, not 42", r);
+	// The timer the message beat must not end a wait with none later
+	child_send(parent, 60, 7);
+	if ((r = ipc_recv(0, 0, 0)) != 7)
+		panic("receive with no timeout: %e, not 7", r);
+	cprintf("receive timeouts ok\n");
+
+	if ((r = ipc_poll(0, 0, 0)) != -E_TIMEOUT)
+		panic("poll with nobody sending: %e, not -E_TIMEOUT", r);
+	// The child blocks in our send queue until we take its message
+	child_send(parent, 0, 9);
+	while ((r = ipc_poll(0, 0, 0)) == -E_TIMEOUT)
+		sys_yield();
+	if (r != 9)
+		panic("poll with a sender: %e, not 9", r);
+	cprintf("poll ok\n");
+}
@@ -0,0 +1,27 @@
+// Test that a spawned child inherits our PTE_SHARE pages: echo, with its
+// standard output our pipe, must write into the pipe, and the pipe must
+// see end of file once echo exits.
+
+#include <inc/lib.h>
+
+void
+umain(void)
+{
+	char buf[32];
+	int p[2], r, n;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((r = dup(p[1], 1)) < 0)
+		panic("dup: %e", r);
+	close(p[1]);
+	if ((r = spawnl("/echo", "echo", "inherited", (char *) 0)) < 0)
+		panic("spawn echo: %e", r);
+	close(1);
+	if ((n = readn(p[0], buf, sizeof(buf) - 1)) < 0)
+		panic("read: %e", n);
+	buf[n] = 0;
+	if (strcmp(buf, "inherited\n") != 0)
+		panic("read '%s' from echo, not 'inherited'", buf);
+	cprintf("spawn fd inheritance ok\n");
+}
@@ -0,0 +1,87 @@
+// Test threads: they share memory with us and with each other, each
+// sees its own 'env', their stacks grow, and page faults go to the
+// handler on each thread's own exception stack.
+
+#include <inc/lib.h>
+
+#define NTHR	4
+#define NWORK	(16 * 1024)
+
+static uint32_t work[NWORK];
+static uint32_t sums[NTHR];
+static envid_t self[NTHR];
+
+static uint8_t *faultva = (uint8_t *) 0x30000000;
+
+static void
+handler(struct UTrapframe *utf)
+{
+	int r;
+	void *va = (void *) ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("allocating at %08x: %e", va, r);
+}
+
+// Use more stack than the thread starts with
+static uint32_t
+deep(int n)
+{
+	volatile uint32_t buf[256];
+
+	buf[0] = n;
+	buf[255] = n == 0 ? 0 : deep(n - 1);
+	return buf[0] + buf[255];
+}
+
+static void
+worker(void *arg)
+{
+	int i, id = (int) arg;
+	uint32_t sum = 0;
+
+	self[id] = env->env_id;
+	for (i = id; i < NWORK; i += NTHR)
+		sum += work[i];
+	sums[id] = sum;
+	if (deep(20) != 210)
+		panic("thread %d: deep recursion went wrong", id);
+	// Each thread faults on a page of its own
+	faultva[id * PGSIZE] = 'a' + id;
+}
+
+void
+umain(void)
+{
+	envid_t tid[NTHR];
+	uint32_t sum, want = 0;
+	int i, r;
+
+	set_pgfault_handler(handler);
+	for (i = 0; i < NWORK; i++) {
+		work[i] = i;
+		want += i;
+	}
+	for (i = 0; i < NTHR; i++)
+		if ((tid[i] = thread_create(worker, (void *) i)) < 0)
+			panic("thread_create: %e", tid[i]);
+	for (i = 0; i < NTHR; i++)
+		if ((r = thread_join(tid[i])) < 0)
+			panic("thread_join: %e", r);
+
+	sum = 0;
+	for (i = 0; i < NTHR; i++) {
+		if (self[i] != tid[i])
+			panic("thread %d saw env %08x, not %08x", i, self[i], tid[i]);
+		if (faultva[i * PGSIZE] != 'a' + i)
+			panic("thread %d's fault page not shared", i);
+		sum += sums[i];
+	}
+	if (sum != want)
+		panic("sum %u, not %u", sum, want);
+	if (env->env_id != sys_getenvid())
+		panic("main thread's env changed");
+	if ((r = thread_join(tid[0])) != -E_INVAL)
+		panic("joining twice: %e", r);
+	cprintf("threads ok\n");
+}
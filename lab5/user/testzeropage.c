@@ -0,0 +1,64 @@
+// Test demand-zero memory: untouched bss, and pages allocated with
+// PTE_COW, are all the kernel's one zero page, read-only, until a write
+// gives just that page a zeroed page of its own.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x10000000)
+
+static char bss[4 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static physaddr_t
+pa(void *va)
+{
+	return PTE_ADDR(vpt[VPN(va)]);
+}
+
+static void
+check_zero(const char *what, char *p)
+{
+	int i;
+
+	for (i = 0; i < PGSIZE; i++)
+		if (p[i] != 0)
+			panic("%s: byte %d is %d", what, i, p[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	physaddr_t zero;
+	int r;
+
+	// Untouched bss
+	check_zero("bss", bss);
+	check_zero("bss", bss + PGSIZE);
+	if ((vpt[VPN(bss)] & PTE_W) || pa(bss) != pa(bss + PGSIZE))
+		panic("untouched bss isn't the zero page");
+	zero = pa(bss);
+	bss[PGSIZE] = 1;
+	if (!(vpt[VPN(bss + PGSIZE)] & PTE_W) || pa(bss + PGSIZE) == zero
+	    || pa(bss) != zero || bss[0] != 0)
+		panic("bss write didn't get a page of its own");
+	check_zero("bss after a write", bss);
+	cprintf("bss ok\n");
+
+	// sys_page_alloc with PTE_COW
+	if ((r = sys_page_alloc(0, VA, PTE_U | PTE_P | PTE_COW)) < 0
+	    || (r = sys_page_alloc(0, VA + PGSIZE, PTE_U | PTE_P | PTE_W | PTE_COW)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (pa(VA) != zero || pa(VA + PGSIZE) != zero || (vpt[VPN(VA)] & PTE_W))
+		panic("demand-zero pages aren't the zero page");
+	check_zero("demand-zero page", VA);
+	if ((r = sys_page_map(0, VA, 0, VA + 2 * PGSIZE, PTE_U | PTE_P | PTE_W)) != -E_INVAL)
+		panic("mapping the zero page writable: %e, not -E_INVAL", r);
+	if ((r = sys_page_alloc(0, VA, PTE_U | PTE_P | PTE_COW | PTE_SHARE)) != -E_INVAL)
+		panic("shared demand-zero page: %e, not -E_INVAL", r);
+	strcpy(VA + PGSIZE, "written");
+	if (pa(VA + PGSIZE) == zero || pa(VA) != zero || strcmp(VA + PGSIZE, "written") != 0)
+		panic("write to a demand-zero page");
+	check_zero("zero page after a write", VA);
+	sys_page_unmap(0, VA);
+	sys_page_unmap(0, VA + PGSIZE);
+	cprintf("demand-zero pages ok\n");
+}